@@ -57,6 +57,12 @@ cmdInfo_t cmdInfo[] = {
 
     {PI_CMD_BSCX, "BSCX", 193, 8, 0}, // bscXfer
 
+    {PI_CMD_BSCSO, "BSCSO", 112, 0, 0},  // bscServiceOpen
+    {PI_CMD_BSCSC, "BSCSC", 101, 0, 0},  // bscServiceClose
+    {PI_CMD_BSCSW, "BSCSW", 197, 2, 0},  // bscServiceWrite
+    {PI_CMD_BSCSR, "BSCSR", 121, 13, 0}, // bscServiceRead
+    {PI_CMD_BSCSS, "BSCSS", 101, 14, 0}, // bscServiceStats
+
     {PI_CMD_BSPIC, "BSPIC", 112, 0, 1}, // bbSPIClose
     {PI_CMD_BSPIO, "BSPIO", 134, 0, 0}, // bbSPIOpen
     {PI_CMD_BSPIX, "BSPIX", 193, 6, 0}, // bbSPIXfer
@@ -116,6 +122,8 @@ cmdInfo_t cmdInfo[] = {
     {PI_CMD_I2CWW, "I2CWW", 131, 0, 1}, // i2cWriteWordData
 
     {PI_CMD_I2CZ, "I2CZ", 193, 6, 0}, // i2cZip
+    {PI_CMD_I2CZA, "I2CZA", 199, 2, 0}, // i2cZipAsync
+    {PI_CMD_I2CAR, "I2CAR", 121, 6, 0}, // i2cAsyncResult
 
     {PI_CMD_MICS, "MICS", 112, 0, 1}, // gpioDelay
     {PI_CMD_MILS, "MILS", 112, 0, 1}, // gpioDelay
@@ -145,9 +153,11 @@ cmdInfo_t cmdInfo[] = {
 
     {PI_CMD_PROC, "PROC", 115, 2, 0},   // gpioStoreScript
     {PI_CMD_PROCD, "PROCD", 112, 0, 0}, // gpioDeleteScript
+    {PI_CMD_PROCF, "PROCF", 121, 0, 0}, // gpioScriptProfile
     {PI_CMD_PROCP, "PROCP", 112, 7, 0}, // gpioScriptStatus
     {PI_CMD_PROCR, "PROCR", 191, 0, 0}, // gpioRunScript
     {PI_CMD_PROCS, "PROCS", 112, 0, 0}, // gpioStopScript
+    {PI_CMD_PROCT, "PROCT", 112, 9, 0}, // gpioScriptProfileGet
     {PI_CMD_PROCU, "PROCU", 191, 0, 0}, // gpioUpdateScript
 
     {PI_CMD_PRRG, "PRRG", 112, 2, 1}, // gpioGetPWMrealRange
@@ -158,11 +168,15 @@ cmdInfo_t cmdInfo[] = {
     {PI_CMD_PWM, "P", 121, 0, 1},   // gpioPWM
     {PI_CMD_PWM, "PWM", 121, 0, 1}, // gpioPWM
 
+    {PI_CMD_PWMB, "PWMB", 198, 0, 0}, // gpioPWMBatch
+
     {PI_CMD_READ, "R", 112, 2, 1},    // gpioRead
     {PI_CMD_READ, "READ", 112, 2, 1}, // gpioRead
 
     {PI_CMD_SERC, "SERC", 112, 0, 1},   // serClose
     {PI_CMD_SERDA, "SERDA", 112, 2, 1}, // serDataAvailable
+    {PI_CMD_SERRE, "SERRE", 121, 0, 1}, // serRxEvent
+    {PI_CMD_SEROV, "SEROV", 112, 2, 1}, // serRxOverruns
     {PI_CMD_SERO, "SERO", 132, 2, 0},   // serOpen
     {PI_CMD_SERR, "SERR", 121, 6, 0},   // serRead
     {PI_CMD_SERRB, "SERRB", 112, 2, 1}, // serReadByte
@@ -172,19 +186,27 @@ cmdInfo_t cmdInfo[] = {
     {PI_CMD_SERVO, "S", 121, 0, 1},     // gpioServo
     {PI_CMD_SERVO, "SERVO", 121, 0, 1}, // gpioServo
 
+    {PI_CMD_SERVB, "SERVB", 198, 0, 0}, // gpioServoBatch
+
     {PI_CMD_SHELL, "SHELL", 128, 2, 0}, // shell
 
     {PI_CMD_SLR, "SLR", 121, 6, 0},   // gpioSerialRead
     {PI_CMD_SLRC, "SLRC", 112, 0, 1}, // gpioSerialReadClose
     {PI_CMD_SLRO, "SLRO", 131, 0, 1}, // gpioSerialReadOpen
     {PI_CMD_SLRI, "SLRI", 121, 0, 1}, // gpioSerialReadInvert
+    {PI_CMD_SLRP, "SLRP", 121, 0, 1}, // gpioSerialReadParity
+    {PI_CMD_SLRST, "SLRST", 112, 12, 0}, // gpioSerialReadStats
 
     {PI_CMD_SPIC, "SPIC", 112, 0, 1}, // spiClose
     {PI_CMD_SPIO, "SPIO", 131, 2, 1}, // spiOpen
     {PI_CMD_SPIR, "SPIR", 121, 6, 0}, // spiRead
+    {PI_CMD_SPISEG, "SPISEG", 193, 6, 0}, // spiSegments
+    {PI_CMD_SPIST, "SPIST", 112, 11, 0}, // spiGetStats
     {PI_CMD_SPIW, "SPIW", 193, 0, 0}, // spiWrite
     {PI_CMD_SPIX, "SPIX", 193, 6, 0}, // spiXfer
 
+    {PI_CMD_SUBS, "SUBS", 101, 2, 1}, // gpioSubsystems
+
     {PI_CMD_TICK, "T", 101, 4, 1},    // gpioTick
     {PI_CMD_TICK, "TICK", 101, 4, 1}, // gpioTick
 
@@ -200,16 +222,23 @@ cmdInfo_t cmdInfo[] = {
     {PI_CMD_WVBSY, "WVBSY", 101, 2, 1}, // gpioWaveTxBusy
     {PI_CMD_WVCHA, "WVCHA", 197, 0, 0}, // gpioWaveChain
     {PI_CMD_WVCLR, "WVCLR", 101, 0, 1}, // gpioWaveClear
+    {PI_CMD_WVCMP, "WVCMP", 101, 2, 1}, // gpioWaveCompact
     {PI_CMD_WVCRE, "WVCRE", 101, 2, 1}, // gpioWaveCreate
+    {PI_CMD_WVCRA, "WVCRA", 101, 2, 1}, // gpioWaveCreateAsync
+    {PI_CMD_WVCRR, "WVCRR", 121, 2, 1}, // gpioWaveCreateResult
     {PI_CMD_WVCAP, "WVCAP", 112, 2, 1}, // gpioWaveCreatePad
     {PI_CMD_WVDEL, "WVDEL", 112, 0, 1}, // gpioWaveDelete
     {PI_CMD_WVGO, "WVGO", 101, 2, 0},   // gpioWaveTxStart
     {PI_CMD_WVGOR, "WVGOR", 101, 2, 0}, // gpioWaveTxStart
     {PI_CMD_WVHLT, "WVHLT", 101, 0, 1}, // gpioWaveTxStop
     {PI_CMD_WVNEW, "WVNEW", 101, 0, 1}, // gpioWaveAddNew
+    {PI_CMD_WVSAP, "WVSAP", 101, 2, 1}, // gpioWaveStreamAppend
     {PI_CMD_WVSC, "WVSC", 112, 2, 1},   // gpioWaveGet*Cbs
+    {PI_CMD_WVSCL, "WVSCL", 101, 0, 1}, // gpioWaveStreamClose
     {PI_CMD_WVSM, "WVSM", 112, 2, 1},   // gpioWaveGet*Micros
+    {PI_CMD_WVSOP, "WVSOP", 112, 0, 1}, // gpioWaveStreamOpen
     {PI_CMD_WVSP, "WVSP", 112, 2, 1},   // gpioWaveGet*Pulses
+    {PI_CMD_WVSST, "WVSST", 101, 10, 0}, // gpioWaveStreamStatus
     {PI_CMD_WVTAT, "WVTAT", 101, 2, 1}, // gpioWaveTxAt
     {PI_CMD_WVTX, "WVTX", 112, 2, 1},   // gpioWaveTxSend
     {PI_CMD_WVTXM, "WVTXM", 121, 2, 1}, // gpioWaveTxSend
@@ -247,6 +276,11 @@ BS1 bits         Set GPIO in bank 1\n\
 BS2 bits         Set GPIO in bank 2\n\
 \n\
 BSCX bctl bvs    BSC I2C/SPI transfer\n\
+BSCSO bctl       Open the buffered BSC slave service\n\
+BSCSC            Close the buffered BSC slave service\n\
+BSCSW bvs        Queue bytes for the master to read\n\
+BSCSR nt num     Read completed BSC transactions\n\
+BSCSS            Get BSC service counters\n\
 \n\
 CF1 ...          Custom function 1\n\
 CF2 ...          Custom function 2\n\
@@ -292,6 +326,8 @@ I2CWQ h b        SMBus Write Quick: write bit\n\
 I2CWS h b        SMBus Write Byte: write byte\n\
 I2CWW h r word   SMBus Write Word Data: write word to register\n\
 I2CZ  h ...      I2C multiple transactions\n\
+I2CZA h o e ...  Queue I2C multiple transactions\n\
+I2CAR tkt wait   Get queued I2C transactions result\n\
 \n\
 M/MODES g mode   Set GPIO mode\n\
 MG/MODEG g       Get GPIO mode\n\
@@ -313,22 +349,28 @@ PIGPV            Get pigpio library version\n\
 PRG g            Get GPIO PWM range\n\
 PROC text        Store script\n\
 PROCD sid        Delete script\n\
+PROCF sid v      Start (v=1) or stop (v=0) script profiling\n\
 PROCP sid        Get script status and parameters\n\
 PROCR sid ...    Run script\n\
 PROCS sid        Stop script\n\
+PROCT sid        Get script profile\n\
 PROCU sid ...    Set script parameters\n\
 PRRG g           Get GPIO PWM real range\n\
 PRS g v          Set GPIO PWM range\n\
 PUD g pud        Set GPIO pull up/down\n\
+PWMB g v ...     Set PWM value of several GPIO at once\n\
 \n\
 R/READ g         Read GPIO level\n\
 \n\
 S/SERVO g v      Set GPIO servo pulsewidth\n\
 SERC h           Close serial handle\n\
 SERDA h          Check for serial data ready to read\n\
+SERRE h event    Trigger event when serial data arrives\n\
+SEROV h          Get bytes lost to a full serial buffer\n\
 SERO text baud flags | Open serial device at baud with flags\n\
 SERR h n         Read bytes from serial handle\n\
 SERRB h          Read byte from serial handle\n\
+SERVB g v ...    Set servo pulsewidth of several GPIO at once\n\
 SERW h ...       Write bytes to serial handle\n\
 SERWB h byte     Write byte to serial handle\n\
 SHELL name str   Execute a shell command\n\
@@ -336,11 +378,16 @@ SLR g v          Read bit bang serial data from GPIO\n\
 SLRC g           Close GPIO for bit bang serial data\n\
 SLRO g baud bitlen | Open GPIO for bit bang serial data\n\
 SLRI g invert    Invert serial logic (1 invert, 0 normal)\n\
+SLRP g parity    Set serial parity (0 none, 1 odd, 2 even)\n\
+SLRST g          Get serial frame and error counts\n\
 SPIC h           SPI close handle\n\
 SPIO channel baud flags | SPI open channel at baud with flags\n\
 SPIR h v         SPI read bytes from handle\n\
+SPISEG n ...     SPI transfer n segments\n\
+SPIST path       Get SPI throughput statistics for path\n\
 SPIW h ...       SPI write bytes to handle\n\
 SPIX h ...       SPI transfer bytes to handle\n\
+SUBS             Get live library subsystems\n\
 \n\
 T/TICK           Get current tick\n\
 TRIG g micros l  Trigger level for micros on GPIO\n\
@@ -352,15 +399,22 @@ WVAS g baud bitlen stopbits offset ... | Wave add serial data\n\
 WVBSY            Check if wave busy\n\
 WVCHA            Transmit a chain of waves\n\
 WVCLR            Wave clear\n\
+WVCMP            Wave compact storage\n\
 WVCRE            Create wave from added pulses\n\
+WVCRA            Create wave from added pulses in the background\n\
+WVCRR tkt wait   Get the wave id of a background create\n\
 WVDEL wid        Delete waves w and higher\n\
 WVGO             Wave transmit (DEPRECATED)\n\
 WVGOR            Wave transmit repeatedly (DEPRECATED)\n\
 WVHLT            Wave stop\n\
 WVNEW            Start a new empty wave\n\
-WVSC 0,1,2       Wave get DMA control block stats\n\
+WVSAP            Append added pulses to the wave stream\n\
+WVSC 0,1,2,3     Wave get DMA control block stats\n\
+WVSCL            Close the wave stream\n\
 WVSM 0,1,2       Wave get micros stats\n\
+WVSOP segs       Open a wave stream\n\
 WVSP 0,1,2       Wave get pulses stats\n\
+WVSST            Get the wave stream status\n\
 WVTAT            Returns the current transmitting wave\n\
 WVTX wid         Transmit wave as one-shot\n\
 WVTXM wid wmde   Transmit wave using mode\n\
@@ -531,6 +585,24 @@ static errInfo_t errInfo[] = {
     {PI_CMD_INTERRUPTED, "command interrupted, Python"},
     {PI_NOT_ON_BCM2711, "not available on BCM2711"},
     {PI_ONLY_ON_BCM2711, "only available on BCM2711"},
+    {PI_BAD_SCRIPT_THREADS, "bad number of script threads, not 1-16"},
+    {PI_SCRIPT_NOT_PROFILED, "script profiling is not enabled"},
+    {PI_BAD_WAVE_PULSES, "bad wave pulse ceiling, not 16-12000"},
+    {PI_WAVE_TX_BUSY, "waveform transmission in progress"},
+    {PI_BAD_STREAM_SEGS, "bad stream segments, not 2-32"},
+    {PI_STREAM_NOT_OPEN, "no waveform stream open"},
+    {PI_STREAM_FULL, "all waveform stream segments queued"},
+    {PI_NO_WAVE_TICKET, "no free asynchronous wave create ticket"},
+    {PI_WAVE_PENDING, "asynchronous wave create still running"},
+    {PI_BAD_WAVE_TICKET, "bad asynchronous wave create ticket"},
+    {PI_DMA_START_FAILED, "deferred DMA start failed"},
+    {PI_BAD_SPI_SEG, "bad SPI transaction segment"},
+    {PI_NO_I2C_TICKET, "no free asynchronous I2C ticket"},
+    {PI_I2C_PENDING, "asynchronous I2C transactions still running"},
+    {PI_BAD_I2C_TICKET, "bad asynchronous I2C ticket"},
+    {PI_BAD_SER_PARITY, "bit bang serial parity not 0-2"},
+    {PI_BSC_SERVICE_OPEN, "BSC is in use by the slave service"},
+    {PI_BSC_NO_SERVICE, "BSC slave service not open"},
 
 };
 
@@ -636,7 +708,8 @@ cmdParse(char* buf, uintptr_t* p, unsigned ext_len, char* ext, cmdCtlParse_t* ct
     case 101: /* BR1  BR2  CGI  H  HELP  HWVER
                  DCRA  HALT  INRA  NO
                  PIGPV  POPA  PUSHA  RET  T  TICK  WVBSY  WVCLR
-                 WVCRE  WVGO  WVGOR  WVHLT  WVNEW
+                 WVCMP  WVCRE  WVGO  WVGOR  WVHLT  WVNEW
+                 WVSAP  WVSCL  WVSST  WVCRA  SUBS  BSCSC  BSCSS
 
                  No parameters, always valid.
               */
@@ -659,8 +732,8 @@ cmdParse(char* buf, uintptr_t* p, unsigned ext_len, char* ext, cmdCtlParse_t* ct
 
     case 112: /* BI2CC FC  GDC  GPW  I2CC  I2CRB
                  MG  MICS  MILS  MODEG  NC  NP  PADG PFG  PRG
-                 PROCD  PROCP  PROCS  PRRG  R  READ  SLRC  SPIC
-                 WVCAP WVDEL  WVSC  WVSM  WVSP  WVTX  WVTXR  BSPIC
+                 PROCD  PROCP  PROCS  PROCT  PRRG  R  READ  SEROV  SLRC  SLRST  SPIC  SPIST
+                 WVCAP WVDEL  WVSC  WVSM  WVSOP  WVSP  WVTX  WVTXR  BSPIC  BSCSO
 
                  One positive parameter.
               */
@@ -718,9 +791,9 @@ cmdParse(char* buf, uintptr_t* p, unsigned ext_len, char* ext, cmdCtlParse_t* ct
 
       break;
 
-    case 121: /* HC  FR  I2CRD  I2CRR  I2CRW  I2CWB I2CWQ  P
-                 PADS  PFS  PRS  PWM  S  SERVO  SLR  SLRI  W
-                 WDOG  WRITE  WVTXM
+    case 121: /* HC  FR  I2CAR  I2CRD  I2CRR  I2CRW  I2CWB I2CWQ  P
+                 PADS  PFS  PROCF  PRS  PWM  S  SERRE  SERVO  SLR  SLRI  SLRP  W
+                 WDOG  WRITE  WVCRR  WVTXM  BSCSR
 
                  Two positive parameters.
               */
@@ -986,7 +1059,7 @@ cmdParse(char* buf, uintptr_t* p, unsigned ext_len, char* ext, cmdCtlParse_t* ct
       break;
 
     case 193: /* BI2CZ  BSCX  BSPIX  FW  I2CWD  I2CZ  SERW
-     SPIW  SPIX
+     SPISEG  SPIW  SPIX
 
                  Two or more parameters, first >=0, rest 0-255.
 
@@ -1140,7 +1213,7 @@ cmdParse(char* buf, uintptr_t* p, unsigned ext_len, char* ext, cmdCtlParse_t* ct
 
       break;
 
-    case 197: /* WVCHA
+    case 197: /* WVCHA  BSCSW
 
                  One or more parameters, all 0-255.
               */
@@ -1166,6 +1239,71 @@ cmdParse(char* buf, uintptr_t* p, unsigned ext_len, char* ext, cmdCtlParse_t* ct
         valid = 1;
 
       break;
+
+    case 198: /* PWMB  SERVB
+
+                 One or more pairs (gpio, value), all >=0.
+              */
+      pars = 0;
+      p32 = (int32_t*)ext;
+
+      while(pars < CMD_MAX_PARAM) {
+        eaten = getNum(buf + ctl->eaten, &tp1, &to1);
+        if((to1 == CMD_NUMERIC) && ((int)tp1 >= 0)) {
+          pars++;
+          *p32++ = tp1;
+          ctl->eaten += eaten;
+        } else
+          break;
+      }
+
+      p[3] = pars * 4;
+
+      if(pars && ((pars % 2) == 0))
+        valid = 1;
+
+      break;
+
+    case 199: /* I2CZA
+
+                 handle outlen event char...
+
+                 p1 handle
+                 p2 outlen
+                 p3 len + 4
+                 ---------
+                 uint32_t event
+                 uint8_t[len]
+              */
+      ctl->eaten += getNum(buf + ctl->eaten, &p[1], &ctl->opt[1]);
+      ctl->eaten += getNum(buf + ctl->eaten, &p[2], &ctl->opt[2]);
+      ctl->eaten += getNum(buf + ctl->eaten, &tp1, &to1);
+
+      if((ctl->opt[1] == CMD_NUMERIC) && ((int)p[1] >= 0) && (ctl->opt[2] == CMD_NUMERIC) && ((int)p[2] >= 0) && (to1 == CMD_NUMERIC) && ((int)tp1 >= 0)) {
+        pars = 0;
+
+        memcpy(ext, &tp1, 4);
+        p8 = ext + 4;
+        while(pars < CMD_MAX_PARAM) {
+          eaten = getNum(buf + ctl->eaten, &tp1, &to1);
+          if(to1 == CMD_NUMERIC) {
+            if(((int)tp1 >= 0) && ((int)tp1 <= 255)) {
+              *p8++ = tp1;
+              pars++;
+              ctl->eaten += eaten;
+            } else
+              break; /* invalid number, end of command */
+          } else
+            break;
+        }
+
+        p[3] = pars + 4;
+
+        if(pars > 0)
+          valid = 1;
+      }
+
+      break;
   }
 
   if(valid)
@@ -1322,3 +1460,264 @@ cmdParseScript(char* script, cmdScript_t* s, int diags) {
   }
   return status;
 }
+
+int
+cmdScriptSteps(char* script, int* start, int* end, int maxSteps) {
+  int idx, len, pos, steps;
+  uintptr_t p[10];
+  cmdCtlParse_t ctl;
+  char v[CMD_MAX_EXTENSION];
+
+  /*
+     Find the source text of each step, parsing the script as
+     cmdParseScript does.  Step n is script[start[n]] up to
+     script[end[n]].  Returns the number of steps found.
+  */
+
+  ctl.eaten = 0;
+
+  len = strlen(script);
+
+  steps = 0;
+
+  while(ctl.eaten < len) {
+    pos = ctl.eaten;
+
+    idx = cmdParse(script, p, CMD_MAX_EXTENSION, v, &ctl);
+
+    if((idx >= 0) && cmdInfo[idx].cvis && (p[0] != PI_CMD_TAG)) {
+      if(steps < maxSteps) {
+        while(isspace(script[pos])) pos++;
+
+        start[steps] = pos;
+        end[steps] = ctl.eaten;
+      }
+
+      steps++;
+    }
+  }
+
+  return steps;
+}
+
+/*
+   A script image is the compiled form of a script with every pointer
+   replaced by an offset, so it can be written to a file and loaded
+   into any process.  Jumps are stored already resolved to steps.
+
+   header   uint32 magic, version, params, vars, instrs, strLen, check
+   body     int32 par[params], int32 var[vars]
+            instrs * { uint64 p[4], uint32 strOfs, int8 opt[4] }
+            char str[strLen]
+*/
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t params;
+  uint32_t vars;
+  uint32_t instrs;
+  uint32_t strLen;
+  uint32_t check;
+} cmdImageHdr_t;
+
+typedef struct {
+  uint64_t p[4];
+  uint32_t strOfs;
+  int8_t opt[4];
+} cmdImageInstr_t;
+
+static uint32_t
+cmdImageCheck(char* buf, int len) {
+  uint32_t h = 2166136261u; /* FNV-1a */
+  int i;
+
+  for(i = 0; i < len; i++) {
+    h ^= (uint8_t)buf[i];
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+int
+cmdScriptImageSize(cmdScript_t* s) {
+  return sizeof(cmdImageHdr_t) + (sizeof(int32_t) * (PI_MAX_SCRIPT_PARAMS + PI_MAX_SCRIPT_VARS)) + (sizeof(cmdImageInstr_t) * s->instrs) + s->str_area_pos;
+}
+
+int
+cmdScriptToImage(cmdScript_t* s, char* image, int size) {
+  cmdImageHdr_t hdr;
+  cmdImageInstr_t ii;
+  int i, j, pos;
+
+  if(size < cmdScriptImageSize(s))
+    return PI_BAD_PARAM;
+
+  pos = sizeof(hdr);
+
+  memcpy(image + pos, s->par, sizeof(int32_t) * (PI_MAX_SCRIPT_PARAMS + PI_MAX_SCRIPT_VARS));
+  pos += sizeof(int32_t) * (PI_MAX_SCRIPT_PARAMS + PI_MAX_SCRIPT_VARS);
+
+  for(i = 0; i < s->instrs; i++) {
+    memset(&ii, 0, sizeof(ii));
+
+    for(j = 0; j < 4; j++) ii.p[j] = s->instr[i].p[j];
+
+    if(s->instr[i].p[3])
+      ii.strOfs = (char*)s->instr[i].p[4] - s->str_area;
+
+    memcpy(ii.opt, s->instr[i].opt, sizeof(ii.opt));
+
+    memcpy(image + pos, &ii, sizeof(ii));
+    pos += sizeof(ii);
+  }
+
+  memcpy(image + pos, s->str_area, s->str_area_pos);
+  pos += s->str_area_pos;
+
+  hdr.magic = CMD_IMAGE_MAGIC;
+  hdr.version = CMD_IMAGE_VERSION;
+  hdr.params = PI_MAX_SCRIPT_PARAMS;
+  hdr.vars = PI_MAX_SCRIPT_VARS;
+  hdr.instrs = s->instrs;
+  hdr.strLen = s->str_area_pos;
+  hdr.check = cmdImageCheck(image + sizeof(hdr), pos - sizeof(hdr));
+
+  memcpy(image, &hdr, sizeof(hdr));
+
+  return pos;
+}
+
+static int
+cmdImageInstrBad(cmdImageInstr_t* ii, int instrs, char* str, int strLen) {
+  int i, j, ok, reg;
+
+  /* reject anything a parsed script could not contain */
+
+  ok = 0;
+
+  for(i = 0; i < (sizeof(cmdInfo) / sizeof(cmdInfo_t)); i++) {
+    if((cmdInfo[i].cmd == ii->p[0]) && cmdInfo[i].cvis) {
+      ok = 1;
+      break;
+    }
+  }
+
+  if(!ok || (ii->p[0] == PI_CMD_TAG))
+    return 1;
+
+  for(j = 0; j < 4; j++) {
+    if((ii->opt[j] < 0) || (ii->opt[j] > CMD_PAR))
+      return 1;
+  }
+
+  for(j = 1; j < 3; j++) {
+    if((ii->opt[j] == CMD_VAR) && (ii->p[j] >= PI_MAX_SCRIPT_VARS))
+      return 1;
+
+    if((ii->opt[j] == CMD_PAR) && (ii->p[j] >= PI_MAX_SCRIPT_PARAMS))
+      return 1;
+  }
+
+  if(ii->p[3]) {
+    /* strings are nul terminated within the string area */
+
+    if(((ii->strOfs + ii->p[3]) >= strLen) || str[ii->strOfs + ii->p[3]])
+      return 1;
+
+    if((ii->p[3] == sizeof(int)) && ((ii->opt[3] == CMD_VAR) || (ii->opt[3] == CMD_PAR))) {
+      /* register used as 3rd parameter, see scrExecute */
+
+      memcpy(&reg, str + ii->strOfs, sizeof(int));
+
+      if((reg < 0) || (reg >= ((ii->opt[3] == CMD_VAR) ? PI_MAX_SCRIPT_VARS : PI_MAX_SCRIPT_PARAMS)))
+        return 1;
+    }
+  }
+
+  if((ii->p[0] == PI_CMD_JMP) || (ii->p[0] == PI_CMD_CALL) || (ii->p[0] == PI_CMD_JZ) || (ii->p[0] == PI_CMD_JNZ) || (ii->p[0] == PI_CMD_JM) ||
+     (ii->p[0] == PI_CMD_JP)) {
+    /* a tag after the last instruction is step instrs, the script ends */
+
+    if(ii->p[1] > instrs)
+      return 1;
+  }
+
+  return 0;
+}
+
+int
+cmdScriptFromImage(char* image, int size, cmdScript_t* s) {
+  cmdImageHdr_t hdr;
+  cmdImageInstr_t ii;
+  int i, j, pos, b;
+
+  s->par = NULL;
+
+  if(size < sizeof(hdr))
+    return PI_BAD_SCRIPT;
+
+  memcpy(&hdr, image, sizeof(hdr));
+
+  if((hdr.magic != CMD_IMAGE_MAGIC) || (hdr.version != CMD_IMAGE_VERSION) || (hdr.params != PI_MAX_SCRIPT_PARAMS) || (hdr.vars != PI_MAX_SCRIPT_VARS))
+    return PI_BAD_SCRIPT;
+
+  if((hdr.instrs > CMD_MAX_EXTENSION) || (hdr.strLen > CMD_MAX_EXTENSION))
+    return PI_BAD_SCRIPT;
+
+  s->instrs = hdr.instrs;
+  s->str_area_pos = hdr.strLen;
+
+  if(size != cmdScriptImageSize(s))
+    return PI_BAD_SCRIPT;
+
+  if(hdr.check != cmdImageCheck(image + sizeof(hdr), size - sizeof(hdr)))
+    return PI_BAD_SCRIPT;
+
+  /* same layout as cmdParseScript, PARAMS, VARS, CMDS, STRINGS */
+
+  b = (sizeof(int) * (PI_MAX_SCRIPT_PARAMS + PI_MAX_SCRIPT_VARS)) + (sizeof(cmdInstr_t) * hdr.instrs) + hdr.strLen + 1;
+
+  s->par = calloc(1, b);
+
+  if(s->par == NULL)
+    return PI_NO_MEMORY;
+
+  s->var = s->par + PI_MAX_SCRIPT_PARAMS;
+
+  s->instr = (cmdInstr_t*)(s->var + PI_MAX_SCRIPT_VARS);
+
+  s->str_area = (char*)(s->instr + hdr.instrs);
+
+  s->str_area_len = hdr.strLen;
+
+  pos = sizeof(hdr);
+
+  memcpy(s->par, image + pos, sizeof(int32_t) * (PI_MAX_SCRIPT_PARAMS + PI_MAX_SCRIPT_VARS));
+  pos += sizeof(int32_t) * (PI_MAX_SCRIPT_PARAMS + PI_MAX_SCRIPT_VARS);
+
+  memcpy(s->str_area, image + pos + (sizeof(ii) * hdr.instrs), hdr.strLen);
+
+  for(i = 0; i < hdr.instrs; i++) {
+    memcpy(&ii, image + pos, sizeof(ii));
+    pos += sizeof(ii);
+
+    if(cmdImageInstrBad(&ii, hdr.instrs, s->str_area, hdr.strLen)) {
+      free(s->par);
+      s->par = NULL;
+      return PI_BAD_SCRIPT;
+    }
+
+    for(j = 0; j < 4; j++) s->instr[i].p[j] = ii.p[j];
+
+    if(ii.p[3])
+      s->instr[i].p[4] = (uintptr_t)(s->str_area + ii.strOfs);
+    else
+      s->instr[i].p[4] = 0;
+
+    memcpy(s->instr[i].opt, ii.opt, sizeof(ii.opt));
+  }
+
+  return 0;
+}
@@ -52,6 +52,11 @@ This version is for pigpio version 70+
 #define CMD_VAR 2
 #define CMD_PAR 3
 
+/* compiled script image */
+
+#define CMD_IMAGE_MAGIC 0x43534750 /* "PGSC" */
+#define CMD_IMAGE_VERSION 1
+
 typedef struct {
   uint32_t cmd;
   uint32_t p1;
@@ -110,6 +115,14 @@ int cmdParse(char* buf, uintptr_t* p, unsigned ext_len, char* ext, cmdCtlParse_t
 
 int cmdParseScript(char* script, cmdScript_t* s, int diags);
 
+int cmdScriptSteps(char* script, int* start, int* end, int maxSteps);
+
+int cmdScriptImageSize(cmdScript_t* s);
+
+int cmdScriptToImage(cmdScript_t* s, char* image, int size);
+
+int cmdScriptFromImage(char* image, int size, cmdScript_t* s);
+
 char* cmdErrStr(int error);
 
 char* cmdStr(void);
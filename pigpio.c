@@ -60,6 +60,7 @@ For more information, please refer to <http://unlicense.org/>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 #include <fnmatch.h>
 #include <glob.h>
 #include <arpa/inet.h>
@@ -251,6 +252,12 @@ bit 0 READ_LAST_NOT_SET_ERROR
     } \
   } while(0)
 
+#define CHECK_DMA \
+  do { \
+    if((dmaLive <= 0) && (initStartDMA() < 0)) \
+      return PI_DMA_START_FAILED; \
+  } while(0)
+
 #define SOFT_ERROR(x, format, arg...) \
   do { \
     DBG(DBG_ALWAYS, format, ##arg); \
@@ -277,6 +284,8 @@ bit 0 READ_LAST_NOT_SET_ERROR
     } \
   } while(0)
 
+#define TIMER_LE(a, b) (((a)->tv_sec < (b)->tv_sec) || (((a)->tv_sec == (b)->tv_sec) && ((a)->tv_nsec <= (b)->tv_nsec)))
+
 #define PI_PERI_BUS 0x7E000000
 
 #define AUX_BASE (pi_peri_phys + 0x00215000)
@@ -344,6 +353,7 @@ bit 0 READ_LAST_NOT_SET_ERROR
 
 #define DMA_CS 0
 #define DMA_CONBLK_AD 1
+#define DMA_NEXTCONBK 7
 #define DMA_DEBUG 8
 
 /* DMA CS Control and Status bits */
@@ -645,6 +655,11 @@ bit 0 READ_LAST_NOT_SET_ERROR
 #define PCM_TIMER (((PCM_BASE + PCM_FIFO * 4) & 0x00ffffff) | PI_PERI_BUS)
 #define PWM_TIMER (((PWM_BASE + PWM_FIFO * 4) & 0x00ffffff) | PI_PERI_BUS)
 
+#define SPI_FIFO_BUS (((SPI_BASE + SPI_FIFO * 4) & 0x00ffffff) | PI_PERI_BUS)
+
+#define DREQ_SPI_TX 6
+#define DREQ_SPI_RX 7
+
 #define DBG_MIN_LEVEL 0
 #define DBG_ALWAYS 0
 #define DBG_STARTUP 1
@@ -708,6 +723,18 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 #define WCB_CHAIN_CBS 60
 #define WCB_CHAIN_OOL 60
 
+#define CHAIN_OP_WAVE 0
+#define CHAIN_OP_DELAY 1
+#define CHAIN_OP_BEGIN 2
+#define CHAIN_OP_END 3
+#define CHAIN_OP_FOREVER 4
+
+/* a loop is unrolled if that adds no more than this many ops */
+#define CHAIN_UNROLL_OPS 8
+
+/* largest delay one full DMA channel cb can time */
+#define CHAIN_MAX_DELAY (0x3FFFFFFF / BPD)
+
 #define CBS_PER_CYCLE ((PULSE_PER_CYCLE * 3) + 2)
 
 #define NUM_CBS (CBS_PER_CYCLE * bufferCycles)
@@ -721,11 +748,33 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 
 #define DMAO_PAGES (PAGES_PER_BLOCK * PI_WAVE_BLOCKS)
 
+#define DMA_BLOCKS (bufferBlocks + PI_WAVE_BLOCKS + spiDmaBlocks)
+
+/*
+SPI DMA blocks follow the wave blocks.  Pages 0-15 hold the
+transmit data, 16-31 the received data and 32-63 the control
+blocks, one per 32 byte chunk in each direction.
+*/
+
+#define SPI_DMA_BLOCKS 2
+#define SPI_DMA_CHUNK 32
+#define SPI_DMA_MAX_BYTES 65535
+#define SPI_DMA_TX_PAGE 0
+#define SPI_DMA_RX_PAGE 16
+#define SPI_DMA_CB_PAGE 32
+#define SPI_DMA_CBS_PER_PAGE 128
+
 #define NUM_WAVE_OOL (DMAO_PAGES * OOL_PER_OPAGE)
 #define NUM_WAVE_CBS (DMAO_PAGES * CBS_PER_OPAGE)
 
+#define WAVE_FIRST_CB (PI_WAVE_COUNT_PAGES * CBS_PER_OPAGE)
+#define WAVE_FIRST_OOL (PI_WAVE_COUNT_PAGES * OOL_PER_OPAGE)
+
 #define TICKSLOTS 50
 
+/* most threads used to prepare the pagemap dma blocks */
+#define INIT_MAX_THREADS 4
+
 #define PI_I2C_CLOSED 0
 #define PI_I2C_RESERVED 1
 #define PI_I2C_OPENED 2
@@ -738,6 +787,10 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 #define PI_SER_RESERVED 1
 #define PI_SER_OPENED 2
 
+/* per handle receive ring filled by the serial service, a power of 2 */
+
+#define SER_RX_BUF_SIZE 4096
+
 #define PI_FILE_CLOSED 0
 #define PI_FILE_RESERVED 1
 #define PI_FILE_OPENED 2
@@ -762,6 +815,18 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 
 #define BPD 4
 
+/* internal pulse flag, gpioOn is written to function select
+   register WAVE_FSEL_REG(flags) instead of set and clear */
+
+#define WAVE_FLAG_FSEL 0x100
+#define WAVE_FSEL(reg) (WAVE_FLAG_FSEL | ((reg) << 12))
+#define WAVE_FSEL_REG(flags) (((flags) >> 12) & 7)
+
+/* bit bang bytes compiled into each dma wave */
+
+#define BB_DMA_CHUNK 32
+#define BB_DMA_PULSES (BB_DMA_CHUNK * 9 * 4)
+
 #define MAX_REPORT 250
 #define MAX_SAMPLE 4000
 
@@ -839,6 +904,30 @@ Assumes two counters per block.  Each counter 4 * 16 (16^4=65536)
 
 #define PI_SCRIPT_STACK_SIZE 256
 
+#define PI_SCRIPT_SLICE 1000       /* instructions per turn on a worker */
+#define PI_SCRIPT_SPIN_MICROS 1000 /* longer MICS delays become timers */
+
+#define PI_SCRIPT_IMAGE_MAX (1 << 22)
+
+#define WF_MAX_TRACKS 32
+#define WF_MIN_PULSES 256 /* first allocation of a staging buffer */
+
+#define WAVE_JOB_FREE 0
+#define WAVE_JOB_QUEUED 1
+#define WAVE_JOB_DONE 2
+#define WAVE_JOB_RUNNING 3
+
+#define I2C_JOB_FREE 0
+#define I2C_JOB_QUEUED 1
+#define I2C_JOB_RUNNING 2
+#define I2C_JOB_DONE 3
+
+#define SCR_SCHED_IDLE 0
+#define SCR_SCHED_READY 1
+#define SCR_SCHED_ACTIVE 2
+#define SCR_SCHED_WAITING 3
+#define SCR_SCHED_SLEEPING 4
+
 #define PI_SPI_FLAGS_CHANNEL(x) ((x & 7) << 29)
 
 #define PI_SPI_FLAGS_GET_CHANNEL(x) (((x) >> 29) & 7)
@@ -968,17 +1057,30 @@ typedef struct {
   pthread_t pthId;
 } gpioTimer_t;
 
+typedef struct {
+  uint32_t count;
+  uint64_t execNanos;
+  uint64_t blockNanos;
+} scrProf_t;
+
 typedef struct {
   unsigned id;
   unsigned state;
   unsigned request;
   unsigned run_state;
+  unsigned sched;  /* SCR_SCHED_x, protected by scrMutex */
+  unsigned resume; /* set A and F from changedBits when resumed */
+  unsigned restart; /* run requested during a turn, protected by scrMutex */
   uint32_t waitBits;
   uint32_t eventBits;
   uint32_t changedBits;
-  pthread_t* pthIdp;
-  pthread_mutex_t pthMutex;
-  pthread_cond_t pthCond;
+  struct timespec wake; /* CLOCK_MONOTONIC end of a MILS/MICS sleep */
+  int PC, A, F, SP;
+  int* S;    /* stack, allocated on first run */
+  char* buf; /* command extension, follows S */
+  scrProf_t* prof; /* one per instruction, NULL unless profiling */
+  int blockPC;     /* instruction the script blocked on, -1 if none */
+  struct timespec blockStart;
   cmdScript_t script;
 } gpioScript_t;
 
@@ -1010,12 +1112,37 @@ typedef struct {
   uint32_t addr;
   uint32_t flags;
   uint32_t funcs;
+  uint32_t bus;
 } i2cInfo_t;
 
+typedef struct {
+  int state; /* I2C_JOB_x */
+  int result; /* i2cZip result once run */
+  unsigned seq; /* jobs on a bus run in submission order */
+  unsigned handle;
+  unsigned bus;
+  unsigned event; /* triggered when done, unless PI_I2C_NO_EVENT */
+  char* inBuf; /* copy of the commands, outBuf follows */
+  unsigned inLen;
+  char* outBuf;
+  unsigned outLen;
+} i2cJob_t;
+
+typedef struct {
+  int running;
+  unsigned bus;
+  pthread_t pth;
+} i2cWorker_t;
+
 typedef struct {
   uint16_t state;
   int16_t fd;
   uint32_t flags;
+  int rxRing; /* fd is drained into the ring by the serial service */
+  unsigned rxEvent; /* triggered on arrival, unless PI_SER_NO_EVENT */
+  unsigned rxHead; /* free running, masked on use */
+  unsigned rxTail;
+  uint32_t rxOverruns; /* unread bytes overwritten by newer data */
 } serInfo_t;
 
 typedef struct {
@@ -1024,6 +1151,27 @@ typedef struct {
   uint32_t flags;
 } spiInfo_t;
 
+typedef struct {
+  uint32_t onSet[SUPERCYCLE];
+  uint32_t onClr[SUPERCYCLE];
+  uint32_t offSet[SUPERLEVEL + 1];
+  uint32_t offClr[SUPERLEVEL + 1];
+  uint32_t gpioClr;        /* PWM gpios to switch off afterwards   */
+  uint32_t stopping;       /* servo gpios whose off slots are      */
+  int stopOff[PI_MAX_USER_GPIO + 1]; /* cleared after the last pulse */
+} slotBatch_t;
+
+typedef struct {
+  uint32_t busPage; /* bus address / PAGE_SIZE, 0 if the slot is free */
+  int page;         /* index into dmaBus */
+} dmaPageMap_t;
+
+typedef struct {
+  int first; /* first block */
+  int last;  /* one past the last block */
+  int status;
+} initBlocks_t;
+
 typedef struct {
   uint32_t alertTicks;
   uint32_t lateTicks;
@@ -1051,6 +1199,10 @@ typedef struct {
   unsigned socketPort;
   unsigned ifFlags;
   unsigned memAllocMode;
+  unsigned scriptThreads;
+  unsigned waveMaxPulses;
+  unsigned spiDmaBytes;
+  unsigned bbDmaBytes;
   unsigned dbgLevel;
   unsigned alertFreq;
   uint32_t internals;
@@ -1070,8 +1222,43 @@ typedef struct {
   uint32_t cbs;
   uint32_t highCbs;
   uint32_t maxCbs;
+  uint32_t rawCbs; /* cbs before normalising */
 } wfStats_t;
 
+typedef struct {
+  int start;
+  int len;
+} waveSpan_t;
+
+typedef struct {
+  int op; /* CHAIN_OP_x */
+  int pos; /* offset in the chain, for diagnostics */
+  uint32_t arg; /* wave id, micros, loop count, or matching end */
+} chainOp_t;
+
+typedef struct {
+  int state; /* WAVE_JOB_x */
+  int result; /* wave id or error once compiled */
+  int share;
+  unsigned seq; /* jobs are compiled in submission order */
+  rawWave_t* pulses;
+  unsigned numPulses;
+} waveJob_t;
+
+typedef struct {
+  rawWave_t* pulses; /* merged pulses of a cached wave, else NULL */
+  uint32_t numPulses;
+  uint32_t hash;
+  uint32_t refs;
+} waveCache_t;
+
+typedef struct {
+  uint32_t tick;  /* start of the pulse within the wave */
+  uint16_t round; /* zero delay pulses at the same tick, 1 based */
+  uint8_t flags;  /* WAVE_FLAG_x of the merged pulse */
+  uint8_t gen;
+} wfSlot_t;
+
 typedef struct {
   char* buf;
   uint32_t bufSize;
@@ -1079,15 +1266,17 @@ typedef struct {
   int writePos;
   uint32_t fullBit;      /* nanoseconds */
   uint32_t halfBit;      /* nanoseconds */
-  int timeout;           /* millisconds */
   uint32_t startBitTick; /* microseconds */
   uint32_t nextBitDiff;  /* nanoseconds */
-  int bit;
+  int bit;               /* -1 idle, 0 start, then data, parity, stop */
   uint32_t data;
   int bytes; /* 1, 2, 4 */
-  int level;
+  int level; /* since the last edge, after any invert */
   int dataBits; /* 1-32 */
   int invert;   /* 0, 1 */
+  int parity;   /* PI_BB_SER_PARITY_x */
+  int parityBit;
+  gpioSerialStats_t stats;
 } wfRxSerial_t;
 
 typedef struct {
@@ -1097,6 +1286,7 @@ typedef struct {
   int SDAMode;
   int SCLMode;
   int started;
+  int stretched; /* clock stretching seen, no more dma */
 } wfRxI2C_t;
 
 typedef struct {
@@ -1125,6 +1315,31 @@ typedef struct {
   };
 } wfRx_t;
 
+typedef struct {
+  rawWave_t* waves;
+  int pulses;
+  int reads;
+  uint32_t fsel[6]; /* function select as the wave leaves it */
+} bbWave_t;
+
+typedef struct {
+  volatile int open;
+  int active; /* a transaction is in progress */
+  bscTrans_t cur;
+  unsigned txFifo; /* bytes believed in the transmit FIFO */
+  unsigned rxHead; /* free running, bytes stored */
+  unsigned rxCommit; /* end of the bytes of queued transactions */
+  unsigned rxTail;
+  unsigned txHead;
+  unsigned txTail;
+  unsigned transHead;
+  unsigned transTail;
+  bscServiceStats_t stats;
+  char rx[PI_BSC_SERVICE_RX];
+  char tx[PI_BSC_SERVICE_TX];
+  bscTrans_t trans[PI_BSC_SERVICE_TRANS];
+} bscService_t;
+
 union my_smbus_data {
   uint8_t byte;
   uint16_t word;
@@ -1174,6 +1389,10 @@ static volatile uint32_t hw_clk_max_freq = PI_HW_CLK_MAX_FREQ;
 
 static int libInitialised = 0;
 
+/* 1 once DMA memory, the sample clock and input DMA are running */
+
+static volatile int dmaLive = 0;
+
 /* initialise every gpioInitialise */
 
 static struct timespec libStarted;
@@ -1182,6 +1401,8 @@ static uint32_t sockNetAddr[MAX_CONNECT_ADDRESSES];
 
 static int numSockNetAddr = 0;
 
+static char scriptDir[PI_MAX_PATH] = ""; /* persisted script images */
+
 static uint32_t reportedLevel = 0;
 
 static int waveClockInited = 0;
@@ -1195,23 +1416,125 @@ static int gpioMaskSet = 0;
 
 static uint64_t gpioMask;
 
-static rawWave_t wf[3][PI_WAVE_MAX_PULSES];
+/*
+   The wave staging buffers are allocated when first needed and grow
+   (by doubling) up to the pulse ceiling.  They are kept for reuse
+   between waves and released by gpioWaveClear.
+*/
+
+static rawWave_t* wf[3] = {NULL, NULL, NULL};
+
+static unsigned wfSize[3] = {0, 0, 0}; /* pulses allocated */
 
 static int wfc[3] = {0, 0, 0};
 
 static int wfcur = 0;
 
-static wfStats_t wfStats = {0, 0, PI_WAVE_MAX_MICROS, 0, 0, PI_WAVE_MAX_PULSES, 0, 0, (DMAO_PAGES * CBS_PER_OPAGE)};
+/*
+   Added pulses are kept as separate tracks and merged with the
+   current wave in one pass when the wave is needed.  Every merged
+   pulse is a slot, identified by its tick and round, so the pulse
+   count is known without merging.
+*/
+
+static rawWave_t* wfTrack = NULL;
+
+static unsigned wfTrackSize = 0;
+
+static unsigned wfTrackPos[WF_MAX_TRACKS + 1];
+
+static int wfTracks = 0;
+
+static wfSlot_t* wfSlot = NULL;
+
+static unsigned wfSlots = 0; /* table entries, twice the pulses allowed */
+
+static uint8_t wfSlotGen = 1;
+
+static unsigned wfSlotPulses = 0;
+static unsigned wfSlotReads = 0;
+static unsigned wfSlotTicks = 0;
+static uint32_t wfSlotMicros = 0;
+
+static wfStats_t wfStats = {0, 0, PI_WAVE_MAX_MICROS, 0, 0, PI_WAVE_MAX_PULSES, 0, 0, (DMAO_PAGES * CBS_PER_OPAGE), 0};
 
 static rawWaveInfo_t waveInfo[PI_MAX_WAVES];
 
 static wfRx_t wfRx[PI_MAX_USER_GPIO + 1];
+static volatile uint32_t wfRxSerialBits = 0; /* GPIO decoded as serial */
+static uint32_t wfRxSerialLevel = 0; /* their levels at the last sample */
+
+/* held by the alert thread while it decodes a batch, and by anything
+   which changes a serial decoder or its buffer */
+
+static pthread_mutex_t wfRxSerialMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* a bit bang dma wave rewrites whole function select registers from
+   a snapshot, mode changes wait for it while bit bang dma is enabled */
 
-static int waveOutBotCB = PI_WAVE_COUNT_PAGES * CBS_PER_OPAGE;
-static int waveOutBotOOL = PI_WAVE_COUNT_PAGES * OOL_PER_OPAGE;
-static int waveOutTopOOL = NUM_WAVE_OOL;
+static pthread_mutex_t fselMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* free CB and OOL ranges, sorted by start, adjacent ranges coalesced */
+
+static waveSpan_t waveFreeCB[PI_MAX_WAVES + 1] = {{WAVE_FIRST_CB, NUM_WAVE_CBS - WAVE_FIRST_CB}};
+static waveSpan_t waveFreeOOL[PI_MAX_WAVES + 1] = {{WAVE_FIRST_OOL, NUM_WAVE_OOL - WAVE_FIRST_OOL}};
+static int waveFreeCBs = 1;
+static int waveFreeOOLs = 1;
 static int waveOutCount = 0;
 
+static waveCache_t waveCache[PI_MAX_WAVES];
+
+/* held while waves are allocated, compiled, moved or freed */
+
+static pthread_mutex_t waveMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* held while the secondary dma channel is stopped or started */
+
+static pthread_mutex_t dmaOutMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* held while the main or auxiliary SPI is in use */
+
+static pthread_mutex_t spiMainMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t spiAuxMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t waveJobMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t waveJobCond = PTHREAD_COND_INITIALIZER; /* job queued */
+static pthread_cond_t waveJobDone = PTHREAD_COND_INITIALIZER; /* job compiled */
+static waveJob_t waveJob[PI_WAVE_MAX_TICKETS];
+static unsigned waveJobSeq = 0;
+static pthread_t pthWaveCompiler;
+static int waveCompilerRunning = 0;
+
+static pthread_mutex_t serRxMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t pthSerRx;
+static int serRxRunning = 0;
+static int serRxEpoll = -1;
+
+static pthread_mutex_t bscSvcMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t i2cJobMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t i2cJobCond = PTHREAD_COND_INITIALIZER; /* job queued */
+static pthread_cond_t i2cJobDone = PTHREAD_COND_INITIALIZER; /* job run */
+static i2cJob_t i2cJob[PI_I2C_MAX_TICKETS];
+static unsigned i2cJobSeq = 0;
+static i2cWorker_t i2cWorker[PI_I2C_MAX_QUEUES];
+
+static int waveStreamSegs = 0; /* ring size, 0 if no stream is open */
+static int waveStreamWid[PI_WAVE_STREAM_MAX_SEGS];
+static int waveStreamHead = 0;
+static int waveStreamQueued = 0;
+static int waveStreamStarted = 0; /* sending since the last underrun */
+static int waveStreamRestart = -1; /* segment whose link the engine missed */
+
+static slotBatch_t slotBatchBuf;
+static slotBatch_t* slotBatch = NULL;
+
+/* held while the PWM and servo slots change, slotBatch is only set under it */
+
+static pthread_mutex_t slotMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t waveStreamSent = 0;
+static uint32_t waveStreamUnderruns = 0;
+
 static uint32_t* waveEndPtr = NULL;
 
 static volatile uint32_t alertBits = 0;
@@ -1245,10 +1568,30 @@ static gpioNotify_t gpioNotify[PI_NOTIFY_SLOTS];
 static fileInfo_t fileInfo[PI_FILE_SLOTS];
 static i2cInfo_t i2cInfo[PI_I2C_SLOTS];
 static serInfo_t serInfo[PI_SER_SLOTS];
+static char serRxBuf[PI_SER_SLOTS][SER_RX_BUF_SIZE];
 static spiInfo_t spiInfo[PI_SPI_SLOTS];
 
 static gpioScript_t gpioScript[PI_MAX_SCRIPTS];
 
+/* script worker pool, all lists hold script ids */
+
+static pthread_mutex_t scrMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrCond;     /* work for the workers */
+static pthread_cond_t scrIdleCond; /* a worker finished a turn */
+
+static int scrReady[PI_MAX_SCRIPTS];
+static int scrReadyHead = 0;
+static int scrReadyCount = 0;
+
+static int scrWaiting[PI_MAX_SCRIPTS];
+static int scrWaitingCount = 0;
+
+static int scrSleeping[PI_MAX_SCRIPTS];
+static int scrSleepingCount = 0;
+
+static pthread_t scrWorker[PI_MAX_SCRIPT_THREADS];
+static int scrWorkers = 0;
+
 static gpioSignal_t gpioSignal[PI_MAX_SIGNUM + 1];
 
 static gpioTimer_t gpioTimer[PI_MAX_TIMER + 1];
@@ -1279,6 +1622,17 @@ static dmaIPage_t** dmaIBus = MAP_FAILED;
 static dmaOPage_t** dmaOVirt = MAP_FAILED;
 static dmaOPage_t** dmaOBus = MAP_FAILED;
 
+static dmaPageMap_t* dmaPageMap = NULL;
+static int dmaPageMapBits = 0;
+
+static unsigned spiDmaBlocks = 0;
+static dmaPage_t** spiDmaVirt = NULL;
+static dmaPage_t** spiDmaBus = NULL;
+static volatile int spiDmaActive = 0;
+static volatile int bbDmaActive = 0;
+
+static spiStats_t spiStats[PI_SPI_PATH_AUX + 1];
+
 static volatile uint32_t* auxReg = MAP_FAILED;
 static volatile uint32_t* bscsReg = MAP_FAILED;
 static volatile uint32_t* clkReg = MAP_FAILED;
@@ -1307,6 +1661,10 @@ static volatile gpioCfg_t gpioCfg = {
     PI_DEFAULT_SOCKET_PORT,
     PI_DEFAULT_IF_FLAGS,
     PI_DEFAULT_MEM_ALLOC_MODE,
+    PI_DEFAULT_SCRIPT_THREADS,
+    PI_DEFAULT_WAVE_MAX_PULSES,
+    PI_DEFAULT_SPI_DMA_BYTES,
+    PI_DEFAULT_BB_DMA_BYTES,
     0, /* dbgLevel */
     0, /* alertFreq */
     0, /* internals */
@@ -1343,6 +1701,9 @@ static uint32_t old_spi_cntl0;
 static uint32_t old_spi_cntl1;
 
 static uint32_t bscFR;
+static int bscMode = 0; /* 0=None, 1=I2C, 2=SPI */
+
+static bscService_t bscSvc;
 
 /* const --------------------------------------------------------- */
 
@@ -1433,16 +1794,33 @@ static void intScriptBits(void);
 
 static void intScriptEventBits(void);
 
+static void scrWake(gpioScript_t* s);
+static void scrImageLoadAll(void);
+
 static int gpioNotifyOpenInBand(int fd);
 
+static int spiSegmentsBuf(unsigned numSegs, char* inBuf, unsigned inLen, char* outBuf, unsigned outLen);
+
+static int initStartDMA(void);
+
+int fileApprove(char* filename);
+
 static void initHWClk(int clkCtl, int clkDiv, int clkSrc, int divI, int divF, int MASH);
 
 static void initDMAgo(volatile uint32_t* dmaAddr, uint32_t cbAddr);
 
+static void initKillDMA(volatile uint32_t* dmaAddr);
+
+static unsigned dmaNowAtICB(void);
+
 int gpioWaveTxStart(unsigned wave_mode); /* deprecated */
 
 static void closeOrphanedNotifications(int slot, int fd);
 
+static void bscServiceTick(uint32_t tick);
+
+void bscTerm(int mode);
+
 /* ======================================================================= */
 
 int
@@ -1579,7 +1957,13 @@ myGpioSetMode(unsigned gpio, unsigned mode) {
   reg = gpio / 10;
   shift = (gpio % 10) * 3;
 
+  if(gpioCfg.bbDmaBytes)
+    pthread_mutex_lock(&fselMutex);
+
   gpioReg[reg] = (gpioReg[reg] & ~(7 << shift)) | (mode << shift);
+
+  if(gpioCfg.bbDmaBytes)
+    pthread_mutex_unlock(&fselMutex);
 }
 
 /* ----------------------------------------------------------------------- */
@@ -1675,16 +2059,28 @@ myTckPageSlot(int pos, int* page, int* slot) {
 
 /* ----------------------------------------------------------------------- */
 
-static uint32_t
-myGetLevel(int pos) {
-  uint32_t level;
-  int page, slot;
+static void
+myGetLevels(int pos, int count, uint32_t* level) {
+  int page, slot, run;
+
+  /* copy count levels from pos on, a page at a time */
 
   myLvsPageSlot(pos, &page, &slot);
 
-  level = dmaIVirt[page]->level[slot];
+  while(count > 0) {
+    run = LVS_PER_IPAGE - slot;
+
+    if(run > count)
+      run = count;
+
+    memcpy(level, &dmaIVirt[page]->level[slot], run * sizeof(uint32_t));
+
+    level += run;
+    count -= run;
 
-  return level;
+    page++;
+    slot = 0;
+  }
 }
 
 /* ----------------------------------------------------------------------- */
@@ -1990,6 +2386,8 @@ myDoCommand(uintptr_t* p, unsigned bufSize, char* buf) {
 
     case PI_CMD_HWVER: res = gpioHardwareRevision(); break;
 
+    case PI_CMD_SUBS: res = gpioSubsystems(); break;
+
     case PI_CMD_I2CC: res = i2cClose(p[1]); break;
 
     case PI_CMD_I2CO:
@@ -2043,6 +2441,16 @@ myDoCommand(uintptr_t* p, unsigned bufSize, char* buf) {
       res = i2cWriteWordData(p[1], p[2], p[4]);
       break;
 
+    case PI_CMD_I2CZA:
+      /* event is the first word of the extension */
+      if(p[3] < 4)
+        p[3] = 4;
+      memcpy(&tmp1, buf, 4);
+      res = i2cZipAsync(p[1], buf + 4, p[3] - 4, p[2], tmp1);
+      break;
+
+    case PI_CMD_I2CAR: res = i2cAsyncResult(p[1], buf, bufSize, p[2]); break;
+
     case PI_CMD_I2CZ:
       /* use half buffer for write, half buffer for read */
       if(p[3] > (bufSize / 2))
@@ -2109,12 +2517,20 @@ myDoCommand(uintptr_t* p, unsigned bufSize, char* buf) {
 
     case PI_CMD_PROCD: res = gpioDeleteScript(p[1]); break;
 
+    case PI_CMD_PROCF: res = gpioScriptProfile(p[1], p[2]); break;
+
     case PI_CMD_PROCP: res = gpioScriptStatus(p[1], (uint32_t*)buf); break;
 
     case PI_CMD_PROCR: res = gpioRunScript(p[1], p[3] / 4, (uint32_t*)buf); break;
 
     case PI_CMD_PROCS: res = gpioStopScript(p[1]); break;
 
+    case PI_CMD_PROCT:
+      res = gpioScriptProfileGet(p[1], (gpioScriptProf_t*)buf, bufSize / sizeof(gpioScriptProf_t));
+      if(res > 0)
+        res *= sizeof(gpioScriptProf_t);
+      break;
+
     case PI_CMD_PROCU: res = gpioUpdateScript(p[1], p[3] / 4, (uint32_t*)buf); break;
 
     case PI_CMD_PRRG: res = gpioGetPWMrealRange(p[1]); break;
@@ -2157,6 +2573,29 @@ myDoCommand(uintptr_t* p, unsigned bufSize, char* buf) {
       }
       break;
 
+    case PI_CMD_PWMB:
+    case PI_CMD_SERVB:
+      /* all the gpios must be permitted */
+
+      j = p[3] / sizeof(gpioPair_t);
+      res = 0;
+
+      for(i = 0; i < j; i++) {
+        if(!myPermit(((gpioPair_t*)buf)[i].gpio)) {
+          DBG(DBG_USER, "gpio%sBatch: gpio %d, no permission to update", (p[0] == PI_CMD_PWMB) ? "PWM" : "Servo", ((gpioPair_t*)buf)[i].gpio);
+          res = PI_NOT_PERMITTED;
+          break;
+        }
+      }
+
+      if(!res) {
+        if(p[0] == PI_CMD_PWMB)
+          res = gpioPWMBatch(j, (gpioPair_t*)buf);
+        else
+          res = gpioServoBatch(j, (gpioPair_t*)buf);
+      }
+      break;
+
     case PI_CMD_SERRB: res = serReadByte(p[1]); break;
 
     case PI_CMD_SERWB: res = serWriteByte(p[1], p[2]); break;
@@ -2167,6 +2606,10 @@ myDoCommand(uintptr_t* p, unsigned bufSize, char* buf) {
 
     case PI_CMD_SERO: res = serOpen(buf, p[1], p[2]); break;
 
+    case PI_CMD_SERRE: res = serRxEvent(p[1], p[2]); break;
+
+    case PI_CMD_SEROV: res = serRxOverruns(p[1]); break;
+
     case PI_CMD_SERR:
       if(p[2] > bufSize)
         p[2] = bufSize;
@@ -2192,6 +2635,43 @@ myDoCommand(uintptr_t* p, unsigned bufSize, char* buf) {
 
     case PI_CMD_SLRI: res = gpioSerialReadInvert(p[1], p[2]); break;
 
+    case PI_CMD_SLRP: res = gpioSerialReadParity(p[1], p[2]); break;
+
+    case PI_CMD_SLRST:
+      res = gpioSerialReadStats(p[1], (gpioSerialStats_t*)buf);
+      if(res >= 0)
+        res = sizeof(gpioSerialStats_t);
+      break;
+
+    case PI_CMD_BSCSO: res = bscServiceOpen(p[1]); break;
+
+    case PI_CMD_BSCSC: res = bscServiceClose(); break;
+
+    case PI_CMD_BSCSW: res = bscServiceWrite(buf, p[3]); break;
+
+    case PI_CMD_BSCSR:
+      /* count, the transactions, then their received bytes */
+      if(!p[1] || (p[1] > PI_BSC_SERVICE_TRANS))
+        p[1] = PI_BSC_SERVICE_TRANS;
+      tmp1 = 4 + (p[1] * sizeof(bscTrans_t));
+      if(!p[2] || (p[2] > (bufSize - tmp1)))
+        p[2] = bufSize - tmp1;
+      res = bscServiceRead((bscTrans_t*)(buf + 4), p[1], buf + tmp1, p[2]);
+      if(res >= 0) {
+        tmp2 = 0;
+        for(i = 0; i < res; i++) tmp2 += ((bscTrans_t*)(buf + 4))[i].rxCnt;
+        memmove(buf + 4 + (res * sizeof(bscTrans_t)), buf + tmp1, tmp2);
+        memcpy(buf, &res, 4);
+        res = 4 + (res * sizeof(bscTrans_t)) + tmp2;
+      }
+      break;
+
+    case PI_CMD_BSCSS:
+      res = bscServiceStats((bscServiceStats_t*)buf);
+      if(res >= 0)
+        res = sizeof(bscServiceStats_t);
+      break;
+
     case PI_CMD_SPIC: res = spiClose(p[1]); break;
 
     case PI_CMD_SPIO:
@@ -2294,8 +2774,42 @@ myDoCommand(uintptr_t* p, unsigned bufSize, char* buf) {
 
     case PI_CMD_WVCLR: res = gpioWaveClear(); break;
 
+    case PI_CMD_WVCMP: res = gpioWaveCompact(); break;
+
+    case PI_CMD_WVSAP: res = gpioWaveStreamAppend(); break;
+
+    case PI_CMD_WVSCL: res = gpioWaveStreamClose(); break;
+
+    case PI_CMD_WVSOP: res = gpioWaveStreamOpen(p[1]); break;
+
+    case PI_CMD_WVSST:
+      res = gpioWaveStreamStatus((gpioStreamStatus_t*)buf);
+      if(res >= 0)
+        res = sizeof(gpioStreamStatus_t);
+      break;
+
+    case PI_CMD_SPIST:
+      res = spiGetStats(p[1], (spiStats_t*)buf);
+      if(res >= 0)
+        res = sizeof(spiStats_t);
+      break;
+
+    case PI_CMD_SPISEG:
+      /* use half buffer for write, half buffer for read */
+      if(p[3] > (bufSize / 2))
+        p[3] = bufSize / 2;
+      res = spiSegmentsBuf(p[1], buf, p[3], buf + (bufSize / 2), bufSize / 2);
+      if(res > 0) {
+        memcpy(buf, buf + (bufSize / 2), res);
+      }
+      break;
+
     case PI_CMD_WVCRE: res = gpioWaveCreate(); break;
 
+    case PI_CMD_WVCRA: res = gpioWaveCreateAsync(); break;
+
+    case PI_CMD_WVCRR: res = gpioWaveCreateResult(p[1], p[2]); break;
+
     case PI_CMD_WVCAP:
       /* Make WVCAP variadic */
       if(p[3] == 4) {
@@ -2329,6 +2843,7 @@ myDoCommand(uintptr_t* p, unsigned bufSize, char* buf) {
         case 0: res = gpioWaveGetCbs(); break;
         case 1: res = gpioWaveGetHighCbs(); break;
         case 2: res = gpioWaveGetMaxCbs(); break;
+        case 3: res = gpioWaveGetRawCbs(); break;
         default: res = PI_BAD_WVSC_COMMND;
       }
       break;
@@ -2371,6 +2886,12 @@ static void
 mySetGpioOff(unsigned gpio, int pos) {
   int page, slot;
 
+  if(slotBatch) {
+    slotBatch->offSet[pos] |= (1 << gpio);
+    slotBatch->offClr[pos] &= ~(1 << gpio);
+    return;
+  }
+
   myOffPageSlot(pos, &page, &slot);
 
   dmaIVirt[page]->gpioOff[slot] |= (1 << gpio);
@@ -2382,6 +2903,12 @@ static void
 myClearGpioOff(unsigned gpio, int pos) {
   int page, slot;
 
+  if(slotBatch) {
+    slotBatch->offClr[pos] |= (1 << gpio);
+    slotBatch->offSet[pos] &= ~(1 << gpio);
+    return;
+  }
+
   myOffPageSlot(pos, &page, &slot);
 
   dmaIVirt[page]->gpioOff[slot] &= ~(1 << gpio);
@@ -2393,6 +2920,12 @@ static void
 mySetGpioOn(unsigned gpio, int pos) {
   int page, slot;
 
+  if(slotBatch) {
+    slotBatch->onSet[pos] |= (1 << gpio);
+    slotBatch->onClr[pos] &= ~(1 << gpio);
+    return;
+  }
+
   page = pos / ON_PER_IPAGE;
   slot = pos % ON_PER_IPAGE;
 
@@ -2405,6 +2938,12 @@ static void
 myClearGpioOn(unsigned gpio, int pos) {
   int page, slot;
 
+  if(slotBatch) {
+    slotBatch->onClr[pos] |= (1 << gpio);
+    slotBatch->onSet[pos] &= ~(1 << gpio);
+    return;
+  }
+
   page = pos / ON_PER_IPAGE;
   slot = pos % ON_PER_IPAGE;
 
@@ -2472,8 +3011,12 @@ myGpioSetPwm(unsigned gpio, int oldVal, int newVal) {
     }
 
     if(switchGpioOff) {
-      *(gpioReg + GPCLR0) = (1 << gpio);
-      *(gpioReg + GPCLR0) = (1 << gpio);
+      if(slotBatch)
+        slotBatch->gpioClr |= (1 << gpio);
+      else {
+        *(gpioReg + GPCLR0) = (1 << gpio);
+        *(gpioReg + GPCLR0) = (1 << gpio);
+      }
     }
   }
 }
@@ -2525,6 +3068,14 @@ myGpioSetServo(unsigned gpio, int oldVal, int newVal) {
 
       for(i = 0; i < SUPERCYCLE; i += cycles) myClearGpioOn(gpio, i);
 
+      if(slotBatch) {
+        /* myBatchApply waits once for all the servos it stops */
+
+        slotBatch->stopping |= (1 << gpio);
+        slotBatch->stopOff[gpio] = oldOff;
+        return;
+      }
+
       /* if in pulse then delay for the last cycle to complete */
 
       if(myGpioRead(gpio))
@@ -2537,6 +3088,82 @@ myGpioSetServo(unsigned gpio, int oldVal, int newVal) {
   }
 }
 
+/* ----------------------------------------------------------------------- */
+
+static void
+myBatchApply(void) {
+  slotBatch_t* b;
+  int cycle, n, pos, last, page, slot, gpio, realRange, i;
+  uint32_t* word;
+
+  b = slotBatch;
+  slotBatch = NULL;
+
+  /*
+  Sweep the supercycle once starting at the cycle after the one
+  being output.  The writes stay ahead of the DMA so every gpio
+  in the batch changes from the same cycle.  The recorded changes
+  are zeroed as they are applied.
+  */
+
+  cycle = ((dmaNowAtICB() / CBS_PER_CYCLE) + 1) % SUPERCYCLE;
+
+  for(n = 0; n < SUPERCYCLE; n++) {
+    if(b->onSet[cycle] | b->onClr[cycle]) {
+      page = cycle / ON_PER_IPAGE;
+      slot = cycle % ON_PER_IPAGE;
+
+      word = &dmaIVirt[page]->gpioOn[slot];
+      *word = (*word & ~b->onClr[cycle]) | b->onSet[cycle];
+
+      b->onSet[cycle] = 0;
+      b->onClr[cycle] = 0;
+    }
+
+    last = (cycle + 1) * PULSE_PER_CYCLE;
+
+    for(pos = (cycle * PULSE_PER_CYCLE) + 1; pos <= last; pos++) {
+      if(b->offSet[pos] | b->offClr[pos]) {
+        myOffPageSlot(pos, &page, &slot);
+
+        word = &dmaIVirt[page]->gpioOff[slot];
+        *word = (*word & ~b->offClr[pos]) | b->offSet[pos];
+
+        b->offSet[pos] = 0;
+        b->offClr[pos] = 0;
+      }
+    }
+
+    if(++cycle >= SUPERCYCLE)
+      cycle = 0;
+  }
+
+  if(b->gpioClr) {
+    *(gpioReg + GPCLR0) = b->gpioClr;
+    *(gpioReg + GPCLR0) = b->gpioClr;
+    b->gpioClr = 0;
+  }
+
+  if(b->stopping) {
+    /* if in pulse then delay for the last cycle to complete */
+
+    if(*(gpioReg + GPLEV0) & b->stopping)
+      myGpioDelay(PI_MAX_SERVO_PULSEWIDTH);
+
+    /* deschedule gpio off */
+
+    realRange = pwmRealRange[clkCfg[gpioCfg.clockMicros].servoIdx];
+
+    for(gpio = 0; gpio <= PI_MAX_USER_GPIO; gpio++) {
+      if(b->stopping & (1 << gpio)) {
+        for(i = 0; i < SUPERLEVEL; i += realRange) myClearGpioOff(gpio, i + b->stopOff[gpio]);
+      }
+    }
+
+    b->stopping = 0;
+  }
+}
+
 /* ======================================================================= */
 
 /*
@@ -2694,39 +3321,147 @@ mbDMAAlloc(DMAMem_t* DMAMemP, unsigned size, uint32_t pi_mem_flag) {
 
 /* ======================================================================= */
 
-rawCbs_t*
-rawWaveCBAdr(int cbNum) {
-  int page, slot;
+static unsigned
+dmaPageHash(uint32_t busPage) {
+  return (busPage * 0x9E3779B1) >> (32 - dmaPageMapBits);
+}
 
-  page = cbNum / CBS_PER_OPAGE;
-  slot = cbNum % CBS_PER_OPAGE;
+/* ----------------------------------------------------------------------- */
 
-  return &dmaOVirt[page]->cb[slot];
+static void
+dmaPageMapFree(void) {
+  free(dmaPageMap);
+
+  dmaPageMap = NULL;
+  dmaPageMapBits = 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static uint32_t
-waveCbPOadr(int pos) {
-  int page, slot;
+static int
+dmaPageMapInit(void) {
+  int i, pages;
+  unsigned h, mask;
+  uint32_t busPage;
 
-  page = pos / CBS_PER_OPAGE;
-  slot = pos % CBS_PER_OPAGE;
+  /*
+  Hash the page aligned bus address of every dma page so the
+  control block the engine is executing can be found without
+  scanning the pages.  The table is at most half full.
+  */
 
-  // cast twice to suppress compiler warning, I belive this cast is ok
-  // because dmaOBus contains bus addresses, not virtual addresses.
-  return (uint32_t)(uintptr_t)&dmaOBus[page]->cb[slot];
-}
+  dmaPageMapFree();
 
-/* ----------------------------------------------------------------------- */
+  pages = DMAI_PAGES + DMAO_PAGES;
 
-static void
-waveOOLPageSlot(int pos, int* page, int* slot) {
-  *page = pos / OOL_PER_OPAGE;
-  *slot = pos % OOL_PER_OPAGE;
-}
+  dmaPageMapBits = 4;
 
-/* ----------------------------------------------------------------------- */
+  while((1 << dmaPageMapBits) < (pages * 2)) dmaPageMapBits++;
+
+  dmaPageMap = calloc(1 << dmaPageMapBits, sizeof(dmaPageMap_t));
+
+  if(!dmaPageMap) {
+    dmaPageMapBits = 0;
+    SOFT_ERROR(PI_INIT_FAILED, "no memory for dma page map");
+  }
+
+  mask = (1 << dmaPageMapBits) - 1;
+
+  for(i = 0; i < pages; i++) {
+    // cast twice to suppress compiler warning, I belive this cast is ok
+    // because dmaIBus and dmaOBus contain bus addresses.
+    if(i < DMAI_PAGES)
+      busPage = (uint32_t)(uintptr_t)dmaIBus[i] / PAGE_SIZE;
+    else
+      busPage = (uint32_t)(uintptr_t)dmaOBus[i - DMAI_PAGES] / PAGE_SIZE;
+
+    h = dmaPageHash(busPage);
+
+    while(dmaPageMap[h].busPage) h = (h + 1) & mask;
+
+    dmaPageMap[h].busPage = busPage;
+    dmaPageMap[h].page = i;
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+dmaPageFind(uint32_t adr) {
+  unsigned h, mask;
+  uint32_t busPage;
+
+  /* returns the dmaBus index of the page holding bus address adr */
+
+  if(!dmaPageMap || !adr)
+    return -1;
+
+  busPage = adr / PAGE_SIZE;
+  mask = (1 << dmaPageMapBits) - 1;
+
+  for(h = dmaPageHash(busPage); dmaPageMap[h].busPage; h = (h + 1) & mask) {
+    if(dmaPageMap[h].busPage == busPage)
+      return dmaPageMap[h].page;
+  }
+
+  return -1;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+dmaOPageFind(uint32_t adr, uint32_t* offset) {
+  int page;
+
+  /* returns the output page holding bus address adr */
+
+  page = dmaPageFind(adr) - DMAI_PAGES;
+
+  if((page < 0) || (page >= DMAO_PAGES))
+    return -1;
+
+  *offset = adr - (uint32_t)(uintptr_t)dmaOBus[page];
+
+  return page;
+}
+
+/* ----------------------------------------------------------------------- */
+
+rawCbs_t*
+rawWaveCBAdr(int cbNum) {
+  int page, slot;
+
+  page = cbNum / CBS_PER_OPAGE;
+  slot = cbNum % CBS_PER_OPAGE;
+
+  return &dmaOVirt[page]->cb[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t
+waveCbPOadr(int pos) {
+  int page, slot;
+
+  page = pos / CBS_PER_OPAGE;
+  slot = pos % CBS_PER_OPAGE;
+
+  // cast twice to suppress compiler warning, I belive this cast is ok
+  // because dmaOBus contains bus addresses, not virtual addresses.
+  return (uint32_t)(uintptr_t)&dmaOBus[page]->cb[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+waveOOLPageSlot(int pos, int* page, int* slot) {
+  *page = pos / OOL_PER_OPAGE;
+  *slot = pos % OOL_PER_OPAGE;
+}
+
+/* ----------------------------------------------------------------------- */
 
 static void
 waveSetOOL(int pos, uint32_t OOL) {
@@ -2753,1860 +3488,1749 @@ waveOOLPOadr(int pos) {
 /* ----------------------------------------------------------------------- */
 
 static void
-waveBitDelay(unsigned baud, unsigned bits, unsigned stops, unsigned* bitDelay) {
-  unsigned fullBit, last, diff, t, i;
+waveSpanReset(void) {
+  waveFreeCB[0].start = WAVE_FIRST_CB;
+  waveFreeCB[0].len = NUM_WAVE_CBS - WAVE_FIRST_CB;
+  waveFreeCBs = 1;
 
-  /* scaled 1000X */
+  waveFreeOOL[0].start = WAVE_FIRST_OOL;
+  waveFreeOOL[0].len = NUM_WAVE_OOL - WAVE_FIRST_OOL;
+  waveFreeOOLs = 1;
+}
 
-  fullBit = 1000000000 / baud;
-  last = 0;
+/* ----------------------------------------------------------------------- */
 
-  for(i = 0; i <= bits; i++) {
-    t = (((i + 1) * fullBit) + 500) / 1000;
-    diff = t - last;
-    last = t;
-    bitDelay[i] = diff;
+static int
+waveSpanAlloc(waveSpan_t* span, int* spans, int len) {
+  int i, best, start;
+
+  /* best fit, ties go to the lowest address */
+
+  best = -1;
+
+  for(i = 0; i < *spans; i++) {
+    if((span[i].len >= len) && ((best < 0) || (span[i].len < span[best].len))) {
+      best = i;
+
+      if(span[i].len == len)
+        break;
+    }
   }
 
-  t = (((bits + 1) * fullBit) + ((stops * fullBit) / 2) + 500) / 1000;
-  diff = t - last;
-  bitDelay[i] = diff;
-}
+  if(best < 0)
+    return -1;
 
-static int
-waveDelayCBs(uint32_t delay) {
-  uint32_t cbs;
+  start = span[best].start;
 
-  if(!delay)
-    return 0;
-  if(gpioCfg.DMAsecondaryChannel < DMA_LITE_FIRST)
-    return 1;
-  cbs = BPD * delay / DMA_LITE_MAX;
-  if((BPD * delay) % DMA_LITE_MAX)
-    cbs++;
-  return cbs;
+  span[best].start += len;
+  span[best].len -= len;
+
+  if(!span[best].len) {
+    memmove(span + best, span + best + 1, (*spans - best - 1) * sizeof(waveSpan_t));
+    (*spans)--;
+  }
+
+  return start;
 }
 
 /* ----------------------------------------------------------------------- */
 
 static void
-waveCBsOOLs(int* numCBs, int* numBOOLs, int* numTOOLs) {
-  int numCB = 0, numBOOL = 0, numTOOL = 0;
-
-  unsigned i;
-
-  unsigned numWaves;
+waveSpanFree(waveSpan_t* span, int* spans, int start, int len) {
+  int i;
 
-  rawWave_t* waves;
+  if(len <= 0)
+    return;
 
-  numWaves = wfc[wfcur];
-  waves = wf[wfcur];
+  for(i = 0; (i < *spans) && (span[i].start < start); i++)
+    ;
 
-  /* delay cb at start of DMA */
+  /* coalesce with the range below and, if it now touches, the one above */
 
-  numCB++;
+  if(i && ((span[i - 1].start + span[i - 1].len) == start)) {
+    span[i - 1].len += len;
 
-  for(i = 0; i < numWaves; i++) {
-    if(waves[i].gpioOn) {
-      numBOOL++;
-    }
-    if(waves[i].gpioOff) {
-      numBOOL++;
-    }
-    if(waves[i].gpioOn || waves[i].gpioOff) {
-      numCB++;
-    }
-    if(waves[i].flags & WAVE_FLAG_READ) {
-      numCB++;
-      numTOOL++;
-    }
-    if(waves[i].flags & WAVE_FLAG_TICK) {
-      numCB++;
-      numTOOL++;
+    if((i < *spans) && ((start + len) == span[i].start)) {
+      span[i - 1].len += span[i].len;
+      memmove(span + i, span + i + 1, (*spans - i - 1) * sizeof(waveSpan_t));
+      (*spans)--;
     }
+    return;
+  }
 
-    numCB += waveDelayCBs(waves[i].usDelay);
+  if((i < *spans) && ((start + len) == span[i].start)) {
+    span[i].start = start;
+    span[i].len += len;
+    return;
   }
 
-  *numCBs = numCB;
-  *numBOOLs = numBOOL;
-  *numTOOLs = numTOOL;
+  memmove(span + i + 1, span + i, (*spans - i) * sizeof(waveSpan_t));
+  span[i].start = start;
+  span[i].len = len;
+  (*spans)++;
 }
 
 /* ----------------------------------------------------------------------- */
 
 static int
-wave2Cbs(unsigned wave_mode, int* CB, int* BOOL, int* TOOL, int numCB, int numBOOL, int numTOOL) {
-  int botCB = *CB, botOOL = *BOOL, topOOL = *TOOL;
-
-  int status, s_stride;
+waveAllocate(int numCB, int numBOOL, int numTOOL) {
+  int wid, CB, OOL;
 
-  rawCbs_t* p = NULL;
+  /* lowest free wave id */
 
-  unsigned i, repeatCB;
+  for(wid = 0; wid < waveOutCount; wid++)
+    if(waveInfo[wid].deleted)
+      break;
 
-  unsigned numWaves;
+  if(wid >= PI_MAX_WAVES)
+    return PI_NO_WAVEFORM_ID;
 
-  unsigned delayCBs, dcb;
+  CB = waveSpanAlloc(waveFreeCB, &waveFreeCBs, numCB);
 
-  uint32_t delayLeft;
+  if(CB < 0)
+    return PI_TOO_MANY_CBS;
 
-  rawWave_t* waves;
+  /* BOOLs grow up from botOOL, TOOLs down from topOOL, one range */
 
-  numWaves = wfc[wfcur];
-  waves = wf[wfcur];
+  if(numBOOL + numTOOL) {
+    OOL = waveSpanAlloc(waveFreeOOL, &waveFreeOOLs, numBOOL + numTOOL);
 
-  /* add delay cb at start of DMA */
+    if(OOL < 0) {
+      waveSpanFree(waveFreeCB, &waveFreeCBs, CB, numCB);
+      return PI_TOO_MANY_OOL;
+    }
+  } else
+    OOL = WAVE_FIRST_OOL;
 
-  p = rawWaveCBAdr(botCB++);
+  if(wid == waveOutCount)
+    waveOutCount++;
 
-  /* use the secondary clock */
+  waveInfo[wid].botCB = CB;
+  waveInfo[wid].topCB = CB + numCB - 1;
+  waveInfo[wid].botOOL = OOL;
+  waveInfo[wid].topOOL = OOL + numBOOL + numTOOL;
+  waveInfo[wid].numCB = numCB;
+  waveInfo[wid].numBOOL = numBOOL;
+  waveInfo[wid].numTOOL = numTOOL;
 
-  if(gpioCfg.clockPeriph != PI_CLOCK_PCM) {
-    p->info = NORMAL_DMA | TIMED_DMA(2);
-    p->dst = PCM_TIMER;
-  } else {
-    p->info = NORMAL_DMA | TIMED_DMA(5);
-    p->dst = PWM_TIMER;
-  }
+  return wid;
+}
 
-  // cast twice to suppress compiler warning, I belive this cast is ok
-  // because dmaOBus contains bus addresses, not virtual addresses.
-  p->src = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
-  p->length = BPD * 20 / PI_WF_MICROS; /* 20 micros delay */
-  p->next = waveCbPOadr(botCB);
+/* ----------------------------------------------------------------------- */
 
-  repeatCB = botCB;
+static uint32_t
+waveCacheHash(rawWave_t* waves, unsigned numWaves) {
+  uint32_t h = 2166136261u; /* FNV-1a */
+  uint32_t v[4];
+  unsigned i, j, k;
 
   for(i = 0; i < numWaves; i++) {
-    if(waves[i].gpioOn && waves[i].gpioOff)
-    /* Use 2-beat burst */
-    {
-      p = rawWaveCBAdr(botCB++);
-
-      p->info = TWO_BEAT_DMA;
-      p->src = waveOOLPOadr(botOOL);
-      waveSetOOL(botOOL++, waves[i].gpioOn);
-      s_stride = waveOOLPOadr(botOOL) - p->src;
-      waveSetOOL(botOOL++, waves[i].gpioOff);
-      p->dst = ((GPIO_BASE + (GPSET0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
-      p->length = (2 << 16) + 4;         // 2 transfers of 4 bytes each
-      p->stride = (12 << 16) + s_stride; // d_stride = (GPCLR0-GPSET0)*4 = 12
-      p->next = waveCbPOadr(botCB);
+    v[0] = waves[i].gpioOn;
+    v[1] = waves[i].gpioOff;
+    v[2] = waves[i].usDelay;
+    v[3] = waves[i].flags;
+
+    for(j = 0; j < 4; j++) {
+      for(k = 0; k < 32; k += 8) {
+        h ^= (v[j] >> k) & 0xFF;
+        h *= 16777619u;
+      }
     }
-    if(waves[i].gpioOn && !waves[i].gpioOff) {
-      waveSetOOL(botOOL, waves[i].gpioOn);
+  }
 
-      p = rawWaveCBAdr(botCB++);
+  return h;
+}
 
-      p->info = NORMAL_DMA;
-      p->src = waveOOLPOadr(botOOL++);
-      p->dst = ((GPIO_BASE + (GPSET0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
-      p->length = 4;
-      p->next = waveCbPOadr(botCB);
-    }
-    if(waves[i].gpioOff && !waves[i].gpioOn) {
-      waveSetOOL(botOOL, waves[i].gpioOff);
+/* ----------------------------------------------------------------------- */
 
-      p = rawWaveCBAdr(botCB++);
+static int
+waveCacheFind(uint32_t hash, rawWave_t* waves, unsigned numWaves) {
+  int wid;
 
-      p->info = NORMAL_DMA;
-      p->src = waveOOLPOadr(botOOL++);
-      p->dst = ((GPIO_BASE + (GPCLR0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
-      p->length = 4;
-      p->next = waveCbPOadr(botCB);
-    }
-    if(waves[i].flags & WAVE_FLAG_READ) {
-      p = rawWaveCBAdr(botCB++);
+  /* the hash only narrows the search, the pulses must match exactly */
 
-      p->info = NORMAL_DMA;
-      p->src = ((GPIO_BASE + (GPLEV0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
-      p->dst = waveOOLPOadr(--topOOL);
-      p->length = 4;
-      p->next = waveCbPOadr(botCB);
-    }
+  for(wid = 0; wid < waveOutCount; wid++) {
+    if(!waveInfo[wid].deleted && waveCache[wid].pulses && (waveCache[wid].hash == hash) && (waveCache[wid].numPulses == numWaves) &&
+       !memcmp(waveCache[wid].pulses, waves, numWaves * sizeof(rawWave_t)))
+      return wid;
+  }
 
-    if(waves[i].flags & WAVE_FLAG_TICK) {
-      p = rawWaveCBAdr(botCB++);
+  return -1;
+}
 
-      p->info = NORMAL_DMA;
-      p->src = ((SYST_BASE + (SYST_CLO * 4)) & 0x00ffffff) | PI_PERI_BUS;
-      p->dst = waveOOLPOadr(--topOOL);
-      p->length = 4;
-      p->next = waveCbPOadr(botCB);
-    }
+/* ----------------------------------------------------------------------- */
 
-    if(waves[i].usDelay) {
-      delayLeft = waves[i].usDelay;
+static void
+waveCacheAdd(int wid, uint32_t hash, rawWave_t* waves, unsigned numWaves) {
+  rawWave_t* copy;
 
-      delayCBs = waveDelayCBs(delayLeft);
+  waveCache[wid].refs = 1;
 
-      for(dcb = 0; dcb < delayCBs; dcb++) {
-        p = rawWaveCBAdr(botCB++);
+  copy = malloc(numWaves * sizeof(rawWave_t));
 
-        /* use the secondary clock */
+  /* without a copy the wave is simply not shared */
 
-        if(gpioCfg.clockPeriph != PI_CLOCK_PCM) {
-          p->info = NORMAL_DMA | TIMED_DMA(2);
-          p->dst = PCM_TIMER;
-        } else {
-          p->info = NORMAL_DMA | TIMED_DMA(5);
-          p->dst = PWM_TIMER;
-        }
+  if(copy == NULL)
+    return;
 
-        // cast twice to suppress compiler warning, I belive this cast is ok
-        // because dmaOBus contains bus addresses, not virtual addresses.
-        p->src = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
+  memcpy(copy, waves, numWaves * sizeof(rawWave_t));
 
-        p->length = BPD * delayLeft / PI_WF_MICROS;
+  waveCache[wid].pulses = copy;
+  waveCache[wid].numPulses = numWaves;
+  waveCache[wid].hash = hash;
+}
 
-        if((gpioCfg.DMAsecondaryChannel >= DMA_LITE_FIRST) && (p->length > DMA_LITE_MAX)) {
-          p->length = DMA_LITE_MAX;
-        }
-
-        delayLeft -= (p->length / BPD);
-
-        p->next = waveCbPOadr(botCB);
-      }
-    }
-  }
+/* ----------------------------------------------------------------------- */
 
-  if(numCB) {
-    /* Pad the wave */
+static void
+waveCacheDrop(int wid) {
+  free(waveCache[wid].pulses);
 
-    botCB = *CB + numCB - 1;
-    botOOL = *BOOL + numBOOL - 1;
-    topOOL = *TOOL - numTOOL;
+  waveCache[wid].pulses = NULL;
+  waveCache[wid].numPulses = 0;
+  waveCache[wid].hash = 0;
+  waveCache[wid].refs = 0;
+}
 
-    /* Link the last CB to end of wave */
+/* ----------------------------------------------------------------------- */
 
-    p->next = waveCbPOadr(botCB);
+static int
+waveCbPos(uint32_t adr, int bot, int top) {
+  int page, pos;
+  uint32_t offset;
 
-    /* Insert sentinel CB at end of DMA */
+  /* inverse of waveCbPOadr, -1 unless adr is a cb in bot..top */
 
-    p = rawWaveCBAdr(botCB++);
-    p->info = NORMAL_DMA | DMA_DEST_IGNORE;
-    p->src = waveOOLPOadr(botOOL++);
-    p->dst = ((GPIO_BASE + (GPSET0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
-    p->length = 4;
-    p->next = 0;
-  }
+  page = dmaOPageFind(adr, &offset);
 
-  if(p != NULL) {
-    if(wave_mode == PI_WAVE_MODE_ONE_SHOT)
-      p->next = 0;
-    else
-      p->next = waveCbPOadr(repeatCB);
-  }
+  if((page < 0) || (offset >= (CBS_PER_OPAGE * sizeof(rawCbs_t))) || (offset % sizeof(rawCbs_t)))
+    return -1;
 
-  status = botCB - *CB;
+  pos = (page * CBS_PER_OPAGE) + (offset / sizeof(rawCbs_t));
 
-  *CB = botCB;
-  *BOOL = botOOL;
-  *TOOL = topOOL;
+  if((pos >= bot) && (pos <= top))
+    return pos;
 
-  return status;
+  return -1;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void
-waveRxSerial(wfRx_t* w, int level, uint32_t tick) {
-  int diffTicks, lastLevel;
-  int newWritePos;
-
-  level = level ^ w->s.invert;
-
-  if(w->s.bit >= 0) {
-    diffTicks = tick - w->s.startBitTick;
-
-    if(level != PI_TIMEOUT) {
-      w->s.level = level;
-      lastLevel = !level;
-    } else
-      lastLevel = w->s.level;
-
-    while((w->s.bit <= w->s.dataBits) && (diffTicks > (w->s.nextBitDiff / 1000))) {
-      if(w->s.bit) {
-        if(lastLevel)
-          w->s.data |= (1 << (w->s.bit - 1));
-      } else
-        w->s.data = 0;
+static int
+waveOOLPos(uint32_t adr, int bot, int top) {
+  int page, pos;
+  uint32_t offset;
 
-      ++(w->s.bit);
+  /* inverse of waveOOLPOadr, -1 unless adr is an OOL in bot..top-1 */
 
-      w->s.nextBitDiff += w->s.fullBit;
-    }
+  page = dmaOPageFind(adr, &offset);
 
-    if(w->s.bit > w->s.dataBits) {
-      memcpy(w->s.buf + w->s.writePos, &w->s.data, w->s.bytes);
+  if(page < 0)
+    return -1;
 
-      /* don't let writePos catch readPos */
+  offset -= CBS_PER_OPAGE * sizeof(rawCbs_t);
 
-      newWritePos = (w->s.writePos + w->s.bytes) % (w->s.bufSize);
+  if((offset >= (OOL_PER_OPAGE * 4)) || (offset % 4))
+    return -1;
 
-      if(newWritePos != w->s.readPos)
-        w->s.writePos = newWritePos;
+  pos = (page * OOL_PER_OPAGE) + (offset / 4);
 
-      if(level == 0) {
-        gpioSetWatchdog(w->gpio, w->s.timeout);
-        w->s.bit = 0;
-        w->s.startBitTick = tick;
-        w->s.nextBitDiff = w->s.halfBit;
-      } else {
-        w->s.bit = -1;
-        gpioSetWatchdog(w->gpio, 0);
-      }
-    }
-  } else {
-    /* start bit if high->low */
+  if((pos >= bot) && (pos < top))
+    return pos;
 
-    if(level == 0) {
-      gpioSetWatchdog(w->gpio, w->s.timeout);
-      w->s.level = 0;
-      w->s.bit = 0;
-      w->s.startBitTick = tick;
-      w->s.nextBitDiff = w->s.halfBit;
-    }
-  }
+  return -1;
 }
 
 /* ----------------------------------------------------------------------- */
 
 static void
-waveRxBit(int gpio, int level, uint32_t tick) {
-  switch(wfRx[gpio].mode) {
-    case PI_WFRX_SERIAL: waveRxSerial(&wfRx[gpio], level, tick);
-  }
-}
-
-/* ----------------------------------------------------------------------- */
-
-int
-rawWaveAddGeneric(unsigned numIn1, rawWave_t* in1) {
-  unsigned inPos1 = 0, inPos2 = 0, outPos = 0, level = NUM_WAVE_OOL;
-
-  unsigned cbs = 0;
-
-  unsigned numIn2, numOut;
-
-  uint32_t tNow, tNext1, tNext2, tDelay, tMax;
-
-  rawWave_t *in2, *out;
+waveMoveCB(rawWaveInfo_t* from, rawWaveInfo_t* to, int cb) {
+  rawCbs_t* p;
+  int pos, s_stride;
 
-  numIn2 = wfc[wfcur];
-  in2 = wf[wfcur];
+  p = rawWaveCBAdr(to->botCB + cb);
 
-  numOut = PI_WAVE_MAX_PULSES;
-  out = wf[1 - wfcur];
+  if(from->botCB != to->botCB)
+    *p = *rawWaveCBAdr(from->botCB + cb);
 
-  tNow = 0;
-  tMax = 0;
+  /* next is nearly always the following cb, try that first */
 
-  if(!numIn1)
-    tNext1 = -1;
-  else
-    tNext1 = 0;
-  if(!numIn2)
-    tNext2 = -1;
+  if(((cb + 1) < from->numCB) && (p->next == waveCbPOadr(from->botCB + cb + 1)))
+    pos = from->botCB + cb + 1;
   else
-    tNext2 = 0;
+    pos = waveCbPos(p->next, from->botCB, from->topCB);
 
-  while(((inPos1 < numIn1) || (inPos2 < numIn2)) && (outPos < numOut)) {
-    if(tNext1 < tNext2) {
-      /* pulse 1 due */
+  if(pos >= 0)
+    p->next = waveCbPOadr(pos - from->botCB + to->botCB);
 
-      if(tNow < tNext1) {
-        /* extend previous delay */
-        out[outPos - 1].usDelay += (tNext1 - tNow);
-        tNow = tNext1;
-      }
+  pos = waveOOLPos(p->dst, from->botOOL, from->topOOL);
 
-      out[outPos].gpioOn = in1[inPos1].gpioOn;
-      out[outPos].gpioOff = in1[inPos1].gpioOff;
-      out[outPos].flags = in1[inPos1].flags;
-
-      tNext1 = tNow + in1[inPos1].usDelay;
-      ++inPos1;
-      if(tMax < tNext1)
-        tMax = tNext1;
-    } else if(tNext2 < tNext1) {
-      /* pulse 2 due */
-
-      if(tNow < tNext2) {
-        /* extend previous delay */
-        out[outPos - 1].usDelay += (tNext2 - tNow);
-        tNow = tNext2;
-      }
+  if(pos >= 0)
+    p->dst = waveOOLPOadr(pos - from->botOOL + to->botOOL);
 
-      out[outPos].gpioOn = in2[inPos2].gpioOn;
-      out[outPos].gpioOff = in2[inPos2].gpioOff;
-      out[outPos].flags = in2[inPos2].flags;
+  pos = waveOOLPos(p->src, from->botOOL, from->topOOL);
 
-      tNext2 = tNow + in2[inPos2].usDelay;
-      ++inPos2;
-      if(tMax < tNext2)
-        tMax = tNext2;
-    } else {
-      /* pulse 1 and 2 both due */
+  if(pos >= 0) {
+    pos = pos - from->botOOL + to->botOOL;
 
-      if(tNow < tNext1) {
-        /* extend previous delay */
-        out[outPos - 1].usDelay += (tNext1 - tNow);
-        tNow = tNext1;
-      }
+    p->src = waveOOLPOadr(pos);
 
-      out[outPos].gpioOn = in1[inPos1].gpioOn | in2[inPos2].gpioOn;
-      out[outPos].gpioOff = in1[inPos1].gpioOff | in2[inPos2].gpioOff;
-      out[outPos].flags = in1[inPos1].flags | in2[inPos2].flags;
+    if(p->info == TWO_BEAT_DMA) {
+      /* the source stride depends on where the OOL pair now lives */
 
-      tNext1 = tNow + in1[inPos1].usDelay;
-      ++inPos1;
-      tNext2 = tNow + in2[inPos2].usDelay;
-      ++inPos2;
-      if(tMax < tNext1)
-        tMax = tNext1;
-      if(tMax < tNext2)
-        tMax = tNext2;
+      s_stride = waveOOLPOadr(pos + 1) - p->src;
+      p->stride = (12 << 16) + s_stride;
     }
+  }
+}
 
-    if(tNext1 <= tNext2) {
-      tDelay = tNext1 - tNow;
-      tNow = tNext1;
-    } else {
-      tDelay = tNext2 - tNow;
-      tNow = tNext2;
-    }
+/* ----------------------------------------------------------------------- */
 
-    out[outPos].usDelay = tDelay;
+static int
+waveLiveOrder(int* order, int byOOL) {
+  int i, j, n, key;
 
-    cbs += waveDelayCBs(tDelay);
+  /* live wave ids sorted by their CB or OOL start */
 
-    if(out[outPos].gpioOn || out[outPos].gpioOff)
-      cbs++;
+  n = 0;
 
-    if(out[outPos].flags & WAVE_FLAG_READ) {
-      cbs++; /* one cb if read */
-      --level;
-    }
+  for(i = 0; i < waveOutCount; i++) {
+    if(waveInfo[i].deleted)
+      continue;
 
-    if(out[outPos].flags & WAVE_FLAG_TICK) {
-      cbs++; /* one cb if tick */
-      --level;
-    }
+    key = byOOL ? waveInfo[i].botOOL : waveInfo[i].botCB;
 
-    outPos++;
+    for(j = n; (j > 0) && ((byOOL ? waveInfo[order[j - 1]].botOOL : waveInfo[order[j - 1]].botCB) > key); j--) order[j] = order[j - 1];
 
-    if(inPos1 >= numIn1)
-      tNext1 = -1;
-    if(inPos2 >= numIn2)
-      tNext2 = -1;
+    order[j] = i;
+    n++;
   }
 
-  if(tNow < tMax) {
-    /* extend previous delay */
-    out[outPos - 1].usDelay += (tMax - tNow);
-    tNow = tMax;
-  }
+  return n;
+}
 
-  if((outPos < numOut) && (outPos < level)) {
-    wfStats.micros = tNow;
+/* ----------------------------------------------------------------------- */
 
-    if(tNow > wfStats.highMicros)
-      wfStats.highMicros = tNow;
+static void
+waveBitDelay(unsigned baud, unsigned bits, unsigned stops, unsigned* bitDelay) {
+  unsigned fullBit, last, diff, t, i;
 
-    wfStats.pulses = outPos;
+  /* scaled 1000X */
 
-    if(outPos > wfStats.highPulses)
-      wfStats.highPulses = outPos;
+  fullBit = 1000000000 / baud;
+  last = 0;
 
-    wfStats.cbs = cbs;
+  for(i = 0; i <= bits; i++) {
+    t = (((i + 1) * fullBit) + 500) / 1000;
+    diff = t - last;
+    last = t;
+    bitDelay[i] = diff;
+  }
 
-    if(cbs > wfStats.highCbs)
-      wfStats.highCbs = cbs;
+  t = (((bits + 1) * fullBit) + ((stops * fullBit) / 2) + 500) / 1000;
+  diff = t - last;
+  bitDelay[i] = diff;
+}
 
-    wfc[1 - wfcur] = outPos;
-    wfcur = 1 - wfcur;
+static int
+waveDelayCBs(uint32_t delay) {
+  uint32_t cbs;
 
-    return outPos;
-  } else
-    return PI_TOO_MANY_PULSES;
+  if(!delay)
+    return 0;
+  if(gpioCfg.DMAsecondaryChannel < DMA_LITE_FIRST)
+    return 1;
+  cbs = BPD * delay / DMA_LITE_MAX;
+  if((BPD * delay) % DMA_LITE_MAX)
+    cbs++;
+  return cbs;
 }
 
-/* ======================================================================= */
+/* ----------------------------------------------------------------------- */
 
-int
-i2cWriteQuick(unsigned handle, unsigned bit) {
-  int status;
+static void
+waveCBsOOLs(rawWave_t* waves, unsigned numWaves, int* numCBs, int* numBOOLs, int* numTOOLs) {
+  int numCB = 0, numBOOL = 0, numTOOL = 0;
 
-  DBG(DBG_USER, "handle=%d bit=%d", handle, bit);
+  unsigned i;
 
-  CHECK_INITED;
+  /* delay cb at start of DMA */
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  numCB++;
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  for(i = 0; i < numWaves; i++) {
+    if(waves[i].flags & WAVE_FLAG_FSEL) {
+      numBOOL++;
+      numCB++;
+    } else {
+      if(waves[i].gpioOn) {
+        numBOOL++;
+      }
+      if(waves[i].gpioOff) {
+        numBOOL++;
+      }
+      if(waves[i].gpioOn || waves[i].gpioOff) {
+        numCB++;
+      }
+    }
+    if(waves[i].flags & WAVE_FLAG_READ) {
+      numCB++;
+      numTOOL++;
+    }
+    if(waves[i].flags & WAVE_FLAG_TICK) {
+      numCB++;
+      numTOOL++;
+    }
 
-  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_QUICK) == 0)
-    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+    numCB += waveDelayCBs(waves[i].usDelay);
+  }
 
-  if(bit > 1)
-    SOFT_ERROR(PI_BAD_PARAM, "bad bit (%d)", bit);
+  *numCBs = numCB;
+  *numBOOLs = numBOOL;
+  *numTOOLs = numTOOL;
+}
 
-  status = my_smbus_access(i2cInfo[handle].fd, bit, 0, PI_I2C_SMBUS_QUICK, NULL);
+/* ----------------------------------------------------------------------- */
 
-  if(status < 0) {
-    DBG(DBG_USER, "error=%d (%m)", status);
-    return PI_I2C_WRITE_FAILED;
-  }
+static int
+wave2Cbs(rawWave_t* waves, unsigned numWaves, unsigned wave_mode, int* CB, int* BOOL, int* TOOL, int numCB, int numBOOL, int numTOOL) {
+  int botCB = *CB, botOOL = *BOOL, topOOL = *TOOL;
 
-  return status;
-}
+  int status, s_stride;
 
-int
-i2cReadByte(unsigned handle) {
-  union my_smbus_data data;
-  int status;
+  rawCbs_t* p = NULL;
 
-  DBG(DBG_USER, "handle=%d", handle);
+  unsigned i, repeatCB;
 
-  CHECK_INITED;
+  unsigned delayCBs, dcb;
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  uint32_t delayLeft;
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  /* add delay cb at start of DMA */
 
-  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_BYTE) == 0)
-    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+  p = rawWaveCBAdr(botCB++);
 
-  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_READ, 0, PI_I2C_SMBUS_BYTE, &data);
+  /* use the secondary clock */
 
-  if(status < 0) {
-    DBG(DBG_USER, "error=%d (%m)", status);
-    return PI_I2C_READ_FAILED;
+  if(gpioCfg.clockPeriph != PI_CLOCK_PCM) {
+    p->info = NORMAL_DMA | TIMED_DMA(2);
+    p->dst = PCM_TIMER;
+  } else {
+    p->info = NORMAL_DMA | TIMED_DMA(5);
+    p->dst = PWM_TIMER;
   }
 
-  return 0xFF & data.byte;
-}
+  // cast twice to suppress compiler warning, I belive this cast is ok
+  // because dmaOBus contains bus addresses, not virtual addresses.
+  p->src = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
+  p->length = BPD * 20 / PI_WF_MICROS; /* 20 micros delay */
+  p->next = waveCbPOadr(botCB);
 
-int
-i2cWriteByte(unsigned handle, unsigned bVal) {
-  int status;
+  repeatCB = botCB;
 
-  DBG(DBG_USER, "handle=%d bVal=%d", handle, bVal);
+  for(i = 0; i < numWaves; i++) {
+    if(waves[i].flags & WAVE_FLAG_FSEL) {
+      waveSetOOL(botOOL, waves[i].gpioOn);
 
-  CHECK_INITED;
+      p = rawWaveCBAdr(botCB++);
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      p->info = NORMAL_DMA;
+      p->src = waveOOLPOadr(botOOL++);
+      p->dst = ((GPIO_BASE + ((GPFSEL0 + WAVE_FSEL_REG(waves[i].flags)) * 4)) & 0x00ffffff) | PI_PERI_BUS;
+      p->length = 4;
+      p->next = waveCbPOadr(botCB);
+    } else if(waves[i].gpioOn && waves[i].gpioOff)
+    /* Use 2-beat burst */
+    {
+      p = rawWaveCBAdr(botCB++);
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      p->info = TWO_BEAT_DMA;
+      p->src = waveOOLPOadr(botOOL);
+      waveSetOOL(botOOL++, waves[i].gpioOn);
+      s_stride = waveOOLPOadr(botOOL) - p->src;
+      waveSetOOL(botOOL++, waves[i].gpioOff);
+      p->dst = ((GPIO_BASE + (GPSET0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
+      p->length = (2 << 16) + 4;         // 2 transfers of 4 bytes each
+      p->stride = (12 << 16) + s_stride; // d_stride = (GPCLR0-GPSET0)*4 = 12
+      p->next = waveCbPOadr(botCB);
+    } else if(waves[i].gpioOn && !waves[i].gpioOff) {
+      waveSetOOL(botOOL, waves[i].gpioOn);
 
-  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_BYTE) == 0)
-    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+      p = rawWaveCBAdr(botCB++);
 
-  if(bVal > 0xFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad bVal (%d)", bVal);
-
-  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, bVal, PI_I2C_SMBUS_BYTE, NULL);
+      p->info = NORMAL_DMA;
+      p->src = waveOOLPOadr(botOOL++);
+      p->dst = ((GPIO_BASE + (GPSET0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
+      p->length = 4;
+      p->next = waveCbPOadr(botCB);
+    } else if(waves[i].gpioOff && !waves[i].gpioOn) {
+      waveSetOOL(botOOL, waves[i].gpioOff);
 
-  if(status < 0) {
-    DBG(DBG_USER, "error=%d (%m)", status);
-    return PI_I2C_WRITE_FAILED;
-  }
+      p = rawWaveCBAdr(botCB++);
 
-  return status;
-}
+      p->info = NORMAL_DMA;
+      p->src = waveOOLPOadr(botOOL++);
+      p->dst = ((GPIO_BASE + (GPCLR0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
+      p->length = 4;
+      p->next = waveCbPOadr(botCB);
+    }
+    if(waves[i].flags & WAVE_FLAG_READ) {
+      p = rawWaveCBAdr(botCB++);
 
-int
-i2cReadByteData(unsigned handle, unsigned reg) {
-  union my_smbus_data data;
-  int status;
+      p->info = NORMAL_DMA;
+      p->src = ((GPIO_BASE + (GPLEV0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
+      p->dst = waveOOLPOadr(--topOOL);
+      p->length = 4;
+      p->next = waveCbPOadr(botCB);
+    }
 
-  DBG(DBG_USER, "handle=%d reg=%d", handle, reg);
+    if(waves[i].flags & WAVE_FLAG_TICK) {
+      p = rawWaveCBAdr(botCB++);
 
-  CHECK_INITED;
+      p->info = NORMAL_DMA;
+      p->src = ((SYST_BASE + (SYST_CLO * 4)) & 0x00ffffff) | PI_PERI_BUS;
+      p->dst = waveOOLPOadr(--topOOL);
+      p->length = 4;
+      p->next = waveCbPOadr(botCB);
+    }
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+    if(waves[i].usDelay) {
+      delayLeft = waves[i].usDelay;
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      delayCBs = waveDelayCBs(delayLeft);
 
-  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_BYTE_DATA) == 0)
-    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+      for(dcb = 0; dcb < delayCBs; dcb++) {
+        p = rawWaveCBAdr(botCB++);
 
-  if(reg > 0xFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+        /* use the secondary clock */
 
-  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_READ, reg, PI_I2C_SMBUS_BYTE_DATA, &data);
+        if(gpioCfg.clockPeriph != PI_CLOCK_PCM) {
+          p->info = NORMAL_DMA | TIMED_DMA(2);
+          p->dst = PCM_TIMER;
+        } else {
+          p->info = NORMAL_DMA | TIMED_DMA(5);
+          p->dst = PWM_TIMER;
+        }
 
-  if(status < 0) {
-    DBG(DBG_USER, "error=%d (%m)", status);
-    return PI_I2C_READ_FAILED;
-  }
+        // cast twice to suppress compiler warning, I belive this cast is ok
+        // because dmaOBus contains bus addresses, not virtual addresses.
+        p->src = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
 
-  return 0xFF & data.byte;
-}
+        p->length = BPD * delayLeft / PI_WF_MICROS;
 
-int
-i2cWriteByteData(unsigned handle, unsigned reg, unsigned bVal) {
-  union my_smbus_data data;
+        if((gpioCfg.DMAsecondaryChannel >= DMA_LITE_FIRST) && (p->length > DMA_LITE_MAX)) {
+          p->length = DMA_LITE_MAX;
+        }
 
-  int status;
+        delayLeft -= (p->length / BPD);
 
-  DBG(DBG_USER, "handle=%d reg=%d bVal=%d", handle, reg, bVal);
+        p->next = waveCbPOadr(botCB);
+      }
+    }
+  }
 
-  CHECK_INITED;
+  if(numCB) {
+    /* Pad the wave */
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+    botCB = *CB + numCB - 1;
+    botOOL = *BOOL + numBOOL - 1;
+    topOOL = *TOOL - numTOOL;
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+    /* Link the last CB to end of wave */
 
-  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_BYTE_DATA) == 0)
-    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+    p->next = waveCbPOadr(botCB);
 
-  if(reg > 0xFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+    /* Insert sentinel CB at end of DMA */
 
-  if(bVal > 0xFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad bVal (%d)", bVal);
+    p = rawWaveCBAdr(botCB++);
+    p->info = NORMAL_DMA | DMA_DEST_IGNORE;
+    p->src = waveOOLPOadr(botOOL++);
+    p->dst = ((GPIO_BASE + (GPSET0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
+    p->length = 4;
+    p->next = 0;
+  }
 
-  data.byte = bVal;
+  if(p != NULL) {
+    if(wave_mode == PI_WAVE_MODE_ONE_SHOT)
+      p->next = 0;
+    else
+      p->next = waveCbPOadr(repeatCB);
+  }
 
-  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg, PI_I2C_SMBUS_BYTE_DATA, &data);
+  status = botCB - *CB;
 
-  if(status < 0) {
-    DBG(DBG_USER, "error=%d (%m)", status);
-    return PI_I2C_WRITE_FAILED;
-  }
+  *CB = botCB;
+  *BOOL = botOOL;
+  *TOOL = topOOL;
 
   return status;
 }
 
-int
-i2cReadWordData(unsigned handle, unsigned reg) {
-  union my_smbus_data data;
-  int status;
+/* ----------------------------------------------------------------------- */
 
-  DBG(DBG_USER, "handle=%d reg=%d", handle, reg);
+static void
+waveRxSerialSample(wfRx_t* w, int level, uint32_t tick) {
+  int diffTicks, newWritePos, odd;
 
-  CHECK_INITED;
+  /* level has been held since the last edge, so it is the value of
+     every bit whose middle has passed by tick */
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  diffTicks = tick - w->s.startBitTick;
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  while((w->s.bit >= 0) && (diffTicks > (int)(w->s.nextBitDiff / 1000))) {
+    if(w->s.bit == 0) {
+      if(level) {
+        /* too short for a start bit */
 
-  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_WORD_DATA) == 0)
-    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+        w->s.bit = -1;
+        return;
+      }
 
-  if(reg > 0xFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+      w->s.data = 0;
+    } else if(w->s.bit <= w->s.dataBits) {
+      if(level)
+        w->s.data |= (1U << (w->s.bit - 1));
+    } else if(w->s.parity && (w->s.bit == (w->s.dataBits + 1))) {
+      w->s.parityBit = level;
+    } else {
+      /* stop bit, the character is kept even if it is in error */
 
-  status = (my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_READ, reg, PI_I2C_SMBUS_WORD_DATA, &data));
+      w->s.stats.frames++;
 
-  if(status < 0) {
-    DBG(DBG_USER, "error=%d (%m)", status);
-    return PI_I2C_READ_FAILED;
-  }
+      if(!level)
+        w->s.stats.framingErrors++;
 
-  return 0xFFFF & data.word;
-}
+      if(w->s.parity) {
+        odd = (__builtin_popcount(w->s.data) + w->s.parityBit) & 1;
 
-int
-i2cWriteWordData(unsigned handle, unsigned reg, unsigned wVal) {
-  union my_smbus_data data;
+        if(odd != (w->s.parity == PI_BB_SER_PARITY_ODD))
+          w->s.stats.parityErrors++;
+      }
 
-  int status;
+      memcpy(w->s.buf + w->s.writePos, &w->s.data, w->s.bytes);
 
-  DBG(DBG_USER, "handle=%d reg=%d wVal=%d", handle, reg, wVal);
+      /* don't let writePos catch readPos */
 
-  CHECK_INITED;
+      newWritePos = (w->s.writePos + w->s.bytes) % (w->s.bufSize);
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      if(newWritePos != w->s.readPos)
+        w->s.writePos = newWritePos;
+      else
+        w->s.stats.overruns++;
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      w->s.bit = -1;
+      return;
+    }
 
-  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_WORD_DATA) == 0)
-    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+    ++(w->s.bit);
 
-  if(reg > 0xFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+    w->s.nextBitDiff += w->s.fullBit;
+  }
+}
 
-  if(wVal > 0xFFFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad wVal (%d)", wVal);
+/* ----------------------------------------------------------------------- */
 
-  data.word = wVal;
+static void
+waveRxSerialEdge(wfRx_t* w, int level, uint32_t tick) {
+  level = level ^ w->s.invert;
 
-  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg, PI_I2C_SMBUS_WORD_DATA, &data);
+  if(w->s.bit >= 0)
+    waveRxSerialSample(w, w->s.level, tick);
 
-  if(status < 0) {
-    DBG(DBG_USER, "error=%d (%m)", status);
-    return PI_I2C_WRITE_FAILED;
+  /* start bit if high->low */
+
+  if((w->s.bit < 0) && (level == 0)) {
+    w->s.bit = 0;
+    w->s.startBitTick = tick;
+    w->s.nextBitDiff = w->s.halfBit;
   }
 
-  return status;
+  w->s.level = level;
 }
 
-int
-i2cProcessCall(unsigned handle, unsigned reg, unsigned wVal) {
-  union my_smbus_data data;
-  int status;
+/* ----------------------------------------------------------------------- */
 
-  DBG(DBG_USER, "handle=%d reg=%d wVal=%d", handle, reg, wVal);
+static void
+waveRxSerialBatch(gpioSample_t* sample, int numSamples, uint32_t eTick) {
+  uint32_t bits, level, changes;
+  int d, b;
 
-  CHECK_INITED;
+  /* decodes every serial GPIO from the compacted samples in one pass,
+     nothing is per GPIO unless it changed */
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  if(!wfRxSerialBits)
+    return;
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  pthread_mutex_lock(&wfRxSerialMutex);
 
-  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_PROC_CALL) == 0)
-    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+  bits = wfRxSerialBits;
 
-  if(reg > 0xFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+  level = wfRxSerialLevel;
 
-  if(wVal > 0xFFFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad wVal (%d)", wVal);
+  for(d = 0; d < numSamples; d++) {
+    changes = (sample[d].level ^ level) & bits;
 
-  data.word = wVal;
+    while(changes) {
+      b = __builtin_ctz(changes);
+      changes &= (changes - 1);
 
-  status = (my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg, PI_I2C_SMBUS_PROC_CALL, &data));
+      waveRxSerialEdge(&wfRx[b], (sample[d].level >> b) & 1, sample[d].tick);
+    }
 
-  if(status < 0) {
-    DBG(DBG_USER, "error=%d (%m)", status);
-    return PI_I2C_READ_FAILED;
+    level = sample[d].level;
   }
 
-  return 0xFFFF & data.word;
-}
-
-int
-i2cReadBlockData(unsigned handle, unsigned reg, char* buf) {
-  union my_smbus_data data;
+  wfRxSerialLevel = level;
 
-  int i, status;
+  /* a character ending in ones has no closing edge, finish what has
+     elapsed by the end of the batch instead of using a watchdog */
 
-  DBG(DBG_USER, "handle=%d reg=%d buf=%08" PRIXPTR, handle, reg, (uintptr_t)buf);
+  while(bits) {
+    b = __builtin_ctz(bits);
+    bits &= (bits - 1);
 
-  CHECK_INITED;
+    if(wfRx[b].s.bit >= 0)
+      waveRxSerialSample(&wfRx[b], wfRx[b].s.level, eTick);
+  }
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  pthread_mutex_unlock(&wfRxSerialMutex);
+}
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+/* ----------------------------------------------------------------------- */
 
-  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_BLOCK_DATA) == 0)
-    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+static void
+waveTrackReset(void) {
+  wfTracks = 0;
+  wfTrackPos[0] = 0;
 
-  if(reg > 0xFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+  wfSlotPulses = 0;
+  wfSlotReads = 0;
+  wfSlotTicks = 0;
+  wfSlotMicros = 0;
 
-  status = (my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_READ, reg, PI_I2C_SMBUS_BLOCK_DATA, &data));
+  /* bumping the generation empties the slot table */
 
-  if(status < 0) {
-    DBG(DBG_USER, "error=%d (%m)", status);
-    return PI_I2C_READ_FAILED;
-  } else {
-    if(data.block[0] <= PI_I2C_SMBUS_BLOCK_MAX) {
-      for(i = 0; i < data.block[0]; i++) buf[i] = data.block[i + 1];
-      return data.block[0];
-    } else
-      return PI_I2C_READ_FAILED;
+  if(!++wfSlotGen) {
+    if(wfSlot)
+      memset(wfSlot, 0, sizeof(wfSlot_t) * wfSlots);
+    wfSlotGen = 1;
   }
 }
 
-int
-i2cWriteBlockData(unsigned handle, unsigned reg, char* buf, unsigned count) {
-  union my_smbus_data data;
+/* ----------------------------------------------------------------------- */
 
-  int i, status;
+static int
+waveReserve(rawWave_t** buf, unsigned* size, unsigned pulses) {
+  rawWave_t* newBuf;
+  unsigned newSize;
 
-  DBG(DBG_USER, "handle=%d reg=%d count=%d [%s]", handle, reg, count, myBuf2Str(count, buf));
+  /* grow a staging buffer to hold pulses, keeping its contents */
 
-  CHECK_INITED;
-
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  if(pulses <= *size)
+    return 0;
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  if(pulses > PI_WAVE_MAX_PULSES)
+    return PI_TOO_MANY_PULSES;
 
-  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_BLOCK_DATA) == 0)
-    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+  newSize = *size ? *size : WF_MIN_PULSES;
 
-  if(reg > 0xFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+  while(newSize < pulses) newSize *= 2;
 
-  if((count < 1) || (count > 32))
-    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+  if(newSize > PI_WAVE_MAX_PULSES)
+    newSize = PI_WAVE_MAX_PULSES;
 
-  for(i = 1; i <= count; i++) data.block[i] = buf[i - 1];
-  data.block[0] = count;
+  newBuf = realloc(*buf, sizeof(rawWave_t) * newSize);
 
-  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg, PI_I2C_SMBUS_BLOCK_DATA, &data);
+  if(!newBuf)
+    SOFT_ERROR(PI_NO_MEMORY, "wave staging, no memory for %u pulses", newSize);
 
-  if(status < 0) {
-    DBG(DBG_USER, "error=%d (%m)", status);
-    return PI_I2C_WRITE_FAILED;
-  }
+  *buf = newBuf;
+  *size = newSize;
 
-  return status;
+  return 0;
 }
 
-int
-i2cBlockProcessCall(unsigned handle, unsigned reg, char* buf, unsigned count) {
-  union my_smbus_data data;
+/* ----------------------------------------------------------------------- */
 
-  int i, status;
+static void
+waveRelease(void) {
+  int i;
 
-  DBG(DBG_USER, "handle=%d reg=%d count=%d [%s]", handle, reg, count, myBuf2Str(count, buf));
+  for(i = 0; i < 3; i++) {
+    free(wf[i]);
+    wf[i] = NULL;
+    wfSize[i] = 0;
+    wfc[i] = 0;
+  }
 
-  CHECK_INITED;
+  free(wfTrack);
+  wfTrack = NULL;
+  wfTrackSize = 0;
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  free(wfSlot);
+  wfSlot = NULL;
+  wfSlots = 0;
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  wfcur = 0;
 
-  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_PROC_CALL) == 0)
-    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+  waveTrackReset();
+}
 
-  if(reg > 0xFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+/* ----------------------------------------------------------------------- */
 
-  if((count < 1) || (count > 32))
-    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+static wfSlot_t*
+waveSlotFind(uint32_t tick, unsigned round) {
+  unsigned i;
 
-  for(i = 1; i <= count; i++) data.block[i] = buf[i - 1];
-  data.block[0] = count;
+  i = ((tick * 2654435761U) ^ (round * 40503U)) % wfSlots;
 
-  status = (my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg, PI_I2C_SMBUS_BLOCK_PROC_CALL, &data));
+  /* never more than half full, see waveSlotReserve */
 
-  if(status < 0) {
-    DBG(DBG_USER, "error=%d (%m)", status);
-    return PI_I2C_READ_FAILED;
-  } else {
-    if(data.block[0] <= PI_I2C_SMBUS_BLOCK_MAX) {
-      for(i = 0; i < data.block[0]; i++) buf[i] = data.block[i + 1];
-      return data.block[0];
-    } else
-      return PI_I2C_READ_FAILED;
+  while((wfSlot[i].gen == wfSlotGen) && ((wfSlot[i].tick != tick) || (wfSlot[i].round != round))) {
+    if(++i == wfSlots)
+      i = 0;
   }
-}
-
-int
-i2cReadI2CBlockData(unsigned handle, unsigned reg, char* buf, unsigned count) {
-  union my_smbus_data data;
 
-  int i, status;
-  uint32_t size;
+  return &wfSlot[i];
+}
 
-  DBG(DBG_USER, "handle=%d reg=%d count=%d buf=%08" PRIXPTR, handle, reg, count, (uintptr_t)buf);
+/* ----------------------------------------------------------------------- */
 
-  CHECK_INITED;
+static int
+waveSlotReserve(unsigned pulses) {
+  wfSlot_t *oldSlot, *slot;
+  unsigned i, oldSlots, newSlots;
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  if((2 * pulses) < wfSlots)
+    return 0;
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  newSlots = wfSlots ? wfSlots : WF_MIN_PULSES + 1;
 
-  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_I2C_BLOCK) == 0)
-    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+  while((2 * pulses) >= newSlots) newSlots = (2 * newSlots) + 1;
 
-  if(reg > 0xFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+  slot = calloc(newSlots, sizeof(wfSlot_t));
 
-  if((count < 1) || (count > 32))
-    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+  if(!slot)
+    SOFT_ERROR(PI_NO_MEMORY, "wave staging, no memory for %u slots", newSlots);
 
-  if(count == 32)
-    size = PI_I2C_SMBUS_I2C_BLOCK_BROKEN;
-  else
-    size = PI_I2C_SMBUS_I2C_BLOCK_DATA;
+  /* rehash the slots in use */
 
-  data.block[0] = count;
+  oldSlot = wfSlot;
+  oldSlots = wfSlots;
 
-  status = (my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_READ, reg, size, &data));
+  wfSlot = slot;
+  wfSlots = newSlots;
 
-  if(status < 0) {
-    DBG(DBG_USER, "error=%d (%m)", status);
-    return PI_I2C_READ_FAILED;
-  } else {
-    if(data.block[0] <= PI_I2C_SMBUS_I2C_BLOCK_MAX) {
-      for(i = 0; i < data.block[0]; i++) buf[i] = data.block[i + 1];
-      return data.block[0];
-    } else
-      return PI_I2C_READ_FAILED;
+  for(i = 0; i < oldSlots; i++) {
+    if(oldSlot[i].gen == wfSlotGen) {
+      slot = waveSlotFind(oldSlot[i].tick, oldSlot[i].round);
+      *slot = oldSlot[i];
+    }
   }
-}
 
-int
-i2cWriteI2CBlockData(unsigned handle, unsigned reg, char* buf, unsigned count) {
-  union my_smbus_data data;
+  free(oldSlot);
 
-  int i, status;
+  return 0;
+}
 
-  DBG(DBG_USER, "handle=%d reg=%d count=%d [%s]", handle, reg, count, myBuf2Str(count, buf));
+/* ----------------------------------------------------------------------- */
 
-  CHECK_INITED;
+static void
+waveHeapDown(int* heap, int n, int i, uint32_t* tNext) {
+  int c, k;
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  k = heap[i];
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  while((c = (2 * i) + 1) < n) {
+    if(((c + 1) < n) && (tNext[heap[c + 1]] < tNext[heap[c]]))
+      c++;
 
-  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_I2C_BLOCK) == 0)
-    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+    if(tNext[heap[c]] >= tNext[k])
+      break;
 
-  if(reg > 0xFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+    heap[i] = heap[c];
+    i = c;
+  }
 
-  if((count < 1) || (count > 32))
-    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+  heap[i] = k;
+}
 
-  for(i = 1; i <= count; i++) data.block[i] = buf[i - 1];
+/* ----------------------------------------------------------------------- */
 
-  data.block[0] = count;
+static void
+waveHeapUp(int* heap, int i, uint32_t* tNext) {
+  int k;
 
-  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg, PI_I2C_SMBUS_I2C_BLOCK_BROKEN, &data);
+  k = heap[i];
 
-  if(status < 0) {
-    DBG(DBG_USER, "error=%d (%m)", status);
-    return PI_I2C_WRITE_FAILED;
+  while(i && (tNext[heap[(i - 1) / 2]] > tNext[k])) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
   }
 
-  return status;
+  heap[i] = k;
 }
 
-int
-i2cWriteDevice(unsigned handle, char* buf, unsigned count) {
-  int bytes;
+/* ----------------------------------------------------------------------- */
 
-  DBG(DBG_USER, "handle=%d count=%d [%s]", handle, count, myBuf2Str(count, buf));
+static unsigned
+waveNormalise(rawWave_t* in, unsigned numIn, rawWave_t* out, unsigned* numCBs) {
+  rawWave_t cur;
+  uint32_t known, level, both;
+  unsigned i, n, cbs;
 
-  CHECK_INITED;
+  /*
+     Drop gpio sets and clears which repeat a level the wave set at
+     the same instant, then fold pulses which do nothing into the
+     delay of the one before.  Once time passes other code may have
+     driven the gpio, so a later repeat is kept.  out may be in, or
+     NULL just to count.
+  */
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  known = 0;
+  level = 0;
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  n = 0;
+  cbs = 0;
 
-  if((count < 1) || (count > PI_MAX_I2C_DEVICE_COUNT))
-    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+  cur.gpioOn = 0;
+  cur.gpioOff = 0;
+  cur.usDelay = 0;
+  cur.flags = 0;
 
-  bytes = write(i2cInfo[handle].fd, buf, count);
+  for(i = 0; i < numIn; i++) {
+    /* a set and clear of the same gpio in one pulse is left alone */
 
-  if(bytes != count) {
-    DBG(DBG_USER, "error=%d (%m)", bytes);
-    return PI_I2C_WRITE_FAILED;
-  }
+    both = in[i].gpioOn & in[i].gpioOff;
 
-  return 0;
-}
+    if(n && !(in[i].gpioOn & ~(known & level & ~both)) && !(in[i].gpioOff & ~(known & ~level & ~both)) && !in[i].flags) {
+      cur.usDelay += in[i].usDelay;
 
-int
-i2cReadDevice(unsigned handle, char* buf, unsigned count) {
-  int bytes;
+      if(in[i].usDelay)
+        known = 0;
 
-  DBG(DBG_USER, "handle=%d count=%d buf=%08" PRIXPTR, handle, count, (uintptr_t)buf);
+      continue;
+    }
 
-  CHECK_INITED;
+    if(n) {
+      cbs += waveDelayCBs(cur.usDelay) + ((cur.gpioOn || cur.gpioOff) ? 1 : 0);
+      cbs += ((cur.flags & WAVE_FLAG_READ) ? 1 : 0) + ((cur.flags & WAVE_FLAG_TICK) ? 1 : 0);
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      if(out)
+        out[n - 1] = cur;
+    }
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+    cur.gpioOn = in[i].gpioOn & ~(known & level & ~both);
+    cur.gpioOff = in[i].gpioOff & ~(known & ~level & ~both);
+    cur.usDelay = in[i].usDelay;
+    cur.flags = in[i].flags;
 
-  if((count < 1) || (count > PI_MAX_I2C_DEVICE_COUNT))
-    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+    known |= in[i].gpioOn | in[i].gpioOff;
+    level = (level | in[i].gpioOn) & ~in[i].gpioOff;
 
-  bytes = read(i2cInfo[handle].fd, buf, count);
+    n++;
 
-  if(bytes != count) {
-    DBG(DBG_USER, "error=%d (%m)", bytes);
-    return PI_I2C_READ_FAILED;
+    if(in[i].usDelay)
+      known = 0;
   }
 
-  return bytes;
+  if(n) {
+    cbs += waveDelayCBs(cur.usDelay) + ((cur.gpioOn || cur.gpioOff) ? 1 : 0);
+    cbs += ((cur.flags & WAVE_FLAG_READ) ? 1 : 0) + ((cur.flags & WAVE_FLAG_TICK) ? 1 : 0);
+
+    if(out)
+      out[n - 1] = cur;
+  }
+
+  if(numCBs)
+    *numCBs = cbs;
+
+  return n;
 }
 
-int
-i2cOpen(unsigned i2cBus, unsigned i2cAddr, unsigned i2cFlags) {
-  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-  char dev[32];
-  int i, slot, fd;
-  uint32_t funcs;
+/* ----------------------------------------------------------------------- */
 
-  DBG(DBG_USER, "i2cBus=%d i2cAddr=%d flags=0x%X", i2cBus, i2cAddr, i2cFlags);
+static int
+waveTrackMerge(void) {
+  rawWave_t *in[WF_MAX_TRACKS + 1], *out;
+  unsigned pos[WF_MAX_TRACKS + 1], num[WF_MAX_TRACKS + 1];
+  uint32_t tNext[WF_MAX_TRACKS + 1];
+  int heap[WF_MAX_TRACKS + 1], due[WF_MAX_TRACKS + 1];
+  int i, k, n, numDue;
+  unsigned outPos, cbs;
+  uint32_t t, tMax;
+  int status;
 
-  CHECK_INITED;
+  /*
+     k-way merge of the current wave and the pending tracks into the
+     alternate buffer.  Pulses due at the same tick are combined, one
+     from each track, as repeated pairwise merges would.
+  */
 
-  if(i2cAddr > PI_MAX_I2C_ADDR)
-    SOFT_ERROR(PI_BAD_I2C_ADDR, "bad I2C address (%d)", i2cAddr);
+  if(!wfTracks)
+    return 0;
 
-  if(i2cFlags)
-    SOFT_ERROR(PI_BAD_FLAGS, "bad flags (0x%X)", i2cFlags);
+  status = waveReserve(&wf[1 - wfcur], &wfSize[1 - wfcur], wfSlotPulses);
 
-  slot = -1;
+  if(status < 0)
+    return status;
 
-  pthread_mutex_lock(&mutex);
+  n = 0;
 
-  for(i = 0; i < PI_I2C_SLOTS; i++) {
-    if(i2cInfo[i].state == PI_I2C_CLOSED) {
-      slot = i;
-      i2cInfo[slot].state = PI_I2C_RESERVED;
-      break;
-    }
+  in[0] = wf[wfcur];
+  num[0] = wfc[wfcur];
+
+  for(k = 1; k <= wfTracks; k++) {
+    in[k] = wfTrack + wfTrackPos[k - 1];
+    num[k] = wfTrackPos[k] - wfTrackPos[k - 1];
   }
 
-  pthread_mutex_unlock(&mutex);
+  for(k = 0; k <= wfTracks; k++) {
+    pos[k] = 0;
+    tNext[k] = 0;
 
-  if(slot < 0)
-    SOFT_ERROR(PI_NO_HANDLE, "no I2C handles");
+    if(num[k])
+      heap[n++] = k;
+  }
 
-  sprintf(dev, "/dev/i2c-%d", i2cBus);
+  out = wf[1 - wfcur];
+  outPos = 0;
+  cbs = 0;
+  tMax = 0;
 
-  if((fd = open(dev, O_RDWR)) < 0) {
-    /* try a modprobe */
+  while(n) {
+    t = tNext[heap[0]];
 
-    if(system("/sbin/modprobe i2c_dev") == -1) { /* ignore errors */
-    }
-    if(system("/sbin/modprobe i2c_bcm2835") == -1) { /* ignore errors */
-    }
+    out[outPos].gpioOn = 0;
+    out[outPos].gpioOff = 0;
+    out[outPos].flags = 0;
 
-    myGpioDelay(100000);
+    numDue = 0;
 
-    if((fd = open(dev, O_RDWR)) < 0) {
-      i2cInfo[slot].state = PI_I2C_CLOSED;
-      return PI_BAD_I2C_BUS;
-    }
-  }
+    while(n && (tNext[heap[0]] == t)) {
+      k = heap[0];
 
-  if(ioctl(fd, PI_I2C_SLAVE, i2cAddr) < 0) {
-    close(fd);
-    i2cInfo[slot].state = PI_I2C_CLOSED;
-    return PI_I2C_OPEN_FAILED;
-  }
+      out[outPos].gpioOn |= in[k][pos[k]].gpioOn;
+      out[outPos].gpioOff |= in[k][pos[k]].gpioOff;
+      out[outPos].flags |= in[k][pos[k]].flags;
 
-  if(ioctl(fd, PI_I2C_FUNCS, &funcs) < 0) {
-    funcs = -1; /* assume all smbus commands allowed */
-  }
+      due[numDue++] = k;
 
-  i2cInfo[slot].fd = fd;
-  i2cInfo[slot].addr = i2cAddr;
-  i2cInfo[slot].flags = i2cFlags;
-  i2cInfo[slot].funcs = funcs;
-  i2cInfo[slot].state = PI_I2C_OPENED;
+      heap[0] = heap[--n];
+      waveHeapDown(heap, n, 0, tNext);
+    }
 
-  return slot;
-}
+    for(i = 0; i < numDue; i++) {
+      k = due[i];
 
-int
-i2cClose(unsigned handle) {
-  DBG(DBG_USER, "handle=%d", handle);
+      tNext[k] = t + in[k][pos[k]].usDelay;
 
-  CHECK_INITED;
+      if(tMax < tNext[k])
+        tMax = tNext[k];
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      if(++pos[k] < num[k]) {
+        heap[n] = k;
+        waveHeapUp(heap, n++, tNext);
+      }
+    }
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+    /* the last pulse lasts until the longest track ends */
 
-  if(i2cInfo[handle].fd >= 0)
-    close(i2cInfo[handle].fd);
+    out[outPos].usDelay = (n ? tNext[heap[0]] : tMax) - t;
 
-  i2cInfo[handle].fd = -1;
-  i2cInfo[handle].state = PI_I2C_CLOSED;
+    cbs += waveDelayCBs(out[outPos].usDelay);
 
-  return 0;
-}
+    if(out[outPos].gpioOn || out[outPos].gpioOff)
+      cbs++;
 
-void
-i2cSwitchCombined(int setting) {
-  int fd;
-
-  DBG(DBG_USER, "setting=%d", setting);
-
-  fd = open(PI_I2C_COMBINED, O_WRONLY);
+    if(out[outPos].flags & WAVE_FLAG_READ)
+      cbs++;
 
-  if(fd >= 0) {
-    if(setting) {
-      if(write(fd, "1\n", 2) == -1) { /* ignore errors */
-      }
-    } else {
-      if(write(fd, "0\n", 2) == -1) { /* ignore errors */
-      }
-    }
+    if(out[outPos].flags & WAVE_FLAG_TICK)
+      cbs++;
 
-    close(fd);
+    outPos++;
   }
-}
-
-int
-i2cSegments(unsigned handle, pi_i2c_msg_t* segs, unsigned numSegs) {
-  int retval;
-  my_i2c_rdwr_ioctl_data_t rdwr;
-
-  DBG(DBG_USER, "handle=%d", handle);
 
-  CHECK_INITED;
+  /* report what the wave will use once normalised */
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  wfStats.rawCbs = cbs;
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  waveNormalise(out, outPos, NULL, &cbs);
 
-  if(segs == NULL)
-    SOFT_ERROR(PI_BAD_POINTER, "null segments");
+  wfStats.cbs = cbs;
 
-  if(numSegs > PI_I2C_RDRW_IOCTL_MAX_MSGS)
-    SOFT_ERROR(PI_TOO_MANY_SEGS, "too many segments (%d)", numSegs);
+  if(cbs > wfStats.highCbs)
+    wfStats.highCbs = cbs;
 
-  rdwr.msgs = segs;
-  rdwr.nmsgs = numSegs;
+  wfc[1 - wfcur] = outPos;
+  wfcur = 1 - wfcur;
 
-  retval = ioctl(i2cInfo[handle].fd, PI_I2C_RDWR, &rdwr);
+  wfTracks = 0;
+  wfTrackPos[0] = 0;
 
-  if(retval >= 0)
-    return retval;
-  else
-    return PI_BAD_I2C_SEG;
+  return 0;
 }
 
-int
-i2cZip(unsigned handle, char* inBuf, unsigned inLen, char* outBuf, unsigned outLen) {
-  int numSegs, inPos, outPos, status, bytes, flags, addr;
-  int esc, setesc;
-  pi_i2c_msg_t segs[PI_I2C_RDRW_IOCTL_MAX_MSGS];
+/* ----------------------------------------------------------------------- */
 
-  DBG(DBG_USER, "handle=%d inBuf=%s outBuf=%08" PRIXPTR " len=%d", handle, myBuf2Str(inLen, (char*)inBuf), (uintptr_t)outBuf, outLen);
+int
+rawWaveAddGeneric(unsigned numIn1, rawWave_t* in1) {
+  wfSlot_t* slot;
+  unsigned i, round, pulses, reads, ticks, maxPulses;
+  uint32_t tick, tEnd;
+  int status;
 
-  CHECK_INITED;
+  maxPulses = wfStats.maxPulses;
 
-  if(handle >= PI_I2C_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  if(numIn1 >= maxPulses)
+    return PI_TOO_MANY_PULSES;
 
-  if(i2cInfo[handle].state != PI_I2C_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  status = waveSlotReserve(((wfSlotPulses + numIn1) < maxPulses) ? (wfSlotPulses + numIn1) : maxPulses);
 
-  if(!inBuf || !inLen)
-    SOFT_ERROR(PI_BAD_POINTER, "input buffer can't be NULL");
+  if(status < 0)
+    return status;
 
-  if(!outBuf && outLen)
-    SOFT_ERROR(PI_BAD_POINTER, "output buffer can't be NULL");
+  /* first pass, count the pulses the merge will produce */
 
-  numSegs = 0;
+  pulses = wfSlotPulses;
+  reads = wfSlotReads;
+  ticks = wfSlotTicks;
 
-  inPos = 0;
-  outPos = 0;
-  status = 0;
+  tick = 0;
+  round = 0;
 
-  addr = i2cInfo[handle].addr;
-  flags = 0;
-  esc = 0;
-  setesc = 0;
+  for(i = 0; (i < numIn1) && (pulses < maxPulses); i++) {
+    if(i && !in1[i - 1].usDelay)
+      round++;
+    else
+      round = 0;
 
-  while(!status && (inPos < inLen)) {
-    DBG(DBG_INTERNAL, "status=%d inpos=%d inlen=%d cmd=%d addr=%d flags=%x", status, inPos, inLen, inBuf[inPos], addr, flags);
+    slot = waveSlotFind(tick, round + 1);
 
-    switch(inBuf[inPos++]) {
-      case PI_I2C_END: status = 1; break;
+    if(slot->gen != wfSlotGen) {
+      pulses++;
+      reads += (in1[i].flags & WAVE_FLAG_READ) ? 1 : 0;
+      ticks += (in1[i].flags & WAVE_FLAG_TICK) ? 1 : 0;
+    } else {
+      reads += (in1[i].flags & ~slot->flags & WAVE_FLAG_READ) ? 1 : 0;
+      ticks += (in1[i].flags & ~slot->flags & WAVE_FLAG_TICK) ? 1 : 0;
+    }
 
-      case PI_I2C_COMBINED_ON:
-        /* Run prior transactions before setting combined flag */
-        if(numSegs) {
-          status = i2cSegments(handle, segs, numSegs);
-          if(status >= 0)
-            status = 0; /* continue */
-          numSegs = 0;
-        }
-        i2cSwitchCombined(1);
-        break;
+    tick += in1[i].usDelay;
+  }
 
-      case PI_I2C_COMBINED_OFF:
-        /* Run prior transactions before clearing combined flag */
-        if(numSegs) {
-          status = i2cSegments(handle, segs, numSegs);
-          if(status >= 0)
-            status = 0; /* continue */
-          numSegs = 0;
-        }
-        i2cSwitchCombined(0);
-        break;
+  tEnd = tick;
 
-      case PI_I2C_ADDR:
-        addr = myI2CGetPar(inBuf, &inPos, inLen, &esc);
-        if(addr < 0)
-          status = PI_BAD_I2C_CMD;
-        break;
+  if((pulses >= maxPulses) || ((pulses + reads + ticks) >= NUM_WAVE_OOL))
+    return PI_TOO_MANY_PULSES;
 
-      case PI_I2C_FLAGS:
-        /* cheat to force two byte flags */
-        esc = 1;
-        flags = myI2CGetPar(inBuf, &inPos, inLen, &esc);
-        if(flags < 0)
-          status = PI_BAD_I2C_CMD;
-        break;
+  if((wfTracks == WF_MAX_TRACKS) || ((wfTrackPos[wfTracks] + numIn1) > maxPulses)) {
+    status = waveTrackMerge();
 
-      case PI_I2C_ESC: setesc = 1; break;
+    if(status < 0)
+      return status;
+  }
 
-      case PI_I2C_READ:
+  status = waveReserve(&wfTrack, &wfTrackSize, wfTrackPos[wfTracks] + numIn1);
 
-        bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+  if(status < 0)
+    return status;
 
-        if(bytes >= 0) {
-          if((bytes + outPos) < outLen) {
-            segs[numSegs].addr = addr;
-            segs[numSegs].flags = (flags | 1);
-            segs[numSegs].len = bytes;
-            segs[numSegs].buf = (uint8_t*)(outBuf + outPos);
-            outPos += bytes;
-            numSegs++;
-            if(numSegs >= PI_I2C_RDRW_IOCTL_MAX_MSGS) {
-              status = i2cSegments(handle, segs, numSegs);
-              if(status >= 0)
-                status = 0; /* continue */
-              numSegs = 0;
-            }
-          } else
-            status = PI_BAD_I2C_RLEN;
-        } else
-          status = PI_BAD_I2C_RLEN;
-        break;
+  /* second pass, claim the slots and queue the track */
 
-      case PI_I2C_WRITE:
+  tick = 0;
+  round = 0;
 
-        bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+  for(i = 0; i < numIn1; i++) {
+    if(i && !in1[i - 1].usDelay)
+      round++;
+    else
+      round = 0;
 
-        if(bytes >= 0) {
-          if((bytes + inPos) < inLen) {
-            segs[numSegs].addr = addr;
-            segs[numSegs].flags = (flags & 0xfffe);
-            segs[numSegs].len = bytes;
-            segs[numSegs].buf = (uint8_t*)(inBuf + inPos);
-            inPos += bytes;
-            numSegs++;
-            if(numSegs >= PI_I2C_RDRW_IOCTL_MAX_MSGS) {
-              status = i2cSegments(handle, segs, numSegs);
-              if(status >= 0)
-                status = 0; /* continue */
-              numSegs = 0;
-            }
-          } else
-            status = PI_BAD_I2C_WLEN;
-        } else
-          status = PI_BAD_I2C_WLEN;
-        break;
+    slot = waveSlotFind(tick, round + 1);
 
-      default: status = PI_BAD_I2C_CMD;
+    if(slot->gen != wfSlotGen) {
+      slot->tick = tick;
+      slot->round = round + 1;
+      slot->flags = 0;
+      slot->gen = wfSlotGen;
     }
 
-    if(setesc)
-      esc = 1;
-    else
-      esc = 0;
+    slot->flags |= in1[i].flags & (WAVE_FLAG_READ | WAVE_FLAG_TICK);
 
-    setesc = 0;
+    tick += in1[i].usDelay;
   }
 
-  if(status >= 0) {
-    if(numSegs)
-      status = i2cSegments(handle, segs, numSegs);
+  if(numIn1) {
+    memcpy(wfTrack + wfTrackPos[wfTracks], in1, sizeof(rawWave_t) * numIn1);
+    wfTrackPos[wfTracks + 1] = wfTrackPos[wfTracks] + numIn1;
+    wfTracks++;
   }
 
-  if(status >= 0)
-    status = outPos;
+  wfSlotPulses = pulses;
+  wfSlotReads = reads;
+  wfSlotTicks = ticks;
 
-  return status;
+  if(tEnd > wfSlotMicros)
+    wfSlotMicros = tEnd;
+
+  wfStats.micros = wfSlotMicros;
+
+  if(wfStats.micros > wfStats.highMicros)
+    wfStats.highMicros = wfStats.micros;
+
+  wfStats.pulses = pulses;
+
+  if(pulses > wfStats.highPulses)
+    wfStats.highPulses = pulses;
+
+  return pulses;
 }
 
 /* ======================================================================= */
 
-/*SPI */
+int
+i2cWriteQuick(unsigned handle, unsigned bit) {
+  int status;
 
-static uint32_t
-_spiTXBits(char* buf, int pos, int bitlen, int msbf) {
-  uint32_t bits = 0;
+  DBG(DBG_USER, "handle=%d bit=%d", handle, bit);
 
-  if(buf) {
-    if(bitlen <= 8)
-      bits = *(((uint8_t*)buf) + pos);
-    else if(bitlen <= 16)
-      bits = *(((uint16_t*)buf) + pos);
-    else
-      bits = *(((uint32_t*)buf) + pos);
+  CHECK_INITED;
 
-    if(msbf)
-      bits <<= (32 - bitlen);
-  }
+  if(handle >= PI_I2C_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  return bits;
-}
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-static void
-_spiRXBits(char* buf, int pos, int bitlen, int msbf, uint32_t bits) {
-  if(buf) {
-    if(!msbf)
-      bits >>= (32 - bitlen);
+  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_QUICK) == 0)
+    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-    if(bitlen <= 8)
-      *(((uint8_t*)buf) + pos) = bits;
-    else if(bitlen <= 16)
-      *(((uint16_t*)buf) + pos) = bits;
-    else
-      *(((uint32_t*)buf) + pos) = bits;
-  }
-}
+  if(bit > 1)
+    SOFT_ERROR(PI_BAD_PARAM, "bad bit (%d)", bit);
 
-static void
-spiACS(int channel, int on) {
-  int gpio;
+  status = my_smbus_access(i2cInfo[handle].fd, bit, 0, PI_I2C_SMBUS_QUICK, NULL);
 
-  switch(channel) {
-    case 0: gpio = PI_ASPI_CE0; break;
-    case 1: gpio = PI_ASPI_CE1; break;
-    default: gpio = PI_ASPI_CE2; break;
+  if(status < 0) {
+    DBG(DBG_USER, "error=%d (%m)", status);
+    return PI_I2C_WRITE_FAILED;
   }
-  myGpioWrite(gpio, on);
+
+  return status;
 }
 
-static void
-spiGoA(unsigned speed, /* bits per second */
-       uint32_t flags, /* flags           */
-       char* txBuf,    /* tx buffer       */
-       char* rxBuf,    /* rx buffer       */
-       unsigned count) /* number of bytes */
-{
-  int cs;
-  char bit_ir[4] = {1, 0, 0, 1}; /* read on rising edge */
-  char bit_or[4] = {0, 1, 1, 0}; /* write on rising edge */
-  char bit_ic[4] = {0, 0, 1, 1}; /* invert clock */
+int
+i2cReadByte(unsigned handle) {
+  union my_smbus_data data;
+  int status;
 
-  int mode, bitlen, txmsbf, rxmsbf, channel;
-  unsigned txCnt = 0;
-  unsigned rxCnt = 0;
-  uint32_t spiDefaults;
-  uint32_t statusReg;
-  int txFull, rxEmpty;
+  DBG(DBG_USER, "handle=%d", handle);
 
-  channel = PI_SPI_FLAGS_GET_CHANNEL(flags);
-  mode = PI_SPI_FLAGS_GET_MODE(flags);
+  CHECK_INITED;
 
-  bitlen = PI_SPI_FLAGS_GET_BITLEN(flags);
+  if(handle >= PI_I2C_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(!bitlen)
-    bitlen = 8;
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  /* correct count for word size */
+  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_BYTE) == 0)
+    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-  if(bitlen > 8)
-    count /= 2;
-  if(bitlen > 16)
-    count /= 2;
+  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_READ, 0, PI_I2C_SMBUS_BYTE, &data);
 
-  txmsbf = !PI_SPI_FLAGS_GET_TX_LSB(flags);
-  rxmsbf = !PI_SPI_FLAGS_GET_RX_LSB(flags);
+  if(status < 0) {
+    DBG(DBG_USER, "error=%d (%m)", status);
+    return PI_I2C_READ_FAILED;
+  }
 
-  cs = PI_SPI_FLAGS_GET_CSPOLS(flags) & (1 << channel);
+  return 0xFF & data.byte;
+}
 
-  spiDefaults = AUXSPI_CNTL0_SPEED((125000000 / speed) - 1) | AUXSPI_CNTL0_IN_RISING(bit_ir[mode]) | AUXSPI_CNTL0_OUT_RISING(bit_or[mode]) |
-                AUXSPI_CNTL0_INVERT_CLK(bit_ic[mode]) | AUXSPI_CNTL0_MSB_FIRST(txmsbf) | AUXSPI_CNTL0_SHIFT_LEN(bitlen);
+int
+i2cWriteByte(unsigned handle, unsigned bVal) {
+  int status;
 
-  if(!count) {
-    auxReg[AUX_SPI0_CNTL0_REG] = AUXSPI_CNTL0_ENABLE | AUXSPI_CNTL0_CLR_FIFOS;
+  DBG(DBG_USER, "handle=%d bVal=%d", handle, bVal);
 
-    myGpioDelay(10);
+  CHECK_INITED;
 
-    auxReg[AUX_SPI0_CNTL0_REG] = AUXSPI_CNTL0_ENABLE | spiDefaults;
+  if(handle >= PI_I2C_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-    auxReg[AUX_SPI0_CNTL1_REG] = AUXSPI_CNTL1_MSB_FIRST(rxmsbf);
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-    return;
+  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_BYTE) == 0)
+    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+
+  if(bVal > 0xFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad bVal (%d)", bVal);
+
+  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, bVal, PI_I2C_SMBUS_BYTE, NULL);
+
+  if(status < 0) {
+    DBG(DBG_USER, "error=%d (%m)", status);
+    return PI_I2C_WRITE_FAILED;
   }
 
-  auxReg[AUX_SPI0_CNTL0_REG] = AUXSPI_CNTL0_ENABLE | spiDefaults;
+  return status;
+}
 
-  auxReg[AUX_SPI0_CNTL1_REG] = AUXSPI_CNTL1_MSB_FIRST(rxmsbf);
+int
+i2cReadByteData(unsigned handle, unsigned reg) {
+  union my_smbus_data data;
+  int status;
 
-  spiACS(channel, cs);
+  DBG(DBG_USER, "handle=%d reg=%d", handle, reg);
 
-  while((txCnt < count) || (rxCnt < count)) {
-    statusReg = auxReg[AUX_SPI0_STAT_REG];
+  CHECK_INITED;
 
-    rxEmpty = statusReg & AUXSPI_STAT_RX_EMPTY;
+  if(handle >= PI_I2C_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-    txFull = (((statusReg >> 28) & 15) > 2);
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-    if(rxCnt < count) {
-      if(!rxEmpty) {
-        _spiRXBits(rxBuf, rxCnt++, bitlen, rxmsbf, auxReg[AUX_SPI0_IO_REG]);
-      }
-    }
+  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_BYTE_DATA) == 0)
+    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-    if(txCnt < count) {
-      if(!txFull) {
-        if(txCnt != (count - 1)) {
-          auxReg[AUX_SPI0_TX_HOLD] = _spiTXBits(txBuf, txCnt++, bitlen, txmsbf);
-        } else {
-          auxReg[AUX_SPI0_IO_REG] = _spiTXBits(txBuf, txCnt++, bitlen, txmsbf);
-        }
-      }
-    }
-  }
+  if(reg > 0xFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-  while((auxReg[AUX_SPI0_STAT_REG] & AUXSPI_STAT_BUSY))
-    ;
+  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_READ, reg, PI_I2C_SMBUS_BYTE_DATA, &data);
+
+  if(status < 0) {
+    DBG(DBG_USER, "error=%d (%m)", status);
+    return PI_I2C_READ_FAILED;
+  }
 
-  spiACS(channel, !cs);
+  return 0xFF & data.byte;
 }
 
-static void
-spiGoS(unsigned speed, uint32_t flags, char* txBuf, char* rxBuf, unsigned count) {
-  unsigned txCnt = 0;
-  unsigned rxCnt = 0;
-  unsigned cnt, cnt4w, cnt3w;
-  uint32_t spiDefaults;
-  unsigned mode, channel, cspol, cspols, flag3w, ren3w;
+int
+i2cWriteByteData(unsigned handle, unsigned reg, unsigned bVal) {
+  union my_smbus_data data;
 
-  channel = PI_SPI_FLAGS_GET_CHANNEL(flags);
-  mode = PI_SPI_FLAGS_GET_MODE(flags);
-  cspols = PI_SPI_FLAGS_GET_CSPOLS(flags);
-  cspol = (cspols >> channel) & 1;
-  flag3w = PI_SPI_FLAGS_GET_3WIRE(flags);
-  ren3w = PI_SPI_FLAGS_GET_3WREN(flags);
+  int status;
 
-  spiDefaults = SPI_CS_MODE(mode) | SPI_CS_CSPOLS(cspols) | SPI_CS_CS(channel) | SPI_CS_CSPOL(cspol) | SPI_CS_CLEAR(3);
+  DBG(DBG_USER, "handle=%d reg=%d bVal=%d", handle, reg, bVal);
 
-  spiReg[SPI_DLEN] = 2; /* undocumented, stops inter-byte gap */
+  CHECK_INITED;
 
-  spiReg[SPI_CS] = spiDefaults; /* stop */
+  if(handle >= PI_I2C_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(!count)
-    return;
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(flag3w) {
-    if(ren3w < count) {
-      cnt4w = ren3w;
-      cnt3w = count - ren3w;
-    } else {
-      cnt4w = count;
-      cnt3w = 0;
-    }
-  } else {
-    cnt4w = count;
-    cnt3w = 0;
-  }
+  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_BYTE_DATA) == 0)
+    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-  spiReg[SPI_CLK] = 250000000 / speed;
+  if(reg > 0xFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-  spiReg[SPI_CS] = spiDefaults | SPI_CS_TA; /* start */
+  if(bVal > 0xFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad bVal (%d)", bVal);
 
-  cnt = cnt4w;
+  data.byte = bVal;
 
-  while((txCnt < cnt) || (rxCnt < cnt)) {
-    while((rxCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_RXD))) {
-      if(rxBuf)
-        rxBuf[rxCnt] = spiReg[SPI_FIFO];
-      else
-        spi_dummy = spiReg[SPI_FIFO];
-      rxCnt++;
-    }
+  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg, PI_I2C_SMBUS_BYTE_DATA, &data);
 
-    while((txCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_TXD))) {
-      if(txBuf)
-        spiReg[SPI_FIFO] = txBuf[txCnt];
-      else
-        spiReg[SPI_FIFO] = 0;
-      txCnt++;
-    }
+  if(status < 0) {
+    DBG(DBG_USER, "error=%d (%m)", status);
+    return PI_I2C_WRITE_FAILED;
   }
 
-  while(!(spiReg[SPI_CS] & SPI_CS_DONE))
-    ;
+  return status;
+}
 
-  /* now switch to 3-wire bus */
+int
+i2cReadWordData(unsigned handle, unsigned reg) {
+  union my_smbus_data data;
+  int status;
 
-  cnt += cnt3w;
+  DBG(DBG_USER, "handle=%d reg=%d", handle, reg);
 
-  spiReg[SPI_CS] |= SPI_CS_REN;
+  CHECK_INITED;
 
-  while((txCnt < cnt) || (rxCnt < cnt)) {
-    while((rxCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_RXD))) {
-      if(rxBuf)
-        rxBuf[rxCnt] = spiReg[SPI_FIFO];
-      else
-        spi_dummy = spiReg[SPI_FIFO];
-      rxCnt++;
-    }
+  if(handle >= PI_I2C_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-    while((txCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_TXD))) {
-      if(txBuf)
-        spiReg[SPI_FIFO] = txBuf[txCnt];
-      else
-        spiReg[SPI_FIFO] = 0;
-      txCnt++;
-    }
-  }
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  while(!(spiReg[SPI_CS] & SPI_CS_DONE))
-    ;
+  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_WORD_DATA) == 0)
+    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-  spiReg[SPI_CS] = spiDefaults; /* stop */
-}
+  if(reg > 0xFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-static void
-spiGo(unsigned speed, uint32_t flags, char* txBuf, char* rxBuf, unsigned count) {
-  static pthread_mutex_t main_mutex = PTHREAD_MUTEX_INITIALIZER;
-  static pthread_mutex_t aux_mutex = PTHREAD_MUTEX_INITIALIZER;
+  status = (my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_READ, reg, PI_I2C_SMBUS_WORD_DATA, &data));
 
-  if(PI_SPI_FLAGS_GET_AUX_SPI(flags)) {
-    pthread_mutex_lock(&aux_mutex);
-    spiGoA(speed, flags, txBuf, rxBuf, count);
-    pthread_mutex_unlock(&aux_mutex);
-  } else {
-    pthread_mutex_lock(&main_mutex);
-    spiGoS(speed, flags, txBuf, rxBuf, count);
-    pthread_mutex_unlock(&main_mutex);
+  if(status < 0) {
+    DBG(DBG_USER, "error=%d (%m)", status);
+    return PI_I2C_READ_FAILED;
   }
+
+  return 0xFFFF & data.word;
 }
 
-static int
-spiAnyOpen(uint32_t flags) {
-  int i, aux;
+int
+i2cWriteWordData(unsigned handle, unsigned reg, unsigned wVal) {
+  union my_smbus_data data;
 
-  aux = PI_SPI_FLAGS_GET_AUX_SPI(flags);
+  int status;
 
-  for(i = 0; i < PI_SPI_SLOTS; i++) {
-    if((spiInfo[i].state == PI_SPI_OPENED) && (PI_SPI_FLAGS_GET_AUX_SPI(spiInfo[i].flags) == aux))
-      return 1;
-  }
-  return 0;
-}
+  DBG(DBG_USER, "handle=%d reg=%d wVal=%d", handle, reg, wVal);
 
-static void
-spiInit(uint32_t flags) {
-  uint32_t resvd, cspols;
+  CHECK_INITED;
 
-  resvd = PI_SPI_FLAGS_GET_RESVD(flags);
-  cspols = PI_SPI_FLAGS_GET_CSPOLS(flags);
+  if(handle >= PI_I2C_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(PI_SPI_FLAGS_GET_AUX_SPI(flags)) {
-    /* enable module and access to registers */
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-    auxReg[AUX_ENABLES] |= AUXENB_SPI1;
+  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_WORD_DATA) == 0)
+    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-    /* save original state */
+  if(reg > 0xFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-    old_mode_ace0 = gpioGetMode(PI_ASPI_CE0);
-    old_mode_ace1 = gpioGetMode(PI_ASPI_CE1);
-    old_mode_ace2 = gpioGetMode(PI_ASPI_CE2);
-    old_mode_asclk = gpioGetMode(PI_ASPI_SCLK);
-    old_mode_amiso = gpioGetMode(PI_ASPI_MISO);
-    old_mode_amosi = gpioGetMode(PI_ASPI_MOSI);
+  if(wVal > 0xFFFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad wVal (%d)", wVal);
 
-    old_spi_cntl0 = auxReg[AUX_SPI0_CNTL0_REG];
-    old_spi_cntl1 = auxReg[AUX_SPI0_CNTL1_REG];
+  data.word = wVal;
 
-    /* manually control auxiliary SPI chip selects */
+  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg, PI_I2C_SMBUS_WORD_DATA, &data);
 
-    if(!(resvd & 1)) {
-      myGpioSetMode(PI_ASPI_CE0, PI_OUTPUT);
-      myGpioWrite(PI_ASPI_CE0, !(cspols & 1));
-    }
+  if(status < 0) {
+    DBG(DBG_USER, "error=%d (%m)", status);
+    return PI_I2C_WRITE_FAILED;
+  }
 
-    if(!(resvd & 2)) {
-      myGpioSetMode(PI_ASPI_CE1, PI_OUTPUT);
-      myGpioWrite(PI_ASPI_CE1, !(cspols & 2));
-    }
+  return status;
+}
 
-    if(!(resvd & 4)) {
-      myGpioSetMode(PI_ASPI_CE2, PI_OUTPUT);
-      myGpioWrite(PI_ASPI_CE2, !(cspols & 4));
-    }
+int
+i2cProcessCall(unsigned handle, unsigned reg, unsigned wVal) {
+  union my_smbus_data data;
+  int status;
 
-    /* set gpios to SPI mode */
+  DBG(DBG_USER, "handle=%d reg=%d wVal=%d", handle, reg, wVal);
 
-    myGpioSetMode(PI_ASPI_SCLK, PI_ALT4);
-    myGpioSetMode(PI_ASPI_MISO, PI_ALT4);
-    myGpioSetMode(PI_ASPI_MOSI, PI_ALT4);
-  } else {
-    /* save original state */
+  CHECK_INITED;
 
-    old_mode_ce0 = gpioGetMode(PI_SPI_CE0);
-    old_mode_ce1 = gpioGetMode(PI_SPI_CE1);
-    old_mode_sclk = gpioGetMode(PI_SPI_SCLK);
-    old_mode_miso = gpioGetMode(PI_SPI_MISO);
-    old_mode_mosi = gpioGetMode(PI_SPI_MOSI);
+  if(handle >= PI_I2C_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-    old_spi_cs = spiReg[SPI_CS];
-    old_spi_clk = spiReg[SPI_CLK];
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-    /* set gpios to SPI mode */
+  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_PROC_CALL) == 0)
+    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-    if(!(resvd & 1))
-      myGpioSetMode(PI_SPI_CE0, PI_ALT0);
-    if(!(resvd & 2))
-      myGpioSetMode(PI_SPI_CE1, PI_ALT0);
+  if(reg > 0xFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-    myGpioSetMode(PI_SPI_SCLK, PI_ALT0);
-    myGpioSetMode(PI_SPI_MISO, PI_ALT0);
-    myGpioSetMode(PI_SPI_MOSI, PI_ALT0);
+  if(wVal > 0xFFFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad wVal (%d)", wVal);
+
+  data.word = wVal;
+
+  status = (my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg, PI_I2C_SMBUS_PROC_CALL, &data));
+
+  if(status < 0) {
+    DBG(DBG_USER, "error=%d (%m)", status);
+    return PI_I2C_READ_FAILED;
   }
-}
 
-static void
-spiTerm(uint32_t flags) {
-  int resvd;
+  return 0xFFFF & data.word;
+}
 
-  resvd = PI_SPI_FLAGS_GET_RESVD(flags);
+int
+i2cReadBlockData(unsigned handle, unsigned reg, char* buf) {
+  union my_smbus_data data;
 
-  if(PI_SPI_FLAGS_GET_AUX_SPI(flags)) {
-    /* disable module and access to registers */
+  int i, status;
 
-    auxReg[AUX_ENABLES] &= (~AUXENB_SPI1);
+  DBG(DBG_USER, "handle=%d reg=%d buf=%08" PRIXPTR, handle, reg, (uintptr_t)buf);
 
-    /* restore original state */
+  CHECK_INITED;
 
-    if(!(resvd & 1))
-      myGpioSetMode(PI_ASPI_CE0, old_mode_ace0);
-    if(!(resvd & 2))
-      myGpioSetMode(PI_ASPI_CE1, old_mode_ace1);
-    if(!(resvd & 4))
-      myGpioSetMode(PI_ASPI_CE2, old_mode_ace2);
+  if(handle >= PI_I2C_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-    myGpioSetMode(PI_ASPI_SCLK, old_mode_asclk);
-    myGpioSetMode(PI_ASPI_MISO, old_mode_amiso);
-    myGpioSetMode(PI_ASPI_MOSI, old_mode_amosi);
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-    auxReg[AUX_SPI0_CNTL0_REG] = old_spi_cntl0;
-    auxReg[AUX_SPI0_CNTL1_REG] = old_spi_cntl1;
-  } else {
-    /* restore original state */
+  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_BLOCK_DATA) == 0)
+    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-    if(!(resvd & 1))
-      myGpioSetMode(PI_SPI_CE0, old_mode_ce0);
-    if(!(resvd & 2))
-      myGpioSetMode(PI_SPI_CE1, old_mode_ce1);
+  if(reg > 0xFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-    myGpioSetMode(PI_SPI_SCLK, old_mode_sclk);
-    myGpioSetMode(PI_SPI_MISO, old_mode_miso);
-    myGpioSetMode(PI_SPI_MOSI, old_mode_mosi);
+  status = (my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_READ, reg, PI_I2C_SMBUS_BLOCK_DATA, &data));
 
-    spiReg[SPI_CS] = old_spi_cs;
-    spiReg[SPI_CLK] = old_spi_clk;
+  if(status < 0) {
+    DBG(DBG_USER, "error=%d (%m)", status);
+    return PI_I2C_READ_FAILED;
+  } else {
+    if(data.block[0] <= PI_I2C_SMBUS_BLOCK_MAX) {
+      for(i = 0; i < data.block[0]; i++) buf[i] = data.block[i + 1];
+      return data.block[0];
+    } else
+      return PI_I2C_READ_FAILED;
   }
 }
 
 int
-spiOpen(unsigned spiChan, unsigned baud, unsigned spiFlags) {
-  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-  int i, slot;
+i2cWriteBlockData(unsigned handle, unsigned reg, char* buf, unsigned count) {
+  union my_smbus_data data;
 
-  DBG(DBG_USER, "spiChan=%d baud=%d spiFlags=0x%X", spiChan, baud, spiFlags);
+  int i, status;
 
-  CHECK_INITED;
+  DBG(DBG_USER, "handle=%d reg=%d count=%d [%s]", handle, reg, count, myBuf2Str(count, buf));
 
-  if(PI_SPI_FLAGS_GET_AUX_SPI(spiFlags)) {
-    if(gpioHardwareRevision() < 16)
-      SOFT_ERROR(PI_NO_AUX_SPI, "no auxiliary SPI on Pi A or B");
+  CHECK_INITED;
 
-    i = PI_NUM_AUX_SPI_CHANNEL;
-  } else
-    i = PI_NUM_STD_SPI_CHANNEL;
+  if(handle >= PI_I2C_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(spiChan >= i)
-    SOFT_ERROR(PI_BAD_SPI_CHANNEL, "bad spiChan (%d)", spiChan);
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if((baud < PI_SPI_MIN_BAUD) || (baud > PI_SPI_MAX_BAUD))
-    SOFT_ERROR(PI_BAD_SPI_SPEED, "bad baud (%d)", baud);
+  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_BLOCK_DATA) == 0)
+    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-  if(spiFlags > (1 << 22))
-    SOFT_ERROR(PI_BAD_FLAGS, "bad spiFlags (0x%X)", spiFlags);
+  if(reg > 0xFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-  if(!spiAnyOpen(spiFlags)) /* initialise on first open */
-  {
-    spiInit(spiFlags);
-    spiGo(baud, spiFlags, NULL, NULL, 0);
-  }
+  if((count < 1) || (count > 32))
+    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
 
-  slot = -1;
+  for(i = 1; i <= count; i++) data.block[i] = buf[i - 1];
+  data.block[0] = count;
 
-  pthread_mutex_lock(&mutex);
+  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg, PI_I2C_SMBUS_BLOCK_DATA, &data);
 
-  for(i = 0; i < PI_SPI_SLOTS; i++) {
-    if(spiInfo[i].state == PI_SPI_CLOSED) {
-      slot = i;
-      spiInfo[slot].state = PI_SPI_RESERVED;
-      break;
-    }
+  if(status < 0) {
+    DBG(DBG_USER, "error=%d (%m)", status);
+    return PI_I2C_WRITE_FAILED;
   }
 
-  pthread_mutex_unlock(&mutex);
-
-  if(slot < 0)
-    SOFT_ERROR(PI_NO_HANDLE, "no SPI handles");
-
-  spiInfo[slot].speed = baud;
-  spiInfo[slot].flags = spiFlags | PI_SPI_FLAGS_CHANNEL(spiChan);
-  spiInfo[slot].state = PI_SPI_OPENED;
-
-  return slot;
+  return status;
 }
 
 int
-spiClose(unsigned handle) {
-  DBG(DBG_USER, "handle=%d", handle);
+i2cBlockProcessCall(unsigned handle, unsigned reg, char* buf, unsigned count) {
+  union my_smbus_data data;
+
+  int i, status;
+
+  DBG(DBG_USER, "handle=%d reg=%d count=%d [%s]", handle, reg, count, myBuf2Str(count, buf));
 
   CHECK_INITED;
 
-  if(handle >= PI_SPI_SLOTS)
+  if(handle >= PI_I2C_SLOTS)
     SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(spiInfo[handle].state != PI_SPI_OPENED)
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
     SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  spiInfo[handle].state = PI_SPI_CLOSED;
-
-  if(!spiAnyOpen(spiInfo[handle].flags))
-    spiTerm(spiInfo[handle].flags); /* terminate on last close */
-
-  return 0;
-}
-
-int
-spiRead(unsigned handle, char* buf, unsigned count) {
-  DBG(DBG_USER, "handle=%d count=%d [%s]", handle, count, myBuf2Str(count, buf));
-
-  CHECK_INITED;
+  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_PROC_CALL) == 0)
+    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-  if(handle >= PI_SPI_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  if(reg > 0xFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-  if(spiInfo[handle].state != PI_SPI_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  if((count < 1) || (count > 32))
+    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
 
-  if(count > PI_MAX_SPI_DEVICE_COUNT)
-    SOFT_ERROR(PI_BAD_SPI_COUNT, "bad count (%d)", count);
+  for(i = 1; i <= count; i++) data.block[i] = buf[i - 1];
+  data.block[0] = count;
 
-  spiGo(spiInfo[handle].speed, spiInfo[handle].flags, NULL, buf, count);
+  status = (my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg, PI_I2C_SMBUS_BLOCK_PROC_CALL, &data));
 
-  return count;
+  if(status < 0) {
+    DBG(DBG_USER, "error=%d (%m)", status);
+    return PI_I2C_READ_FAILED;
+  } else {
+    if(data.block[0] <= PI_I2C_SMBUS_BLOCK_MAX) {
+      for(i = 0; i < data.block[0]; i++) buf[i] = data.block[i + 1];
+      return data.block[0];
+    } else
+      return PI_I2C_READ_FAILED;
+  }
 }
 
 int
-spiWrite(unsigned handle, char* buf, unsigned count) {
-  DBG(DBG_USER, "handle=%d count=%d [%s]", handle, count, myBuf2Str(count, buf));
+i2cReadI2CBlockData(unsigned handle, unsigned reg, char* buf, unsigned count) {
+  union my_smbus_data data;
+
+  int i, status;
+  uint32_t size;
+
+  DBG(DBG_USER, "handle=%d reg=%d count=%d buf=%08" PRIXPTR, handle, reg, count, (uintptr_t)buf);
 
   CHECK_INITED;
 
-  if(handle >= PI_SPI_SLOTS)
+  if(handle >= PI_I2C_SLOTS)
     SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(spiInfo[handle].state != PI_SPI_OPENED)
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
     SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(count > PI_MAX_SPI_DEVICE_COUNT)
-    SOFT_ERROR(PI_BAD_SPI_COUNT, "bad count (%d)", count);
+  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_READ_I2C_BLOCK) == 0)
+    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
 
-  spiGo(spiInfo[handle].speed, spiInfo[handle].flags, buf, NULL, count);
+  if(reg > 0xFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
 
-  return count;
+  if((count < 1) || (count > 32))
+    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+
+  if(count == 32)
+    size = PI_I2C_SMBUS_I2C_BLOCK_BROKEN;
+  else
+    size = PI_I2C_SMBUS_I2C_BLOCK_DATA;
+
+  data.block[0] = count;
+
+  status = (my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_READ, reg, size, &data));
+
+  if(status < 0) {
+    DBG(DBG_USER, "error=%d (%m)", status);
+    return PI_I2C_READ_FAILED;
+  } else {
+    if(data.block[0] <= PI_I2C_SMBUS_I2C_BLOCK_MAX) {
+      for(i = 0; i < data.block[0]; i++) buf[i] = data.block[i + 1];
+      return data.block[0];
+    } else
+      return PI_I2C_READ_FAILED;
+  }
 }
 
 int
-spiXfer(unsigned handle, char* txBuf, char* rxBuf, unsigned count) {
-  DBG(DBG_USER, "handle=%d count=%d [%s]", handle, count, myBuf2Str(count, txBuf));
+i2cWriteI2CBlockData(unsigned handle, unsigned reg, char* buf, unsigned count) {
+  union my_smbus_data data;
+
+  int i, status;
+
+  DBG(DBG_USER, "handle=%d reg=%d count=%d [%s]", handle, reg, count, myBuf2Str(count, buf));
 
   CHECK_INITED;
 
-  if(handle >= PI_SPI_SLOTS)
+  if(handle >= PI_I2C_SLOTS)
     SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(spiInfo[handle].state != PI_SPI_OPENED)
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
     SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(count > PI_MAX_SPI_DEVICE_COUNT)
-    SOFT_ERROR(PI_BAD_SPI_COUNT, "bad count (%d)", count);
+  if((i2cInfo[handle].funcs & PI_I2C_FUNC_SMBUS_WRITE_I2C_BLOCK) == 0)
+    SOFT_ERROR(PI_BAD_SMBUS_CMD, "SMBUS command not supported by driver");
+
+  if(reg > 0xFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad reg (%d)", reg);
+
+  if((count < 1) || (count > 32))
+    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
 
-  spiGo(spiInfo[handle].speed, spiInfo[handle].flags, txBuf, rxBuf, count);
+  for(i = 1; i <= count; i++) data.block[i] = buf[i - 1];
 
-  return count;
+  data.block[0] = count;
+
+  status = my_smbus_access(i2cInfo[handle].fd, PI_I2C_SMBUS_WRITE, reg, PI_I2C_SMBUS_I2C_BLOCK_BROKEN, &data);
+
+  if(status < 0) {
+    DBG(DBG_USER, "error=%d (%m)", status);
+    return PI_I2C_WRITE_FAILED;
+  }
+
+  return status;
 }
 
-/* ======================================================================= */
+int
+i2cWriteDevice(unsigned handle, char* buf, unsigned count) {
+  int bytes;
+
+  DBG(DBG_USER, "handle=%d count=%d [%s]", handle, count, myBuf2Str(count, buf));
+
+  CHECK_INITED;
+
+  if(handle >= PI_I2C_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if((count < 1) || (count > PI_MAX_I2C_DEVICE_COUNT))
+    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+
+  bytes = write(i2cInfo[handle].fd, buf, count);
+
+  if(bytes != count) {
+    DBG(DBG_USER, "error=%d (%m)", bytes);
+    return PI_I2C_WRITE_FAILED;
+  }
+
+  return 0;
+}
 
 int
-serOpen(char* tty, unsigned serBaud, unsigned serFlags) {
-  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-  struct termios new;
-  int speed;
-  int fd;
-  int i, slot;
+i2cReadDevice(unsigned handle, char* buf, unsigned count) {
+  int bytes;
 
-  DBG(DBG_USER, "tty=%s serBaud=%d serFlags=0x%X", tty, serBaud, serFlags);
+  DBG(DBG_USER, "handle=%d count=%d buf=%08" PRIXPTR, handle, count, (uintptr_t)buf);
 
-  SER_CHECK_INITED;
+  CHECK_INITED;
 
-  if(strncmp("/dev/tty", tty, 8) && strncmp("/dev/serial", tty, 11))
-    SOFT_ERROR(PI_BAD_SER_DEVICE, "bad device (%s)", tty);
+  if(handle >= PI_I2C_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  switch(serBaud) {
-    case 50: speed = B50; break;
-    case 75: speed = B75; break;
-    case 110: speed = B110; break;
-    case 134: speed = B134; break;
-    case 150: speed = B150; break;
-    case 200: speed = B200; break;
-    case 300: speed = B300; break;
-    case 600: speed = B600; break;
-    case 1200: speed = B1200; break;
-    case 1800: speed = B1800; break;
-    case 2400: speed = B2400; break;
-    case 4800: speed = B4800; break;
-    case 9600: speed = B9600; break;
-    case 19200: speed = B19200; break;
-    case 38400: speed = B38400; break;
-    case 57600: speed = B57600; break;
-    case 115200: speed = B115200; break;
-    case 230400: speed = B230400; break;
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-    default: SOFT_ERROR(PI_BAD_SER_SPEED, "bad speed (%d)", serBaud);
+  if((count < 1) || (count > PI_MAX_I2C_DEVICE_COUNT))
+    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+
+  bytes = read(i2cInfo[handle].fd, buf, count);
+
+  if(bytes != count) {
+    DBG(DBG_USER, "error=%d (%m)", bytes);
+    return PI_I2C_READ_FAILED;
   }
 
-  if(serFlags)
-    SOFT_ERROR(PI_BAD_FLAGS, "bad flags (0x%X)", serFlags);
+  return bytes;
+}
+
+int
+i2cOpen(unsigned i2cBus, unsigned i2cAddr, unsigned i2cFlags) {
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  char dev[32];
+  int i, slot, fd;
+  uint32_t funcs;
+
+  DBG(DBG_USER, "i2cBus=%d i2cAddr=%d flags=0x%X", i2cBus, i2cAddr, i2cFlags);
+
+  CHECK_INITED;
+
+  if(i2cAddr > PI_MAX_I2C_ADDR)
+    SOFT_ERROR(PI_BAD_I2C_ADDR, "bad I2C address (%d)", i2cAddr);
+
+  if(i2cFlags)
+    SOFT_ERROR(PI_BAD_FLAGS, "bad flags (0x%X)", i2cFlags);
 
   slot = -1;
 
   pthread_mutex_lock(&mutex);
 
-  for(i = 0; i < PI_SER_SLOTS; i++) {
-    if(serInfo[i].state == PI_SER_CLOSED) {
+  for(i = 0; i < PI_I2C_SLOTS; i++) {
+    if(i2cInfo[i].state == PI_I2C_CLOSED) {
       slot = i;
-      serInfo[slot].state = PI_SER_RESERVED;
+      i2cInfo[slot].state = PI_I2C_RESERVED;
       break;
     }
   }
@@ -4614,1028 +5238,2760 @@ serOpen(char* tty, unsigned serBaud, unsigned serFlags) {
   pthread_mutex_unlock(&mutex);
 
   if(slot < 0)
-    SOFT_ERROR(PI_NO_HANDLE, "no serial handles");
+    SOFT_ERROR(PI_NO_HANDLE, "no I2C handles");
 
-  if((fd = open(tty, O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK)) == -1) {
-    serInfo[slot].state = PI_SER_CLOSED;
-    return PI_SER_OPEN_FAILED;
-  }
+  sprintf(dev, "/dev/i2c-%d", i2cBus);
 
-  tcgetattr(fd, &new);
+  if((fd = open(dev, O_RDWR)) < 0) {
+    /* try a modprobe */
 
-  cfmakeraw(&new);
+    if(system("/sbin/modprobe i2c_dev") == -1) { /* ignore errors */
+    }
+    if(system("/sbin/modprobe i2c_bcm2835") == -1) { /* ignore errors */
+    }
 
-  cfsetispeed(&new, speed);
-  cfsetospeed(&new, speed);
+    myGpioDelay(100000);
 
-  new.c_cc[VMIN] = 0;
-  new.c_cc[VTIME] = 0;
+    if((fd = open(dev, O_RDWR)) < 0) {
+      i2cInfo[slot].state = PI_I2C_CLOSED;
+      return PI_BAD_I2C_BUS;
+    }
+  }
 
-  tcflush(fd, TCIFLUSH);
-  tcsetattr(fd, TCSANOW, &new);
+  if(ioctl(fd, PI_I2C_SLAVE, i2cAddr) < 0) {
+    close(fd);
+    i2cInfo[slot].state = PI_I2C_CLOSED;
+    return PI_I2C_OPEN_FAILED;
+  }
 
-  // fcntl(fd, F_SETFL, O_RDWR);
+  if(ioctl(fd, PI_I2C_FUNCS, &funcs) < 0) {
+    funcs = -1; /* assume all smbus commands allowed */
+  }
 
-  serInfo[slot].fd = fd;
-  serInfo[slot].flags = serFlags;
-  serInfo[slot].state = PI_SER_OPENED;
+  i2cInfo[slot].fd = fd;
+  i2cInfo[slot].addr = i2cAddr;
+  i2cInfo[slot].flags = i2cFlags;
+  i2cInfo[slot].funcs = funcs;
+  i2cInfo[slot].bus = i2cBus;
+  i2cInfo[slot].state = PI_I2C_OPENED;
 
   return slot;
 }
 
 int
-serClose(unsigned handle) {
+i2cClose(unsigned handle) {
+  int i, fd, running;
+
   DBG(DBG_USER, "handle=%d", handle);
 
-  SER_CHECK_INITED;
+  CHECK_INITED;
 
-  if(handle >= PI_SER_SLOTS)
+  if(handle >= PI_I2C_SLOTS)
     SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(serInfo[handle].state != PI_SER_OPENED)
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
     SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(serInfo[handle].fd >= 0)
-    close(serInfo[handle].fd);
+  pthread_mutex_lock(&i2cJobMutex);
 
-  serInfo[handle].fd = -1;
-  serInfo[handle].state = PI_SER_CLOSED;
+  /* queued async jobs on the handle fail, a running one is let finish */
 
-  return 0;
-}
+  for(i = 0; i < PI_I2C_MAX_TICKETS; i++) {
+    if((i2cJob[i].state == I2C_JOB_QUEUED) && (i2cJob[i].handle == handle)) {
+      i2cJob[i].result = PI_BAD_HANDLE;
+      i2cJob[i].state = I2C_JOB_DONE;
 
-int
-serWriteByte(unsigned handle, unsigned bVal) {
-  char c;
+      if(i2cJob[i].event <= PI_MAX_EVENT)
+        eventTrigger(i2cJob[i].event);
+    }
+  }
 
-  DBG(DBG_USER, "handle=%d bVal=%d", handle, bVal);
+  pthread_cond_broadcast(&i2cJobDone);
 
-  SER_CHECK_INITED;
+  do {
+    running = 0;
 
-  if(handle >= PI_SER_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+    for(i = 0; i < PI_I2C_MAX_TICKETS; i++)
+      if((i2cJob[i].state == I2C_JOB_RUNNING) && (i2cJob[i].handle == handle))
+        running = 1;
 
-  if(serInfo[handle].state != PI_SER_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+    if(running)
+      pthread_cond_wait(&i2cJobDone, &i2cJobMutex);
+  } while(running);
 
-  if(bVal > 0xFF)
-    SOFT_ERROR(PI_BAD_PARAM, "bad parameter (%d)", bVal);
+  fd = i2cInfo[handle].fd;
 
-  c = bVal;
+  i2cInfo[handle].fd = -1;
+  i2cInfo[handle].state = PI_I2C_CLOSED;
 
-  if(write(serInfo[handle].fd, &c, 1) != 1)
-    return PI_SER_WRITE_FAILED;
-  else
-    return 0;
-}
+  pthread_mutex_unlock(&i2cJobMutex);
 
-int
-serReadByte(unsigned handle) {
-  int r;
-  char x;
+  if(fd >= 0)
+    close(fd);
 
-  DBG(DBG_USER, "handle=%d", handle);
+  return 0;
+}
 
-  SER_CHECK_INITED;
+void
+i2cSwitchCombined(int setting) {
+  int fd;
 
-  if(handle >= PI_SER_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  DBG(DBG_USER, "setting=%d", setting);
 
-  if(serInfo[handle].state != PI_SER_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  fd = open(PI_I2C_COMBINED, O_WRONLY);
 
-  r = read(serInfo[handle].fd, &x, 1);
-
-  if(r == 1)
-    return ((int)x) & 0xFF;
-
-  else if(r == 0)
-    return PI_SER_READ_NO_DATA;
-
-  else if((r == -1) && (errno == EAGAIN))
-    return PI_SER_READ_NO_DATA;
+  if(fd >= 0) {
+    if(setting) {
+      if(write(fd, "1\n", 2) == -1) { /* ignore errors */
+      }
+    } else {
+      if(write(fd, "0\n", 2) == -1) { /* ignore errors */
+      }
+    }
 
-  else
-    return PI_SER_READ_FAILED;
+    close(fd);
+  }
 }
 
 int
-serWrite(unsigned handle, char* buf, unsigned count) {
-  int written = 0, wrote = 0;
+i2cSegments(unsigned handle, pi_i2c_msg_t* segs, unsigned numSegs) {
+  int retval;
+  my_i2c_rdwr_ioctl_data_t rdwr;
 
-  DBG(DBG_USER, "handle=%d count=%d [%s]", handle, count, myBuf2Str(count, buf));
+  DBG(DBG_USER, "handle=%d", handle);
 
-  SER_CHECK_INITED;
+  CHECK_INITED;
 
-  if(handle >= PI_SER_SLOTS)
+  if(handle >= PI_I2C_SLOTS)
     SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(serInfo[handle].state != PI_SER_OPENED)
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
     SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(!count)
-    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+  if(segs == NULL)
+    SOFT_ERROR(PI_BAD_POINTER, "null segments");
 
-  while((written != count) && (wrote >= 0)) {
-    wrote = write(serInfo[handle].fd, buf + written, count - written);
+  if(numSegs > PI_I2C_RDRW_IOCTL_MAX_MSGS)
+    SOFT_ERROR(PI_TOO_MANY_SEGS, "too many segments (%d)", numSegs);
 
-    if(wrote >= 0) {
-      written += wrote;
+  rdwr.msgs = segs;
+  rdwr.nmsgs = numSegs;
 
-      if(written != count)
-        time_sleep(0.05);
-    }
-  }
+  retval = ioctl(i2cInfo[handle].fd, PI_I2C_RDWR, &rdwr);
 
-  if(written != count)
-    return PI_SER_WRITE_FAILED;
+  if(retval >= 0)
+    return retval;
   else
-    return 0;
+    return PI_BAD_I2C_SEG;
 }
 
 int
-serRead(unsigned handle, char* buf, unsigned count) {
-  int r;
+i2cZip(unsigned handle, char* inBuf, unsigned inLen, char* outBuf, unsigned outLen) {
+  int numSegs, inPos, outPos, status, bytes, flags, addr;
+  int esc, setesc;
+  pi_i2c_msg_t segs[PI_I2C_RDRW_IOCTL_MAX_MSGS];
 
-  DBG(DBG_USER, "handle=%d count=%d buf=0x%" PRIXPTR, handle, count, (uintptr_t)buf);
+  DBG(DBG_USER, "handle=%d inBuf=%s outBuf=%08" PRIXPTR " len=%d", handle, myBuf2Str(inLen, (char*)inBuf), (uintptr_t)outBuf, outLen);
 
-  SER_CHECK_INITED;
+  CHECK_INITED;
 
-  if(handle >= PI_SER_SLOTS)
+  if(handle >= PI_I2C_SLOTS)
     SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(serInfo[handle].state != PI_SER_OPENED)
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
     SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(!count)
-    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+  if(!inBuf || !inLen)
+    SOFT_ERROR(PI_BAD_POINTER, "input buffer can't be NULL");
 
-  r = read(serInfo[handle].fd, buf, count);
+  if(!outBuf && outLen)
+    SOFT_ERROR(PI_BAD_POINTER, "output buffer can't be NULL");
 
-  if(r == -1) {
-    if(errno == EAGAIN)
-      return PI_SER_READ_NO_DATA;
-    else
-      return PI_SER_READ_FAILED;
-  } else {
-    if(r < count)
-      buf[r] = 0;
-    return r;
-  }
-}
+  numSegs = 0;
 
-int
-serDataAvailable(unsigned handle) {
-  int result;
+  inPos = 0;
+  outPos = 0;
+  status = 0;
 
-  DBG(DBG_USER, "handle=%d", handle);
+  addr = i2cInfo[handle].addr;
+  flags = 0;
+  esc = 0;
+  setesc = 0;
 
-  SER_CHECK_INITED;
+  while(!status && (inPos < inLen)) {
+    DBG(DBG_INTERNAL, "status=%d inpos=%d inlen=%d cmd=%d addr=%d flags=%x", status, inPos, inLen, inBuf[inPos], addr, flags);
 
-  if(handle >= PI_SER_SLOTS)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+    switch(inBuf[inPos++]) {
+      case PI_I2C_END: status = 1; break;
 
-  if(serInfo[handle].state != PI_SER_OPENED)
-    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+      case PI_I2C_COMBINED_ON:
+        /* Run prior transactions before setting combined flag */
+        if(numSegs) {
+          status = i2cSegments(handle, segs, numSegs);
+          if(status >= 0)
+            status = 0; /* continue */
+          numSegs = 0;
+        }
+        i2cSwitchCombined(1);
+        break;
 
-  if(ioctl(serInfo[handle].fd, FIONREAD, &result) == -1)
-    return 0;
+      case PI_I2C_COMBINED_OFF:
+        /* Run prior transactions before clearing combined flag */
+        if(numSegs) {
+          status = i2cSegments(handle, segs, numSegs);
+          if(status >= 0)
+            status = 0; /* continue */
+          numSegs = 0;
+        }
+        i2cSwitchCombined(0);
+        break;
 
-  return result;
-}
+      case PI_I2C_ADDR:
+        addr = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+        if(addr < 0)
+          status = PI_BAD_I2C_CMD;
+        break;
 
-/* ======================================================================= */
+      case PI_I2C_FLAGS:
+        /* cheat to force two byte flags */
+        esc = 1;
+        flags = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+        if(flags < 0)
+          status = PI_BAD_I2C_CMD;
+        break;
 
-static int
-chooseBestClock(clkInf_t* clkInf, unsigned f, unsigned numc, unsigned* cf) {
-  int c, valid;
-  double fdiv, offby, best_offby;
-  unsigned div, frac;
+      case PI_I2C_ESC: setesc = 1; break;
 
-  valid = 0;
-  best_offby = 0;
+      case PI_I2C_READ:
 
-  for(c = 0; c < numc; c++) {
-    fdiv = (double)cf[c] / (double)f;
-    if(f < PI_MASH_MAX_FREQ) {
-      fdiv += (0.5 / 4096.0);
-      div = fdiv;
-      frac = (fdiv - div) * 4096.0;
-    } else {
-      fdiv += 0.5;
-      div = fdiv;
-      frac = 0;
-    }
+        bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
 
-    if((div > 1) && (div < 4096)) {
-      offby = f - (cf[c] / (div + (frac / 4096.0)));
-      if(offby < 0)
-        offby = -offby;
-      if((!valid) || (offby <= best_offby)) {
-        valid = 1;
-        clkInf->div = div;
-        clkInf->frac = frac;
-        clkInf->clock = c;
-        best_offby = offby;
-      }
+        if(bytes >= 0) {
+          if((bytes + outPos) < outLen) {
+            segs[numSegs].addr = addr;
+            segs[numSegs].flags = (flags | 1);
+            segs[numSegs].len = bytes;
+            segs[numSegs].buf = (uint8_t*)(outBuf + outPos);
+            outPos += bytes;
+            numSegs++;
+            if(numSegs >= PI_I2C_RDRW_IOCTL_MAX_MSGS) {
+              status = i2cSegments(handle, segs, numSegs);
+              if(status >= 0)
+                status = 0; /* continue */
+              numSegs = 0;
+            }
+          } else
+            status = PI_BAD_I2C_RLEN;
+        } else
+          status = PI_BAD_I2C_RLEN;
+        break;
+
+      case PI_I2C_WRITE:
+
+        bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
+
+        if(bytes >= 0) {
+          if((bytes + inPos) < inLen) {
+            segs[numSegs].addr = addr;
+            segs[numSegs].flags = (flags & 0xfffe);
+            segs[numSegs].len = bytes;
+            segs[numSegs].buf = (uint8_t*)(inBuf + inPos);
+            inPos += bytes;
+            numSegs++;
+            if(numSegs >= PI_I2C_RDRW_IOCTL_MAX_MSGS) {
+              status = i2cSegments(handle, segs, numSegs);
+              if(status >= 0)
+                status = 0; /* continue */
+              numSegs = 0;
+            }
+          } else
+            status = PI_BAD_I2C_WLEN;
+        } else
+          status = PI_BAD_I2C_WLEN;
+        break;
+
+      default: status = PI_BAD_I2C_CMD;
     }
-  }
-  return valid;
-}
 
-/* ======================================================================= */
+    if(setesc)
+      esc = 1;
+    else
+      esc = 0;
 
-static rawCbs_t*
-dmaCB2adr(int pos) {
-  int page, slot;
+    setesc = 0;
+  }
 
-  page = pos / CBS_PER_IPAGE;
-  slot = pos % CBS_PER_IPAGE;
+  if(status >= 0) {
+    if(numSegs)
+      status = i2cSegments(handle, segs, numSegs);
+  }
 
-  return &dmaIVirt[page]->cb[slot];
+  if(status >= 0)
+    status = outPos;
+
+  return status;
 }
 
 /* ----------------------------------------------------------------------- */
 
 static void
-dmaCbPrint(int pos) {
-  rawCbs_t* p;
-
-  p = dmaCB2adr(pos);
-
-  fprintf(stderr, "i=%x s=%x d=%x len=%x s=%x nxt=%x\n", p->info, p->src, p->dst, p->length, p->stride, p->next);
+i2cJobUnlock(void* x) {
+  if(*(int*)x)
+    pthread_mutex_unlock(&i2cJobMutex);
 }
 
 /* ----------------------------------------------------------------------- */
 
-static unsigned
-dmaNowAtICB(void) {
-  unsigned cb;
-  static unsigned lastPage = 0;
-  unsigned page;
-  uint32_t cbAddr;
-  uint32_t startTick, endTick;
+static void*
+pthI2CWorkerThread(void* x) {
+  i2cWorker_t* worker = x;
+  i2cJob_t* job;
+  int i, locked, state, result;
 
-  startTick = systReg[SYST_CLO];
+  /* one worker per bus, so buses overlap but a bus runs in order */
 
-  cbAddr = dmaIn[DMA_CONBLK_AD];
+  pthread_mutex_lock(&i2cJobMutex);
 
-  page = lastPage;
+  locked = 1;
 
-  /* which page are we dma'ing? */
+  pthread_cleanup_push(i2cJobUnlock, &locked);
 
   while(1) {
-    // cast twice to suppress compiler warning, I belive this cast is ok
-    // because dmaIbus contains bus addresses, not user addresses. --plugwash
-    cb = (cbAddr - ((int)(uintptr_t)dmaIBus[page])) / 32;
+    job = NULL;
 
-    if(cb < CBS_PER_IPAGE) {
-      endTick = systReg[SYST_CLO];
+    for(i = 0; i < PI_I2C_MAX_TICKETS; i++) {
+      if((i2cJob[i].state == I2C_JOB_QUEUED) && (i2cJob[i].bus == worker->bus) && ((job == NULL) || ((int)(i2cJob[i].seq - job->seq) < 0)))
+        job = &i2cJob[i];
+    }
 
-      if(endTick != startTick)
-        gpioStats.cbTicks += (endTick - startTick);
+    if(job == NULL) {
+      pthread_cond_wait(&i2cJobCond, &i2cJobMutex);
+      continue;
+    }
 
-      gpioStats.cbCalls++;
+    job->state = I2C_JOB_RUNNING;
 
-      lastPage = page;
+    locked = 0;
+    pthread_mutex_unlock(&i2cJobMutex);
 
-      return (page * CBS_PER_IPAGE) + cb;
-    }
+    /* finish the transaction before honouring a cancel */
 
-    if(page++ >= DMAI_PAGES)
-      page = 0;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
 
-    if(page == lastPage)
-      break;
-  }
+    result = i2cZip(job->handle, job->inBuf, job->inLen, job->outBuf, job->outLen);
 
-  return 0;
-}
+    pthread_setcancelstate(state, NULL);
 
-/* ----------------------------------------------------------------------- */
+    pthread_mutex_lock(&i2cJobMutex);
+    locked = 1;
 
-static int
-dmaNowAtOCB(void) {
-  unsigned cb;
-  unsigned page;
-  uint32_t cbAddr;
+    job->result = result;
+    job->state = I2C_JOB_DONE;
 
-  cbAddr = dmaOut[DMA_CONBLK_AD];
+    if(job->event <= PI_MAX_EVENT)
+      eventTrigger(job->event);
 
-  if(!cbAddr)
-    return -PI_NO_TX_WAVE;
+    pthread_cond_broadcast(&i2cJobDone);
+  }
 
-  page = 0;
+  pthread_cleanup_pop(1);
 
-  /* which page are we dma'ing? */
+  return NULL;
+}
 
-  while(1) {
-    // cast twice to suppress compiler warning, I belive this cast is ok
-    // because dmaIbus contains bus addresses, not user addresses. --plugwash
-    cb = (cbAddr - ((int)(uintptr_t)dmaOBus[page])) / 32;
+/* ----------------------------------------------------------------------- */
 
-    if(cb < CBS_PER_OPAGE)
-      return (page * CBS_PER_OPAGE) + cb;
+int
+i2cZipAsync(unsigned handle, char* inBuf, unsigned inLen, unsigned outLen, unsigned event) {
+  int w, ticket;
+  unsigned bus;
+  char* buf;
 
-    if(page++ >= DMAO_PAGES)
-      break;
-  }
+  DBG(DBG_USER, "handle=%d inBuf=%s outLen=%d event=%d", handle, myBuf2Str(inLen, (char*)inBuf), outLen, event);
 
-  /* Try twice */
+  CHECK_INITED;
 
-  cbAddr = dmaOut[DMA_CONBLK_AD];
+  if(handle >= PI_I2C_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  if(!cbAddr)
-    return -PI_NO_TX_WAVE;
+  if(i2cInfo[handle].state != PI_I2C_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
 
-  page = 0;
+  if(!inBuf || !inLen)
+    SOFT_ERROR(PI_BAD_POINTER, "input buffer can't be NULL");
 
-  /* which page are we dma'ing? */
+  if(inLen > PI_MAX_I2C_DEVICE_COUNT)
+    SOFT_ERROR(PI_BAD_I2C_WLEN, "bad input length (%d)", inLen);
 
-  while(1) {
-    // cast twice to suppress compiler warning, I belive this cast is ok
-    // because dmaIbus contains bus addresses, not user addresses. --plugwash
-    cb = (cbAddr - ((int)(uintptr_t)dmaOBus[page])) / 32;
+  if(outLen > PI_MAX_I2C_DEVICE_COUNT)
+    SOFT_ERROR(PI_BAD_I2C_RLEN, "bad output length (%d)", outLen);
 
-    if(cb < CBS_PER_OPAGE)
-      return (page * CBS_PER_OPAGE) + cb;
+  if((event > PI_MAX_EVENT) && (event != PI_I2C_NO_EVENT))
+    SOFT_ERROR(PI_BAD_EVENT_ID, "bad event (%d)", event);
 
-    if(page++ >= DMAO_PAGES)
-      break;
-  }
+  /* events are reported by the alert thread */
 
-  return -PI_WAVE_NOT_FOUND;
-}
+  if(event <= PI_MAX_EVENT)
+    CHECK_DMA;
 
-/* ----------------------------------------------------------------------- */
+  buf = malloc(inLen + outLen);
 
-unsigned
-rawWaveCB(void) {
-  unsigned cb;
-  static unsigned lastPage = 0;
-  unsigned page;
-  uint32_t cbAddr;
+  if(buf == NULL)
+    SOFT_ERROR(PI_NO_MEMORY, "no memory for I2C job");
 
-  cbAddr = dmaOut[DMA_CONBLK_AD];
+  memcpy(buf, inBuf, inLen);
 
-  if(!cbAddr)
-    return -1;
+  bus = i2cInfo[handle].bus;
 
-  page = lastPage;
+  pthread_mutex_lock(&i2cJobMutex);
 
-  /* which page are we dma'ing? */
+  /* i2cClose changes the state under the lock */
 
-  while(1) {
-    // cast twice to suppress compiler warning, I belive this cast is ok
-    // because dmaIbus contains bus addresses, not user addresses. --plugwash
-    cb = (cbAddr - ((int)(uintptr_t)dmaOBus[page])) / 32;
+  if(i2cInfo[handle].state != PI_I2C_OPENED) {
+    pthread_mutex_unlock(&i2cJobMutex);
+    free(buf);
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+  }
 
-    if(cb < CBS_PER_OPAGE) {
-      lastPage = page;
+  for(ticket = 0; ticket < PI_I2C_MAX_TICKETS; ticket++)
+    if(i2cJob[ticket].state == I2C_JOB_FREE)
+      break;
 
-      return (page * CBS_PER_OPAGE) + cb;
-    }
+  if(ticket >= PI_I2C_MAX_TICKETS) {
+    pthread_mutex_unlock(&i2cJobMutex);
+    free(buf);
+    return PI_NO_I2C_TICKET;
+  }
 
-    if(page++ >= DMAO_PAGES)
-      page = 0;
+  /* a bus worker is only started by the first job on the bus */
 
-    if(page == lastPage)
+  for(w = 0; w < PI_I2C_MAX_QUEUES; w++)
+    if(i2cWorker[w].running && (i2cWorker[w].bus == bus))
       break;
-  }
 
-  return 0;
-}
+  if(w >= PI_I2C_MAX_QUEUES) {
+    for(w = 0; w < PI_I2C_MAX_QUEUES; w++)
+      if(!i2cWorker[w].running)
+        break;
 
-/* ----------------------------------------------------------------------- */
+    if(w >= PI_I2C_MAX_QUEUES) {
+      pthread_mutex_unlock(&i2cJobMutex);
+      free(buf);
+      SOFT_ERROR(PI_NO_I2C_TICKET, "no queue for I2C bus %d", bus);
+    }
 
-static unsigned
-dmaCurrentSlot(unsigned pos) {
-  unsigned cycle = 0, slot = 0, tmp;
+    i2cWorker[w].bus = bus;
 
-  cycle = (pos / CBS_PER_CYCLE);
-  tmp = (pos % CBS_PER_CYCLE);
+    if(pthread_create(&i2cWorker[w].pth, NULL, pthI2CWorkerThread, &i2cWorker[w])) {
+      pthread_mutex_unlock(&i2cJobMutex);
+      free(buf);
+      SOFT_ERROR(PI_NO_I2C_TICKET, "I2C worker thread create failed (%m)");
+    }
 
-  if(tmp > 2)
-    slot = ((tmp - 2) / 3);
+    i2cWorker[w].running = 1;
+  }
 
-  return (cycle * PULSE_PER_CYCLE) + slot;
-}
+  i2cJob[ticket].handle = handle;
+  i2cJob[ticket].bus = bus;
+  i2cJob[ticket].event = event;
+  i2cJob[ticket].inBuf = buf;
+  i2cJob[ticket].inLen = inLen;
+  i2cJob[ticket].outBuf = buf + inLen;
+  i2cJob[ticket].outLen = outLen;
+  i2cJob[ticket].seq = i2cJobSeq++;
+  i2cJob[ticket].result = PI_I2C_PENDING;
+  i2cJob[ticket].state = I2C_JOB_QUEUED;
 
-/* ----------------------------------------------------------------------- */
+  /* workers share the condition, each picks its own bus */
 
-static uint32_t
-dmaPwmDataAdr(int pos) {
-  // cast twice to suppress compiler warning, I belive this cast is ok
-  // because dmaIbus contains bus addresses, not user addresses. --plugwash
-  return (uint32_t)(uintptr_t)&dmaIBus[pos]->periphData;
+  pthread_cond_broadcast(&i2cJobCond);
+
+  pthread_mutex_unlock(&i2cJobMutex);
+
+  return ticket;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static uint32_t
-dmaGpioOnAdr(int pos) {
-  int page, slot;
+int
+i2cAsyncResult(unsigned ticket, char* outBuf, unsigned outLen, unsigned wait) {
+  int result;
 
-  page = pos / ON_PER_IPAGE;
-  slot = pos % ON_PER_IPAGE;
+  DBG(DBG_USER, "ticket=%d outBuf=%08" PRIXPTR " outLen=%d wait=%d", ticket, (uintptr_t)outBuf, outLen, wait);
 
-  // cast twice to suppress compiler warning, I belive this cast is ok
-  // because dmaIbus contains bus addresses, not user addresses. --plugwash
-  return (uint32_t)(uintptr_t)&dmaIBus[page]->gpioOn[slot];
-}
+  CHECK_INITED;
 
-/* ----------------------------------------------------------------------- */
+  if(ticket >= PI_I2C_MAX_TICKETS)
+    SOFT_ERROR(PI_BAD_I2C_TICKET, "bad I2C ticket (%d)", ticket);
 
-static uint32_t
-dmaGpioOffAdr(int pos) {
-  int page, slot;
+  pthread_mutex_lock(&i2cJobMutex);
 
-  myOffPageSlot(pos, &page, &slot);
+  if(i2cJob[ticket].state == I2C_JOB_FREE) {
+    pthread_mutex_unlock(&i2cJobMutex);
+    SOFT_ERROR(PI_BAD_I2C_TICKET, "bad I2C ticket (%d)", ticket);
+  }
 
-  // cast twice to suppress compiler warning, I belive this cast is ok
-  // because dmaIbus contains bus addresses, not user addresses. --plugwash
-  return (uint32_t)(uintptr_t)&dmaIBus[page]->gpioOff[slot];
-}
+  while(wait && (i2cJob[ticket].state != I2C_JOB_DONE)) pthread_cond_wait(&i2cJobDone, &i2cJobMutex);
 
-/* ----------------------------------------------------------------------- */
+  if(i2cJob[ticket].state != I2C_JOB_DONE) {
+    pthread_mutex_unlock(&i2cJobMutex);
+    return PI_I2C_PENDING;
+  }
 
-static uint32_t
-dmaTickAdr(int pos) {
-  int page, slot;
+  /* the ticket is finished with once its result is collected */
 
-  myTckPageSlot(pos, &page, &slot);
+  result = i2cJob[ticket].result;
 
-  // cast twice to suppress compiler warning, I belive this cast is ok
-  // because dmaIbus contains bus addresses, not user addresses. --plugwash
-  return (uint32_t)(uintptr_t)&dmaIBus[page]->tick[slot];
-}
+  if(result > 0) {
+    if(!outBuf)
+      result = 0;
+    else if(result > outLen)
+      result = outLen;
 
-/* ----------------------------------------------------------------------- */
+    if(result)
+      memcpy(outBuf, i2cJob[ticket].outBuf, result);
+  }
 
-static uint32_t
-dmaReadLevelsAdr(int pos) {
-  int page, slot;
+  free(i2cJob[ticket].inBuf);
+  i2cJob[ticket].inBuf = NULL;
+  i2cJob[ticket].outBuf = NULL;
+  i2cJob[ticket].state = I2C_JOB_FREE;
 
-  myLvsPageSlot(pos, &page, &slot);
+  pthread_mutex_unlock(&i2cJobMutex);
 
-  // cast twice to suppress compiler warning, I belive this cast is ok
-  // because dmaIbus contains bus addresses, not user addresses. --plugwash
-  return (uint32_t)(uintptr_t)&dmaIBus[page]->level[slot];
+  return result;
 }
 
-/* ----------------------------------------------------------------------- */
+/* ======================================================================= */
+
+/*SPI */
 
 static uint32_t
-dmaCbAdr(int pos) {
-  int page, slot;
+_spiTXBits(char* buf, int pos, int bitlen, int msbf) {
+  uint32_t bits = 0;
 
-  page = (pos / CBS_PER_IPAGE);
-  slot = (pos % CBS_PER_IPAGE);
+  if(buf) {
+    if(bitlen <= 8)
+      bits = *(((uint8_t*)buf) + pos);
+    else if(bitlen <= 16)
+      bits = *(((uint16_t*)buf) + pos);
+    else
+      bits = *(((uint32_t*)buf) + pos);
 
-  // cast twice to suppress compiler warning, I belive this cast is ok
-  // because dmaIbus contains bus addresses, not user addresses. --plugwash
-  return (uint32_t)(uintptr_t)&dmaIBus[page]->cb[slot];
-}
+    if(msbf)
+      bits <<= (32 - bitlen);
+  }
 
-/* ----------------------------------------------------------------------- */
+  return bits;
+}
 
 static void
-dmaGpioOnCb(int b, int pos) {
-  rawCbs_t* p;
-
-  p = dmaCB2adr(b);
+_spiRXBits(char* buf, int pos, int bitlen, int msbf, uint32_t bits) {
+  if(buf) {
+    if(!msbf)
+      bits >>= (32 - bitlen);
 
-  p->info = NORMAL_DMA;
-  p->src = dmaGpioOnAdr(pos);
-  p->dst = ((GPIO_BASE + (GPSET0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
-  p->length = 4;
-  p->next = dmaCbAdr(b + 1);
+    if(bitlen <= 8)
+      *(((uint8_t*)buf) + pos) = bits;
+    else if(bitlen <= 16)
+      *(((uint16_t*)buf) + pos) = bits;
+    else
+      *(((uint32_t*)buf) + pos) = bits;
+  }
 }
 
-/* ----------------------------------------------------------------------- */
+static void
+spiACS(int channel, int on) {
+  int gpio;
+
+  switch(channel) {
+    case 0: gpio = PI_ASPI_CE0; break;
+    case 1: gpio = PI_ASPI_CE1; break;
+    default: gpio = PI_ASPI_CE2; break;
+  }
+  myGpioWrite(gpio, on);
+}
 
 static void
-dmaTickCb(int b, int pos) {
-  rawCbs_t* p;
+spiGoA(unsigned speed, /* bits per second  */
+       uint32_t flags, /* flags            */
+       char* txBuf,    /* tx buffer        */
+       char* rxBuf,    /* rx buffer        */
+       unsigned count, /* number of bytes  */
+       int cont,       /* CS already held  */
+       int hold)       /* keep CS asserted */
+{
+  int cs;
+  char bit_ir[4] = {1, 0, 0, 1}; /* read on rising edge */
+  char bit_or[4] = {0, 1, 1, 0}; /* write on rising edge */
+  char bit_ic[4] = {0, 0, 1, 1}; /* invert clock */
 
-  p = dmaCB2adr(b);
+  int mode, bitlen, txmsbf, rxmsbf, channel;
+  unsigned txCnt = 0;
+  unsigned rxCnt = 0;
+  uint32_t spiDefaults;
+  uint32_t statusReg;
+  int txFull, rxEmpty;
 
-  p->info = NORMAL_DMA;
-  p->src = ((SYST_BASE + (SYST_CLO * 4)) & 0x00ffffff) | PI_PERI_BUS;
-  p->dst = dmaTickAdr(pos);
-  p->length = 4;
-  p->next = dmaCbAdr(b + 1);
-}
+  channel = PI_SPI_FLAGS_GET_CHANNEL(flags);
+  mode = PI_SPI_FLAGS_GET_MODE(flags);
 
-/* ----------------------------------------------------------------------- */
+  bitlen = PI_SPI_FLAGS_GET_BITLEN(flags);
 
-static void
-dmaGpioOffCb(int b, int pos) {
-  rawCbs_t* p;
+  if(!bitlen)
+    bitlen = 8;
 
-  p = dmaCB2adr(b);
+  /* correct count for word size */
 
-  p->info = NORMAL_DMA;
-  p->src = dmaGpioOffAdr(pos);
-  p->dst = ((GPIO_BASE + (GPCLR0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
-  p->length = 4;
-  p->next = dmaCbAdr(b + 1);
-}
+  if(bitlen > 8)
+    count /= 2;
+  if(bitlen > 16)
+    count /= 2;
 
-/* ----------------------------------------------------------------------- */
+  txmsbf = !PI_SPI_FLAGS_GET_TX_LSB(flags);
+  rxmsbf = !PI_SPI_FLAGS_GET_RX_LSB(flags);
 
-static void
-dmaReadLevelsCb(int b, int pos) {
-  rawCbs_t* p;
+  cs = PI_SPI_FLAGS_GET_CSPOLS(flags) & (1 << channel);
 
-  p = dmaCB2adr(b);
+  spiDefaults = AUXSPI_CNTL0_SPEED((125000000 / speed) - 1) | AUXSPI_CNTL0_IN_RISING(bit_ir[mode]) | AUXSPI_CNTL0_OUT_RISING(bit_or[mode]) |
+                AUXSPI_CNTL0_INVERT_CLK(bit_ic[mode]) | AUXSPI_CNTL0_MSB_FIRST(txmsbf) | AUXSPI_CNTL0_SHIFT_LEN(bitlen);
 
-  p->info = NORMAL_DMA;
-  p->src = ((GPIO_BASE + (GPLEV0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
-  p->dst = dmaReadLevelsAdr(pos);
-  p->length = 4;
-  p->next = dmaCbAdr(b + 1);
-}
+  if(!count) {
+    auxReg[AUX_SPI0_CNTL0_REG] = AUXSPI_CNTL0_ENABLE | AUXSPI_CNTL0_CLR_FIFOS;
 
-/* ----------------------------------------------------------------------- */
+    myGpioDelay(10);
 
-static void
-dmaDelayCb(int b) {
-  rawCbs_t* p;
+    auxReg[AUX_SPI0_CNTL0_REG] = AUXSPI_CNTL0_ENABLE | spiDefaults;
 
-  p = dmaCB2adr(b);
+    auxReg[AUX_SPI0_CNTL1_REG] = AUXSPI_CNTL1_MSB_FIRST(rxmsbf);
 
-  if(gpioCfg.clockPeriph == PI_CLOCK_PCM) {
-    p->info = NORMAL_DMA | TIMED_DMA(2);
-    p->dst = PCM_TIMER;
-  } else {
-    p->info = NORMAL_DMA | TIMED_DMA(5);
-    p->dst = PWM_TIMER;
+    return;
   }
 
-  p->src = dmaPwmDataAdr(b % DMAI_PAGES);
-  p->length = 4;
-  p->next = dmaCbAdr(b + 1);
-}
-
-/* ----------------------------------------------------------------------- */
-
-static void
-dmaInitCbs(void) {
-  int b, pulse, level, cycle;
-
-  rawCbs_t* p;
-
-  /* set up the DMA control blocks */
-
-  DBG(DBG_STARTUP, "");
-
-  gpioStats.dmaInitCbsCount++;
+  auxReg[AUX_SPI0_CNTL0_REG] = AUXSPI_CNTL0_ENABLE | spiDefaults;
 
-  b = -1;
-  level = 0;
+  auxReg[AUX_SPI0_CNTL1_REG] = AUXSPI_CNTL1_MSB_FIRST(rxmsbf);
 
-  for(cycle = 0; cycle < bufferCycles; cycle++) {
-    b++;
-    dmaGpioOnCb(b, cycle % SUPERCYCLE); /* gpio on slot */
+  if(!cont)
+    spiACS(channel, cs);
 
-    b++;
-    dmaTickCb(b, cycle); /* tick slot */
+  while((txCnt < count) || (rxCnt < count)) {
+    statusReg = auxReg[AUX_SPI0_STAT_REG];
 
-    for(pulse = 0; pulse < PULSE_PER_CYCLE; pulse++) {
-      b++;
-      dmaReadLevelsCb(b, level); /* read levels slot */
+    rxEmpty = statusReg & AUXSPI_STAT_RX_EMPTY;
 
-      b++;
-      dmaDelayCb(b); /* delay slot */
+    txFull = (((statusReg >> 28) & 15) > 2);
 
-      b++;
-      dmaGpioOffCb(b, (level % SUPERLEVEL) + 1); /* gpio off slot */
+    if(rxCnt < count) {
+      if(!rxEmpty) {
+        _spiRXBits(rxBuf, rxCnt++, bitlen, rxmsbf, auxReg[AUX_SPI0_IO_REG]);
+      }
+    }
 
-      ++level;
+    if(txCnt < count) {
+      if(!txFull) {
+        if(txCnt != (count - 1)) {
+          auxReg[AUX_SPI0_TX_HOLD] = _spiTXBits(txBuf, txCnt++, bitlen, txmsbf);
+        } else {
+          auxReg[AUX_SPI0_IO_REG] = _spiTXBits(txBuf, txCnt++, bitlen, txmsbf);
+        }
+      }
     }
   }
 
-  /* point last cb back to first for continuous loop */
+  while((auxReg[AUX_SPI0_STAT_REG] & AUXSPI_STAT_BUSY))
+    ;
 
-  p = dmaCB2adr(b);
+  if(!hold)
+    spiACS(channel, !cs);
+}
 
-  p->next = dmaCbAdr(0);
+static rawCbs_t*
+spiDmaCB(int pos) {
+  return &spiDmaVirt[SPI_DMA_CB_PAGE + (pos / SPI_DMA_CBS_PER_PAGE)]->cb[pos % SPI_DMA_CBS_PER_PAGE];
+}
 
-  DBG(DBG_STARTUP, "DMA page type count = %zd", sizeof(dmaIPage_t));
+/* ----------------------------------------------------------------------- */
 
-  DBG(DBG_STARTUP, "%d control blocks (exp=%d)", b + 1, NUM_CBS);
+static uint32_t
+spiDmaCBadr(int pos) {
+  // cast twice to suppress compiler warning, spiDmaBus holds bus addresses
+  return (uint32_t)(uintptr_t)&spiDmaBus[SPI_DMA_CB_PAGE + (pos / SPI_DMA_CBS_PER_PAGE)]->cb[pos % SPI_DMA_CBS_PER_PAGE];
 }
 
-/* ======================================================================= */
-
-static void
-sigHandler(int signum) {
-  if((signum >= PI_MIN_SIGNUM) && (signum <= PI_MAX_SIGNUM)) {
-    if(gpioSignal[signum].func) {
-      if(gpioSignal[signum].ex) {
-        (gpioSignal[signum].func)(signum, gpioSignal[signum].userdata);
-      } else {
-        (gpioSignal[signum].func)(signum);
-      }
-    } else {
-      switch(signum) {
-        case SIGUSR1:
+/* ----------------------------------------------------------------------- */
 
-          if(gpioCfg.dbgLevel > DBG_MIN_LEVEL)
-            --gpioCfg.dbgLevel;
-          else
-            gpioCfg.dbgLevel = DBG_MIN_LEVEL;
-          DBG(DBG_USER, "Debug level %d\n", gpioCfg.dbgLevel);
-          break;
+static uint32_t
+spiDmaDataAdr(int page, unsigned offset) {
+  return (uint32_t)(uintptr_t)spiDmaBus[page + (offset / PAGE_SIZE)] + (offset % PAGE_SIZE);
+}
 
-        case SIGUSR2:
-          if(gpioCfg.dbgLevel < DBG_MAX_LEVEL)
-            ++gpioCfg.dbgLevel;
-          else
-            gpioCfg.dbgLevel = DBG_MAX_LEVEL;
-          DBG(DBG_USER, "Debug level %d\n", gpioCfg.dbgLevel);
-          break;
+/* ----------------------------------------------------------------------- */
 
-        case SIGPIPE:
-        case SIGWINCH: DBG(DBG_USER, "signal %d ignored", signum); break;
+static void
+spiDmaCopy(char* buf, int page, unsigned count, int toDma) {
+  unsigned i, n;
+  char* p;
 
-        case SIGCHLD:
-          /* Used to notify threads of events */
-          break;
+  for(i = 0; i < count; i += n) {
+    n = count - i;
+    if(n > PAGE_SIZE)
+      n = PAGE_SIZE;
 
-        default:
-          DBG(DBG_ALWAYS, "Unhandled signal %d, terminating\n", signum);
-          gpioTerminate();
-          exit(-1);
-      }
-    }
-  } else {
-    /* exit */
+    p = (char*)spiDmaVirt[page + (i / PAGE_SIZE)];
 
-    DBG(DBG_ALWAYS, "Unhandled signal %d, terminating\n", signum);
-    gpioTerminate();
-    exit(-1);
+    if(!toDma)
+      memcpy(buf + i, p, n);
+    else if(buf)
+      memcpy(p, buf + i, n);
+    else
+      memset(p, 0, n);
   }
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void
-sigSetHandler(void) {
-  int i;
-  struct sigaction new;
+static int
+spiGoDMA(unsigned speed, uint32_t spiDefaults, char* txBuf, char* rxBuf, unsigned count, int hold) {
+  rawCbs_t* p;
+  unsigned chunks, c, len;
+  int cb;
+  uint32_t start, expected, timeout;
+  int status;
 
-  for(i = PI_MIN_SIGNUM; i <= PI_MAX_SIGNUM; i++) {
+  /*
+  Borrows the secondary (wave) dma channel when it is idle.  The
+  control blocks alternate between writing a chunk to the SPI fifo
+  and reading back the previous chunk, so no more than the 64 byte
+  fifo is ever in flight.  Returns -1 if the channel is busy so
+  the caller may poll instead, or PI_SPI_XFER_FAILED if the transfer
+  timed out.
+  */
 
-    memset(&new, 0, sizeof(new));
-    new.sa_handler = sigHandler;
+  if(pthread_mutex_trylock(&dmaOutMutex))
+    return -1;
 
-    sigaction(i, &new, NULL);
+  if(dmaOut[DMA_CONBLK_AD]) {
+    pthread_mutex_unlock(&dmaOutMutex);
+    return -1;
   }
-}
-
-/*
-   freq mics  net
- 0 1000 1000  900
- 1 4000  250  225
- 2 3750  266  240
- 3 3500  285  257
- 4 3250  307  276
- 5 3000  333  300
- 6 2750  363  327
- 7 2500  400  360
- 8 2250  444  400
- 9 2000  500  450
-10 1750  571  514
-11 1500  666  600
-12 1250  800  720
-13 1000 1000  900
-14 750  1333 1200
-15 500  2000 1800
-*/
 
-unsigned alert_delays[] = {900000, 225000, 240000, 257142, 276923, 300000, 327272, 360000, 400000, 450000, 514285, 600000, 720000, 900000, 1200000, 1800000};
+  spiDmaActive = 1;
 
-/* ======================================================================= */
+  spiDmaCopy(txBuf, SPI_DMA_TX_PAGE, count, 1);
 
-static void
-alertGlitchFilter(gpioSample_t* sample, int numSamples) {
-  int i, j, diff;
-  uint32_t steadyUs, changedTick, RBitV, LBitV, initialised;
-  uint32_t bit, bitV;
+  chunks = (count + SPI_DMA_CHUNK - 1) / SPI_DMA_CHUNK;
 
-  for(i = 0; i <= PI_MAX_USER_GPIO; i++) {
-    bit = (1 << i);
+  cb = 0;
 
-    if(monitorBits & bit & gFilterBits) {
-      initialised = gpioAlert[i].gfInitialised;
-      if(!initialised && numSamples > 0) {
-        /* Initialise filter with first sample */
-        bitV = sample[0].level & bit;
-        gpioAlert[i].gfRBitV = bitV;
-        gpioAlert[i].gfLBitV = bitV;
-        gpioAlert[i].gfTick = sample[0].tick;
-        gpioAlert[i].gfInitialised = 1;
-      }
+  for(c = 0; c <= chunks; c++) {
+    if(c < chunks) {
+      len = count - (c * SPI_DMA_CHUNK);
+      if(len > SPI_DMA_CHUNK)
+        len = SPI_DMA_CHUNK;
+
+      p = spiDmaCB(cb++);
+      p->info = NORMAL_DMA | DMA_DEST_DREQ | DMA_PERIPHERAL_MAPPING(DREQ_SPI_TX) | DMA_SRC_INC;
+      p->src = spiDmaDataAdr(SPI_DMA_TX_PAGE, c * SPI_DMA_CHUNK);
+      p->dst = SPI_FIFO_BUS;
+      p->length = (len + 3) & ~3;
+      p->next = spiDmaCBadr(cb);
+    }
 
-      steadyUs = gpioAlert[i].gfSteadyUs;
-      RBitV = gpioAlert[i].gfRBitV;
-      LBitV = gpioAlert[i].gfLBitV;
-      changedTick = gpioAlert[i].gfTick;
+    if(c) {
+      len = count - ((c - 1) * SPI_DMA_CHUNK);
+      if(len > SPI_DMA_CHUNK)
+        len = SPI_DMA_CHUNK;
+
+      p = spiDmaCB(cb++);
+      p->info = NORMAL_DMA | DMA_SRC_DREQ | DMA_PERIPHERAL_MAPPING(DREQ_SPI_RX) | DMA_DEST_INC;
+      p->src = SPI_FIFO_BUS;
+      p->dst = spiDmaDataAdr(SPI_DMA_RX_PAGE, (c - 1) * SPI_DMA_CHUNK);
+      p->length = (len + 3) & ~3;
+      p->next = spiDmaCBadr(cb);
+    }
+  }
 
-      for(j = 0; j < numSamples; j++) {
-        bitV = sample[j].level & bit;
+  p->next = 0;
 
-        if(bitV != LBitV) {
-          /* Difference between level and last level.
-             Restart steady timer. */
+  spiReg[SPI_DC] = SPI_DC_RPANIC(48) | SPI_DC_RDREQ(0) | SPI_DC_TPANIC(16) | SPI_DC_TDREQ(32);
 
-          changedTick = sample[j].tick;
-          LBitV = bitV;
-        }
+  spiReg[SPI_DLEN] = count;
 
-        if(bitV != RBitV) {
-          /* Difference between level and reported level. */
+  spiReg[SPI_CS] = spiDefaults | SPI_CS_DMAEN | SPI_CS_TA; /* start */
 
-          diff = sample[j].tick - changedTick;
+  flushMemory();
 
-          if(diff >= steadyUs) {
-            /* Level stable for steady period. */
-            RBitV = bitV;
-          } else {
-            /* Keep reporting old level. */
+  initDMAgo(dmaOut, spiDmaCBadr(0));
 
-            sample[j].level ^= bit;
-          }
-        }
-      }
+  /* sleep through most of the transfer rather than spin */
 
-      gpioAlert[i].gfRBitV = RBitV;
-      gpioAlert[i].gfLBitV = LBitV;
-      gpioAlert[i].gfTick = changedTick;
-    }
-  }
-}
+  expected = ((uint64_t)count * 8 * MILLION) / speed;
 
-static void
-alertNoiseFilter(gpioSample_t* sample, int numSamples) {
-  int i, j, diff;
-  uint32_t LBitV;
-  uint32_t bit, bitV;
-  uint32_t nowTick;
+  timeout = (expected * 2) + 20000;
 
-  for(i = 0; i <= PI_MAX_USER_GPIO; i++) {
-    bit = (1 << i);
+  start = systReg[SYST_CLO];
 
-    if(monitorBits & bit & nFilterBits) {
-      LBitV = gpioAlert[i].nfLBitV;
+  if(expected > PI_MAX_BUSY_DELAY)
+    myGpioDelay(expected);
 
-      for(j = 0; j < numSamples; j++) {
-        bitV = sample[j].level & bit;
-        nowTick = sample[j].tick;
+  status = 0;
 
-        if(gpioAlert[i].nfActive) /* reporting events */
-        {
-          diff = nowTick - gpioAlert[i].nfTick2;
+  while(dmaOut[DMA_CONBLK_AD]) {
+    if((systReg[SYST_CLO] - start) > timeout) {
+      initKillDMA(dmaOut);
+      DBG(DBG_ALWAYS, "SPI dma transfer of %d bytes timed out", count);
+      status = PI_SPI_XFER_FAILED;
+      break;
+    }
+    myGpioSleep(0, 20);
+  }
 
-          if(diff >= 0) {
-            /* Stop reporting gpio changes */
+  while(!(spiReg[SPI_CS] & SPI_CS_DONE)) {
+    if((systReg[SYST_CLO] - start) > timeout) {
+      status = PI_SPI_XFER_FAILED;
+      break;
+    }
+  }
 
-            gpioAlert[i].nfActive = 0;
-            gpioAlert[i].nfTick1 = nowTick;
-          }
-        } else /* waiting for steady us */
-        {
-          if(bitV != LBitV) {
-            diff = nowTick - gpioAlert[i].nfTick1;
-            gpioAlert[i].nfTick1 = nowTick;
+  if(hold)
+    spiReg[SPI_CS] = spiDefaults | SPI_CS_TA; /* dma off, CS held */
+  else
+    spiReg[SPI_CS] = spiDefaults; /* stop */
 
-            if(diff >= gpioAlert[i].nfSteadyUs) {
-              /* Start reporting gpio changes */
+  spiReg[SPI_DLEN] = 2; /* undocumented, stops inter-byte gap */
 
-              gpioAlert[i].nfRBitV = LBitV;
-              gpioAlert[i].nfActive = 1;
-              gpioAlert[i].nfTick2 = nowTick + gpioAlert[i].nfActiveUs;
-            }
-          }
-        }
+  if(rxBuf)
+    spiDmaCopy(rxBuf, SPI_DMA_RX_PAGE, count, 0);
 
-        if(!gpioAlert[i].nfActive) {
-          if(bitV != gpioAlert[i].nfRBitV)
-            sample[j].level ^= bit;
-        }
+  spiDmaActive = 0;
 
-        LBitV = bitV;
-      }
+  pthread_mutex_unlock(&dmaOutMutex);
 
-      gpioAlert[i].nfLBitV = LBitV;
-    }
-  }
+  return status;
 }
 
-static void
-alertEmit(gpioSample_t* sample, int numSamples, uint32_t changedBits, uint32_t eTick) {
-  uint32_t oldLevel, newLevel;
-  int32_t diff;
-  int emit, seqno, emitted;
-  uint32_t changes, bits, timeoutBits, eventBits;
-  int d;
-  int b, n, v;
+/* ----------------------------------------------------------------------- */
+
+static int
+spiGoS(unsigned speed, uint32_t flags, char* txBuf, char* rxBuf, unsigned count, int cont, int hold) {
+  unsigned txCnt = 0;
+  unsigned rxCnt = 0;
+  unsigned cnt, cnt4w, cnt3w;
+  uint32_t spiDefaults;
+  unsigned mode, channel, cspol, cspols, flag3w, ren3w;
   int err;
-  int max_emits;
-  char fifo[32];
-  /* ensure space for maximum number of watchdog and event notifications */
-  gpioReport_t report[MAX_REPORT + PI_MAX_USER_GPIO + 1 + PI_MAX_EVENT + 1];
 
-  if(changedBits) {
-    if(gpioGetSamples.func) {
-      if(gpioGetSamples.ex) {
-        (gpioGetSamples.func)(sample, numSamples, gpioGetSamples.userdata);
-      } else {
-        (gpioGetSamples.func)(sample, numSamples);
-      }
-    }
-  }
+  channel = PI_SPI_FLAGS_GET_CHANNEL(flags);
+  mode = PI_SPI_FLAGS_GET_MODE(flags);
+  cspols = PI_SPI_FLAGS_GET_CSPOLS(flags);
+  cspol = (cspols >> channel) & 1;
+  flag3w = PI_SPI_FLAGS_GET_3WIRE(flags);
+  ren3w = PI_SPI_FLAGS_GET_3WREN(flags);
 
-  eventBits = 0;
+  spiDefaults = SPI_CS_MODE(mode) | SPI_CS_CSPOLS(cspols) | SPI_CS_CS(channel) | SPI_CS_CSPOL(cspol) | SPI_CS_CLEAR(3);
 
-  if(bscFR != (bscsReg[BSC_FR] & 0xffff)) {
-    bscFR = bscsReg[BSC_FR] & 0xffff;
-    eventAlert[PI_EVENT_BSC].fired = 1;
-  }
+  spiReg[SPI_DLEN] = 2; /* undocumented, stops inter-byte gap */
 
-  for(b = 0; b <= PI_MAX_EVENT; b++) {
-    if(eventAlert[b].fired && (!eventAlert[b].ignore)) {
-      eventBits |= (1 << b);
+  if(!cont)
+    spiReg[SPI_CS] = spiDefaults; /* stop */
 
-      if(eventAlert[b].func) {
-        if(eventAlert[b].ex) {
-          (eventAlert[b].func)(b, eTick, eventAlert[b].userdata);
-        } else {
-          (eventAlert[b].func)(b, eTick);
-        }
-      }
-    }
+  if(!count)
+    return PI_SPI_PATH_POLL;
 
-    eventAlert[b].fired = 0;
+  if(flag3w) {
+    if(ren3w < count) {
+      cnt4w = ren3w;
+      cnt3w = count - ren3w;
+    } else {
+      cnt4w = count;
+      cnt3w = 0;
+    }
+  } else {
+    cnt4w = count;
+    cnt3w = 0;
   }
 
-  /* call alert callbacks for each bit transition */
+  spiReg[SPI_CLK] = 250000000 / speed;
 
-  if(changedBits & alertBits) {
-    oldLevel = (reportedLevel & alertBits);
+  /* large 4-wire transfers go by dma when it is running */
 
-    for(d = 0; d < numSamples; d++) {
-      newLevel = (sample[d].level & alertBits);
+  if(spiDmaVirt && (dmaLive > 0) && !flag3w && gpioCfg.spiDmaBytes && (count >= gpioCfg.spiDmaBytes) && (count <= SPI_DMA_MAX_BYTES)) {
+    err = spiGoDMA(speed, spiDefaults, txBuf, rxBuf, count, hold);
 
-      if(newLevel != oldLevel) {
-        changes = (newLevel ^ oldLevel);
+    if(err == 0)
+      return PI_SPI_PATH_DMA;
 
-        for(b = 0; b <= PI_MAX_USER_GPIO; b++) {
-          if(changes & (1 << b)) {
-            if(newLevel & (1 << b))
-              v = 1;
-            else
-              v = 0;
+    /* a timed out transfer is not repeated by polling */
 
-            if(gpioAlert[b].func) {
-              if(gpioAlert[b].ex) {
-                (gpioAlert[b].func)(b, v, sample[d].tick, gpioAlert[b].userdata);
-              } else {
-                (gpioAlert[b].func)(b, v, sample[d].tick);
-              }
-            }
-          }
-        }
-        oldLevel = newLevel;
-      }
+    if(err != -1)
+      return err;
+  }
+
+  spiReg[SPI_CS] = spiDefaults | SPI_CS_TA; /* start */
+
+  cnt = cnt4w;
+
+  while((txCnt < cnt) || (rxCnt < cnt)) {
+    while((rxCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_RXD))) {
+      if(rxBuf)
+        rxBuf[rxCnt] = spiReg[SPI_FIFO];
+      else
+        spi_dummy = spiReg[SPI_FIFO];
+      rxCnt++;
+    }
+
+    while((txCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_TXD))) {
+      if(txBuf)
+        spiReg[SPI_FIFO] = txBuf[txCnt];
+      else
+        spiReg[SPI_FIFO] = 0;
+      txCnt++;
     }
   }
 
-  /* check for watchdog timeouts */
+  while(!(spiReg[SPI_CS] & SPI_CS_DONE))
+    ;
 
-  timeoutBits = 0;
+  /* now switch to 3-wire bus */
 
-  if(wdogBits) {
-    for(b = 0; b <= PI_MAX_USER_GPIO; b++) {
-      if(gpioAlert[b].wdSteadyUs) {
-        diff = eTick - gpioAlert[b].wdTick;
+  cnt += cnt3w;
 
-        if(diff >= gpioAlert[b].wdSteadyUs) {
-          timeoutBits |= (1 << b);
+  spiReg[SPI_CS] |= SPI_CS_REN;
 
-          gpioAlert[b].wdTick = eTick;
+  while((txCnt < cnt) || (rxCnt < cnt)) {
+    while((rxCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_RXD))) {
+      if(rxBuf)
+        rxBuf[rxCnt] = spiReg[SPI_FIFO];
+      else
+        spi_dummy = spiReg[SPI_FIFO];
+      rxCnt++;
+    }
 
-          if(gpioAlert[b].func) {
-            if(gpioAlert[b].ex) {
-              (gpioAlert[b].func)(b, PI_TIMEOUT, eTick, gpioAlert[b].userdata);
-            } else {
-              (gpioAlert[b].func)(b, PI_TIMEOUT, eTick);
-            }
-          }
-        }
-      }
+    while((txCnt < cnt) && ((spiReg[SPI_CS] & SPI_CS_TXD))) {
+      if(txBuf)
+        spiReg[SPI_FIFO] = txBuf[txCnt];
+      else
+        spiReg[SPI_FIFO] = 0;
+      txCnt++;
     }
   }
 
-  for(n = 0; n < PI_NOTIFY_SLOTS; n++) {
-    if(gpioNotify[n].state == PI_NOTIFY_CLOSING) {
-      if(gpioNotify[n].pipe) {
-        DBG(DBG_INTERNAL, "close notify pipe %d", gpioNotify[n].fd);
-        close(gpioNotify[n].fd);
+  while(!(spiReg[SPI_CS] & SPI_CS_DONE))
+    ;
 
-        sprintf(fifo, "/dev/pigpio%d", n);
+  if(!hold)
+    spiReg[SPI_CS] = spiDefaults; /* stop */
 
-        unlink(fifo);
-      }
+  return PI_SPI_PATH_POLL;
+}
 
-      gpioNotify[n].state = PI_NOTIFY_CLOSED;
-    } else if(gpioNotify[n].state >= PI_NOTIFY_OPENED) {
-      bits = gpioNotify[n].bits;
+static void
+spiStatsAdd(int path, unsigned count, uint32_t start) {
+  if(count) {
+    spiStats[path].transfers++;
+    spiStats[path].bytes += count;
+    spiStats[path].micros += systReg[SYST_CLO] - start;
+  }
+}
 
-      emit = 0;
+static int
+spiGoAny(unsigned speed, uint32_t flags, char* txBuf, char* rxBuf, unsigned count, int cont, int hold) {
+  uint32_t start;
+  int path;
 
-      seqno = gpioNotify[n].seqno;
+  /* the caller holds the SPI mutex */
 
-      if(gpioNotify[n].state == PI_NOTIFY_RUNNING) {
-        /* check to see if any bits have changed for this
-           notification.
+  start = systReg[SYST_CLO];
 
-           bits         is the set of notification bits
-           changedBits is the set of changed bits
-        */
+  if(PI_SPI_FLAGS_GET_AUX_SPI(flags)) {
+    spiGoA(speed, flags, txBuf, rxBuf, count, cont, hold);
+    path = PI_SPI_PATH_AUX;
+  } else
+    path = spiGoS(speed, flags, txBuf, rxBuf, count, cont, hold);
 
-        if(changedBits & bits) {
-          oldLevel = reportedLevel & bits;
+  if(path < 0)
+    return path;
 
-          for(d = 0; d < numSamples; d++) {
-            newLevel = sample[d].level & bits;
+  spiStatsAdd(path, count, start);
 
-            if(newLevel != oldLevel) {
-              report[emit].seqno = seqno;
-              report[emit].flags = 0;
-              report[emit].tick = sample[d].tick;
-              report[emit].level = sample[d].level;
+  return path;
+}
 
-              oldLevel = newLevel;
+static void
+spiRelease(uint32_t flags) {
+  unsigned channel;
 
-              emit++;
-              seqno++;
-            }
-          }
-        }
+  channel = PI_SPI_FLAGS_GET_CHANNEL(flags);
 
-        /* check to see if any watchdogs are due for this
-           notification.
+  if(PI_SPI_FLAGS_GET_AUX_SPI(flags))
+    spiACS(channel, !(PI_SPI_FLAGS_GET_CSPOLS(flags) & (1 << channel)));
+  else
+    spiGoS(0, flags, NULL, NULL, 0, 0, 0);
+}
 
-           bits        is the set of notification bits
-           timeoutBits is the set of timed out bits
-        */
+static int
+spiGo(unsigned speed, uint32_t flags, char* txBuf, char* rxBuf, unsigned count) {
+  pthread_mutex_t* mutex;
+  int path;
 
-        bits = gpioNotify[n].bits;
+  if(PI_SPI_FLAGS_GET_AUX_SPI(flags))
+    mutex = &spiAuxMutex;
+  else
+    mutex = &spiMainMutex;
 
-        if(timeoutBits & bits) {
-          /* at least one watchdog has fired for this
-             notification.
-          */
+  pthread_mutex_lock(mutex);
+  path = spiGoAny(speed, flags, txBuf, rxBuf, count, 0, 0);
+  pthread_mutex_unlock(mutex);
 
-          for(b = 0; b <= PI_MAX_USER_GPIO; b++) {
-            if(timeoutBits & bits & (1 << b)) {
-              if(numSamples)
-                newLevel = sample[numSamples - 1].level;
-              else
-                newLevel = reportedLevel;
+  return path;
+}
 
-              report[emit].seqno = seqno;
-              report[emit].flags = PI_NTFY_FLAGS_WDOG | PI_NTFY_FLAGS_BIT(b);
-              report[emit].tick = eTick;
-              report[emit].level = newLevel;
+static int
+spiAnyOpen(uint32_t flags) {
+  int i, aux;
 
-              emit++;
-              seqno++;
-            }
-          }
-        }
-      }
+  aux = PI_SPI_FLAGS_GET_AUX_SPI(flags);
 
-      /* check to see if any events are due
+  for(i = 0; i < PI_SPI_SLOTS; i++) {
+    if((spiInfo[i].state == PI_SPI_OPENED) && (PI_SPI_FLAGS_GET_AUX_SPI(spiInfo[i].flags) == aux))
+      return 1;
+  }
+  return 0;
+}
 
-         eventBits is the set of events
-      */
+static void
+spiInit(uint32_t flags) {
+  uint32_t resvd, cspols;
 
-      if(eventBits & gpioNotify[n].eventBits) {
-        for(b = 0; b <= PI_MAX_EVENT; b++) {
-          if(eventBits & gpioNotify[n].eventBits & (1 << b)) {
-            if(numSamples)
-              newLevel = sample[numSamples - 1].level;
-            else
-              newLevel = reportedLevel;
+  resvd = PI_SPI_FLAGS_GET_RESVD(flags);
+  cspols = PI_SPI_FLAGS_GET_CSPOLS(flags);
 
-            report[emit].seqno = seqno;
-            report[emit].flags = PI_NTFY_FLAGS_EVENT | PI_NTFY_FLAGS_BIT(b);
-            report[emit].tick = eTick;
-            report[emit].level = newLevel;
+  if(PI_SPI_FLAGS_GET_AUX_SPI(flags)) {
+    /* enable module and access to registers */
+
+    auxReg[AUX_ENABLES] |= AUXENB_SPI1;
+
+    /* save original state */
+
+    old_mode_ace0 = gpioGetMode(PI_ASPI_CE0);
+    old_mode_ace1 = gpioGetMode(PI_ASPI_CE1);
+    old_mode_ace2 = gpioGetMode(PI_ASPI_CE2);
+    old_mode_asclk = gpioGetMode(PI_ASPI_SCLK);
+    old_mode_amiso = gpioGetMode(PI_ASPI_MISO);
+    old_mode_amosi = gpioGetMode(PI_ASPI_MOSI);
+
+    old_spi_cntl0 = auxReg[AUX_SPI0_CNTL0_REG];
+    old_spi_cntl1 = auxReg[AUX_SPI0_CNTL1_REG];
+
+    /* manually control auxiliary SPI chip selects */
+
+    if(!(resvd & 1)) {
+      myGpioSetMode(PI_ASPI_CE0, PI_OUTPUT);
+      myGpioWrite(PI_ASPI_CE0, !(cspols & 1));
+    }
+
+    if(!(resvd & 2)) {
+      myGpioSetMode(PI_ASPI_CE1, PI_OUTPUT);
+      myGpioWrite(PI_ASPI_CE1, !(cspols & 2));
+    }
+
+    if(!(resvd & 4)) {
+      myGpioSetMode(PI_ASPI_CE2, PI_OUTPUT);
+      myGpioWrite(PI_ASPI_CE2, !(cspols & 4));
+    }
+
+    /* set gpios to SPI mode */
+
+    myGpioSetMode(PI_ASPI_SCLK, PI_ALT4);
+    myGpioSetMode(PI_ASPI_MISO, PI_ALT4);
+    myGpioSetMode(PI_ASPI_MOSI, PI_ALT4);
+  } else {
+    /* save original state */
+
+    old_mode_ce0 = gpioGetMode(PI_SPI_CE0);
+    old_mode_ce1 = gpioGetMode(PI_SPI_CE1);
+    old_mode_sclk = gpioGetMode(PI_SPI_SCLK);
+    old_mode_miso = gpioGetMode(PI_SPI_MISO);
+    old_mode_mosi = gpioGetMode(PI_SPI_MOSI);
+
+    old_spi_cs = spiReg[SPI_CS];
+    old_spi_clk = spiReg[SPI_CLK];
+
+    /* set gpios to SPI mode */
+
+    if(!(resvd & 1))
+      myGpioSetMode(PI_SPI_CE0, PI_ALT0);
+    if(!(resvd & 2))
+      myGpioSetMode(PI_SPI_CE1, PI_ALT0);
+
+    myGpioSetMode(PI_SPI_SCLK, PI_ALT0);
+    myGpioSetMode(PI_SPI_MISO, PI_ALT0);
+    myGpioSetMode(PI_SPI_MOSI, PI_ALT0);
+  }
+}
+
+static void
+spiTerm(uint32_t flags) {
+  int resvd;
+
+  resvd = PI_SPI_FLAGS_GET_RESVD(flags);
+
+  if(PI_SPI_FLAGS_GET_AUX_SPI(flags)) {
+    /* disable module and access to registers */
+
+    auxReg[AUX_ENABLES] &= (~AUXENB_SPI1);
+
+    /* restore original state */
+
+    if(!(resvd & 1))
+      myGpioSetMode(PI_ASPI_CE0, old_mode_ace0);
+    if(!(resvd & 2))
+      myGpioSetMode(PI_ASPI_CE1, old_mode_ace1);
+    if(!(resvd & 4))
+      myGpioSetMode(PI_ASPI_CE2, old_mode_ace2);
+
+    myGpioSetMode(PI_ASPI_SCLK, old_mode_asclk);
+    myGpioSetMode(PI_ASPI_MISO, old_mode_amiso);
+    myGpioSetMode(PI_ASPI_MOSI, old_mode_amosi);
+
+    auxReg[AUX_SPI0_CNTL0_REG] = old_spi_cntl0;
+    auxReg[AUX_SPI0_CNTL1_REG] = old_spi_cntl1;
+  } else {
+    /* restore original state */
+
+    if(!(resvd & 1))
+      myGpioSetMode(PI_SPI_CE0, old_mode_ce0);
+    if(!(resvd & 2))
+      myGpioSetMode(PI_SPI_CE1, old_mode_ce1);
+
+    myGpioSetMode(PI_SPI_SCLK, old_mode_sclk);
+    myGpioSetMode(PI_SPI_MISO, old_mode_miso);
+    myGpioSetMode(PI_SPI_MOSI, old_mode_mosi);
+
+    spiReg[SPI_CS] = old_spi_cs;
+    spiReg[SPI_CLK] = old_spi_clk;
+  }
+}
+
+int
+spiOpen(unsigned spiChan, unsigned baud, unsigned spiFlags) {
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  int i, slot;
+
+  DBG(DBG_USER, "spiChan=%d baud=%d spiFlags=0x%X", spiChan, baud, spiFlags);
+
+  CHECK_INITED;
+
+  if(PI_SPI_FLAGS_GET_AUX_SPI(spiFlags)) {
+    if(gpioHardwareRevision() < 16)
+      SOFT_ERROR(PI_NO_AUX_SPI, "no auxiliary SPI on Pi A or B");
+
+    i = PI_NUM_AUX_SPI_CHANNEL;
+  } else
+    i = PI_NUM_STD_SPI_CHANNEL;
+
+  if(spiChan >= i)
+    SOFT_ERROR(PI_BAD_SPI_CHANNEL, "bad spiChan (%d)", spiChan);
+
+  if((baud < PI_SPI_MIN_BAUD) || (baud > PI_SPI_MAX_BAUD))
+    SOFT_ERROR(PI_BAD_SPI_SPEED, "bad baud (%d)", baud);
+
+  if(spiFlags > (1 << 22))
+    SOFT_ERROR(PI_BAD_FLAGS, "bad spiFlags (0x%X)", spiFlags);
+
+  if(!spiAnyOpen(spiFlags)) /* initialise on first open */
+  {
+    spiInit(spiFlags);
+    spiGo(baud, spiFlags, NULL, NULL, 0);
+  }
+
+  slot = -1;
+
+  pthread_mutex_lock(&mutex);
+
+  for(i = 0; i < PI_SPI_SLOTS; i++) {
+    if(spiInfo[i].state == PI_SPI_CLOSED) {
+      slot = i;
+      spiInfo[slot].state = PI_SPI_RESERVED;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&mutex);
+
+  if(slot < 0)
+    SOFT_ERROR(PI_NO_HANDLE, "no SPI handles");
+
+  spiInfo[slot].speed = baud;
+  spiInfo[slot].flags = spiFlags | PI_SPI_FLAGS_CHANNEL(spiChan);
+  spiInfo[slot].state = PI_SPI_OPENED;
+
+  return slot;
+}
+
+int
+spiClose(unsigned handle) {
+  DBG(DBG_USER, "handle=%d", handle);
+
+  CHECK_INITED;
+
+  if(handle >= PI_SPI_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(spiInfo[handle].state != PI_SPI_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  spiInfo[handle].state = PI_SPI_CLOSED;
+
+  if(!spiAnyOpen(spiInfo[handle].flags))
+    spiTerm(spiInfo[handle].flags); /* terminate on last close */
+
+  return 0;
+}
+
+int
+spiRead(unsigned handle, char* buf, unsigned count) {
+  DBG(DBG_USER, "handle=%d count=%d [%s]", handle, count, myBuf2Str(count, buf));
+
+  CHECK_INITED;
+
+  if(handle >= PI_SPI_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(spiInfo[handle].state != PI_SPI_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(count > PI_MAX_SPI_DEVICE_COUNT)
+    SOFT_ERROR(PI_BAD_SPI_COUNT, "bad count (%d)", count);
+
+  if(spiGo(spiInfo[handle].speed, spiInfo[handle].flags, NULL, buf, count) < 0)
+    SOFT_ERROR(PI_SPI_XFER_FAILED, "handle %d, read of %d bytes failed", handle, count);
+
+  return count;
+}
+
+int
+spiWrite(unsigned handle, char* buf, unsigned count) {
+  DBG(DBG_USER, "handle=%d count=%d [%s]", handle, count, myBuf2Str(count, buf));
+
+  CHECK_INITED;
+
+  if(handle >= PI_SPI_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(spiInfo[handle].state != PI_SPI_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(count > PI_MAX_SPI_DEVICE_COUNT)
+    SOFT_ERROR(PI_BAD_SPI_COUNT, "bad count (%d)", count);
+
+  if(spiGo(spiInfo[handle].speed, spiInfo[handle].flags, buf, NULL, count) < 0)
+    SOFT_ERROR(PI_SPI_XFER_FAILED, "handle %d, write of %d bytes failed", handle, count);
+
+  return count;
+}
+
+int
+spiXfer(unsigned handle, char* txBuf, char* rxBuf, unsigned count) {
+  DBG(DBG_USER, "handle=%d count=%d [%s]", handle, count, myBuf2Str(count, txBuf));
+
+  CHECK_INITED;
+
+  if(handle >= PI_SPI_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(spiInfo[handle].state != PI_SPI_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(count > PI_MAX_SPI_DEVICE_COUNT)
+    SOFT_ERROR(PI_BAD_SPI_COUNT, "bad count (%d)", count);
+
+  if(spiGo(spiInfo[handle].speed, spiInfo[handle].flags, txBuf, rxBuf, count) < 0)
+    SOFT_ERROR(PI_SPI_XFER_FAILED, "handle %d, xfer of %d bytes failed", handle, count);
+
+  return count;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+spiGetStats(unsigned path, spiStats_t* stats) {
+  DBG(DBG_USER, "path=%d stats=%08" PRIXPTR, path, (uintptr_t)stats);
+
+  CHECK_INITED;
+
+  if(path > PI_SPI_PATH_AUX)
+    SOFT_ERROR(PI_BAD_PARAM, "bad SPI path (%d)", path);
+
+  *stats = spiStats[path];
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+spiSegments(pi_spi_seg_t* segs, unsigned numSegs) {
+  int i, held, total, hold, needMain, needAux;
+  unsigned handle;
+
+  DBG(DBG_USER, "segs=%08" PRIXPTR " numSegs=%d", (uintptr_t)segs, numSegs);
+
+  CHECK_INITED;
+
+  if(segs == NULL)
+    SOFT_ERROR(PI_BAD_POINTER, "null segments");
+
+  if(!numSegs)
+    SOFT_ERROR(PI_BAD_SPI_SEG, "no segments");
+
+  if(numSegs > PI_SPI_MAX_SEGS)
+    SOFT_ERROR(PI_TOO_MANY_SEGS, "too many segments (%d)", numSegs);
+
+  needMain = 0;
+  needAux = 0;
+
+  for(i = 0; i < numSegs; i++) {
+    handle = segs[i].handle;
+
+    if(handle >= PI_SPI_SLOTS)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+    if(spiInfo[handle].state != PI_SPI_OPENED)
+      SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+    if(segs[i].flags & ~PI_SPI_SEG_CS_HOLD)
+      SOFT_ERROR(PI_BAD_SPI_SEG, "bad segment flags (0x%X)", segs[i].flags);
+
+    if(PI_SPI_FLAGS_GET_AUX_SPI(spiInfo[handle].flags))
+      needAux = 1;
+    else
+      needMain = 1;
+  }
+
+  /* one lock for the whole transaction, main before aux */
+
+  if(needMain)
+    pthread_mutex_lock(&spiMainMutex);
+
+  if(needAux)
+    pthread_mutex_lock(&spiAuxMutex);
+
+  held = -1;
+  total = 0;
+
+  for(i = 0; i < numSegs; i++) {
+    handle = segs[i].handle;
+
+    if((held >= 0) && (held != handle))
+      spiRelease(spiInfo[held].flags);
+
+    /* CS is always released after the last segment */
+
+    hold = (segs[i].flags & PI_SPI_SEG_CS_HOLD) && (i < (numSegs - 1));
+
+    if(spiGoAny(spiInfo[handle].speed, spiInfo[handle].flags, segs[i].txBuf, segs[i].rxBuf, segs[i].len, held == handle, hold) < 0) {
+      if(hold)
+        spiRelease(spiInfo[handle].flags);
+
+      total = PI_SPI_XFER_FAILED;
+      break;
+    }
+
+    total += segs[i].len;
+
+    held = hold ? handle : -1;
+
+    if(segs[i].delay)
+      myGpioDelay(segs[i].delay);
+  }
+
+  if(needAux)
+    pthread_mutex_unlock(&spiAuxMutex);
+
+  if(needMain)
+    pthread_mutex_unlock(&spiMainMutex);
+
+  if(total < 0)
+    SOFT_ERROR(PI_SPI_XFER_FAILED, "segment %d failed", i);
+
+  return total;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+spiSegmentsBuf(unsigned numSegs, char* inBuf, unsigned inLen, char* outBuf, unsigned outLen) {
+  pi_spi_seg_t segs[PI_SPI_MAX_SEGS];
+  unsigned i, inPos, outPos;
+  uint8_t* hdr;
+
+  /*
+  Each segment is a six byte header (handle, flags, length and
+  delay, least significant byte first) followed by length bytes
+  to transmit.  The received bytes are returned back to back.
+  */
+
+  if(!numSegs)
+    SOFT_ERROR(PI_BAD_SPI_SEG, "no segments");
+
+  if(numSegs > PI_SPI_MAX_SEGS)
+    SOFT_ERROR(PI_TOO_MANY_SEGS, "too many segments (%d)", numSegs);
+
+  inPos = 0;
+  outPos = 0;
+
+  for(i = 0; i < numSegs; i++) {
+    if((inPos + 6) > inLen)
+      SOFT_ERROR(PI_BAD_SPI_SEG, "segment %d truncated", i);
+
+    hdr = (uint8_t*)inBuf + inPos;
+
+    segs[i].handle = hdr[0];
+    segs[i].flags = hdr[1];
+    segs[i].len = hdr[2] | (hdr[3] << 8);
+    segs[i].delay = hdr[4] | (hdr[5] << 8);
+
+    inPos += 6;
+
+    if(((inPos + segs[i].len) > inLen) || ((outPos + segs[i].len) > outLen))
+      SOFT_ERROR(PI_BAD_SPI_SEG, "segment %d too long (%d)", i, segs[i].len);
+
+    segs[i].txBuf = inBuf + inPos;
+    segs[i].rxBuf = outBuf + outPos;
+
+    inPos += segs[i].len;
+    outPos += segs[i].len;
+  }
+
+  if(inPos != inLen)
+    SOFT_ERROR(PI_BAD_SPI_SEG, "%d bytes after last segment", inLen - inPos);
+
+  return spiSegments(segs, numSegs);
+}
+
+/* ======================================================================= */
+
+static void*
+pthSerRxThread(void* x) {
+  struct epoll_event ev[PI_SER_SLOTS];
+  int i, n, r, state, slot;
+  unsigned event, room, pos;
+
+  /* drains every open handle as data arrives so reads never hit the tty */
+
+  while(1) {
+    n = epoll_wait(serRxEpoll, ev, PI_SER_SLOTS, -1);
+
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+
+      DBG(DBG_ALWAYS, "serial epoll_wait failed (%m)");
+      break;
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+
+    for(i = 0; i < n; i++) {
+      slot = ev[i].data.u32;
+
+      pthread_mutex_lock(&serRxMutex);
+
+      if((serInfo[slot].state != PI_SER_OPENED) || !serInfo[slot].rxRing) {
+        pthread_mutex_unlock(&serRxMutex);
+        continue;
+      }
+
+      r = 0;
+
+      do {
+        pos = serInfo[slot].rxHead & (SER_RX_BUF_SIZE - 1);
+        room = SER_RX_BUF_SIZE - pos;
+
+        r = read(serInfo[slot].fd, serRxBuf[slot] + pos, room);
+
+        if(r > 0) {
+          serInfo[slot].rxHead += r;
+
+          /* a full ring keeps the newest data */
+
+          if((serInfo[slot].rxHead - serInfo[slot].rxTail) > SER_RX_BUF_SIZE) {
+            serInfo[slot].rxOverruns += (serInfo[slot].rxHead - serInfo[slot].rxTail) - SER_RX_BUF_SIZE;
+            serInfo[slot].rxTail = serInfo[slot].rxHead - SER_RX_BUF_SIZE;
+          }
+        }
+      } while(r == room);
+
+      if((r == 0) || ((r < 0) && (errno != EAGAIN) && (errno != EINTR)) || (ev[i].events & (EPOLLHUP | EPOLLERR))) {
+        /* device gone, stop watching it rather than spin */
+
+        epoll_ctl(serRxEpoll, EPOLL_CTL_DEL, serInfo[slot].fd, NULL);
+        serInfo[slot].rxRing = 0;
+      }
+
+      event = serInfo[slot].rxEvent;
+
+      pthread_mutex_unlock(&serRxMutex);
+
+      if(event <= PI_MAX_EVENT)
+        eventTrigger(event);
+    }
+
+    pthread_setcancelstate(state, NULL);
+  }
+
+  return NULL;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+serRxWatch(int slot) {
+  struct epoll_event ev;
+
+  /* called with serRxMutex locked, an unwatched handle reads the tty
+     once its ring is empty */
+
+  serInfo[slot].rxRing = 0;
+  serInfo[slot].rxHead = 0;
+  serInfo[slot].rxTail = 0;
+  serInfo[slot].rxOverruns = 0;
+  serInfo[slot].rxEvent = PI_SER_NO_EVENT;
+
+  if(!serRxRunning) {
+    serRxEpoll = epoll_create1(EPOLL_CLOEXEC);
+
+    if(serRxEpoll < 0) {
+      DBG(DBG_ALWAYS, "serial epoll_create1 failed (%m)");
+      return;
+    }
+
+    if(pthread_create(&pthSerRx, NULL, pthSerRxThread, NULL)) {
+      DBG(DBG_ALWAYS, "serial receive thread create failed (%m)");
+      close(serRxEpoll);
+      serRxEpoll = -1;
+      return;
+    }
+
+    serRxRunning = 1;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = slot;
+
+  if(epoll_ctl(serRxEpoll, EPOLL_CTL_ADD, serInfo[slot].fd, &ev) == 0)
+    serInfo[slot].rxRing = 1;
+  else
+    DBG(DBG_ALWAYS, "serial epoll_ctl failed (%m)");
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+serRxTake(unsigned handle, char* buf, unsigned count) {
+  unsigned avail, pos, n;
+
+  /* called with serRxMutex locked */
+
+  avail = serInfo[handle].rxHead - serInfo[handle].rxTail;
+
+  if(count > avail)
+    count = avail;
+
+  pos = serInfo[handle].rxTail & (SER_RX_BUF_SIZE - 1);
+  n = SER_RX_BUF_SIZE - pos;
+
+  if(n > count)
+    n = count;
+
+  memcpy(buf, serRxBuf[handle] + pos, n);
+  memcpy(buf + n, serRxBuf[handle], count - n);
+
+  serInfo[handle].rxTail += count;
+
+  return count;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+serOpen(char* tty, unsigned serBaud, unsigned serFlags) {
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  struct termios new;
+  int speed;
+  int fd;
+  int i, slot;
+
+  DBG(DBG_USER, "tty=%s serBaud=%d serFlags=0x%X", tty, serBaud, serFlags);
+
+  SER_CHECK_INITED;
+
+  if(strncmp("/dev/tty", tty, 8) && strncmp("/dev/serial", tty, 11))
+    SOFT_ERROR(PI_BAD_SER_DEVICE, "bad device (%s)", tty);
+
+  switch(serBaud) {
+    case 50: speed = B50; break;
+    case 75: speed = B75; break;
+    case 110: speed = B110; break;
+    case 134: speed = B134; break;
+    case 150: speed = B150; break;
+    case 200: speed = B200; break;
+    case 300: speed = B300; break;
+    case 600: speed = B600; break;
+    case 1200: speed = B1200; break;
+    case 1800: speed = B1800; break;
+    case 2400: speed = B2400; break;
+    case 4800: speed = B4800; break;
+    case 9600: speed = B9600; break;
+    case 19200: speed = B19200; break;
+    case 38400: speed = B38400; break;
+    case 57600: speed = B57600; break;
+    case 115200: speed = B115200; break;
+    case 230400: speed = B230400; break;
+
+    default: SOFT_ERROR(PI_BAD_SER_SPEED, "bad speed (%d)", serBaud);
+  }
+
+  if(serFlags)
+    SOFT_ERROR(PI_BAD_FLAGS, "bad flags (0x%X)", serFlags);
+
+  slot = -1;
+
+  pthread_mutex_lock(&mutex);
+
+  for(i = 0; i < PI_SER_SLOTS; i++) {
+    if(serInfo[i].state == PI_SER_CLOSED) {
+      slot = i;
+      serInfo[slot].state = PI_SER_RESERVED;
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&mutex);
+
+  if(slot < 0)
+    SOFT_ERROR(PI_NO_HANDLE, "no serial handles");
+
+  if((fd = open(tty, O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK)) == -1) {
+    serInfo[slot].state = PI_SER_CLOSED;
+    return PI_SER_OPEN_FAILED;
+  }
+
+  tcgetattr(fd, &new);
+
+  cfmakeraw(&new);
+
+  cfsetispeed(&new, speed);
+  cfsetospeed(&new, speed);
+
+  new.c_cc[VMIN] = 0;
+  new.c_cc[VTIME] = 0;
+
+  tcflush(fd, TCIFLUSH);
+  tcsetattr(fd, TCSANOW, &new);
+
+  // fcntl(fd, F_SETFL, O_RDWR);
+
+  pthread_mutex_lock(&serRxMutex);
+
+  serInfo[slot].fd = fd;
+  serInfo[slot].flags = serFlags;
+
+  serRxWatch(slot);
+
+  serInfo[slot].state = PI_SER_OPENED;
+
+  pthread_mutex_unlock(&serRxMutex);
+
+  return slot;
+}
+
+int
+serClose(unsigned handle) {
+  DBG(DBG_USER, "handle=%d", handle);
+
+  SER_CHECK_INITED;
+
+  if(handle >= PI_SER_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(serInfo[handle].state != PI_SER_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  pthread_mutex_lock(&serRxMutex);
+
+  if(serInfo[handle].rxRing)
+    epoll_ctl(serRxEpoll, EPOLL_CTL_DEL, serInfo[handle].fd, NULL);
+
+  if(serInfo[handle].fd >= 0)
+    close(serInfo[handle].fd);
+
+  serInfo[handle].rxRing = 0;
+  serInfo[handle].fd = -1;
+  serInfo[handle].state = PI_SER_CLOSED;
+
+  pthread_mutex_unlock(&serRxMutex);
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+serRxEvent(unsigned handle, unsigned event) {
+  DBG(DBG_USER, "handle=%d event=%d", handle, event);
+
+  SER_CHECK_INITED;
+
+  if(handle >= PI_SER_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(serInfo[handle].state != PI_SER_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if((event > PI_MAX_EVENT) && (event != PI_SER_NO_EVENT))
+    SOFT_ERROR(PI_BAD_EVENT_ID, "bad event (%d)", event);
+
+  /* events are reported by the alert thread */
+
+  if(event <= PI_MAX_EVENT)
+    CHECK_DMA;
+
+  pthread_mutex_lock(&serRxMutex);
+
+  serInfo[handle].rxEvent = event;
+
+  pthread_mutex_unlock(&serRxMutex);
+
+  return 0;
+}
+
+int
+serRxOverruns(unsigned handle) {
+  int result;
+
+  DBG(DBG_USER, "handle=%d", handle);
+
+  SER_CHECK_INITED;
+
+  if(handle >= PI_SER_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(serInfo[handle].state != PI_SER_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  pthread_mutex_lock(&serRxMutex);
+
+  result = serInfo[handle].rxOverruns & 0x7FFFFFFF;
+
+  pthread_mutex_unlock(&serRxMutex);
+
+  return result;
+}
+
+int
+serWriteByte(unsigned handle, unsigned bVal) {
+  char c;
+
+  DBG(DBG_USER, "handle=%d bVal=%d", handle, bVal);
+
+  SER_CHECK_INITED;
+
+  if(handle >= PI_SER_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(serInfo[handle].state != PI_SER_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(bVal > 0xFF)
+    SOFT_ERROR(PI_BAD_PARAM, "bad parameter (%d)", bVal);
+
+  c = bVal;
+
+  if(write(serInfo[handle].fd, &c, 1) != 1)
+    return PI_SER_WRITE_FAILED;
+  else
+    return 0;
+}
+
+int
+serReadByte(unsigned handle) {
+  int r;
+  char x;
+
+  DBG(DBG_USER, "handle=%d", handle);
+
+  SER_CHECK_INITED;
+
+  if(handle >= PI_SER_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(serInfo[handle].state != PI_SER_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  pthread_mutex_lock(&serRxMutex);
+
+  if(serInfo[handle].rxRing || (serInfo[handle].rxHead != serInfo[handle].rxTail)) {
+    r = serRxTake(handle, &x, 1);
+    pthread_mutex_unlock(&serRxMutex);
+
+    if(r == 1)
+      return ((int)x) & 0xFF;
+    else
+      return PI_SER_READ_NO_DATA;
+  }
+
+  pthread_mutex_unlock(&serRxMutex);
+
+  r = read(serInfo[handle].fd, &x, 1);
+
+  if(r == 1)
+    return ((int)x) & 0xFF;
+
+  else if(r == 0)
+    return PI_SER_READ_NO_DATA;
+
+  else if((r == -1) && (errno == EAGAIN))
+    return PI_SER_READ_NO_DATA;
+
+  else
+    return PI_SER_READ_FAILED;
+}
+
+int
+serWrite(unsigned handle, char* buf, unsigned count) {
+  int written = 0, wrote = 0;
+
+  DBG(DBG_USER, "handle=%d count=%d [%s]", handle, count, myBuf2Str(count, buf));
+
+  SER_CHECK_INITED;
+
+  if(handle >= PI_SER_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(serInfo[handle].state != PI_SER_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(!count)
+    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+
+  while((written != count) && (wrote >= 0)) {
+    wrote = write(serInfo[handle].fd, buf + written, count - written);
+
+    if(wrote >= 0) {
+      written += wrote;
+
+      if(written != count)
+        time_sleep(0.05);
+    }
+  }
+
+  if(written != count)
+    return PI_SER_WRITE_FAILED;
+  else
+    return 0;
+}
+
+int
+serRead(unsigned handle, char* buf, unsigned count) {
+  int r;
+
+  DBG(DBG_USER, "handle=%d count=%d buf=0x%" PRIXPTR, handle, count, (uintptr_t)buf);
+
+  SER_CHECK_INITED;
+
+  if(handle >= PI_SER_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(serInfo[handle].state != PI_SER_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(!count)
+    SOFT_ERROR(PI_BAD_PARAM, "bad count (%d)", count);
+
+  pthread_mutex_lock(&serRxMutex);
+
+  if(serInfo[handle].rxRing || (serInfo[handle].rxHead != serInfo[handle].rxTail)) {
+    r = serRxTake(handle, buf, count);
+    pthread_mutex_unlock(&serRxMutex);
+
+    if(!r)
+      return PI_SER_READ_NO_DATA;
+
+    if(r < count)
+      buf[r] = 0;
+    return r;
+  }
+
+  pthread_mutex_unlock(&serRxMutex);
+
+  r = read(serInfo[handle].fd, buf, count);
+
+  if(r == -1) {
+    if(errno == EAGAIN)
+      return PI_SER_READ_NO_DATA;
+    else
+      return PI_SER_READ_FAILED;
+  } else {
+    if(r < count)
+      buf[r] = 0;
+    return r;
+  }
+}
+
+int
+serDataAvailable(unsigned handle) {
+  int result;
+
+  DBG(DBG_USER, "handle=%d", handle);
+
+  SER_CHECK_INITED;
+
+  if(handle >= PI_SER_SLOTS)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  if(serInfo[handle].state != PI_SER_OPENED)
+    SOFT_ERROR(PI_BAD_HANDLE, "bad handle (%d)", handle);
+
+  pthread_mutex_lock(&serRxMutex);
+
+  if(serInfo[handle].rxRing || (serInfo[handle].rxHead != serInfo[handle].rxTail)) {
+    result = serInfo[handle].rxHead - serInfo[handle].rxTail;
+    pthread_mutex_unlock(&serRxMutex);
+    return result;
+  }
+
+  pthread_mutex_unlock(&serRxMutex);
+
+  if(ioctl(serInfo[handle].fd, FIONREAD, &result) == -1)
+    return 0;
+
+  return result;
+}
+
+/* ======================================================================= */
+
+static int
+chooseBestClock(clkInf_t* clkInf, unsigned f, unsigned numc, unsigned* cf) {
+  int c, valid;
+  double fdiv, offby, best_offby;
+  unsigned div, frac;
+
+  valid = 0;
+  best_offby = 0;
+
+  for(c = 0; c < numc; c++) {
+    fdiv = (double)cf[c] / (double)f;
+    if(f < PI_MASH_MAX_FREQ) {
+      fdiv += (0.5 / 4096.0);
+      div = fdiv;
+      frac = (fdiv - div) * 4096.0;
+    } else {
+      fdiv += 0.5;
+      div = fdiv;
+      frac = 0;
+    }
+
+    if((div > 1) && (div < 4096)) {
+      offby = f - (cf[c] / (div + (frac / 4096.0)));
+      if(offby < 0)
+        offby = -offby;
+      if((!valid) || (offby <= best_offby)) {
+        valid = 1;
+        clkInf->div = div;
+        clkInf->frac = frac;
+        clkInf->clock = c;
+        best_offby = offby;
+      }
+    }
+  }
+  return valid;
+}
+
+/* ======================================================================= */
+
+static rawCbs_t*
+dmaCB2adr(int pos) {
+  int page, slot;
+
+  page = pos / CBS_PER_IPAGE;
+  slot = pos % CBS_PER_IPAGE;
+
+  return &dmaIVirt[page]->cb[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+dmaCbPrint(int pos) {
+  rawCbs_t* p;
+
+  p = dmaCB2adr(pos);
+
+  fprintf(stderr, "i=%x s=%x d=%x len=%x s=%x nxt=%x\n", p->info, p->src, p->dst, p->length, p->stride, p->next);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned
+dmaNowAtICB(void) {
+  int page;
+  uint32_t cbAddr, offset;
+  uint32_t startTick = 0;
+
+  if(gpioCfg.internals & PI_CFG_STATS)
+    startTick = systReg[SYST_CLO];
+
+  cbAddr = dmaIn[DMA_CONBLK_AD];
+
+  /* which page are we dma'ing? */
+
+  page = dmaPageFind(cbAddr);
+
+  if((page < 0) || (page >= DMAI_PAGES))
+    return 0;
+
+  // cast twice to suppress compiler warning, I belive this cast is ok
+  // because dmaIbus contains bus addresses, not user addresses. --plugwash
+  offset = cbAddr - (uint32_t)(uintptr_t)dmaIBus[page];
+
+  if(offset >= (CBS_PER_IPAGE * 32))
+    return 0;
+
+  if(gpioCfg.internals & PI_CFG_STATS)
+    gpioStats.cbTicks += (systReg[SYST_CLO] - startTick);
+
+  gpioStats.cbCalls++;
+
+  return (page * CBS_PER_IPAGE) + (offset / 32);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+dmaNowAtOCB(void) {
+  int page, try;
+  uint32_t cbAddr, offset;
+
+  /* Try twice */
+
+  for(try = 0; try < 2; try++) {
+    cbAddr = dmaOut[DMA_CONBLK_AD];
+
+    if(!cbAddr)
+      return -PI_NO_TX_WAVE;
+
+    /* which page are we dma'ing? */
+
+    page = dmaOPageFind(cbAddr, &offset);
+
+    if((page >= 0) && (offset < (CBS_PER_OPAGE * 32)))
+      return (page * CBS_PER_OPAGE) + (offset / 32);
+  }
+
+  return -PI_WAVE_NOT_FOUND;
+}
+
+/* ----------------------------------------------------------------------- */
+
+unsigned
+rawWaveCB(void) {
+  int page;
+  uint32_t cbAddr, offset;
+
+  cbAddr = dmaOut[DMA_CONBLK_AD];
+
+  if(!cbAddr)
+    return -1;
+
+  /* which page are we dma'ing? */
+
+  page = dmaOPageFind(cbAddr, &offset);
+
+  if((page < 0) || (offset >= (CBS_PER_OPAGE * 32)))
+    return 0;
+
+  return (page * CBS_PER_OPAGE) + (offset / 32);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static unsigned
+dmaCurrentSlot(unsigned pos) {
+  unsigned cycle = 0, slot = 0, tmp;
+
+  cycle = (pos / CBS_PER_CYCLE);
+  tmp = (pos % CBS_PER_CYCLE);
+
+  if(tmp > 2)
+    slot = ((tmp - 2) / 3);
+
+  return (cycle * PULSE_PER_CYCLE) + slot;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t
+dmaPwmDataAdr(int pos) {
+  // cast twice to suppress compiler warning, I belive this cast is ok
+  // because dmaIbus contains bus addresses, not user addresses. --plugwash
+  return (uint32_t)(uintptr_t)&dmaIBus[pos]->periphData;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t
+dmaGpioOnAdr(int pos) {
+  int page, slot;
+
+  page = pos / ON_PER_IPAGE;
+  slot = pos % ON_PER_IPAGE;
+
+  // cast twice to suppress compiler warning, I belive this cast is ok
+  // because dmaIbus contains bus addresses, not user addresses. --plugwash
+  return (uint32_t)(uintptr_t)&dmaIBus[page]->gpioOn[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t
+dmaGpioOffAdr(int pos) {
+  int page, slot;
+
+  myOffPageSlot(pos, &page, &slot);
+
+  // cast twice to suppress compiler warning, I belive this cast is ok
+  // because dmaIbus contains bus addresses, not user addresses. --plugwash
+  return (uint32_t)(uintptr_t)&dmaIBus[page]->gpioOff[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t
+dmaTickAdr(int pos) {
+  int page, slot;
+
+  myTckPageSlot(pos, &page, &slot);
+
+  // cast twice to suppress compiler warning, I belive this cast is ok
+  // because dmaIbus contains bus addresses, not user addresses. --plugwash
+  return (uint32_t)(uintptr_t)&dmaIBus[page]->tick[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t
+dmaReadLevelsAdr(int pos) {
+  int page, slot;
+
+  myLvsPageSlot(pos, &page, &slot);
+
+  // cast twice to suppress compiler warning, I belive this cast is ok
+  // because dmaIbus contains bus addresses, not user addresses. --plugwash
+  return (uint32_t)(uintptr_t)&dmaIBus[page]->level[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t
+dmaCbAdr(int pos) {
+  int page, slot;
+
+  page = (pos / CBS_PER_IPAGE);
+  slot = (pos % CBS_PER_IPAGE);
+
+  // cast twice to suppress compiler warning, I belive this cast is ok
+  // because dmaIbus contains bus addresses, not user addresses. --plugwash
+  return (uint32_t)(uintptr_t)&dmaIBus[page]->cb[slot];
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+dmaGpioOnCb(int b, int pos) {
+  rawCbs_t* p;
+
+  p = dmaCB2adr(b);
+
+  p->info = NORMAL_DMA;
+  p->src = dmaGpioOnAdr(pos);
+  p->dst = ((GPIO_BASE + (GPSET0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
+  p->length = 4;
+  p->next = dmaCbAdr(b + 1);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+dmaTickCb(int b, int pos) {
+  rawCbs_t* p;
+
+  p = dmaCB2adr(b);
+
+  p->info = NORMAL_DMA;
+  p->src = ((SYST_BASE + (SYST_CLO * 4)) & 0x00ffffff) | PI_PERI_BUS;
+  p->dst = dmaTickAdr(pos);
+  p->length = 4;
+  p->next = dmaCbAdr(b + 1);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+dmaGpioOffCb(int b, int pos) {
+  rawCbs_t* p;
+
+  p = dmaCB2adr(b);
+
+  p->info = NORMAL_DMA;
+  p->src = dmaGpioOffAdr(pos);
+  p->dst = ((GPIO_BASE + (GPCLR0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
+  p->length = 4;
+  p->next = dmaCbAdr(b + 1);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+dmaReadLevelsCb(int b, int pos) {
+  rawCbs_t* p;
+
+  p = dmaCB2adr(b);
+
+  p->info = NORMAL_DMA;
+  p->src = ((GPIO_BASE + (GPLEV0 * 4)) & 0x00ffffff) | PI_PERI_BUS;
+  p->dst = dmaReadLevelsAdr(pos);
+  p->length = 4;
+  p->next = dmaCbAdr(b + 1);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+dmaDelayCb(int b) {
+  rawCbs_t* p;
+
+  p = dmaCB2adr(b);
+
+  if(gpioCfg.clockPeriph == PI_CLOCK_PCM) {
+    p->info = NORMAL_DMA | TIMED_DMA(2);
+    p->dst = PCM_TIMER;
+  } else {
+    p->info = NORMAL_DMA | TIMED_DMA(5);
+    p->dst = PWM_TIMER;
+  }
+
+  p->src = dmaPwmDataAdr(b % DMAI_PAGES);
+  p->length = 4;
+  p->next = dmaCbAdr(b + 1);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+dmaInitCbs(void) {
+  int b, pulse, level, cycle;
+
+  rawCbs_t* p;
+
+  /* set up the DMA control blocks */
+
+  DBG(DBG_STARTUP, "");
+
+  gpioStats.dmaInitCbsCount++;
+
+  b = -1;
+  level = 0;
+
+  for(cycle = 0; cycle < bufferCycles; cycle++) {
+    b++;
+    dmaGpioOnCb(b, cycle % SUPERCYCLE); /* gpio on slot */
+
+    b++;
+    dmaTickCb(b, cycle); /* tick slot */
+
+    for(pulse = 0; pulse < PULSE_PER_CYCLE; pulse++) {
+      b++;
+      dmaReadLevelsCb(b, level); /* read levels slot */
+
+      b++;
+      dmaDelayCb(b); /* delay slot */
+
+      b++;
+      dmaGpioOffCb(b, (level % SUPERLEVEL) + 1); /* gpio off slot */
+
+      ++level;
+    }
+  }
+
+  /* point last cb back to first for continuous loop */
+
+  p = dmaCB2adr(b);
+
+  p->next = dmaCbAdr(0);
+
+  DBG(DBG_STARTUP, "DMA page type count = %zd", sizeof(dmaIPage_t));
+
+  DBG(DBG_STARTUP, "%d control blocks (exp=%d)", b + 1, NUM_CBS);
+}
+
+/* ======================================================================= */
+
+static void
+sigHandler(int signum) {
+  if((signum >= PI_MIN_SIGNUM) && (signum <= PI_MAX_SIGNUM)) {
+    if(gpioSignal[signum].func) {
+      if(gpioSignal[signum].ex) {
+        (gpioSignal[signum].func)(signum, gpioSignal[signum].userdata);
+      } else {
+        (gpioSignal[signum].func)(signum);
+      }
+    } else {
+      switch(signum) {
+        case SIGUSR1:
+
+          if(gpioCfg.dbgLevel > DBG_MIN_LEVEL)
+            --gpioCfg.dbgLevel;
+          else
+            gpioCfg.dbgLevel = DBG_MIN_LEVEL;
+          DBG(DBG_USER, "Debug level %d\n", gpioCfg.dbgLevel);
+          break;
+
+        case SIGUSR2:
+          if(gpioCfg.dbgLevel < DBG_MAX_LEVEL)
+            ++gpioCfg.dbgLevel;
+          else
+            gpioCfg.dbgLevel = DBG_MAX_LEVEL;
+          DBG(DBG_USER, "Debug level %d\n", gpioCfg.dbgLevel);
+          break;
+
+        case SIGPIPE:
+        case SIGWINCH: DBG(DBG_USER, "signal %d ignored", signum); break;
+
+        case SIGCHLD:
+          /* Used to notify threads of events */
+          break;
+
+        default:
+          DBG(DBG_ALWAYS, "Unhandled signal %d, terminating\n", signum);
+          gpioTerminate();
+          exit(-1);
+      }
+    }
+  } else {
+    /* exit */
+
+    DBG(DBG_ALWAYS, "Unhandled signal %d, terminating\n", signum);
+    gpioTerminate();
+    exit(-1);
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+sigSetHandler(void) {
+  int i;
+  struct sigaction new;
+
+  for(i = PI_MIN_SIGNUM; i <= PI_MAX_SIGNUM; i++) {
+
+    memset(&new, 0, sizeof(new));
+    new.sa_handler = sigHandler;
+
+    sigaction(i, &new, NULL);
+  }
+}
+
+/*
+   freq mics  net
+ 0 1000 1000  900
+ 1 4000  250  225
+ 2 3750  266  240
+ 3 3500  285  257
+ 4 3250  307  276
+ 5 3000  333  300
+ 6 2750  363  327
+ 7 2500  400  360
+ 8 2250  444  400
+ 9 2000  500  450
+10 1750  571  514
+11 1500  666  600
+12 1250  800  720
+13 1000 1000  900
+14 750  1333 1200
+15 500  2000 1800
+*/
+
+unsigned alert_delays[] = {900000, 225000, 240000, 257142, 276923, 300000, 327272, 360000, 400000, 450000, 514285, 600000, 720000, 900000, 1200000, 1800000};
+
+/* ======================================================================= */
+
+static void
+alertTicks(uint32_t* cycleTick, int cycles, uint32_t* tick) {
+  int c, i, diff, minDiff, step, ticks;
+  uint32_t ft;
+
+  /*
+  cycleTick[c] is the tick read at the start of cycle c.  The
+  samples of a cycle are clockMicros apart unless the next cycle
+  started earlier or later than expected.  Then they are spread
+  evenly over the cycle's actual duration.
+  */
+
+  step = gpioCfg.clockMicros;
+  minDiff = step / 2;
+
+  for(c = 0; c < cycles; c++) {
+    ft = cycleTick[c];
+    ticks = cycleTick[c + 1] - ft;
+    diff = ticks - (PULSE_PER_CYCLE * step);
+
+    if(abs(diff) > minDiff) {
+      for(i = 0; i < PULSE_PER_CYCLE; i++) tick[i] = ((i * ticks) / PULSE_PER_CYCLE) + ft;
+    } else {
+      for(i = 0; i < PULSE_PER_CYCLE; i++) tick[i] = (i * step) + ft;
+    }
+
+    tick += PULSE_PER_CYCLE;
+
+    diff += (TICKSLOTS / 2);
+
+    if(diff < 0)
+      gpioStats.diffTick[0]++;
+    else if(diff >= TICKSLOTS)
+      gpioStats.diffTick[TICKSLOTS - 1]++;
+    else
+      gpioStats.diffTick[diff]++;
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+alertGlitchFilter(uint32_t* tick, uint32_t* level, int numSamples) {
+  int i, j, diff;
+  uint32_t steadyUs, changedTick, RBitV, LBitV, initialised;
+  uint32_t bit, bitV;
+
+  for(i = 0; i <= PI_MAX_USER_GPIO; i++) {
+    bit = (1 << i);
+
+    if(monitorBits & bit & gFilterBits) {
+      initialised = gpioAlert[i].gfInitialised;
+      if(!initialised && numSamples > 0) {
+        /* Initialise filter with first sample */
+        bitV = level[0] & bit;
+        gpioAlert[i].gfRBitV = bitV;
+        gpioAlert[i].gfLBitV = bitV;
+        gpioAlert[i].gfTick = tick[0];
+        gpioAlert[i].gfInitialised = 1;
+      }
+
+      steadyUs = gpioAlert[i].gfSteadyUs;
+      RBitV = gpioAlert[i].gfRBitV;
+      LBitV = gpioAlert[i].gfLBitV;
+      changedTick = gpioAlert[i].gfTick;
+
+      for(j = 0; j < numSamples; j++) {
+        bitV = level[j] & bit;
+
+        if(bitV != LBitV) {
+          /* Difference between level and last level.
+             Restart steady timer. */
+
+          changedTick = tick[j];
+          LBitV = bitV;
+        }
+
+        if(bitV != RBitV) {
+          /* Difference between level and reported level. */
+
+          diff = tick[j] - changedTick;
+
+          if(diff >= steadyUs) {
+            /* Level stable for steady period. */
+            RBitV = bitV;
+          } else {
+            /* Keep reporting old level. */
+
+            level[j] ^= bit;
+          }
+        }
+      }
+
+      gpioAlert[i].gfRBitV = RBitV;
+      gpioAlert[i].gfLBitV = LBitV;
+      gpioAlert[i].gfTick = changedTick;
+    }
+  }
+}
+
+static void
+alertNoiseFilter(uint32_t* tick, uint32_t* level, int numSamples) {
+  int i, j, diff;
+  uint32_t LBitV;
+  uint32_t bit, bitV;
+  uint32_t nowTick;
+
+  for(i = 0; i <= PI_MAX_USER_GPIO; i++) {
+    bit = (1 << i);
+
+    if(monitorBits & bit & nFilterBits) {
+      LBitV = gpioAlert[i].nfLBitV;
+
+      for(j = 0; j < numSamples; j++) {
+        bitV = level[j] & bit;
+        nowTick = tick[j];
+
+        if(gpioAlert[i].nfActive) /* reporting events */
+        {
+          diff = nowTick - gpioAlert[i].nfTick2;
+
+          if(diff >= 0) {
+            /* Stop reporting gpio changes */
+
+            gpioAlert[i].nfActive = 0;
+            gpioAlert[i].nfTick1 = nowTick;
+          }
+        } else /* waiting for steady us */
+        {
+          if(bitV != LBitV) {
+            diff = nowTick - gpioAlert[i].nfTick1;
+            gpioAlert[i].nfTick1 = nowTick;
+
+            if(diff >= gpioAlert[i].nfSteadyUs) {
+              /* Start reporting gpio changes */
+
+              gpioAlert[i].nfRBitV = LBitV;
+              gpioAlert[i].nfActive = 1;
+              gpioAlert[i].nfTick2 = nowTick + gpioAlert[i].nfActiveUs;
+            }
+          }
+        }
+
+        if(!gpioAlert[i].nfActive) {
+          if(bitV != gpioAlert[i].nfRBitV)
+            level[j] ^= bit;
+        }
+
+        LBitV = bitV;
+      }
+
+      gpioAlert[i].nfLBitV = LBitV;
+    }
+  }
+}
+
+static void
+alertEmit(gpioSample_t* sample, int numSamples, uint32_t changedBits, uint32_t eTick) {
+  uint32_t oldLevel, newLevel;
+  int32_t diff;
+  int emit, seqno, emitted;
+  uint32_t changes, bits, timeoutBits, eventBits;
+  int d;
+  int b, n, v;
+  int err;
+  int max_emits;
+  char fifo[32];
+  /* ensure space for maximum number of watchdog and event notifications */
+  gpioReport_t report[MAX_REPORT + PI_MAX_USER_GPIO + 1 + PI_MAX_EVENT + 1];
+
+  if(changedBits) {
+    if(gpioGetSamples.func) {
+      if(gpioGetSamples.ex) {
+        (gpioGetSamples.func)(sample, numSamples, gpioGetSamples.userdata);
+      } else {
+        (gpioGetSamples.func)(sample, numSamples);
+      }
+    }
+  }
+
+  waveRxSerialBatch(sample, numSamples, eTick);
+
+  eventBits = 0;
+
+  if(bscSvc.open)
+    bscServiceTick(eTick);
+  else if(bscFR != (bscsReg[BSC_FR] & 0xffff)) {
+    bscFR = bscsReg[BSC_FR] & 0xffff;
+    eventAlert[PI_EVENT_BSC].fired = 1;
+  }
+
+  for(b = 0; b <= PI_MAX_EVENT; b++) {
+    if(eventAlert[b].fired && (!eventAlert[b].ignore)) {
+      eventBits |= (1 << b);
+
+      if(eventAlert[b].func) {
+        if(eventAlert[b].ex) {
+          (eventAlert[b].func)(b, eTick, eventAlert[b].userdata);
+        } else {
+          (eventAlert[b].func)(b, eTick);
+        }
+      }
+    }
+
+    eventAlert[b].fired = 0;
+  }
+
+  /* call alert callbacks for each bit transition */
+
+  if(changedBits & alertBits) {
+    oldLevel = (reportedLevel & alertBits);
+
+    for(d = 0; d < numSamples; d++) {
+      newLevel = (sample[d].level & alertBits);
+
+      if(newLevel != oldLevel) {
+        changes = (newLevel ^ oldLevel);
+
+        for(b = 0; b <= PI_MAX_USER_GPIO; b++) {
+          if(changes & (1 << b)) {
+            if(newLevel & (1 << b))
+              v = 1;
+            else
+              v = 0;
+
+            if(gpioAlert[b].func) {
+              if(gpioAlert[b].ex) {
+                (gpioAlert[b].func)(b, v, sample[d].tick, gpioAlert[b].userdata);
+              } else {
+                (gpioAlert[b].func)(b, v, sample[d].tick);
+              }
+            }
+          }
+        }
+        oldLevel = newLevel;
+      }
+    }
+  }
+
+  /* check for watchdog timeouts */
+
+  timeoutBits = 0;
+
+  if(wdogBits) {
+    for(b = 0; b <= PI_MAX_USER_GPIO; b++) {
+      if(gpioAlert[b].wdSteadyUs) {
+        diff = eTick - gpioAlert[b].wdTick;
+
+        if(diff >= gpioAlert[b].wdSteadyUs) {
+          timeoutBits |= (1 << b);
+
+          gpioAlert[b].wdTick = eTick;
+
+          if(gpioAlert[b].func) {
+            if(gpioAlert[b].ex) {
+              (gpioAlert[b].func)(b, PI_TIMEOUT, eTick, gpioAlert[b].userdata);
+            } else {
+              (gpioAlert[b].func)(b, PI_TIMEOUT, eTick);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  for(n = 0; n < PI_NOTIFY_SLOTS; n++) {
+    if(gpioNotify[n].state == PI_NOTIFY_CLOSING) {
+      if(gpioNotify[n].pipe) {
+        DBG(DBG_INTERNAL, "close notify pipe %d", gpioNotify[n].fd);
+        close(gpioNotify[n].fd);
+
+        sprintf(fifo, "/dev/pigpio%d", n);
+
+        unlink(fifo);
+      }
+
+      gpioNotify[n].state = PI_NOTIFY_CLOSED;
+    } else if(gpioNotify[n].state >= PI_NOTIFY_OPENED) {
+      bits = gpioNotify[n].bits;
+
+      emit = 0;
+
+      seqno = gpioNotify[n].seqno;
+
+      if(gpioNotify[n].state == PI_NOTIFY_RUNNING) {
+        /* check to see if any bits have changed for this
+           notification.
+
+           bits         is the set of notification bits
+           changedBits is the set of changed bits
+        */
+
+        if(changedBits & bits) {
+          oldLevel = reportedLevel & bits;
+
+          for(d = 0; d < numSamples; d++) {
+            newLevel = sample[d].level & bits;
+
+            if(newLevel != oldLevel) {
+              report[emit].seqno = seqno;
+              report[emit].flags = 0;
+              report[emit].tick = sample[d].tick;
+              report[emit].level = sample[d].level;
+
+              oldLevel = newLevel;
+
+              emit++;
+              seqno++;
+            }
+          }
+        }
+
+        /* check to see if any watchdogs are due for this
+           notification.
+
+           bits        is the set of notification bits
+           timeoutBits is the set of timed out bits
+        */
+
+        bits = gpioNotify[n].bits;
+
+        if(timeoutBits & bits) {
+          /* at least one watchdog has fired for this
+             notification.
+          */
+
+          for(b = 0; b <= PI_MAX_USER_GPIO; b++) {
+            if(timeoutBits & bits & (1 << b)) {
+              if(numSamples)
+                newLevel = sample[numSamples - 1].level;
+              else
+                newLevel = reportedLevel;
+
+              report[emit].seqno = seqno;
+              report[emit].flags = PI_NTFY_FLAGS_WDOG | PI_NTFY_FLAGS_BIT(b);
+              report[emit].tick = eTick;
+              report[emit].level = newLevel;
+
+              emit++;
+              seqno++;
+            }
+          }
+        }
+      }
+
+      /* check to see if any events are due
+
+         eventBits is the set of events
+      */
+
+      if(eventBits & gpioNotify[n].eventBits) {
+        for(b = 0; b <= PI_MAX_EVENT; b++) {
+          if(eventBits & gpioNotify[n].eventBits & (1 << b)) {
+            if(numSamples)
+              newLevel = sample[numSamples - 1].level;
+            else
+              newLevel = reportedLevel;
+
+            report[emit].seqno = seqno;
+            report[emit].flags = PI_NTFY_FLAGS_EVENT | PI_NTFY_FLAGS_BIT(b);
+            report[emit].tick = eTick;
+            report[emit].level = newLevel;
 
             emit++;
             seqno++;
@@ -5643,1355 +7999,2747 @@ alertEmit(gpioSample_t* sample, int numSamples, uint32_t changedBits, uint32_t e
         }
       }
 
-      if(!emit) {
-        if((int)(eTick - gpioNotify[n].lastReportTick) > 60000000) {
-          if(numSamples)
-            newLevel = sample[numSamples - 1].level;
-          else
-            newLevel = reportedLevel;
+      if(!emit) {
+        if((int)(eTick - gpioNotify[n].lastReportTick) > 60000000) {
+          if(numSamples)
+            newLevel = sample[numSamples - 1].level;
+          else
+            newLevel = reportedLevel;
+
+          report[emit].seqno = seqno;
+          report[emit].flags = PI_NTFY_FLAGS_ALIVE;
+          report[emit].tick = eTick;
+          report[emit].level = newLevel;
+
+          emit++;
+          seqno++;
+        }
+      }
+
+      if(emit) {
+        DBG(DBG_FAST_TICK, "notification %d (%d reports, %x-%x)", n, emit, report[0].seqno, report[emit - 1].seqno);
+        gpioNotify[n].lastReportTick = eTick;
+        max_emits = gpioNotify[n].max_emits;
+
+        if(emit > gpioStats.maxEmit)
+          gpioStats.maxEmit = emit;
+
+        emitted = 0;
+
+        while(emit > 0) {
+          if(emit > max_emits) {
+            gpioStats.emitFrags++;
+
+            err = write(gpioNotify[n].fd, report + emitted, max_emits * sizeof(gpioReport_t));
+
+            if(err != (max_emits * sizeof(gpioReport_t))) {
+              if(err < 0) {
+                if((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                  /* serious error, no point continuing */
+
+                  DBG(DBG_ALWAYS, "fd=%d err=%d errno=%d", gpioNotify[n].fd, err, errno);
+
+                  DBG(DBG_ALWAYS, "%s", strerror(errno));
+
+                  gpioNotify[n].bits = 0;
+                  gpioNotify[n].state = PI_NOTIFY_CLOSING;
+                  intNotifyBits();
+                  break;
+                } else
+                  gpioStats.wouldBlockPipeWrite++;
+              } else {
+                gpioStats.shortPipeWrite++;
+                DBG(DBG_ALWAYS, "emitted %zd, asked for %d", err / sizeof(gpioReport_t), max_emits);
+              }
+            } else {
+              gpioStats.goodPipeWrite++;
+            }
+
+            emitted += max_emits;
+            emit -= max_emits;
+          } else {
+            err = write(gpioNotify[n].fd, report + emitted, emit * sizeof(gpioReport_t));
+
+            if(err != (emit * sizeof(gpioReport_t))) {
+              if(err < 0) {
+                if((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+                  DBG(DBG_ALWAYS, "fd=%d err=%d errno=%d", gpioNotify[n].fd, err, errno);
+
+                  DBG(DBG_ALWAYS, "%s", strerror(errno));
+
+                  /* serious error, no point continuing */
+                  gpioNotify[n].bits = 0;
+                  gpioNotify[n].state = PI_NOTIFY_CLOSING;
+                  intNotifyBits();
+                  break;
+                } else
+                  gpioStats.wouldBlockPipeWrite++;
+              } else {
+                gpioStats.shortPipeWrite++;
+                DBG(DBG_ALWAYS, "emitted %zd, asked for %d", err / sizeof(gpioReport_t), emit);
+              }
+            } else {
+              gpioStats.goodPipeWrite++;
+            }
+
+            emitted += emit;
+            emit = 0;
+          }
+        }
+
+        gpioNotify[n].seqno = seqno;
+      }
+    }
+  }
+
+  if((changedBits & scriptBits) || (eventBits & scriptEventBits)) {
+    pthread_mutex_lock(&scrMutex);
+
+    /* scrWake swaps the last entry into n, so walk backwards */
+
+    for(n = scrWaitingCount - 1; n >= 0; n--) {
+      bits = (gpioScript[scrWaiting[n]].waitBits & changedBits) | (gpioScript[scrWaiting[n]].eventBits & eventBits);
+
+      if(bits) {
+        gpioScript[scrWaiting[n]].changedBits = bits;
+        scrWake(&gpioScript[scrWaiting[n]]);
+      }
+    }
+
+    pthread_mutex_unlock(&scrMutex);
+  }
+
+  if(numSamples)
+    reportedLevel = sample[numSamples - 1].level;
+}
+
+static void
+alertWdogCheck(gpioSample_t* sample, int numSamples) {
+  /*
+  Go through and set the last time each GPIO with a watchdog changed state.
+  */
+
+  int i, j;
+  uint32_t LBitV;
+  uint32_t bit;
+
+  for(i = 0; i <= PI_MAX_USER_GPIO; i++) {
+    bit = (1 << i);
+
+    if(monitorBits & bit & wdogBits) {
+      LBitV = gpioAlert[i].wdLBitV;
+
+      for(j = 0; j < numSamples; j++) {
+        if((sample[j].level & bit) != LBitV) {
+          LBitV = sample[j].level & bit;
+          gpioAlert[i].wdTick = sample[j].tick;
+        }
+      }
+
+      gpioAlert[i].wdLBitV = LBitV;
+    }
+  }
+}
+
+static void*
+pthAlertThread(void* x) {
+  struct timespec req, rem;
+  uint32_t oldLevel, newLevel;
+  uint32_t oldSlot, newSlot;
+  uint32_t sTick;
+  uint32_t changedBits;
+  int32_t stickInited;
+  int cycle, cycles, run, skip;
+  int numSamples, i;
+  int rp, reports, totalSamples;
+  int stopped;
+  int moreToDo;
+  uint32_t* tick;
+  uint32_t* level;
+  uint32_t sampleTick[MAX_SAMPLE];
+  uint32_t sampleLevel[MAX_SAMPLE];
+  uint32_t cycleTick[(MAX_SAMPLE / PULSE_PER_CYCLE) + 1];
+  gpioSample_t sample[MAX_REPORT];
+
+  req.tv_sec = 0;
+
+  /* don't start until DMA started */
+
+  spinWhileStarting();
+
+  reportedLevel = gpioReg[GPLEV0];
+
+  oldLevel = reportedLevel;
+
+  oldSlot = dmaCurrentSlot(dmaNowAtICB());
+
+  oldSlot = (oldSlot / PULSE_PER_CYCLE) * PULSE_PER_CYCLE;
+
+  cycle = (oldSlot / PULSE_PER_CYCLE);
+
+  stopped = 0;
+
+  moreToDo = 0;
+
+  stickInited = 0;
+
+  sTick = 0;
+
+  while(1) {
+    /* Check that DMA is running okay */
+
+    if(dmaIn[DMA_CONBLK_AD]) {
+      if(stopped) {
+        DBG(DBG_STARTUP, "****** GOING ******");
+        stopped = 0;
+      }
+    } else {
+      stopped = 1;
+
+      myGpioDelay(5000);
+
+      if(runState == PI_RUNNING) {
+        /* should never be executed, leave code just in case */
+
+        gpioCfg.internals |= PI_CFG_STATS;
+
+        dmaInitCbs();
+        flushMemory();
+        // cast twice to suppress compiler warning, I belive this cast is ok
+        // because dmaIbus contains bus addresses, not user addresses. --plugwash
+        initDMAgo((uint32_t*)dmaIn, (uint32_t)(uintptr_t)dmaIBus[0]);
+        myGpioDelay(5000); /* let DMA run for a while */
+        oldSlot = dmaCurrentSlot(dmaNowAtICB());
+        gpioStats.DMARestarts++;
+      }
+    }
+
+    newSlot = dmaCurrentSlot(dmaNowAtICB());
+
+    newSlot = (newSlot / PULSE_PER_CYCLE) * PULSE_PER_CYCLE;
+
+    /*
+    Extract whole cycles of samples from the DMA ring buffer.
+    The levels are copied in runs up to the end of the ring, the
+    tick at the start of each following cycle is read alongside.
+    */
+
+    numSamples = 0;
+    cycles = 0;
+    cycleTick[0] = sTick;
+
+    while((oldSlot != newSlot) && (numSamples < MAX_SAMPLE)) {
+      if(newSlot > oldSlot)
+        run = newSlot - oldSlot;
+      else
+        run = (bufferCycles * PULSE_PER_CYCLE) - oldSlot;
+
+      if(run > (MAX_SAMPLE - numSamples))
+        run = MAX_SAMPLE - numSamples;
+
+      myGetLevels(oldSlot, run, sampleLevel + numSamples);
+
+      numSamples += run;
+      oldSlot += run;
+
+      for(i = run / PULSE_PER_CYCLE; i > 0; i--) {
+        if(++cycle >= bufferCycles) {
+          cycle = 0;
+          oldSlot = 0;
+        }
+
+        cycleTick[++cycles] = myGetTick(cycle);
+      }
+    }
+
+    sTick = cycleTick[cycles];
+
+    /* the first cycle only sets the starting tick */
+
+    skip = 0;
+
+    if(cycles && !stickInited) {
+      stickInited = 1;
+      skip = 1;
+      if(!(gpioCfg.ifFlags & PI_DISABLE_ALERT)) {
+        pthAlertRunning = PI_THREAD_RUNNING;
+      }
+    }
+
+    alertTicks(cycleTick + skip, cycles - skip, sampleTick + (skip * PULSE_PER_CYCLE));
+
+    tick = sampleTick + (skip * PULSE_PER_CYCLE);
+    level = sampleLevel + (skip * PULSE_PER_CYCLE);
+    numSamples -= skip * PULSE_PER_CYCLE;
+
+    if(oldSlot == newSlot)
+      moreToDo = 0;
+    else
+      moreToDo = 1;
+
+    /* Apply glitch filter */
+
+    if(numSamples && gFilterBits)
+      alertGlitchFilter(tick, level, numSamples);
+
+    /* Apply noise filter */
+
+    if(numSamples && nFilterBits)
+      alertNoiseFilter(tick, level, numSamples);
+
+    /* Compact samples */
+
+    changedBits = 0;
+    oldLevel &= monitorBits;
+    reports = 0;
+    totalSamples = 0;
+
+    for(rp = 0; rp < numSamples; rp++) {
+      newLevel = (level[rp] & monitorBits);
+
+      if(newLevel != oldLevel) {
+        sample[reports].tick = tick[rp];
+        sample[reports].level = level[rp];
+        changedBits |= (newLevel ^ oldLevel);
+        oldLevel = newLevel;
+
+        reports++;
+
+        if(reports >= MAX_REPORT) {
+          totalSamples += reports;
+
+          /* Rebase watchdog timeouts */
+          if(wdogBits)
+            alertWdogCheck(sample, reports);
+
+          gpioStats.numSamples += reports;
+
+          alertEmit(sample, reports, changedBits, tick[rp]);
+
+          changedBits = 0;
+          reports = 0;
+        }
+      }
+    }
+
+    if(reports) {
+      totalSamples += reports;
+
+      /* Rebase watchdog timeouts */
+      if(wdogBits)
+        alertWdogCheck(sample, reports);
+
+      gpioStats.numSamples += reports;
+    }
+
+    alertEmit(sample, reports, changedBits, sTick);
+
+    if(numSamples)
+      reportedLevel = level[numSamples - 1];
+
+    if(totalSamples > gpioStats.maxSamples)
+      gpioStats.maxSamples = numSamples;
+
+    req.tv_sec = 0;
+    req.tv_nsec = alert_delays[(gpioCfg.internals >> PI_CFG_ALERT_FREQ) & 15];
+
+    if(moreToDo) {
+      gpioStats.moreToDo++;
+    } else {
+      gpioStats.alertTicks++;
+
+      while(nanosleep(&req, &rem)) {
+        req.tv_sec = rem.tv_sec;
+        req.tv_nsec = rem.tv_nsec;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* ======================================================================= */
+
+static int
+scrPop(gpioScript_t* s, int* SP, int* S) {
+  if((*SP) > 0) {
+    return S[--(*SP)];
+  } else {
+    s->run_state = PI_SCRIPT_FAILED;
+    DBG(DBG_ALWAYS, "script %d too many pops", s->id);
+    return 0;
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrPush(gpioScript_t* s, int* SP, int* S, int val) {
+  if((*SP) < PI_SCRIPT_STACK_SIZE) {
+    S[(*SP)++] = val;
+  } else {
+    s->run_state = PI_SCRIPT_FAILED;
+    DBG(DBG_ALWAYS, "script %d too many pushes", s->id);
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrSwap(int* v1, int* v2) {
+  int t;
+
+  t = *v1;
+  *v1 = *v2;
+  *v2 = t;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrListAdd(int* list, int* count, int id) {
+  list[(*count)++] = id;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrListDel(int* list, int* count, int id) {
+  int i;
+
+  for(i = 0; i < *count; i++) {
+    if(list[i] == id) {
+      list[i] = list[--(*count)];
+      break;
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrReadyPush(gpioScript_t* s) {
+  /* scrMutex must be held by the caller (as for all scr list functions) */
+
+  scrReady[(scrReadyHead + scrReadyCount++) % PI_MAX_SCRIPTS] = s->id;
+
+  s->sched = SCR_SCHED_READY;
+
+  pthread_cond_signal(&scrCond);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrReadyDel(gpioScript_t* s) {
+  int i, id, n;
+
+  n = 0;
+
+  for(i = 0; i < scrReadyCount; i++) {
+    id = scrReady[(scrReadyHead + i) % PI_MAX_SCRIPTS];
+
+    if(id != s->id)
+      scrReady[(scrReadyHead + n++) % PI_MAX_SCRIPTS] = id;
+  }
+
+  scrReadyCount = n;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrUnschedule(gpioScript_t* s) {
+  switch(s->sched) {
+    case SCR_SCHED_READY: scrReadyDel(s); break;
+
+    case SCR_SCHED_WAITING:
+      scrListDel(scrWaiting, &scrWaitingCount, s->id);
+      s->waitBits = 0;
+      s->eventBits = 0;
+      intScriptBits();
+      intScriptEventBits();
+      break;
+
+    case SCR_SCHED_SLEEPING: scrListDel(scrSleeping, &scrSleepingCount, s->id); break;
+  }
+
+  s->sched = SCR_SCHED_IDLE;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrWake(gpioScript_t* s) {
+  scrUnschedule(s);
+
+  s->run_state = PI_SCRIPT_RUNNING;
+
+  scrReadyPush(s);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static gpioScript_t*
+scrNextReady(struct timespec* next) {
+  struct timespec now;
+  gpioScript_t* s;
+  int i;
+
+  /* next is set to the earliest pending wake time, 0 if none */
+
+  next->tv_sec = 0;
+  next->tv_nsec = 0;
+
+  if(scrSleepingCount) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for(i = scrSleepingCount - 1; i >= 0; i--) {
+      s = &gpioScript[scrSleeping[i]];
+
+      if(TIMER_LE(&s->wake, &now))
+        scrWake(s);
+      else if(!next->tv_sec || TIMER_LE(&s->wake, next))
+        *next = s->wake;
+    }
+  }
+
+  if(!scrReadyCount)
+    return NULL;
+
+  s = &gpioScript[scrReady[scrReadyHead]];
+
+  scrReadyHead = (scrReadyHead + 1) % PI_MAX_SCRIPTS;
+  scrReadyCount--;
+
+  s->sched = SCR_SCHED_ACTIVE;
+
+  return s;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrStart(gpioScript_t* s) {
+  /* run from the first step, the caller files it */
+
+  s->PC = 0;
+  s->A = 0;
+  s->F = 0;
+  s->SP = 0;
+  s->resume = 0;
+  s->restart = 0;
+  s->blockPC = -1;
+  s->run_state = PI_SCRIPT_RUNNING;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrPark(gpioScript_t* s, int sched) {
+  /* file a script after its turn on a worker */
+
+  if(s->restart) {
+    /* a run request during the turn restarts a script which has stopped */
+
+    s->restart = 0;
+
+    if(((volatile int)s->request == PI_SCRIPT_RUN) && (s->state == PI_SCRIPT_IN_USE) && (s->run_state != PI_SCRIPT_RUNNING)) {
+      scrStart(s);
+      sched = SCR_SCHED_READY;
+    }
+  }
+
+  if(((volatile int)s->request != PI_SCRIPT_RUN) || (s->state != PI_SCRIPT_IN_USE)) {
+    s->run_state = PI_SCRIPT_HALTED;
+    sched = SCR_SCHED_IDLE;
+  } else if(s->run_state != PI_SCRIPT_RUNNING) {
+    sched = SCR_SCHED_IDLE;
+  }
+
+  switch(sched) {
+    case SCR_SCHED_READY: scrReadyPush(s); break;
+
+    case SCR_SCHED_WAITING:
+      s->run_state = PI_SCRIPT_WAITING;
+      s->resume = 1;
+      s->sched = SCR_SCHED_WAITING;
+      scrListAdd(scrWaiting, &scrWaitingCount, s->id);
+      intScriptBits();
+      intScriptEventBits();
+      break;
+
+    case SCR_SCHED_SLEEPING:
+      s->sched = SCR_SCHED_SLEEPING;
+      scrListAdd(scrSleeping, &scrSleepingCount, s->id);
+      pthread_cond_signal(&scrCond); /* an idle worker must rearm its timeout */
+      break;
+
+    default: s->sched = SCR_SCHED_IDLE; break;
+  }
+
+  pthread_cond_broadcast(&scrIdleCond);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrSetWake(gpioScript_t* s, uint32_t micros) {
+  struct timespec delay;
+
+  delay.tv_sec = micros / MILLION;
+  delay.tv_nsec = (micros % MILLION) * THOUSAND;
+
+  clock_gettime(CLOCK_MONOTONIC, &s->wake);
+
+  TIMER_ADD(&s->wake, &delay, &s->wake);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+scrSys(char* cmd, uint32_t p1, uint32_t p2) {
+  char buf[1024];
+  int status;
+
+  if(!myScriptNameValid(cmd))
+    SOFT_ERROR(PI_BAD_SCRIPT_NAME, "bad script name (%s)", cmd);
+
+  snprintf(buf, sizeof(buf), "/opt/pigpio/cgi/%s %u %u", cmd, p1, p2);
+
+  DBG(DBG_USER, "%s", buf);
+
+  status = system(buf);
+
+  if(status < 0)
+    status = PI_BAD_SHELL_STATUS;
+
+  return status;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint64_t
+scrProfNanos(struct timespec* from, struct timespec* to) {
+  return ((uint64_t)(to->tv_sec - from->tv_sec) * BILLION) + to->tv_nsec - from->tv_nsec;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrProfExec(scrProf_t* prof, int PC, struct timespec* t0) {
+  struct timespec t1;
+
+  /* charge the time since t0 to step PC, t0 becomes now */
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  prof[PC].count++;
+  prof[PC].execNanos += scrProfNanos(t0, &t1);
+
+  *t0 = t1;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+scrExecute(gpioScript_t* s) {
+  cmdInstr_t instr;
+  int p1, p2, p1o, p2o, p3o, *t1, *t2;
+  int PC, A, F, SP;
+  int* S;
+  char* buf;
+  int slice, sched, ipc;
+  scrProf_t* prof;
+  struct timespec t0;
+
+  /*
+     Run a script for at most one slice.  Returns the SCR_SCHED_x
+     list the script should be filed on.  WAIT, EVTWT and the longer
+     delays return to the worker rather than blocking it.
+  */
+
+  PC = s->PC;
+  A = s->A;
+  F = s->F;
+  SP = s->SP;
+  S = s->S;
+  buf = s->buf;
+
+  if(s->resume) {
+    A = s->changedBits;
+    F = A;
+    s->resume = 0;
+  }
+
+  prof = s->prof;
+
+  ipc = -1; /* step being timed */
+
+  if(prof) {
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    if(s->blockPC >= 0)
+      prof[s->blockPC].blockNanos += scrProfNanos(&s->blockStart, &t0);
+  }
+
+  s->blockPC = -1;
+
+  sched = SCR_SCHED_READY;
+
+  for(slice = 0; slice < PI_SCRIPT_SLICE; slice++) {
+    if(ipc >= 0) {
+      scrProfExec(prof, ipc, &t0);
+      ipc = -1;
+    }
+
+    if(((volatile int)s->request != PI_SCRIPT_RUN) || (s->run_state != PI_SCRIPT_RUNNING))
+      break;
+
+    if(PC >= s->script.instrs) {
+      s->run_state = PI_SCRIPT_HALTED;
+      break;
+    }
+
+    instr = s->script.instr[PC];
+
+    if(prof)
+      ipc = PC;
+
+    p1o = instr.p[1];
+    p2o = instr.p[2];
+
+    if(instr.opt[1] == CMD_VAR)
+      instr.p[1] = s->script.var[p1o];
+    else if(instr.opt[1] == CMD_PAR)
+      instr.p[1] = s->script.par[p1o];
+
+    if(instr.opt[2] == CMD_VAR)
+      instr.p[2] = s->script.var[p2o];
+    else if(instr.opt[2] == CMD_PAR)
+      instr.p[2] = s->script.par[p2o];
+    /*
+             fprintf(stderr, "PC=%d cmd=%d p1o=%d p1=%d p2o=%d p2=%d\n",
+                PC, instr.p[0], p1o, instr.p[1], p2o, instr.p[2]);
+             fflush(stderr);
+    */
+    if(instr.p[0] < PI_CMD_SCRIPT) {
+      if(instr.p[3]) {
+        if((instr.p[3] == sizeof(int)) && ((instr.opt[3] == CMD_VAR) || (instr.opt[3] == CMD_PAR))) {
+          /* Hack to allow register use in 3rd parameter */
+          memcpy((char*)&p3o, (char*)instr.p[4], sizeof(int));
+          if(instr.opt[3] == CMD_VAR)
+            memcpy(buf, (char*)&(s->script.var[p3o]), sizeof(int));
+          else
+            memcpy(buf, (char*)&(s->script.par[p3o]), sizeof(int));
+        } else {
+          memcpy(buf, (char*)instr.p[4], instr.p[3]);
+        }
+      }
+
+      if(((instr.p[0] == PI_CMD_MILS) && (instr.p[1] <= PI_MAX_MILS_DELAY)) ||
+         ((instr.p[0] == PI_CMD_MICS) && (instr.p[1] > PI_SCRIPT_SPIN_MICROS) && (instr.p[1] <= PI_MAX_MICS_DELAY))) {
+        /* sleep on the timer list rather than tie up the worker */
+
+        if(instr.p[0] == PI_CMD_MILS)
+          scrSetWake(s, instr.p[1] * THOUSAND);
+        else
+          scrSetWake(s, instr.p[1]);
+
+        A = 0;
+        F = 0;
+        PC++;
+
+        sched = SCR_SCHED_SLEEPING;
+
+        break;
+      }
+
+      A = myDoCommand(instr.p, CMD_MAX_EXTENSION - 1, buf);
+
+      F = A;
+
+      PC++;
+    } else {
+      p1 = instr.p[1];
+      p2 = instr.p[2];
+
+      switch(instr.p[0]) {
+        case PI_CMD_ADD:
+          A += p1;
+          F = A;
+          PC++;
+          break;
+
+        case PI_CMD_AND:
+          A &= p1;
+          F = A;
+          PC++;
+          break;
+
+        case PI_CMD_CALL:
+          scrPush(s, &SP, S, PC + 1);
+          PC = p1;
+          break;
+
+        case PI_CMD_CMP:
+          F = A - p1;
+          PC++;
+          break;
+
+        case PI_CMD_DCR:
+          if(instr.opt[1] == CMD_PAR) {
+            --s->script.par[p1o];
+            F = s->script.par[p1o];
+          } else {
+            --s->script.var[p1o];
+            F = s->script.var[p1o];
+          }
+          PC++;
+          break;
+
+        case PI_CMD_DCRA:
+          --A;
+          F = A;
+          PC++;
+          break;
+
+        case PI_CMD_DIV:
+          A /= p1;
+          F = A;
+          PC++;
+          break;
+
+        case PI_CMD_HALT: s->run_state = PI_SCRIPT_HALTED; break;
+
+        case PI_CMD_EVTWT:
+          if((dmaLive <= 0) && (initStartDMA() < 0)) {
+            s->run_state = PI_SCRIPT_FAILED;
+            break;
+          }
+
+          s->waitBits = 0;
+          s->eventBits = p1;
+          sched = SCR_SCHED_WAITING;
+          PC++;
+          break;
+
+        case PI_CMD_INR:
+          if(instr.opt[1] == CMD_PAR) {
+            ++s->script.par[p1o];
+            F = s->script.par[p1o];
+          } else {
+            ++s->script.var[p1o];
+            F = s->script.var[p1o];
+          }
+          PC++;
+          break;
+
+        case PI_CMD_INRA:
+          ++A;
+          F = A;
+          PC++;
+          break;
+
+        case PI_CMD_JM:
+          if(F < 0)
+            PC = p1;
+          else
+            PC++;
+          break;
+
+        case PI_CMD_JMP: PC = p1; break;
+
+        case PI_CMD_JNZ:
+          if(F)
+            PC = p1;
+          else
+            PC++;
+          break;
+
+        case PI_CMD_JP:
+          if(F >= 0)
+            PC = p1;
+          else
+            PC++;
+          break;
+
+        case PI_CMD_JZ:
+          if(!F)
+            PC = p1;
+          else
+            PC++;
+          break;
+
+        case PI_CMD_LD:
+          if(instr.opt[1] == CMD_PAR)
+            s->script.par[p1o] = p2;
+          else
+            s->script.var[p1o] = p2;
+          PC++;
+          break;
+
+        case PI_CMD_LDA:
+          A = p1;
+          PC++;
+          break;
+
+        case PI_CMD_LDAB:
+          if((p1 >= 0) && (p1 < CMD_MAX_EXTENSION))
+            A = buf[p1];
+          PC++;
+          break;
+
+        case PI_CMD_MLT:
+          A *= p1;
+          F = A;
+          PC++;
+          break;
+
+        case PI_CMD_MOD:
+          A %= p1;
+          F = A;
+          PC++;
+          break;
+
+        case PI_CMD_OR:
+          A |= p1;
+          F = A;
+          PC++;
+          break;
+
+        case PI_CMD_POP:
+          if(instr.opt[1] == CMD_PAR)
+            s->script.par[p1o] = scrPop(s, &SP, S);
+          else
+            s->script.var[p1o] = scrPop(s, &SP, S);
+          PC++;
+          break;
+
+        case PI_CMD_POPA:
+          A = scrPop(s, &SP, S);
+          PC++;
+          break;
+
+        case PI_CMD_PUSH:
+          if(instr.opt[1] == CMD_PAR)
+            scrPush(s, &SP, S, s->script.par[p1o]);
+          else
+            scrPush(s, &SP, S, s->script.var[p1o]);
+          PC++;
+          break;
+
+        case PI_CMD_PUSHA:
+          scrPush(s, &SP, S, A);
+          PC++;
+          break;
+
+        case PI_CMD_RET: PC = scrPop(s, &SP, S); break;
+
+        case PI_CMD_RL:
+          if(instr.opt[1] == CMD_PAR) {
+            s->script.par[p1o] <<= p2;
+            F = s->script.par[p1o];
+          } else {
+            s->script.var[p1o] <<= p2;
+            F = s->script.var[p1o];
+          }
+          PC++;
+          break;
+
+        case PI_CMD_RLA:
+          A <<= p1;
+          F = A;
+          PC++;
+          break;
+
+        case PI_CMD_RR:
+          if(instr.opt[1] == CMD_PAR) {
+            s->script.par[p1o] >>= p2;
+            F = s->script.par[p1o];
+          } else {
+            s->script.var[p1o] >>= p2;
+            F = s->script.var[p1o];
+          }
+          PC++;
+          break;
+
+        case PI_CMD_RRA:
+          A >>= p1;
+          F = A;
+          PC++;
+          break;
+
+        case PI_CMD_STA:
+          if(instr.opt[1] == CMD_PAR)
+            s->script.par[p1o] = A;
+          else
+            s->script.var[p1o] = A;
+          PC++;
+          break;
+
+        case PI_CMD_STAB:
+          if((p1 >= 0) && (p1 < CMD_MAX_EXTENSION))
+            buf[p1] = A;
+          PC++;
+          break;
+
+        case PI_CMD_SUB:
+          A -= p1;
+          F = A;
+          PC++;
+          break;
+
+        case PI_CMD_SYS:
+          A = scrSys((char*)instr.p[4], A, *(gpioReg + GPLEV0));
+          F = A;
+          PC++;
+          break;
+
+        case PI_CMD_WAIT:
+          if((dmaLive <= 0) && (initStartDMA() < 0)) {
+            s->run_state = PI_SCRIPT_FAILED;
+            break;
+          }
+
+          s->waitBits = p1;
+          s->eventBits = 0;
+          sched = SCR_SCHED_WAITING;
+          PC++;
+          break;
+
+        case PI_CMD_X:
+          if(instr.opt[1] == CMD_PAR)
+            t1 = &s->script.par[p1o];
+          else
+            t1 = &s->script.var[p1o];
+
+          if(instr.opt[2] == CMD_PAR)
+            t2 = &s->script.par[p2o];
+          else
+            t2 = &s->script.var[p2o];
+
+          scrSwap(t1, t2);
+          PC++;
+          break;
+
+        case PI_CMD_XA:
+          if(instr.opt[1] == CMD_PAR)
+            scrSwap(&s->script.par[p1o], &A);
+          else
+            scrSwap(&s->script.var[p1o], &A);
+          PC++;
+          break;
+
+        case PI_CMD_XOR:
+          A ^= p1;
+          F = A;
+          PC++;
+          break;
+      }
+
+      if(sched != SCR_SCHED_READY)
+        break;
+    }
+  }
+
+  if(ipc >= 0) {
+    scrProfExec(prof, ipc, &t0);
+
+    if(sched != SCR_SCHED_READY) {
+      /* blocked time is charged when the script next runs */
+      s->blockPC = ipc;
+      s->blockStart = t0;
+    }
+  }
+
+  s->PC = PC;
+  s->A = A;
+  s->F = F;
+  s->SP = SP;
+
+  return sched;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrWorkerUnlock(void* x) {
+  if(*(int*)x)
+    pthread_mutex_unlock(&scrMutex);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void*
+pthScriptWorker(void* x) {
+  gpioScript_t* s;
+  struct timespec next;
+  int locked, sched;
+
+  pthread_mutex_lock(&scrMutex);
+
+  locked = 1;
+
+  pthread_cleanup_push(scrWorkerUnlock, &locked);
+
+  while(1) {
+    s = scrNextReady(&next);
+
+    if(s) {
+      locked = 0;
+      pthread_mutex_unlock(&scrMutex);
+
+      sched = scrExecute(s);
+
+      pthread_mutex_lock(&scrMutex);
+      locked = 1;
+
+      scrPark(s, sched);
+    } else if(next.tv_sec) {
+      pthread_cond_timedwait(&scrCond, &scrMutex, &next);
+    } else {
+      pthread_cond_wait(&scrCond, &scrMutex);
+    }
+  }
+
+  pthread_cleanup_pop(1);
+
+  return NULL;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+scrPoolStart(void) {
+  pthread_condattr_t condAttr;
+  pthread_attr_t pthAttr;
+  int i;
+
+  /* workers are only started once the first script is stored */
+
+  if(scrWorkers)
+    return 0;
+
+  pthread_condattr_init(&condAttr);
+  pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+  pthread_cond_init(&scrCond, &condAttr);
+  pthread_condattr_destroy(&condAttr);
+
+  pthread_cond_init(&scrIdleCond, NULL);
+
+  if(pthread_attr_init(&pthAttr))
+    SOFT_ERROR(PI_NO_SCRIPT_ROOM, "pthread_attr_init failed (%m)");
+
+  if(pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
+    SOFT_ERROR(PI_NO_SCRIPT_ROOM, "pthread_attr_setstacksize failed (%m)");
+
+  for(i = 0; i < gpioCfg.scriptThreads; i++) {
+    if(pthread_create(&scrWorker[i], &pthAttr, pthScriptWorker, NULL)) {
+      DBG(DBG_ALWAYS, "script worker %d, create failed (%m)", i);
+      break;
+    }
+
+    scrWorkers++;
+  }
+
+  if(!scrWorkers)
+    return PI_NO_SCRIPT_ROOM;
+
+  DBG(DBG_STARTUP, "%d script workers", scrWorkers);
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void*
+pthTimerTick(void* x) {
+  gpioTimer_t* tp;
+  struct timespec req, rem;
+
+  tp = x;
+
+  while(1) {
+    req.tv_sec = tp->millis / THOUSAND;
+    req.tv_nsec = (tp->millis % THOUSAND) * THOUSAND * THOUSAND;
+
+    while(nanosleep(&req, &rem)) {
+      req.tv_sec = rem.tv_sec;
+      req.tv_nsec = rem.tv_nsec;
+    }
+
+    if(tp->ex)
+      (tp->func)(tp->userdata);
+    else
+      (tp->func)();
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void*
+pthFifoThread(void* x) {
+  char buf[CMD_MAX_EXTENSION];
+  int idx, flags, len, res, i, j;
+  uintptr_t p[CMD_P_ARR];
+  cmdCtlParse_t ctl;
+  uint32_t* param;
+  gpioScriptProf_t* prof;
+  gpioStreamStatus_t* stream;
+  spiStats_t* spiStat;
+  gpioSerialStats_t* serStat;
+  bscTrans_t* bscTrans;
+  bscServiceStats_t* bscStat;
+  char* bscData;
+  char v[CMD_MAX_EXTENSION];
+
+  myCreatePipe(PI_INPFIFO, 0662);
+
+  if((inpFifo = fopen(PI_INPFIFO, "r+")) == NULL)
+    SOFT_ERROR((void*)PI_INIT_FAILED, "fopen %s failed(%m)", PI_INPFIFO);
+
+  myCreatePipe(PI_OUTFIFO, 0664);
+
+  if((outFifo = fopen(PI_OUTFIFO, "w+")) == NULL)
+    SOFT_ERROR((void*)PI_INIT_FAILED, "fopen %s failed (%m)", PI_OUTFIFO);
+
+  /* set outFifo non-blocking */
+
+  flags = fcntl(fileno(outFifo), F_GETFL, 0);
+  fcntl(fileno(outFifo), F_SETFL, flags | O_NONBLOCK);
+
+  /* don't start until DMA started */
+
+  spinWhileStarting();
+
+  while(1) {
+    if(fgets(buf, sizeof(buf), inpFifo) == NULL)
+      SOFT_ERROR((void*)PI_INIT_FAILED, "fifo fgets failed (%m)");
+
+    len = strlen(buf);
+
+    if(len) {
+      --len;
+      buf[len] = 0; /* replace terminating */
+    }
+
+    ctl.eaten = 0;
+    idx = 0;
+
+    while(((ctl.eaten) < len) && (idx >= 0)) {
+      if((idx = cmdParse(buf, p, CMD_MAX_EXTENSION, v, &ctl)) >= 0) {
+        /* make sure extensions are null terminated */
+
+        v[p[3]] = 0;
+
+        res = myDoCommand(p, sizeof(v) - 1, v);
+
+        switch(cmdInfo[idx].rv) {
+          case 0: fprintf(outFifo, "%d\n", res); break;
+
+          case 1: fprintf(outFifo, "%d\n", res); break;
+
+          case 2: fprintf(outFifo, "%d\n", res); break;
+
+          case 3: fprintf(outFifo, "%08X\n", res); break;
+
+          case 4: fprintf(outFifo, "%u\n", res); break;
+
+          case 5: fprintf(outFifo, "%s", cmdUsage); break;
+
+          case 6:
+            fprintf(outFifo, "%d", res);
+            if(res > 0) {
+              for(i = 0; i < res; i++) { fprintf(outFifo, " %d", v[i]); }
+            }
+            fprintf(outFifo, "\n");
+            break;
+
+          case 7:
+            if(res < 0)
+              fprintf(outFifo, "%d\n", res);
+            else {
+              fprintf(outFifo, "%d", res);
+              param = (uint32_t*)v;
+              for(i = 0; i < PI_MAX_SCRIPT_PARAMS; i++) { fprintf(outFifo, " %d", param[i]); }
+              fprintf(outFifo, "\n");
+            }
+            break;
+
+          case 9:
+            fprintf(outFifo, "%d", res);
+            if(res > 0) {
+              prof = (gpioScriptProf_t*)v;
+              for(i = 0; i < (int)(res / sizeof(gpioScriptProf_t)); i++) {
+                fprintf(outFifo, " %u %u %u", prof[i].count, prof[i].micros, prof[i].blocked);
+              }
+            }
+            fprintf(outFifo, "\n");
+            break;
+
+          case 10:
+            if(res < 0)
+              fprintf(outFifo, "%d\n", res);
+            else {
+              stream = (gpioStreamStatus_t*)v;
+              fprintf(outFifo, "%u %u %u %u %u\n", stream->queued, stream->free, stream->sent, stream->underruns, stream->running);
+            }
+            break;
+
+          case 11:
+            if(res < 0)
+              fprintf(outFifo, "%d\n", res);
+            else {
+              spiStat = (spiStats_t*)v;
+              fprintf(outFifo, "%u %u %u\n", spiStat->transfers, spiStat->bytes, spiStat->micros);
+            }
+            break;
+
+          case 12:
+            if(res < 0)
+              fprintf(outFifo, "%d\n", res);
+            else {
+              serStat = (gpioSerialStats_t*)v;
+              fprintf(outFifo, "%u %u %u %u\n", serStat->frames, serStat->framingErrors, serStat->parityErrors, serStat->overruns);
+            }
+            break;
+
+          case 13:
+            if(res < 0)
+              fprintf(outFifo, "%d\n", res);
+            else {
+              memcpy(&len, v, 4);
+              bscTrans = (bscTrans_t*)(v + 4);
+              bscData = v + 4 + (len * sizeof(bscTrans_t));
+              fprintf(outFifo, "%d\n", len);
+              for(i = 0; i < len; i++) {
+                fprintf(outFifo, "%u %u %u %hu %hu", bscTrans[i].tick, bscTrans[i].endTick, bscTrans[i].flags, bscTrans[i].txCnt, bscTrans[i].rxCnt);
+                for(j = 0; j < bscTrans[i].rxCnt; j++) fprintf(outFifo, " %hhu", *bscData++);
+                fprintf(outFifo, "\n");
+              }
+            }
+            break;
+
+          case 14:
+            if(res < 0)
+              fprintf(outFifo, "%d\n", res);
+            else {
+              bscStat = (bscServiceStats_t*)v;
+              fprintf(outFifo, "%u %u %u %u %u %u %u\n", bscStat->transactions, bscStat->rxBytes, bscStat->txBytes, bscStat->rxDropped, bscStat->fifoOverruns,
+                      bscStat->txUnderruns, bscStat->transDropped);
+            }
+            break;
+        }
+      } else
+        fprintf(outFifo, "%d\n", PI_BAD_FIFO_COMMAND);
+    }
+
+    fflush(outFifo);
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void*
+pthSocketThreadHandler(void* fdC) {
+  int sock = *(int*)fdC;
+  uintptr_t p[10];
+  uint32_t tmp, response[4];
+  int i;
+  int opt;
+  char buf[CMD_MAX_EXTENSION];
+
+  free(fdC);
+
+  /* Disable the Nagle algorithm. */
+  opt = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
+
+  while(1) {
+    if(sizeof(uintptr_t) == 8) {
+      if(recv(sock, &tmp, 4, MSG_WAITALL) != 4)
+        break;
+      p[0] = (uintptr_t)tmp;
+      if(recv(sock, &tmp, 4, MSG_WAITALL) != 4)
+        break;
+      p[1] = (uintptr_t)tmp;
+      if(recv(sock, &tmp, 4, MSG_WAITALL) != 4)
+        break;
+      p[2] = (uintptr_t)tmp;
+      if(recv(sock, &tmp, 4, MSG_WAITALL) != 4)
+        break;
+      p[3] = (uintptr_t)tmp;
+    } else {
+      if(recv(sock, p, 16, MSG_WAITALL) != 16)
+        break;
+    }
+
+    if(p[3]) {
+      if(p[3] < sizeof(buf)) {
+        /* read extension into buf */
+        if(recv(sock, buf, p[3], MSG_WAITALL) != p[3]) {
+          /* Serious error.  No point continuing. */
+          DBG(DBG_ALWAYS, "recv failed for %" PRIdPTR " bytes, sock=%d", p[3], sock);
+
+          closeOrphanedNotifications(-1, sock);
+
+          close(sock);
+
+          return 0;
+        }
+      } else {
+        /* Serious error.  No point continuing. */
+        DBG(DBG_ALWAYS, "ext too large %" PRIdPTR "(%zd), sock=%d", p[3], sizeof(buf), sock);
+
+        closeOrphanedNotifications(-1, sock);
+
+        close(sock);
+
+        return 0;
+      }
+    }
+
+    /* add null terminator in case it's a string */
+
+    buf[p[3]] = 0;
+
+    switch(p[0]) {
+      case PI_CMD_NOIB:
+
+        p[3] = gpioNotifyOpenInBand(sock);
+
+        /* Enable the Nagle algorithm. */
+        opt = 0;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
+
+        break;
+
+      case PI_CMD_PROCP:
+        p[3] = myDoCommand(p, sizeof(buf) - 1, buf + sizeof(int));
+        if(((int)p[3]) >= 0) {
+          memcpy(buf, &p[3], 4);
+          p[3] = 4 + (4 * PI_MAX_SCRIPT_PARAMS);
+        }
+        break;
+
+      default: p[3] = myDoCommand(p, sizeof(buf) - 1, buf);
+    }
+
+    if(sizeof(uintptr_t) == 8) // 64-bit system
+    {
+      for(i = 0; i < 4; i++) response[i] = (uint32_t)p[i];
+      if(write(sock, response, 16) == -1) { /* ignore errors */
+      }
+    } else // 32-bit system
+    {
+      if(write(sock, p, 16) == -1) { /* ignore errors */
+      }
+    }
+
+    switch(p[0]) {
+        /* extensions */
 
-          report[emit].seqno = seqno;
-          report[emit].flags = PI_NTFY_FLAGS_ALIVE;
-          report[emit].tick = eTick;
-          report[emit].level = newLevel;
+      case PI_CMD_BI2CZ:
+      case PI_CMD_BSCX:
+      case PI_CMD_CF2:
+      case PI_CMD_FL:
+      case PI_CMD_FR:
+      case PI_CMD_I2CPK:
+      case PI_CMD_I2CRD:
+      case PI_CMD_I2CRI:
+      case PI_CMD_I2CRK:
+      case PI_CMD_I2CZ:
+      case PI_CMD_I2CAR:
+      case PI_CMD_PROCP:
+      case PI_CMD_PROCT:
+      case PI_CMD_SERR:
+      case PI_CMD_SLR:
+      case PI_CMD_SPIX:
+      case PI_CMD_SPIR:
+      case PI_CMD_BSPIX:
+      case PI_CMD_WVSST:
+      case PI_CMD_SPIST:
+      case PI_CMD_SPISEG:
+      case PI_CMD_SLRST:
+      case PI_CMD_BSCSR:
+      case PI_CMD_BSCSS:
 
-          emit++;
-          seqno++;
+        if(((int)p[3]) > 0) {
+          if(write(sock, buf, p[3]) == 1) { /* ignore errors */
+          }
         }
+        break;
+
+      default: break;
+    }
+  }
+
+  closeOrphanedNotifications(-1, sock);
+
+  close(sock);
+
+  DBG(DBG_USER, "Socket %d closed", sock);
+
+  return 0;
+}
+
+static int
+addrAllowed(struct sockaddr* saddr) {
+  int i;
+  uint32_t addr;
+
+  if(!numSockNetAddr)
+    return 1;
+
+  // FIXME: add IPv6 whitelisting support
+  if(saddr->sa_family != AF_INET)
+    return 0;
+
+  addr = ((struct sockaddr_in*)saddr)->sin_addr.s_addr;
+
+  for(i = 0; i < numSockNetAddr; i++) {
+    if(addr == sockNetAddr[i])
+      return 1;
+  }
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void*
+pthSocketThread(void* x) {
+  int fdC = 0, c, *sock;
+  struct sockaddr_storage client;
+  pthread_attr_t attr;
+
+  if(pthread_attr_init(&attr))
+    SOFT_ERROR((void*)PI_INIT_FAILED, "pthread_attr_init failed (%m)");
+
+  if(pthread_attr_setstacksize(&attr, STACK_SIZE))
+    SOFT_ERROR((void*)PI_INIT_FAILED, "pthread_attr_setstacksize failed (%m)");
+
+  if(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
+    SOFT_ERROR((void*)PI_INIT_FAILED, "pthread_attr_setdetachstate failed (%m)");
+
+  /* fdSock opened in gpioInitialise so that we can treat
+     failure to bind as fatal. */
+
+  listen(fdSock, 100);
+
+  c = sizeof(client);
+
+  /* don't start until DMA started */
+
+  spinWhileStarting();
+
+  while(fdC >= 0) {
+    pthread_t thr;
+
+    fdC = accept(fdSock, (struct sockaddr*)&client, (socklen_t*)&c);
+
+    closeOrphanedNotifications(-1, fdC);
+
+    if(addrAllowed((struct sockaddr*)&client)) {
+      DBG(DBG_USER, "Connection accepted on socket %d", fdC);
+
+      sock = malloc(sizeof(int));
+
+      *sock = fdC;
+
+      /* Enable tcp_keepalive */
+      int optval = 1;
+      socklen_t optlen = sizeof(optval);
+
+      if(setsockopt(fdC, SOL_SOCKET, SO_KEEPALIVE, &optval, optlen) < 0) {
+        DBG(DBG_ALWAYS, "setsockopt() fail, closing socket %d", fdC);
+        close(fdC);
       }
 
-      if(emit) {
-        DBG(DBG_FAST_TICK, "notification %d (%d reports, %x-%x)", n, emit, report[0].seqno, report[emit - 1].seqno);
-        gpioNotify[n].lastReportTick = eTick;
-        max_emits = gpioNotify[n].max_emits;
+      DBG(DBG_USER, "SO_KEEPALIVE enabled on socket %d\n", fdC);
+
+      if(pthread_create(&thr, &attr, pthSocketThreadHandler, (void*)sock) < 0)
+        SOFT_ERROR((void*)PI_INIT_FAILED, "socket pthread_create failed (%m)");
+    } else {
+      DBG(DBG_ALWAYS, "Connection rejected, closing");
+      close(fdC);
+    }
+  }
+
+  if(fdC < 0)
+    SOFT_ERROR((void*)PI_INIT_FAILED, "accept failed (%m)");
+
+  return 0;
+}
+
+/* ======================================================================= */
+
+static void
+initCheckLockFile(void) {
+  int fd;
+  int count;
+  int pid;
+  int err;
+  int delete;
+  char str[20];
+
+  fd = open(PI_LOCKFILE, O_RDONLY);
+
+  if(fd != -1) {
+    DBG(DBG_STARTUP, "lock file exists");
+    delete = 1;
+
+    count = read(fd, str, sizeof(str) - 1);
+
+    if(count) {
+      pid = atoi(str);
+      err = kill(pid, 0);
+      if(!err)
+        delete = 0; /* process still exists */
+      DBG(DBG_STARTUP, "lock file pid=%d err=%d", pid, err);
+    }
+
+    close(fd);
+    DBG(DBG_STARTUP, "lock file delete=%d", delete);
+
+    if(delete)
+      unlink(PI_LOCKFILE);
+  }
+}
+
+static int
+initGrabLockFile(void) {
+  int fd;
+  int lockResult;
+  char pidStr[20];
+
+  initCheckLockFile();
+
+  /* try to grab the lock file */
+
+  fd = open(PI_LOCKFILE, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC, 0644);
+
+  if(fd != -1) {
+    lockResult = flock(fd, LOCK_EX | LOCK_NB);
+
+    if(lockResult == 0) {
+      sprintf(pidStr, "%d\n", (int)getpid());
+
+      if(write(fd, pidStr, strlen(pidStr)) == -1) {
+        /* ignore errors */
+      }
+    } else {
+      close(fd);
+      return -1;
+    }
+  }
+
+  return fd;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t*
+initMapMem(int fd, uint32_t addr, uint32_t len) {
+  return (uint32_t*)mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, addr);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+initCheckPermitted(void) {
+  DBG(DBG_STARTUP, "");
+
+  if(!pi_ispi) {
+    DBG(DBG_ALWAYS,
+        "\n"
+        "+---------------------------------------------------------+\n"
+        "|Sorry, this system does not appear to be a raspberry pi. |\n"
+        "|aborting.                                                |\n"
+        "+---------------------------------------------------------+\n\n");
+    return -1;
+  }
+
+  if((fdMem = open("/dev/mem", O_RDWR | O_SYNC)) < 0) {
+    DBG(DBG_ALWAYS,
+        "\n"
+        "+---------------------------------------------------------+\n"
+        "|Sorry, you don't have permission to run this program.    |\n"
+        "|Try running as root, e.g. precede the command with sudo. |\n"
+        "+---------------------------------------------------------+\n\n");
+    return -1;
+  }
+  return 0;
+}
 
-        if(emit > gpioStats.maxEmit)
-          gpioStats.maxEmit = emit;
+/* ----------------------------------------------------------------------- */
 
-        emitted = 0;
+static int
+initPeripherals(void) {
+  DBG(DBG_STARTUP, "");
 
-        while(emit > 0) {
-          if(emit > max_emits) {
-            gpioStats.emitFrags++;
+  gpioReg = initMapMem(fdMem, GPIO_BASE, GPIO_LEN);
 
-            err = write(gpioNotify[n].fd, report + emitted, max_emits * sizeof(gpioReport_t));
+  if(gpioReg == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap gpio failed (%m)");
 
-            if(err != (max_emits * sizeof(gpioReport_t))) {
-              if(err < 0) {
-                if((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
-                  /* serious error, no point continuing */
+  dmaReg = initMapMem(fdMem, DMA_BASE, DMA_LEN);
 
-                  DBG(DBG_ALWAYS, "fd=%d err=%d errno=%d", gpioNotify[n].fd, err, errno);
+  if(dmaReg == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap dma failed (%m)");
 
-                  DBG(DBG_ALWAYS, "%s", strerror(errno));
+  /* we should know if we are running on a BCM2711 by now */
 
-                  gpioNotify[n].bits = 0;
-                  gpioNotify[n].state = PI_NOTIFY_CLOSING;
-                  intNotifyBits();
-                  break;
-                } else
-                  gpioStats.wouldBlockPipeWrite++;
-              } else {
-                gpioStats.shortPipeWrite++;
-                DBG(DBG_ALWAYS, "emitted %zd, asked for %d", err / sizeof(gpioReport_t), max_emits);
-              }
-            } else {
-              gpioStats.goodPipeWrite++;
-            }
+  if(gpioCfg.DMAprimaryChannel == PI_DEFAULT_DMA_NOT_SET) {
+    if(pi_is_2711)
+      gpioCfg.DMAprimaryChannel = PI_DEFAULT_DMA_PRIMARY_CH_2711;
+    else
+      gpioCfg.DMAprimaryChannel = PI_DEFAULT_DMA_PRIMARY_CHANNEL;
+  }
 
-            emitted += max_emits;
-            emit -= max_emits;
-          } else {
-            err = write(gpioNotify[n].fd, report + emitted, emit * sizeof(gpioReport_t));
+  if(gpioCfg.DMAsecondaryChannel == PI_DEFAULT_DMA_NOT_SET) {
+    if(pi_is_2711)
+      gpioCfg.DMAsecondaryChannel = PI_DEFAULT_DMA_SECONDARY_CH_2711;
+    else
+      gpioCfg.DMAsecondaryChannel = PI_DEFAULT_DMA_SECONDARY_CHANNEL;
+  }
 
-            if(err != (emit * sizeof(gpioReport_t))) {
-              if(err < 0) {
-                if((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
-                  DBG(DBG_ALWAYS, "fd=%d err=%d errno=%d", gpioNotify[n].fd, err, errno);
+  dmaIn = dmaReg + (gpioCfg.DMAprimaryChannel * 0x40);
+  dmaOut = dmaReg + (gpioCfg.DMAsecondaryChannel * 0x40);
 
-                  DBG(DBG_ALWAYS, "%s", strerror(errno));
+  DBG(DBG_STARTUP, "DMA #%d @ %08" PRIXPTR, gpioCfg.DMAprimaryChannel, (uintptr_t)dmaIn);
 
-                  /* serious error, no point continuing */
-                  gpioNotify[n].bits = 0;
-                  gpioNotify[n].state = PI_NOTIFY_CLOSING;
-                  intNotifyBits();
-                  break;
-                } else
-                  gpioStats.wouldBlockPipeWrite++;
-              } else {
-                gpioStats.shortPipeWrite++;
-                DBG(DBG_ALWAYS, "emitted %zd, asked for %d", err / sizeof(gpioReport_t), emit);
-              }
-            } else {
-              gpioStats.goodPipeWrite++;
-            }
+  DBG(DBG_STARTUP, "debug reg is %08X", dmaIn[DMA_DEBUG]);
 
-            emitted += emit;
-            emit = 0;
-          }
-        }
+  clkReg = initMapMem(fdMem, CLK_BASE, CLK_LEN);
 
-        gpioNotify[n].seqno = seqno;
-      }
-    }
-  }
+  if(clkReg == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap clk failed (%m)");
 
-  if(changedBits & scriptBits) {
-    for(n = 0; n < PI_MAX_SCRIPTS; n++) {
-      if((gpioScript[n].state == PI_SCRIPT_IN_USE) && (gpioScript[n].run_state == PI_SCRIPT_WAITING) && (gpioScript[n].waitBits & changedBits)) {
-        pthread_mutex_lock(&gpioScript[n].pthMutex);
+  systReg = initMapMem(fdMem, SYST_BASE, SYST_LEN);
 
-        if(gpioScript[n].run_state == PI_SCRIPT_WAITING) {
-          gpioScript[n].changedBits = gpioScript[n].waitBits & changedBits;
-          pthread_cond_signal(&gpioScript[n].pthCond);
-        }
+  if(systReg == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap syst failed (%m)");
 
-        pthread_mutex_unlock(&gpioScript[n].pthMutex);
-      }
-    }
-  }
+  spiReg = initMapMem(fdMem, SPI_BASE, SPI_LEN);
 
-  if(eventBits & scriptEventBits) {
-    for(n = 0; n < PI_MAX_SCRIPTS; n++) {
-      if((gpioScript[n].state == PI_SCRIPT_IN_USE) && (gpioScript[n].run_state == PI_SCRIPT_WAITING) && (gpioScript[n].eventBits & eventBits)) {
-        pthread_mutex_lock(&gpioScript[n].pthMutex);
+  if(spiReg == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap spi failed (%m)");
 
-        if(gpioScript[n].run_state == PI_SCRIPT_WAITING) {
-          gpioScript[n].changedBits = gpioScript[n].eventBits & eventBits;
-          pthread_cond_signal(&gpioScript[n].pthCond);
-        }
+  pwmReg = initMapMem(fdMem, PWM_BASE, PWM_LEN);
 
-        pthread_mutex_unlock(&gpioScript[n].pthMutex);
-      }
-    }
-  }
+  if(pwmReg == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap pwm failed (%m)");
 
-  if(numSamples)
-    reportedLevel = sample[numSamples - 1].level;
-}
+  pcmReg = initMapMem(fdMem, PCM_BASE, PCM_LEN);
 
-static void
-alertWdogCheck(gpioSample_t* sample, int numSamples) {
-  /*
-  Go through and set the last time each GPIO with a watchdog changed state.
-  */
+  if(pcmReg == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap pcm failed (%m)");
 
-  int i, j;
-  uint32_t LBitV;
-  uint32_t bit;
+  auxReg = initMapMem(fdMem, AUX_BASE, AUX_LEN);
 
-  for(i = 0; i <= PI_MAX_USER_GPIO; i++) {
-    bit = (1 << i);
+  if(auxReg == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap aux failed (%m)");
 
-    if(monitorBits & bit & wdogBits) {
-      LBitV = gpioAlert[i].wdLBitV;
+  padsReg = initMapMem(fdMem, PADS_BASE, PADS_LEN);
 
-      for(j = 0; j < numSamples; j++) {
-        if((sample[j].level & bit) != LBitV) {
-          LBitV = sample[j].level & bit;
-          gpioAlert[i].wdTick = sample[j].tick;
-        }
-      }
+  if(padsReg == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap pads failed (%m)");
 
-      gpioAlert[i].wdLBitV = LBitV;
-    }
-  }
-}
+  bscsReg = initMapMem(fdMem, BSCS_BASE, BSCS_LEN);
 
-static void*
-pthAlertThread(void* x) {
-  struct timespec req, rem;
-  uint32_t oldLevel, newLevel, level;
-  uint32_t oldSlot, newSlot;
-  uint32_t expected, ft, sTick;
-  uint32_t changedBits;
-  int32_t diff, minDiff, stickInited;
-  int cycle, pulse;
-  int numSamples, ticks, i;
-  int rp, reports, totalSamples;
-  int stopped;
-  int moreToDo;
-  gpioSample_t sample[MAX_SAMPLE];
+  if(bscsReg == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap bscs failed (%m)");
 
-  req.tv_sec = 0;
+  return 0;
+}
 
-  /* don't start until DMA started */
+/* ----------------------------------------------------------------------- */
 
-  spinWhileStarting();
+static int
+initLapMicros(struct timespec* lap) {
+  struct timespec now;
+  int micros;
 
-  reportedLevel = gpioReg[GPLEV0];
+  /* microseconds since *lap, which is moved on to now */
 
-  oldLevel = reportedLevel;
+  clock_gettime(CLOCK_MONOTONIC, &now);
 
-  oldSlot = dmaCurrentSlot(dmaNowAtICB());
+  micros = ((now.tv_sec - lap->tv_sec) * MILLION) + ((now.tv_nsec - lap->tv_nsec) / 1000);
 
-  oldSlot = (oldSlot / PULSE_PER_CYCLE) * PULSE_PER_CYCLE;
+  *lap = now;
 
-  cycle = (oldSlot / PULSE_PER_CYCLE);
+  return micros;
+}
 
-  pulse = 0;
+/* ----------------------------------------------------------------------- */
 
-  stopped = 0;
+static int
+initZaps(int pmapFd, void* virtualBase, int basePage, int pages) {
+  int n, i, run;
+  uintptr_t index;
+  ssize_t t;
+  uint32_t physical;
+  int status;
+  uintptr_t pageAdr;
+  void* virtualAdr;
+  unsigned long long pa[PAGES_PER_BLOCK];
 
-  moreToDo = 0;
+  DBG(DBG_STARTUP, "");
 
-  stickInited = 0;
+  status = 0;
 
-  sTick = 0;
+  pageAdr = (uintptr_t)dmaVirt[basePage];
 
-  minDiff = gpioCfg.clockMicros / 2;
+  index = ((uintptr_t)virtualBase / PAGE_SIZE) * 8;
 
-  while(1) {
-    /* Check that DMA is running okay */
+  /* one read for the pagemap entries of the whole block */
 
-    if(dmaIn[DMA_CONBLK_AD]) {
-      if(stopped) {
-        DBG(DBG_STARTUP, "****** GOING ******");
-        stopped = 0;
-      }
-    } else {
-      stopped = 1;
+  t = pread(pmapFd, pa, pages * sizeof(pa[0]), index);
 
-      myGpioDelay(5000);
+  if(t != (pages * sizeof(pa[0])))
+    SOFT_ERROR(PI_INIT_FAILED, "read pagemap failed (%m)");
 
-      if(runState == PI_RUNNING) {
-        /* should never be executed, leave code just in case */
+  for(n = 0; n < pages; n += run) {
+    DBG(DBG_STARTUP, "pf%d=%016llX", n, pa[n]);
 
-        gpioCfg.internals |= PI_CFG_STATS;
+    physical = 0x3FFFFFFF & (PAGE_SIZE * (pa[n] & 0xFFFFFFFF));
 
-        dmaInitCbs();
-        flushMemory();
-        // cast twice to suppress compiler warning, I belive this cast is ok
-        // because dmaIbus contains bus addresses, not user addresses. --plugwash
-        initDMAgo((uint32_t*)dmaIn, (uint32_t)(uintptr_t)dmaIBus[0]);
-        myGpioDelay(5000); /* let DMA run for a while */
-        oldSlot = dmaCurrentSlot(dmaNowAtICB());
-        gpioStats.DMARestarts++;
-      }
-    }
+    run = 1;
 
-    newSlot = dmaCurrentSlot(dmaNowAtICB());
+    if(physical) {
+      /* physically contiguous pages share one mapping */
 
-    newSlot = (newSlot / PULSE_PER_CYCLE) * PULSE_PER_CYCLE;
+      while(((n + run) < pages) && ((0x3FFFFFFF & (PAGE_SIZE * (pa[n + run] & 0xFFFFFFFF))) == (physical + (run * PAGE_SIZE))))
+        run++;
 
-    numSamples = 0;
+      virtualAdr = mmap((void*)pageAdr, run * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | MAP_LOCKED | MAP_NORESERVE, fdMem, physical);
 
-    /*
-    Extract samples from DMA ring buffer.
-    */
+      if(virtualAdr == MAP_FAILED)
+        SOFT_ERROR(PI_INIT_FAILED, "mmap dma page failed (%m)");
 
-    while((oldSlot != newSlot) && (numSamples < MAX_SAMPLE)) {
-      level = myGetLevel(oldSlot++);
+      for(i = 0; i < run; i++) {
+        // cast twice to suppress warning, I belive this is ok as these
+        // are bus addresses, not virtual addresses. --plugwash
+        dmaBus[basePage + n + i] = (dmaPage_t*)(uintptr_t)((physical + (i * PAGE_SIZE)) | pi_dram_bus);
 
-      sample[numSamples].tick = sTick;
-      sample[numSamples].level = level;
+        dmaVirt[basePage + n + i] = (dmaPage_t*)((char*)virtualAdr + (i * PAGE_SIZE));
+      }
+    } else
+      status = 1;
 
-      numSamples++;
+    pageAdr += run * PAGE_SIZE;
+  }
 
-      sTick += gpioCfg.clockMicros;
+  return status;
+}
 
-      if(++pulse >= PULSE_PER_CYCLE) {
-        pulse = 0;
+/* ----------------------------------------------------------------------- */
 
-        if(++cycle >= bufferCycles) {
-          cycle = 0;
-          oldSlot = 0;
-        }
+static int
+initPagemapBlock(int block) {
+  int trys, status;
+  unsigned pageNum;
 
-        expected = sTick;
+  DBG(DBG_STARTUP, "block=%d", block);
 
-        sTick = myGetTick(cycle);
+  dmaPMapBlk[block] = mmap(0, (PAGES_PER_BLOCK * PAGE_SIZE), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE | MAP_LOCKED, -1, 0);
 
-        if(stickInited) {
-          diff = sTick - expected;
+  if(dmaPMapBlk[block] == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap dma block %d failed (%m)", block);
 
-          if(abs(diff) > minDiff) {
-            ft = sample[numSamples - PULSE_PER_CYCLE].tick;
+  /* force allocation of physical memory, one touch is enough */
 
-            ticks = sTick - ft;
+  memset((void*)dmaPMapBlk[block], 0, (PAGES_PER_BLOCK * PAGE_SIZE));
 
-            for(i = 1; i < PULSE_PER_CYCLE; i++) { sample[numSamples - PULSE_PER_CYCLE + i].tick = ((i * ticks) / PULSE_PER_CYCLE) + ft; }
-          }
+  pageNum = block * PAGES_PER_BLOCK;
 
-          diff += (TICKSLOTS / 2);
+  /*
+  reserve the address range for initZaps to map over, it stays mapped
+  so a mapping made on another init thread can not land in it
+  */
 
-          if(diff < 0) {
-            gpioStats.diffTick[0]++;
-          }
+  dmaVirt[pageNum] = mmap(0, (PAGES_PER_BLOCK * PAGE_SIZE), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
 
-          else if(diff >= TICKSLOTS) {
-            gpioStats.diffTick[TICKSLOTS - 1]++;
-          }
+  if(dmaVirt[pageNum] == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap dma block %d failed (%m)", block);
 
-          else
-            gpioStats.diffTick[diff]++;
-        } else {
-          stickInited = 1;
-          numSamples = 0;
-          if(!(gpioCfg.ifFlags & PI_DISABLE_ALERT)) {
-            pthAlertRunning = PI_THREAD_RUNNING;
-          }
-        }
-      }
-    }
+  for(trys = 0; trys < 10; trys++) {
+    status = initZaps(fdPmap, dmaPMapBlk[block], pageNum, PAGES_PER_BLOCK);
 
-    if(oldSlot == newSlot)
-      moreToDo = 0;
-    else
-      moreToDo = 1;
+    if(status <= 0)
+      break;
 
-    /* Apply glitch filter */
+    myGpioDelay(50000);
+  }
 
-    if(numSamples && gFilterBits)
-      alertGlitchFilter(sample, numSamples);
+  if(status)
+    SOFT_ERROR(PI_INIT_FAILED, "initZaps failed");
 
-    /* Apply noise filter */
+  return 0;
+}
 
-    if(numSamples && nFilterBits)
-      alertNoiseFilter(sample, numSamples);
+/* ----------------------------------------------------------------------- */
 
-    /* Compact samples */
+static void*
+pthInitPagemapThread(void* x) {
+  initBlocks_t* blocks;
+  int i;
 
-    changedBits = 0;
-    oldLevel &= monitorBits;
-    reports = 0;
-    totalSamples = 0;
+  blocks = x;
 
-    for(rp = 0; rp < numSamples; rp++) {
-      newLevel = (sample[rp].level & monitorBits);
+  for(i = blocks->first; i < blocks->last; i++) {
+    blocks->status = initPagemapBlock(i);
 
-      if(newLevel != oldLevel) {
-        sample[reports].tick = sample[rp].tick;
-        sample[reports].level = sample[rp].level;
-        changedBits |= (newLevel ^ oldLevel);
-        oldLevel = newLevel;
+    if(blocks->status < 0)
+      break;
+  }
 
-        reports++;
+  return NULL;
+}
 
-        if(reports >= MAX_REPORT) {
-          totalSamples += reports;
+/* ----------------------------------------------------------------------- */
 
-          /* Rebase watchdog timeouts */
-          if(wdogBits)
-            alertWdogCheck(sample, reports);
+static int
+initPagemapBlocks(int numBlocks) {
+  int i, threads, status, per;
+  int started[INIT_MAX_THREADS];
+  pthread_t pth[INIT_MAX_THREADS];
+  initBlocks_t blocks[INIT_MAX_THREADS];
 
-          gpioStats.numSamples += reports;
+  /* blocks are independent, prepare them on several threads */
 
-          alertEmit(sample, reports, changedBits, sample[rp].tick);
+  threads = sysconf(_SC_NPROCESSORS_ONLN);
 
-          changedBits = 0;
-          reports = 0;
-        }
-      }
-    }
+  if(threads > INIT_MAX_THREADS)
+    threads = INIT_MAX_THREADS;
 
-    if(reports) {
-      totalSamples += reports;
+  if(threads > numBlocks)
+    threads = numBlocks;
 
-      /* Rebase watchdog timeouts */
-      if(wdogBits)
-        alertWdogCheck(sample, reports);
+  if(threads < 1)
+    threads = 1;
 
-      gpioStats.numSamples += reports;
-    }
+  per = (numBlocks + threads - 1) / threads;
 
-    alertEmit(sample, reports, changedBits, sTick);
-    reportedLevel = sample[numSamples - 1].level;
+  for(i = 0; i < threads; i++) {
+    blocks[i].first = i * per;
+    blocks[i].last = (i + 1) * per;
+    blocks[i].status = 0;
 
-    if(totalSamples > gpioStats.maxSamples)
-      gpioStats.maxSamples = numSamples;
+    if(blocks[i].last > numBlocks)
+      blocks[i].last = numBlocks;
+  }
 
-    req.tv_sec = 0;
-    req.tv_nsec = alert_delays[(gpioCfg.internals >> PI_CFG_ALERT_FREQ) & 15];
+  /* the calling thread does the last share */
 
-    if(moreToDo) {
-      gpioStats.moreToDo++;
-    } else {
-      gpioStats.alertTicks++;
+  for(i = 0; i < (threads - 1); i++) {
+    started[i] = !pthread_create(&pth[i], NULL, pthInitPagemapThread, &blocks[i]);
 
-      while(nanosleep(&req, &rem)) {
-        req.tv_sec = rem.tv_sec;
-        req.tv_nsec = rem.tv_nsec;
-      }
+    if(!started[i]) {
+      DBG(DBG_STARTUP, "pthread_create failed, blocks %d-%d done serially", blocks[i].first, blocks[i].last - 1);
+      pthInitPagemapThread(&blocks[i]);
     }
   }
 
-  return 0;
-}
+  pthInitPagemapThread(&blocks[threads - 1]);
 
-/* ======================================================================= */
+  status = 0;
 
-static int
-scrPop(gpioScript_t* s, int* SP, int* S) {
-  if((*SP) > 0) {
-    return S[--(*SP)];
-  } else {
-    s->run_state = PI_SCRIPT_FAILED;
-    DBG(DBG_ALWAYS, "script %d too many pops", s->id);
-    return 0;
+  for(i = 0; i < threads; i++) {
+    if((i < (threads - 1)) && started[i])
+      pthread_join(pth[i], NULL);
+
+    if(blocks[i].status < 0)
+      status = blocks[i].status;
   }
-}
 
-/* ----------------------------------------------------------------------- */
+  DBG(DBG_STARTUP, "%d blocks on %d threads", numBlocks, threads);
 
-static void
-scrPush(gpioScript_t* s, int* SP, int* S, int val) {
-  if((*SP) < PI_SCRIPT_STACK_SIZE) {
-    S[(*SP)++] = val;
-  } else {
-    s->run_state = PI_SCRIPT_FAILED;
-    DBG(DBG_ALWAYS, "script %d too many pushes", s->id);
-  }
+  return status;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void
-scrSwap(int* v1, int* v2) {
-  int t;
+static int
+initMboxBlock(int block) {
+  int n, ok;
+  unsigned page;
+  uintptr_t virtualAdr;
+  uintptr_t busAdr;
 
-  t = *v1;
-  *v1 = *v2;
-  *v2 = t;
-}
+  DBG(DBG_STARTUP, "block=%d", block);
 
-/* ----------------------------------------------------------------------- */
+  ok = mbDMAAlloc(&dmaMboxBlk[block], PAGES_PER_BLOCK * PAGE_SIZE, pi_mem_flag);
 
-static int
-scrEvtWait(gpioScript_t* s, uint32_t bits) {
-  pthread_mutex_lock(&s->pthMutex);
+  if(!ok)
+    SOFT_ERROR(PI_INIT_FAILED, "init mbox zaps failed");
 
-  if(s->request == PI_SCRIPT_RUN) {
-    s->run_state = PI_SCRIPT_WAITING;
-    s->eventBits = bits;
-    intScriptEventBits();
+  page = block * PAGES_PER_BLOCK;
 
-    pthread_cond_wait(&s->pthCond, &s->pthMutex);
+  virtualAdr = (uintptr_t)dmaMboxBlk[block].virtual_addr;
+  busAdr = dmaMboxBlk[block].bus_addr;
 
-    s->waitBits = 0;
-    intScriptEventBits();
-    s->run_state = PI_SCRIPT_RUNNING;
+  for(n = 0; n < PAGES_PER_BLOCK; n++) {
+    dmaVirt[page + n] = (dmaPage_t*)virtualAdr;
+    dmaBus[page + n] = (dmaPage_t*)busAdr;
+    virtualAdr += PAGE_SIZE;
+    busAdr += PAGE_SIZE;
   }
 
-  pthread_mutex_unlock(&s->pthMutex);
-
-  return s->changedBits;
+  return 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
 static int
-scrWait(gpioScript_t* s, uint32_t bits) {
-  pthread_mutex_lock(&s->pthMutex);
+initAllocDMAMem(void) {
+  int i, servoCycles, superCycles;
+  int status;
+  struct timespec lap;
 
-  if(s->request == PI_SCRIPT_RUN) {
-    s->run_state = PI_SCRIPT_WAITING;
-    s->waitBits = bits;
-    intScriptBits();
+  DBG(DBG_STARTUP, "");
 
-    pthread_cond_wait(&s->pthCond, &s->pthMutex);
+  /* Calculate the number of blocks needed for buffers.  The number
+     of blocks must be a multiple of the 20ms servo cycle.
+  */
 
-    s->waitBits = 0;
-    intScriptBits();
-    s->run_state = PI_SCRIPT_RUNNING;
-  }
+  servoCycles = gpioCfg.bufferMilliseconds / 20;
+  if(gpioCfg.bufferMilliseconds % 20)
+    servoCycles++;
 
-  pthread_mutex_unlock(&s->pthMutex);
+  bufferCycles = (SUPERCYCLE * servoCycles) / gpioCfg.clockMicros;
 
-  return s->changedBits;
-}
+  superCycles = bufferCycles / SUPERCYCLE;
+  if(bufferCycles % SUPERCYCLE)
+    superCycles++;
 
-/* ----------------------------------------------------------------------- */
+  bufferCycles = SUPERCYCLE * superCycles;
 
-static int
-scrSys(char* cmd, uint32_t p1, uint32_t p2) {
-  char buf[1024];
-  int status;
+  bufferBlocks = bufferCycles / CYCLES_PER_BLOCK;
 
-  if(!myScriptNameValid(cmd))
-    SOFT_ERROR(PI_BAD_SCRIPT_NAME, "bad script name (%s)", cmd);
+  DBG(DBG_STARTUP, "bmillis=%d mics=%d bblk=%d bcyc=%d", gpioCfg.bufferMilliseconds, gpioCfg.clockMicros, bufferBlocks, bufferCycles);
 
-  snprintf(buf, sizeof(buf), "/opt/pigpio/cgi/%s %u %u", cmd, p1, p2);
+  /* blocks for large SPI transfers, unless disabled */
 
-  DBG(DBG_USER, "%s", buf);
+  spiDmaBlocks = gpioCfg.spiDmaBytes ? SPI_DMA_BLOCKS : 0;
 
-  status = system(buf);
+  /* allocate memory for pointers to virtual and bus memory pages */
 
-  if(status < 0)
-    status = PI_BAD_SHELL_STATUS;
+  dmaVirt =
+      mmap(0, PAGES_PER_BLOCK * DMA_BLOCKS * sizeof(dmaPage_t*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_LOCKED, -1, 0);
 
-  return status;
-}
+  if(dmaVirt == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap dma virtual failed (%m)");
 
-/* ----------------------------------------------------------------------- */
+  dmaBus =
+      mmap(0, PAGES_PER_BLOCK * DMA_BLOCKS * sizeof(dmaPage_t*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_LOCKED, -1, 0);
 
-static void*
-pthScript(void* x) {
-  gpioScript_t* s;
-  cmdInstr_t instr;
-  int p1, p2, p1o, p2o, p3o, *t1, *t2;
-  int PC, A, F, SP;
-  int S[PI_SCRIPT_STACK_SIZE];
-  char buf[CMD_MAX_EXTENSION];
+  if(dmaBus == MAP_FAILED)
+    SOFT_ERROR(PI_INIT_FAILED, "mmap dma bus failed (%m)");
 
-  S[0] = 0; /* to prevent compiler warning */
+  dmaIVirt = (dmaIPage_t**)dmaVirt;
+  dmaIBus = (dmaIPage_t**)dmaBus;
 
-  s = x;
+  dmaOVirt = (dmaOPage_t**)(dmaVirt + (PAGES_PER_BLOCK * bufferBlocks));
+  dmaOBus = (dmaOPage_t**)(dmaBus + (PAGES_PER_BLOCK * bufferBlocks));
 
-  while((volatile int)s->request != PI_SCRIPT_DELETE) {
-    pthread_mutex_lock(&s->pthMutex);
-    s->run_state = PI_SCRIPT_HALTED;
-    pthread_cond_wait(&s->pthCond, &s->pthMutex);
-    pthread_mutex_unlock(&s->pthMutex);
-
-    s->run_state = PI_SCRIPT_RUNNING;
-
-    A = 0;
-    F = 0;
-    PC = 0;
-    SP = 0;
-
-    while(((volatile int)s->request == PI_SCRIPT_RUN) && (s->run_state == PI_SCRIPT_RUNNING)) {
-      instr = s->script.instr[PC];
-
-      p1o = instr.p[1];
-      p2o = instr.p[2];
-
-      if(instr.opt[1] == CMD_VAR)
-        instr.p[1] = s->script.var[p1o];
-      else if(instr.opt[1] == CMD_PAR)
-        instr.p[1] = s->script.par[p1o];
-
-      if(instr.opt[2] == CMD_VAR)
-        instr.p[2] = s->script.var[p2o];
-      else if(instr.opt[2] == CMD_PAR)
-        instr.p[2] = s->script.par[p2o];
-      /*
-               fprintf(stderr, "PC=%d cmd=%d p1o=%d p1=%d p2o=%d p2=%d\n",
-                  PC, instr.p[0], p1o, instr.p[1], p2o, instr.p[2]);
-               fflush(stderr);
-      */
-      if(instr.p[0] < PI_CMD_SCRIPT) {
-        if(instr.p[3]) {
-          if((instr.p[3] == sizeof(int)) && ((instr.opt[3] == CMD_VAR) || (instr.opt[3] == CMD_PAR))) {
-            /* Hack to allow register use in 3rd parameter */
-            memcpy((char*)&p3o, (char*)instr.p[4], sizeof(int));
-            if(instr.opt[3] == CMD_VAR)
-              memcpy(buf, (char*)&(s->script.var[p3o]), sizeof(int));
-            else
-              memcpy(buf, (char*)&(s->script.par[p3o]), sizeof(int));
-          } else {
-            memcpy(buf, (char*)instr.p[4], instr.p[3]);
-          }
-        }
+  if(spiDmaBlocks) {
+    spiDmaVirt = dmaVirt + (PAGES_PER_BLOCK * (bufferBlocks + PI_WAVE_BLOCKS));
+    spiDmaBus = dmaBus + (PAGES_PER_BLOCK * (bufferBlocks + PI_WAVE_BLOCKS));
+  }
 
-        A = myDoCommand(instr.p, sizeof(buf) - 1, buf);
+  if((gpioCfg.memAllocMode == PI_MEM_ALLOC_PAGEMAP) ||
+     ((gpioCfg.memAllocMode == PI_MEM_ALLOC_AUTO) && (gpioCfg.bufferMilliseconds > PI_DEFAULT_BUFFER_MILLIS))) {
+    /* pagemap allocation of DMA memory */
 
-        F = A;
+    dmaPMapBlk = mmap(0, DMA_BLOCKS * sizeof(dmaPage_t*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_LOCKED, -1, 0);
 
-        PC++;
-      } else {
-        p1 = instr.p[1];
-        p2 = instr.p[2];
+    if(dmaPMapBlk == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "pagemap mmap block failed (%m)");
 
-        switch(instr.p[0]) {
-          case PI_CMD_ADD:
-            A += p1;
-            F = A;
-            PC++;
-            break;
+    fdPmap = open("/proc/self/pagemap", O_RDONLY);
 
-          case PI_CMD_AND:
-            A &= p1;
-            F = A;
-            PC++;
-            break;
+    if(fdPmap < 0)
+      SOFT_ERROR(PI_INIT_FAILED, "pagemap open failed(%m)");
 
-          case PI_CMD_CALL:
-            scrPush(s, &SP, S, PC + 1);
-            PC = p1;
-            break;
+    clock_gettime(CLOCK_MONOTONIC, &lap);
 
-          case PI_CMD_CMP:
-            F = A - p1;
-            PC++;
-            break;
+    status = initPagemapBlocks(DMA_BLOCKS);
 
-          case PI_CMD_DCR:
-            if(instr.opt[1] == CMD_PAR) {
-              --s->script.par[p1o];
-              F = s->script.par[p1o];
-            } else {
-              --s->script.var[p1o];
-              F = s->script.var[p1o];
-            }
-            PC++;
-            break;
+    close(fdPmap);
 
-          case PI_CMD_DCRA:
-            --A;
-            F = A;
-            PC++;
-            break;
+    if(status < 0)
+      return status;
 
-          case PI_CMD_DIV:
-            A /= p1;
-            F = A;
-            PC++;
-            break;
+    DBG(DBG_STARTUP, "pagemap blocks took %d us", initLapMicros(&lap));
 
-          case PI_CMD_HALT: s->run_state = PI_SCRIPT_HALTED; break;
+    DBG(DBG_STARTUP, "dmaPMapBlk=%08" PRIXPTR " dmaIn=%08" PRIXPTR, (uintptr_t)dmaPMapBlk, (uintptr_t)dmaIn);
+  } else {
+    /* mailbox allocation of DMA memory */
 
-          case PI_CMD_EVTWT:
-            A = scrEvtWait(s, p1);
-            F = A;
-            PC++;
-            break;
+    dmaMboxBlk = mmap(0, DMA_BLOCKS * sizeof(DMAMem_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_LOCKED, -1, 0);
 
-          case PI_CMD_INR:
-            if(instr.opt[1] == CMD_PAR) {
-              ++s->script.par[p1o];
-              F = s->script.par[p1o];
-            } else {
-              ++s->script.var[p1o];
-              F = s->script.var[p1o];
-            }
-            PC++;
-            break;
+    if(dmaMboxBlk == MAP_FAILED)
+      SOFT_ERROR(PI_INIT_FAILED, "mmap mbox block failed (%m)");
 
-          case PI_CMD_INRA:
-            ++A;
-            F = A;
-            PC++;
-            break;
+    fdMbox = mbOpen();
 
-          case PI_CMD_JM:
-            if(F < 0)
-              PC = p1;
-            else
-              PC++;
-            break;
+    if(fdMbox < 0)
+      SOFT_ERROR(PI_INIT_FAILED, "mbox open failed(%m)");
 
-          case PI_CMD_JMP: PC = p1; break;
+    clock_gettime(CLOCK_MONOTONIC, &lap);
 
-          case PI_CMD_JNZ:
-            if(F)
-              PC = p1;
-            else
-              PC++;
-            break;
+    for(i = 0; i < DMA_BLOCKS; i++) {
+      status = initMboxBlock(i);
+      if(status < 0) {
+        mbClose(fdMbox);
+        return status;
+      }
+    }
+
+    mbClose(fdMbox);
+
+    DBG(DBG_STARTUP, "mailbox blocks took %d us", initLapMicros(&lap));
+
+    DBG(DBG_STARTUP, "dmaMboxBlk=%08" PRIXPTR " dmaIn=%08" PRIXPTR, (uintptr_t)dmaMboxBlk, (uintptr_t)dmaIn);
+  }
+
+  DBG(DBG_STARTUP,
+      "gpioReg=%08" PRIXPTR " pwmReg=%08" PRIXPTR " pcmReg=%08" PRIXPTR " clkReg=%08" PRIXPTR " auxReg=%08" PRIXPTR,
+      (uintptr_t)gpioReg,
+      (uintptr_t)pwmReg,
+      (uintptr_t)pcmReg,
+      (uintptr_t)clkReg,
+      (uintptr_t)auxReg);
+
+  for(i = 0; i < DMAI_PAGES; i++) DBG(DBG_STARTUP, "dmaIBus[%d]=%08" PRIXPTR, i, (uintptr_t)dmaIBus[i]);
+
+  status = dmaPageMapInit();
+
+  if(status < 0)
+    return status;
+
+  if(gpioCfg.dbgLevel >= DBG_DMACBS) {
+    fprintf(stderr, "*** INPUT DMA CONTROL BLOCKS ***\n");
+    for(i = 0; i < NUM_CBS; i++) dmaCbPrint(i);
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+initPWM(unsigned bits) {
+  DBG(DBG_STARTUP, "bits=%d", bits);
+
+  /* reset PWM */
 
-          case PI_CMD_JP:
-            if(F >= 0)
-              PC = p1;
-            else
-              PC++;
-            break;
+  pwmReg[PWM_CTL] = 0;
 
-          case PI_CMD_JZ:
-            if(!F)
-              PC = p1;
-            else
-              PC++;
-            break;
+  myGpioDelay(10);
 
-          case PI_CMD_LD:
-            if(instr.opt[1] == CMD_PAR)
-              s->script.par[p1o] = p2;
-            else
-              s->script.var[p1o] = p2;
-            PC++;
-            break;
+  pwmReg[PWM_STA] = -1;
 
-          case PI_CMD_LDA:
-            A = p1;
-            PC++;
-            break;
+  myGpioDelay(10);
 
-          case PI_CMD_LDAB:
-            if((p1 >= 0) && (p1 < sizeof(buf)))
-              A = buf[p1];
-            PC++;
-            break;
+  /* set number of bits to transmit */
 
-          case PI_CMD_MLT:
-            A *= p1;
-            F = A;
-            PC++;
-            break;
+  pwmReg[PWM_RNG1] = bits;
 
-          case PI_CMD_MOD:
-            A %= p1;
-            F = A;
-            PC++;
-            break;
+  myGpioDelay(10);
 
-          case PI_CMD_OR:
-            A |= p1;
-            F = A;
-            PC++;
-            break;
+  dmaIVirt[0]->periphData = 1;
 
-          case PI_CMD_POP:
-            if(instr.opt[1] == CMD_PAR)
-              s->script.par[p1o] = scrPop(s, &SP, S);
-            else
-              s->script.var[p1o] = scrPop(s, &SP, S);
-            PC++;
-            break;
+  /* enable PWM DMA, raise panic and dreq thresholds to 15 */
 
-          case PI_CMD_POPA:
-            A = scrPop(s, &SP, S);
-            PC++;
-            break;
+  pwmReg[PWM_DMAC] = PWM_DMAC_ENAB | PWM_DMAC_PANIC(15) | PWM_DMAC_DREQ(15);
 
-          case PI_CMD_PUSH:
-            if(instr.opt[1] == CMD_PAR)
-              scrPush(s, &SP, S, s->script.par[p1o]);
-            else
-              scrPush(s, &SP, S, s->script.var[p1o]);
-            PC++;
-            break;
+  myGpioDelay(10);
 
-          case PI_CMD_PUSHA:
-            scrPush(s, &SP, S, A);
-            PC++;
-            break;
+  /* clear PWM fifo */
 
-          case PI_CMD_RET: PC = scrPop(s, &SP, S); break;
+  pwmReg[PWM_CTL] = PWM_CTL_CLRF1;
 
-          case PI_CMD_RL:
-            if(instr.opt[1] == CMD_PAR) {
-              s->script.par[p1o] <<= p2;
-              F = s->script.par[p1o];
-            } else {
-              s->script.var[p1o] <<= p2;
-              F = s->script.var[p1o];
-            }
-            PC++;
-            break;
+  myGpioDelay(10);
 
-          case PI_CMD_RLA:
-            A <<= p1;
-            F = A;
-            PC++;
-            break;
+  /* enable PWM channel 1 and use fifo */
 
-          case PI_CMD_RR:
-            if(instr.opt[1] == CMD_PAR) {
-              s->script.par[p1o] >>= p2;
-              F = s->script.par[p1o];
-            } else {
-              s->script.var[p1o] >>= p2;
-              F = s->script.var[p1o];
-            }
-            PC++;
-            break;
+  pwmReg[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_MODE1 | PWM_CTL_PWEN1;
+}
 
-          case PI_CMD_RRA:
-            A >>= p1;
-            F = A;
-            PC++;
-            break;
+/* ----------------------------------------------------------------------- */
 
-          case PI_CMD_STA:
-            if(instr.opt[1] == CMD_PAR)
-              s->script.par[p1o] = A;
-            else
-              s->script.var[p1o] = A;
-            PC++;
-            break;
+static void
+initPCM(unsigned bits) {
+  DBG(DBG_STARTUP, "bits=%d", bits);
 
-          case PI_CMD_STAB:
-            if((p1 >= 0) && (p1 < sizeof(buf)))
-              buf[p1] = A;
-            PC++;
-            break;
+  /* disable PCM so we can modify the regs */
 
-          case PI_CMD_SUB:
-            A -= p1;
-            F = A;
-            PC++;
-            break;
+  pcmReg[PCM_CS] = 0;
 
-          case PI_CMD_SYS:
-            A = scrSys((char*)instr.p[4], A, *(gpioReg + GPLEV0));
-            F = A;
-            PC++;
-            break;
+  myGpioDelay(1000);
 
-          case PI_CMD_WAIT:
-            A = scrWait(s, p1);
-            F = A;
-            PC++;
-            break;
+  pcmReg[PCM_FIFO] = 0;
+  pcmReg[PCM_MODE] = 0;
+  pcmReg[PCM_RXC] = 0;
+  pcmReg[PCM_TXC] = 0;
+  pcmReg[PCM_DREQ] = 0;
+  pcmReg[PCM_INTEN] = 0;
+  pcmReg[PCM_INTSTC] = 0;
+  pcmReg[PCM_GRAY] = 0;
 
-          case PI_CMD_X:
-            if(instr.opt[1] == CMD_PAR)
-              t1 = &s->script.par[p1o];
-            else
-              t1 = &s->script.var[p1o];
+  myGpioDelay(1000);
 
-            if(instr.opt[2] == CMD_PAR)
-              t2 = &s->script.par[p2o];
-            else
-              t2 = &s->script.var[p2o];
+  pcmReg[PCM_MODE] = PCM_MODE_FLEN(bits - 1); /* # bits in frame */
 
-            scrSwap(t1, t2);
-            PC++;
-            break;
+  /* enable channel 1 with # bits width */
 
-          case PI_CMD_XA:
-            if(instr.opt[1] == CMD_PAR)
-              scrSwap(&s->script.par[p1o], &A);
-            else
-              scrSwap(&s->script.var[p1o], &A);
-            PC++;
-            break;
+  pcmReg[PCM_TXC] = PCM_TXC_CH1EN | PCM_TXC_CH1WID(bits - 8);
 
-          case PI_CMD_XOR:
-            A ^= p1;
-            F = A;
-            PC++;
-            break;
-        }
-      }
+  pcmReg[PCM_CS] |= PCM_CS_STBY; /* clear standby */
 
-      if(PC >= s->script.instrs)
-        s->run_state = PI_SCRIPT_HALTED;
-    }
+  myGpioDelay(1000);
 
-    if((volatile int)s->request == PI_SCRIPT_HALT)
-      s->run_state = PI_SCRIPT_HALTED;
-  }
+  pcmReg[PCM_CS] |= PCM_CS_TXCLR; /* clear TX FIFO */
 
-  return 0;
-}
+  pcmReg[PCM_CS] |= PCM_CS_DMAEN; /* enable DREQ */
 
-/* ----------------------------------------------------------------------- */
+  pcmReg[PCM_DREQ] = PCM_DREQ_TX_PANIC(16) | PCM_DREQ_TX_REQ_L(30);
 
-static void*
-pthTimerTick(void* x) {
-  gpioTimer_t* tp;
-  struct timespec req, rem;
+  pcmReg[PCM_INTSTC] = 0b1111; /* clear status bits */
 
-  tp = x;
+  /* enable PCM */
 
-  while(1) {
-    req.tv_sec = tp->millis / THOUSAND;
-    req.tv_nsec = (tp->millis % THOUSAND) * THOUSAND * THOUSAND;
+  pcmReg[PCM_CS] |= PCM_CS_EN;
 
-    while(nanosleep(&req, &rem)) {
-      req.tv_sec = rem.tv_sec;
-      req.tv_nsec = rem.tv_nsec;
-    }
+  /* enable tx */
 
-    if(tp->ex)
-      (tp->func)(tp->userdata);
-    else
-      (tp->func)();
-  }
+  pcmReg[PCM_CS] |= PCM_CS_TXON;
 
-  return 0;
+  dmaIVirt[0]->periphData = 0x0F;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void*
-pthFifoThread(void* x) {
-  char buf[CMD_MAX_EXTENSION];
-  int idx, flags, len, res, i;
-  uintptr_t p[CMD_P_ARR];
-  cmdCtlParse_t ctl;
-  uint32_t* param;
-  char v[CMD_MAX_EXTENSION];
-
-  myCreatePipe(PI_INPFIFO, 0662);
-
-  if((inpFifo = fopen(PI_INPFIFO, "r+")) == NULL)
-    SOFT_ERROR((void*)PI_INIT_FAILED, "fopen %s failed(%m)", PI_INPFIFO);
+static void
+initHWClk(int clkCtl, int clkDiv, int clkSrc, int divI, int divF, int MASH) {
+  DBG(DBG_INTERNAL, "ctl=%d div=%d src=%d /I=%d /f=%d M=%d", clkCtl, clkDiv, clkSrc, divI, divF, MASH);
 
-  myCreatePipe(PI_OUTFIFO, 0664);
+  /* kill the clock if busy, anything else isn't reliable */
 
-  if((outFifo = fopen(PI_OUTFIFO, "w+")) == NULL)
-    SOFT_ERROR((void*)PI_INIT_FAILED, "fopen %s failed (%m)", PI_OUTFIFO);
+  if(clkReg[clkCtl] & CLK_CTL_BUSY) {
+    do { clkReg[clkCtl] = BCM_PASSWD | CLK_CTL_KILL; } while(clkReg[clkCtl] & CLK_CTL_BUSY);
+  }
 
-  /* set outFifo non-blocking */
+  clkReg[clkDiv] = (BCM_PASSWD | CLK_DIV_DIVI(divI) | CLK_DIV_DIVF(divF));
 
-  flags = fcntl(fileno(outFifo), F_GETFL, 0);
-  fcntl(fileno(outFifo), F_SETFL, flags | O_NONBLOCK);
+  usleep(10);
 
-  /* don't start until DMA started */
+  clkReg[clkCtl] = (BCM_PASSWD | CLK_CTL_MASH(MASH) | CLK_CTL_SRC(clkSrc));
 
-  spinWhileStarting();
+  usleep(10);
 
-  while(1) {
-    if(fgets(buf, sizeof(buf), inpFifo) == NULL)
-      SOFT_ERROR((void*)PI_INIT_FAILED, "fifo fgets failed (%m)");
+  clkReg[clkCtl] |= (BCM_PASSWD | CLK_CTL_ENAB);
+}
 
-    len = strlen(buf);
+static void
+initClock(int mainClock) {
+  const unsigned BITS = 10;
+  int clockPWM;
+  unsigned clkCtl, clkDiv, clkSrc, clkDivI, clkDivF, clkMash, clkBits;
+  char* per;
+  unsigned micros;
 
-    if(len) {
-      --len;
-      buf[len] = 0; /* replace terminating */
-    }
+  DBG(DBG_STARTUP, "mainClock=%d", mainClock);
 
-    ctl.eaten = 0;
-    idx = 0;
+  if(mainClock)
+    micros = gpioCfg.clockMicros;
+  else
+    micros = PI_WF_MICROS;
 
-    while(((ctl.eaten) < len) && (idx >= 0)) {
-      if((idx = cmdParse(buf, p, CMD_MAX_EXTENSION, v, &ctl)) >= 0) {
-        /* make sure extensions are null terminated */
+  clockPWM = mainClock ^ (gpioCfg.clockPeriph == PI_CLOCK_PCM);
 
-        v[p[3]] = 0;
+  if(clockPWM) {
+    clkCtl = CLK_PWMCTL;
+    clkDiv = CLK_PWMDIV;
+    per = "PWM";
+  } else {
+    clkCtl = CLK_PCMCTL;
+    clkDiv = CLK_PCMDIV;
+    per = "PCM";
+  }
 
-        res = myDoCommand(p, sizeof(v) - 1, v);
+  clkSrc = CLK_CTL_SRC_PLLD;
+  clkDivI = clk_plld_freq / (10000000 / micros); /* 10 MHz - 1 MHz */
+  clkBits = BITS;                                /* 10/BITS MHz - 1/BITS MHz */
+  clkDivF = 0;
+  clkMash = 0;
 
-        switch(cmdInfo[idx].rv) {
-          case 0: fprintf(outFifo, "%d\n", res); break;
+  DBG(DBG_STARTUP, "%s PLLD divi=%d divf=%d mash=%d bits=%d", per, clkDivI, clkDivF, clkMash, clkBits);
 
-          case 1: fprintf(outFifo, "%d\n", res); break;
+  initHWClk(clkCtl, clkDiv, clkSrc, clkDivI, clkDivF, clkMash);
 
-          case 2: fprintf(outFifo, "%d\n", res); break;
+  if(clockPWM)
+    initPWM(BITS);
+  else
+    initPCM(BITS);
 
-          case 3: fprintf(outFifo, "%08X\n", res); break;
+  myGpioDelay(2000);
+}
 
-          case 4: fprintf(outFifo, "%u\n", res); break;
+static void
+initKillDMA(volatile uint32_t* dmaAddr) {
+  dmaAddr[DMA_CS] = DMA_CHANNEL_ABORT;
+  dmaAddr[DMA_CS] = 0;
+  dmaAddr[DMA_CS] = DMA_CHANNEL_RESET;
 
-          case 5: fprintf(outFifo, "%s", cmdUsage); break;
+  dmaAddr[DMA_CONBLK_AD] = 0;
+}
 
-          case 6:
-            fprintf(outFifo, "%d", res);
-            if(res > 0) {
-              for(i = 0; i < res; i++) { fprintf(outFifo, " %d", v[i]); }
-            }
-            fprintf(outFifo, "\n");
-            break;
+/* ----------------------------------------------------------------------- */
 
-          case 7:
-            if(res < 0)
-              fprintf(outFifo, "%d\n", res);
-            else {
-              fprintf(outFifo, "%d", res);
-              param = (uint32_t*)v;
-              for(i = 0; i < PI_MAX_SCRIPT_PARAMS; i++) { fprintf(outFifo, " %d", param[i]); }
-              fprintf(outFifo, "\n");
-            }
-            break;
-        }
-      } else
-        fprintf(outFifo, "%d\n", PI_BAD_FIFO_COMMAND);
-    }
+static void
+initDMAgo(volatile uint32_t* dmaAddr, uint32_t cbAddr) {
+  DBG(DBG_STARTUP, "");
 
-    fflush(outFifo);
-  }
+  initKillDMA(dmaAddr);
 
-  return 0;
-}
+  dmaAddr[DMA_CS] = DMA_INTERRUPT_STATUS | DMA_END_FLAG;
 
-/* ----------------------------------------------------------------------- */
+  dmaAddr[DMA_CONBLK_AD] = cbAddr;
 
-static void*
-pthSocketThreadHandler(void* fdC) {
-  int sock = *(int*)fdC;
-  uintptr_t p[10];
-  uint32_t tmp, response[4];
-  int i;
-  int opt;
-  char buf[CMD_MAX_EXTENSION];
+  /* clear READ/FIFO/READ_LAST_NOT_SET error bits */
 
-  free(fdC);
+  dmaAddr[DMA_DEBUG] = DMA_DEBUG_READ_ERR | DMA_DEBUG_FIFO_ERR | DMA_DEBUG_RD_LST_NOT_SET_ERR;
 
-  /* Disable the Nagle algorithm. */
-  opt = 1;
-  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
+  dmaAddr[DMA_CS] = DMA_WAIT_ON_WRITES | DMA_PANIC_PRIORITY(8) | DMA_PRIORITY(8) | DMA_ACTIVE;
+}
 
-  while(1) {
-    if(sizeof(uintptr_t) == 8) {
-      if(recv(sock, &tmp, 4, MSG_WAITALL) != 4)
-        break;
-      p[0] = (uintptr_t)tmp;
-      if(recv(sock, &tmp, 4, MSG_WAITALL) != 4)
-        break;
-      p[1] = (uintptr_t)tmp;
-      if(recv(sock, &tmp, 4, MSG_WAITALL) != 4)
-        break;
-      p[2] = (uintptr_t)tmp;
-      if(recv(sock, &tmp, 4, MSG_WAITALL) != 4)
-        break;
-      p[3] = (uintptr_t)tmp;
-    } else {
-      if(recv(sock, p, 16, MSG_WAITALL) != 16)
-        break;
-    }
+/* ----------------------------------------------------------------------- */
 
-    if(p[3]) {
-      if(p[3] < sizeof(buf)) {
-        /* read extension into buf */
-        if(recv(sock, buf, p[3], MSG_WAITALL) != p[3]) {
-          /* Serious error.  No point continuing. */
-          DBG(DBG_ALWAYS, "recv failed for %" PRIdPTR " bytes, sock=%d", p[3], sock);
+static void
+initClearGlobals(void) {
+  int i;
 
-          closeOrphanedNotifications(-1, sock);
+  DBG(DBG_STARTUP, "");
 
-          close(sock);
+  alertBits = 0;
+  monitorBits = 0;
+  notifyBits = 0;
+  scriptBits = 0;
+  gFilterBits = 0;
+  nFilterBits = 0;
+  wdogBits = 0;
 
-          return 0;
-        }
-      } else {
-        /* Serious error.  No point continuing. */
-        DBG(DBG_ALWAYS, "ext too large %" PRIdPTR "(%zd), sock=%d", p[3], sizeof(buf), sock);
+  pthAlertRunning = PI_THREAD_NONE;
+  pthFifoRunning = PI_THREAD_NONE;
+  pthSocketRunning = PI_THREAD_NONE;
 
-        closeOrphanedNotifications(-1, sock);
+  wfc[0] = 0;
+  wfc[1] = 0;
+  wfc[2] = 0;
 
-        close(sock);
+  wfcur = 0;
 
-        return 0;
-      }
-    }
+  waveTrackReset();
 
-    /* add null terminator in case it's a string */
+  waveSpanReset();
 
-    buf[p[3]] = 0;
+  waveOutCount = 0;
 
-    switch(p[0]) {
-      case PI_CMD_NOIB:
+  wfStats.micros = 0;
+  wfStats.highMicros = 0;
+  wfStats.maxMicros = PI_WAVE_MAX_MICROS;
 
-        p[3] = gpioNotifyOpenInBand(sock);
+  wfStats.pulses = 0;
+  wfStats.highPulses = 0;
+  wfStats.maxPulses = gpioCfg.waveMaxPulses;
 
-        /* Enable the Nagle algorithm. */
-        opt = 0;
-        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&opt, sizeof(int));
+  wfStats.cbs = 0;
+  wfStats.highCbs = 0;
+  wfStats.maxCbs = (PI_WAVE_BLOCKS * PAGES_PER_BLOCK * CBS_PER_OPAGE);
+  wfStats.rawCbs = 0;
 
-        break;
+  gpioGetSamples.func = NULL;
+  gpioGetSamples.ex = 0;
+  gpioGetSamples.userdata = NULL;
+  gpioGetSamples.bits = 0;
 
-      case PI_CMD_PROCP:
-        p[3] = myDoCommand(p, sizeof(buf) - 1, buf + sizeof(int));
-        if(((int)p[3]) >= 0) {
-          memcpy(buf, &p[3], 4);
-          p[3] = 4 + (4 * PI_MAX_SCRIPT_PARAMS);
-        }
-        break;
+  wfRxSerialBits = 0;
 
-      default: p[3] = myDoCommand(p, sizeof(buf) - 1, buf);
-    }
+  for(i = 0; i <= PI_MAX_USER_GPIO; i++) {
+    wfRx[i].mode = PI_WFRX_NONE;
+    pthread_mutex_init(&wfRx[i].mutex, NULL);
+    gpioAlert[i].func = NULL;
+  }
 
-    if(sizeof(uintptr_t) == 8) // 64-bit system
-    {
-      for(i = 0; i < 4; i++) response[i] = (uint32_t)p[i];
-      if(write(sock, response, 16) == -1) { /* ignore errors */
-      }
-    } else // 32-bit system
-    {
-      if(write(sock, p, 16) == -1) { /* ignore errors */
-      }
-    }
+  for(i = 0; i <= PI_MAX_GPIO; i++) {
+    gpioInfo[i].is = GPIO_UNDEFINED;
+    gpioInfo[i].width = 0;
+    gpioInfo[i].range = PI_DEFAULT_DUTYCYCLE_RANGE;
+    gpioInfo[i].freqIdx = DEFAULT_PWM_IDX;
+  }
 
-    switch(p[0]) {
-        /* extensions */
+  for(i = 0; i < PI_NOTIFY_SLOTS; i++) {
+    gpioNotify[i].seqno = 0;
+    gpioNotify[i].state = PI_NOTIFY_CLOSED;
+  }
 
-      case PI_CMD_BI2CZ:
-      case PI_CMD_BSCX:
-      case PI_CMD_CF2:
-      case PI_CMD_FL:
-      case PI_CMD_FR:
-      case PI_CMD_I2CPK:
-      case PI_CMD_I2CRD:
-      case PI_CMD_I2CRI:
-      case PI_CMD_I2CRK:
-      case PI_CMD_I2CZ:
-      case PI_CMD_PROCP:
-      case PI_CMD_SERR:
-      case PI_CMD_SLR:
-      case PI_CMD_SPIX:
-      case PI_CMD_SPIR:
-      case PI_CMD_BSPIX:
+  for(i = 0; i <= PI_MAX_SIGNUM; i++) {
+    gpioSignal[i].func = NULL;
+    gpioSignal[i].ex = 0;
+    gpioSignal[i].userdata = NULL;
+  }
 
-        if(((int)p[3]) > 0) {
-          if(write(sock, buf, p[3]) == 1) { /* ignore errors */
-          }
-        }
-        break;
+  for(i = 0; i <= PI_MAX_TIMER; i++) {
+    gpioTimer[i].running = 0;
+    gpioTimer[i].func = NULL;
+  }
 
-      default: break;
-    }
+  for(i = 0; i <= PI_MAX_EVENT; i++) {
+    eventAlert[i].func = NULL;
+    eventAlert[i].ignore = 0;
+    eventAlert[i].fired = 0;
   }
 
-  closeOrphanedNotifications(-1, sock);
+  /* calculate the usable PWM frequencies */
 
-  close(sock);
+  for(i = 0; i < PWM_FREQS; i++) {
+    pwmFreq[i] = (1000000.0 / ((float)PULSE_PER_CYCLE * gpioCfg.clockMicros * pwmCycles[i])) + 0.5;
 
-  DBG(DBG_USER, "Socket %d closed", sock);
+    DBG(DBG_STARTUP, "f%d is %d", i, pwmFreq[i]);
+  }
 
-  return 0;
-}
+  inpFifo = NULL;
+  outFifo = NULL;
 
-static int
-addrAllowed(struct sockaddr* saddr) {
-  int i;
-  uint32_t addr;
+  fdLock = -1;
+  fdMem = -1;
+  fdSock = -1;
 
-  if(!numSockNetAddr)
-    return 1;
+  dmaMboxBlk = MAP_FAILED;
+  dmaPMapBlk = MAP_FAILED;
+  dmaVirt = MAP_FAILED;
+  dmaBus = MAP_FAILED;
 
-  // FIXME: add IPv6 whitelisting support
-  if(saddr->sa_family != AF_INET)
-    return 0;
+  spiDmaVirt = NULL;
+  spiDmaBus = NULL;
 
-  addr = ((struct sockaddr_in*)saddr)->sin_addr.s_addr;
+  memset(spiStats, 0, sizeof(spiStats));
 
-  for(i = 0; i < numSockNetAddr; i++) {
-    if(addr == sockNetAddr[i])
-      return 1;
-  }
-  return 0;
+  auxReg = MAP_FAILED;
+  clkReg = MAP_FAILED;
+  dmaReg = MAP_FAILED;
+  gpioReg = MAP_FAILED;
+  pcmReg = MAP_FAILED;
+  pwmReg = MAP_FAILED;
+  systReg = MAP_FAILED;
+  spiReg = MAP_FAILED;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void*
-pthSocketThread(void* x) {
-  int fdC = 0, c, *sock;
-  struct sockaddr_storage client;
-  pthread_attr_t attr;
-
-  if(pthread_attr_init(&attr))
-    SOFT_ERROR((void*)PI_INIT_FAILED, "pthread_attr_init failed (%m)");
-
-  if(pthread_attr_setstacksize(&attr, STACK_SIZE))
-    SOFT_ERROR((void*)PI_INIT_FAILED, "pthread_attr_setstacksize failed (%m)");
+static void
+initReleaseResources(void) {
+  int i;
 
-  if(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
-    SOFT_ERROR((void*)PI_INIT_FAILED, "pthread_attr_setdetachstate failed (%m)");
+  DBG(DBG_STARTUP, "");
 
-  /* fdSock opened in gpioInitialise so that we can treat
-     failure to bind as fatal. */
+  /* shut down running threads */
 
-  listen(fdSock, 100);
+  for(i = 0; i <= PI_MAX_GPIO; i++) {
+    if(gpioISR[i].pth) {
+      /* destroy thread, unexport GPIO */
 
-  c = sizeof(client);
+      gpioSetISRFunc(i, 0, 0, NULL);
+    }
+  }
 
-  /* don't start until DMA started */
+  for(i = 0; i <= PI_MAX_TIMER; i++) {
+    if(gpioTimer[i].running) {
+      /* destroy thread */
 
-  spinWhileStarting();
+      pthread_cancel(gpioTimer[i].pthId);
+      pthread_join(gpioTimer[i].pthId, NULL);
+      gpioTimer[i].running = 0;
+    }
+  }
 
-  while(fdC >= 0) {
-    pthread_t thr;
+  for(i = 0; i < scrWorkers; i++) {
+    /* destroy script workers, stored scripts are left halted */
 
-    fdC = accept(fdSock, (struct sockaddr*)&client, (socklen_t*)&c);
+    pthread_cancel(scrWorker[i]);
+    pthread_join(scrWorker[i], NULL);
+  }
 
-    closeOrphanedNotifications(-1, fdC);
+  scrWorkers = 0;
 
-    if(addrAllowed((struct sockaddr*)&client)) {
-      DBG(DBG_USER, "Connection accepted on socket %d", fdC);
+  if(waveCompilerRunning) {
+    /* the compiler finishes any wave it is part way through */
 
-      sock = malloc(sizeof(int));
+    pthread_cancel(pthWaveCompiler);
+    pthread_join(pthWaveCompiler, NULL);
 
-      *sock = fdC;
+    waveCompilerRunning = 0;
+  }
 
-      /* Enable tcp_keepalive */
-      int optval = 1;
-      socklen_t optlen = sizeof(optval);
+  for(i = 0; i < PI_WAVE_MAX_TICKETS; i++) {
+    free(waveJob[i].pulses);
+    waveJob[i].pulses = NULL;
+    waveJob[i].state = WAVE_JOB_FREE;
+  }
 
-      if(setsockopt(fdC, SOL_SOCKET, SO_KEEPALIVE, &optval, optlen) < 0) {
-        DBG(DBG_ALWAYS, "setsockopt() fail, closing socket %d", fdC);
-        close(fdC);
-      }
+  for(i = 0; i < PI_I2C_MAX_QUEUES; i++) {
+    if(i2cWorker[i].running) {
+      /* a worker finishes any transaction it is part way through */
 
-      DBG(DBG_USER, "SO_KEEPALIVE enabled on socket %d\n", fdC);
+      pthread_cancel(i2cWorker[i].pth);
+      pthread_join(i2cWorker[i].pth, NULL);
 
-      if(pthread_create(&thr, &attr, pthSocketThreadHandler, (void*)sock) < 0)
-        SOFT_ERROR((void*)PI_INIT_FAILED, "socket pthread_create failed (%m)");
-    } else {
-      DBG(DBG_ALWAYS, "Connection rejected, closing");
-      close(fdC);
+      i2cWorker[i].running = 0;
     }
   }
 
-  if(fdC < 0)
-    SOFT_ERROR((void*)PI_INIT_FAILED, "accept failed (%m)");
+  if(serRxRunning) {
+    /* open handles fall back to reading the tty directly */
 
-  return 0;
-}
+    pthread_cancel(pthSerRx);
+    pthread_join(pthSerRx, NULL);
 
-/* ======================================================================= */
+    for(i = 0; i < PI_SER_SLOTS; i++)
+      serInfo[i].rxRing = 0;
 
-static void
-initCheckLockFile(void) {
-  int fd;
-  int count;
-  int pid;
-  int err;
-  int delete;
-  char str[20];
+    close(serRxEpoll);
+    serRxEpoll = -1;
+    serRxRunning = 0;
+  }
 
-  fd = open(PI_LOCKFILE, O_RDONLY);
+  /* release the BSC GPIO left in BSC mode by bscXfer or the service */
 
-  if(fd != -1) {
-    DBG(DBG_STARTUP, "lock file exists");
-    delete = 1;
+  bscSvc.open = 0;
 
-    count = read(fd, str, sizeof(str) - 1);
+  if(bscMode)
+    bscTerm(bscMode);
 
-    if(count) {
-      pid = atoi(str);
-      err = kill(pid, 0);
-      if(!err)
-        delete = 0; /* process still exists */
-      DBG(DBG_STARTUP, "lock file pid=%d err=%d", pid, err);
-    }
+  bscMode = 0;
 
-    close(fd);
-    DBG(DBG_STARTUP, "lock file delete=%d", delete);
+  for(i = 0; i < PI_I2C_MAX_TICKETS; i++) {
+    free(i2cJob[i].inBuf);
+    i2cJob[i].inBuf = NULL;
+    i2cJob[i].outBuf = NULL;
+    i2cJob[i].state = I2C_JOB_FREE;
+  }
 
-    if(delete)
-      unlink(PI_LOCKFILE);
+  scrReadyCount = 0;
+  scrWaitingCount = 0;
+  scrSleepingCount = 0;
+
+  for(i = 0; i < PI_MAX_SCRIPTS; i++) {
+    if(gpioScript[i].state == PI_SCRIPT_IN_USE) {
+      gpioScript[i].request = PI_SCRIPT_HALT;
+      gpioScript[i].run_state = PI_SCRIPT_HALTED;
+      gpioScript[i].sched = SCR_SCHED_IDLE;
+      gpioScript[i].restart = 0;
+    }
   }
-}
 
-static int
-initGrabLockFile(void) {
-  int fd;
-  int lockResult;
-  char pidStr[20];
+  if(pthAlertRunning != PI_THREAD_NONE) {
+    pthread_cancel(pthAlert);
+    pthread_join(pthAlert, NULL);
+    pthAlertRunning = PI_THREAD_NONE;
+  }
 
-  initCheckLockFile();
+  if(pthFifoRunning != PI_THREAD_NONE) {
+    pthread_cancel(pthFifo);
+    pthread_join(pthFifo, NULL);
+    pthFifoRunning = PI_THREAD_NONE;
+  }
 
-  /* try to grab the lock file */
+  if(pthSocketRunning != PI_THREAD_NONE) {
+    pthread_cancel(pthSocket);
+    pthread_join(pthSocket, NULL);
+    pthSocketRunning = PI_THREAD_NONE;
+  }
 
-  fd = open(PI_LOCKFILE, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC, 0644);
+  /* release mmap'd memory */
 
-  if(fd != -1) {
-    lockResult = flock(fd, LOCK_EX | LOCK_NB);
+  if(auxReg != MAP_FAILED)
+    munmap((void*)auxReg, AUX_LEN);
+  if(bscsReg != MAP_FAILED)
+    munmap((void*)bscsReg, BSCS_LEN);
+  if(clkReg != MAP_FAILED)
+    munmap((void*)clkReg, CLK_LEN);
+  if(dmaReg != MAP_FAILED)
+    munmap((void*)dmaReg, DMA_LEN);
+  if(gpioReg != MAP_FAILED)
+    munmap((void*)gpioReg, GPIO_LEN);
+  if(pcmReg != MAP_FAILED)
+    munmap((void*)pcmReg, PCM_LEN);
+  if(pwmReg != MAP_FAILED)
+    munmap((void*)pwmReg, PWM_LEN);
+  if(systReg != MAP_FAILED)
+    munmap((void*)systReg, SYST_LEN);
+  if(spiReg != MAP_FAILED)
+    munmap((void*)spiReg, SPI_LEN);
 
-    if(lockResult == 0) {
-      sprintf(pidStr, "%d\n", (int)getpid());
+  auxReg = MAP_FAILED;
+  bscsReg = MAP_FAILED;
+  clkReg = MAP_FAILED;
+  dmaReg = MAP_FAILED;
+  gpioReg = MAP_FAILED;
+  pcmReg = MAP_FAILED;
+  pwmReg = MAP_FAILED;
+  systReg = MAP_FAILED;
+  spiReg = MAP_FAILED;
 
-      if(write(fd, pidStr, strlen(pidStr)) == -1) {
-        /* ignore errors */
-      }
-    } else {
-      close(fd);
-      return -1;
-    }
+  dmaPageMapFree();
+
+  if(dmaBus != MAP_FAILED) {
+    munmap(dmaBus, PAGES_PER_BLOCK * DMA_BLOCKS * sizeof(dmaPage_t*));
   }
 
-  return fd;
-}
+  dmaBus = MAP_FAILED;
 
-/* ----------------------------------------------------------------------- */
+  if(dmaVirt != MAP_FAILED) {
+    for(i = 0; i < PAGES_PER_BLOCK * DMA_BLOCKS; i++) { munmap(dmaVirt[i], PAGE_SIZE); }
 
-static uint32_t*
-initMapMem(int fd, uint32_t addr, uint32_t len) {
-  return (uint32_t*)mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, addr);
-}
+    munmap(dmaVirt, PAGES_PER_BLOCK * DMA_BLOCKS * sizeof(dmaPage_t*));
+  }
 
-/* ----------------------------------------------------------------------- */
+  dmaVirt = MAP_FAILED;
 
-static int
-initCheckPermitted(void) {
-  DBG(DBG_STARTUP, "");
+  if(dmaPMapBlk != MAP_FAILED) {
+    for(i = 0; i < DMA_BLOCKS; i++) { munmap(dmaPMapBlk[i], PAGES_PER_BLOCK * PAGE_SIZE); }
 
-  if(!pi_ispi) {
-    DBG(DBG_ALWAYS,
-        "\n"
-        "+---------------------------------------------------------+\n"
-        "|Sorry, this system does not appear to be a raspberry pi. |\n"
-        "|aborting.                                                |\n"
-        "+---------------------------------------------------------+\n\n");
-    return -1;
+    munmap(dmaPMapBlk, DMA_BLOCKS * sizeof(dmaPage_t*));
   }
 
-  if((fdMem = open("/dev/mem", O_RDWR | O_SYNC)) < 0) {
-    DBG(DBG_ALWAYS,
-        "\n"
-        "+---------------------------------------------------------+\n"
-        "|Sorry, you don't have permission to run this program.    |\n"
-        "|Try running as root, e.g. precede the command with sudo. |\n"
-        "+---------------------------------------------------------+\n\n");
-    return -1;
+  dmaPMapBlk = MAP_FAILED;
+
+  if(dmaMboxBlk != MAP_FAILED) {
+    fdMbox = mbOpen();
+
+    for(i = 0; i < DMA_BLOCKS; i++) { mbDMAFree(&dmaMboxBlk[DMA_BLOCKS - i - 1]); }
+
+    mbClose(fdMbox);
+
+    munmap(dmaMboxBlk, DMA_BLOCKS * sizeof(DMAMem_t));
   }
-  return 0;
-}
 
-/* ----------------------------------------------------------------------- */
+  dmaMboxBlk = MAP_FAILED;
 
-static int
-initPeripherals(void) {
-  DBG(DBG_STARTUP, "");
+  spiDmaBlocks = 0;
+  spiDmaVirt = NULL;
+  spiDmaBus = NULL;
 
-  gpioReg = initMapMem(fdMem, GPIO_BASE, GPIO_LEN);
+  if(inpFifo != NULL) {
+    fclose(inpFifo);
+    unlink(PI_INPFIFO);
+    inpFifo = NULL;
+  }
 
-  if(gpioReg == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap gpio failed (%m)");
+  if(outFifo != NULL) {
+    fclose(outFifo);
+    unlink(PI_OUTFIFO);
+    outFifo = NULL;
+  }
 
-  dmaReg = initMapMem(fdMem, DMA_BASE, DMA_LEN);
+  if(fdMem != -1) {
+    close(fdMem);
+    fdMem = -1;
+  }
 
-  if(dmaReg == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap dma failed (%m)");
+  if(fdLock != -1) {
+    close(fdLock);
+    unlink(PI_LOCKFILE);
+    fdLock = -1;
+  }
 
-  /* we should know if we are running on a BCM2711 by now */
+  if(fdSock != -1) {
+    close(fdSock);
+    fdSock = -1;
+  }
 
-  if(gpioCfg.DMAprimaryChannel == PI_DEFAULT_DMA_NOT_SET) {
-    if(pi_is_2711)
-      gpioCfg.DMAprimaryChannel = PI_DEFAULT_DMA_PRIMARY_CH_2711;
-    else
-      gpioCfg.DMAprimaryChannel = PI_DEFAULT_DMA_PRIMARY_CHANNEL;
+  if(fdPmap != -1) {
+    close(fdPmap);
+    fdPmap = -1;
   }
 
-  if(gpioCfg.DMAsecondaryChannel == PI_DEFAULT_DMA_NOT_SET) {
-    if(pi_is_2711)
-      gpioCfg.DMAsecondaryChannel = PI_DEFAULT_DMA_SECONDARY_CH_2711;
-    else
-      gpioCfg.DMAsecondaryChannel = PI_DEFAULT_DMA_SECONDARY_CHANNEL;
+  if(fdMbox != -1) {
+    close(fdMbox);
+    fdMbox = -1;
   }
 
-  dmaIn = dmaReg + (gpioCfg.DMAprimaryChannel * 0x40);
-  dmaOut = dmaReg + (gpioCfg.DMAsecondaryChannel * 0x40);
+  gpioStats.DMARestarts = 0;
+  gpioStats.dmaInitCbsCount = 0;
 
-  DBG(DBG_STARTUP, "DMA #%d @ %08" PRIXPTR, gpioCfg.DMAprimaryChannel, (uintptr_t)dmaIn);
+  numSockNetAddr = 0;
 
-  DBG(DBG_STARTUP, "debug reg is %08X", dmaIn[DMA_DEBUG]);
+  dmaLive = 0;
+}
 
-  clkReg = initMapMem(fdMem, CLK_BASE, CLK_LEN);
+/* ----------------------------------------------------------------------- */
 
-  if(clkReg == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap clk failed (%m)");
+static int
+initDMA(void) {
+  pthread_attr_t pthAttr;
+  struct timespec lap;
 
-  systReg = initMapMem(fdMem, SYST_BASE, SYST_LEN);
+  DBG(DBG_STARTUP, "");
 
-  if(systReg == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap syst failed (%m)");
+  clock_gettime(CLOCK_MONOTONIC, &lap);
 
-  spiReg = initMapMem(fdMem, SPI_BASE, SPI_LEN);
+  if(initAllocDMAMem() < 0)
+    return PI_INIT_FAILED;
 
-  if(spiReg == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap spi failed (%m)");
+  DBG(DBG_STARTUP, "dma memory took %d us", initLapMicros(&lap));
 
-  pwmReg = initMapMem(fdMem, PWM_BASE, PWM_LEN);
+  /* done with /dev/mem */
 
-  if(pwmReg == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap pwm failed (%m)");
+  if(fdMem != -1) {
+    close(fdMem);
+    fdMem = -1;
+  }
 
-  pcmReg = initMapMem(fdMem, PCM_BASE, PCM_LEN);
+  initClock(1); /* initialise main clock */
+
+  DBG(DBG_STARTUP, "clock took %d us", initLapMicros(&lap));
+
+  myGpioDelay(1000);
+
+  dmaInitCbs();
+
+  flushMemory();
+
+  // cast twice to suppress compiler warning, I belive this cast
+  // is ok because dmaIBus contains bus addresses, not virtual
+  // addresses.
+  initDMAgo((uint32_t*)dmaIn, (uint32_t)(uintptr_t)dmaIBus[0]);
 
-  if(pcmReg == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap pcm failed (%m)");
+  /* the alert thread only reads the ring once the DMA is going */
 
-  auxReg = initMapMem(fdMem, AUX_BASE, AUX_LEN);
+  if(!(gpioCfg.ifFlags & PI_DISABLE_ALERT)) {
+    if(pthread_attr_init(&pthAttr))
+      SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_init failed (%m)");
 
-  if(auxReg == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap aux failed (%m)");
+    if(pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
+      SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_setstacksize failed (%m)");
 
-  padsReg = initMapMem(fdMem, PADS_BASE, PADS_LEN);
+    if(pthread_create(&pthAlert, &pthAttr, pthAlertThread, NULL))
+      SOFT_ERROR(PI_INIT_FAILED, "pthread_create alert failed (%m)");
 
-  if(padsReg == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap pads failed (%m)");
+    pthAlertRunning = PI_THREAD_STARTED;
+  }
 
-  bscsReg = initMapMem(fdMem, BSCS_BASE, BSCS_LEN);
+  dmaLive = 1;
 
-  if(bscsReg == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap bscs failed (%m)");
+  DBG(DBG_STARTUP, "dma start took %d us", initLapMicros(&lap));
 
   return 0;
 }
@@ -6999,1692 +10747,1794 @@ initPeripherals(void) {
 /* ----------------------------------------------------------------------- */
 
 static int
-initZaps(int pmapFd, void* virtualBase, int basePage, int pages) {
-  int n;
-  uintptr_t index;
-  off_t offset;
-  ssize_t t;
-  uint32_t physical;
+initStartDMA(void) {
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
   int status;
-  uintptr_t pageAdr;
-  unsigned long long pa;
 
-  DBG(DBG_STARTUP, "");
+  /*
+  With PI_LAZY_DMA the first command needing sampling, PWM, servos
+  or waves brings the DMA up.  A failed start is not retried.
+  */
 
-  status = 0;
+  pthread_mutex_lock(&mutex);
 
-  pageAdr = (uintptr_t)dmaVirt[basePage];
+  if(!dmaLive) {
+    DBG(DBG_STARTUP, "starting deferred dma");
 
-  index = ((uintptr_t)virtualBase / PAGE_SIZE) * 8;
+    if(initDMA() < 0)
+      dmaLive = PI_DMA_START_FAILED;
+  }
 
-  offset = lseek(pmapFd, index, SEEK_SET);
+  status = dmaLive;
 
-  if(offset != index)
-    SOFT_ERROR(PI_INIT_FAILED, "lseek pagemap failed (%m)");
+  pthread_mutex_unlock(&mutex);
 
-  for(n = 0; n < pages; n++) {
-    t = read(pmapFd, &pa, sizeof(pa));
+  if(status < 0)
+    SOFT_ERROR(PI_DMA_START_FAILED, "deferred dma start failed");
 
-    if(t != sizeof(pa))
-      SOFT_ERROR(PI_INIT_FAILED, "read pagemap failed (%m)");
+  if(!(gpioCfg.ifFlags & PI_DISABLE_ALERT)) {
+    while(pthAlertRunning != PI_THREAD_RUNNING) myGpioDelay(1000);
+  }
 
-    DBG(DBG_STARTUP, "pf%d=%016llX", n, pa);
+  return 0;
+}
 
-    physical = 0x3FFFFFFF & (PAGE_SIZE * (pa & 0xFFFFFFFF));
+/* ----------------------------------------------------------------------- */
 
-    if(physical) {
-      // cast twice to suppress warning, I belive this is ok as these
-      // are bus addresses, not virtual addresses. --plugwash
-      dmaBus[basePage + n] = (dmaPage_t*)(uintptr_t)(physical | pi_dram_bus);
+int
+initInitialise(void) {
+  int i;
+  unsigned rev, model;
+  struct sockaddr_in server;
+  struct sockaddr_in6 server6;
+  char* portStr;
+  unsigned port;
+  struct sched_param param;
+  pthread_attr_t pthAttr;
+  struct timespec lap;
 
-      dmaVirt[basePage + n] = mmap((void*)pageAdr, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | MAP_LOCKED | MAP_NORESERVE, fdMem, physical);
-    } else
-      status = 1;
+  DBG(DBG_STARTUP, "");
 
-    pageAdr += PAGE_SIZE;
-  }
+  clock_gettime(CLOCK_MONOTONIC, &lap);
 
-  return status;
-}
+  waveClockInited = 0;
+  PWMClockInited = 0;
 
-/* ----------------------------------------------------------------------- */
+  clock_gettime(CLOCK_REALTIME, &libStarted);
 
-static int
-initPagemapBlock(int block) {
-  int trys, ok;
-  unsigned pageNum;
+  rev = gpioHardwareRevision();
 
-  DBG(DBG_STARTUP, "block=%d", block);
+  initClearGlobals();
 
-  dmaPMapBlk[block] = mmap(0, (PAGES_PER_BLOCK * PAGE_SIZE), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE | MAP_LOCKED, -1, 0);
+  if(initCheckPermitted() < 0)
+    return PI_INIT_FAILED;
 
-  if(dmaPMapBlk[block] == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap dma block %d failed (%m)", block);
+  fdLock = initGrabLockFile();
 
-  /* force allocation of physical memory */
+  if(fdLock < 0)
+    SOFT_ERROR(PI_INIT_FAILED, "Can't lock %s", PI_LOCKFILE);
 
-  memset((void*)dmaPMapBlk[block], 0xAA, (PAGES_PER_BLOCK * PAGE_SIZE));
+  if(!gpioMaskSet) {
+    if(rev == 0)
+      gpioMask = PI_DEFAULT_UPDATE_MASK_UNKNOWN;
+    else if(rev < 4)
+      gpioMask = PI_DEFAULT_UPDATE_MASK_B1;
+    else if(rev < 16)
+      gpioMask = PI_DEFAULT_UPDATE_MASK_A_B2;
+    else if(rev == 17)
+      gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
+    else if(rev < 20)
+      gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
+    else if(rev == 20)
+      gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
+    else if(rev == 21)
+      gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
+    else {
+      model = (rev >> 4) & 0xFF;
 
-  memset((void*)dmaPMapBlk[block], 0xFF, (PAGES_PER_BLOCK * PAGE_SIZE));
+      /* model
+      0=A 1=B
+      2=A+ 3=B+
+      4=Pi2B
+      5=Alpha
+      6=Compute Module
+      7=Unknown
+      8=Pi3B
+      9=Zero
+      12=Zero W
+      13=Pi3B+
+      14=Pi3A+
+      17=Pi4B
+      */
+      if(model < 2)
+        gpioMask = PI_DEFAULT_UPDATE_MASK_A_B2;
+      else if(model < 4)
+        gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
+      else if(model == 4)
+        gpioMask = PI_DEFAULT_UPDATE_MASK_PI2B;
 
-  memset((void*)dmaPMapBlk[block], 0, (PAGES_PER_BLOCK * PAGE_SIZE));
+      else if(model == 6 || model == 10 || model == 16)
+        gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
 
-  pageNum = block * PAGES_PER_BLOCK;
+      else if(model == 8 || model == 13 || model == 14)
+        gpioMask = PI_DEFAULT_UPDATE_MASK_PI3B;
 
-  dmaVirt[pageNum] = mmap(0, (PAGES_PER_BLOCK * PAGE_SIZE), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE | MAP_LOCKED, -1, 0);
+      else if(model == 9 || model == 12)
+        gpioMask = PI_DEFAULT_UPDATE_MASK_ZERO;
 
-  if(dmaVirt[pageNum] == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap dma block %d failed (%m)", block);
+      else if(model == 17)
+        gpioMask = PI_DEFAULT_UPDATE_MASK_PI4B;
+      else
+        gpioMask = PI_DEFAULT_UPDATE_MASK_UNKNOWN;
+    }
 
-  munmap(dmaVirt[pageNum], PAGES_PER_BLOCK * PAGE_SIZE);
+    gpioMaskSet = 1;
+  }
 
-  trys = 0;
-  ok = 0;
+#ifndef EMBEDDED_IN_VM
+  if(!(gpioCfg.internals & PI_CFG_NOSIGHANDLER))
+    sigSetHandler();
+#endif
 
-  while((trys < 10) && !ok) {
-    if(initZaps(fdPmap, dmaPMapBlk[block], pageNum, PAGES_PER_BLOCK) == 0)
-      ok = 1;
-    else
-      myGpioDelay(50000);
+  DBG(DBG_STARTUP, "checks took %d us", initLapMicros(&lap));
 
-    ++trys;
-  }
+  if(initPeripherals() < 0)
+    return PI_INIT_FAILED;
 
-  if(!ok)
-    SOFT_ERROR(PI_INIT_FAILED, "initZaps failed");
+  DBG(DBG_STARTUP, "peripherals took %d us", initLapMicros(&lap));
 
-  return 0;
-}
+  param.sched_priority = sched_get_priority_max(SCHED_FIFO);
 
-static int
-initMboxBlock(int block) {
-  int n, ok;
-  unsigned page;
-  uintptr_t virtualAdr;
-  uintptr_t busAdr;
+  if(gpioCfg.internals & PI_CFG_RT_PRIORITY)
+    sched_setscheduler(0, SCHED_FIFO, &param);
 
-  DBG(DBG_STARTUP, "block=%d", block);
+  atexit(gpioTerminate);
 
-  ok = mbDMAAlloc(&dmaMboxBlk[block], PAGES_PER_BLOCK * PAGE_SIZE, pi_mem_flag);
+  if(!(gpioCfg.ifFlags & PI_LAZY_DMA)) {
+    if(initDMA() < 0)
+      return PI_INIT_FAILED;
 
-  if(!ok)
-    SOFT_ERROR(PI_INIT_FAILED, "init mbox zaps failed");
+    initLapMicros(&lap);
+  }
 
-  page = block * PAGES_PER_BLOCK;
+  if(pthread_attr_init(&pthAttr))
+    SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_init failed (%m)");
 
-  virtualAdr = (uintptr_t)dmaMboxBlk[block].virtual_addr;
-  busAdr = dmaMboxBlk[block].bus_addr;
+  if(pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
+    SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_setstacksize failed (%m)");
 
-  for(n = 0; n < PAGES_PER_BLOCK; n++) {
-    dmaVirt[page + n] = (dmaPage_t*)virtualAdr;
-    dmaBus[page + n] = (dmaPage_t*)busAdr;
-    virtualAdr += PAGE_SIZE;
-    busAdr += PAGE_SIZE;
+  if(!(gpioCfg.ifFlags & PI_DISABLE_FIFO_IF)) {
+    if(pthread_create(&pthFifo, &pthAttr, pthFifoThread, &i))
+      SOFT_ERROR(PI_INIT_FAILED, "pthread_create fifo failed (%m)");
+
+    pthFifoRunning = PI_THREAD_STARTED;
   }
 
-  return 0;
-}
+  if(!(gpioCfg.ifFlags & PI_DISABLE_SOCK_IF)) {
+    portStr = getenv(PI_ENVPORT);
+    if(portStr)
+      port = atoi(portStr);
+    else
+      port = gpioCfg.socketPort;
 
-/* ----------------------------------------------------------------------- */
+    // Accept connections on IPv6, unless we have an IPv4-only whitelist
+    if(!numSockNetAddr) {
+      fdSock = socket(AF_INET6, SOCK_STREAM, 0);
 
-static int
-initAllocDMAMem(void) {
-  int i, servoCycles, superCycles;
-  int status;
+      if(fdSock != -1) {
+        bzero((char*)&server6, sizeof(server6));
+        server6.sin6_family = AF_INET6;
+        if(gpioCfg.ifFlags & PI_LOCALHOST_SOCK_IF) {
+          server6.sin6_addr = in6addr_loopback;
+        } else {
+          server6.sin6_addr = in6addr_any;
+        }
+        server6.sin6_port = htons(port);
 
-  DBG(DBG_STARTUP, "");
+        int opt = 1;
+        setsockopt(fdSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if(bind(fdSock, (struct sockaddr*)&server6, sizeof(server6)) < 0)
+          SOFT_ERROR(PI_INIT_FAILED, "bind to port %d failed (%m)", port);
+      }
+    }
 
-  /* Calculate the number of blocks needed for buffers.  The number
-     of blocks must be a multiple of the 20ms servo cycle.
-  */
+    if(numSockNetAddr || fdSock == -1) {
+      fdSock = socket(AF_INET, SOCK_STREAM, 0);
 
-  servoCycles = gpioCfg.bufferMilliseconds / 20;
-  if(gpioCfg.bufferMilliseconds % 20)
-    servoCycles++;
+      if(fdSock == -1)
+        SOFT_ERROR(PI_INIT_FAILED, "socket failed (%m)");
+      else {
+        int opt = 1;
+        setsockopt(fdSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+      }
+      server.sin_family = AF_INET;
+      if(gpioCfg.ifFlags & PI_LOCALHOST_SOCK_IF) {
+        server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      } else {
+        server.sin_addr.s_addr = htonl(INADDR_ANY);
+      }
+      server.sin_port = htons(port);
 
-  bufferCycles = (SUPERCYCLE * servoCycles) / gpioCfg.clockMicros;
+      if(bind(fdSock, (struct sockaddr*)&server, sizeof(server)) < 0)
+        SOFT_ERROR(PI_INIT_FAILED, "bind to port %d failed (%m)", port);
+    }
 
-  superCycles = bufferCycles / SUPERCYCLE;
-  if(bufferCycles % SUPERCYCLE)
-    superCycles++;
+    if(pthread_create(&pthSocket, &pthAttr, pthSocketThread, &i))
+      SOFT_ERROR(PI_INIT_FAILED, "pthread_create socket failed (%m)");
 
-  bufferCycles = SUPERCYCLE * superCycles;
+    pthSocketRunning = PI_THREAD_STARTED;
+  }
 
-  bufferBlocks = bufferCycles / CYCLES_PER_BLOCK;
+  DBG(DBG_STARTUP, "threads took %d us", initLapMicros(&lap));
 
-  DBG(DBG_STARTUP, "bmillis=%d mics=%d bblk=%d bcyc=%d", gpioCfg.bufferMilliseconds, gpioCfg.clockMicros, bufferBlocks, bufferCycles);
+  return PIGPIO_VERSION;
+}
 
-  /* allocate memory for pointers to virtual and bus memory pages */
+/* ======================================================================= */
+
+int
+getBitInBytes(int bitPos, char* buf, int numBits) {
+  int bitp, bufp;
+
+  if(bitPos < numBits) {
+    bufp = bitPos / 8;
+    bitp = 7 - (bitPos % 8);
+    if(buf[bufp] & (1 << bitp))
+      return 1;
+  }
+
+  return 0;
+}
 
-  dmaVirt =
-      mmap(0, PAGES_PER_BLOCK * (bufferBlocks + PI_WAVE_BLOCKS) * sizeof(dmaPage_t*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_LOCKED, -1, 0);
+/* ----------------------------------------------------------------------- */
 
-  if(dmaVirt == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap dma virtual failed (%m)");
+void
+putBitInBytes(int bitPos, char* buf, int bit) {
+  int bitp, bufp;
 
-  dmaBus =
-      mmap(0, PAGES_PER_BLOCK * (bufferBlocks + PI_WAVE_BLOCKS) * sizeof(dmaPage_t*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_LOCKED, -1, 0);
+  bufp = bitPos / 8;
+  bitp = 7 - (bitPos % 8);
 
-  if(dmaBus == MAP_FAILED)
-    SOFT_ERROR(PI_INIT_FAILED, "mmap dma bus failed (%m)");
+  if(bit)
+    buf[bufp] |= (1 << bitp);
+  else
+    buf[bufp] &= (~(1 << bitp));
+}
 
-  dmaIVirt = (dmaIPage_t**)dmaVirt;
-  dmaIBus = (dmaIPage_t**)dmaBus;
+/* ----------------------------------------------------------------------- */
 
-  dmaOVirt = (dmaOPage_t**)(dmaVirt + (PAGES_PER_BLOCK * bufferBlocks));
-  dmaOBus = (dmaOPage_t**)(dmaBus + (PAGES_PER_BLOCK * bufferBlocks));
+uint32_t
+rawWaveGetOOL(int pos) {
+  int page, slot;
 
-  if((gpioCfg.memAllocMode == PI_MEM_ALLOC_PAGEMAP) ||
-     ((gpioCfg.memAllocMode == PI_MEM_ALLOC_AUTO) && (gpioCfg.bufferMilliseconds > PI_DEFAULT_BUFFER_MILLIS))) {
-    /* pagemap allocation of DMA memory */
+  if((pos >= 0) && (pos < NUM_WAVE_OOL)) {
+    waveOOLPageSlot(pos, &page, &slot);
+    return (dmaOVirt[page]->OOL[slot]);
+  }
 
-    dmaPMapBlk = mmap(0, (bufferBlocks + PI_WAVE_BLOCKS) * sizeof(dmaPage_t*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_LOCKED, -1, 0);
+  return -1;
+}
 
-    if(dmaPMapBlk == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "pagemap mmap block failed (%m)");
+/* ----------------------------------------------------------------------- */
 
-    fdPmap = open("/proc/self/pagemap", O_RDONLY);
+void
+rawWaveSetOOL(int pos, uint32_t value) {
+  int page, slot;
 
-    if(fdPmap < 0)
-      SOFT_ERROR(PI_INIT_FAILED, "pagemap open failed(%m)");
+  if((pos >= 0) && (pos < NUM_WAVE_OOL)) {
+    waveOOLPageSlot(pos, &page, &slot);
+    dmaOVirt[page]->OOL[slot] = value;
+  }
+}
 
-    for(i = 0; i < (bufferBlocks + PI_WAVE_BLOCKS); i++) {
-      status = initPagemapBlock(i);
-      if(status < 0) {
-        close(fdPmap);
-        return status;
-      }
-    }
+/* ----------------------------------------------------------------------- */
 
-    close(fdPmap);
+uint32_t
+rawWaveGetOut(int pos) {
+  int page, slot;
 
-    DBG(DBG_STARTUP, "dmaPMapBlk=%08" PRIXPTR " dmaIn=%08" PRIXPTR, (uintptr_t)dmaPMapBlk, (uintptr_t)dmaIn);
-  } else {
-    /* mailbox allocation of DMA memory */
+  if((pos >= 0) && (pos < NUM_WAVE_OOL)) {
+    waveOOLPageSlot(pos, &page, &slot);
+    return (dmaOVirt[page]->OOL[slot]);
+  }
 
-    dmaMboxBlk = mmap(0, (bufferBlocks + PI_WAVE_BLOCKS) * sizeof(DMAMem_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_LOCKED, -1, 0);
+  return -1;
+}
 
-    if(dmaMboxBlk == MAP_FAILED)
-      SOFT_ERROR(PI_INIT_FAILED, "mmap mbox block failed (%m)");
+/* ----------------------------------------------------------------------- */
 
-    fdMbox = mbOpen();
+void
+rawWaveSetOut(int pos, uint32_t value) {
+  int page, slot;
 
-    if(fdMbox < 0)
-      SOFT_ERROR(PI_INIT_FAILED, "mbox open failed(%m)");
+  if((pos >= 0) && (pos < NUM_WAVE_OOL)) {
+    waveOOLPageSlot(pos, &page, &slot);
+    dmaOVirt[page]->OOL[slot] = value;
+  }
+}
 
-    for(i = 0; i < (bufferBlocks + PI_WAVE_BLOCKS); i++) {
-      status = initMboxBlock(i);
-      if(status < 0) {
-        mbClose(fdMbox);
-        return status;
-      }
-    }
+/* ----------------------------------------------------------------------- */
 
-    mbClose(fdMbox);
+uint32_t
+rawWaveGetIn(int pos) {
+  int page, slot;
 
-    DBG(DBG_STARTUP, "dmaMboxBlk=%08" PRIXPTR " dmaIn=%08" PRIXPTR, (uintptr_t)dmaMboxBlk, (uintptr_t)dmaIn);
+  if((pos >= 0) && (pos < NUM_WAVE_OOL)) {
+    waveOOLPageSlot((NUM_WAVE_OOL - 1) - pos, &page, &slot);
+    return (dmaOVirt[page]->OOL[slot]);
   }
 
-  DBG(DBG_STARTUP,
-      "gpioReg=%08" PRIXPTR " pwmReg=%08" PRIXPTR " pcmReg=%08" PRIXPTR " clkReg=%08" PRIXPTR " auxReg=%08" PRIXPTR,
-      (uintptr_t)gpioReg,
-      (uintptr_t)pwmReg,
-      (uintptr_t)pcmReg,
-      (uintptr_t)clkReg,
-      (uintptr_t)auxReg);
+  return -1;
+}
 
-  for(i = 0; i < DMAI_PAGES; i++) DBG(DBG_STARTUP, "dmaIBus[%d]=%08" PRIXPTR, i, (uintptr_t)dmaIBus[i]);
+/* ----------------------------------------------------------------------- */
 
-  if(gpioCfg.dbgLevel >= DBG_DMACBS) {
-    fprintf(stderr, "*** INPUT DMA CONTROL BLOCKS ***\n");
-    for(i = 0; i < NUM_CBS; i++) dmaCbPrint(i);
-  }
+void
+rawWaveSetIn(int pos, uint32_t value) {
+  int page, slot;
 
-  return 0;
+  if((pos >= 0) && (pos < NUM_WAVE_OOL)) {
+    waveOOLPageSlot((NUM_WAVE_OOL - 1) - pos, &page, &slot);
+    dmaOVirt[page]->OOL[slot] = value;
+  }
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void
-initPWM(unsigned bits) {
-  DBG(DBG_STARTUP, "bits=%d", bits);
+rawWaveInfo_t
+rawWaveInfo(int wave_id) {
+  rawWaveInfo_t dummy = {0, 0, 0, 0, 0, 0, 0, 0};
 
-  /* reset PWM */
+  if((wave_id >= 0) && (wave_id < PI_MAX_WAVES))
+    return waveInfo[wave_id];
+  else
+    return dummy;
+}
 
-  pwmReg[PWM_CTL] = 0;
+/* ----------------------------------------------------------------------- */
 
-  myGpioDelay(10);
+double
+time_time(void) {
+  struct timeval tv;
+  double t;
 
-  pwmReg[PWM_STA] = -1;
+  gettimeofday(&tv, 0);
 
-  myGpioDelay(10);
+  t = (double)tv.tv_sec + ((double)tv.tv_usec / 1E6);
 
-  /* set number of bits to transmit */
+  return t;
+}
 
-  pwmReg[PWM_RNG1] = bits;
+/* ----------------------------------------------------------------------- */
 
-  myGpioDelay(10);
+void
+time_sleep(double seconds) {
+  struct timespec ts, rem;
 
-  dmaIVirt[0]->periphData = 1;
+  if(seconds > 0.0) {
+    ts.tv_sec = seconds;
+    ts.tv_nsec = (seconds - (double)ts.tv_sec) * 1E9;
 
-  /* enable PWM DMA, raise panic and dreq thresholds to 15 */
+    while(clock_nanosleep(CLOCK_REALTIME, 0, &ts, &rem)) {
+      /* copy remaining time to ts */
+      ts.tv_sec = rem.tv_sec;
+      ts.tv_nsec = rem.tv_nsec;
+    }
+  }
+}
 
-  pwmReg[PWM_DMAC] = PWM_DMAC_ENAB | PWM_DMAC_PANIC(15) | PWM_DMAC_DREQ(15);
+/* ----------------------------------------------------------------------- */
 
-  myGpioDelay(10);
+void
+rawDumpWave(void) {
+  int i;
 
-  /* clear PWM fifo */
+  unsigned numWaves, t;
 
-  pwmReg[PWM_CTL] = PWM_CTL_CLRF1;
+  rawWave_t* waves;
 
-  myGpioDelay(10);
+  waveTrackMerge();
 
-  /* enable PWM channel 1 and use fifo */
+  numWaves = wfc[wfcur];
+  waves = wf[wfcur];
 
-  pwmReg[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_MODE1 | PWM_CTL_PWEN1;
+  t = 0;
+
+  for(i = 0; i < numWaves; i++) {
+    fprintf(stderr, "%10u %08X %08X %08X %10u\n", t, waves[i].gpioOn, waves[i].gpioOff, waves[i].flags, waves[i].usDelay);
+    t += waves[i].usDelay;
+  }
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void
-initPCM(unsigned bits) {
-  DBG(DBG_STARTUP, "bits=%d", bits);
-
-  /* disable PCM so we can modify the regs */
+void
+rawDumpScript(unsigned script_id) {
+  int i;
 
-  pcmReg[PCM_CS] = 0;
+  if(script_id >= PI_MAX_SCRIPTS)
+    return;
 
-  myGpioDelay(1000);
+  if(gpioScript[script_id].state == PI_SCRIPT_IN_USE) {
 
-  pcmReg[PCM_FIFO] = 0;
-  pcmReg[PCM_MODE] = 0;
-  pcmReg[PCM_RXC] = 0;
-  pcmReg[PCM_TXC] = 0;
-  pcmReg[PCM_DREQ] = 0;
-  pcmReg[PCM_INTEN] = 0;
-  pcmReg[PCM_INTSTC] = 0;
-  pcmReg[PCM_GRAY] = 0;
+    for(i = 0; i < PI_MAX_SCRIPT_PARAMS; i++) { fprintf(stderr, "p%d=%d ", i, gpioScript[script_id].script.par[i]); }
 
-  myGpioDelay(1000);
+    fprintf(stderr, "\n");
 
-  pcmReg[PCM_MODE] = PCM_MODE_FLEN(bits - 1); /* # bits in frame */
+    for(i = 0; i < PI_MAX_SCRIPT_VARS; i++) { fprintf(stderr, "v%d=%d ", i, gpioScript[script_id].script.var[i]); }
 
-  /* enable channel 1 with # bits width */
+    fprintf(stderr, "\n");
 
-  pcmReg[PCM_TXC] = PCM_TXC_CH1EN | PCM_TXC_CH1WID(bits - 8);
+    for(i = 0; i < gpioScript[script_id].script.instrs; i++) {
+      fprintf(stderr,
+              "c%d=[%" PRIdPTR ", %" PRIdPTR "(%d), %" PRIdPTR "(%d), %" PRIdPTR ", %" PRIdPTR "]\n",
+              i,
+              gpioScript[script_id].script.instr[i].p[0],
+              gpioScript[script_id].script.instr[i].p[1],
+              gpioScript[script_id].script.instr[i].opt[1],
+              gpioScript[script_id].script.instr[i].p[2],
+              gpioScript[script_id].script.instr[i].opt[2],
+              gpioScript[script_id].script.instr[i].p[3],
+              gpioScript[script_id].script.instr[i].p[4]);
+    }
+  }
+}
 
-  pcmReg[PCM_CS] |= PCM_CS_STBY; /* clear standby */
+/* ======================================================================= */
 
-  myGpioDelay(1000);
+int
+gpioInitialise(void) {
+  int status;
 
-  pcmReg[PCM_CS] |= PCM_CS_TXCLR; /* clear TX FIFO */
+  if(libInitialised)
+    return PIGPIO_VERSION;
 
-  pcmReg[PCM_CS] |= PCM_CS_DMAEN; /* enable DREQ */
+  DBG(DBG_STARTUP, "not initialised, initialising");
 
-  pcmReg[PCM_DREQ] = PCM_DREQ_TX_PANIC(16) | PCM_DREQ_TX_REQ_L(30);
+  runState = PI_STARTING;
 
-  pcmReg[PCM_INTSTC] = 0b1111; /* clear status bits */
+  status = initInitialise();
 
-  /* enable PCM */
+  if(status < 0) {
+    runState = PI_ENDING;
+    initReleaseResources();
+  } else {
+    libInitialised = 1;
 
-  pcmReg[PCM_CS] |= PCM_CS_EN;
+    runState = PI_RUNNING;
 
-  /* enable tx */
+    scrImageLoadAll();
 
-  pcmReg[PCM_CS] |= PCM_CS_TXON;
+    if((dmaLive > 0) && !(gpioCfg.ifFlags & PI_DISABLE_ALERT)) {
+      while(pthAlertRunning != PI_THREAD_RUNNING) myGpioDelay(1000);
+    }
+  }
 
-  dmaIVirt[0]->periphData = 0x0F;
+  return status;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void
-initHWClk(int clkCtl, int clkDiv, int clkSrc, int divI, int divF, int MASH) {
-  DBG(DBG_INTERNAL, "ctl=%d div=%d src=%d /I=%d /f=%d M=%d", clkCtl, clkDiv, clkSrc, divI, divF, MASH);
-
-  /* kill the clock if busy, anything else isn't reliable */
+void
+gpioTerminate(void) {
+  int i;
 
-  if(clkReg[clkCtl] & CLK_CTL_BUSY) {
-    do { clkReg[clkCtl] = BCM_PASSWD | CLK_CTL_KILL; } while(clkReg[clkCtl] & CLK_CTL_BUSY);
-  }
+  DBG(DBG_USER, "");
 
-  clkReg[clkDiv] = (BCM_PASSWD | CLK_DIV_DIVI(divI) | CLK_DIV_DIVF(divF));
+  if(!libInitialised)
+    return;
 
-  usleep(10);
+  DBG(DBG_STARTUP, "initialised, terminating");
 
-  clkReg[clkCtl] = (BCM_PASSWD | CLK_CTL_MASH(MASH) | CLK_CTL_SRC(clkSrc));
+  runState = PI_ENDING;
 
-  usleep(10);
+  gpioMaskSet = 0;
 
-  clkReg[clkCtl] |= (BCM_PASSWD | CLK_CTL_ENAB);
-}
+  /* reset DMA */
 
-static void
-initClock(int mainClock) {
-  const unsigned BITS = 10;
-  int clockPWM;
-  unsigned clkCtl, clkDiv, clkSrc, clkDivI, clkDivF, clkMash, clkBits;
-  char* per;
-  unsigned micros;
+  if((dmaReg != MAP_FAILED) && (dmaLive > 0)) {
+    initKillDMA(dmaIn);
+    initKillDMA(dmaOut);
+  }
 
-  DBG(DBG_STARTUP, "mainClock=%d", mainClock);
+#ifndef EMBEDDED_IN_VM
+  if((gpioCfg.internals & PI_CFG_STATS) && (!(gpioCfg.internals & PI_CFG_NOSIGHANDLER))) {
+    fprintf(stderr, "\n#####################################################\n");
+    fprintf(stderr, "pigpio version=%d internals=%X\n", PIGPIO_VERSION, gpioCfg.internals);
 
-  if(mainClock)
-    micros = gpioCfg.clockMicros;
-  else
-    micros = PI_WF_MICROS;
+    fprintf(stderr,
+            "micros=%d allocMode=%d dmaInitCbs=%d DMARestarts=%d\n",
+            gpioCfg.clockMicros,
+            gpioCfg.memAllocMode,
+            gpioStats.dmaInitCbsCount,
+            gpioStats.DMARestarts);
 
-  clockPWM = mainClock ^ (gpioCfg.clockPeriph == PI_CLOCK_PCM);
+    fprintf(stderr, "samples %u maxSamples %u maxEmit %u emitFrags %u\n", gpioStats.numSamples, gpioStats.maxSamples, gpioStats.maxEmit, gpioStats.emitFrags);
 
-  if(clockPWM) {
-    clkCtl = CLK_PWMCTL;
-    clkDiv = CLK_PWMDIV;
-    per = "PWM";
-  } else {
-    clkCtl = CLK_PCMCTL;
-    clkDiv = CLK_PCMDIV;
-    per = "PCM";
-  }
+    fprintf(stderr, "cbTicks %d, cbCalls %u\n", gpioStats.cbTicks, gpioStats.cbCalls);
 
-  clkSrc = CLK_CTL_SRC_PLLD;
-  clkDivI = clk_plld_freq / (10000000 / micros); /* 10 MHz - 1 MHz */
-  clkBits = BITS;                                /* 10/BITS MHz - 1/BITS MHz */
-  clkDivF = 0;
-  clkMash = 0;
+    fprintf(stderr, "pipe: good %u, short %u, would block %u\n", gpioStats.goodPipeWrite, gpioStats.shortPipeWrite, gpioStats.wouldBlockPipeWrite);
 
-  DBG(DBG_STARTUP, "%s PLLD divi=%d divf=%d mash=%d bits=%d", per, clkDivI, clkDivF, clkMash, clkBits);
+    fprintf(stderr, "alertTicks %u, lateTicks %u, moreToDo %u\n", gpioStats.alertTicks, gpioStats.lateTicks, gpioStats.moreToDo);
 
-  initHWClk(clkCtl, clkDiv, clkSrc, clkDivI, clkDivF, clkMash);
+    for(i = 0; i < TICKSLOTS; i++) fprintf(stderr, "%9u ", gpioStats.diffTick[i]);
 
-  if(clockPWM)
-    initPWM(BITS);
-  else
-    initPCM(BITS);
+    fprintf(stderr, "\n#####################################################\n\n\n");
+  }
 
-  myGpioDelay(2000);
-}
+#endif
+  initReleaseResources();
 
-static void
-initKillDMA(volatile uint32_t* dmaAddr) {
-  dmaAddr[DMA_CS] = DMA_CHANNEL_ABORT;
-  dmaAddr[DMA_CS] = 0;
-  dmaAddr[DMA_CS] = DMA_CHANNEL_RESET;
+  fflush(NULL);
 
-  dmaAddr[DMA_CONBLK_AD] = 0;
+  libInitialised = 0;
 }
 
-/* ----------------------------------------------------------------------- */
-
 static void
-initDMAgo(volatile uint32_t* dmaAddr, uint32_t cbAddr) {
-  DBG(DBG_STARTUP, "");
+switchFunctionOff(unsigned gpio) {
+  switch(gpioInfo[gpio].is) {
+    case GPIO_SERVO:
+      /* switch servo off */
+      myGpioSetServo(gpio, gpioInfo[gpio].width, 0);
+      gpioInfo[gpio].width = 0;
+      break;
 
-  initKillDMA(dmaAddr);
+    case GPIO_PWM:
+      /* switch pwm off */
+      myGpioSetPwm(gpio, gpioInfo[gpio].width, 0);
+      gpioInfo[gpio].width = 0;
+      break;
 
-  dmaAddr[DMA_CS] = DMA_INTERRUPT_STATUS | DMA_END_FLAG;
+    case GPIO_HW_CLK:
+      /* No longer disable clock hardware, doing that was a bug. */
+      gpioInfo[gpio].width = 0;
+      break;
 
-  dmaAddr[DMA_CONBLK_AD] = cbAddr;
+    case GPIO_HW_PWM:
+      /* No longer disable PWM hardware, doing that was a bug. */
+      gpioInfo[gpio].width = 0;
+      break;
+  }
+}
 
-  /* clear READ/FIFO/READ_LAST_NOT_SET error bits */
+static void
+stopHardwarePWM(void) {
+  unsigned i, pwm;
 
-  dmaAddr[DMA_DEBUG] = DMA_DEBUG_READ_ERR | DMA_DEBUG_FIFO_ERR | DMA_DEBUG_RD_LST_NOT_SET_ERR;
+  for(i = 0; i <= PI_MAX_GPIO; i++) {
+    if(gpioInfo[i].is == GPIO_HW_PWM) {
+      pwm = (PWMDef[i] >> 4) & 3;
 
-  dmaAddr[DMA_CS] = DMA_WAIT_ON_WRITES | DMA_PANIC_PRIORITY(8) | DMA_PRIORITY(8) | DMA_ACTIVE;
+      if(pwm == 0)
+        pwmReg[PWM_CTL] &= (~PWM_CTL_PWEN1);
+      else
+        pwmReg[PWM_CTL] &= (~PWM_CTL_PWEN2);
+
+      gpioInfo[i].width = 0;
+      gpioInfo[i].is = GPIO_UNDEFINED;
+    }
+  }
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void
-initClearGlobals(void) {
-  int i;
-
-  DBG(DBG_STARTUP, "");
+int
+gpioSetMode(unsigned gpio, unsigned mode) {
+  int reg, shift, old_mode;
 
-  alertBits = 0;
-  monitorBits = 0;
-  notifyBits = 0;
-  scriptBits = 0;
-  gFilterBits = 0;
-  nFilterBits = 0;
-  wdogBits = 0;
+  DBG(DBG_USER, "gpio=%d mode=%d", gpio, mode);
 
-  pthAlertRunning = PI_THREAD_NONE;
-  pthFifoRunning = PI_THREAD_NONE;
-  pthSocketRunning = PI_THREAD_NONE;
+  CHECK_INITED;
 
-  wfc[0] = 0;
-  wfc[1] = 0;
-  wfc[2] = 0;
+  if(gpio > PI_MAX_GPIO)
+    SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-  wfcur = 0;
+  if(mode > PI_ALT3)
+    SOFT_ERROR(PI_BAD_MODE, "gpio %d, bad mode (%d)", gpio, mode);
 
-  wfStats.micros = 0;
-  wfStats.highMicros = 0;
-  wfStats.maxMicros = PI_WAVE_MAX_MICROS;
+  reg = gpio / 10;
+  shift = (gpio % 10) * 3;
 
-  wfStats.pulses = 0;
-  wfStats.highPulses = 0;
-  wfStats.maxPulses = PI_WAVE_MAX_PULSES;
+  old_mode = (gpioReg[reg] >> shift) & 7;
 
-  wfStats.cbs = 0;
-  wfStats.highCbs = 0;
-  wfStats.maxCbs = (PI_WAVE_BLOCKS * PAGES_PER_BLOCK * CBS_PER_OPAGE);
+  if(mode != old_mode) {
+    pthread_mutex_lock(&slotMutex);
 
-  gpioGetSamples.func = NULL;
-  gpioGetSamples.ex = 0;
-  gpioGetSamples.userdata = NULL;
-  gpioGetSamples.bits = 0;
+    switchFunctionOff(gpio);
 
-  for(i = 0; i <= PI_MAX_USER_GPIO; i++) {
-    wfRx[i].mode = PI_WFRX_NONE;
-    pthread_mutex_init(&wfRx[i].mutex, NULL);
-    gpioAlert[i].func = NULL;
-  }
+    gpioInfo[gpio].is = GPIO_UNDEFINED;
 
-  for(i = 0; i <= PI_MAX_GPIO; i++) {
-    gpioInfo[i].is = GPIO_UNDEFINED;
-    gpioInfo[i].width = 0;
-    gpioInfo[i].range = PI_DEFAULT_DUTYCYCLE_RANGE;
-    gpioInfo[i].freqIdx = DEFAULT_PWM_IDX;
+    pthread_mutex_unlock(&slotMutex);
   }
 
-  for(i = 0; i < PI_NOTIFY_SLOTS; i++) {
-    gpioNotify[i].seqno = 0;
-    gpioNotify[i].state = PI_NOTIFY_CLOSED;
-  }
+  if(gpioCfg.bbDmaBytes)
+    pthread_mutex_lock(&fselMutex);
 
-  for(i = 0; i <= PI_MAX_SIGNUM; i++) {
-    gpioSignal[i].func = NULL;
-    gpioSignal[i].ex = 0;
-    gpioSignal[i].userdata = NULL;
-  }
+  gpioReg[reg] = (gpioReg[reg] & ~(7 << shift)) | (mode << shift);
 
-  for(i = 0; i <= PI_MAX_TIMER; i++) {
-    gpioTimer[i].running = 0;
-    gpioTimer[i].func = NULL;
-  }
+  if(gpioCfg.bbDmaBytes)
+    pthread_mutex_unlock(&fselMutex);
 
-  for(i = 0; i <= PI_MAX_EVENT; i++) {
-    eventAlert[i].func = NULL;
-    eventAlert[i].ignore = 0;
-    eventAlert[i].fired = 0;
-  }
+  return 0;
+}
 
-  /* calculate the usable PWM frequencies */
+/* ----------------------------------------------------------------------- */
 
-  for(i = 0; i < PWM_FREQS; i++) {
-    pwmFreq[i] = (1000000.0 / ((float)PULSE_PER_CYCLE * gpioCfg.clockMicros * pwmCycles[i])) + 0.5;
+int
+gpioGetMode(unsigned gpio) {
+  int reg, shift;
 
-    DBG(DBG_STARTUP, "f%d is %d", i, pwmFreq[i]);
-  }
+  DBG(DBG_USER, "gpio=%d", gpio);
 
-  inpFifo = NULL;
-  outFifo = NULL;
+  CHECK_INITED;
 
-  fdLock = -1;
-  fdMem = -1;
-  fdSock = -1;
+  if(gpio > PI_MAX_GPIO)
+    SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-  dmaMboxBlk = MAP_FAILED;
-  dmaPMapBlk = MAP_FAILED;
-  dmaVirt = MAP_FAILED;
-  dmaBus = MAP_FAILED;
+  reg = gpio / 10;
+  shift = (gpio % 10) * 3;
 
-  auxReg = MAP_FAILED;
-  clkReg = MAP_FAILED;
-  dmaReg = MAP_FAILED;
-  gpioReg = MAP_FAILED;
-  pcmReg = MAP_FAILED;
-  pwmReg = MAP_FAILED;
-  systReg = MAP_FAILED;
-  spiReg = MAP_FAILED;
+  return (gpioReg[reg] >> shift) & 7;
 }
 
 /* ----------------------------------------------------------------------- */
 
-static void
-initReleaseResources(void) {
-  int i;
+int
+gpioSetPullUpDown(unsigned gpio, unsigned pud) {
+  int shift = (gpio & 0xf) << 1;
+  uint32_t bits;
+  uint32_t pull;
+
+  DBG(DBG_USER, "gpio=%d pud=%d", gpio, pud);
 
-  DBG(DBG_STARTUP, "");
+  CHECK_INITED;
 
-  /* shut down running threads */
+  if(gpio > PI_MAX_GPIO)
+    SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-  for(i = 0; i <= PI_MAX_GPIO; i++) {
-    if(gpioISR[i].pth) {
-      /* destroy thread, unexport GPIO */
+  if(pud > PI_PUD_UP)
+    SOFT_ERROR(PI_BAD_PUD, "gpio %d, bad pud (%d)", gpio, pud);
 
-      gpioSetISRFunc(i, 0, 0, NULL);
+  if(pi_is_2711) {
+    switch(pud) {
+      case PI_PUD_OFF: pull = 0; break;
+      case PI_PUD_UP: pull = 1; break;
+      case PI_PUD_DOWN: pull = 2; break;
     }
-  }
 
-  for(i = 0; i <= PI_MAX_TIMER; i++) {
-    if(gpioTimer[i].running) {
-      /* destroy thread */
+    bits = *(gpioReg + GPPUPPDN0 + (gpio >> 4));
+    bits &= ~(3 << shift);
+    bits |= (pull << shift);
+    *(gpioReg + GPPUPPDN0 + (gpio >> 4)) = bits;
+  } else {
+    *(gpioReg + GPPUD) = pud;
 
-      pthread_cancel(gpioTimer[i].pthId);
-      pthread_join(gpioTimer[i].pthId, NULL);
-      gpioTimer[i].running = 0;
-    }
-  }
+    myGpioDelay(1);
 
-  if(pthAlertRunning != PI_THREAD_NONE) {
-    pthread_cancel(pthAlert);
-    pthread_join(pthAlert, NULL);
-    pthAlertRunning = PI_THREAD_NONE;
-  }
+    *(gpioReg + GPPUDCLK0 + BANK) = BIT;
 
-  if(pthFifoRunning != PI_THREAD_NONE) {
-    pthread_cancel(pthFifo);
-    pthread_join(pthFifo, NULL);
-    pthFifoRunning = PI_THREAD_NONE;
-  }
+    myGpioDelay(1);
 
-  if(pthSocketRunning != PI_THREAD_NONE) {
-    pthread_cancel(pthSocket);
-    pthread_join(pthSocket, NULL);
-    pthSocketRunning = PI_THREAD_NONE;
+    *(gpioReg + GPPUD) = 0;
+
+    *(gpioReg + GPPUDCLK0 + BANK) = 0;
   }
 
-  /* release mmap'd memory */
+  return 0;
+}
 
-  if(auxReg != MAP_FAILED)
-    munmap((void*)auxReg, AUX_LEN);
-  if(bscsReg != MAP_FAILED)
-    munmap((void*)bscsReg, BSCS_LEN);
-  if(clkReg != MAP_FAILED)
-    munmap((void*)clkReg, CLK_LEN);
-  if(dmaReg != MAP_FAILED)
-    munmap((void*)dmaReg, DMA_LEN);
-  if(gpioReg != MAP_FAILED)
-    munmap((void*)gpioReg, GPIO_LEN);
-  if(pcmReg != MAP_FAILED)
-    munmap((void*)pcmReg, PCM_LEN);
-  if(pwmReg != MAP_FAILED)
-    munmap((void*)pwmReg, PWM_LEN);
-  if(systReg != MAP_FAILED)
-    munmap((void*)systReg, SYST_LEN);
-  if(spiReg != MAP_FAILED)
-    munmap((void*)spiReg, SPI_LEN);
+/* ----------------------------------------------------------------------- */
 
-  auxReg = MAP_FAILED;
-  bscsReg = MAP_FAILED;
-  clkReg = MAP_FAILED;
-  dmaReg = MAP_FAILED;
-  gpioReg = MAP_FAILED;
-  pcmReg = MAP_FAILED;
-  pwmReg = MAP_FAILED;
-  systReg = MAP_FAILED;
-  spiReg = MAP_FAILED;
+int
+gpioRead(unsigned gpio) {
+  DBG(DBG_USER, "gpio=%d", gpio);
 
-  if(dmaBus != MAP_FAILED) {
-    munmap(dmaBus, PAGES_PER_BLOCK * (bufferBlocks + PI_WAVE_BLOCKS) * sizeof(dmaPage_t*));
-  }
+  CHECK_INITED;
 
-  dmaBus = MAP_FAILED;
+  if(gpio > PI_MAX_GPIO)
+    SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-  if(dmaVirt != MAP_FAILED) {
-    for(i = 0; i < PAGES_PER_BLOCK * (bufferBlocks + PI_WAVE_BLOCKS); i++) { munmap(dmaVirt[i], PAGE_SIZE); }
+  if((*(gpioReg + GPLEV0 + BANK) & BIT) != 0)
+    return PI_ON;
+  else
+    return PI_OFF;
+}
 
-    munmap(dmaVirt, PAGES_PER_BLOCK * (bufferBlocks + PI_WAVE_BLOCKS) * sizeof(dmaPage_t*));
-  }
+/* ----------------------------------------------------------------------- */
 
-  dmaVirt = MAP_FAILED;
+int
+gpioWrite(unsigned gpio, unsigned level) {
+  DBG(DBG_USER, "gpio=%d level=%d", gpio, level);
 
-  if(dmaPMapBlk != MAP_FAILED) {
-    for(i = 0; i < (bufferBlocks + PI_WAVE_BLOCKS); i++) { munmap(dmaPMapBlk[i], PAGES_PER_BLOCK * PAGE_SIZE); }
+  CHECK_INITED;
 
-    munmap(dmaPMapBlk, (bufferBlocks + PI_WAVE_BLOCKS) * sizeof(dmaPage_t*));
-  }
+  if(gpio > PI_MAX_GPIO)
+    SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
 
-  dmaPMapBlk = MAP_FAILED;
+  if(level > PI_ON)
+    SOFT_ERROR(PI_BAD_LEVEL, "gpio %d, bad level (%d)", gpio, level);
 
-  if(dmaMboxBlk != MAP_FAILED) {
-    fdMbox = mbOpen();
+  if(gpio <= PI_MAX_GPIO) {
+    if(gpioInfo[gpio].is != GPIO_WRITE) {
+      /* stop a glitch between setting mode then level */
+      if(level == PI_OFF)
+        *(gpioReg + GPCLR0 + BANK) = BIT;
+      else
+        *(gpioReg + GPSET0 + BANK) = BIT;
 
-    for(i = 0; i < (bufferBlocks + PI_WAVE_BLOCKS); i++) { mbDMAFree(&dmaMboxBlk[bufferBlocks + PI_WAVE_BLOCKS - i - 1]); }
+      pthread_mutex_lock(&slotMutex);
 
-    mbClose(fdMbox);
+      switchFunctionOff(gpio);
+
+      gpioInfo[gpio].is = GPIO_WRITE;
 
-    munmap(dmaMboxBlk, (bufferBlocks + PI_WAVE_BLOCKS) * sizeof(DMAMem_t));
+      pthread_mutex_unlock(&slotMutex);
+    }
   }
 
-  dmaMboxBlk = MAP_FAILED;
+  myGpioSetMode(gpio, PI_OUTPUT);
 
-  if(inpFifo != NULL) {
-    fclose(inpFifo);
-    unlink(PI_INPFIFO);
-    inpFifo = NULL;
-  }
+  if(level == PI_OFF)
+    *(gpioReg + GPCLR0 + BANK) = BIT;
+  else
+    *(gpioReg + GPSET0 + BANK) = BIT;
 
-  if(outFifo != NULL) {
-    fclose(outFifo);
-    unlink(PI_OUTFIFO);
-    outFifo = NULL;
-  }
+  return 0;
+}
 
-  if(fdMem != -1) {
-    close(fdMem);
-    fdMem = -1;
-  }
+/* ----------------------------------------------------------------------- */
 
-  if(fdLock != -1) {
-    close(fdLock);
-    unlink(PI_LOCKFILE);
-    fdLock = -1;
-  }
+int
+gpioPWM(unsigned gpio, unsigned val) {
+  DBG(DBG_USER, "gpio=%d dutycycle=%d", gpio, val);
 
-  if(fdSock != -1) {
-    close(fdSock);
-    fdSock = -1;
-  }
+  CHECK_INITED;
 
-  if(fdPmap != -1) {
-    close(fdPmap);
-    fdPmap = -1;
-  }
+  CHECK_DMA;
 
-  if(fdMbox != -1) {
-    close(fdMbox);
-    fdMbox = -1;
-  }
+  if(gpio > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-  gpioStats.DMARestarts = 0;
-  gpioStats.dmaInitCbsCount = 0;
+  if(val > gpioInfo[gpio].range)
+    SOFT_ERROR(PI_BAD_DUTYCYCLE, "gpio %d, bad dutycycle (%d)", gpio, val);
 
-  numSockNetAddr = 0;
-}
+  pthread_mutex_lock(&slotMutex);
 
-int
-initInitialise(void) {
-  int i;
-  unsigned rev, model;
-  struct sockaddr_in server;
-  struct sockaddr_in6 server6;
-  char* portStr;
-  unsigned port;
-  struct sched_param param;
-  pthread_attr_t pthAttr;
+  if(gpioInfo[gpio].is != GPIO_PWM) {
+    switchFunctionOff(gpio);
 
-  DBG(DBG_STARTUP, "");
+    gpioInfo[gpio].is = GPIO_PWM;
 
-  waveClockInited = 0;
-  PWMClockInited = 0;
+    if(!val)
+      myGpioWrite(gpio, 0);
+  }
 
-  clock_gettime(CLOCK_REALTIME, &libStarted);
+  myGpioSetMode(gpio, PI_OUTPUT);
 
-  rev = gpioHardwareRevision();
+  myGpioSetPwm(gpio, gpioInfo[gpio].width, val);
 
-  initClearGlobals();
+  gpioInfo[gpio].width = val;
 
-  if(initCheckPermitted() < 0)
-    return PI_INIT_FAILED;
+  pthread_mutex_unlock(&slotMutex);
 
-  fdLock = initGrabLockFile();
+  return 0;
+}
 
-  if(fdLock < 0)
-    SOFT_ERROR(PI_INIT_FAILED, "Can't lock %s", PI_LOCKFILE);
+/* ----------------------------------------------------------------------- */
 
-  if(!gpioMaskSet) {
-    if(rev == 0)
-      gpioMask = PI_DEFAULT_UPDATE_MASK_UNKNOWN;
-    else if(rev < 4)
-      gpioMask = PI_DEFAULT_UPDATE_MASK_B1;
-    else if(rev < 16)
-      gpioMask = PI_DEFAULT_UPDATE_MASK_A_B2;
-    else if(rev == 17)
-      gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
-    else if(rev < 20)
-      gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
-    else if(rev == 20)
-      gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
-    else if(rev == 21)
-      gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
-    else {
-      model = (rev >> 4) & 0xFF;
+static int
+myBatchSet(unsigned numPairs, gpioPair_t* pairs, int is) {
+  int i, gpio;
+  uint32_t bits;
+  unsigned val[PI_MAX_USER_GPIO + 1];
 
-      /* model
-      0=A 1=B
-      2=A+ 3=B+
-      4=Pi2B
-      5=Alpha
-      6=Compute Module
-      7=Unknown
-      8=Pi3B
-      9=Zero
-      12=Zero W
-      13=Pi3B+
-      14=Pi3A+
-      17=Pi4B
-      */
-      if(model < 2)
-        gpioMask = PI_DEFAULT_UPDATE_MASK_A_B2;
-      else if(model < 4)
-        gpioMask = PI_DEFAULT_UPDATE_MASK_APLUS_BPLUS;
-      else if(model == 4)
-        gpioMask = PI_DEFAULT_UPDATE_MASK_PI2B;
+  if(numPairs && !pairs)
+    SOFT_ERROR(PI_BAD_POINTER, "NULL pairs");
 
-      else if(model == 6 || model == 10 || model == 16)
-        gpioMask = PI_DEFAULT_UPDATE_MASK_COMPUTE;
+  /* check every pair before anything changes, the last pair wins */
 
-      else if(model == 8 || model == 13 || model == 14)
-        gpioMask = PI_DEFAULT_UPDATE_MASK_PI3B;
+  bits = 0;
+
+  for(i = 0; i < numPairs; i++) {
+    gpio = pairs[i].gpio;
+
+    if(pairs[i].gpio > PI_MAX_USER_GPIO)
+      SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", pairs[i].gpio);
 
-      else if(model == 9 || model == 12)
-        gpioMask = PI_DEFAULT_UPDATE_MASK_ZERO;
+    if(is == GPIO_PWM) {
+      if(pairs[i].value > gpioInfo[gpio].range)
+        SOFT_ERROR(PI_BAD_DUTYCYCLE, "gpio %d, bad dutycycle (%d)", gpio, pairs[i].value);
+    } else {
+      if((pairs[i].value != PI_SERVO_OFF) && (pairs[i].value < PI_MIN_SERVO_PULSEWIDTH))
+        SOFT_ERROR(PI_BAD_PULSEWIDTH, "gpio %d, bad pulsewidth (%d)", gpio, pairs[i].value);
 
-      else if(model == 17)
-        gpioMask = PI_DEFAULT_UPDATE_MASK_PI4B;
-      else
-        gpioMask = PI_DEFAULT_UPDATE_MASK_UNKNOWN;
+      if(pairs[i].value > PI_MAX_SERVO_PULSEWIDTH)
+        SOFT_ERROR(PI_BAD_PULSEWIDTH, "gpio %d, bad pulsewidth (%d)", gpio, pairs[i].value);
     }
 
-    gpioMaskSet = 1;
+    val[gpio] = pairs[i].value;
+    bits |= (1 << gpio);
   }
 
-#ifndef EMBEDDED_IN_VM
-  if(!(gpioCfg.internals & PI_CFG_NOSIGHANDLER))
-    sigSetHandler();
-#endif
+  /* no other slot change may start until the batch is applied */
 
-  if(initPeripherals() < 0)
-    return PI_INIT_FAILED;
+  pthread_mutex_lock(&slotMutex);
 
-  if(initAllocDMAMem() < 0)
-    return PI_INIT_FAILED;
+  /* changes of function are made at once, as by gpioPWM/gpioServo */
 
-  /* done with /dev/mem */
+  for(gpio = 0; gpio <= PI_MAX_USER_GPIO; gpio++) {
+    if(!(bits & (1 << gpio)))
+      continue;
 
-  if(fdMem != -1) {
-    close(fdMem);
-    fdMem = -1;
-  }
+    if(gpioInfo[gpio].is != is) {
+      switchFunctionOff(gpio);
 
-  param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+      gpioInfo[gpio].is = is;
 
-  if(gpioCfg.internals & PI_CFG_RT_PRIORITY)
-    sched_setscheduler(0, SCHED_FIFO, &param);
+      if(!val[gpio])
+        myGpioWrite(gpio, 0);
+    }
 
-  initClock(1); /* initialise main clock */
+    myGpioSetMode(gpio, PI_OUTPUT);
+  }
 
-  atexit(gpioTerminate);
+  /* the slot changes of all the gpios are made in one pass */
 
-  if(pthread_attr_init(&pthAttr))
-    SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_init failed (%m)");
+  slotBatch = &slotBatchBuf;
 
-  if(pthread_attr_setstacksize(&pthAttr, STACK_SIZE))
-    SOFT_ERROR(PI_INIT_FAILED, "pthread_attr_setstacksize failed (%m)");
+  for(gpio = 0; gpio <= PI_MAX_USER_GPIO; gpio++) {
+    if(!(bits & (1 << gpio)))
+      continue;
 
-  if(!(gpioCfg.ifFlags & PI_DISABLE_ALERT)) {
-    if(pthread_create(&pthAlert, &pthAttr, pthAlertThread, &i))
-      SOFT_ERROR(PI_INIT_FAILED, "pthread_create alert failed (%m)");
+    if(is == GPIO_PWM)
+      myGpioSetPwm(gpio, gpioInfo[gpio].width, val[gpio]);
+    else
+      myGpioSetServo(gpio, gpioInfo[gpio].width, val[gpio]);
 
-    pthAlertRunning = PI_THREAD_STARTED;
+    gpioInfo[gpio].width = val[gpio];
   }
 
-  if(!(gpioCfg.ifFlags & PI_DISABLE_FIFO_IF)) {
-    if(pthread_create(&pthFifo, &pthAttr, pthFifoThread, &i))
-      SOFT_ERROR(PI_INIT_FAILED, "pthread_create fifo failed (%m)");
+  myBatchApply();
 
-    pthFifoRunning = PI_THREAD_STARTED;
-  }
+  pthread_mutex_unlock(&slotMutex);
 
-  if(!(gpioCfg.ifFlags & PI_DISABLE_SOCK_IF)) {
-    portStr = getenv(PI_ENVPORT);
-    if(portStr)
-      port = atoi(portStr);
-    else
-      port = gpioCfg.socketPort;
+  return 0;
+}
 
-    // Accept connections on IPv6, unless we have an IPv4-only whitelist
-    if(!numSockNetAddr) {
-      fdSock = socket(AF_INET6, SOCK_STREAM, 0);
+/* ----------------------------------------------------------------------- */
 
-      if(fdSock != -1) {
-        bzero((char*)&server6, sizeof(server6));
-        server6.sin6_family = AF_INET6;
-        if(gpioCfg.ifFlags & PI_LOCALHOST_SOCK_IF) {
-          server6.sin6_addr = in6addr_loopback;
-        } else {
-          server6.sin6_addr = in6addr_any;
-        }
-        server6.sin6_port = htons(port);
+int
+gpioPWMBatch(unsigned numPairs, gpioPair_t* pairs) {
+  DBG(DBG_USER, "numPairs=%d pairs=%08" PRIXPTR, numPairs, (uintptr_t)pairs);
 
-        int opt = 1;
-        setsockopt(fdSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        if(bind(fdSock, (struct sockaddr*)&server6, sizeof(server6)) < 0)
-          SOFT_ERROR(PI_INIT_FAILED, "bind to port %d failed (%m)", port);
-      }
-    }
+  CHECK_INITED;
 
-    if(numSockNetAddr || fdSock == -1) {
-      fdSock = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK_DMA;
 
-      if(fdSock == -1)
-        SOFT_ERROR(PI_INIT_FAILED, "socket failed (%m)");
-      else {
-        int opt = 1;
-        setsockopt(fdSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-      }
-      server.sin_family = AF_INET;
-      if(gpioCfg.ifFlags & PI_LOCALHOST_SOCK_IF) {
-        server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-      } else {
-        server.sin_addr.s_addr = htonl(INADDR_ANY);
-      }
-      server.sin_port = htons(port);
+  return myBatchSet(numPairs, pairs, GPIO_PWM);
+}
 
-      if(bind(fdSock, (struct sockaddr*)&server, sizeof(server)) < 0)
-        SOFT_ERROR(PI_INIT_FAILED, "bind to port %d failed (%m)", port);
-    }
+/* ----------------------------------------------------------------------- */
 
-    if(pthread_create(&pthSocket, &pthAttr, pthSocketThread, &i))
-      SOFT_ERROR(PI_INIT_FAILED, "pthread_create socket failed (%m)");
+int
+gpioGetPWMdutycycle(unsigned gpio) {
+  unsigned pwm;
 
-    pthSocketRunning = PI_THREAD_STARTED;
-  }
+  DBG(DBG_USER, "gpio=%d", gpio);
 
-  myGpioDelay(1000);
+  CHECK_INITED;
 
-  dmaInitCbs();
+  if(gpio > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-  flushMemory();
+  switch(gpioInfo[gpio].is) {
+    case GPIO_PWM: return gpioInfo[gpio].width;
 
-  // cast twice to suppress compiler warning, I belive this cast
-  // is ok because dmaIBus contains bus addresses, not virtual
-  // addresses.
-  initDMAgo((uint32_t*)dmaIn, (uint32_t)(uintptr_t)dmaIBus[0]);
+    case GPIO_HW_PWM: pwm = (PWMDef[gpio] >> 4) & 3; return hw_pwm_duty[pwm];
 
-  return PIGPIO_VERSION;
+    case GPIO_HW_CLK: return PI_HW_PWM_RANGE / 2;
+
+    default: SOFT_ERROR(PI_NOT_PWM_GPIO, "not a PWM gpio (%d)", gpio);
+  }
 }
 
-/* ======================================================================= */
+/* ----------------------------------------------------------------------- */
 
 int
-getBitInBytes(int bitPos, char* buf, int numBits) {
-  int bitp, bufp;
-
-  if(bitPos < numBits) {
-    bufp = bitPos / 8;
-    bitp = 7 - (bitPos % 8);
-    if(buf[bufp] & (1 << bitp))
-      return 1;
-  }
+gpioSetPWMrange(unsigned gpio, unsigned range) {
+  int oldWidth, newWidth;
 
-  return 0;
-}
+  DBG(DBG_USER, "gpio=%d range=%d", gpio, range);
 
-/* ----------------------------------------------------------------------- */
+  CHECK_INITED;
 
-void
-putBitInBytes(int bitPos, char* buf, int bit) {
-  int bitp, bufp;
+  if(gpio > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-  bufp = bitPos / 8;
-  bitp = 7 - (bitPos % 8);
+  if((range < PI_MIN_DUTYCYCLE_RANGE) || (range > PI_MAX_DUTYCYCLE_RANGE))
+    SOFT_ERROR(PI_BAD_DUTYRANGE, "gpio %d, bad range (%d)", gpio, range);
 
-  if(bit)
-    buf[bufp] |= (1 << bitp);
-  else
-    buf[bufp] &= (~(1 << bitp));
-}
+  pthread_mutex_lock(&slotMutex);
 
-/* ----------------------------------------------------------------------- */
+  oldWidth = gpioInfo[gpio].width;
 
-uint32_t
-rawWaveGetOOL(int pos) {
-  int page, slot;
+  if(oldWidth) {
+    if(gpioInfo[gpio].is == GPIO_PWM) {
+      newWidth = (range * oldWidth) / gpioInfo[gpio].range;
 
-  if((pos >= 0) && (pos < NUM_WAVE_OOL)) {
-    waveOOLPageSlot(pos, &page, &slot);
-    return (dmaOVirt[page]->OOL[slot]);
+      myGpioSetPwm(gpio, oldWidth, 0);
+      gpioInfo[gpio].range = range;
+      gpioInfo[gpio].width = newWidth;
+      myGpioSetPwm(gpio, 0, newWidth);
+    }
   }
 
-  return -1;
+  gpioInfo[gpio].range = range;
+
+  pthread_mutex_unlock(&slotMutex);
+
+  /* return the actual range for the current gpio frequency */
+
+  return pwmRealRange[gpioInfo[gpio].freqIdx];
 }
 
 /* ----------------------------------------------------------------------- */
 
-void
-rawWaveSetOOL(int pos, uint32_t value) {
-  int page, slot;
+int
+gpioGetPWMrange(unsigned gpio) {
+  DBG(DBG_USER, "gpio=%d", gpio);
 
-  if((pos >= 0) && (pos < NUM_WAVE_OOL)) {
-    waveOOLPageSlot(pos, &page, &slot);
-    dmaOVirt[page]->OOL[slot] = value;
+  CHECK_INITED;
+
+  if(gpio > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+  switch(gpioInfo[gpio].is) {
+    case GPIO_HW_PWM:
+    case GPIO_HW_CLK: return PI_HW_PWM_RANGE;
+
+    default: return gpioInfo[gpio].range;
   }
 }
 
 /* ----------------------------------------------------------------------- */
 
-uint32_t
-rawWaveGetOut(int pos) {
-  int page, slot;
+int
+gpioGetPWMrealRange(unsigned gpio) {
+  unsigned pwm;
 
-  if((pos >= 0) && (pos < NUM_WAVE_OOL)) {
-    waveOOLPageSlot(pos, &page, &slot);
-    return (dmaOVirt[page]->OOL[slot]);
-  }
+  DBG(DBG_USER, "gpio=%d", gpio);
 
-  return -1;
-}
+  CHECK_INITED;
 
-/* ----------------------------------------------------------------------- */
+  if(gpio > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-void
-rawWaveSetOut(int pos, uint32_t value) {
-  int page, slot;
+  switch(gpioInfo[gpio].is) {
+    case GPIO_HW_PWM: pwm = (PWMDef[gpio] >> 4) & 3; return hw_pwm_real_range[pwm];
 
-  if((pos >= 0) && (pos < NUM_WAVE_OOL)) {
-    waveOOLPageSlot(pos, &page, &slot);
-    dmaOVirt[page]->OOL[slot] = value;
+    case GPIO_HW_CLK: return PI_HW_PWM_RANGE;
+
+    default: return pwmRealRange[gpioInfo[gpio].freqIdx];
   }
 }
 
 /* ----------------------------------------------------------------------- */
 
-uint32_t
-rawWaveGetIn(int pos) {
-  int page, slot;
+int
+gpioSetPWMfrequency(unsigned gpio, unsigned frequency) {
+  int i, width;
+  unsigned diff, best, idx;
 
-  if((pos >= 0) && (pos < NUM_WAVE_OOL)) {
-    waveOOLPageSlot((NUM_WAVE_OOL - 1) - pos, &page, &slot);
-    return (dmaOVirt[page]->OOL[slot]);
-  }
+  DBG(DBG_USER, "gpio=%d frequency=%d", gpio, frequency);
 
-  return -1;
-}
+  CHECK_INITED;
+
+  if(gpio > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+  if(frequency > pwmFreq[0])
+    idx = 0;
+  else if(frequency < pwmFreq[PWM_FREQS - 1])
+    idx = PWM_FREQS - 1;
+  else {
+    best = 100000; /* impossibly high frequency difference */
+    idx = 0;
+
+    for(i = 0; i < PWM_FREQS; i++) {
+      if(frequency > pwmFreq[i])
+        diff = frequency - pwmFreq[i];
+      else
+        diff = pwmFreq[i] - frequency;
+
+      if(diff < best) {
+        best = diff;
+        idx = i;
+      }
+    }
+  }
 
-/* ----------------------------------------------------------------------- */
+  pthread_mutex_lock(&slotMutex);
 
-void
-rawWaveSetIn(int pos, uint32_t value) {
-  int page, slot;
+  width = gpioInfo[gpio].width;
 
-  if((pos >= 0) && (pos < NUM_WAVE_OOL)) {
-    waveOOLPageSlot((NUM_WAVE_OOL - 1) - pos, &page, &slot);
-    dmaOVirt[page]->OOL[slot] = value;
+  if(width) {
+    if(gpioInfo[gpio].is == GPIO_PWM) {
+      myGpioSetPwm(gpio, width, 0);
+      gpioInfo[gpio].freqIdx = idx;
+      myGpioSetPwm(gpio, 0, width);
+    }
   }
-}
 
-/* ----------------------------------------------------------------------- */
+  gpioInfo[gpio].freqIdx = idx;
 
-rawWaveInfo_t
-rawWaveInfo(int wave_id) {
-  rawWaveInfo_t dummy = {0, 0, 0, 0, 0, 0, 0, 0};
+  pthread_mutex_unlock(&slotMutex);
 
-  if((wave_id >= 0) && (wave_id < PI_MAX_WAVES))
-    return waveInfo[wave_id];
-  else
-    return dummy;
+  return pwmFreq[idx];
 }
 
 /* ----------------------------------------------------------------------- */
 
-double
-time_time(void) {
-  struct timeval tv;
-  double t;
-
-  gettimeofday(&tv, 0);
+int
+gpioGetPWMfrequency(unsigned gpio) {
+  unsigned pwm, clock;
 
-  t = (double)tv.tv_sec + ((double)tv.tv_usec / 1E6);
+  DBG(DBG_USER, "gpio=%d", gpio);
 
-  return t;
-}
+  CHECK_INITED;
 
-/* ----------------------------------------------------------------------- */
+  if(gpio > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-void
-time_sleep(double seconds) {
-  struct timespec ts, rem;
+  switch(gpioInfo[gpio].is) {
+    case GPIO_HW_PWM: pwm = (PWMDef[gpio] >> 4) & 3; return hw_pwm_freq[pwm];
 
-  if(seconds > 0.0) {
-    ts.tv_sec = seconds;
-    ts.tv_nsec = (seconds - (double)ts.tv_sec) * 1E9;
+    case GPIO_HW_CLK: clock = (clkDef[gpio] >> 4) & 3; return hw_clk_freq[clock];
 
-    while(clock_nanosleep(CLOCK_REALTIME, 0, &ts, &rem)) {
-      /* copy remaining time to ts */
-      ts.tv_sec = rem.tv_sec;
-      ts.tv_nsec = rem.tv_nsec;
-    }
+    default: return pwmFreq[gpioInfo[gpio].freqIdx];
   }
 }
 
 /* ----------------------------------------------------------------------- */
 
-void
-rawDumpWave(void) {
-  int i;
+int
+gpioServo(unsigned gpio, unsigned val) {
+  DBG(DBG_USER, "gpio=%d pulsewidth=%d", gpio, val);
 
-  unsigned numWaves, t;
+  CHECK_INITED;
 
-  rawWave_t* waves;
+  CHECK_DMA;
 
-  numWaves = wfc[wfcur];
-  waves = wf[wfcur];
+  if(gpio > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-  t = 0;
+  if((val != PI_SERVO_OFF) && (val < PI_MIN_SERVO_PULSEWIDTH))
+    SOFT_ERROR(PI_BAD_PULSEWIDTH, "gpio %d, bad pulsewidth (%d)", gpio, val);
 
-  for(i = 0; i < numWaves; i++) {
-    fprintf(stderr, "%10u %08X %08X %08X %10u\n", t, waves[i].gpioOn, waves[i].gpioOff, waves[i].flags, waves[i].usDelay);
-    t += waves[i].usDelay;
-  }
-}
+  if(val > PI_MAX_SERVO_PULSEWIDTH)
+    SOFT_ERROR(PI_BAD_PULSEWIDTH, "gpio %d, bad pulsewidth (%d)", gpio, val);
 
-/* ----------------------------------------------------------------------- */
+  pthread_mutex_lock(&slotMutex);
 
-void
-rawDumpScript(unsigned script_id) {
-  int i;
+  if(gpioInfo[gpio].is != GPIO_SERVO) {
+    switchFunctionOff(gpio);
 
-  if(script_id >= PI_MAX_SCRIPTS)
-    return;
+    gpioInfo[gpio].is = GPIO_SERVO;
 
-  if(gpioScript[script_id].state == PI_SCRIPT_IN_USE) {
+    if(!val)
+      myGpioWrite(gpio, 0);
+  }
 
-    for(i = 0; i < PI_MAX_SCRIPT_PARAMS; i++) { fprintf(stderr, "p%d=%d ", i, gpioScript[script_id].script.par[i]); }
+  myGpioSetMode(gpio, PI_OUTPUT);
 
-    fprintf(stderr, "\n");
+  myGpioSetServo(gpio, gpioInfo[gpio].width, val);
 
-    for(i = 0; i < PI_MAX_SCRIPT_VARS; i++) { fprintf(stderr, "v%d=%d ", i, gpioScript[script_id].script.var[i]); }
+  gpioInfo[gpio].width = val;
 
-    fprintf(stderr, "\n");
+  pthread_mutex_unlock(&slotMutex);
 
-    for(i = 0; i < gpioScript[script_id].script.instrs; i++) {
-      fprintf(stderr,
-              "c%d=[%" PRIdPTR ", %" PRIdPTR "(%d), %" PRIdPTR "(%d), %" PRIdPTR ", %" PRIdPTR "]\n",
-              i,
-              gpioScript[script_id].script.instr[i].p[0],
-              gpioScript[script_id].script.instr[i].p[1],
-              gpioScript[script_id].script.instr[i].opt[1],
-              gpioScript[script_id].script.instr[i].p[2],
-              gpioScript[script_id].script.instr[i].opt[2],
-              gpioScript[script_id].script.instr[i].p[3],
-              gpioScript[script_id].script.instr[i].p[4]);
-    }
-  }
+  return 0;
 }
 
-/* ======================================================================= */
+/* ----------------------------------------------------------------------- */
 
 int
-gpioInitialise(void) {
-  int status;
+gpioServoBatch(unsigned numPairs, gpioPair_t* pairs) {
+  DBG(DBG_USER, "numPairs=%d pairs=%08" PRIXPTR, numPairs, (uintptr_t)pairs);
 
-  if(libInitialised)
-    return PIGPIO_VERSION;
+  CHECK_INITED;
 
-  DBG(DBG_STARTUP, "not initialised, initialising");
+  CHECK_DMA;
 
-  runState = PI_STARTING;
+  return myBatchSet(numPairs, pairs, GPIO_SERVO);
+}
 
-  status = initInitialise();
+/* ----------------------------------------------------------------------- */
 
-  if(status < 0) {
-    runState = PI_ENDING;
-    initReleaseResources();
-  } else {
-    libInitialised = 1;
+int
+gpioGetServoPulsewidth(unsigned gpio) {
+  DBG(DBG_USER, "gpio=%d", gpio);
 
-    runState = PI_RUNNING;
+  CHECK_INITED;
 
-    if(!(gpioCfg.ifFlags & PI_DISABLE_ALERT)) {
-      while(pthAlertRunning != PI_THREAD_RUNNING) myGpioDelay(1000);
-    }
-  }
+  if(gpio > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-  return status;
+  if(gpioInfo[gpio].is != GPIO_SERVO)
+    SOFT_ERROR(PI_NOT_SERVO_GPIO, "not a servo gpio (%d)", gpio);
+
+  return gpioInfo[gpio].width;
 }
 
 /* ----------------------------------------------------------------------- */
 
-void
-gpioTerminate(void) {
+int
+gpioWaveClear(void) {
   int i;
 
   DBG(DBG_USER, "");
 
-  if(!libInitialised)
-    return;
+  CHECK_INITED;
 
-  DBG(DBG_STARTUP, "initialised, terminating");
+  waveRelease(); /* free the staging buffers */
 
-  runState = PI_ENDING;
+  wfStats.micros = 0;
+  wfStats.pulses = 0;
+  wfStats.cbs = 0;
+  wfStats.rawCbs = 0;
 
-  gpioMaskSet = 0;
+  /*
+  pending async creates are cancelled and finished ones whose wave
+  is about to go fail, the compile in progress is let finish first
+  */
 
-  /* reset DMA */
+  pthread_mutex_lock(&waveJobMutex);
 
-  if(dmaReg != MAP_FAILED) {
-    initKillDMA(dmaIn);
-    initKillDMA(dmaOut);
+  for(i = 0; i < PI_WAVE_MAX_TICKETS; i++) {
+    while(waveJob[i].state == WAVE_JOB_RUNNING) pthread_cond_wait(&waveJobDone, &waveJobMutex);
   }
 
-#ifndef EMBEDDED_IN_VM
-  if((gpioCfg.internals & PI_CFG_STATS) && (!(gpioCfg.internals & PI_CFG_NOSIGHANDLER))) {
-    fprintf(stderr, "\n#####################################################\n");
-    fprintf(stderr, "pigpio version=%d internals=%X\n", PIGPIO_VERSION, gpioCfg.internals);
+  for(i = 0; i < PI_WAVE_MAX_TICKETS; i++) {
+    if(waveJob[i].state == WAVE_JOB_QUEUED) {
+      free(waveJob[i].pulses);
+      waveJob[i].pulses = NULL;
+      waveJob[i].state = WAVE_JOB_DONE;
+      waveJob[i].result = PI_BAD_WAVE_ID;
+    } else if((waveJob[i].state == WAVE_JOB_DONE) && (waveJob[i].result >= 0))
+      waveJob[i].result = PI_BAD_WAVE_ID;
+  }
 
-    fprintf(stderr,
-            "micros=%d allocMode=%d dmaInitCbs=%d DMARestarts=%d\n",
-            gpioCfg.clockMicros,
-            gpioCfg.memAllocMode,
-            gpioStats.dmaInitCbsCount,
-            gpioStats.DMARestarts);
+  pthread_cond_broadcast(&waveJobDone);
 
-    fprintf(stderr, "samples %u maxSamples %u maxEmit %u emitFrags %u\n", gpioStats.numSamples, gpioStats.maxSamples, gpioStats.maxEmit, gpioStats.emitFrags);
+  pthread_mutex_lock(&waveMutex);
 
-    fprintf(stderr, "cbTicks %d, cbCalls %u\n", gpioStats.cbTicks, gpioStats.cbCalls);
+  waveSpanReset();
 
-    fprintf(stderr, "pipe: good %u, short %u, would block %u\n", gpioStats.goodPipeWrite, gpioStats.shortPipeWrite, gpioStats.wouldBlockPipeWrite);
+  for(i = 0; i < PI_MAX_WAVES; i++) waveCacheDrop(i);
 
-    fprintf(stderr, "alertTicks %u, lateTicks %u, moreToDo %u\n", gpioStats.alertTicks, gpioStats.lateTicks, gpioStats.moreToDo);
+  waveStreamQueued = 0; /* the segments have gone with the waves */
 
-    for(i = 0; i < TICKSLOTS; i++) fprintf(stderr, "%9u ", gpioStats.diffTick[i]);
+  waveOutCount = 0;
 
-    fprintf(stderr, "\n#####################################################\n\n\n");
-  }
+  waveEndPtr = NULL;
 
-#endif
-  initReleaseResources();
+  pthread_mutex_unlock(&waveMutex);
 
-  fflush(NULL);
+  pthread_mutex_unlock(&waveJobMutex);
 
-  libInitialised = 0;
+  return 0;
 }
 
-static void
-switchFunctionOff(unsigned gpio) {
-  switch(gpioInfo[gpio].is) {
-    case GPIO_SERVO:
-      /* switch servo off */
-      myGpioSetServo(gpio, gpioInfo[gpio].width, 0);
-      gpioInfo[gpio].width = 0;
-      break;
+/* ----------------------------------------------------------------------- */
 
-    case GPIO_PWM:
-      /* switch pwm off */
-      myGpioSetPwm(gpio, gpioInfo[gpio].width, 0);
-      gpioInfo[gpio].width = 0;
-      break;
+int
+gpioWaveAddNew(void) {
+  DBG(DBG_USER, "");
 
-    case GPIO_HW_CLK:
-      /* No longer disable clock hardware, doing that was a bug. */
-      gpioInfo[gpio].width = 0;
-      break;
+  CHECK_INITED;
 
-    case GPIO_HW_PWM:
-      /* No longer disable PWM hardware, doing that was a bug. */
-      gpioInfo[gpio].width = 0;
-      break;
-  }
+  wfc[0] = 0;
+  wfc[1] = 0;
+  wfc[2] = 0;
+
+  wfcur = 0;
+
+  waveTrackReset();
+
+  wfStats.micros = 0;
+  wfStats.pulses = 0;
+  wfStats.cbs = 0;
+  wfStats.rawCbs = 0;
+
+  return 0;
 }
 
-static void
-stopHardwarePWM(void) {
-  unsigned i, pwm;
+/* ----------------------------------------------------------------------- */
 
-  for(i = 0; i <= PI_MAX_GPIO; i++) {
-    if(gpioInfo[i].is == GPIO_HW_PWM) {
-      pwm = (PWMDef[i] >> 4) & 3;
+int
+gpioWaveAddGeneric(unsigned numPulses, gpioPulse_t* pulses) {
+  int p;
 
-      if(pwm == 0)
-        pwmReg[PWM_CTL] &= (~PWM_CTL_PWEN1);
-      else
-        pwmReg[PWM_CTL] &= (~PWM_CTL_PWEN2);
+  DBG(DBG_USER, "numPulses=%u pulses=%08" PRIXPTR, numPulses, (uintptr_t)pulses);
 
-      gpioInfo[i].width = 0;
-      gpioInfo[i].is = GPIO_UNDEFINED;
-    }
+  CHECK_INITED;
+
+  if(numPulses > PI_WAVE_MAX_PULSES)
+    SOFT_ERROR(PI_TOO_MANY_PULSES, "bad number of pulses (%d)", numPulses);
+
+  if(!pulses)
+    SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) pulses pointer");
+
+  p = waveReserve(&wf[2], &wfSize[2], numPulses);
+
+  if(p < 0)
+    return p;
+
+  for(p = 0; p < numPulses; p++) {
+    wf[2][p].gpioOff = pulses[p].gpioOff;
+    wf[2][p].gpioOn = pulses[p].gpioOn;
+    wf[2][p].usDelay = pulses[p].usDelay;
+    wf[2][p].flags = 0;
   }
+
+  return rawWaveAddGeneric(numPulses, wf[2]);
 }
 
 /* ----------------------------------------------------------------------- */
 
 int
-gpioSetMode(unsigned gpio, unsigned mode) {
-  int reg, shift, old_mode;
+gpioWaveAddSerial(unsigned gpio, unsigned baud, unsigned data_bits, unsigned stop_bits, unsigned offset, unsigned numBytes, char* bstr) {
+  int i, b, p, lev, c, v;
 
-  DBG(DBG_USER, "gpio=%d mode=%d", gpio, mode);
+  uint16_t* wstr = (uint16_t*)bstr;
+  uint32_t* lstr = (uint32_t*)bstr;
+
+  unsigned bitDelay[32];
+
+  DBG(DBG_USER,
+      "gpio=%d baud=%d bits=%d stops=%d offset=%d numBytes=%d str=[%s]",
+      gpio,
+      baud,
+      data_bits,
+      stop_bits,
+      offset,
+      numBytes,
+      myBuf2Str(numBytes, (char*)bstr));
 
   CHECK_INITED;
 
-  if(gpio > PI_MAX_GPIO)
-    SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+  if(gpio > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-  if(mode > PI_ALT3)
-    SOFT_ERROR(PI_BAD_MODE, "gpio %d, bad mode (%d)", gpio, mode);
+  if((baud < PI_WAVE_MIN_BAUD) || (baud > PI_WAVE_MAX_BAUD))
+    SOFT_ERROR(PI_BAD_WAVE_BAUD, "bad baud rate (%d)", baud);
 
-  reg = gpio / 10;
-  shift = (gpio % 10) * 3;
+  if((data_bits < PI_MIN_WAVE_DATABITS) || (data_bits > PI_MAX_WAVE_DATABITS))
+    SOFT_ERROR(PI_BAD_DATABITS, "bad number of databits (%d)", data_bits);
 
-  old_mode = (gpioReg[reg] >> shift) & 7;
+  if((stop_bits < PI_MIN_WAVE_HALFSTOPBITS) || (stop_bits > PI_MAX_WAVE_HALFSTOPBITS))
+    SOFT_ERROR(PI_BAD_STOPBITS, "bad number of (half) stop bits (%d)", stop_bits);
 
-  if(mode != old_mode) {
-    switchFunctionOff(gpio);
+  if(gpio > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
-    gpioInfo[gpio].is = GPIO_UNDEFINED;
-  }
+  if(numBytes > PI_WAVE_MAX_CHARS)
+    SOFT_ERROR(PI_TOO_MANY_CHARS, "too many chars (%d)", numBytes);
 
-  gpioReg[reg] = (gpioReg[reg] & ~(7 << shift)) | (mode << shift);
+  if(offset > PI_WAVE_MAX_MICROS)
+    SOFT_ERROR(PI_BAD_SER_OFFSET, "offset too large (%d)", offset);
 
-  return 0;
-}
+  if(data_bits > 8)
+    numBytes /= 2;
+  if(data_bits > 16)
+    numBytes /= 2;
 
-/* ----------------------------------------------------------------------- */
+  if(!numBytes)
+    return 0;
 
-int
-gpioGetMode(unsigned gpio) {
-  int reg, shift;
+  waveBitDelay(baud, data_bits, stop_bits, bitDelay);
 
-  DBG(DBG_USER, "gpio=%d", gpio);
+  /* at most a start, data_bits level changes and a stop per char */
 
-  CHECK_INITED;
+  p = waveReserve(&wf[2], &wfSize[2], (numBytes * (data_bits + 2)) + 2);
 
-  if(gpio > PI_MAX_GPIO)
-    SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+  if(p < 0)
+    return p;
 
-  reg = gpio / 10;
-  shift = (gpio % 10) * 3;
+  p = 0;
 
-  return (gpioReg[reg] >> shift) & 7;
-}
+  wf[2][p].gpioOn = (1 << gpio);
+  wf[2][p].gpioOff = 0;
+  wf[2][p].flags = 0;
 
-/* ----------------------------------------------------------------------- */
+  if(offset > bitDelay[0])
+    wf[2][p].usDelay = offset;
+  else
+    wf[2][p].usDelay = bitDelay[0];
 
-int
-gpioSetPullUpDown(unsigned gpio, unsigned pud) {
-  int shift = (gpio & 0xf) << 1;
-  uint32_t bits;
-  uint32_t pull;
+  for(i = 0; i < numBytes; i++) {
+    p++;
 
-  DBG(DBG_USER, "gpio=%d pud=%d", gpio, pud);
+    /* start bit */
 
-  CHECK_INITED;
+    wf[2][p].gpioOn = 0;
+    wf[2][p].gpioOff = (1 << gpio);
+    wf[2][p].usDelay = bitDelay[0];
+    wf[2][p].flags = 0;
 
-  if(gpio > PI_MAX_GPIO)
-    SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+    lev = 0;
 
-  if(pud > PI_PUD_UP)
-    SOFT_ERROR(PI_BAD_PUD, "gpio %d, bad pud (%d)", gpio, pud);
+    if(data_bits < 9)
+      c = bstr[i];
+    else if(data_bits < 17)
+      c = wstr[i];
+    else
+      c = lstr[i];
 
-  if(pi_is_2711) {
-    switch(pud) {
-      case PI_PUD_OFF: pull = 0; break;
-      case PI_PUD_UP: pull = 1; break;
-      case PI_PUD_DOWN: pull = 2; break;
-    }
+    for(b = 0; b < data_bits; b++) {
+      if(c & (1 << b))
+        v = 1;
+      else
+        v = 0;
 
-    bits = *(gpioReg + GPPUPPDN0 + (gpio >> 4));
-    bits &= ~(3 << shift);
-    bits |= (pull << shift);
-    *(gpioReg + GPPUPPDN0 + (gpio >> 4)) = bits;
-  } else {
-    *(gpioReg + GPPUD) = pud;
+      if(v == lev)
+        wf[2][p].usDelay += bitDelay[b + 1];
+      else {
+        p++;
 
-    myGpioDelay(1);
+        lev = v;
 
-    *(gpioReg + GPPUDCLK0 + BANK) = BIT;
+        if(lev) {
+          wf[2][p].gpioOn = (1 << gpio);
+          wf[2][p].gpioOff = 0;
+          wf[2][p].flags = 0;
+        } else {
+          wf[2][p].gpioOn = 0;
+          wf[2][p].gpioOff = (1 << gpio);
+          wf[2][p].flags = 0;
+        }
 
-    myGpioDelay(1);
+        wf[2][p].usDelay = bitDelay[b + 1];
+      }
+    }
 
-    *(gpioReg + GPPUD) = 0;
+    /* stop bit */
 
-    *(gpioReg + GPPUDCLK0 + BANK) = 0;
+    if(lev)
+      wf[2][p].usDelay += bitDelay[data_bits + 1];
+    else {
+      p++;
+
+      wf[2][p].gpioOn = (1 << gpio);
+      wf[2][p].gpioOff = 0;
+      wf[2][p].usDelay = bitDelay[data_bits + 1];
+      wf[2][p].flags = 0;
+    }
   }
 
-  return 0;
+  p++;
+
+  wf[2][p].gpioOn = (1 << gpio);
+  wf[2][p].gpioOff = 0;
+  wf[2][p].usDelay = bitDelay[0];
+  wf[2][p].flags = 0;
+
+  return rawWaveAddGeneric(p, wf[2]);
 }
 
 /* ----------------------------------------------------------------------- */
 
 int
-gpioRead(unsigned gpio) {
-  DBG(DBG_USER, "gpio=%d", gpio);
+rawWaveAddSPI(rawSPI_t* spi, unsigned offset, unsigned spiSS, char* buf, unsigned spiTxBits, unsigned spiBitFirst, unsigned spiBitLast, unsigned spiBits) {
+  int p, bit, dbv, halfbit;
+  int rising_edge[2], read_cycle[2];
+  uint32_t on_bits, off_bits;
+  int tx_bit_pos;
+
+  DBG(DBG_USER,
+      "spi=%08" PRIXPTR " off=%d spiSS=%d tx=%08" PRIXPTR ", num=%d fb=%d lb=%d spiBits=%d",
+      (uintptr_t)spi,
+      offset,
+      spiSS,
+      (uintptr_t)buf,
+      spiTxBits,
+      spiBitFirst,
+      spiBitLast,
+      spiBits);
 
   CHECK_INITED;
 
-  if(gpio > PI_MAX_GPIO)
-    SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+  if(spiSS > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", spiSS);
 
-  if((*(gpioReg + GPLEV0 + BANK) & BIT) != 0)
-    return PI_ON;
-  else
-    return PI_OFF;
-}
+  /*
+  CPOL CPHA
+   0    0   read rising/write falling
+   0    1   read falling/write rising
+   1    0   read falling/write rising
+   1    1   read rising/write falling
+  */
 
-/* ----------------------------------------------------------------------- */
+  if(spi->clk_pol) {
+    rising_edge[0] = 0;
+    rising_edge[1] = 1;
+  } else {
+    rising_edge[0] = 1;
+    rising_edge[1] = 0;
+  }
 
-int
-gpioWrite(unsigned gpio, unsigned level) {
-  DBG(DBG_USER, "gpio=%d level=%d", gpio, level);
+  if(spi->clk_pha) {
+    read_cycle[0] = 0;
+    read_cycle[1] = 1;
+  } else {
+    read_cycle[0] = 1;
+    read_cycle[1] = 0;
+  }
 
-  CHECK_INITED;
+  p = waveReserve(&wf[2], &wfSize[2], (2 * spiBits) + 3);
 
-  if(gpio > PI_MAX_GPIO)
-    SOFT_ERROR(PI_BAD_GPIO, "bad gpio (%d)", gpio);
+  if(p < 0)
+    return p;
 
-  if(level > PI_ON)
-    SOFT_ERROR(PI_BAD_LEVEL, "gpio %d, bad level (%d)", gpio, level);
+  p = 0;
 
-  if(gpio <= PI_MAX_GPIO) {
-    if(gpioInfo[gpio].is != GPIO_WRITE) {
-      /* stop a glitch between setting mode then level */
-      if(level == PI_OFF)
-        *(gpioReg + GPCLR0 + BANK) = BIT;
-      else
-        *(gpioReg + GPSET0 + BANK) = BIT;
+  if(offset) {
+    wf[2][p].gpioOn = 0;
+    wf[2][p].gpioOff = 0;
+    wf[2][p].flags = 0;
+    wf[2][p].usDelay = offset;
+    p++;
+  }
 
-      switchFunctionOff(gpio);
+  on_bits = 0;
+  off_bits = 0;
 
-      gpioInfo[gpio].is = GPIO_WRITE;
-    }
+  tx_bit_pos = 0;
+
+  /* preset initial mosi bit */
+
+  if(getBitInBytes(tx_bit_pos, buf, spiTxBits)) {
+    on_bits |= (1 << (spi->mosi));
+    dbv = 1;
+  } else {
+    off_bits |= (1 << (spi->mosi));
+    dbv = 0;
   }
 
-  myGpioSetMode(gpio, PI_OUTPUT);
+  if(!spi->clk_pha)
+    tx_bit_pos++;
+
+  if(spi->ss_pol)
+    off_bits |= (1 << spiSS);
+  else
+    on_bits |= (1 << spiSS);
 
-  if(level == PI_OFF)
-    *(gpioReg + GPCLR0 + BANK) = BIT;
+  if(spi->clk_pol)
+    on_bits |= (1 << (spi->clk));
   else
-    *(gpioReg + GPSET0 + BANK) = BIT;
+    off_bits |= (1 << (spi->clk));
 
-  return 0;
-}
+  wf[2][p].gpioOn = on_bits;
+  wf[2][p].gpioOff = off_bits;
+  wf[2][p].flags = 0;
 
-/* ----------------------------------------------------------------------- */
+  if(spi->clk_us > spi->ss_us)
+    wf[2][p].usDelay = spi->clk_us;
+  else
+    wf[2][p].usDelay = spi->ss_us;
 
-int
-gpioPWM(unsigned gpio, unsigned val) {
-  DBG(DBG_USER, "gpio=%d dutycycle=%d", gpio, val);
+  p++;
 
-  CHECK_INITED;
+  for(bit = 1; bit <= spiBits; bit++) {
+    for(halfbit = 0; halfbit < 2; halfbit++) {
+      wf[2][p].usDelay = spi->clk_us;
+      wf[2][p].flags = 0;
 
-  if(gpio > PI_MAX_USER_GPIO)
-    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+      on_bits = 0;
+      off_bits = 0;
 
-  if(val > gpioInfo[gpio].range)
-    SOFT_ERROR(PI_BAD_DUTYCYCLE, "gpio %d, bad dutycycle (%d)", gpio, val);
+      if(read_cycle[halfbit]) {
+        if((bit >= spiBitFirst) && (bit <= spiBitLast))
+          wf[2][p].flags = WAVE_FLAG_READ;
+      } else {
+        if(getBitInBytes(tx_bit_pos, buf, spiTxBits)) {
+          if(!dbv)
+            on_bits |= (1 << (spi->mosi));
+          dbv = 1;
+        } else {
+          if(dbv)
+            off_bits |= (1 << (spi->mosi));
+          dbv = 0;
+        }
 
-  if(gpioInfo[gpio].is != GPIO_PWM) {
-    switchFunctionOff(gpio);
+        ++tx_bit_pos;
+      }
 
-    gpioInfo[gpio].is = GPIO_PWM;
+      if(rising_edge[halfbit])
+        on_bits |= (1 << (spi->clk));
+      else
+        off_bits |= (1 << (spi->clk));
 
-    if(!val)
-      myGpioWrite(gpio, 0);
+      wf[2][p].gpioOn = on_bits;
+      wf[2][p].gpioOff = off_bits;
+
+      p++;
+    }
   }
 
-  myGpioSetMode(gpio, PI_OUTPUT);
+  on_bits = 0;
+  off_bits = 0;
 
-  myGpioSetPwm(gpio, gpioInfo[gpio].width, val);
+  if(spi->ss_pol)
+    on_bits |= (1 << spiSS);
+  else
+    off_bits |= (1 << spiSS);
 
-  gpioInfo[gpio].width = val;
+  wf[2][p].gpioOn = on_bits;
+  wf[2][p].gpioOff = off_bits;
+  wf[2][p].flags = 0;
+  wf[2][p].usDelay = 0;
 
-  return 0;
+  p++;
+
+  return rawWaveAddGeneric(p, wf[2]);
 }
 
 /* ----------------------------------------------------------------------- */
 
-int
-gpioGetPWMdutycycle(unsigned gpio) {
-  unsigned pwm;
-
-  DBG(DBG_USER, "gpio=%d", gpio);
-
-  CHECK_INITED;
+static int
+waveCompile(rawWave_t* waves, unsigned numWaves, int share) {
+  int wid;
+  int numCB, numBOOL, numTOOL;
+  int CB, BOOL, TOOL;
+  uint32_t hash;
 
-  if(gpio > PI_MAX_USER_GPIO)
-    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+  pthread_mutex_lock(&waveMutex);
 
-  switch(gpioInfo[gpio].is) {
-    case GPIO_PWM: return gpioInfo[gpio].width;
+  hash = 0;
 
-    case GPIO_HW_PWM: pwm = (PWMDef[gpio] >> 4) & 3; return hw_pwm_duty[pwm];
+  if(share) {
+    /* Is an identical wave already resident? */
 
-    case GPIO_HW_CLK: return PI_HW_PWM_RANGE / 2;
+    hash = waveCacheHash(waves, numWaves);
 
-    default: SOFT_ERROR(PI_NOT_PWM_GPIO, "not a PWM gpio (%d)", gpio);
-  }
-}
+    wid = waveCacheFind(hash, waves, numWaves);
 
-/* ----------------------------------------------------------------------- */
+    if(wid >= 0) {
+      waveCache[wid].refs++;
 
-int
-gpioSetPWMrange(unsigned gpio, unsigned range) {
-  int oldWidth, newWidth;
+      DBG(DBG_USER, "Wave cache: wid=%d refs %d", wid, waveCache[wid].refs);
 
-  DBG(DBG_USER, "gpio=%d range=%d", gpio, range);
+      pthread_mutex_unlock(&waveMutex);
 
-  CHECK_INITED;
+      return wid;
+    }
+  }
 
-  if(gpio > PI_MAX_USER_GPIO)
-    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+  /* What resources are needed? */
 
-  if((range < PI_MIN_DUTYCYCLE_RANGE) || (range > PI_MAX_DUTYCYCLE_RANGE))
-    SOFT_ERROR(PI_BAD_DUTYRANGE, "gpio %d, bad range (%d)", gpio, range);
+  waveCBsOOLs(waves, numWaves, &numCB, &numBOOL, &numTOOL);
 
-  oldWidth = gpioInfo[gpio].width;
+  /* Best fit from the free CB and OOL ranges. */
 
-  if(oldWidth) {
-    if(gpioInfo[gpio].is == GPIO_PWM) {
-      newWidth = (range * oldWidth) / gpioInfo[gpio].range;
+  wid = waveAllocate(numCB, numBOOL, numTOOL);
 
-      myGpioSetPwm(gpio, oldWidth, 0);
-      gpioInfo[gpio].range = range;
-      gpioInfo[gpio].width = newWidth;
-      myGpioSetPwm(gpio, 0, newWidth);
-    }
+  if(wid < 0) {
+    pthread_mutex_unlock(&waveMutex);
+    return wid;
   }
 
-  gpioInfo[gpio].range = range;
+  CB = waveInfo[wid].botCB;
+  BOOL = waveInfo[wid].botOOL;
+  TOOL = waveInfo[wid].topOOL;
 
-  /* return the actual range for the current gpio frequency */
+  wave2Cbs(waves, numWaves, PI_WAVE_MODE_ONE_SHOT, &CB, &BOOL, &TOOL, 0, 0, 0);
 
-  return pwmRealRange[gpioInfo[gpio].freqIdx];
-}
+  /* Sanity check. */
 
-/* ----------------------------------------------------------------------- */
+  if((numCB != (CB - waveInfo[wid].botCB)) || (numBOOL != (BOOL - waveInfo[wid].botOOL)) || (numTOOL != (waveInfo[wid].topOOL - TOOL))) {
+    DBG(DBG_ALWAYS,
+        "ERROR wid=%d CBs %d=%d BOOL %d=%d TOOL %d=%d",
+        wid,
+        numCB,
+        CB - waveInfo[wid].botCB,
+        numBOOL,
+        BOOL - waveInfo[wid].botOOL,
+        numTOOL,
+        waveInfo[wid].topOOL - TOOL);
+  }
 
-int
-gpioGetPWMrange(unsigned gpio) {
-  DBG(DBG_USER, "gpio=%d", gpio);
+  DBG(DBG_USER, "Wave Stats: wid=%d CBs %d BOOL %d TOOL %d", wid, numCB, numBOOL, numTOOL);
 
-  CHECK_INITED;
+  waveInfo[wid].deleted = 0;
 
-  if(gpio > PI_MAX_USER_GPIO)
-    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+  if(share)
+    waveCacheAdd(wid, hash, waves, numWaves);
 
-  switch(gpioInfo[gpio].is) {
-    case GPIO_HW_PWM:
-    case GPIO_HW_CLK: return PI_HW_PWM_RANGE;
+  pthread_mutex_unlock(&waveMutex);
 
-    default: return gpioInfo[gpio].range;
-  }
+  return wid;
 }
 
 /* ----------------------------------------------------------------------- */
 
-int
-gpioGetPWMrealRange(unsigned gpio) {
-  unsigned pwm;
+static int
+waveCreate(int share) {
+  int wid;
+  unsigned numWaves;
 
-  DBG(DBG_USER, "gpio=%d", gpio);
+  wid = waveTrackMerge();
 
-  CHECK_INITED;
+  if(wid < 0)
+    return wid;
 
-  if(gpio > PI_MAX_USER_GPIO)
-    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+  if(wfc[wfcur] == 0)
+    return PI_EMPTY_WAVEFORM;
 
-  switch(gpioInfo[gpio].is) {
-    case GPIO_HW_PWM: pwm = (PWMDef[gpio] >> 4) & 3; return hw_pwm_real_range[pwm];
+  /* normalise into the spare buffer, the added pulses stay as they
+     were if the create fails */
 
-    case GPIO_HW_CLK: return PI_HW_PWM_RANGE;
+  wid = waveReserve(&wf[1 - wfcur], &wfSize[1 - wfcur], wfc[wfcur]);
 
-    default: return pwmRealRange[gpioInfo[gpio].freqIdx];
-  }
-}
+  if(wid < 0)
+    return wid;
 
-/* ----------------------------------------------------------------------- */
+  numWaves = waveNormalise(wf[wfcur], wfc[wfcur], wf[1 - wfcur], NULL);
 
-int
-gpioSetPWMfrequency(unsigned gpio, unsigned frequency) {
-  int i, width;
-  unsigned diff, best, idx;
+  wid = waveCompile(wf[1 - wfcur], numWaves, share);
 
-  DBG(DBG_USER, "gpio=%d frequency=%d", gpio, frequency);
+  if(wid < 0)
+    return wid;
 
-  CHECK_INITED;
+  /* Consume waves. */
 
-  if(gpio > PI_MAX_USER_GPIO)
-    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+  wfc[0] = 0;
+  wfc[1] = 0;
+  wfc[2] = 0;
 
-  if(frequency > pwmFreq[0])
-    idx = 0;
-  else if(frequency < pwmFreq[PWM_FREQS - 1])
-    idx = PWM_FREQS - 1;
-  else {
-    best = 100000; /* impossibly high frequency difference */
-    idx = 0;
+  wfcur = 0;
 
-    for(i = 0; i < PWM_FREQS; i++) {
-      if(frequency > pwmFreq[i])
-        diff = frequency - pwmFreq[i];
-      else
-        diff = pwmFreq[i] - frequency;
+  waveTrackReset();
 
-      if(diff < best) {
-        best = diff;
-        idx = i;
-      }
-    }
-  }
+  return wid;
+}
 
-  width = gpioInfo[gpio].width;
+int
+gpioWaveCreate(void) {
+  DBG(DBG_USER, "");
 
-  if(width) {
-    if(gpioInfo[gpio].is == GPIO_PWM) {
-      myGpioSetPwm(gpio, width, 0);
-      gpioInfo[gpio].freqIdx = idx;
-      myGpioSetPwm(gpio, 0, width);
-    }
-  }
+  CHECK_INITED;
 
-  gpioInfo[gpio].freqIdx = idx;
+  CHECK_DMA;
 
-  return pwmFreq[idx];
+  return waveCreate(gpioCfg.internals & PI_CFG_WAVE_CACHE);
 }
 
 /* ----------------------------------------------------------------------- */
 
-int
-gpioGetPWMfrequency(unsigned gpio) {
-  unsigned pwm, clock;
+static void
+waveJobUnlock(void* x) {
+  if(*(int*)x)
+    pthread_mutex_unlock(&waveJobMutex);
+}
 
-  DBG(DBG_USER, "gpio=%d", gpio);
+/* ----------------------------------------------------------------------- */
 
-  CHECK_INITED;
+static void*
+pthWaveCompilerThread(void* x) {
+  waveJob_t* job;
+  int i, locked, state, result;
 
-  if(gpio > PI_MAX_USER_GPIO)
-    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+  pthread_mutex_lock(&waveJobMutex);
 
-  switch(gpioInfo[gpio].is) {
-    case GPIO_HW_PWM: pwm = (PWMDef[gpio] >> 4) & 3; return hw_pwm_freq[pwm];
+  locked = 1;
 
-    case GPIO_HW_CLK: clock = (clkDef[gpio] >> 4) & 3; return hw_clk_freq[clock];
+  pthread_cleanup_push(waveJobUnlock, &locked);
 
-    default: return pwmFreq[gpioInfo[gpio].freqIdx];
-  }
-}
+  while(1) {
+    job = NULL;
 
-/* ----------------------------------------------------------------------- */
+    for(i = 0; i < PI_WAVE_MAX_TICKETS; i++) {
+      if((waveJob[i].state == WAVE_JOB_QUEUED) && ((job == NULL) || ((int)(waveJob[i].seq - job->seq) < 0)))
+        job = &waveJob[i];
+    }
 
-int
-gpioServo(unsigned gpio, unsigned val) {
-  DBG(DBG_USER, "gpio=%d pulsewidth=%d", gpio, val);
+    if(job == NULL) {
+      pthread_cond_wait(&waveJobCond, &waveJobMutex);
+      continue;
+    }
 
-  CHECK_INITED;
+    job->state = WAVE_JOB_RUNNING; /* gpioWaveClear waits for it */
 
-  if(gpio > PI_MAX_USER_GPIO)
-    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+    locked = 0;
+    pthread_mutex_unlock(&waveJobMutex);
 
-  if((val != PI_SERVO_OFF) && (val < PI_MIN_SERVO_PULSEWIDTH))
-    SOFT_ERROR(PI_BAD_PULSEWIDTH, "gpio %d, bad pulsewidth (%d)", gpio, val);
+    /* waveMutex is taken inside, don't die holding it */
 
-  if(val > PI_MAX_SERVO_PULSEWIDTH)
-    SOFT_ERROR(PI_BAD_PULSEWIDTH, "gpio %d, bad pulsewidth (%d)", gpio, val);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+
+    result = waveCompile(job->pulses, job->numPulses, job->share);
 
-  if(gpioInfo[gpio].is != GPIO_SERVO) {
-    switchFunctionOff(gpio);
+    pthread_setcancelstate(state, NULL);
 
-    gpioInfo[gpio].is = GPIO_SERVO;
+    pthread_mutex_lock(&waveJobMutex);
+    locked = 1;
 
-    if(!val)
-      myGpioWrite(gpio, 0);
-  }
+    free(job->pulses);
+    job->pulses = NULL;
 
-  myGpioSetMode(gpio, PI_OUTPUT);
+    job->result = result;
+    job->state = WAVE_JOB_DONE;
 
-  myGpioSetServo(gpio, gpioInfo[gpio].width, val);
+    pthread_cond_broadcast(&waveJobDone);
+  }
 
-  gpioInfo[gpio].width = val;
+  pthread_cleanup_pop(1);
 
-  return 0;
+  return NULL;
 }
 
 /* ----------------------------------------------------------------------- */
 
 int
-gpioGetServoPulsewidth(unsigned gpio) {
-  DBG(DBG_USER, "gpio=%d", gpio);
+gpioWaveCreateAsync(void) {
+  int i, ticket;
+
+  DBG(DBG_USER, "");
 
   CHECK_INITED;
 
-  if(gpio > PI_MAX_USER_GPIO)
-    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+  CHECK_DMA;
 
-  if(gpioInfo[gpio].is != GPIO_SERVO)
-    SOFT_ERROR(PI_NOT_SERVO_GPIO, "not a servo gpio (%d)", gpio);
+  i = waveTrackMerge();
 
-  return gpioInfo[gpio].width;
-}
+  if(i < 0)
+    return i;
 
-/* ----------------------------------------------------------------------- */
+  if(wfc[wfcur] == 0)
+    return PI_EMPTY_WAVEFORM;
 
-int
-gpioWaveClear(void) {
-  DBG(DBG_USER, "");
+  wfc[wfcur] = waveNormalise(wf[wfcur], wfc[wfcur], wf[wfcur], NULL);
 
-  CHECK_INITED;
+  pthread_mutex_lock(&waveJobMutex);
 
-  wfc[0] = 0;
-  wfc[1] = 0;
-  wfc[2] = 0;
+  /* the compiler thread is only started by the first async create */
 
-  wfcur = 0;
+  if(!waveCompilerRunning) {
+    if(pthread_create(&pthWaveCompiler, NULL, pthWaveCompilerThread, NULL)) {
+      pthread_mutex_unlock(&waveJobMutex);
+      SOFT_ERROR(PI_NO_WAVE_TICKET, "wave compiler thread create failed (%m)");
+    }
 
-  wfStats.micros = 0;
-  wfStats.pulses = 0;
-  wfStats.cbs = 0;
+    waveCompilerRunning = 1;
+  }
 
-  waveOutBotCB = PI_WAVE_COUNT_PAGES * CBS_PER_OPAGE;
-  waveOutBotOOL = PI_WAVE_COUNT_PAGES * OOL_PER_OPAGE;
-  waveOutTopOOL = NUM_WAVE_OOL;
+  for(ticket = 0; ticket < PI_WAVE_MAX_TICKETS; ticket++)
+    if(waveJob[ticket].state == WAVE_JOB_FREE)
+      break;
 
-  waveOutCount = 0;
+  if(ticket >= PI_WAVE_MAX_TICKETS) {
+    pthread_mutex_unlock(&waveJobMutex);
+    return PI_NO_WAVE_TICKET;
+  }
 
-  waveEndPtr = NULL;
+  /* hand the merged staging buffer to the job, adds start afresh */
 
-  return 0;
-}
+  waveJob[ticket].pulses = wf[wfcur];
+  waveJob[ticket].numPulses = wfc[wfcur];
+  waveJob[ticket].share = gpioCfg.internals & PI_CFG_WAVE_CACHE;
+  waveJob[ticket].seq = waveJobSeq++;
+  waveJob[ticket].result = PI_WAVE_PENDING;
+  waveJob[ticket].state = WAVE_JOB_QUEUED;
 
-/* ----------------------------------------------------------------------- */
+  wf[wfcur] = NULL;
+  wfSize[wfcur] = 0;
 
-int
-gpioWaveAddNew(void) {
-  DBG(DBG_USER, "");
+  pthread_cond_signal(&waveJobCond);
 
-  CHECK_INITED;
+  pthread_mutex_unlock(&waveJobMutex);
+
+  /* Consume waves. */
 
   wfc[0] = 0;
   wfc[1] = 0;
@@ -8692,562 +12542,546 @@ gpioWaveAddNew(void) {
 
   wfcur = 0;
 
-  wfStats.micros = 0;
-  wfStats.pulses = 0;
-  wfStats.cbs = 0;
+  waveTrackReset();
 
-  return 0;
+  DBG(DBG_USER, "Wave ticket %d queued", ticket);
+
+  return ticket;
 }
 
 /* ----------------------------------------------------------------------- */
 
 int
-gpioWaveAddGeneric(unsigned numPulses, gpioPulse_t* pulses) {
-  int p;
+gpioWaveCreateResult(unsigned ticket, unsigned wait) {
+  int result;
 
-  DBG(DBG_USER, "numPulses=%u pulses=%08" PRIXPTR, numPulses, (uintptr_t)pulses);
+  DBG(DBG_USER, "ticket=%d wait=%d", ticket, wait);
 
   CHECK_INITED;
 
-  if(numPulses > PI_WAVE_MAX_PULSES)
-    SOFT_ERROR(PI_TOO_MANY_PULSES, "bad number of pulses (%d)", numPulses);
+  if(ticket >= PI_WAVE_MAX_TICKETS)
+    SOFT_ERROR(PI_BAD_WAVE_TICKET, "bad wave ticket (%d)", ticket);
 
-  if(!pulses)
-    SOFT_ERROR(PI_BAD_POINTER, "bad (NULL) pulses pointer");
+  pthread_mutex_lock(&waveJobMutex);
 
-  for(p = 0; p < numPulses; p++) {
-    wf[2][p].gpioOff = pulses[p].gpioOff;
-    wf[2][p].gpioOn = pulses[p].gpioOn;
-    wf[2][p].usDelay = pulses[p].usDelay;
-    wf[2][p].flags = 0;
+  if(waveJob[ticket].state == WAVE_JOB_FREE) {
+    pthread_mutex_unlock(&waveJobMutex);
+    SOFT_ERROR(PI_BAD_WAVE_TICKET, "bad wave ticket (%d)", ticket);
   }
 
-  return rawWaveAddGeneric(numPulses, wf[2]);
+  while(wait && (waveJob[ticket].state != WAVE_JOB_DONE)) pthread_cond_wait(&waveJobDone, &waveJobMutex);
+
+  if(waveJob[ticket].state != WAVE_JOB_DONE) {
+    pthread_mutex_unlock(&waveJobMutex);
+    return PI_WAVE_PENDING;
+  }
+
+  /* the ticket is finished with once its result is collected */
+
+  result = waveJob[ticket].result;
+
+  waveJob[ticket].state = WAVE_JOB_FREE;
+
+  pthread_mutex_unlock(&waveJobMutex);
+
+  return result;
 }
 
 /* ----------------------------------------------------------------------- */
 
 int
-gpioWaveAddSerial(unsigned gpio, unsigned baud, unsigned data_bits, unsigned stop_bits, unsigned offset, unsigned numBytes, char* bstr) {
-  int i, b, p, lev, c, v;
+gpioWaveCreatePad(int pctCB, int pctBOOL, int pctTOOL) {
+  int i, wid;
+  unsigned numWaves;
+  int numCB, numBOOL, numTOOL;
+  int CB, BOOL, TOOL;
 
-  uint16_t* wstr = (uint16_t*)bstr;
-  uint32_t* lstr = (uint32_t*)bstr;
+  DBG(DBG_USER, "%d, %d, %d", pctCB, pctBOOL, pctTOOL);
 
-  unsigned bitDelay[32];
+  CHECK_INITED;
 
-  DBG(DBG_USER,
-      "gpio=%d baud=%d bits=%d stops=%d offset=%d numBytes=%d str=[%s]",
-      gpio,
-      baud,
-      data_bits,
-      stop_bits,
-      offset,
-      numBytes,
-      myBuf2Str(numBytes, (char*)bstr));
+  CHECK_DMA;
 
-  CHECK_INITED;
+  if(pctCB < 0 || pctCB > 100)
+    SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctCB=(%d)", pctCB);
+  if(pctBOOL < 0 || pctBOOL > 100)
+    SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctBOOL=(%d)", pctBOOL);
+  if(pctTOOL < 0 || pctTOOL > 100)
+    SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctTOOL=(%d)", pctTOOL);
 
-  if(gpio > PI_MAX_USER_GPIO)
-    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+  i = waveTrackMerge();
 
-  if((baud < PI_WAVE_MIN_BAUD) || (baud > PI_WAVE_MAX_BAUD))
-    SOFT_ERROR(PI_BAD_WAVE_BAUD, "bad baud rate (%d)", baud);
+  if(i < 0)
+    return i;
 
-  if((data_bits < PI_MIN_WAVE_DATABITS) || (data_bits > PI_MAX_WAVE_DATABITS))
-    SOFT_ERROR(PI_BAD_DATABITS, "bad number of databits (%d)", data_bits);
+  if(wfc[wfcur] == 0)
+    return PI_EMPTY_WAVEFORM;
 
-  if((stop_bits < PI_MIN_WAVE_HALFSTOPBITS) || (stop_bits > PI_MAX_WAVE_HALFSTOPBITS))
-    SOFT_ERROR(PI_BAD_STOPBITS, "bad number of (half) stop bits (%d)", stop_bits);
+  i = waveReserve(&wf[1 - wfcur], &wfSize[1 - wfcur], wfc[wfcur]);
 
-  if(gpio > PI_MAX_USER_GPIO)
-    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+  if(i < 0)
+    return i;
 
-  if(numBytes > PI_WAVE_MAX_CHARS)
-    SOFT_ERROR(PI_TOO_MANY_CHARS, "too many chars (%d)", numBytes);
+  numWaves = waveNormalise(wf[wfcur], wfc[wfcur], wf[1 - wfcur], NULL);
 
-  if(offset > PI_WAVE_MAX_MICROS)
-    SOFT_ERROR(PI_BAD_SER_OFFSET, "offset too large (%d)", offset);
+  /* What resources are needed? */
+  waveCBsOOLs(wf[1 - wfcur], numWaves, &numCB, &numBOOL, &numTOOL);
 
-  if(data_bits > 8)
-    numBytes /= 2;
-  if(data_bits > 16)
-    numBytes /= 2;
+  /* Amount of pad required */
+  CB = (NUM_WAVE_CBS - PI_WAVE_COUNT_PAGES * CBS_PER_OPAGE) * pctCB / 100;
+  BOOL = (NUM_WAVE_OOL - PI_WAVE_COUNT_PAGES * OOL_PER_OPAGE) * pctBOOL / 100;
+  TOOL = (NUM_WAVE_OOL - PI_WAVE_COUNT_PAGES * OOL_PER_OPAGE) * pctTOOL / 100;
 
-  if(!numBytes)
-    return 0;
+  /* Reject if wave is too big */
+  if(numCB > CB)
+    return PI_TOO_MANY_CBS;
+  if(numBOOL > BOOL)
+    return PI_TOO_MANY_OOL;
+  if(numTOOL > TOOL)
+    return PI_TOO_MANY_OOL;
 
-  waveBitDelay(baud, data_bits, stop_bits, bitDelay);
+  /* Set the padding */
+  numCB = CB;
+  numBOOL = BOOL;
+  numTOOL = TOOL;
 
-  p = 0;
+  /* Best fit from the free CB and OOL ranges. */
 
-  wf[2][p].gpioOn = (1 << gpio);
-  wf[2][p].gpioOff = 0;
-  wf[2][p].flags = 0;
+  pthread_mutex_lock(&waveMutex);
 
-  if(offset > bitDelay[0])
-    wf[2][p].usDelay = offset;
-  else
-    wf[2][p].usDelay = bitDelay[0];
+  wid = waveAllocate(numCB, numBOOL, numTOOL);
 
-  for(i = 0; i < numBytes; i++) {
-    p++;
+  if(wid < 0) {
+    pthread_mutex_unlock(&waveMutex);
+    return wid;
+  }
 
-    /* start bit */
+  CB = waveInfo[wid].botCB;
+  BOOL = waveInfo[wid].botOOL;
+  TOOL = waveInfo[wid].topOOL;
 
-    wf[2][p].gpioOn = 0;
-    wf[2][p].gpioOff = (1 << gpio);
-    wf[2][p].usDelay = bitDelay[0];
-    wf[2][p].flags = 0;
+  wave2Cbs(wf[1 - wfcur], numWaves, PI_WAVE_MODE_ONE_SHOT, &CB, &BOOL, &TOOL, numCB, numBOOL, numTOOL);
 
-    lev = 0;
+  /* Sanity check. */
 
-    if(data_bits < 9)
-      c = bstr[i];
-    else if(data_bits < 17)
-      c = wstr[i];
-    else
-      c = lstr[i];
+  if((numCB != (CB - waveInfo[wid].botCB)) || (numBOOL != (BOOL - waveInfo[wid].botOOL)) || (numTOOL != (waveInfo[wid].topOOL - TOOL))) {
+    DBG(DBG_ALWAYS,
+        "ERROR wid=%d CBs %d=%d BOOL %d=%d TOOL %d=%d",
+        wid,
+        numCB,
+        CB - waveInfo[wid].botCB,
+        numBOOL,
+        BOOL - waveInfo[wid].botOOL,
+        numTOOL,
+        waveInfo[wid].topOOL - TOOL);
+  }
 
-    for(b = 0; b < data_bits; b++) {
-      if(c & (1 << b))
-        v = 1;
-      else
-        v = 0;
+  DBG(DBG_USER, "Wave padding: wid=%d CBs %d BOOL %d TOOL %d", wid, numCB, numBOOL, numTOOL);
 
-      if(v == lev)
-        wf[2][p].usDelay += bitDelay[b + 1];
-      else {
-        p++;
+  waveInfo[wid].deleted = 0;
 
-        lev = v;
+  pthread_mutex_unlock(&waveMutex);
 
-        if(lev) {
-          wf[2][p].gpioOn = (1 << gpio);
-          wf[2][p].gpioOff = 0;
-          wf[2][p].flags = 0;
-        } else {
-          wf[2][p].gpioOn = 0;
-          wf[2][p].gpioOff = (1 << gpio);
-          wf[2][p].flags = 0;
-        }
+  /* Consume waves. */
 
-        wf[2][p].usDelay = bitDelay[b + 1];
-      }
-    }
+  wfc[0] = 0;
+  wfc[1] = 0;
+  wfc[2] = 0;
 
-    /* stop bit */
+  wfcur = 0;
 
-    if(lev)
-      wf[2][p].usDelay += bitDelay[data_bits + 1];
-    else {
-      p++;
+  waveTrackReset();
 
-      wf[2][p].gpioOn = (1 << gpio);
-      wf[2][p].gpioOff = 0;
-      wf[2][p].usDelay = bitDelay[data_bits + 1];
-      wf[2][p].flags = 0;
-    }
+  return wid;
+}
+/* ----------------------------------------------------------------------- */
+
+int
+gpioWaveDelete(unsigned wave_id) {
+  DBG(DBG_USER, "wave id=%d", wave_id);
+
+  CHECK_INITED;
+
+  pthread_mutex_lock(&waveMutex);
+
+  if((wave_id >= waveOutCount) || waveInfo[wave_id].deleted) {
+    pthread_mutex_unlock(&waveMutex);
+    SOFT_ERROR(PI_BAD_WAVE_ID, "bad wave id (%d)", wave_id);
   }
 
-  p++;
+  /* a shared wave is only freed on its last release */
 
-  wf[2][p].gpioOn = (1 << gpio);
-  wf[2][p].gpioOff = 0;
-  wf[2][p].usDelay = bitDelay[0];
-  wf[2][p].flags = 0;
+  if(waveCache[wave_id].refs > 1) {
+    waveCache[wave_id].refs--;
+    pthread_mutex_unlock(&waveMutex);
+    return 0;
+  }
 
-  return rawWaveAddGeneric(p, wf[2]);
+  waveCacheDrop(wave_id);
+
+  waveInfo[wave_id].deleted = 1;
+
+  /* return the wave's ranges to the free lists */
+
+  waveSpanFree(waveFreeCB, &waveFreeCBs, waveInfo[wave_id].botCB, waveInfo[wave_id].numCB);
+
+  waveSpanFree(waveFreeOOL, &waveFreeOOLs, waveInfo[wave_id].botOOL, waveInfo[wave_id].numBOOL + waveInfo[wave_id].numTOOL);
+
+  if(wave_id == (waveOutCount - 1)) {
+    /* top wave deleted, drop any other deleted waves below it */
+
+    while((wave_id > 0) && (waveInfo[wave_id - 1].deleted)) --wave_id;
+
+    waveOutCount = wave_id;
+  }
+
+  pthread_mutex_unlock(&waveMutex);
+
+  return 0;
 }
 
 /* ----------------------------------------------------------------------- */
 
 int
-rawWaveAddSPI(rawSPI_t* spi, unsigned offset, unsigned spiSS, char* buf, unsigned spiTxBits, unsigned spiBitFirst, unsigned spiBitLast, unsigned spiBits) {
-  int p, bit, dbv, halfbit;
-  int rising_edge[2], read_cycle[2];
-  uint32_t on_bits, off_bits;
-  int tx_bit_pos;
+gpioWaveCompact(void) {
+  int i, k, n, wid, len, pos, moved;
+  int order[PI_MAX_WAVES];
+  rawWaveInfo_t old[PI_MAX_WAVES];
 
-  DBG(DBG_USER,
-      "spi=%08" PRIXPTR " off=%d spiSS=%d tx=%08" PRIXPTR ", num=%d fb=%d lb=%d spiBits=%d",
-      (uintptr_t)spi,
-      offset,
-      spiSS,
-      (uintptr_t)buf,
-      spiTxBits,
-      spiBitFirst,
-      spiBitLast,
-      spiBits);
+  DBG(DBG_USER, "");
 
   CHECK_INITED;
 
-  if(spiSS > PI_MAX_USER_GPIO)
-    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", spiSS);
-
   /*
-  CPOL CPHA
-   0    0   read rising/write falling
-   0    1   read falling/write rising
-   1    0   read falling/write rising
-   1    1   read rising/write falling
+  a running wave or chain, or the linked segments of a stream, may
+  reference any wave's cbs.  Every start of the engine holds
+  dmaOutMutex so it is held until the cbs are back in place.
   */
 
-  if(spi->clk_pol) {
-    rising_edge[0] = 0;
-    rising_edge[1] = 1;
-  } else {
-    rising_edge[0] = 1;
-    rising_edge[1] = 0;
-  }
+  pthread_mutex_lock(&waveMutex);
+  pthread_mutex_lock(&dmaOutMutex);
 
-  if(spi->clk_pha) {
-    read_cycle[0] = 0;
-    read_cycle[1] = 1;
-  } else {
-    read_cycle[0] = 1;
-    read_cycle[1] = 0;
+  if(dmaOut[DMA_CONBLK_AD] || waveStreamQueued) {
+    pthread_mutex_unlock(&dmaOutMutex);
+    pthread_mutex_unlock(&waveMutex);
+    SOFT_ERROR(PI_WAVE_TX_BUSY, "wave transmission in progress");
   }
 
-  p = 0;
-
-  if(offset) {
-    wf[2][p].gpioOn = 0;
-    wf[2][p].gpioOff = 0;
-    wf[2][p].flags = 0;
-    wf[2][p].usDelay = offset;
-    p++;
-  }
+  memcpy(old, waveInfo, sizeof(old));
 
-  on_bits = 0;
-  off_bits = 0;
+  moved = 0;
 
-  tx_bit_pos = 0;
+  /* slide the OOL ranges down, lowest first so nothing unmoved is hit */
 
-  /* preset initial mosi bit */
+  n = waveLiveOrder(order, 1);
 
-  if(getBitInBytes(tx_bit_pos, buf, spiTxBits)) {
-    on_bits |= (1 << (spi->mosi));
-    dbv = 1;
-  } else {
-    off_bits |= (1 << (spi->mosi));
-    dbv = 0;
-  }
+  pos = WAVE_FIRST_OOL;
 
-  if(!spi->clk_pha)
-    tx_bit_pos++;
+  for(i = 0; i < n; i++) {
+    wid = order[i];
+    len = old[wid].numBOOL + old[wid].numTOOL;
 
-  if(spi->ss_pol)
-    off_bits |= (1 << spiSS);
-  else
-    on_bits |= (1 << spiSS);
+    if(!len)
+      continue;
 
-  if(spi->clk_pol)
-    on_bits |= (1 << (spi->clk));
-  else
-    off_bits |= (1 << (spi->clk));
+    if(old[wid].botOOL != pos) {
+      for(k = 0; k < len; k++) waveSetOOL(pos + k, rawWaveGetOOL(old[wid].botOOL + k));
+    }
 
-  wf[2][p].gpioOn = on_bits;
-  wf[2][p].gpioOff = off_bits;
-  wf[2][p].flags = 0;
+    waveInfo[wid].botOOL = pos;
+    waveInfo[wid].topOOL = pos + len;
 
-  if(spi->clk_us > spi->ss_us)
-    wf[2][p].usDelay = spi->clk_us;
-  else
-    wf[2][p].usDelay = spi->ss_us;
+    pos += len;
+  }
 
-  p++;
+  waveFreeOOL[0].start = pos;
+  waveFreeOOL[0].len = NUM_WAVE_OOL - pos;
+  waveFreeOOLs = (pos < NUM_WAVE_OOL);
 
-  for(bit = 1; bit <= spiBits; bit++) {
-    for(halfbit = 0; halfbit < 2; halfbit++) {
-      wf[2][p].usDelay = spi->clk_us;
-      wf[2][p].flags = 0;
+  /* then the cbs, relinked to their new cb and OOL positions */
 
-      on_bits = 0;
-      off_bits = 0;
+  n = waveLiveOrder(order, 0);
 
-      if(read_cycle[halfbit]) {
-        if((bit >= spiBitFirst) && (bit <= spiBitLast))
-          wf[2][p].flags = WAVE_FLAG_READ;
-      } else {
-        if(getBitInBytes(tx_bit_pos, buf, spiTxBits)) {
-          if(!dbv)
-            on_bits |= (1 << (spi->mosi));
-          dbv = 1;
-        } else {
-          if(dbv)
-            off_bits |= (1 << (spi->mosi));
-          dbv = 0;
-        }
+  pos = WAVE_FIRST_CB;
 
-        ++tx_bit_pos;
-      }
+  for(i = 0; i < n; i++) {
+    wid = order[i];
 
-      if(rising_edge[halfbit])
-        on_bits |= (1 << (spi->clk));
-      else
-        off_bits |= (1 << (spi->clk));
+    waveInfo[wid].botCB = pos;
+    waveInfo[wid].topCB = pos + old[wid].numCB - 1;
 
-      wf[2][p].gpioOn = on_bits;
-      wf[2][p].gpioOff = off_bits;
+    if((old[wid].botCB != waveInfo[wid].botCB) || (old[wid].botOOL != waveInfo[wid].botOOL)) {
+      for(k = 0; k < old[wid].numCB; k++) waveMoveCB(&old[wid], &waveInfo[wid], k);
 
-      p++;
+      moved++;
     }
+
+    pos += old[wid].numCB;
   }
 
-  on_bits = 0;
-  off_bits = 0;
+  waveFreeCB[0].start = pos;
+  waveFreeCB[0].len = NUM_WAVE_CBS - pos;
+  waveFreeCBs = (pos < NUM_WAVE_CBS);
 
-  if(spi->ss_pol)
-    on_bits |= (1 << spiSS);
-  else
-    off_bits |= (1 << spiSS);
+  /* a queued sync send would patch the old position */
 
-  wf[2][p].gpioOn = on_bits;
-  wf[2][p].gpioOff = off_bits;
-  wf[2][p].flags = 0;
-  wf[2][p].usDelay = 0;
+  waveEndPtr = NULL;
 
-  p++;
+  pthread_mutex_unlock(&dmaOutMutex);
+  pthread_mutex_unlock(&waveMutex);
 
-  return rawWaveAddGeneric(p, wf[2]);
+  DBG(DBG_USER, "relocated %d waves", moved);
+
+  return moved;
 }
 
 /* ----------------------------------------------------------------------- */
 
-int
-gpioWaveCreate(void) {
-  int i, wid;
-  int numCB, numBOOL, numTOOL;
-  int CB, BOOL, TOOL;
+static void
+waveStreamReclaim(void) {
+  int i, cb, wid, done;
 
-  DBG(DBG_USER, "");
+  /* an idle engine has sent everything queued up to a missed link */
 
-  CHECK_INITED;
+  for(i = 0; i < waveStreamQueued; i++) {
+    if(waveStreamWid[(waveStreamHead + i) % waveStreamSegs] == waveStreamRestart)
+      break;
+  }
 
-  if(wfc[wfcur] == 0)
-    return PI_EMPTY_WAVEFORM;
+  done = i;
 
-  /* What resources are needed? */
+  if(dmaOut[DMA_CONBLK_AD]) {
+    cb = dmaNowAtOCB();
 
-  waveCBsOOLs(&numCB, &numBOOL, &numTOOL);
+    for(i = 0; i < waveStreamQueued; i++) {
+      wid = waveStreamWid[(waveStreamHead + i) % waveStreamSegs];
 
-  wid = -1;
+      if((cb >= waveInfo[wid].botCB) && (cb <= waveInfo[wid].topCB))
+        break;
+    }
 
-  /* Is there an exact fit with a deleted wave. */
+    /* not in the stream, something else owns the engine */
 
-  for(i = 0; i < waveOutCount; i++) {
-    if(waveInfo[i].deleted && (waveInfo[i].numCB == numCB) && (waveInfo[i].numBOOL == numBOOL) && (waveInfo[i].numTOOL == numTOOL)) {
-      /* Reuse the deleted waves resources. */
-      wid = i;
-      break;
-    }
+    done = (i < waveStreamQueued) ? i : 0;
   }
 
-  if(wid == -1) {
-    /* Are there enough spare resources? */
+  for(i = 0; i < done; i++) {
+    gpioWaveDelete(waveStreamWid[waveStreamHead]);
 
-    if((numCB + waveOutBotCB) > NUM_WAVE_CBS)
-      return PI_TOO_MANY_CBS;
+    waveStreamHead = (waveStreamHead + 1) % waveStreamSegs;
+  }
 
-    if((numBOOL + waveOutBotOOL) > (waveOutTopOOL - numTOOL))
-      return PI_TOO_MANY_OOL;
+  waveStreamQueued -= done;
+  waveStreamSent += done;
 
-    if(wid >= PI_MAX_WAVES)
-      return PI_NO_WAVEFORM_ID;
+  if(dmaOut[DMA_CONBLK_AD])
+    return;
 
-    wid = waveOutCount++;
+  if(waveStreamStarted) {
+    /* ran dry, counted now rather than at the next append */
 
-    waveInfo[wid].botCB = waveOutBotCB;
-    waveInfo[wid].topCB = waveOutBotCB + numCB - 1;
-    waveInfo[wid].botOOL = waveOutBotOOL;
-    waveInfo[wid].topOOL = waveOutTopOOL;
-    waveInfo[wid].numCB = numCB;
-    waveInfo[wid].numBOOL = numBOOL;
-    waveInfo[wid].numTOOL = numTOOL;
+    waveStreamStarted = 0;
+    waveStreamUnderruns++;
 
-    waveOutBotCB += numCB;
-    waveOutBotOOL += numBOOL;
-    waveOutTopOOL -= numTOOL;
+    DBG(DBG_USER, "wave stream underrun %d", waveStreamUnderruns);
   }
 
-  /* Must be room if got this far. */
+  if(waveStreamRestart >= 0) {
+    /* the rest of the queue has not been sent, start it now */
 
-  CB = waveInfo[wid].botCB;
-  BOOL = waveInfo[wid].botOOL;
-  TOOL = waveInfo[wid].topOOL;
+    pthread_mutex_lock(&waveMutex);
+    pthread_mutex_lock(&dmaOutMutex);
 
-  wave2Cbs(PI_WAVE_MODE_ONE_SHOT, &CB, &BOOL, &TOOL, 0, 0, 0);
+    initDMAgo((uint32_t*)dmaOut, waveCbPOadr(waveInfo[waveStreamRestart].botCB));
 
-  /* Sanity check. */
+    pthread_mutex_unlock(&dmaOutMutex);
+    pthread_mutex_unlock(&waveMutex);
 
-  if((numCB != (CB - waveInfo[wid].botCB)) || (numBOOL != (BOOL - waveInfo[wid].botOOL)) || (numTOOL != (waveInfo[wid].topOOL - TOOL))) {
-    DBG(DBG_ALWAYS,
-        "ERROR wid=%d CBs %d=%d BOOL %d=%d TOOL %d=%d",
-        wid,
-        numCB,
-        CB - waveInfo[wid].botCB,
-        numBOOL,
-        BOOL - waveInfo[wid].botOOL,
-        numTOOL,
-        waveInfo[wid].topOOL - TOOL);
+    waveStreamRestart = -1;
+    waveStreamStarted = 1;
   }
+}
 
-  DBG(DBG_USER, "Wave Stats: wid=%d CBs %d BOOL %d TOOL %d", wid, numCB, numBOOL, numTOOL);
+/* ----------------------------------------------------------------------- */
 
-  waveInfo[wid].deleted = 0;
+int
+gpioWaveStreamOpen(unsigned segments) {
+  DBG(DBG_USER, "segments=%d", segments);
 
-  /* Consume waves. */
+  CHECK_INITED;
 
-  wfc[0] = 0;
-  wfc[1] = 0;
-  wfc[2] = 0;
+  CHECK_DMA;
 
-  wfcur = 0;
+  if((segments < PI_WAVE_STREAM_MIN_SEGS) || (segments > PI_WAVE_STREAM_MAX_SEGS))
+    SOFT_ERROR(PI_BAD_STREAM_SEGS, "bad stream segments (%d)", segments);
 
-  return wid;
+  if(waveStreamSegs)
+    gpioWaveStreamClose();
+
+  if(dmaOut[DMA_CONBLK_AD])
+    SOFT_ERROR(PI_WAVE_TX_BUSY, "wave transmission in progress");
+
+  waveStreamSegs = segments;
+  waveStreamHead = 0;
+  waveStreamQueued = 0;
+  waveStreamStarted = 0;
+  waveStreamRestart = -1;
+  waveStreamSent = 0;
+  waveStreamUnderruns = 0;
+
+  waveEndPtr = NULL;
+
+  return 0;
 }
 
+/* ----------------------------------------------------------------------- */
+
 int
-gpioWaveCreatePad(int pctCB, int pctBOOL, int pctTOOL) {
-  int i, wid;
-  int numCB, numBOOL, numTOOL;
-  int CB, BOOL, TOOL;
+gpioWaveStreamAppend(void) {
+  int i, wid, last, start;
+  uint32_t end, link, cb;
 
-  DBG(DBG_USER, "%d, %d, %d", pctCB, pctBOOL, pctTOOL);
+  DBG(DBG_USER, "");
 
   CHECK_INITED;
 
-  if(pctCB < 0 || pctCB > 100)
-    SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctCB=(%d)", pctCB);
-  if(pctBOOL < 0 || pctBOOL > 100)
-    SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctBOOL=(%d)", pctBOOL);
-  if(pctTOOL < 0 || pctTOOL > 100)
-    SOFT_ERROR(PI_BAD_PARAM, "bad wave param, pctTOOL=(%d)", pctTOOL);
+  if(!waveStreamSegs)
+    SOFT_ERROR(PI_STREAM_NOT_OPEN, "no wave stream open");
 
-  if(wfc[wfcur] == 0)
-    return PI_EMPTY_WAVEFORM;
+  waveStreamReclaim();
 
-  /* What resources are needed? */
-  waveCBsOOLs(&numCB, &numBOOL, &numTOOL);
+  if(waveStreamQueued >= waveStreamSegs)
+    return PI_STREAM_FULL;
 
-  /* Amount of pad required */
-  CB = (NUM_WAVE_CBS - PI_WAVE_COUNT_PAGES * CBS_PER_OPAGE) * pctCB / 100;
-  BOOL = (NUM_WAVE_OOL - PI_WAVE_COUNT_PAGES * OOL_PER_OPAGE) * pctBOOL / 100;
-  TOOL = (NUM_WAVE_OOL - PI_WAVE_COUNT_PAGES * OOL_PER_OPAGE) * pctTOOL / 100;
+  wid = waveCreate(0); /* segments are never shared */
 
-  /* Reject if wave is too big */
-  if(numCB > CB)
-    return PI_TOO_MANY_CBS;
-  if(numBOOL > BOOL)
-    return PI_TOO_MANY_OOL;
-  if(numTOOL > TOOL)
-    return PI_TOO_MANY_OOL;
+  if(wid < 0)
+    return wid;
 
-  /* Set the padding */
-  numCB = CB;
-  numBOOL = BOOL;
-  numTOOL = TOOL;
+  if(!waveClockInited) {
+    stopHardwarePWM();
+    initClock(0); /* initialise secondary clock */
+    waveClockInited = 1;
+    PWMClockInited = 0;
+  }
 
-  wid = -1;
+  start = !waveStreamQueued;
 
-  /* Is there an exact fit with a deleted wave. */
+  pthread_mutex_lock(&waveMutex);
+  pthread_mutex_lock(&dmaOutMutex);
 
-  for(i = 0; i < waveOutCount; i++) {
-    if(waveInfo[i].deleted && (waveInfo[i].numCB == numCB) && (waveInfo[i].numBOOL == numBOOL) && (waveInfo[i].numTOOL == numTOOL)) {
-      /* Reuse the deleted waves resources. */
-      wid = i;
-      break;
+  if(waveStreamQueued) {
+    last = waveStreamWid[(waveStreamHead + waveStreamQueued - 1) % waveStreamSegs];
+
+    end = waveCbPOadr(waveInfo[last].topCB);
+
+    /* skip the start delay cb so segments run back to back */
+
+    link = waveCbPOadr(waveInfo[wid].botCB + 1);
+
+    rawWaveCBAdr(waveInfo[last].topCB)->next = link;
+
+    /*
+    the engine latches the next cb as it loads each one, stopped or
+    holding the old end of stream without the link means it was missed
+    */
+
+    cb = dmaOut[DMA_CONBLK_AD];
+
+    if((waveStreamRestart < 0) && (!cb || ((cb == end) && (dmaOut[DMA_NEXTCONBK] != link)))) {
+      /* the end is one sentinel cb, a few register reads see it out */
+
+      for(i = 0; (i < 1000) && dmaOut[DMA_CONBLK_AD]; i++)
+        ;
+
+      /* still finishing the old end, the next reclaim restarts it */
+
+      if(dmaOut[DMA_CONBLK_AD])
+        waveStreamRestart = wid;
+      else
+        start = 1;
     }
   }
 
-  if(wid == -1) {
-    /* Are there enough spare resources? */
+  if(start && !dmaOut[DMA_CONBLK_AD]) {
+    if(waveStreamStarted) {
+      waveStreamUnderruns++;
 
-    if((numCB + waveOutBotCB) > NUM_WAVE_CBS)
-      return PI_TOO_MANY_CBS;
+      DBG(DBG_USER, "wave stream underrun %d", waveStreamUnderruns);
+    }
 
-    if((numBOOL + waveOutBotOOL) > (waveOutTopOOL - numTOOL))
-      return PI_TOO_MANY_OOL;
+    initDMAgo((uint32_t*)dmaOut, waveCbPOadr(waveInfo[wid].botCB));
 
-    if(wid >= PI_MAX_WAVES)
-      return PI_NO_WAVEFORM_ID;
+    waveStreamStarted = 1;
+  }
 
-    wid = waveOutCount++;
+  pthread_mutex_unlock(&dmaOutMutex);
+  pthread_mutex_unlock(&waveMutex);
 
-    waveInfo[wid].botCB = waveOutBotCB;
-    waveInfo[wid].topCB = waveOutBotCB + numCB - 1;
-    waveInfo[wid].botOOL = waveOutBotOOL;
-    waveInfo[wid].topOOL = waveOutTopOOL;
-    waveInfo[wid].numCB = numCB;
-    waveInfo[wid].numBOOL = numBOOL;
-    waveInfo[wid].numTOOL = numTOOL;
+  waveStreamWid[(waveStreamHead + waveStreamQueued) % waveStreamSegs] = wid;
 
-    waveOutBotCB += numCB;
-    waveOutBotOOL += numBOOL;
-    waveOutTopOOL -= numTOOL;
-  }
+  return ++waveStreamQueued;
+}
 
-  /* Must be room if got this far. */
+/* ----------------------------------------------------------------------- */
 
-  CB = waveInfo[wid].botCB;
-  BOOL = waveInfo[wid].botOOL;
-  TOOL = waveInfo[wid].topOOL;
+int
+gpioWaveStreamStatus(gpioStreamStatus_t* status) {
+  DBG(DBG_USER, "status=%08" PRIXPTR, (uintptr_t)status);
 
-  wave2Cbs(PI_WAVE_MODE_ONE_SHOT, &CB, &BOOL, &TOOL, numCB, numBOOL, numTOOL);
+  CHECK_INITED;
 
-  /* Sanity check. */
+  if(!waveStreamSegs)
+    SOFT_ERROR(PI_STREAM_NOT_OPEN, "no wave stream open");
 
-  if((numCB != (CB - waveInfo[wid].botCB)) || (numBOOL != (BOOL - waveInfo[wid].botOOL)) || (numTOOL != (waveInfo[wid].topOOL - TOOL))) {
-    DBG(DBG_ALWAYS,
-        "ERROR wid=%d CBs %d=%d BOOL %d=%d TOOL %d=%d",
-        wid,
-        numCB,
-        CB - waveInfo[wid].botCB,
-        numBOOL,
-        BOOL - waveInfo[wid].botOOL,
-        numTOOL,
-        waveInfo[wid].topOOL - TOOL);
-  }
+  waveStreamReclaim();
+
+  status->queued = waveStreamQueued;
+  status->free = waveStreamSegs - waveStreamQueued;
+  status->sent = waveStreamSent;
+  status->underruns = waveStreamUnderruns;
+  status->running = (waveStreamQueued != 0);
+
+  return waveStreamQueued;
+}
 
-  DBG(DBG_USER, "Wave padding: wid=%d CBs %d BOOL %d TOOL %d", wid, numCB, numBOOL, numTOOL);
+/* ----------------------------------------------------------------------- */
 
-  waveInfo[wid].deleted = 0;
+static void
+waveStreamFlush(void) {
+  int i;
 
-  /* Consume waves. */
+  /* stop the stream and drop its queued segments, it stays open */
 
-  wfc[0] = 0;
-  wfc[1] = 0;
-  wfc[2] = 0;
+  if(waveStreamQueued) {
+    pthread_mutex_lock(&dmaOutMutex);
+    initKillDMA(dmaOut);
+    waveEndPtr = NULL;
+    pthread_mutex_unlock(&dmaOutMutex);
+  }
 
-  wfcur = 0;
+  for(i = 0; i < waveStreamQueued; i++) gpioWaveDelete(waveStreamWid[(waveStreamHead + i) % waveStreamSegs]);
 
-  return wid;
+  waveStreamHead = 0;
+  waveStreamQueued = 0;
+  waveStreamStarted = 0;
+  waveStreamRestart = -1;
 }
+
 /* ----------------------------------------------------------------------- */
 
 int
-gpioWaveDelete(unsigned wave_id) {
-  DBG(DBG_USER, "wave id=%d", wave_id);
+gpioWaveStreamClose(void) {
+  DBG(DBG_USER, "");
 
   CHECK_INITED;
 
-  if((wave_id >= waveOutCount) || waveInfo[wave_id].deleted)
-    SOFT_ERROR(PI_BAD_WAVE_ID, "bad wave id (%d)", wave_id);
-
-  waveInfo[wave_id].deleted = 1;
-
-  if(wave_id == (waveOutCount - 1)) {
-    /* top wave deleted, garbage collect any other deleted waves */
-
-    while((wave_id > 0) && (waveInfo[wave_id - 1].deleted)) --wave_id;
+  if(!waveStreamSegs)
+    SOFT_ERROR(PI_STREAM_NOT_OPEN, "no wave stream open");
 
-    waveOutBotCB = waveInfo[wave_id].botCB;
-    waveOutBotOOL = waveInfo[wave_id].botOOL;
-    waveOutTopOOL = waveInfo[wave_id].topOOL;
+  waveStreamFlush();
 
-    waveOutCount = wave_id;
-  }
+  waveStreamSegs = 0;
 
   return 0;
 }
@@ -9268,17 +13102,27 @@ gpioWaveTxStart(unsigned wave_mode) {
 int
 gpioWaveTxSend(unsigned wave_id, unsigned wave_mode) {
   rawCbs_t* p = NULL;
+  int cbs;
 
   DBG(DBG_USER, "wave_id=%d wave_mode=%d", wave_id, wave_mode);
 
   CHECK_INITED;
 
-  if((wave_id >= waveOutCount) || waveInfo[wave_id].deleted)
-    SOFT_ERROR(PI_BAD_WAVE_ID, "bad wave id (%d)", wave_id);
-
   if(wave_mode > PI_WAVE_MODE_REPEAT_SYNC)
     SOFT_ERROR(PI_BAD_WAVE_MODE, "bad wave mode (%d)", wave_mode);
 
+  if(waveStreamSegs)
+    SOFT_ERROR(PI_WAVE_TX_BUSY, "wave stream open");
+
+  /* the async compiler may be changing the wave table */
+
+  pthread_mutex_lock(&waveMutex);
+
+  if((wave_id >= waveOutCount) || waveInfo[wave_id].deleted) {
+    pthread_mutex_unlock(&waveMutex);
+    SOFT_ERROR(PI_BAD_WAVE_ID, "bad wave id (%d)", wave_id);
+  }
+
   if(!waveClockInited) {
     stopHardwarePWM();
     initClock(0); /* initialise secondary clock */
@@ -9286,6 +13130,8 @@ gpioWaveTxSend(unsigned wave_id, unsigned wave_mode) {
     PWMClockInited = 0;
   }
 
+  pthread_mutex_lock(&dmaOutMutex);
+
   if(wave_mode < PI_WAVE_MODE_ONE_SHOT_SYNC)
     initKillDMA(dmaOut);
 
@@ -9308,10 +13154,16 @@ gpioWaveTxSend(unsigned wave_id, unsigned wave_mode) {
 
   waveEndPtr = &p->next;
 
+  pthread_mutex_unlock(&dmaOutMutex);
+
   /* for compatability with the deprecated gpioWaveTxStart return the
      number of cbs
   */
-  return (waveInfo[wave_id].topCB - waveInfo[wave_id].botCB) + 1;
+  cbs = (waveInfo[wave_id].topCB - waveInfo[wave_id].botCB) + 1;
+
+  pthread_mutex_unlock(&waveMutex);
+
+  return cbs;
 }
 
 /* ----------------------------------------------------------------------- */
@@ -9485,205 +13337,489 @@ chainMakeCounter(unsigned counter, unsigned blklen, unsigned blocks, unsigned co
   for(b = 0; b < (blocks * (blklen + 1)); b++) chainSetCntVal(counter, b + (blocks * (blklen + 1)), chainGetCntVal(counter, b));
 }
 
-int
-gpioWaveChain(char* buf, unsigned bufSize) {
-  unsigned blklen = 16, blocks = 4;
-  int cb, chaincb;
-  rawCbs_t* p;
-  int i, wid, cmd, loop, counters;
-  unsigned cycles, delayCBs, dcb, delayLeft;
-  uint32_t repeat, next, *endPtr;
-  int stk_pos[10], stk_lev = 0;
+static int
+chainBodyActive(chainOp_t* ops, int from, int to) {
+  int i;
 
-  cb = 0;
-  loop = -1;
+  /* does the loop body make any cbs */
 
-  DBG(DBG_USER, "bufSize=%d [%s]", bufSize, myBuf2Str(bufSize, buf));
+  for(i = from; i < to; i++) {
+    if((ops[i].op == CHAIN_OP_WAVE) || ((ops[i].op == CHAIN_OP_DELAY) && ops[i].arg))
+      return 1;
+  }
 
-  CHECK_INITED;
+  return 0;
+}
 
-  if(!waveClockInited) {
-    stopHardwarePWM();
-    initClock(0); /* initialise secondary clock */
-    waveClockInited = 1;
-    PWMClockInited = 0;
-  }
+/* ----------------------------------------------------------------------- */
 
-  initKillDMA(dmaOut);
+static int
+chainParse(char* buf, unsigned bufSize, chainOp_t* ops, int* stack) {
+  unsigned i;
+  int n, lev, wid, cmd, loop;
+  uint32_t val;
 
-  waveEndPtr = NULL;
-  endPtr = NULL;
+  /* stage one, check the chain and turn it into ops */
 
-  /* add delay cb at start of DMA */
+  n = 0;
+  lev = 0;
+  val = 0;
 
-  p = rawWaveCBAdr(chainGetCB(cb++));
+  i = 0;
 
-  /* use the secondary clock */
+  while(i < bufSize) {
+    wid = (unsigned char)buf[i];
 
-  if(gpioCfg.clockPeriph != PI_CLOCK_PCM) {
-    p->info = NORMAL_DMA | TIMED_DMA(2);
-    p->dst = PCM_TIMER;
-  } else {
-    p->info = NORMAL_DMA | TIMED_DMA(5);
-    p->dst = PWM_TIMER;
-  }
+    if(wid != 255) {
+      if((wid >= waveOutCount) || waveInfo[wid].deleted)
+        SOFT_ERROR(PI_BAD_WAVE_ID, "undefined wave (%d) (at %d)", wid, i);
 
-  // cast twice to suppress warning, I belive this is ok as dmaOBus
-  // contains bus addresses not virtual addresses. --plugwash
-  p->src = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
-  p->length = BPD * 20 / PI_WF_MICROS; /* 20 micros delay */
-  p->next = waveCbPOadr(chainGetCB(cb));
+      ops[n].op = CHAIN_OP_WAVE;
+      ops[n].pos = i;
+      ops[n].arg = wid;
+      n++;
 
-  counters = 0;
-  wid = -1;
+      i += 1;
+      continue;
+    }
 
-  i = 0;
+    if((i + 2) > bufSize)
+      SOFT_ERROR(PI_BAD_CHAIN_CMD, "incomplete chain command (at %d)", i);
 
-  while(i < bufSize) {
-    wid = (unsigned)buf[i];
+    cmd = (unsigned char)buf[i + 1];
 
-    if(wid == 255) /* wave command */
-    {
-      if((i + 2) > bufSize)
+    if((cmd == 1) || (cmd == 2)) {
+      if((i + 4) > bufSize)
         SOFT_ERROR(PI_BAD_CHAIN_CMD, "incomplete chain command (at %d)", i);
 
-      cmd = buf[i + 1];
+      val = ((unsigned char)buf[i + 3] << 8) + (unsigned char)buf[i + 2];
+    }
+
+    ops[n].pos = i;
 
-      if(cmd == 0) /* loop begin */
-      {
-        if(stk_lev >= (sizeof(stk_pos) / sizeof(int)))
-          SOFT_ERROR(PI_CHAIN_NESTING, "chain counters nested too deep (at %d)", i);
+    switch(cmd) {
+      case 0: /* loop begin */
+        stack[lev++] = n;
 
-        stk_pos[stk_lev++] = cb;
+        ops[n].op = CHAIN_OP_BEGIN;
+        ops[n].arg = 0;
+        n++;
 
         i += 2;
-      } else if(cmd == 1) /* loop end */
-      {
-        if(counters >= WCB_COUNTERS)
-          SOFT_ERROR(PI_CHAIN_COUNTER, "too many chain counters (at %d)", i);
+        break;
 
-        if((i + 4) > bufSize)
-          SOFT_ERROR(PI_BAD_CHAIN_CMD, "incomplete chain command (at %d)", i);
+      case 1: /* loop end */
+      case 3: /* repeat loop forever */
+        if(!lev)
+          SOFT_ERROR(PI_BAD_CHAIN_LOOP, "loop end without loop start (at %d)", i);
 
-        loop = 0;
-        if(--stk_lev >= 0)
-          loop = stk_pos[stk_lev];
+        loop = stack[--lev];
 
-        if((loop < 1) || (loop == cb))
+        if(!chainBodyActive(ops, loop + 1, n))
           SOFT_ERROR(PI_BAD_CHAIN_LOOP, "empty chain loop (at %d)", i);
 
-        cycles = ((unsigned)buf[i + 3] << 8) + (unsigned)buf[i + 2];
+        if(cmd == 1) {
+          if(val > PI_MAX_WAVE_CYCLES)
+            SOFT_ERROR(PI_CHAIN_LOOP_CNT, "bad chain loop count (%d) (at %d)", val, i);
+
+          ops[n].op = CHAIN_OP_END;
+          ops[n].arg = val;
+
+          i += 4;
+        } else {
+          if((i + 2) < bufSize)
+            SOFT_ERROR(PI_BAD_FOREVER, "loop forever must be last command (at %d)", i);
+
+          ops[n].op = CHAIN_OP_FOREVER;
+          ops[n].arg = 0;
+
+          i += 2;
+        }
+
+        ops[loop].arg = n;
+        n++;
+        break;
+
+      case 2: /* delay us */
+        if(val > PI_MAX_WAVE_DELAY)
+          SOFT_ERROR(PI_BAD_CHAIN_DELAY, "bad chain delay micros (%d) (at %d)", val, i);
+
+        ops[n].op = CHAIN_OP_DELAY;
+        ops[n].arg = val;
+        n++;
 
         i += 4;
+        break;
+
+      default: SOFT_ERROR(PI_BAD_CHAIN_CMD, "unknown chain command (255 %d) (at %d)", cmd, i);
+    }
+  }
 
-        if(cycles > PI_MAX_WAVE_CYCLES)
-          SOFT_ERROR(PI_CHAIN_LOOP_CNT, "bad chain loop count (%d)", cycles);
+  /* a loop start with no end does nothing, make it an empty delay */
 
-        if(cycles == 0) {
-          /* Skip the complete loop block.  Change
-             the next pointing to the start of the
-             loop block to the current cb.
-          */
-          p = rawWaveCBAdr(chainGetCB(loop));
-          p->next = waveCbPOadr(chainGetCB(cb));
-        } else if(cycles == 1) {
-          /* Nothing to do, no need for a counter. */
-        } else {
-          chaincb = chainGetCB(cb++);
-          if(chaincb < 0)
-            SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+  while(lev) {
+    loop = stack[--lev];
 
-          p = rawWaveCBAdr(chaincb);
+    ops[loop].op = CHAIN_OP_DELAY;
+    ops[loop].arg = 0;
+  }
+
+  return n;
+}
 
-          repeat = waveCbPOadr(chainGetCB(loop));
+/* ----------------------------------------------------------------------- */
 
-          /* Need to check next cb as well. */
+static int
+chainMatch(chainOp_t* ops, int begin) {
+  int i, depth;
 
-          chaincb = chainGetCB(cb);
+  /* the end of the loop starting at begin */
 
-          if(chaincb < 0)
-            SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+  depth = 0;
 
-          next = waveCbPOadr(chainGetCB(cb));
+  for(i = begin;; i++) {
+    if(ops[i].op == CHAIN_OP_BEGIN)
+      depth++;
+    else if((ops[i].op == CHAIN_OP_END) || (ops[i].op == CHAIN_OP_FOREVER)) {
+      if(--depth == 0)
+        return i;
+    }
+  }
+}
 
-          /* dummy src and dest */
-          p->info = NORMAL_DMA;
-          // cast twice to suppress warning, I belive this is ok as dmaOBus
-          // contains bus addresses not virtual addresses. --plugwash
-          p->src = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
-          p->dst = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
-          p->length = 4;
-          p->next = waveCbPOadr(chainGetCntCB(counters));
+/* ----------------------------------------------------------------------- */
+
+static int
+chainHasLoop(chainOp_t* ops, int from, int to) {
+  int i;
 
-          chainMakeCounter(counters, blklen, blocks, cycles - 1, repeat, next);
+  for(i = from; i < to; i++) {
+    if(ops[i].op == CHAIN_OP_BEGIN)
+      return 1;
+  }
 
-          counters++;
-        }
-      } else if(cmd == 2) /* delay us */
-      {
-        if((i + 4) > bufSize)
-          SOFT_ERROR(PI_BAD_CHAIN_CMD, "incomplete chain command (at %d)", i);
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+chainSameOps(chainOp_t* a, chainOp_t* b, int len) {
+  int i;
+
+  for(i = 0; i < len; i++) {
+    if((a[i].op != b[i].op) || (a[i].arg != b[i].arg))
+      return 0;
+  }
+
+  return 1;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+chainOptimise(chainOp_t* in, int from, int to, chainOp_t* out, int n) {
+  int i, s, len, end, prev, inner;
+  uint32_t count;
+
+  /*
+     Stage two, copy in[from, to) to out[n] onwards.  Loops run 0
+     times are dropped, loops run once are inlined, a loop whose body
+     is a single loop takes one counter for both, a loop repeating the
+     loop before it adds its count to that loop's counter, and small
+     loops are unrolled.  Loop ends in out hold the count, loop
+     starts nothing.
+  */
+
+  prev = -1; /* start of the loop just emitted, if the last thing */
+
+  for(i = from; i < to; i++) {
+    if(in[i].op != CHAIN_OP_BEGIN) {
+      if((in[i].op != CHAIN_OP_DELAY) || in[i].arg) {
+        out[n++] = in[i];
+        prev = -1;
+      }
+      continue;
+    }
+
+    end = in[i].arg;
+    count = in[end].arg;
+
+    if((in[end].op == CHAIN_OP_END) && (count == 0)) {
+      i = end;
+      continue;
+    }
+
+    s = n;
+    out[n++] = in[i];
+
+    n = chainOptimise(in, i + 1, end, out, n);
+
+    len = n - s - 1;
+    i = end;
+
+    if(in[end].op == CHAIN_OP_FOREVER) {
+      out[n++] = in[end];
+      prev = -1;
+      continue;
+    }
+
+    if(!len || (count == 1)) {
+      memmove(&out[s], &out[s + 1], len * sizeof(chainOp_t));
+      n--;
+      prev = -1;
+      continue;
+    }
+
+    inner = (out[s + 1].op == CHAIN_OP_BEGIN) ? chainMatch(out, s + 1) : -1;
+
+    if((inner == (n - 1)) && (out[inner].op == CHAIN_OP_END) && ((count * out[inner].arg) <= PI_MAX_WAVE_CYCLES)) {
+      out[inner].arg *= count;
+      memmove(&out[s], &out[s + 1], len * sizeof(chainOp_t));
+      n--;
+      prev = s;
+      continue;
+    }
+
+    if((prev >= 0) && ((s - prev - 2) == len) && chainSameOps(&out[prev + 1], &out[s + 1], len) &&
+       ((out[s - 1].arg + count) <= PI_MAX_WAVE_CYCLES)) {
+      out[s - 1].arg += count;
+      n = s;
+      continue;
+    }
+
+    if(!chainHasLoop(out, s + 1, n) && (((count - 1) * len) <= CHAIN_UNROLL_OPS)) {
+      memmove(&out[s], &out[s + 1], len * sizeof(chainOp_t));
+      n--;
+
+      while(--count) {
+        memcpy(&out[n], &out[s], len * sizeof(chainOp_t));
+        n += len;
+      }
+
+      prev = -1;
+      continue;
+    }
+
+    out[s].arg = 0;
+    out[n] = in[end];
+    n++;
+
+    prev = s;
+  }
+
+  return n;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+chainMergeDelays(chainOp_t* ops, int numOps) {
+  int i, n;
+
+  /* adjacent delays become one */
+
+  n = 0;
+
+  for(i = 0; i < numOps; i++) {
+    if((ops[i].op == CHAIN_OP_DELAY) && n && (ops[n - 1].op == CHAIN_OP_DELAY) && ((ops[n - 1].arg + ops[i].arg) <= CHAIN_MAX_DELAY))
+      ops[n - 1].arg += ops[i].arg;
+    else
+      ops[n++] = ops[i];
+  }
+
+  return n;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+chainCompile(char* buf, unsigned bufSize, chainOp_t* ops, chainOp_t* out, int* stack) {
+  int i, n, cbs, counters;
 
-        cycles = ((unsigned)buf[i + 3] << 8) + (unsigned)buf[i + 2];
+  n = chainParse(buf, bufSize, ops, stack);
+
+  if(n < 0)
+    return n;
+
+  n = chainOptimise(ops, 0, n, out, 0);
+
+  n = chainMergeDelays(out, n);
+
+  /* check the resources before the current output is disturbed */
+
+  cbs = 2; /* start delay and final cb */
+  counters = 0;
+
+  for(i = 0; i < n; i++) {
+    switch(out[i].op) {
+      case CHAIN_OP_WAVE: cbs++; break;
+
+      case CHAIN_OP_DELAY: cbs += waveDelayCBs(out[i].arg); break;
+
+      case CHAIN_OP_END:
+        cbs++;
+        counters++;
+        break;
+
+      case CHAIN_OP_FOREVER:
+        /* whatever was in the loop was optimised away */
+
+        if(out[i - 1].op == CHAIN_OP_BEGIN)
+          SOFT_ERROR(PI_BAD_CHAIN_LOOP, "empty chain loop (at %d)", out[i].pos);
+
+        cbs++;
+        break;
+    }
+  }
+
+  DBG(DBG_USER, "%d ops, %d cbs, %d counters", n, cbs, counters);
+
+  if(counters > WCB_COUNTERS)
+    SOFT_ERROR(PI_CHAIN_COUNTER, "too many chain counters (%d)", counters);
+
+  if(cbs > (WCB_CHAIN_CBS * PI_WAVE_COUNT_PAGES))
+    SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d cbs)", cbs);
+
+  return n;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+gpioWaveChain(char* buf, unsigned bufSize) {
+  unsigned blklen = 16, blocks = 4;
+  int cb, chaincb, nextcb, loopcb;
+  rawCbs_t* p;
+  int i, k, lev, numOps, loop, counters, tooBig;
+  unsigned delayCBs, dcb, delayLeft;
+  uint32_t repeat, next, *endPtr;
+  chainOp_t *ops, *out;
+  int* stack;
+
+  DBG(DBG_USER, "bufSize=%d [%s]", bufSize, myBuf2Str(bufSize, buf));
+
+  CHECK_INITED;
+
+  CHECK_DMA;
+
+  if(waveStreamSegs)
+    SOFT_ERROR(PI_WAVE_TX_BUSY, "wave stream open");
+
+  /* every op takes at least a byte, unrolling adds a few per loop */
+
+  ops = malloc((bufSize + 1) * sizeof(chainOp_t));
+  out = malloc(((bufSize * 3) + CHAIN_UNROLL_OPS) * sizeof(chainOp_t));
+  stack = malloc((bufSize + 1) * sizeof(int));
+
+  /* the wave table is held until the chain's cbs are written */
+
+  pthread_mutex_lock(&waveMutex);
+
+  if(!ops || !out || !stack)
+    numOps = PI_NO_MEMORY;
+  else
+    numOps = chainCompile(buf, bufSize, ops, out, stack);
+
+  free(ops);
+
+  if(numOps < 0) {
+    pthread_mutex_unlock(&waveMutex);
+    free(out);
+    free(stack);
+    return numOps;
+  }
+
+  if(!waveClockInited) {
+    stopHardwarePWM();
+    initClock(0); /* initialise secondary clock */
+    waveClockInited = 1;
+    PWMClockInited = 0;
+  }
+
+  pthread_mutex_lock(&dmaOutMutex);
+
+  initKillDMA(dmaOut);
+
+  waveEndPtr = NULL;
+  endPtr = NULL;
+
+  cb = 0;
+  lev = 0;
+  counters = 0;
+  tooBig = 0;
+
+  /* add delay cb at start of DMA */
+
+  p = rawWaveCBAdr(chainGetCB(cb++));
 
-        i += 4;
+  /* use the secondary clock */
 
-        if(cycles > PI_MAX_WAVE_DELAY)
-          SOFT_ERROR(PI_BAD_CHAIN_DELAY, "bad chain delay micros (%d)", cycles);
+  if(gpioCfg.clockPeriph != PI_CLOCK_PCM) {
+    p->info = NORMAL_DMA | TIMED_DMA(2);
+    p->dst = PCM_TIMER;
+  } else {
+    p->info = NORMAL_DMA | TIMED_DMA(5);
+    p->dst = PWM_TIMER;
+  }
 
-        if(cycles) {
-          delayLeft = cycles;
-          delayCBs = waveDelayCBs(delayLeft);
-          for(dcb = 0; dcb < delayCBs; dcb++) {
-            chaincb = chainGetCB(cb++);
+  // cast twice to suppress warning, I belive this is ok as dmaOBus
+  // contains bus addresses not virtual addresses. --plugwash
+  p->src = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
+  p->length = BPD * 20 / PI_WF_MICROS; /* 20 micros delay */
+  p->next = waveCbPOadr(chainGetCB(cb));
 
-            if(chaincb < 0)
-              SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+  /*
+     stage three, the ops were checked to fit but each cb is still
+     checked so a miscount stops here rather than writing past the
+     chain pages
+  */
 
-            p = rawWaveCBAdr(chaincb);
+  for(k = 0; (k < numOps) && !tooBig; k++) {
+    switch(out[k].op) {
+      case CHAIN_OP_BEGIN: stack[lev++] = cb; break;
 
-            /* use the secondary clock */
+      case CHAIN_OP_END:
+        loop = stack[--lev];
 
-            if(gpioCfg.clockPeriph != PI_CLOCK_PCM) {
-              p->info = NORMAL_DMA | TIMED_DMA(2);
-              p->dst = PCM_TIMER;
-            } else {
-              p->info = NORMAL_DMA | TIMED_DMA(5);
-              p->dst = PWM_TIMER;
-            }
+        chaincb = chainGetCB(cb++);
+        loopcb = chainGetCB(loop);
+        nextcb = chainGetCB(cb);
 
-            // cast twice to suppress warning, I belive this is ok as dmaOBus
-            // contains bus addresses not virtual addresses. --plugwash
-            p->src = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
+        if((chaincb < 0) || (loopcb < 0) || (nextcb < 0)) {
+          tooBig = 1;
+          break;
+        }
 
-            p->length = BPD * delayLeft / PI_WF_MICROS;
+        p = rawWaveCBAdr(chaincb);
 
-            if((gpioCfg.DMAsecondaryChannel >= DMA_LITE_FIRST) && (p->length > DMA_LITE_MAX)) {
-              p->length = DMA_LITE_MAX;
-            }
+        repeat = waveCbPOadr(loopcb);
+        next = waveCbPOadr(nextcb);
 
-            delayLeft -= (p->length / BPD);
+        /* dummy src and dest */
+        p->info = NORMAL_DMA;
+        // cast twice to suppress warning, I belive this is ok as dmaOBus
+        // contains bus addresses not virtual addresses. --plugwash
+        p->src = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
+        p->dst = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
+        p->length = 4;
+        p->next = waveCbPOadr(chainGetCntCB(counters));
 
-            p->next = waveCbPOadr(chainGetCB(cb));
-          }
-        }
-      } else if(cmd == 3) /* repeat loop forever */
-      {
-        i += 2;
+        chainMakeCounter(counters, blklen, blocks, out[k].arg - 1, repeat, next);
 
-        loop = 0;
-        if(--stk_lev >= 0)
-          loop = stk_pos[stk_lev];
+        counters++;
+        break;
 
-        if((loop < 1) || (loop == cb))
-          SOFT_ERROR(PI_BAD_CHAIN_LOOP, "empty chain loop (at %d)", i);
+      case CHAIN_OP_FOREVER:
+        loop = stack[--lev];
 
         chaincb = chainGetCB(cb++);
-        if(chaincb < 0)
-          SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+        loopcb = chainGetCB(loop);
 
-        if(i < bufSize)
-          SOFT_ERROR(PI_BAD_FOREVER, "loop forever must be last command");
+        if((chaincb < 0) || (loopcb < 0)) {
+          tooBig = 1;
+          break;
+        }
 
         p = rawWaveCBAdr(chaincb);
 
@@ -9694,43 +13830,90 @@ gpioWaveChain(char* buf, unsigned bufSize) {
         p->src = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
         p->dst = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
         p->length = 4;
-        p->next = waveCbPOadr(chainGetCB(loop));
+        p->next = waveCbPOadr(loopcb);
         endPtr = &p->next;
-      } else
-        SOFT_ERROR(PI_BAD_CHAIN_CMD, "unknown chain command (255 %d)", cmd);
-    } else if((wid >= waveOutCount) || waveInfo[wid].deleted)
-      SOFT_ERROR(PI_BAD_WAVE_ID, "undefined wave (%d)", wid);
-    else {
-      chaincb = chainGetCB(cb++);
+        break;
 
-      if(chaincb < 0)
-        SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+      case CHAIN_OP_DELAY:
+        delayLeft = out[k].arg;
+        delayCBs = waveDelayCBs(delayLeft);
 
-      p = rawWaveCBAdr(chaincb);
+        for(dcb = 0; dcb < delayCBs; dcb++) {
+          chaincb = chainGetCB(cb++);
+          nextcb = chainGetCB(cb);
 
-      chaincb = chainGetCB(cb);
+          if((chaincb < 0) || (nextcb < 0)) {
+            tooBig = 1;
+            break;
+          }
 
-      if(chaincb < 0)
-        SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+          p = rawWaveCBAdr(chaincb);
 
-      chainSetVal(cb - 1, waveCbPOadr(chaincb));
+          /* use the secondary clock */
 
-      /* patch next of wid topCB to next cb */
+          if(gpioCfg.clockPeriph != PI_CLOCK_PCM) {
+            p->info = NORMAL_DMA | TIMED_DMA(2);
+            p->dst = PCM_TIMER;
+          } else {
+            p->info = NORMAL_DMA | TIMED_DMA(5);
+            p->dst = PWM_TIMER;
+          }
 
-      p->info = NORMAL_DMA;
-      p->src = chainGetValPadr(cb - 1);               /* this next */
-      p->dst = waveCbPOadr(waveInfo[wid].topCB) + 20; /* wid next */
-      p->length = 4;
-      p->next = waveCbPOadr(waveInfo[wid].botCB + 1);
+          // cast twice to suppress warning, I belive this is ok as dmaOBus
+          // contains bus addresses not virtual addresses. --plugwash
+          p->src = (uint32_t)(uintptr_t)(&dmaOBus[0]->periphData);
 
-      i += 1;
+          p->length = BPD * delayLeft / PI_WF_MICROS;
+
+          if((gpioCfg.DMAsecondaryChannel >= DMA_LITE_FIRST) && (p->length > DMA_LITE_MAX)) {
+            p->length = DMA_LITE_MAX;
+          }
+
+          delayLeft -= (p->length / BPD);
+
+          p->next = waveCbPOadr(nextcb);
+        }
+        break;
+
+      case CHAIN_OP_WAVE:
+        i = out[k].arg;
+
+        chaincb = chainGetCB(cb++);
+        nextcb = chainGetCB(cb);
+
+        if((chaincb < 0) || (nextcb < 0)) {
+          tooBig = 1;
+          break;
+        }
+
+        p = rawWaveCBAdr(chaincb);
+
+        chainSetVal(cb - 1, waveCbPOadr(nextcb));
+
+        /* patch next of wid topCB to next cb */
+
+        p->info = NORMAL_DMA;
+        p->src = chainGetValPadr(cb - 1);             /* this next */
+        p->dst = waveCbPOadr(waveInfo[i].topCB) + 20; /* wid next */
+        p->length = 4;
+        p->next = waveCbPOadr(waveInfo[i].botCB + 1);
+        break;
     }
   }
 
+  free(out);
+  free(stack);
+
   chaincb = chainGetCB(cb++);
 
-  if(chaincb < 0)
+  if(tooBig || (chaincb < 0)) {
+    /* the output was stopped and is left stopped */
+
+    pthread_mutex_unlock(&dmaOutMutex);
+    pthread_mutex_unlock(&waveMutex);
+
     SOFT_ERROR(PI_CHAIN_TOO_BIG, "chain is too long (%d)", cb);
+  }
 
   p = rawWaveCBAdr(chaincb);
 
@@ -9750,6 +13933,10 @@ gpioWaveChain(char* buf, unsigned bufSize) {
 
   waveEndPtr = endPtr;
 
+  pthread_mutex_unlock(&dmaOutMutex);
+
+  pthread_mutex_unlock(&waveMutex);
+
   return 0;
 }
 
@@ -9761,7 +13948,9 @@ gpioWaveTxBusy(void) {
 
   CHECK_INITED;
 
-  if(dmaOut[DMA_CONBLK_AD])
+  /* a large SPI or bit bang transfer may be borrowing the channel */
+
+  if(dmaOut[DMA_CONBLK_AD] && !spiDmaActive && !bbDmaActive)
     return 1;
   else
     return 0;
@@ -9771,7 +13960,7 @@ gpioWaveTxBusy(void) {
 
 int
 gpioWaveTxAt(void) {
-  int i, cb;
+  int i, cb, wid;
 
   DBG(DBG_USER, "");
 
@@ -9782,12 +13971,20 @@ gpioWaveTxAt(void) {
   if(cb < 0)
     return -cb;
 
-  for(i = 0; i < PI_MAX_WAVES; i++) {
-    if(!waveInfo[i].deleted && (cb >= waveInfo[i].botCB) && (cb <= waveInfo[i].topCB))
-      return i;
+  wid = PI_WAVE_NOT_FOUND;
+
+  pthread_mutex_lock(&waveMutex);
+
+  for(i = 0; i < waveOutCount; i++) {
+    if(!waveInfo[i].deleted && (cb >= waveInfo[i].botCB) && (cb <= waveInfo[i].topCB)) {
+      wid = i;
+      break;
+    }
   }
 
-  return PI_WAVE_NOT_FOUND;
+  pthread_mutex_unlock(&waveMutex);
+
+  return wid;
 }
 
 /* ----------------------------------------------------------------------- */
@@ -9798,10 +13995,19 @@ gpioWaveTxStop(void) {
 
   CHECK_INITED;
 
+  if(waveStreamSegs) {
+    waveStreamFlush();
+    return 0;
+  }
+
+  pthread_mutex_lock(&dmaOutMutex);
+
   initKillDMA(dmaOut);
 
   waveEndPtr = NULL;
 
+  pthread_mutex_unlock(&dmaOutMutex);
+
   return 0;
 }
 
@@ -9879,6 +14085,8 @@ gpioWaveGetCbs(void) {
 
   CHECK_INITED;
 
+  waveTrackMerge(); /* the CB count is only known once merged */
+
   return wfStats.cbs;
 }
 
@@ -9890,11 +14098,26 @@ gpioWaveGetHighCbs(void) {
 
   CHECK_INITED;
 
+  waveTrackMerge();
+
   return wfStats.highCbs;
 }
 
 /* ----------------------------------------------------------------------- */
 
+int
+gpioWaveGetRawCbs(void) {
+  DBG(DBG_USER, "");
+
+  CHECK_INITED;
+
+  waveTrackMerge();
+
+  return wfStats.rawCbs;
+}
+
+/* ----------------------------------------------------------------------- */
+
 int
 gpioWaveGetMaxCbs(void) {
   DBG(DBG_USER, "");
@@ -9906,6 +14129,132 @@ gpioWaveGetMaxCbs(void) {
 
 /* ----------------------------------------------------------------------- */
 
+static void
+bbWavePulse(bbWave_t* b, uint32_t on, uint32_t off, uint32_t flags, uint32_t delay) {
+  rawWave_t* p = &b->waves[b->pulses++];
+
+  p->gpioOn = on;
+  p->gpioOff = off;
+  p->flags = flags;
+  p->usDelay = delay;
+
+  if(flags & WAVE_FLAG_READ)
+    b->reads++;
+}
+
+static void
+bbWaveMode(bbWave_t* b, unsigned gpio, unsigned mode, uint32_t delay) {
+  int reg, shift;
+
+  reg = gpio / 10;
+  shift = (gpio % 10) * 3;
+
+  b->fsel[reg] = (b->fsel[reg] & ~(7 << shift)) | (mode << shift);
+
+  bbWavePulse(b, b->fsel[reg], 0, WAVE_FSEL(reg), delay);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+bbGoDMA(bbWave_t* b, uint32_t* levels) {
+  rawCbs_t* p;
+  int i, wid, status;
+  uint32_t start, expected, timeout;
+
+  /*
+  Sends the pulses of a bit bang transfer as a one-shot wave on the
+  secondary channel and returns the levels captured by its read
+  pulses, in order.  Returns -1 without sending if the wave can't be
+  compiled, the channel is busy, or its clock is in use by hardware
+  PWM, so the caller may bit bang instead.  Returns -2 if the wave
+  didn't finish.
+  */
+
+  if(PWMClockInited && !waveClockInited)
+    return -1;
+
+  wid = waveCompile(b->waves, b->pulses, 0);
+
+  if(wid < 0)
+    return -1;
+
+  /* the engine is started under waveMutex like any wave send */
+
+  pthread_mutex_lock(&waveMutex);
+
+  if(pthread_mutex_trylock(&dmaOutMutex)) {
+    pthread_mutex_unlock(&waveMutex);
+    gpioWaveDelete(wid);
+    return -1;
+  }
+
+  if(dmaOut[DMA_CONBLK_AD] || waveStreamSegs) {
+    pthread_mutex_unlock(&dmaOutMutex);
+    pthread_mutex_unlock(&waveMutex);
+    gpioWaveDelete(wid);
+    return -1;
+  }
+
+  bbDmaActive = 1;
+
+  if(!waveClockInited) {
+    stopHardwarePWM();
+    initClock(0); /* initialise secondary clock */
+    waveClockInited = 1;
+    PWMClockInited = 0;
+  }
+
+  p = rawWaveCBAdr(waveInfo[wid].topCB);
+
+  p->next = 0;
+
+  waveEndPtr = NULL; /* the wave is gone when this returns */
+
+  expected = 20;
+
+  for(i = 0; i < b->pulses; i++) expected += b->waves[i].usDelay;
+
+  timeout = (expected * 2) + 20000;
+
+  status = 0;
+
+  initDMAgo((uint32_t*)dmaOut, waveCbPOadr(waveInfo[wid].botCB));
+
+  /* dmaOutMutex keeps compaction off the wave until it is deleted */
+
+  pthread_mutex_unlock(&waveMutex);
+
+  /* sleep through most of the transfer rather than spin */
+
+  start = systReg[SYST_CLO];
+
+  if(expected > PI_MAX_BUSY_DELAY)
+    myGpioDelay(expected);
+
+  while(dmaOut[DMA_CONBLK_AD]) {
+    if((systReg[SYST_CLO] - start) > timeout) {
+      initKillDMA(dmaOut);
+      DBG(DBG_ALWAYS, "bit bang dma transfer of %d pulses timed out", b->pulses);
+      status = -2;
+      break;
+    }
+    myGpioSleep(0, 20);
+  }
+
+  for(i = 0; i < b->reads; i++) levels[i] = rawWaveGetOOL(waveInfo[wid].topOOL - 1 - i);
+
+  bbDmaActive = 0;
+
+  pthread_mutex_unlock(&dmaOutMutex);
+
+  gpioWaveDelete(wid);
+
+  return status;
+}
+
+/* ----------------------------------------------------------------------- */
+
 static int
 read_SDA(wfRx_t* w) {
   myGpioSetMode(w->I.SDA, PI_INPUT);
@@ -9986,43 +14335,192 @@ I2CPutBit(wfRx_t* w, int bit) {
   clear_SCL(w);
 }
 
-static int
-I2CGetBit(wfRx_t* w) {
-  int bit;
+static int
+I2CGetBit(wfRx_t* w) {
+  int bit;
+
+  set_SDA(w); /* let SDA float */
+  I2C_delay(w);
+  I2C_clock_stretch(w);
+  bit = read_SDA(w);
+  I2C_delay(w);
+  clear_SCL(w);
+
+  return bit;
+}
+
+static int
+I2CPutByte(wfRx_t* w, int byte) {
+  int bit, nack;
+
+  for(bit = 0; bit < 8; bit++) {
+    I2CPutBit(w, byte & 0x80);
+    byte <<= 1;
+  }
+
+  nack = I2CGetBit(w);
+
+  return nack;
+}
+
+static uint8_t
+I2CGetByte(wfRx_t* w, int nack) {
+  int bit, byte = 0;
+
+  for(bit = 0; bit < 8; bit++) { byte = (byte << 1) | I2CGetBit(w); }
+
+  I2CPutBit(w, nack);
+
+  return byte;
+}
+
+static void
+bbI2CWaveBit(wfRx_t* w, bbWave_t* b, int bit) {
+  int high;
+
+  /*
+  As I2CPutBit, and I2CGetBit which is I2CPutBit(1).  SDA and SCL
+  are released by making them inputs and pulled low by making them
+  outputs, their output levels are already low.  SDA and SCL are
+  read part way through the high half, SCL must be high or the
+  device was stretching the clock.
+  */
+
+  high = (w->I.delay + 1) / 2;
+
+  bbWaveMode(b, w->I.SDA, bit ? PI_INPUT : PI_OUTPUT, w->I.delay);
+  bbWaveMode(b, w->I.SCL, PI_INPUT, high);
+  bbWavePulse(b, 0, 0, WAVE_FLAG_READ, w->I.delay - high);
+  bbWaveMode(b, w->I.SCL, PI_OUTPUT, 0);
+}
+
+static int
+bbI2CUseDMA(wfRx_t* w, int bytes) {
+  return gpioCfg.bbDmaBytes && (bytes >= gpioCfg.bbDmaBytes) && (dmaLive > 0) && !w->I.stretched;
+}
+
+static int
+bbI2CXferDMA(wfRx_t* w, int addrByte, char* buf, int bytes, int rd) {
+  bbWave_t b;
+  uint32_t levels[BB_DMA_CHUNK * 9];
+  uint32_t* lev;
+  int bit, byte, pos, first, frames, f, err, status, failed, stretched;
+
+  /*
+  Sends the address byte and the data bytes of an I2C read or write
+  as dma waves of up to BB_DMA_CHUNK bytes.  Returns 1 if nothing
+  was sent so the caller may bit bang, otherwise 0 or the error.
+  If the channel becomes busy part way through the rest is bit
+  banged.  Clock stretching can't be followed by a wave, if it is
+  seen the transfer fails and the bus is bit banged from then on.
+  */
+
+  b.waves = malloc(BB_DMA_PULSES * sizeof(rawWave_t));
+
+  if(b.waves == NULL)
+    return 1;
+
+  failed = rd ? PI_I2C_READ_FAILED : PI_I2C_WRITE_FAILED;
+  status = 0;
+  stretched = 0;
+
+  *(gpioReg + GPCLR0) = (1 << w->I.SDA) | (1 << w->I.SCL);
+
+  pos = -1; /* the address byte */
+
+  while(pos < bytes) {
+    b.pulses = 0;
+    b.reads = 0;
+
+    /* no mode may change in these registers until the wave is done */
+
+    pthread_mutex_lock(&fselMutex);
+
+    b.fsel[w->I.SDA / 10] = *(gpioReg + GPFSEL0 + (w->I.SDA / 10));
+    b.fsel[w->I.SCL / 10] = *(gpioReg + GPFSEL0 + (w->I.SCL / 10));
+
+    first = pos;
+
+    for(frames = 0; (frames < BB_DMA_CHUNK) && (pos < bytes); frames++, pos++) {
+      if(pos < 0)
+        byte = addrByte;
+      else if(rd)
+        byte = 0xFF; /* let SDA float */
+      else
+        byte = buf[pos] & 0xFF;
+
+      for(bit = 0; bit < 8; bit++) {
+        bbI2CWaveBit(w, &b, byte & 0x80);
+        byte <<= 1;
+      }
+
+      if(rd && (pos >= 0))
+        bbI2CWaveBit(w, &b, pos == (bytes - 1)); /* ack or nack */
+      else
+        bbI2CWaveBit(w, &b, 1); /* device ack */
+    }
+
+    err = bbGoDMA(&b, levels);
+
+    pthread_mutex_unlock(&fselMutex);
+
+    if(err == -1) {
+      pos = first;
+      break;
+    }
+
+    if(err) {
+      status = failed;
+      pos = bytes;
+      break;
+    }
 
-  set_SDA(w); /* let SDA float */
-  I2C_delay(w);
-  I2C_clock_stretch(w);
-  bit = read_SDA(w);
-  I2C_delay(w);
-  clear_SCL(w);
+    for(f = 0; f < frames; f++) {
+      lev = levels + (f * 9);
+      byte = 0;
 
-  return bit;
-}
+      for(bit = 0; bit < 9; bit++) {
+        if(!(lev[bit] & (1 << w->I.SCL)))
+          stretched = 1;
 
-static int
-I2CPutByte(wfRx_t* w, int byte) {
-  int bit, nack;
+        if(bit < 8)
+          byte = (byte << 1) | ((lev[bit] >> w->I.SDA) & 1);
+      }
 
-  for(bit = 0; bit < 8; bit++) {
-    I2CPutBit(w, byte & 0x80);
-    byte <<= 1;
-  }
+      if((first + f) < 0) {
+        if(lev[8] & (1 << w->I.SDA))
+          status = failed; /* address nack */
+      } else if(rd)
+        buf[first + f] = byte;
+      else if((lev[8] & (1 << w->I.SDA)) && ((first + f) < (bytes - 1)))
+        status = failed;
+    }
 
-  nack = I2CGetBit(w);
+    if(stretched) {
+      DBG(DBG_ALWAYS, "SDA %d, clock stretched, dma disabled", w->I.SDA);
+      w->I.stretched = 1;
+      status = failed;
+      pos = bytes;
+      break;
+    }
 
-  return nack;
-}
+    if((first < 0) && status)
+      pos = bytes;
+  }
 
-static uint8_t
-I2CGetByte(wfRx_t* w, int nack) {
-  int bit, byte = 0;
+  free(b.waves);
 
-  for(bit = 0; bit < 8; bit++) { byte = (byte << 1) | I2CGetBit(w); }
+  if(pos < 0)
+    return 1;
 
-  I2CPutBit(w, nack);
+  for(; pos < bytes; pos++) {
+    if(rd)
+      buf[pos] = I2CGetByte(w, pos == (bytes - 1));
+    else if(I2CPutByte(w, buf[pos]) && (pos < (bytes - 1)))
+      status = failed;
+  }
 
-  return byte;
+  return status;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -10053,6 +14551,7 @@ bbI2COpen(unsigned SDA, unsigned SCL, unsigned baud) {
   wfRx[SDA].baud = baud;
 
   wfRx[SDA].I.started = 0;
+  wfRx[SDA].I.stretched = 0;
   wfRx[SDA].I.SDA = SDA;
   wfRx[SDA].I.SCL = SCL;
   wfRx[SDA].I.delay = 500000 / baud;
@@ -10100,7 +14599,7 @@ bbI2CClose(unsigned SDA) {
 
 int
 bbI2CZip(unsigned SDA, char* inBuf, unsigned inLen, char* outBuf, unsigned outLen) {
-  int i, ack, inPos, outPos, status, bytes;
+  int i, ack, inPos, outPos, status, bytes, dma;
   int addr, flags, esc, setesc;
   wfRx_t* w;
 
@@ -10163,6 +14662,18 @@ bbI2CZip(unsigned SDA, char* inBuf, unsigned inLen, char* outBuf, unsigned outLe
 
         bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
 
+        if((bytes > 0) && ((bytes + outPos) <= outLen) && bbI2CUseDMA(w, bytes)) {
+          dma = bbI2CXferDMA(w, (addr << 1) | 1, outBuf + outPos, bytes, 1);
+
+          if(dma <= 0) {
+            if(dma)
+              status = dma;
+            else
+              outPos += bytes;
+            break;
+          }
+        }
+
         if(bytes >= 0)
           ack = I2CPutByte(w, (addr << 1) | 1);
 
@@ -10183,6 +14694,16 @@ bbI2CZip(unsigned SDA, char* inBuf, unsigned inLen, char* outBuf, unsigned outLe
 
         bytes = myI2CGetPar(inBuf, &inPos, inLen, &esc);
 
+        if((bytes > 0) && ((bytes + inPos) <= inLen) && bbI2CUseDMA(w, bytes)) {
+          dma = bbI2CXferDMA(w, addr << 1, inBuf + inPos, bytes, 0);
+
+          if(dma <= 0) {
+            status = dma;
+            inPos += bytes;
+            break;
+          }
+        }
+
         if(bytes >= 0)
           ack = I2CPutByte(w, addr << 1);
 
@@ -10248,125 +14769,426 @@ bscInit(int mode) {
     ce = BSC_CE_N;
   }
 
-  if(mode > 1) /* SPI uses all GPIO */
-  {
-    gpioSetMode(scl, PI_ALT3);
-    gpioSetMode(mosi, PI_ALT3);
-    gpioSetMode(miso, PI_ALT3);
-    gpioSetMode(ce, PI_ALT3);
-  } else {
-    gpioSetMode(scl, PI_ALT3);
-    gpioSetMode(sda, PI_ALT3);
+  if(mode > 1) /* SPI uses all GPIO */
+  {
+    gpioSetMode(scl, PI_ALT3);
+    gpioSetMode(mosi, PI_ALT3);
+    gpioSetMode(miso, PI_ALT3);
+    gpioSetMode(ce, PI_ALT3);
+  } else {
+    gpioSetMode(scl, PI_ALT3);
+    gpioSetMode(sda, PI_ALT3);
+  }
+}
+
+void
+bscTerm(int mode) {
+  int sda, scl, mosi, miso, ce;
+
+  bscsReg[BSC_CR] = 0;  /* clear device */
+  bscsReg[BSC_RSR] = 0; /* clear underrun and overrun errors */
+  bscsReg[BSC_SLV] = 0; /* clear I2C slave address */
+
+  if(pi_is_2711) {
+    sda = BSC_SDA_2711;
+    scl = BSC_SCL_SCLK_2711;
+    mosi = BSC_MOSI_2711;
+    miso = BSC_MISO_2711;
+    ce = BSC_CE_N_2711;
+  } else {
+    sda = BSC_SDA;
+    scl = BSC_SCL_SCLK;
+    mosi = BSC_MOSI;
+    miso = BSC_MISO;
+    ce = BSC_CE_N;
+  }
+
+  if(mode > 1) {
+    gpioSetMode(scl, PI_INPUT);
+    gpioSetMode(mosi, PI_INPUT);
+    gpioSetMode(miso, PI_INPUT);
+    gpioSetMode(ce, PI_INPUT);
+  } else {
+    gpioSetMode(sda, PI_INPUT);
+    gpioSetMode(scl, PI_INPUT);
+  }
+}
+
+int
+bscXfer(bsc_xfer_t* xfer) {
+  int copied = 0;
+  int active, mode;
+
+  DBG(DBG_USER,
+      "control=0x%X (sa=0x%X, cr=0x%X) tx=%d [%s]",
+      xfer->control,
+      ((xfer->control) >> 16) & 127,
+      (xfer->control) & 0x3fff,
+      xfer->txCnt,
+      myBuf2Str(xfer->txCnt, (char*)xfer->txBuf));
+
+  CHECK_INITED;
+
+  if(bscSvc.open)
+    SOFT_ERROR(PI_BSC_SERVICE_OPEN, "BSC in use by the slave service");
+
+  eventAlert[PI_EVENT_BSC].ignore = 1;
+
+  if(xfer->control) {
+    /*
+       bscMode (0=None, 1=I2C, 2=SPI) tracks which GPIO have been
+       set to BSC mode
+    */
+    if(xfer->control & 2)
+      mode = 2; /* SPI */
+    else
+      mode = 1; /* assume I2C */
+
+    if(mode > bscMode) {
+      bscInit(mode);
+      bscMode = mode;
+    }
+  } else {
+    if(bscMode)
+      bscTerm(bscMode);
+    bscMode = 0;
+    return 0; /* leave ignore set */
+  }
+
+  xfer->rxCnt = 0;
+
+  bscsReg[BSC_SLV] = ((xfer->control) >> 16) & 127;
+  bscsReg[BSC_CR] = (xfer->control) & 0x3fff;
+  bscsReg[BSC_RSR] = 0; /* clear underrun and overrun errors */
+
+  active = 1;
+
+  while(active) {
+    active = 0;
+
+    while((copied < xfer->txCnt) && (!(bscsReg[BSC_FR] & BSC_FR_TXFF))) {
+      bscsReg[BSC_DR] = xfer->txBuf[copied++];
+      active = 1;
+    }
+
+    while((xfer->rxCnt < BSC_FIFO_SIZE) && (!(bscsReg[BSC_FR] & BSC_FR_RXFE))) {
+      xfer->rxBuf[xfer->rxCnt++] = bscsReg[BSC_DR];
+      active = 1;
+    }
+
+    if(!active) {
+      active = bscsReg[BSC_FR] & (BSC_FR_RXBUSY | BSC_FR_TXBUSY);
+    }
+
+    if(active)
+      myGpioSleep(0, 20);
+  }
+
+  bscFR = bscsReg[BSC_FR] & 0xffff;
+
+  eventAlert[PI_EVENT_BSC].ignore = 0;
+
+  return (copied << 16) | bscFR;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+bscServiceFill(bscService_t* b) {
+  /* called with bscSvcMutex locked */
+
+  while((b->txTail != b->txHead) && !(bscsReg[BSC_FR] & BSC_FR_TXFF)) {
+    bscsReg[BSC_DR] = b->tx[b->txTail++ % PI_BSC_SERVICE_TX];
+    b->txFifo++;
+  }
+}
+
+static void
+bscServiceEnd(bscService_t* b) {
+  /* called with bscSvcMutex locked, queue the finished transaction */
+
+  if((b->transHead - b->transTail) < PI_BSC_SERVICE_TRANS) {
+    b->trans[b->transHead++ % PI_BSC_SERVICE_TRANS] = b->cur;
+    b->rxCommit = b->rxHead;
+  } else {
+    b->stats.transDropped++;
+    b->rxHead = b->rxCommit; /* its bytes go too */
+  }
+
+  b->stats.transactions++;
+
+  memset(&b->cur, 0, sizeof(bscTrans_t));
+
+  b->active = 0;
+}
+
+static void
+bscServiceTick(uint32_t tick) {
+  bscService_t* b = &bscSvc;
+  uint32_t rsr, level;
+  int moved, sent;
+  char c;
+
+  /*
+  Called by the alert thread every batch while the service is open.
+  A transaction ends at the first batch which moves no bytes while
+  the slave is not receiving.
+  */
+
+  pthread_mutex_lock(&bscSvcMutex);
+
+  if(!b->open) {
+    pthread_mutex_unlock(&bscSvcMutex);
+    return;
+  }
+
+  moved = 0;
+
+  while(!(bscsReg[BSC_FR] & BSC_FR_RXFE)) {
+    c = bscsReg[BSC_DR];
+
+    if((b->rxHead - b->rxTail) < PI_BSC_SERVICE_RX) {
+      b->rx[b->rxHead++ % PI_BSC_SERVICE_RX] = c;
+      b->cur.rxCnt++;
+    } else {
+      b->stats.rxDropped++;
+      b->cur.flags |= PI_BSC_TRANS_RX_OVERRUN;
+    }
+
+    b->stats.rxBytes++;
+    moved = 1;
+  }
+
+  /* what the transmit FIFO lost was read by the master */
+
+  level = (bscsReg[BSC_FR] >> 6) & 0x1F;
+
+  sent = (level < b->txFifo) ? (b->txFifo - level) : 0;
+
+  b->txFifo = level;
+
+  if(sent) {
+    if((b->cur.txCnt + sent) <= 0xFFFF)
+      b->cur.txCnt += sent;
+    b->stats.txBytes += sent;
+    moved = 1;
+  }
+
+  bscServiceFill(b);
+
+  rsr = bscsReg[BSC_RSR];
+
+  if(rsr & 3) {
+    if(rsr & 1) {
+      b->stats.fifoOverruns++;
+      b->cur.flags |= PI_BSC_TRANS_RX_OVERRUN;
+    }
+
+    if(rsr & 2) {
+      b->stats.txUnderruns++;
+      b->cur.flags |= PI_BSC_TRANS_TX_UNDERRUN;
+    }
+
+    bscsReg[BSC_RSR] = 0; /* clear underrun and overrun errors */
+    moved = 1;
+  }
+
+  if(moved) {
+    if(!b->active) {
+      b->active = 1;
+      b->cur.tick = tick;
+    }
+
+    b->cur.endTick = tick;
+  } else if(b->active && !(bscsReg[BSC_FR] & BSC_FR_RXBUSY)) {
+    bscServiceEnd(b);
+    eventAlert[PI_EVENT_BSC].fired = 1;
+  }
+
+  pthread_mutex_unlock(&bscSvcMutex);
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+bscServiceOpen(uint32_t control) {
+  int mode;
+
+  DBG(DBG_USER, "control=0x%X", control);
+
+  CHECK_INITED;
+
+  CHECK_DMA;
+
+  if(!control || (control & ~0x7F3FFF))
+    SOFT_ERROR(PI_BAD_PARAM, "bad BSC control (0x%X)", control);
+
+  pthread_mutex_lock(&bscSvcMutex);
+
+  if(bscSvc.open) {
+    pthread_mutex_unlock(&bscSvcMutex);
+    SOFT_ERROR(PI_BSC_SERVICE_OPEN, "BSC slave service already open");
+  }
+
+  if(control & BSC_CR_SPI)
+    mode = 2;
+  else
+    mode = 1; /* assume I2C */
+
+  if(mode > bscMode) {
+    bscInit(mode);
+    bscMode = mode;
+  }
+
+  memset(&bscSvc, 0, sizeof(bscSvc));
+
+  bscsReg[BSC_SLV] = (control >> 16) & 127;
+  bscsReg[BSC_CR] = control & 0x3fff;
+  bscsReg[BSC_RSR] = 0; /* clear underrun and overrun errors */
+
+  bscSvc.txFifo = (bscsReg[BSC_FR] >> 6) & 0x1F;
+
+  eventAlert[PI_EVENT_BSC].ignore = 0;
+
+  bscSvc.open = 1;
+
+  pthread_mutex_unlock(&bscSvcMutex);
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+bscServiceClose(void) {
+  DBG(DBG_USER, "");
+
+  CHECK_INITED;
+
+  pthread_mutex_lock(&bscSvcMutex);
+
+  if(!bscSvc.open) {
+    pthread_mutex_unlock(&bscSvcMutex);
+    SOFT_ERROR(PI_BSC_NO_SERVICE, "BSC slave service not open");
   }
+
+  bscSvc.open = 0;
+
+  if(bscSvc.active)
+    bscServiceEnd(&bscSvc);
+
+  if(bscMode)
+    bscTerm(bscMode);
+
+  bscMode = 0;
+
+  pthread_mutex_unlock(&bscSvcMutex);
+
+  return 0;
 }
 
-void
-bscTerm(int mode) {
-  int sda, scl, mosi, miso, ce;
+/* ----------------------------------------------------------------------- */
 
-  bscsReg[BSC_CR] = 0;  /* clear device */
-  bscsReg[BSC_RSR] = 0; /* clear underrun and overrun errors */
-  bscsReg[BSC_SLV] = 0; /* clear I2C slave address */
+int
+bscServiceWrite(char* txBuf, unsigned count) {
+  bscService_t* b = &bscSvc;
+  unsigned n;
 
-  if(pi_is_2711) {
-    sda = BSC_SDA_2711;
-    scl = BSC_SCL_SCLK_2711;
-    mosi = BSC_MOSI_2711;
-    miso = BSC_MISO_2711;
-    ce = BSC_CE_N_2711;
-  } else {
-    sda = BSC_SDA;
-    scl = BSC_SCL_SCLK;
-    mosi = BSC_MOSI;
-    miso = BSC_MISO;
-    ce = BSC_CE_N;
-  }
+  DBG(DBG_USER, "count=%d [%s]", count, myBuf2Str(count, txBuf));
 
-  if(mode > 1) {
-    gpioSetMode(scl, PI_INPUT);
-    gpioSetMode(mosi, PI_INPUT);
-    gpioSetMode(miso, PI_INPUT);
-    gpioSetMode(ce, PI_INPUT);
-  } else {
-    gpioSetMode(sda, PI_INPUT);
-    gpioSetMode(scl, PI_INPUT);
+  CHECK_INITED;
+
+  if(!txBuf && count)
+    SOFT_ERROR(PI_BAD_POINTER, "null transmit buffer");
+
+  pthread_mutex_lock(&bscSvcMutex);
+
+  if(!b->open) {
+    pthread_mutex_unlock(&bscSvcMutex);
+    SOFT_ERROR(PI_BSC_NO_SERVICE, "BSC slave service not open");
   }
+
+  for(n = 0; (n < count) && ((b->txHead - b->txTail) < PI_BSC_SERVICE_TX); n++) b->tx[b->txHead++ % PI_BSC_SERVICE_TX] = txBuf[n];
+
+  bscServiceFill(b);
+
+  pthread_mutex_unlock(&bscSvcMutex);
+
+  return n;
 }
 
-int
-bscXfer(bsc_xfer_t* xfer) {
-  static int bscMode = 0;
+/* ----------------------------------------------------------------------- */
 
-  int copied = 0;
-  int active, mode;
+int
+bscServiceRead(bscTrans_t* trans, unsigned maxTrans, char* rxBuf, unsigned rxLen) {
+  bscService_t* b = &bscSvc;
+  bscTrans_t* t;
+  unsigned n, pos, i, len;
 
-  DBG(DBG_USER,
-      "control=0x%X (sa=0x%X, cr=0x%X) tx=%d [%s]",
-      xfer->control,
-      ((xfer->control) >> 16) & 127,
-      (xfer->control) & 0x3fff,
-      xfer->txCnt,
-      myBuf2Str(xfer->txCnt, (char*)xfer->txBuf));
+  DBG(DBG_USER, "maxTrans=%d rxLen=%d", maxTrans, rxLen);
 
   CHECK_INITED;
 
-  eventAlert[PI_EVENT_BSC].ignore = 1;
+  if(!trans && maxTrans)
+    SOFT_ERROR(PI_BAD_POINTER, "null transaction buffer");
 
-  if(xfer->control) {
-    /*
-       bscMode (0=None, 1=I2C, 2=SPI) tracks which GPIO have been
-       set to BSC mode
-    */
-    if(xfer->control & 2)
-      mode = 2; /* SPI */
-    else
-      mode = 1; /* assume I2C */
+  if(!rxBuf && rxLen)
+    SOFT_ERROR(PI_BAD_POINTER, "null receive buffer");
 
-    if(mode > bscMode) {
-      bscInit(mode);
-      bscMode = mode;
-    }
-  } else {
-    if(bscMode)
-      bscTerm(bscMode);
-    bscMode = 0;
-    return 0; /* leave ignore set */
-  }
+  pthread_mutex_lock(&bscSvcMutex);
 
-  xfer->rxCnt = 0;
+  n = 0;
+  pos = 0;
 
-  bscsReg[BSC_SLV] = ((xfer->control) >> 16) & 127;
-  bscsReg[BSC_CR] = (xfer->control) & 0x3fff;
-  bscsReg[BSC_RSR] = 0; /* clear underrun and overrun errors */
+  while((n < maxTrans) && (b->transTail != b->transHead)) {
+    t = &b->trans[b->transTail % PI_BSC_SERVICE_TRANS];
 
-  active = 1;
+    len = t->rxCnt;
 
-  while(active) {
-    active = 0;
+    if((pos + len) > rxLen) {
+      if(n)
+        break;
 
-    while((copied < xfer->txCnt) && (!(bscsReg[BSC_FR] & BSC_FR_TXFF))) {
-      bscsReg[BSC_DR] = xfer->txBuf[copied++];
-      active = 1;
-    }
+      /* too big for an empty buffer, return what fits */
 
-    while((xfer->rxCnt < BSC_FIFO_SIZE) && (!(bscsReg[BSC_FR] & BSC_FR_RXFE))) {
-      xfer->rxBuf[xfer->rxCnt++] = bscsReg[BSC_DR];
-      active = 1;
+      len = rxLen;
+      t->flags |= PI_BSC_TRANS_RX_OVERRUN;
     }
 
-    if(!active) {
-      active = bscsReg[BSC_FR] & (BSC_FR_RXBUSY | BSC_FR_TXBUSY);
-    }
+    for(i = 0; i < len; i++) rxBuf[pos++] = b->rx[b->rxTail++ % PI_BSC_SERVICE_RX];
 
-    if(active)
-      myGpioSleep(0, 20);
+    b->rxTail += t->rxCnt - len;
+
+    trans[n] = *t;
+    trans[n].rxCnt = len;
+
+    b->transTail++;
+    n++;
   }
 
-  bscFR = bscsReg[BSC_FR] & 0xffff;
+  pthread_mutex_unlock(&bscSvcMutex);
 
-  eventAlert[PI_EVENT_BSC].ignore = 0;
+  return n;
+}
 
-  return (copied << 16) | bscFR;
+/* ----------------------------------------------------------------------- */
+
+int
+bscServiceStats(bscServiceStats_t* stats) {
+  DBG(DBG_USER, "stats=%08" PRIXPTR, (uintptr_t)stats);
+
+  CHECK_INITED;
+
+  if(!stats)
+    SOFT_ERROR(PI_BAD_POINTER, "null stats");
+
+  pthread_mutex_lock(&bscSvcMutex);
+
+  *stats = bscSvc.stats;
+
+  pthread_mutex_unlock(&bscSvcMutex);
+
+  return 0;
 }
 
 /* ----------------------------------------------------------------------- */
@@ -10487,6 +15309,106 @@ bbSPIXferByte(wfRx_t* w, char txByte) {
   return rxByte;
 }
 
+static int
+bbSPIXferDMA(wfRx_t* w, char* inBuf, char* outBuf, unsigned count) {
+  bbWave_t b;
+  uint32_t levels[BB_DMA_CHUNK * 8];
+  uint32_t sclk, mosi, setOn, setOff, half, bitOn, bitOff;
+  int pos, first, i, bit, err, flags;
+  uint8_t txByte, rxByte;
+
+  /*
+  As bbSPIXferByte for up to BB_DMA_CHUNK bytes per dma wave.
+  MISO is read at the same edge.  Returns the number of bytes
+  transferred, the caller bit bangs any rest if the channel
+  was busy.
+  */
+
+  b.waves = malloc(BB_DMA_PULSES * sizeof(rawWave_t));
+
+  if(b.waves == NULL)
+    return 0;
+
+  flags = w->S.spiFlags;
+
+  sclk = 1 << w->S.SCLK;
+  mosi = 1 << w->S.MOSI;
+
+  /* set_SCLK, clear_SCLK is the reverse */
+
+  setOn = PI_SPI_FLAGS_GET_CPOL(flags) ? 0 : sclk;
+  setOff = PI_SPI_FLAGS_GET_CPOL(flags) ? sclk : 0;
+
+  half = 500000 / w->baud;
+
+  pos = 0;
+
+  while(pos < count) {
+    b.pulses = 0;
+    b.reads = 0;
+
+    first = pos;
+
+    for(; (pos < count) && ((pos - first) < BB_DMA_CHUNK); pos++) {
+      txByte = inBuf[pos];
+
+      for(bit = 0; bit < 8; bit++) {
+        if(PI_SPI_FLAGS_GET_TX_LSB(flags)) {
+          bitOn = (txByte & 0x01) ? mosi : 0;
+          txByte >>= 1;
+        } else {
+          bitOn = (txByte & 0x80) ? mosi : 0;
+          txByte <<= 1;
+        }
+
+        bitOff = bitOn ^ mosi;
+
+        if(PI_SPI_FLAGS_GET_CPHA(flags)) {
+          /* write on set clock, read on clear clock */
+          bbWavePulse(&b, setOn | bitOn, setOff | bitOff, 0, half);
+          bbWavePulse(&b, setOff, setOn, WAVE_FLAG_READ, half);
+        } else {
+          /* write on clear clock, read on set clock */
+          bbWavePulse(&b, setOff | bitOn, setOn | bitOff, 0, half);
+          bbWavePulse(&b, setOn, setOff, WAVE_FLAG_READ, half);
+        }
+      }
+    }
+
+    if(!PI_SPI_FLAGS_GET_CPHA(flags))
+      bbWavePulse(&b, setOff, setOn, 0, 0);
+
+    err = bbGoDMA(&b, levels);
+
+    if(err == -1) {
+      pos = first;
+      break;
+    }
+
+    if(err) {
+      pos = PI_SPI_XFER_FAILED;
+      break;
+    }
+
+    for(i = first; i < pos; i++) {
+      rxByte = 0;
+
+      for(bit = 0; bit < 8; bit++) {
+        if(PI_SPI_FLAGS_GET_RX_LSB(flags))
+          rxByte = (rxByte >> 1) | (((levels[((i - first) * 8) + bit] >> w->S.MISO) & 1) << 7);
+        else
+          rxByte = (rxByte << 1) | ((levels[((i - first) * 8) + bit] >> w->S.MISO) & 1);
+      }
+
+      outBuf[i] = rxByte;
+    }
+  }
+
+  free(b.waves);
+
+  return pos;
+}
+
 /*-------------------------------------------------------------------------*/
 
 int
@@ -10666,12 +15588,22 @@ bbSPIXfer(unsigned CS, char* inBuf, char* outBuf, unsigned count) {
 
   bbSPIStart(w);
 
-  for(pos = 0; pos < count; pos++) { outBuf[pos] = bbSPIXferByte(w, inBuf[pos]); }
+  pos = 0;
+
+  if(gpioCfg.bbDmaBytes && (count >= gpioCfg.bbDmaBytes) && (dmaLive > 0))
+    pos = bbSPIXferDMA(w, inBuf, outBuf, count);
+
+  if(pos >= 0) {
+    for(; pos < count; pos++) { outBuf[pos] = bbSPIXferByte(w, inBuf[pos]); }
+  }
 
   bbSPIStop(w);
 
   wfRx_unlock(SCLK);
 
+  if(pos < 0)
+    SOFT_ERROR(PI_SPI_XFER_FAILED, "CS %d, dma transfer timed out", CS);
+
   return count;
 }
 
@@ -10679,12 +15611,14 @@ bbSPIXfer(unsigned CS, char* inBuf, char* outBuf, unsigned count) {
 
 int
 gpioSerialReadOpen(unsigned gpio, unsigned baud, unsigned data_bits) {
-  int bitTime, timeout;
+  int bitTime;
 
   DBG(DBG_USER, "gpio=%d baud=%d data_bits=%d", gpio, baud, data_bits);
 
   CHECK_INITED;
 
+  CHECK_DMA;
+
   if(gpio > PI_MAX_USER_GPIO)
     SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
@@ -10699,10 +15633,7 @@ gpioSerialReadOpen(unsigned gpio, unsigned baud, unsigned data_bits) {
 
   bitTime = (1000 * MILLION) / baud; /* nanos */
 
-  timeout = ((data_bits + 2) * bitTime) / MILLION; /* millis */
-
-  if(timeout < 1)
-    timeout = 1;
+  pthread_mutex_lock(&wfRxSerialMutex);
 
   wfRx[gpio].gpio = gpio;
   wfRx[gpio].mode = PI_WFRX_SERIAL;
@@ -10710,7 +15641,6 @@ gpioSerialReadOpen(unsigned gpio, unsigned baud, unsigned data_bits) {
 
   wfRx[gpio].s.buf = malloc(SRX_BUF_SIZE);
   wfRx[gpio].s.bufSize = SRX_BUF_SIZE;
-  wfRx[gpio].s.timeout = timeout;
   wfRx[gpio].s.fullBit = bitTime;             /* nanos */
   wfRx[gpio].s.halfBit = (bitTime / 2) + 500; /* nanos (500 for rounding) */
   wfRx[gpio].s.readPos = 0;
@@ -10718,6 +15648,10 @@ gpioSerialReadOpen(unsigned gpio, unsigned baud, unsigned data_bits) {
   wfRx[gpio].s.bit = -1;
   wfRx[gpio].s.dataBits = data_bits;
   wfRx[gpio].s.invert = PI_BB_SER_NORMAL;
+  wfRx[gpio].s.parity = PI_BB_SER_PARITY_NONE;
+  wfRx[gpio].s.level = (reportedLevel >> gpio) & 1;
+
+  memset(&wfRx[gpio].s.stats, 0, sizeof(gpioSerialStats_t));
 
   if(data_bits < 9)
     wfRx[gpio].s.bytes = 1;
@@ -10726,7 +15660,15 @@ gpioSerialReadOpen(unsigned gpio, unsigned baud, unsigned data_bits) {
   else
     wfRx[gpio].s.bytes = 4;
 
-  gpioSetAlertFunc(gpio, waveRxBit);
+  /* decoded by the alert thread from its sample batches */
+
+  wfRxSerialLevel = (wfRxSerialLevel & ~BIT) | (reportedLevel & BIT);
+
+  wfRxSerialBits |= BIT;
+
+  pthread_mutex_unlock(&wfRxSerialMutex);
+
+  monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits | wfRxSerialBits;
 
   return 0;
 }
@@ -10748,8 +15690,66 @@ gpioSerialReadInvert(unsigned gpio, unsigned invert) {
   if((invert < PI_BB_SER_NORMAL) || (invert > PI_BB_SER_INVERT))
     SOFT_ERROR(PI_BAD_SER_INVERT, "bad invert level for gpio %d (%d)", gpio, invert);
 
+  pthread_mutex_lock(&wfRxSerialMutex);
+
+  if(wfRx[gpio].s.invert != invert) {
+    wfRx[gpio].s.level = !wfRx[gpio].s.level;
+    wfRx[gpio].s.bit = -1;
+  }
+
   wfRx[gpio].s.invert = invert;
 
+  pthread_mutex_unlock(&wfRxSerialMutex);
+
+  return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int
+gpioSerialReadParity(unsigned gpio, unsigned parity) {
+  DBG(DBG_USER, "gpio=%d parity=%d", gpio, parity);
+
+  CHECK_INITED;
+
+  if(gpio > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+  if(wfRx[gpio].mode != PI_WFRX_SERIAL)
+    SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
+
+  if(parity > PI_BB_SER_PARITY_EVEN)
+    SOFT_ERROR(PI_BAD_SER_PARITY, "bad parity for gpio %d (%d)", gpio, parity);
+
+  pthread_mutex_lock(&wfRxSerialMutex);
+
+  wfRx[gpio].s.bit = -1;
+  wfRx[gpio].s.parity = parity;
+
+  pthread_mutex_unlock(&wfRxSerialMutex);
+
+  return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+
+int
+gpioSerialReadStats(unsigned gpio, gpioSerialStats_t* stats) {
+  DBG(DBG_USER, "gpio=%d stats=%08" PRIXPTR, gpio, (uintptr_t)stats);
+
+  CHECK_INITED;
+
+  if(gpio > PI_MAX_USER_GPIO)
+    SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
+
+  if(wfRx[gpio].mode != PI_WFRX_SERIAL)
+    SOFT_ERROR(PI_NOT_SERIAL_GPIO, "no serial read on gpio (%d)", gpio);
+
+  if(!stats)
+    SOFT_ERROR(PI_BAD_POINTER, "stats can't be NULL");
+
+  memcpy(stats, &wfRx[gpio].s.stats, sizeof(gpioSerialStats_t));
+
   return 0;
 }
 
@@ -10817,14 +15817,21 @@ gpioSerialReadClose(unsigned gpio) {
 
     case PI_WFRX_SERIAL:
 
-      free(wfRx[gpio].s.buf);
+      /* waits for a batch being decoded to finish with the buffer */
 
-      gpioSetWatchdog(gpio, 0); /* switch off timeouts */
+      pthread_mutex_lock(&wfRxSerialMutex);
 
-      gpioSetAlertFunc(gpio, NULL); /* cancel alert */
+      wfRxSerialBits &= ~BIT; /* stop decoding */
 
       wfRx[gpio].mode = PI_WFRX_NONE;
 
+      free(wfRx[gpio].s.buf);
+      wfRx[gpio].s.buf = NULL;
+
+      pthread_mutex_unlock(&wfRxSerialMutex);
+
+      monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits | wfRxSerialBits;
+
       break;
   }
 
@@ -10853,6 +15860,9 @@ eventSetFunc(unsigned event, eventFunc_t f) {
 
   CHECK_INITED;
 
+  if(f)
+    CHECK_DMA;
+
   if(event > PI_MAX_EVENT)
     SOFT_ERROR(PI_BAD_EVENT_ID, "bad event (%d)", event);
 
@@ -10869,6 +15879,9 @@ eventSetFuncEx(unsigned event, eventFuncEx_t f, void* userdata) {
 
   CHECK_INITED;
 
+  if(f)
+    CHECK_DMA;
+
   if(event > PI_MAX_EVENT)
     SOFT_ERROR(PI_BAD_EVENT_ID, "bad event (%d)", event);
 
@@ -10929,7 +15942,7 @@ intGpioSetAlertFunc(unsigned gpio, void* f, int user, void* userdata) {
     alertBits &= ~BIT;
   }
 
-  monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+  monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits | wfRxSerialBits;
 
   return 0;
 }
@@ -10942,6 +15955,9 @@ gpioSetAlertFunc(unsigned gpio, gpioAlertFunc_t f) {
 
   CHECK_INITED;
 
+  if(f)
+    CHECK_DMA;
+
   if(gpio > PI_MAX_USER_GPIO)
     SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
@@ -10958,6 +15974,9 @@ gpioSetAlertFuncEx(unsigned gpio, gpioAlertFuncEx_t f, void* userdata) {
 
   CHECK_INITED;
 
+  if(f)
+    CHECK_DMA;
+
   if(gpio > PI_MAX_USER_GPIO)
     SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
@@ -11218,6 +16237,8 @@ gpioNotifyOpenWithSize(int bufSize) {
 
   CHECK_INITED;
 
+  CHECK_DMA;
+
   slot = -1;
 
   notifyMutex(1);
@@ -11282,6 +16303,8 @@ gpioNotifyOpenInBand(int fd) {
 
   CHECK_INITED;
 
+  CHECK_DMA;
+
   slot = -1;
 
   notifyMutex(1);
@@ -11321,15 +16344,13 @@ intScriptBits(void) {
 
   bits = 0;
 
-  for(i = 0; i < PI_MAX_SCRIPTS; i++) {
-    if(gpioScript[i].state == PI_SCRIPT_IN_USE) {
-      bits |= gpioScript[i].waitBits;
-    }
-  }
+  /* only scripts on the waiting list have bits set, scrMutex held */
+
+  for(i = 0; i < scrWaitingCount; i++) bits |= gpioScript[scrWaiting[i]].waitBits;
 
   scriptBits = bits;
 
-  monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+  monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits | wfRxSerialBits;
 }
 
 static void
@@ -11339,11 +16360,7 @@ intScriptEventBits(void) {
 
   bits = 0;
 
-  for(i = 0; i < PI_MAX_SCRIPTS; i++) {
-    if(gpioScript[i].state == PI_SCRIPT_IN_USE) {
-      bits |= gpioScript[i].eventBits;
-    }
-  }
+  for(i = 0; i < scrWaitingCount; i++) bits |= gpioScript[scrWaiting[i]].eventBits;
 
   scriptEventBits = bits;
 }
@@ -11363,7 +16380,7 @@ intNotifyBits(void) {
 
   notifyBits = bits;
 
-  monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+  monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits | wfRxSerialBits;
 }
 
 /* ----------------------------------------------------------------------- */
@@ -11492,6 +16509,9 @@ gpioSetWatchdog(unsigned gpio, unsigned timeout) {
 
   CHECK_INITED;
 
+  if(timeout)
+    CHECK_DMA;
+
   if(gpio > PI_MAX_USER_GPIO)
     SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
@@ -11517,6 +16537,9 @@ gpioNoiseFilter(unsigned gpio, unsigned steady, unsigned active) {
 
   CHECK_INITED;
 
+  if(steady)
+    CHECK_DMA;
+
   if(gpio > PI_MAX_USER_GPIO)
     SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
@@ -11548,6 +16571,9 @@ gpioGlitchFilter(unsigned gpio, unsigned steady) {
 
   CHECK_INITED;
 
+  if(steady)
+    CHECK_DMA;
+
   if(gpio > PI_MAX_USER_GPIO)
     SOFT_ERROR(PI_BAD_USER_GPIO, "bad gpio (%d)", gpio);
 
@@ -11577,6 +16603,9 @@ gpioSetGetSamplesFunc(gpioGetSamplesFunc_t f, uint32_t bits) {
 
   CHECK_INITED;
 
+  if(f)
+    CHECK_DMA;
+
   gpioGetSamples.ex = 0;
   gpioGetSamples.userdata = NULL;
   gpioGetSamples.func = f;
@@ -11586,7 +16615,7 @@ gpioSetGetSamplesFunc(gpioGetSamplesFunc_t f, uint32_t bits) {
   else
     gpioGetSamples.bits = 0;
 
-  monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+  monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits | wfRxSerialBits;
 
   return 0;
 }
@@ -11599,6 +16628,9 @@ gpioSetGetSamplesFuncEx(gpioGetSamplesFuncEx_t f, uint32_t bits, void* userdata)
 
   CHECK_INITED;
 
+  if(f)
+    CHECK_DMA;
+
   gpioGetSamples.ex = 1;
   gpioGetSamples.userdata = userdata;
   gpioGetSamples.func = f;
@@ -11608,7 +16640,7 @@ gpioSetGetSamplesFuncEx(gpioGetSamplesFuncEx_t f, uint32_t bits, void* userdata)
   else
     gpioGetSamples.bits = 0;
 
-  monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits;
+  monitorBits = alertBits | notifyBits | scriptBits | gpioGetSamples.bits | wfRxSerialBits;
 
   return 0;
 }
@@ -11760,6 +16792,171 @@ gpioStopThread(pthread_t* pth) {
 
 /* ----------------------------------------------------------------------- */
 
+static void
+scrInstall(gpioScript_t* s, int slot) {
+  s->id = slot;
+  s->request = PI_SCRIPT_HALT;
+  s->run_state = PI_SCRIPT_HALTED;
+  s->sched = SCR_SCHED_IDLE;
+  s->resume = 0;
+  s->restart = 0;
+  s->waitBits = 0;
+  s->eventBits = 0;
+  s->changedBits = 0;
+  s->S = NULL; /* allocated on first run */
+  s->buf = NULL;
+  s->prof = NULL;
+  s->blockPC = -1;
+
+  s->state = PI_SCRIPT_IN_USE;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrImagePath(unsigned script_id, char* path, int len) {
+  snprintf(path, len, "%s/pigpio-script-%u.img", scriptDir, script_id);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+scrImageSave(gpioScript_t* s) {
+  char path[PI_MAX_PATH + 32];
+  char tmp[PI_MAX_PATH + 40];
+  char* image;
+  int size, fd, ok;
+
+  if(!scriptDir[0])
+    return 0;
+
+  scrImagePath(s->id, path, sizeof(path));
+
+  if((fileApprove(path) & PI_FILE_WRITE) != PI_FILE_WRITE)
+    SOFT_ERROR(PI_NO_FILE_ACCESS, "no permission to write script image (%s)", path);
+
+  size = cmdScriptImageSize(&s->script);
+
+  image = malloc(size);
+
+  if(!image)
+    SOFT_ERROR(PI_NO_MEMORY, "script image (%s), no memory", path);
+
+  cmdScriptToImage(&s->script, image, size);
+
+  /* write then rename so a crash never leaves a truncated image */
+
+  snprintf(tmp, sizeof(tmp), "%s.new", path);
+
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+
+  ok = 0;
+
+  if(fd >= 0) {
+    ok = (write(fd, image, size) == size) && (fsync(fd) == 0);
+    close(fd);
+  }
+
+  free(image);
+
+  if(!ok || rename(tmp, path)) {
+    unlink(tmp);
+    SOFT_ERROR(PI_BAD_FILE_WRITE, "write script image (%s) failed (%m)", path);
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrImageRemove(unsigned script_id) {
+  char path[PI_MAX_PATH + 32];
+
+  if(!scriptDir[0])
+    return;
+
+  scrImagePath(script_id, path, sizeof(path));
+
+  if((fileApprove(path) & PI_FILE_WRITE) == PI_FILE_WRITE)
+    unlink(path);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+scrImageLoadAll(void) {
+  char path[PI_MAX_PATH + 32];
+  struct stat statbuf;
+  gpioScript_t* s;
+  char* image;
+  int i, fd, status, loaded;
+
+  /* reinstate persisted scripts under their original ids */
+
+  if(!scriptDir[0])
+    return;
+
+  loaded = 0;
+
+  for(i = 0; i < PI_MAX_SCRIPTS; i++) {
+    s = &gpioScript[i];
+
+    if(s->state != PI_SCRIPT_FREE)
+      continue;
+
+    scrImagePath(i, path, sizeof(path));
+
+    if(stat(path, &statbuf) < 0)
+      continue;
+
+    if((fileApprove(path) & PI_FILE_READ) != PI_FILE_READ) {
+      DBG(DBG_ALWAYS, "no permission to read script image (%s)", path);
+      continue;
+    }
+
+    status = PI_BAD_SCRIPT;
+
+    image = NULL;
+
+    if((statbuf.st_size > 0) && (statbuf.st_size <= PI_SCRIPT_IMAGE_MAX))
+      image = malloc(statbuf.st_size);
+
+    if(image) {
+      fd = open(path, O_RDONLY);
+
+      if(fd >= 0) {
+        if(read(fd, image, statbuf.st_size) == statbuf.st_size)
+          status = cmdScriptFromImage(image, statbuf.st_size, &s->script);
+
+        close(fd);
+      }
+
+      free(image);
+    }
+
+    if(status == 0) {
+      status = scrPoolStart();
+
+      if(status < 0) {
+        free(s->script.par);
+        s->script.par = NULL;
+        return;
+      }
+
+      scrInstall(s, i);
+
+      loaded++;
+    } else {
+      DBG(DBG_ALWAYS, "bad script image (%s), ignored", path);
+    }
+  }
+
+  DBG(DBG_STARTUP, "%d scripts loaded from %s", loaded, scriptDir);
+}
+
+/* ----------------------------------------------------------------------- */
+
 int
 gpioStoreScript(char* script) {
   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -11774,16 +16971,23 @@ gpioStoreScript(char* script) {
 
   pthread_mutex_lock(&mutex);
 
-  for(i = 0; i < PI_MAX_SCRIPTS; i++) {
-    if(gpioScript[i].state == PI_SCRIPT_FREE) {
-      slot = i;
-      gpioScript[slot].state = PI_SCRIPT_RESERVED;
-      break;
+  status = scrPoolStart();
+
+  if(status == 0) {
+    for(i = 0; i < PI_MAX_SCRIPTS; i++) {
+      if(gpioScript[i].state == PI_SCRIPT_FREE) {
+        slot = i;
+        gpioScript[slot].state = PI_SCRIPT_RESERVED;
+        break;
+      }
     }
   }
 
   pthread_mutex_unlock(&mutex);
 
+  if(status < 0)
+    return status;
+
   if(slot < 0)
     SOFT_ERROR(PI_NO_SCRIPT_ROOM, "no room for scripts");
 
@@ -11792,17 +16996,9 @@ gpioStoreScript(char* script) {
   status = cmdParseScript(script, &s->script, 0);
 
   if(status == 0) {
-    s->request = PI_SCRIPT_HALT;
-    s->run_state = PI_SCRIPT_INITING;
-
-    pthread_cond_init(&s->pthCond, NULL);
-    pthread_mutex_init(&s->pthMutex, NULL);
+    scrInstall(s, slot);
 
-    s->id = slot;
-
-    gpioScript[slot].state = PI_SCRIPT_IN_USE;
-
-    s->pthIdp = gpioStartThread(pthScript, s);
+    scrImageSave(s); /* failure is logged, the script still runs */
 
     status = slot;
   } else {
@@ -11819,6 +17015,7 @@ gpioStoreScript(char* script) {
 
 int
 gpioRunScript(unsigned script_id, unsigned numParam, uint32_t* param) {
+  gpioScript_t* s;
   int status = 0;
 
   DBG(DBG_USER, "script_id=%d numParam=%d param=%08" PRIXPTR, script_id, numParam, (uintptr_t)param);
@@ -11831,22 +17028,38 @@ gpioRunScript(unsigned script_id, unsigned numParam, uint32_t* param) {
   if(numParam > PI_MAX_SCRIPT_PARAMS)
     SOFT_ERROR(PI_TOO_MANY_PARAM, "bad number of parameters(%d)", numParam);
 
-  if(gpioScript[script_id].state == PI_SCRIPT_IN_USE) {
-    pthread_mutex_lock(&gpioScript[script_id].pthMutex);
+  s = &gpioScript[script_id];
+
+  if(s->state == PI_SCRIPT_IN_USE) {
+    pthread_mutex_lock(&scrMutex);
+
+    if(!s->S) {
+      s->S = malloc((sizeof(int) * PI_SCRIPT_STACK_SIZE) + CMD_MAX_EXTENSION);
+
+      if(s->S)
+        s->buf = (char*)(s->S + PI_SCRIPT_STACK_SIZE);
+    }
 
-    if(gpioScript[script_id].run_state != PI_SCRIPT_INITING) {
+    if(s->S) {
       if((numParam > 0) && (param != 0)) {
-        memcpy(gpioScript[script_id].script.par, param, sizeof(uint32_t) * numParam);
+        memcpy(s->script.par, param, sizeof(uint32_t) * numParam);
       }
 
-      gpioScript[script_id].request = PI_SCRIPT_RUN;
+      s->request = PI_SCRIPT_RUN;
 
-      pthread_cond_signal(&gpioScript[script_id].pthCond);
+      if(s->sched == SCR_SCHED_IDLE) {
+        scrStart(s);
+        scrReadyPush(s);
+      } else if(s->sched == SCR_SCHED_WAITING) {
+        scrWake(s); /* a run request ends a wait early */
+      } else if(s->sched == SCR_SCHED_ACTIVE) {
+        s->restart = 1; /* seen by scrPark at the end of the turn */
+      }
     } else {
-      status = PI_SCRIPT_NOT_READY;
+      status = PI_NO_MEMORY;
     }
 
-    pthread_mutex_unlock(&gpioScript[script_id].pthMutex);
+    pthread_mutex_unlock(&scrMutex);
 
     return status;
   } else {
@@ -11902,8 +17115,107 @@ gpioScriptStatus(unsigned script_id, uint32_t* param) {
 
 /* ----------------------------------------------------------------------- */
 
+int
+gpioScriptProfile(unsigned script_id, unsigned enable) {
+  gpioScript_t* s;
+  scrProf_t* prof;
+
+  DBG(DBG_USER, "script_id=%d enable=%d", script_id, enable);
+
+  CHECK_INITED;
+
+  if(script_id >= PI_MAX_SCRIPTS)
+    SOFT_ERROR(PI_BAD_SCRIPT_ID, "bad script id(%d)", script_id);
+
+  s = &gpioScript[script_id];
+
+  if(s->state != PI_SCRIPT_IN_USE)
+    return PI_BAD_SCRIPT_ID;
+
+  prof = NULL;
+
+  if(enable) {
+    prof = calloc(s->script.instrs ? s->script.instrs : 1, sizeof(scrProf_t));
+
+    if(!prof)
+      SOFT_ERROR(PI_NO_MEMORY, "script %d, no memory for profile", script_id);
+  }
+
+  pthread_mutex_lock(&scrMutex);
+
+  /* a worker may be using the old counters */
+
+  while(s->sched == SCR_SCHED_ACTIVE) pthread_cond_wait(&scrIdleCond, &scrMutex);
+
+  if(s->prof)
+    free(s->prof);
+
+  s->prof = prof;
+  s->blockPC = -1;
+
+  pthread_mutex_unlock(&scrMutex);
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+gpioScriptProfileGet(unsigned script_id, gpioScriptProf_t* prof, unsigned numProf) {
+  gpioScript_t* s;
+  uint64_t micros;
+  int i, steps;
+
+  DBG(DBG_USER, "script_id=%d prof=%08" PRIXPTR " numProf=%d", script_id, (uintptr_t)prof, numProf);
+
+  CHECK_INITED;
+
+  if(script_id >= PI_MAX_SCRIPTS)
+    SOFT_ERROR(PI_BAD_SCRIPT_ID, "bad script id(%d)", script_id);
+
+  s = &gpioScript[script_id];
+
+  if(s->state != PI_SCRIPT_IN_USE)
+    return PI_BAD_SCRIPT_ID;
+
+  if(!prof)
+    SOFT_ERROR(PI_BAD_POINTER, "null profile buffer");
+
+  pthread_mutex_lock(&scrMutex);
+
+  if(!s->prof) {
+    pthread_mutex_unlock(&scrMutex);
+    return PI_SCRIPT_NOT_PROFILED;
+  }
+
+  /* counters are read while the script runs, a step may be mid-update */
+
+  steps = s->script.instrs;
+
+  if(steps > numProf)
+    steps = numProf;
+
+  for(i = 0; i < steps; i++) {
+    prof[i].count = s->prof[i].count;
+
+    micros = s->prof[i].execNanos / THOUSAND;
+    prof[i].micros = (micros > 0xFFFFFFFF) ? 0xFFFFFFFF : micros;
+
+    micros = s->prof[i].blockNanos / THOUSAND;
+    prof[i].blocked = (micros > 0xFFFFFFFF) ? 0xFFFFFFFF : micros;
+  }
+
+  pthread_mutex_unlock(&scrMutex);
+
+  return steps;
+}
+
+/* ----------------------------------------------------------------------- */
+
 int
 gpioStopScript(unsigned script_id) {
+  gpioScript_t* s;
+
   DBG(DBG_USER, "script_id=%d", script_id);
 
   CHECK_INITED;
@@ -11911,16 +17223,21 @@ gpioStopScript(unsigned script_id) {
   if(script_id >= PI_MAX_SCRIPTS)
     SOFT_ERROR(PI_BAD_SCRIPT_ID, "bad script id(%d)", script_id);
 
-  if(gpioScript[script_id].state == PI_SCRIPT_IN_USE) {
-    pthread_mutex_lock(&gpioScript[script_id].pthMutex);
+  s = &gpioScript[script_id];
+
+  if(s->state == PI_SCRIPT_IN_USE) {
+    pthread_mutex_lock(&scrMutex);
 
-    gpioScript[script_id].request = PI_SCRIPT_HALT;
+    s->request = PI_SCRIPT_HALT;
+
+    /* an active script is halted by its worker */
 
-    if(gpioScript[script_id].run_state == PI_SCRIPT_WAITING) {
-      pthread_cond_signal(&gpioScript[script_id].pthCond);
+    if((s->sched != SCR_SCHED_IDLE) && (s->sched != SCR_SCHED_ACTIVE)) {
+      scrUnschedule(s);
+      s->run_state = PI_SCRIPT_HALTED;
     }
 
-    pthread_mutex_unlock(&gpioScript[script_id].pthMutex);
+    pthread_mutex_unlock(&scrMutex);
 
     return 0;
   } else
@@ -11931,6 +17248,8 @@ gpioStopScript(unsigned script_id) {
 
 int
 gpioDeleteScript(unsigned script_id) {
+  gpioScript_t* s;
+
   DBG(DBG_USER, "script_id=%d", script_id);
 
   CHECK_INITED;
@@ -11938,29 +17257,43 @@ gpioDeleteScript(unsigned script_id) {
   if(script_id >= PI_MAX_SCRIPTS)
     SOFT_ERROR(PI_BAD_SCRIPT_ID, "bad script id(%d)", script_id);
 
-  if(gpioScript[script_id].state == PI_SCRIPT_IN_USE) {
-    gpioScript[script_id].state = PI_SCRIPT_DYING;
+  s = &gpioScript[script_id];
 
-    pthread_mutex_lock(&gpioScript[script_id].pthMutex);
+  if(s->state == PI_SCRIPT_IN_USE) {
+    pthread_mutex_lock(&scrMutex);
 
-    gpioScript[script_id].request = PI_SCRIPT_HALT;
+    s->state = PI_SCRIPT_DYING;
 
-    if(gpioScript[script_id].run_state == PI_SCRIPT_WAITING) {
-      pthread_cond_signal(&gpioScript[script_id].pthCond);
-    }
+    s->request = PI_SCRIPT_HALT;
+
+    if(s->sched != SCR_SCHED_ACTIVE)
+      scrUnschedule(s);
+
+    while(s->sched == SCR_SCHED_ACTIVE) { pthread_cond_wait(&scrIdleCond, &scrMutex); /* give script time to halt */ }
+
+    s->run_state = PI_SCRIPT_HALTED;
 
-    pthread_mutex_unlock(&gpioScript[script_id].pthMutex);
+    pthread_mutex_unlock(&scrMutex);
 
-    while(gpioScript[script_id].run_state == PI_SCRIPT_RUNNING) { myGpioSleep(0, 5000); /* give script time to halt */ }
+    if(s->script.par)
+      free(s->script.par);
+
+    s->script.par = NULL;
 
-    gpioStopThread(gpioScript[script_id].pthIdp);
+    if(s->S)
+      free(s->S);
 
-    if(gpioScript[script_id].script.par)
-      free(gpioScript[script_id].script.par);
+    s->S = NULL;
+    s->buf = NULL;
 
-    gpioScript[script_id].script.par = NULL;
+    if(s->prof)
+      free(s->prof);
 
-    gpioScript[script_id].state = PI_SCRIPT_FREE;
+    s->prof = NULL;
+
+    scrImageRemove(script_id);
+
+    s->state = PI_SCRIPT_FREE;
 
     return 0;
   } else
@@ -12228,11 +17561,15 @@ gpioHardwarePWM(unsigned gpio, unsigned frequency, unsigned dutycycle) {
     }
 
     if(gpioInfo[gpio].is != GPIO_HW_PWM) {
+      pthread_mutex_lock(&slotMutex);
+
       switchFunctionOff(gpio);
 
       myGpioSetMode(gpio, mode);
 
       gpioInfo[gpio].is = GPIO_HW_PWM;
+
+      pthread_mutex_unlock(&slotMutex);
     }
   } else {
     /* frequency 0, stop PWM */
@@ -12716,6 +18053,31 @@ gpioVersion(void) {
 
 /* ----------------------------------------------------------------------- */
 
+int
+gpioSubsystems(void) {
+  int live = 0;
+
+  DBG(DBG_USER, "");
+
+  CHECK_INITED;
+
+  if(dmaLive > 0)
+    live |= PI_SUBSYS_DMA;
+
+  if(pthAlertRunning != PI_THREAD_NONE)
+    live |= PI_SUBSYS_ALERT;
+
+  if(pthFifoRunning != PI_THREAD_NONE)
+    live |= PI_SUBSYS_FIFO;
+
+  if(pthSocketRunning != PI_THREAD_NONE)
+    live |= PI_SUBSYS_SOCK;
+
+  return live;
+}
+
+/* ----------------------------------------------------------------------- */
+
 /*
 2 2  2  2 2 2  1 1 1 1  1 1 1 1  1 1 0 0 0 0 0 0  0 0 0 0
 5 4  3  2 1 0  9 8 7 6  5 4 3 2  1 0 9 8 7 6 5 4  3 2 1 0
@@ -12956,7 +18318,7 @@ gpioCfgInterfaces(unsigned ifFlags) {
 
   CHECK_NOT_INITED;
 
-  if(ifFlags > 15)
+  if(ifFlags > 31)
     SOFT_ERROR(PI_BAD_IF_FLAGS, "bad ifFlags (%X)", ifFlags);
 
   gpioCfg.ifFlags = ifFlags;
@@ -12998,6 +18360,91 @@ gpioCfgMemAlloc(unsigned memAllocMode) {
 
 /* ----------------------------------------------------------------------- */
 
+int
+gpioCfgScriptThreads(unsigned threads) {
+  DBG(DBG_USER, "threads=%d", threads);
+
+  CHECK_NOT_INITED;
+
+  if((threads < PI_MIN_SCRIPT_THREADS) || (threads > PI_MAX_SCRIPT_THREADS))
+    SOFT_ERROR(PI_BAD_SCRIPT_THREADS, "bad script threads (%d)", threads);
+
+  gpioCfg.scriptThreads = threads;
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+gpioCfgWaveMaxPulses(unsigned pulses) {
+  DBG(DBG_USER, "pulses=%d", pulses);
+
+  CHECK_NOT_INITED;
+
+  if((pulses < PI_MIN_WAVE_PULSES) || (pulses > PI_WAVE_MAX_PULSES))
+    SOFT_ERROR(PI_BAD_WAVE_PULSES, "bad wave pulse ceiling (%d)", pulses);
+
+  gpioCfg.waveMaxPulses = pulses;
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+gpioCfgSPIdma(unsigned minBytes) {
+  DBG(DBG_USER, "minBytes=%d", minBytes);
+
+  CHECK_NOT_INITED;
+
+  if(minBytes > PI_MAX_SPI_DMA_BYTES)
+    SOFT_ERROR(PI_BAD_PARAM, "bad SPI dma threshold (%d)", minBytes);
+
+  gpioCfg.spiDmaBytes = minBytes;
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+gpioCfgBitBangDMA(unsigned minBytes) {
+  DBG(DBG_USER, "minBytes=%d", minBytes);
+
+  CHECK_NOT_INITED;
+
+  if(minBytes > PI_MAX_BB_DMA_BYTES)
+    SOFT_ERROR(PI_BAD_PARAM, "bad bit bang dma threshold (%d)", minBytes);
+
+  gpioCfg.bbDmaBytes = minBytes;
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+gpioCfgScriptDir(char* dir) {
+  DBG(DBG_USER, "dir=%s", dir ? dir : "");
+
+  CHECK_NOT_INITED;
+
+  if(!dir || !dir[0]) {
+    scriptDir[0] = 0;
+    return 0;
+  }
+
+  if((strlen(dir) >= (PI_MAX_PATH - 32)) || myPathBad(dir))
+    SOFT_ERROR(PI_BAD_PATHNAME, "bad script directory (%s)", dir);
+
+  strcpy(scriptDir, dir);
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
 int
 gpioCfgNetAddr(int numSockAddr, uint32_t* sockAddr) {
   int i;
@@ -139,6 +139,7 @@ gpioWrite                  Write a GPIO
 PWM_(overrides_servo_commands_on_same_GPIO)
 
 gpioPWM                    Start/stop PWM pulses on a GPIO
+gpioPWMBatch               Set the PWM dutycycle of several GPIO at once
 gpioSetPWMfrequency        Configure PWM frequency for a GPIO
 gpioSetPWMrange            Configure PWM range for a GPIO
 
@@ -151,6 +152,7 @@ gpioGetPWMrealRange        Get underlying PWM range for a GPIO
 Servo_(overrides_PWM_commands_on_same_GPIO)
 
 gpioServo                  Start/stop servo pulses on a GPIO
+gpioServoBatch             Set the servo pulsewidth of several GPIO at once
 
 gpioGetServoPulsewidth     Get pulsewidth setting on a GPIO
 
@@ -226,6 +228,8 @@ gpioStoreScript            Store a script
 gpioRunScript              Run a stored script
 gpioUpdateScript           Set a scripts parameters
 gpioScriptStatus           Get script status and parameters
+gpioScriptProfile          Start or stop profiling a script
+gpioScriptProfileGet       Get a script's execution profile
 gpioStopScript             Stop a running script
 gpioDeleteScript           Delete a stored script
 
@@ -263,6 +267,9 @@ i2cSegments                Performs multiple I2C transactions
 
 i2cZip                     Performs multiple I2C transactions
 
+i2cZipAsync                Queues multiple I2C transactions
+i2cAsyncResult             Collects a queued I2C result
+
 I2C_BIT_BANG
 
 bbI2COpen                  Opens GPIO for bit banging I2C
@@ -274,6 +281,12 @@ I2C/SPI_SLAVE
 
 bscXfer                    I2C/SPI as slave transfer
 
+bscServiceOpen             Starts the buffered I2C/SPI slave service
+bscServiceClose            Stops the buffered I2C/SPI slave service
+bscServiceWrite            Queues bytes for the master to read
+bscServiceRead             Gets completed slave transactions
+bscServiceStats            Gets the slave service counts
+
 SERIAL
 
 serOpen                    Opens a serial device
@@ -287,12 +300,18 @@ serWrite                   Writes bytes to a serial device
 
 serDataAvailable           Returns number of bytes ready to be read
 
+serRxEvent                 Sets an event to trigger when data arrives
+serRxOverruns              Returns bytes lost to a full receive buffer
+
 SERIAL_BIT_BANG_(read_only)
 
 gpioSerialReadOpen         Opens a GPIO for bit bang serial reads
 gpioSerialReadClose        Closes a GPIO for bit bang serial reads
 
 gpioSerialReadInvert       Configures normal/inverted for serial reads
+gpioSerialReadParity       Configures the parity for serial reads
+
+gpioSerialReadStats        Gets the error counts for serial reads
 
 gpioSerialRead             Reads bit bang serial data from a GPIO
 
@@ -304,6 +323,9 @@ spiClose                   Closes a SPI device
 spiRead                    Reads bytes from a SPI device
 spiWrite                   Writes bytes to a SPI device
 spiXfer                    Transfers bytes with a SPI device
+spiSegments                Performs multiple SPI transfers
+
+spiGetStats                Gets SPI throughput statistics
 
 SPI_BIT_BANG
 
@@ -334,7 +356,15 @@ gpioWaveAddSerial          Adds serial data to the waveform
 
 gpioWaveCreate             Creates a waveform from added data
 gpioWaveCreatePad          Creates a waveform of fixed size from added data
+gpioWaveCreateAsync        Creates a waveform on a background thread
+gpioWaveCreateResult       Gets the result of an asynchronous create
 gpioWaveDelete             Deletes a waveform
+gpioWaveCompact            Packs the stored waveforms together
+
+gpioWaveStreamOpen         Opens a waveform stream
+gpioWaveStreamAppend       Appends added data to the waveform stream
+gpioWaveStreamStatus       Gets the waveform stream status
+gpioWaveStreamClose        Closes the waveform stream
 
 gpioWaveTxSend             Transmits a waveform
 
@@ -349,6 +379,7 @@ gpioWaveTxStop             Aborts the current waveform
 gpioWaveGetCbs             Length in CBs of the current waveform
 gpioWaveGetHighCbs         Length of longest waveform so far
 gpioWaveGetMaxCbs          Absolute maximum allowed CBs
+gpioWaveGetRawCbs          Length in CBs before normalising
 
 gpioWaveGetMicros          Length in micros of the current waveform
 gpioWaveGetHighMicros      Length of longest waveform so far
@@ -366,6 +397,7 @@ gpioTick                   Get current tick (microseconds)
 
 gpioHardwareRevision       Get hardware revision
 gpioVersion                Get the pigpio version
+gpioSubsystems             Get the live library subsystems
 
 getBitInBytes              Get the value of a bit
 putBitInBytes              Set the value of a bit
@@ -387,6 +419,11 @@ gpioCfgInterfaces          Configure user interfaces
 gpioCfgSocketPort          Configure socket port
 gpioCfgMemAlloc            Configure DMA memory allocation mode
 gpioCfgNetAddr             Configure allowed network addresses
+gpioCfgScriptThreads       Configure script worker threads
+gpioCfgScriptDir           Configure persisted script directory
+gpioCfgWaveMaxPulses       Configure the wave pulse ceiling
+gpioCfgSPIdma              Configure the SPI DMA threshold
+gpioCfgBitBangDMA          Configure the bit bang DMA threshold
 
 gpioCfgGetInternals        Get internal configuration settings
 gpioCfgSetInternals        Set internal configuration settings
@@ -453,6 +490,56 @@ typedef struct {
   uint32_t usDelay;
 } gpioPulse_t;
 
+typedef struct {
+  uint32_t gpio;
+  uint32_t value;
+} gpioPair_t;
+
+typedef struct {
+  uint32_t count;   /* times the step was executed          */
+  uint32_t micros;  /* cumulative execution time            */
+  uint32_t blocked; /* cumulative time blocked in the step  */
+} gpioScriptProf_t;
+
+typedef struct {
+  uint32_t queued;    /* segments queued or being sent         */
+  uint32_t free;      /* segments which may still be appended  */
+  uint32_t sent;      /* segments sent since the stream opened */
+  uint32_t underruns; /* times the stream ran dry              */
+  uint32_t running;   /* 1 if the stream is being sent         */
+} gpioStreamStatus_t;
+
+typedef struct {
+  uint32_t transfers; /* transfers made on the path   */
+  uint32_t bytes;     /* bytes transferred            */
+  uint32_t micros;    /* cumulative transfer time     */
+} spiStats_t;
+
+typedef struct {
+  uint32_t frames;        /* characters received          */
+  uint32_t framingErrors; /* characters with a low stop bit */
+  uint32_t parityErrors;  /* characters with bad parity   */
+  uint32_t overruns;      /* characters lost, buffer full */
+} gpioSerialStats_t;
+
+typedef struct {
+  uint32_t tick;    /* first activity of the transaction */
+  uint32_t endTick; /* last activity of the transaction  */
+  uint16_t rxCnt;   /* bytes received from the master    */
+  uint16_t txCnt;   /* bytes sent to the master          */
+  uint32_t flags;   /* PI_BSC_TRANS_x                    */
+} bscTrans_t;
+
+typedef struct {
+  uint32_t transactions; /* transactions completed            */
+  uint32_t rxBytes;      /* bytes received from the master    */
+  uint32_t txBytes;      /* bytes sent to the master          */
+  uint32_t rxDropped;    /* bytes dropped, receive ring full  */
+  uint32_t fifoOverruns; /* receive FIFO overruns             */
+  uint32_t txUnderruns;  /* master reads with no data queued  */
+  uint32_t transDropped; /* transactions dropped, queue full  */
+} bscServiceStats_t;
+
 #define WAVE_FLAG_READ 1
 #define WAVE_FLAG_TICK 2
 
@@ -517,10 +604,30 @@ typedef struct {
   uint8_t* buf; /* pointer to msg data */
 } pi_i2c_msg_t;
 
+typedef struct {
+  uint16_t handle; /* as returned by spiOpen     */
+  uint16_t flags;  /* PI_SPI_SEG_CS_HOLD         */
+  uint16_t len;    /* bytes to transfer          */
+  uint16_t delay;  /* microseconds after transfer */
+  char* txBuf;     /* data to send, NULL zeros   */
+  char* rxBuf;     /* received data, NULL drops  */
+} pi_spi_seg_t;
+
 /* BSC FIFO size */
 
 #define BSC_FIFO_SIZE 512
 
+/* BSC service */
+
+#define PI_BSC_SERVICE_RX 8192
+#define PI_BSC_SERVICE_TX 8192
+#define PI_BSC_SERVICE_TRANS 256
+
+/* bscTrans_t flags */
+
+#define PI_BSC_TRANS_RX_OVERRUN 1
+#define PI_BSC_TRANS_TX_UNDERRUN 2
+
 typedef struct {
   uint32_t control;          /* Write */
   int rxCnt;                 /* Read only */
@@ -634,6 +741,7 @@ typedef void*(gpioThreadFunc_t)(void*);
 
 #define PI_WAVE_BLOCKS 4
 #define PI_WAVE_MAX_PULSES (PI_WAVE_BLOCKS * 3000)
+#define PI_MIN_WAVE_PULSES 16
 #define PI_WAVE_MAX_CHARS (PI_WAVE_BLOCKS * 300)
 
 #define PI_BB_I2C_MIN_BAUD 50
@@ -648,6 +756,10 @@ typedef void*(gpioThreadFunc_t)(void*);
 #define PI_BB_SER_NORMAL 0
 #define PI_BB_SER_INVERT 1
 
+#define PI_BB_SER_PARITY_NONE 0
+#define PI_BB_SER_PARITY_ODD 1
+#define PI_BB_SER_PARITY_EVEN 2
+
 #define PI_WAVE_MIN_BAUD 50
 #define PI_WAVE_MAX_BAUD 1000000
 
@@ -664,6 +776,11 @@ typedef void*(gpioThreadFunc_t)(void*);
 
 #define PI_MAX_WAVES 250
 
+#define PI_WAVE_STREAM_MIN_SEGS 2
+#define PI_WAVE_STREAM_MAX_SEGS 32
+
+#define PI_WAVE_MAX_TICKETS 16
+
 #define PI_MAX_WAVE_CYCLES 65535
 #define PI_MAX_WAVE_DELAY 65535
 
@@ -696,6 +813,22 @@ typedef void*(gpioThreadFunc_t)(void*);
 #define PI_MAX_I2C_DEVICE_COUNT (1 << 16)
 #define PI_MAX_SPI_DEVICE_COUNT (1 << 16)
 
+/* spiGetStats paths */
+
+#define PI_SPI_PATH_POLL 0
+#define PI_SPI_PATH_DMA 1
+#define PI_SPI_PATH_AUX 2
+
+/* i2cZipAsync */
+
+#define PI_I2C_MAX_TICKETS 32
+#define PI_I2C_MAX_QUEUES 8
+#define PI_I2C_NO_EVENT 255
+
+/* serRxEvent */
+
+#define PI_SER_NO_EVENT 255
+
 /* max pi_i2c_msg_t per transaction */
 
 #define PI_I2C_RDRW_IOCTL_MAX_MSGS 42
@@ -736,6 +869,14 @@ typedef void*(gpioThreadFunc_t)(void*);
 #define PI_SPI_FLAGS_CSPOLS(x) ((x & 7) << 2)
 #define PI_SPI_FLAGS_MODE(x) ((x & 3))
 
+/* max pi_spi_seg_t per spiSegments transaction */
+
+#define PI_SPI_MAX_SEGS 32
+
+/* pi_spi_seg_t flags */
+
+#define PI_SPI_SEG_CS_HOLD 1
+
 /* BSC registers */
 
 #define BSC_DR 0
@@ -805,7 +946,12 @@ typedef void*(gpioThreadFunc_t)(void*);
 #define PI_MIN_MS 10
 #define PI_MAX_MS 60000
 
-#define PI_MAX_SCRIPTS 32
+#define PI_MAX_SCRIPTS 512
+
+/* script worker threads: 1-16 */
+
+#define PI_MIN_SCRIPT_THREADS 1
+#define PI_MAX_SCRIPT_THREADS 16
 
 #define PI_MAX_SCRIPT_TAGS 50
 #define PI_MAX_SCRIPT_VARS 150
@@ -860,6 +1006,22 @@ typedef void*(gpioThreadFunc_t)(void*);
 #define PI_DISABLE_SOCK_IF 2
 #define PI_LOCALHOST_SOCK_IF 4
 #define PI_DISABLE_ALERT 8
+#define PI_LAZY_DMA 16
+
+/* gpioSubsystems */
+
+#define PI_SUBSYS_DMA 1
+#define PI_SUBSYS_ALERT 2
+#define PI_SUBSYS_FIFO 4
+#define PI_SUBSYS_SOCK 8
+
+/* gpioCfgSPIdma */
+
+#define PI_MAX_SPI_DMA_BYTES 65536
+
+/* gpioCfgBitBangDMA */
+
+#define PI_MAX_BB_DMA_BYTES 65536
 
 /* memAllocMode */
 
@@ -879,8 +1041,9 @@ typedef void*(gpioThreadFunc_t)(void*);
 #define PI_CFG_RT_PRIORITY (1 << 8)
 #define PI_CFG_STATS (1 << 9)
 #define PI_CFG_NOSIGHANDLER (1 << 10)
+#define PI_CFG_WAVE_CACHE (1 << 11)
 
-#define PI_CFG_ILLEGAL_VAL (1 << 11)
+#define PI_CFG_ILLEGAL_VAL (1 << 12)
 
 /* gpioISR */
 
@@ -1102,6 +1265,36 @@ gpioPWM(23, 0);   // Sets GPIO23 full off.
 ...
 D*/
 
+/*F*/
+int gpioPWMBatch(unsigned numPairs, gpioPair_t* pairs);
+/*D
+Sets the PWM dutycycle of several GPIO at once.
+
+. .
+numPairs: the number of pairs
+   pairs: an array of (GPIO 0-31, dutycycle 0-range) pairs
+. .
+
+Returns 0 if OK, otherwise PI_BAD_POINTER, PI_BAD_USER_GPIO, or
+PI_BAD_DUTYCYCLE.
+
+Every pair is checked before any GPIO is changed.  If a GPIO appears
+more than once its last pair is used.
+
+The changes to the DMA slots are gathered and applied in one pass
+which starts at the next PWM cycle.  All the GPIO switch to their
+new dutycycles in the same cycle, there is no intermediate state with
+some GPIO updated and others not.
+
+This is quicker than calling [*gpioPWM*] for each GPIO.
+
+...
+gpioPair_t pairs[3] = {{17, 255}, {18, 128}, {23, 0}};
+
+gpioPWMBatch(3, pairs); // GPIO17 full on, GPIO18 half, GPIO23 off.
+...
+D*/
+
 /*F*/
 int gpioGetPWMdutycycle(unsigned user_gpio);
 /*D
@@ -1337,6 +1530,33 @@ Thereafter use the PWM command to move the servo,
 e.g. gpioPWM(25, 1500) will set a 1500 us pulse.
 D*/
 
+/*F*/
+int gpioServoBatch(unsigned numPairs, gpioPair_t* pairs);
+/*D
+Sets the servo pulsewidth of several GPIO at once.
+
+. .
+numPairs: the number of pairs
+   pairs: an array of (GPIO 0-31, pulsewidth 0 or 500-2500) pairs
+. .
+
+Returns 0 if OK, otherwise PI_BAD_POINTER, PI_BAD_USER_GPIO, or
+PI_BAD_PULSEWIDTH.
+
+Every pair is checked before any GPIO is changed.  If a GPIO appears
+more than once its last pair is used.
+
+As with [*gpioPWMBatch*] the new pulsewidths are applied in one pass
+and take effect in the same cycle.  If servos are switched off
+the function waits at most once for pulses in progress to finish.
+
+...
+gpioPair_t pairs[2] = {{17, 1000}, {23, 2000}};
+
+gpioServoBatch(2, pairs); // Move both servos together.
+...
+D*/
+
 /*F*/
 int gpioGetServoPulsewidth(unsigned user_gpio);
 /*D
@@ -1734,6 +1954,10 @@ int gpioWaveClear(void);
 This function clears all waveforms and any data added by calls to the
 [*gpioWaveAdd**] functions.
 
+Asynchronous creates still pending are cancelled.  Their tickets, and
+those of finished creates not yet collected, return PI_BAD_WAVE_ID
+from [*gpioWaveCreateResult*].
+
 Returns 0 if OK.
 
 ...
@@ -1920,6 +2144,12 @@ set all the fields to zero (the pulse will be ignored).
 When a waveform is started each pulse is executed in order with the
 specified delay between the pulse and the next.
 
+If PI_CFG_WAVE_CACHE is set (see [*gpioCfgSetInternals*]) a waveform
+identical to one already created returns the existing wave id rather
+than using more control blocks.  Such a wave is shared, including any
+values it reads, and is only freed when [*gpioWaveDelete*] has been
+called once for each time it was returned.
+
 Returns the new waveform id if OK, otherwise PI_EMPTY_WAVEFORM,
 PI_NO_WAVEFORM_ID, PI_TOO_MANY_CBS, or PI_TOO_MANY_OOL.
 D*/
@@ -1968,28 +2198,162 @@ This buffer structure allows the transmission of infinite wave sequences.
 D*/
 
 /*F*/
-int gpioWaveDelete(unsigned wave_id);
+int gpioWaveCreateAsync(void);
 /*D
-This function deletes the waveform with id wave_id.
+This function starts creating a waveform from the data provided by
+the prior calls to the [*gpioWaveAdd**] functions and returns at
+once with a ticket.
+
+The control blocks are built on a background thread.  The data is
+consumed straight away so the next waveform may be added, and
+waveforms already created may be transmitted, while it compiles.
 
-The wave is flagged for deletion.  The resources used by the wave
-will only be reused when either of the following apply.
+Pass the ticket to [*gpioWaveCreateResult*] to collect the wave id.
+Tickets are compiled in the order they were issued.  Each ticket
+must be collected before it can be reused.
 
-- all waves with higher numbered wave ids have been deleted or have
-been flagged for deletion.
+Returns a ticket (0-15) if OK, otherwise PI_EMPTY_WAVEFORM or
+PI_NO_WAVE_TICKET.
+D*/
+
+/*F*/
+int gpioWaveCreateResult(unsigned ticket, unsigned wait);
+/*D
+This function returns the result of an asynchronous waveform create.
+
+. .
+ticket: 0-15, as returned by [*gpioWaveCreateAsync*]
+  wait: 0 to return at once, 1 to wait for the compile to finish
+. .
+
+Returns the wave id if the create succeeded, PI_WAVE_PENDING if wait
+is 0 and it has not finished, otherwise PI_BAD_WAVE_TICKET or one
+of the errors returned by [*gpioWaveCreate*].
 
-- a new wave is created which uses exactly the same resources as
-the current wave (see the C source for gpioWaveCreate for details).
+The ticket is released once anything other than PI_WAVE_PENDING is
+returned.
+D*/
+
+/*F*/
+int gpioWaveDelete(unsigned wave_id);
+/*D
+This function deletes the waveform with id wave_id.
+
+The control blocks and OOL storage used by the wave are returned
+to the free pool straight away and merged with any free neighbours,
+unless the wave is still shared through the wave cache (see
+[*gpioWaveCreate*]).  New waves are placed in the smallest free range which fits.
 
 . .
 wave_id: >=0, as returned by [*gpioWaveCreate*]
 . .
 
-Wave ids are allocated in order, 0, 1, 2, etc.
+Wave ids are allocated lowest free first, 0, 1, 2, etc.
 
 Returns 0 if OK, otherwise PI_BAD_WAVE_ID.
 D*/
 
+/*F*/
+int gpioWaveCompact(void);
+/*D
+This function packs the stored waveforms together at the bottom of
+the control block and OOL areas so that the free space forms one
+range.
+
+Waves keep their ids.  Their control blocks and OOL storage may
+move, so the function refuses to run while a wave or chain is
+being transmitted or a stream has segments queued.
+
+Use it when [*gpioWaveCreate*] fails with PI_TOO_MANY_CBS or
+PI_TOO_MANY_OOL although enough space has been freed by
+[*gpioWaveDelete*].
+
+Returns the number of waves relocated if OK, otherwise
+PI_WAVE_TX_BUSY.
+D*/
+
+/*F*/
+int gpioWaveStreamOpen(unsigned segments);
+/*D
+This function opens a waveform stream.  A stream sends waveforms
+back to back for as long as the application keeps supplying them,
+so it is not limited by PI_WAVE_MAX_PULSES or PI_WAVE_MAX_MICROS.
+
+. .
+segments: 2-32, the number of waveforms which may be queued
+. .
+
+Each segment is built with the [*gpioWaveAdd**] functions and queued
+with [*gpioWaveStreamAppend*].  The first segment starts transmission.
+Later segments are linked to the end of the previous one as they
+are appended.
+
+Any stream already open is closed first.  A stream uses the same DMA
+channel as [*gpioWaveTxSend*] and [*gpioWaveChain*], which fail with
+PI_WAVE_TX_BUSY while it is open.  [*gpioWaveTxStop*] stops the
+stream and deletes its queued segments, leaving it open.
+
+Returns 0 if OK, otherwise PI_BAD_STREAM_SEGS or PI_WAVE_TX_BUSY.
+D*/
+
+/*F*/
+int gpioWaveStreamAppend(void);
+/*D
+This function creates a segment from the data provided by the prior
+calls to the [*gpioWaveAdd**] functions and queues it on the stream.
+
+The data is consumed as by [*gpioWaveCreate*].  Sent segments are
+deleted automatically.
+
+If the stream ran out of segments before this call transmission
+restarts with the new segment.  An underrun is counted once each
+time the stream runs dry, whether noticed by this call or by
+[*gpioWaveStreamStatus*].
+
+Returns the number of queued segments if OK, otherwise
+PI_STREAM_NOT_OPEN, PI_STREAM_FULL, PI_EMPTY_WAVEFORM,
+PI_NO_WAVEFORM_ID, PI_TOO_MANY_CBS, or PI_TOO_MANY_OOL.
+
+PI_STREAM_FULL means all segments are queued.  The added data is kept
+so the call may simply be retried.
+D*/
+
+/*F*/
+int gpioWaveStreamStatus(gpioStreamStatus_t* status);
+/*D
+This function returns the state of the waveform stream.
+
+. .
+status: the stream status
+. .
+
+. .
+typedef struct
+{
+   uint32_t queued;    // segments queued or being sent
+   uint32_t free;      // segments which may still be appended
+   uint32_t sent;      // segments sent since the stream opened
+   uint32_t underruns; // times the stream ran dry
+   uint32_t running;   // 1 if the stream is being sent
+} gpioStreamStatus_t;
+. .
+
+Returns the number of queued segments if OK, otherwise
+PI_STREAM_NOT_OPEN.
+D*/
+
+/*F*/
+int gpioWaveStreamClose(void);
+/*D
+This function stops the waveform stream and deletes any queued
+segments.
+
+To let the queued segments finish first wait until
+[*gpioWaveStreamStatus*] reports no queued segments.
+
+Returns 0 if OK, otherwise PI_STREAM_NOT_OPEN.
+D*/
+
 /*F*/
 int gpioWaveTxSend(unsigned wave_id, unsigned wave_mode);
 /*D
@@ -2010,7 +2374,8 @@ wave_mode: PI_WAVE_MODE_ONE_SHOT, PI_WAVE_MODE_REPEAT,
 . .
 
 Returns the number of DMA control blocks in the waveform if OK,
-otherwise PI_BAD_WAVE_ID, or PI_BAD_WAVE_MODE.
+otherwise PI_BAD_WAVE_ID, PI_BAD_WAVE_MODE, or PI_WAVE_TX_BUSY if
+a wave stream is open.
 D*/
 
 /*F*/
@@ -2029,8 +2394,9 @@ codes and related data.
 bufSize: the number of bytes in buf
 . .
 
-Returns 0 if OK, otherwise PI_CHAIN_NESTING, PI_CHAIN_LOOP_CNT, PI_BAD_CHAIN_LOOP, PI_BAD_CHAIN_CMD, PI_CHAIN_COUNTER,
-PI_BAD_CHAIN_DELAY, PI_CHAIN_TOO_BIG, or PI_BAD_WAVE_ID.
+Returns 0 if OK, otherwise PI_CHAIN_LOOP_CNT, PI_BAD_CHAIN_LOOP, PI_BAD_CHAIN_CMD, PI_CHAIN_COUNTER,
+PI_BAD_CHAIN_DELAY, PI_CHAIN_TOO_BIG, PI_BAD_FOREVER, PI_NO_MEMORY, PI_BAD_WAVE_ID,
+or PI_WAVE_TX_BUSY if a wave stream is open.
 
 Each wave is transmitted in the order specified.  A wave may
 occur multiple times per chain.
@@ -2051,6 +2417,11 @@ Loop Forever @ 255 3      @ loop forever
 
 If present Loop Forever must be the last entry in the chain.
 
+The whole chain is checked before any current output is stopped.
+Loops run 0 times are removed and loops run once are inlined.  Small
+loops are unrolled, and nested or adjacent loops which can share a
+loop counter do so.  Adjacent delays are merged.
+
 The code is currently dimensioned to support a chain with roughly
 600 entries and 20 loop counters.
 
@@ -2136,6 +2507,9 @@ int gpioWaveTxStop(void);
 /*D
 This function aborts the transmission of the current waveform.
 
+If a wave stream is open its queued segments are deleted, the
+stream stays open.
+
 Returns 0 if OK.
 
 This function is intended to stop a waveform started in repeat mode.
@@ -2186,6 +2560,13 @@ int gpioWaveGetCbs(void);
 /*D
 This function returns the length in DMA control blocks of the current
 waveform.
+
+The count is taken after the waveform has been normalised.  Pulses
+which set or clear a GPIO to the level the waveform gave it at the
+same instant, with no delay between, are stripped of that GPIO, and
+pulses left with nothing to do are folded into the delay of the
+previous pulse.  A level set again after a delay is always kept, as
+other code may have changed the GPIO in the meantime.
 D*/
 
 /*F*/
@@ -2202,6 +2583,16 @@ This function returns the maximum possible size of a waveform in DMA
 control blocks.
 D*/
 
+/*F*/
+int gpioWaveGetRawCbs(void);
+/*D
+This function returns the length in DMA control blocks the current
+waveform would need without normalising.
+
+Compare with [*gpioWaveGetCbs*] to see how many control blocks
+normalising saved.
+D*/
+
 /*F*/
 int gpioSerialReadOpen(unsigned user_gpio, unsigned baud, unsigned data_bits);
 /*D
@@ -2221,6 +2612,11 @@ The serial data is returned in a cyclic buffer and is read using
 
 It is the caller's responsibility to read data from the cyclic buffer
 in a timely fashion.
+
+The alert thread decodes all the open GPIO together from each batch
+of samples, no watchdogs are used.  The highest usable baud rate is
+limited by the sample rate (see [*gpioCfgClock*]), allow at least
+three samples per bit.
 D*/
 
 /*F*/
@@ -2243,6 +2639,57 @@ The GPIO must be opened for bit bang reading of serial data using
 [*gpioSerialReadOpen*] prior to calling this function.
 D*/
 
+/*F*/
+int gpioSerialReadParity(unsigned user_gpio, unsigned parity);
+/*D
+This function sets whether a parity bit follows the data bits for
+bit bang serial reads.  Default is PI_BB_SER_PARITY_NONE.
+
+. .
+user_gpio: 0-31
+   parity: 0-2
+. .
+
+. .
+PI_BB_SER_PARITY_NONE 0
+PI_BB_SER_PARITY_ODD  1
+PI_BB_SER_PARITY_EVEN 2
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_NOT_SERIAL_GPIO,
+or PI_BAD_SER_PARITY.
+
+Characters with the wrong parity are still returned by
+[*gpioSerialRead*] and are counted by [*gpioSerialReadStats*].
+D*/
+
+/*F*/
+int gpioSerialReadStats(unsigned user_gpio, gpioSerialStats_t* stats);
+/*D
+This function returns the receive counts for a GPIO opened for bit
+bang reading of serial data.
+
+. .
+user_gpio: 0-31, previously opened with [*gpioSerialReadOpen*]
+    stats: the receive counts
+. .
+
+. .
+typedef struct
+{
+   uint32_t frames;        // characters received
+   uint32_t framingErrors; // characters with a low stop bit
+   uint32_t parityErrors;  // characters with bad parity
+   uint32_t overruns;      // characters lost, buffer full
+} gpioSerialStats_t;
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_NOT_SERIAL_GPIO,
+or PI_BAD_POINTER.
+
+The counts are cleared by [*gpioSerialReadOpen*] and wrap at 2^32.
+D*/
+
 /*F*/
 int gpioSerialRead(unsigned user_gpio, void* buf, size_t bufSize);
 /*D
@@ -2329,6 +2776,9 @@ This closes the I2C device associated with the handle.
 handle: >=0, as returned by a call to [*i2cOpen*]
 . .
 
+Jobs queued on the handle by [*i2cZipAsync*] and not yet started
+complete with PI_BAD_HANDLE.  A job already running is waited for.
+
 Returns 0 if OK, otherwise PI_BAD_HANDLE.
 D*/
 
@@ -2734,6 +3184,63 @@ End
 ...
 D*/
 
+/*F*/
+int i2cZipAsync(unsigned handle, char* inBuf, unsigned inLen, unsigned outLen, unsigned event);
+/*D
+This function queues a sequence of I2C operations, as described
+for [*i2cZip*], and returns at once with a ticket.
+
+. .
+handle: >=0, as returned by a call to [*i2cOpen*]
+ inBuf: pointer to the concatenated I2C commands
+ inLen: size of command buffer
+outLen: the most bytes the commands will read
+ event: 0-31 to trigger when done, or PI_I2C_NO_EVENT
+. .
+
+Returns a ticket (0-31) if OK, otherwise PI_BAD_HANDLE,
+PI_BAD_POINTER, PI_BAD_I2C_WLEN, PI_BAD_I2C_RLEN, PI_BAD_EVENT_ID,
+PI_NO_MEMORY, PI_DMA_START_FAILED, or PI_NO_I2C_TICKET.
+
+Each I2C bus has its own queue and worker thread, started by the
+first job on the bus.  Jobs on one bus run in the order they were
+queued, jobs on different buses run in parallel.  Up to 8 buses
+may have queues.
+
+The commands are copied so inBuf may be reused at once.  Pass the
+ticket to [*i2cAsyncResult*] to collect the result.  If an event
+is given it is triggered ([*eventTrigger*]) when the job is done so
+a consumer registered with [*eventSetFunc*] or an event notification
+can collect it without waiting.
+
+...
+char cmd[] = {0x04, 0x53, 0x07, 0x01, 0x32, 0x06, 0x06, 0x00};
+
+ticket = i2cZipAsync(h, cmd, sizeof(cmd), 6, 5); // event 5 when done
+...
+D*/
+
+/*F*/
+int i2cAsyncResult(unsigned ticket, char* outBuf, unsigned outLen, unsigned wait);
+/*D
+This function returns the result of a job queued by [*i2cZipAsync*].
+
+. .
+ticket: 0-31, as returned by [*i2cZipAsync*]
+outBuf: buffer to hold the bytes read
+outLen: size of output buffer
+  wait: 0 to return at once, 1 to wait for the job to finish
+. .
+
+Returns the number of bytes read (copied to outBuf) if the job
+succeeded, PI_I2C_PENDING if wait is 0 and it has not finished,
+otherwise PI_BAD_I2C_TICKET or one of the errors returned by
+[*i2cZip*].
+
+The ticket is released once anything other than PI_I2C_PENDING is
+returned.
+D*/
+
 /*F*/
 int bbI2COpen(unsigned SDA, unsigned SCL, unsigned baud);
 /*D
@@ -2820,6 +3327,14 @@ No flags are currently defined.
 
 The returned I2C data is stored in consecutive locations of outBuf.
 
+Reads and writes of at least the [*gpioCfgBitBangDMA*] threshold
+are clocked by a DMA waveform on the secondary channel if it is not
+sending a waveform.  While one is in progress the modes of the other
+GPIO in the same bank of ten as SDA or SCL must not be changed.  A
+device which stretches the clock fails the transfer with
+PI_I2C_READ_FAILED or PI_I2C_WRITE_FAILED and the bus is bit banged
+from then on.
+
 ...
 Set address 0x53
 start, write 0x32, (re)start, read 6 bytes, stop
@@ -2906,6 +3421,9 @@ The returned function value is the status of the transfer (see below).
 If there was an error the status will be less than zero
 (and will contain the error code).
 
+bscXfer fails with PI_BSC_SERVICE_OPEN while [*bscServiceOpen*]
+has the BSC.
+
 The most significant word of the returned status contains the number
 of bytes actually copied from txBuf to the BSC transmit FIFO (may be
 less than requested if the FIFO already contained untransmitted data).
@@ -2989,6 +3507,125 @@ disabling and re-enabling the TE bit on the BSC control register while in
 SPI mode.
 D*/
 
+/*F*/
+int bscServiceOpen(uint32_t control);
+/*D
+This function starts a buffered BSC slave service in the daemon
+or library.  Instead of the FIFOs being copied by repeated calls
+to [*bscXfer*], the alert thread drains the receive FIFO into a
+receive ring and refills the transmit FIFO from a transmit ring
+every millisecond.
+
+. .
+control: the BSC control word, see [*bscXfer*]
+. .
+
+Returns 0 if OK, otherwise PI_BAD_PARAM or PI_BSC_SERVICE_OPEN if
+the service is already open.
+
+Activity separated by a millisecond with no bytes moved and the
+slave not receiving ends a transaction.  Completed transactions
+are queued with their timestamps and received bytes, to be
+fetched in bulk with [*bscServiceRead*].  Event PI_EVENT_BSC is
+triggered as each one completes.
+
+The rings are PI_BSC_SERVICE_RX and PI_BSC_SERVICE_TX bytes and
+up to PI_BSC_SERVICE_TRANS transactions are queued.  Anything
+lost is counted, see [*bscServiceStats*].
+
+Opening the service clears its rings, queue and counts.  While it
+is open [*bscXfer*] fails with PI_BSC_SERVICE_OPEN.
+D*/
+
+/*F*/
+int bscServiceClose(void);
+/*D
+This function stops the BSC slave service and resets the BSC
+GPIO to INPUT mode.  Queued transactions may still be read.
+
+Returns 0 if OK, otherwise PI_BSC_NO_SERVICE.
+D*/
+
+/*F*/
+int bscServiceWrite(char* txBuf, unsigned count);
+/*D
+This function queues bytes for the master to read from the
+BSC slave.
+
+. .
+txBuf: the bytes to queue
+count: the number of bytes
+. .
+
+Returns the number of bytes queued if OK (less than count if the
+transmit ring is full), otherwise PI_BAD_POINTER or
+PI_BSC_NO_SERVICE.
+D*/
+
+/*F*/
+int bscServiceRead(bscTrans_t* trans, unsigned maxTrans, char* rxBuf, unsigned rxLen);
+/*D
+This function removes completed transactions from the BSC slave
+service queue, oldest first.
+
+. .
+   trans: an array of at least maxTrans [*bscTrans_t*]
+maxTrans: the most transactions to return
+   rxBuf: a buffer for the bytes received
+   rxLen: the size of rxBuf
+. .
+
+Returns the number of transactions if OK, otherwise PI_BAD_POINTER.
+
+. .
+typedef struct
+{
+   uint32_t tick;    // first activity of the transaction
+   uint32_t endTick; // last activity of the transaction
+   uint16_t rxCnt;   // bytes received from the master
+   uint16_t txCnt;   // bytes sent to the master
+   uint32_t flags;   // PI_BSC_TRANS_x
+} bscTrans_t;
+. .
+
+The bytes received in each transaction are stored one after
+another in rxBuf.  No more transactions are returned than have
+their bytes fit in rxLen.  A transaction whose bytes don't fit in
+rxLen at all is returned with them cut to rxLen and
+PI_BSC_TRANS_RX_OVERRUN set.
+
+. .
+PI_BSC_TRANS_RX_OVERRUN  1 // received bytes were lost
+PI_BSC_TRANS_TX_UNDERRUN 2 // the master read with no data queued
+. .
+D*/
+
+/*F*/
+int bscServiceStats(bscServiceStats_t* stats);
+/*D
+This function returns the counts of the BSC slave service since
+it was opened.
+
+. .
+stats: the service counts
+. .
+
+Returns 0 if OK.
+
+. .
+typedef struct
+{
+   uint32_t transactions; // transactions completed
+   uint32_t rxBytes;      // bytes received from the master
+   uint32_t txBytes;      // bytes sent to the master
+   uint32_t rxDropped;    // bytes dropped, receive ring full
+   uint32_t fifoOverruns; // receive FIFO overruns
+   uint32_t txUnderruns;  // master reads with no data queued
+   uint32_t transDropped; // transactions dropped, queue full
+} bscServiceStats_t;
+. .
+D*/
+
 /*F*/
 int bbSPIOpen(unsigned CS, unsigned MISO, unsigned MOSI, unsigned SCLK, unsigned baud, unsigned spiFlags);
 /*D
@@ -3069,7 +3706,12 @@ outBuf: pointer to buffer to hold returned data
 . .
 
 Returns >= 0 if OK (the number of bytes read), otherwise
-PI_BAD_USER_GPIO, PI_NOT_SPI_GPIO or PI_BAD_POINTER.
+PI_BAD_USER_GPIO, PI_NOT_SPI_GPIO, PI_BAD_POINTER, or
+PI_SPI_XFER_FAILED.
+
+Transfers of at least the [*gpioCfgBitBangDMA*] threshold are
+clocked by a DMA waveform on the secondary channel if it is not
+sending a waveform.
 
 ...
 // gcc -Wall -pthread -o bbSPIx_test bbSPIx_test.c -lpigpio
@@ -3290,6 +3932,94 @@ handle: >=0, as returned by a call to [*spiOpen*]
 
 Returns the number of bytes transferred if OK, otherwise
 PI_BAD_HANDLE, PI_BAD_SPI_COUNT, or PI_SPI_XFER_FAILED.
+
+Main SPI transfers of at least the [*gpioCfgSPIdma*] threshold are
+made by DMA if the secondary DMA channel is not sending a waveform.
+Shorter transfers, 3-wire transfers and auxiliary SPI transfers
+are polled.  A DMA transfer which does not finish in twice its
+expected time plus 20 milliseconds is stopped and the call fails
+with PI_SPI_XFER_FAILED.
+D*/
+
+/*F*/
+int spiSegments(pi_spi_seg_t* segs, unsigned numSegs);
+/*D
+This function performs a list of SPI transfers as one transaction.
+The SPI is locked once for the whole list so no other transfer can
+come between the segments.
+
+. .
+   segs: an array of SPI segments
+numSegs: 1-32, the number of segments
+. .
+
+. .
+typedef struct
+{
+   uint16_t handle; // as returned by spiOpen
+   uint16_t flags;  // PI_SPI_SEG_CS_HOLD
+   uint16_t len;    // bytes to transfer
+   uint16_t delay;  // microseconds after transfer
+   char *txBuf;     // data to send, NULL to send zeros
+   char *rxBuf;     // received data, NULL to discard
+} pi_spi_seg_t;
+. .
+
+Returns the total number of bytes transferred if OK, otherwise
+PI_BAD_POINTER, PI_BAD_SPI_SEG, PI_TOO_MANY_SEGS, PI_BAD_HANDLE,
+or PI_SPI_XFER_FAILED.
+
+Segments may use different handles on the main and auxiliary SPI.
+
+If PI_SPI_SEG_CS_HOLD is set the chip select stays asserted after
+the segment so a following segment on the same handle continues the
+same transaction.  The delay is made with chip select still held.
+Chip select is released before a segment on a different handle and
+always after the last segment.
+
+...
+char cmd[2] = {0x80, 0x00}, data[6];
+
+pi_spi_seg_t segs[2] =
+{
+   {h, PI_SPI_SEG_CS_HOLD, 2, 10, cmd, NULL},
+   {h, 0,                  6,  0, NULL, data},
+};
+
+spiSegments(segs, 2); // command, wait 10us, read 6 bytes
+...
+D*/
+
+/*F*/
+int spiGetStats(unsigned path, spiStats_t* stats);
+/*D
+This function returns the throughput statistics of one SPI
+transfer path.
+
+. .
+ path: 0-2
+stats: the path statistics
+. .
+
+. .
+PI_SPI_PATH_POLL 0 // main SPI, polled
+PI_SPI_PATH_DMA  1 // main SPI, by DMA
+PI_SPI_PATH_AUX  2 // auxiliary SPI
+. .
+
+. .
+typedef struct
+{
+   uint32_t transfers; // transfers made on the path
+   uint32_t bytes;     // bytes transferred
+   uint32_t micros;    // cumulative transfer time
+} spiStats_t;
+. .
+
+Returns 0 if OK, otherwise PI_BAD_PARAM.
+
+The counts are cleared by [*gpioInitialise*] and wrap at 2^32.
+bytes*8000000/micros gives the mean bit rate of the path.
 D*/
 
 /*F*/
@@ -3401,6 +4131,55 @@ handle: >=0, as returned by a call to [*serOpen*]
 
 Returns the number of bytes of data available (>=0) if OK,
 otherwise PI_BAD_HANDLE.
+
+Received data is drained from the device into a 4096 byte buffer
+per handle as it arrives, so [*serRead*], [*serReadByte*], and this
+function only read that buffer.  If the buffer overflows the oldest
+data is discarded and counted by [*serRxOverruns*].
+D*/
+
+/*F*/
+int serRxEvent(unsigned handle, unsigned event);
+/*D
+This function sets an event to be triggered whenever data arrives
+on the serial port associated with handle.
+
+. .
+handle: >=0, as returned by a call to [*serOpen*]
+ event: 0-31, or PI_SER_NO_EVENT to stop triggering
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE or PI_BAD_EVENT_ID.
+
+This lets a program wait for data with [*eventSetFunc*] or a socket
+client with [*EVM*] rather than polling [*serDataAvailable*].
+
+Events which fire in quick succession are reported once, so read
+everything available when the event is seen.
+
+...
+h = serOpen("/dev/ttyAMA0", 9600, 0);
+serRxEvent(h, 4);
+eventSetFunc(4, gpsData);
+...
+D*/
+
+/*F*/
+int serRxOverruns(unsigned handle);
+/*D
+This function returns the number of received bytes which were
+discarded, unread, because the receive buffer of the serial device
+associated with handle was full.
+
+. .
+handle: >=0, as returned by a call to [*serOpen*]
+. .
+
+Returns the number of bytes discarded since the device was opened
+(>=0) if OK, otherwise PI_BAD_HANDLE.
+
+A count which grows means the device is not being read often
+enough.
 D*/
 
 /*F*/
@@ -3705,6 +4484,9 @@ script: the text of the script
 
 The function returns a script id if the script is valid,
 otherwise PI_BAD_SCRIPT.
+
+If a script directory has been set with [*gpioCfgScriptDir*]
+the compiled script is also saved there.
 D*/
 
 /*F*/
@@ -3772,6 +4554,48 @@ PI_SCRIPT_FAILED
 The current value of script parameters 0 to 9 are returned in param.
 D*/
 
+/*F*/
+int gpioScriptProfile(unsigned script_id, unsigned enable);
+/*D
+This function starts or stops profiling a stored script.
+
+. .
+script_id: >=0, as returned by [*gpioStoreScript*]
+   enable: 0 stops profiling, otherwise profiling is (re)started
+. .
+
+Returns 0 if OK, otherwise PI_BAD_SCRIPT_ID or PI_NO_MEMORY.
+
+While profiling is enabled the number of times each step of the
+script is executed and the time spent executing it are recorded.
+The time a script spends blocked in WAIT, EVTWT or MILS is recorded
+separately against the blocking step.
+
+Starting profiling clears any previous counts.  Profiling slows
+script execution a little, it is off by default.
+D*/
+
+/*F*/
+int gpioScriptProfileGet(unsigned script_id, gpioScriptProf_t* prof, unsigned numProf);
+/*D
+This function returns the execution profile of a stored script.
+
+. .
+script_id: >=0, as returned by [*gpioStoreScript*]
+     prof: an array to hold the returned profile, one entry per step
+  numProf: the number of entries prof can hold
+. .
+
+Returns the number of entries returned if OK, otherwise
+PI_BAD_SCRIPT_ID, PI_BAD_POINTER, or PI_SCRIPT_NOT_PROFILED.
+
+A step is a script command.  Tags do not occupy a step.  The
+times are in microseconds.
+
+The [*gpioScriptProf_t*] entries are returned in step order.
+pigs PROCT will annotate the script source with the profile.
+D*/
+
 /*F*/
 int gpioStopScript(unsigned script_id);
 /*D
@@ -4138,6 +4962,24 @@ unsigned gpioVersion(void);
 Returns the pigpio version.
 D*/
 
+/*F*/
+int gpioSubsystems(void);
+/*D
+Returns a bit mask of the library subsystems which are running.
+
+. .
+PI_SUBSYS_DMA   1 DMA memory, sample clock, PWM, servos and waves
+PI_SUBSYS_ALERT 2 alert thread (callbacks, notifications, watchdogs)
+PI_SUBSYS_FIFO  4 pipe interface
+PI_SUBSYS_SOCK  8 socket interface
+. .
+
+Unless PI_LAZY_DMA is set (see [*gpioCfgInterfaces*]) the DMA and
+alert subsystems start with [*gpioInitialise*].
+
+Returns the mask if OK, otherwise PI_NOT_INITIALISED.
+D*/
+
 /*F*/
 int gpioGetPad(unsigned pad);
 /*D
@@ -4746,7 +5588,7 @@ Configures pigpio support of the fifo and socket interfaces.
 This function is only effective if called before [*gpioInitialise*].
 
 . .
-ifFlags: 0-7
+ifFlags: 0-31
 . .
 
 The default setting (0) is that both interfaces are enabled.
@@ -4758,6 +5600,17 @@ Or in PI_DISABLE_SOCK_IF to disable the socket interface.
 Or in PI_LOCALHOST_SOCK_IF to disable remote socket
 access (this means that the socket interface is only
 usable from the local Pi).
+
+Or in PI_DISABLE_ALERT to disable alerts (sampling).
+
+Or in PI_LAZY_DMA to defer the DMA memory, sample clock, GPIO
+sampling and alert thread until the first call which needs them
+(PWM, servos, waves, alerts, notifications, watchdogs, filters,
+bit bang serial reads, events, and script WAIT or EVTWT).  A
+process which only reads and writes GPIO or uses I2C, SPI or
+serial then locks no DMA memory and uses no idle CPU for
+sampling.  If the deferred start fails the call returns
+PI_DMA_START_FAILED.  See [*gpioSubsystems*].
 D*/
 
 /*F*/
@@ -4793,6 +5646,129 @@ numSockAddr: 0-256 (0 means all addresses allowed)
 . .
 D*/
 
+/*F*/
+int gpioCfgScriptThreads(unsigned threads);
+/*D
+Sets the number of worker threads used to run scripts.
+
+This function is only effective if called before [*gpioInitialise*].
+
+. .
+threads: 1-16
+. .
+
+Scripts are not given a thread each.  All running scripts share
+this pool of workers.  A script waiting in WAIT or EVT, or delaying
+in MILS (or MICS longer than a millisecond) does not occupy a
+worker while it waits.
+
+The workers are started when the first script is stored.
+
+The default setting is 2 threads.
+D*/
+
+/*F*/
+int gpioCfgWaveMaxPulses(unsigned pulses);
+/*D
+Sets the maximum number of pulses in a waveform.
+
+This function is only effective if called before [*gpioInitialise*].
+
+. .
+pulses: 16-12000
+. .
+
+Returns 0 if OK, otherwise PI_BAD_WAVE_PULSES.
+
+The buffers used to build waveforms are only allocated when a
+waveform is first built, and grow as needed up to this limit.
+They are freed by [*gpioWaveClear*].
+
+The default setting is PI_WAVE_MAX_PULSES (12000).
+D*/
+
+/*F*/
+int gpioCfgSPIdma(unsigned minBytes);
+/*D
+Sets the smallest main SPI transfer which is made by DMA.
+
+This function is only effective if called before [*gpioInitialise*].
+
+. .
+minBytes: 0-65536
+. .
+
+Returns 0 if OK, otherwise PI_BAD_PARAM.
+
+Transfers of minBytes or more are made by DMA on the secondary
+channel while no waveform is being sent, freeing the CPU for the
+length of the transfer.  Transfers over 65535 bytes are polled.
+0 disables SPI DMA, and its memory is not allocated.
+
+The default setting is 1024 bytes.
+D*/
+
+/*F*/
+int gpioCfgBitBangDMA(unsigned minBytes);
+/*D
+Sets the smallest bit banged I2C read or write, or SPI transfer,
+which is clocked by a DMA waveform.
+
+This function is only effective if called before [*gpioInitialise*].
+
+. .
+minBytes: 0-65536
+. .
+
+Returns 0 if OK, otherwise PI_BAD_PARAM.
+
+[*bbI2CZip*] reads and writes, and [*bbSPIXfer*] transfers, of
+minBytes or more are compiled into waves of up to 32 bytes and
+sent on the secondary channel while no waveform is being sent.
+The bus timing is then exact and the CPU sleeps instead of
+busy-waiting.  The input levels are read by the waves.  If the
+channel is busy, or the wave memory is full, the transfer is bit
+banged as usual.  0 disables bit bang DMA.
+
+I2C waves release and pull down SDA and SCL by writing the whole
+function select register of each, from a copy taken as the wave is
+built.  Mode changes made through pigpio wait for the wave to
+finish, but a change to another GPIO sharing those registers (GPIO
+0-9, 10-19, 20-29 and so on) made outside pigpio while a wave is
+being sent is undone.  Only enable bit bang DMA if nothing else
+configures those GPIO.
+
+The default setting is 0.
+D*/
+
+/*F*/
+int gpioCfgScriptDir(char* dir);
+/*D
+Sets the directory used to persist stored scripts.
+
+This function is only effective if called before [*gpioInitialise*].
+
+. .
+dir: the directory path, NULL or "" disables persistence
+. .
+
+Returns 0 if OK, otherwise PI_BAD_PATHNAME.
+
+Each script stored by [*gpioStoreScript*] is also written, in its
+compiled form, to dir/pigpio-script-<id>.img.  [*gpioDeleteScript*]
+removes the file.
+
+At [*gpioInitialise*] any images found in the directory are loaded
+into their original script slots, so script ids remain valid across
+restarts.  A damaged or unreadable image is logged and skipped.
+
+The image files are subject to the same permission checks as the
+file functions (see [*fileOpen*]), i.e. the directory must be
+listed in /opt/pigpio/access with write permission.
+
+By default scripts are not persisted.
+D*/
+
 /*F*/
 uint32_t gpioCfgGetInternals(void);
 /*D
@@ -4810,6 +5786,9 @@ settings.
 cfgVal: see source code
 . .
 
+Setting PI_CFG_WAVE_CACHE makes [*gpioWaveCreate*] return the id
+of an identical resident waveform instead of creating a new one.
+
 D*/
 
 /*F*/
@@ -5144,6 +6123,32 @@ typedef struct
 } bsc_xfer_t;
 . .
 
+bscServiceStats_t::
+. .
+typedef struct
+{
+   uint32_t transactions;
+   uint32_t rxBytes;
+   uint32_t txBytes;
+   uint32_t rxDropped;
+   uint32_t fifoOverruns;
+   uint32_t txUnderruns;
+   uint32_t transDropped;
+} bscServiceStats_t;
+. .
+
+bscTrans_t::
+. .
+typedef struct
+{
+   uint32_t tick;
+   uint32_t endTick;
+   uint16_t rxCnt;
+   uint16_t txCnt;
+   uint32_t flags;
+} bscTrans_t;
+. .
+
 *buf::
 
 A buffer to hold data being sent or being received.
@@ -5205,6 +6210,9 @@ PI_HW_CLK_MAX_FREQ 250000000
 PI_HW_CLK_MAX_FREQ_2711 375000000
 . .
 
+control::
+The BSC control word, see [*bscXfer*].
+
 count::
 The number of bytes to be transferred in an I2C, SPI, or Serial
 command.
@@ -5222,6 +6230,9 @@ PI_MIN_WAVE_DATABITS 1
 PI_MAX_WAVE_DATABITS 32
 . .
 
+dir::
+A directory path.  See [*gpioCfgScriptDir*].
+
 DMAchannel::0-15
 . .
 PI_MIN_DMA_CHANNEL 0
@@ -5239,6 +6250,9 @@ A number representing the ratio of on time to off time for PWM.
 The number may vary between 0 and range (default 255) where
 0 is off and range is fully on.
 
+enable::
+0 to stop profiling a script, otherwise start profiling.
+
 edge::0-2
 The type of GPIO edge to generate an interrupt.  See [*gpioSetISRFunc*]
 and [*gpioSetISRFuncEx*].
@@ -5253,6 +6267,9 @@ event::0-31
 An event is a signal used to inform one or more consumers
 to start an action.
 
+[*i2cZipAsync*] also accepts PI_I2C_NO_EVENT (255) and [*serRxEvent*]
+PI_SER_NO_EVENT (255) for no event.
+
 eventFunc_t::
 . .
 typedef void (*eventFunc_t) (int event, uint32_t tick);
@@ -5336,6 +6353,11 @@ These functions are only effective if called before [*gpioInitialise*].
 [*gpioCfgInterfaces*]
 [*gpioCfgSocketPort*]
 [*gpioCfgMemAlloc*]
+[*gpioCfgScriptThreads*]
+[*gpioCfgScriptDir*]
+[*gpioCfgWaveMaxPulses*]
+[*gpioCfgSPIdma*]
+[*gpioCfgBitBangDMA*]
 
 gpioGetSamplesFunc_t::
 . .
@@ -5361,6 +6383,15 @@ typedef void (*gpioISRFuncEx_t)
    (int gpio, int level, uint32_t tick, void *userdata);
 . .
 
+gpioPair_t::
+. .
+typedef struct
+{
+   uint32_t gpio;
+   uint32_t value;
+} gpioPair_t;
+. .
+
 gpioPulse_t::
 . .
 typedef struct
@@ -5380,6 +6411,39 @@ typedef struct
 } gpioSample_t;
 . .
 
+gpioScriptProf_t::
+. .
+typedef struct
+{
+   uint32_t count;
+   uint32_t micros;
+   uint32_t blocked;
+} gpioScriptProf_t;
+. .
+
+gpioSerialStats_t::
+. .
+typedef struct
+{
+   uint32_t frames;
+   uint32_t framingErrors;
+   uint32_t parityErrors;
+   uint32_t overruns;
+} gpioSerialStats_t;
+. .
+
+gpioStreamStatus_t::
+. .
+typedef struct
+{
+   uint32_t queued;
+   uint32_t free;
+   uint32_t sent;
+   uint32_t underruns;
+   uint32_t running;
+} gpioStreamStatus_t;
+. .
+
 gpioSignalFunc_t::
 . .
 typedef void (*gpioSignalFunc_t) (int signum);
@@ -5438,10 +6502,13 @@ i2cReg:: 0-255
 
 A register of an I2C device.
 
-ifFlags::0-3
+ifFlags::0-31
 . .
-PI_DISABLE_FIFO_IF 1
-PI_DISABLE_SOCK_IF 2
+PI_DISABLE_FIFO_IF   1
+PI_DISABLE_SOCK_IF   2
+PI_LOCALHOST_SOCK_IF 4
+PI_DISABLE_ALERT     8
+PI_LAZY_DMA         16
 . .
 
 *inBuf::
@@ -5503,10 +6570,17 @@ micros::
 
 A value representing microseconds.
 
+maxTrans::
+The most BSC slave transactions to return.
+
 millis::
 
 A value representing milliseconds.
 
+minBytes:: 0-65536
+The smallest main SPI transfer made by DMA, or bit banged transfer
+clocked by DMA, 0 to disable.
+
 MISO::
 The GPIO used for the MISO signal when bit banging SPI.
 
@@ -5553,14 +6627,20 @@ The number of bytes used to store characters in a string.  Depending
 on the number of bits per character there may be 1, 2, or 4 bytes
 per character.
 
+numPairs::
+The number of (GPIO, value) pairs in a batch update.
+
 numPar:: 0-10
 The number of parameters passed to a script.
 
+numProf::
+The number of [*gpioScriptProf_t*] entries which may be returned.
+
 numPulses::
 The number of pulses to be added to a waveform.
 
 numSegs::
-The number of segments in a combined I2C transaction.
+The number of segments in a combined I2C or SPI transaction.
 
 numSockAddr::
 The number of network addresses allowed to use the socket interface.
@@ -5589,9 +6669,17 @@ padStrength:: 1-16
 The mA which may be drawn from each GPIO whilst still guaranteeing the
 high and low levels.
 
+*pairs::
+An array of [*gpioPair_t*], each giving a GPIO and the dutycycle or
+pulsewidth to set.
+
 *param::
 An array of script parameters.
 
+parity:: 0-2
+The parity bit of bit bang serial data, PI_BB_SER_PARITY_NONE,
+PI_BB_SER_PARITY_ODD, or PI_BB_SER_PARITY_EVEN.
+
 pctBOOL:: 0-100
 percent On-Off-Level (OOL) buffer to consume for wave output.
 
@@ -5612,12 +6700,32 @@ typedef struct
 } pi_i2c_msg_t;
 . .
 
+pi_spi_seg_t::
+. .
+typedef struct
+{
+   uint16_t handle;
+   uint16_t flags;
+   uint16_t len;
+   uint16_t delay;
+   char *txBuf;
+   char *rxBuf;
+} pi_spi_seg_t;
+. .
+
+path:: 0-2
+A SPI transfer path, PI_SPI_PATH_POLL, PI_SPI_PATH_DMA, or
+PI_SPI_PATH_AUX.
+
 port:: 1024-32000
 The port used to bind to the pigpio socket.  Defaults to 8888.
 
 pos::
 The position of an item.
 
+*prof::
+An array of [*gpioScriptProf_t*] used to return a script profile.
+
 primaryChannel:: 0-15
 The DMA channel used to time the sampling of GPIO and to time servo and
 PWM pulses.
@@ -5630,6 +6738,15 @@ pthread_t::
 
 A thread identifier.
 
+pulses:: 16-12000
+
+The maximum number of pulses in a waveform.
+
+. .
+PI_MIN_WAVE_PULSES 16
+PI_WAVE_MAX_PULSES 12000
+. .
+
 pud::0-2
 
 The setting of the pull up/down resistor for a GPIO, which may be off,
@@ -5745,6 +6862,9 @@ The maximum number of bytes a user customised function should return.
 
 A pointer to a buffer to receive data.
 
+rxLen::
+The size of the buffer for received data.
+
 SCL::
 The user GPIO to use for the clock when bit banging I2C.
 
@@ -5791,8 +6911,16 @@ seekOffset::
 The number of bytes to move forward (positive) or backwards (negative)
 from the seek position (start, current, or end of file).
 
+segments:: 2-32
+The number of segments which may be queued on a waveform stream.
+
+. .
+PI_WAVE_STREAM_MIN_SEGS 2
+PI_WAVE_STREAM_MAX_SEGS 32
+. .
+
 *segs::
-An array of segments which make up a combined I2C transaction.
+An array of segments which make up a combined I2C or SPI transaction.
 
 serFlags::
 Flags which modify a serial open command.  None are currently defined.
@@ -5841,6 +6969,16 @@ See [*spiOpen*] and [*bbSPIOpen*].
 spiSS::
 The SPI slave select GPIO in a raw SPI transaction.
 
+spiStats_t::
+. .
+typedef struct
+{
+   uint32_t transfers;
+   uint32_t bytes;
+   uint32_t micros;
+} spiStats_t;
+. .
+
 spiTxBits::
 The number of bits to transfer dring a raw SPI transaction
 
@@ -5859,9 +6997,30 @@ PI_MIN_WAVE_HALFSTOPBITS 2
 PI_MAX_WAVE_HALFSTOPBITS 8
 . .
 
+*stats::
+A [*spiStats_t*] used to return SPI throughput statistics, a
+[*gpioSerialStats_t*] for bit bang serial reads, or a
+[*bscServiceStats_t*] for the BSC slave service.
+
+*status::
+A [*gpioStreamStatus_t*] used to return the waveform stream status.
+
 *str::
 An array of characters.
 
+threads:: 1-16
+
+The number of worker threads used to run scripts.
+
+. .
+PI_MIN_SCRIPT_THREADS 1
+PI_MAX_SCRIPT_THREADS 16
+. .
+
+ticket::
+A ticket returned by [*gpioWaveCreateAsync*] (0-15) or
+[*i2cZipAsync*] (0-31).
+
 timeout::
 A GPIO level change timeout in milliseconds.
 
@@ -5889,6 +7048,9 @@ PI_TIME_RELATIVE 0
 PI_TIME_ABSOLUTE 1
 . .
 
+*trans::
+An array of [*bscTrans_t*] used to return BSC slave transactions.
+
 *txBuf::
 
 An array of bytes to transmit.
@@ -5947,6 +7109,9 @@ void::
 
 Denoting no parameter is required
 
+wait:: 0-1
+Whether [*gpioWaveCreateResult*] waits for the create to finish.
+
 wave_id::
 
 A number identifying a waveform created by [*gpioWaveCreate*].
@@ -6114,6 +7279,42 @@ PARAMS*/
 #define PI_CMD_PROCU 117
 #define PI_CMD_WVCAP 118
 
+#define PI_CMD_PROCF 119
+#define PI_CMD_PROCT 120
+
+#define PI_CMD_WVCMP 121
+
+#define PI_CMD_WVSOP 122
+#define PI_CMD_WVSAP 123
+#define PI_CMD_WVSST 124
+#define PI_CMD_WVSCL 125
+
+#define PI_CMD_WVCRA 126
+#define PI_CMD_WVCRR 127
+
+#define PI_CMD_PWMB 128
+#define PI_CMD_SERVB 129
+
+#define PI_CMD_SUBS 130
+
+#define PI_CMD_SPIST 131
+#define PI_CMD_SPISEG 132
+
+#define PI_CMD_I2CZA 133
+#define PI_CMD_I2CAR 134
+
+#define PI_CMD_SERRE 135
+#define PI_CMD_SEROV 143
+
+#define PI_CMD_SLRP 136
+#define PI_CMD_SLRST 137
+
+#define PI_CMD_BSCSO 138
+#define PI_CMD_BSCSC 139
+#define PI_CMD_BSCSW 140
+#define PI_CMD_BSCSR 141
+#define PI_CMD_BSCSS 142
+
 /*DEF_E*/
 
 /*
@@ -6325,6 +7526,24 @@ after this command is issued.
 #define PI_CMD_INTERRUPTED -144  // Used by Python
 #define PI_NOT_ON_BCM2711 -145   // not available on BCM2711
 #define PI_ONLY_ON_BCM2711 -146  // only available on BCM2711
+#define PI_BAD_SCRIPT_THREADS -147 // bad number of script threads, not 1-16
+#define PI_SCRIPT_NOT_PROFILED -148 // script profiling is not enabled
+#define PI_BAD_WAVE_PULSES -149 // bad wave pulse ceiling, not 16-12000
+#define PI_WAVE_TX_BUSY -150    // waveform transmission in progress
+#define PI_BAD_STREAM_SEGS -151 // bad stream segments, not 2-32
+#define PI_STREAM_NOT_OPEN -152 // no waveform stream open
+#define PI_STREAM_FULL -153     // all waveform stream segments queued
+#define PI_NO_WAVE_TICKET -154  // no free asynchronous wave create ticket
+#define PI_WAVE_PENDING -155    // asynchronous wave create still running
+#define PI_BAD_WAVE_TICKET -156 // bad asynchronous wave create ticket
+#define PI_DMA_START_FAILED -157 // deferred DMA start failed
+#define PI_BAD_SPI_SEG -158      // bad SPI transaction segment
+#define PI_NO_I2C_TICKET -159    // no free asynchronous I2C ticket or queue
+#define PI_I2C_PENDING -160      // asynchronous I2C job still running
+#define PI_BAD_I2C_TICKET -161   // bad asynchronous I2C ticket
+#define PI_BAD_SER_PARITY -162   // bit bang serial parity not 0-2
+#define PI_BSC_SERVICE_OPEN -163 // BSC is in use by the slave service
+#define PI_BSC_NO_SERVICE -164   // BSC slave service not open
 
 #define PI_PIGIF_ERR_0 -2000
 #define PI_PIGIF_ERR_99 -2099
@@ -6360,6 +7579,13 @@ after this command is issued.
 #define PI_DEFAULT_UPDATE_MASK_PI4B 0x0000000FFFFFFCLL
 #define PI_DEFAULT_UPDATE_MASK_COMPUTE 0x00FFFFFFFFFFFFLL
 #define PI_DEFAULT_MEM_ALLOC_MODE PI_MEM_ALLOC_AUTO
+#define PI_DEFAULT_SCRIPT_THREADS 2
+
+#define PI_DEFAULT_WAVE_MAX_PULSES PI_WAVE_MAX_PULSES
+
+#define PI_DEFAULT_SPI_DMA_BYTES 1024
+
+#define PI_DEFAULT_BB_DMA_BYTES 0
 
 #define PI_DEFAULT_CFG_INTERNALS 0
 
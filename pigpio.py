@@ -113,6 +113,7 @@ write                     Write a GPIO
 PWM_(overrides_servo_commands_on_same_GPIO)
 
 set_PWM_dutycycle         Start/stop PWM pulses on a GPIO
+set_PWM_dutycycles        Set the PWM dutycycle of several GPIO at once
 set_PWM_frequency         Set PWM frequency of a GPIO
 set_PWM_range             Configure PWM range of a GPIO
 
@@ -125,6 +126,7 @@ get_PWM_real_range        Get underlying PWM range for a GPIO
 Servo_(overrides_PWM_commands_on_same_GPIO)
 
 set_servo_pulsewidth      Start/Stop servo pulses on a GPIO
+set_servo_pulsewidths     Set the servo pulsewidth of several GPIO at once
 
 get_servo_pulsewidth      Get servo pulsewidth set on a GPIO
 
@@ -230,6 +232,12 @@ I2C/SPI_SLAVE
 bsc_xfer                  I2C/SPI as slave transfer
 bsc_i2c                   I2C as slave transfer
 
+bsc_service_open          Opens the buffered BSC slave service
+bsc_service_close         Closes the buffered BSC slave service
+bsc_service_write         Queues bytes for the master to read
+bsc_service_read          Reads completed BSC transactions
+bsc_service_stats         Gets the BSC service counts
+
 SERIAL
 
 serial_open               Opens a serial device
@@ -243,6 +251,9 @@ serial_write              Writes bytes to a serial device
 
 serial_data_available     Returns number of bytes ready to be read
 
+serial_rx_event           Sets an event to trigger when data arrives
+serial_rx_overruns        Returns bytes lost to a full receive buffer
+
 SERIAL_BIT_BANG_(read_only)
 
 bb_serial_read_open       Open a GPIO for bit bang serial reads
@@ -260,6 +271,7 @@ spi_close                 Closes a SPI device
 spi_read                  Reads bytes from a SPI device
 spi_write                 Writes bytes to a SPI device
 spi_xfer                  Transfers bytes with a SPI device
+spi_segments              Performs multiple SPI transfers
 
 SPI_BIT_BANG
 
@@ -318,6 +330,7 @@ get_current_tick          Get current tick (microseconds)
 
 get_hardware_revision     Get hardware revision
 get_pigpio_version        Get the pigpio version
+get_subsystems            Get the live daemon subsystems
 
 pigpio.error_text         Gets error text from error number
 pigpio.tickDiff           Returns difference between two ticks
@@ -392,6 +405,31 @@ WAVE_MODE_REPEAT       =1
 WAVE_MODE_ONE_SHOT_SYNC=2
 WAVE_MODE_REPEAT_SYNC  =3
 
+# live subsystems
+
+SUBSYS_DMA   = 1
+SUBSYS_ALERT = 2
+SUBSYS_FIFO  = 4
+SUBSYS_SOCK  = 8
+
+# spi_segments flags
+
+SPI_SEG_CS_HOLD = 1
+
+# i2c_zip_async event
+
+I2C_NO_EVENT = 255
+
+# serial_rx_event event
+
+SER_NO_EVENT = 255
+
+# bb_serial_parity parity
+
+BB_SER_PARITY_NONE = 0
+BB_SER_PARITY_ODD  = 1
+BB_SER_PARITY_EVEN = 2
+
 WAVE_NOT_FOUND = 9998 # Transmitted wave not found.
 NO_TX_WAVE     = 9999 # No wave being transmitted.
 
@@ -574,6 +612,25 @@ _PI_CMD_EVT  =116
 _PI_CMD_PROCU=117
 _PI_CMD_WVCAP=118
 
+_PI_CMD_PWMB =128
+_PI_CMD_SERVB=129
+
+_PI_CMD_SUBS =130
+
+_PI_CMD_SPISEG=132
+_PI_CMD_I2CZA =133
+_PI_CMD_I2CAR =134
+_PI_CMD_SERRE =135
+_PI_CMD_SEROV =143
+_PI_CMD_SLRP  =136
+_PI_CMD_SLRST =137
+
+_PI_CMD_BSCSO =138
+_PI_CMD_BSCSC =139
+_PI_CMD_BSCSW =140
+_PI_CMD_BSCSR =141
+_PI_CMD_BSCSS =142
+
 # pigpio error numbers
 
 _PI_INIT_FAILED     =-1
@@ -723,6 +780,24 @@ PI_BAD_EVENT_ID     =-143
 PI_CMD_INTERRUPTED  =-144
 PI_NOT_ON_BCM2711   =-145
 PI_ONLY_ON_BCM2711  =-146
+PI_BAD_SCRIPT_THREADS =-147
+PI_SCRIPT_NOT_PROFILED =-148
+PI_BAD_WAVE_PULSES  =-149
+PI_WAVE_TX_BUSY     =-150
+PI_BAD_STREAM_SEGS  =-151
+PI_STREAM_NOT_OPEN  =-152
+PI_STREAM_FULL      =-153
+PI_NO_WAVE_TICKET   =-154
+PI_WAVE_PENDING     =-155
+PI_BAD_WAVE_TICKET  =-156
+PI_DMA_START_FAILED =-157
+PI_BAD_SPI_SEG      =-158
+PI_NO_I2C_TICKET    =-159
+PI_I2C_PENDING      =-160
+PI_BAD_I2C_TICKET   =-161
+PI_BAD_SER_PARITY   =-162
+PI_BSC_SERVICE_OPEN =-163
+PI_BSC_NO_SERVICE   =-164
 
 # pigpio error text
 
@@ -871,6 +946,24 @@ _errors=[
    [PI_CMD_INTERRUPTED   , "pigpio command interrupted"],
    [PI_NOT_ON_BCM2711    , "not available on BCM2711"],
    [PI_ONLY_ON_BCM2711   , "only available on BCM2711"],
+   [PI_BAD_SCRIPT_THREADS , "bad number of script threads, not 1-16"],
+   [PI_SCRIPT_NOT_PROFILED , "script profiling is not enabled"],
+   [PI_BAD_WAVE_PULSES   , "bad wave pulse ceiling, not 16-12000"],
+   [PI_WAVE_TX_BUSY      , "waveform transmission in progress"],
+   [PI_BAD_STREAM_SEGS   , "bad stream segments, not 2-32"],
+   [PI_STREAM_NOT_OPEN   , "no waveform stream open"],
+   [PI_STREAM_FULL       , "all waveform stream segments queued"],
+   [PI_NO_WAVE_TICKET    , "no free asynchronous wave create ticket"],
+   [PI_WAVE_PENDING      , "asynchronous wave create still running"],
+   [PI_BAD_WAVE_TICKET   , "bad asynchronous wave create ticket"],
+   [PI_DMA_START_FAILED  , "deferred DMA start failed"],
+   [PI_BAD_SPI_SEG       , "bad SPI transaction segment"],
+   [PI_NO_I2C_TICKET     , "no free asynchronous I2C ticket or queue"],
+   [PI_I2C_PENDING       , "asynchronous I2C job still running"],
+   [PI_BAD_I2C_TICKET    , "bad asynchronous I2C ticket"],
+   [PI_BAD_SER_PARITY    , "bit bang serial parity not 0-2"],
+   [PI_BSC_SERVICE_OPEN  , "BSC is in use by the slave service"],
+   [PI_BSC_NO_SERVICE    , "BSC slave service not open"],
 ]
 
 _except_a = "%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%\n{}"
@@ -1480,6 +1573,38 @@ class pi():
       return _u2i(_pigpio_command(
          self.sl, _PI_CMD_PWM, user_gpio, int(dutycycle)))
 
+   def set_PWM_dutycycles(self, pairs):
+      """
+      Sets the PWM dutycycle of several GPIO at once.
+
+      pairs:= a list of (user_gpio, dutycycle) pairs.
+
+      The dutycycles are as for [*set_PWM_dutycycle*].
+
+      Every pair is checked before any GPIO is changed.  All the
+      GPIO are updated in the same cycle.
+
+      ...
+      pi.set_PWM_dutycycles([(4, 64), (17, 128), (18, 255)])
+      ...
+      """
+      # pigpio message format
+
+      # I p1 0
+      # I p2 0
+      # I p3 pairs * 8
+      ## extension ##
+      # II gpio/value * pairs
+      if len(pairs):
+         ext = bytearray()
+         for g, v in pairs:
+            ext.extend(struct.pack("II", g, int(v)))
+         extents = [ext]
+         return _u2i(_pigpio_command_ext(
+            self.sl, _PI_CMD_PWMB, 0, 0, len(pairs)*8, extents))
+      else:
+         return 0
+
    def get_PWM_dutycycle(self, user_gpio):
       """
       Returns the PWM dutycycle being used on the GPIO.
@@ -1678,6 +1803,38 @@ class pi():
       return _u2i(_pigpio_command(
          self.sl, _PI_CMD_SERVO, user_gpio, int(pulsewidth)))
 
+   def set_servo_pulsewidths(self, pairs):
+      """
+      Sets the servo pulsewidth of several GPIO at once.
+
+      pairs:= a list of (user_gpio, pulsewidth) pairs.
+
+      The pulsewidths are as for [*set_servo_pulsewidth*].
+
+      Every pair is checked before any GPIO is changed.  All the
+      GPIO are updated in the same cycle.
+
+      ...
+      pi.set_servo_pulsewidths([(17, 1000), (23, 2000)])
+      ...
+      """
+      # pigpio message format
+
+      # I p1 0
+      # I p2 0
+      # I p3 pairs * 8
+      ## extension ##
+      # II gpio/value * pairs
+      if len(pairs):
+         ext = bytearray()
+         for g, v in pairs:
+            ext.extend(struct.pack("II", g, int(v)))
+         extents = [ext]
+         return _u2i(_pigpio_command_ext(
+            self.sl, _PI_CMD_SERVB, 0, 0, len(pairs)*8, extents))
+      else:
+         return 0
+
    def get_servo_pulsewidth(self, user_gpio):
       """
       Returns the servo pulsewidth being used on the GPIO.
@@ -2099,6 +2256,25 @@ class pi():
       """
       return _pigpio_command(self.sl, _PI_CMD_PIGPV, 0, 0)
 
+   def get_subsystems(self):
+      """
+      Returns a bit mask of the daemon subsystems which are running.
+
+      SUBSYS_DMA   1 DMA memory, sample clock, PWM, servos and waves
+      SUBSYS_ALERT 2 alert thread (callbacks, notifications, watchdogs)
+      SUBSYS_FIFO  4 pipe interface
+      SUBSYS_SOCK  8 socket interface
+
+      If the daemon was started with -o the DMA and alert subsystems
+      only start with the first command which needs them.
+
+      ...
+      if not pi.get_subsystems() & pigpio.SUBSYS_DMA:
+         print("DMA not started yet")
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_SUBS, 0, 0))
+
    def wave_clear(self):
       """
       Clears all waveforms and any data added by calls to the
@@ -3257,6 +3433,61 @@ class pi():
             rdata = self._rxbuf(bytes)
       return bytes, rdata
 
+   def i2c_zip_async(self, handle, data, out_len, event=I2C_NO_EVENT):
+      """
+      This function queues the [*i2c_zip*] sequence in data and
+      returns at once with a ticket (0-31).
+
+       handle:= >=0 (as returned by a prior call to [*i2c_open*]).
+         data:= the concatenated I2C commands, see [*i2c_zip*].
+      out_len:= the most read bytes to keep for [*i2c_async_result*].
+        event:= 0-31, triggered when the sequence has finished,
+                or I2C_NO_EVENT.
+
+      Sequences for different buses run in parallel, those for the
+      same bus run in the order queued.
+
+      ...
+      t = pi.i2c_zip_async(h, [4, 0x53, 7, 1, 0x32, 6, 6, 0], 6, 3)
+      ...
+      """
+      # I p1 handle
+      # I p2 out_len
+      # I p3 4+len
+      ## extension ##
+      # I event
+      # s len data bytes
+
+      ext = [struct.pack("I", event), data]
+      return _u2i(_pigpio_command_ext(
+         self.sl, _PI_CMD_I2CZA, handle, out_len, 4+len(data), ext))
+
+   def i2c_async_result(self, ticket, wait=0):
+      """
+      This function returns the result of the queued I2C sequence
+      with the given ticket.
+
+      ticket:= as returned by [*i2c_zip_async*].
+        wait:= 1 to wait for the sequence to finish, otherwise 0.
+
+      The returned value is a tuple of the number of bytes read and
+      a bytearray containing the bytes.  If wait is 0 and the
+      sequence has not finished the count is PI_I2C_PENDING (-160) and the
+      ticket may be polled again.
+
+      ...
+      (count, data) = pi.i2c_async_result(t, 1)
+      ...
+      """
+      bytes = PI_CMD_INTERRUPTED
+      rdata = ""
+      with self.sl.l:
+         bytes = u2i(_pigpio_command_nolock(
+            self.sl, _PI_CMD_I2CAR, ticket, wait))
+         if bytes > 0:
+            rdata = self._rxbuf(bytes)
+      return bytes, rdata
+
 
    def bb_spi_open(self, CS, MISO, MOSI, SCLK, baud=100000, spi_flags=0):
       """
@@ -3873,6 +4104,121 @@ class pi():
          control = 0
       return self.bsc_xfer(control, data)
 
+   def bsc_service_open(self, bsc_control):
+      """
+      Starts a buffered BSC slave service in the daemon.  The daemon
+      drains the BSC receive FIFO and refills the transmit FIFO
+      every millisecond, so no transfers are missed between calls.
+
+      bsc_control:= see [*bsc_xfer*].
+
+      Activity separated by a millisecond with nothing moved ends
+      a transaction.  Completed transactions are queued to be
+      fetched with [*bsc_service_read*] and event [*EVENT_BSC*] is
+      triggered as each one completes.
+
+      While the service is open [*bsc_xfer*] fails, as does a
+      second open.
+
+      ...
+      pi.bsc_service_open((0x13<<16)|0x305) # I2C slave at 0x13
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_BSCSO, bsc_control, 0))
+
+   def bsc_service_close(self):
+      """
+      Stops the BSC slave service.  Queued transactions may still
+      be read.
+
+      ...
+      pi.bsc_service_close()
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_BSCSC, 0, 0))
+
+   def bsc_service_write(self, data):
+      """
+      Queues bytes for the master to read from the BSC slave.
+
+      data:= the bytes to queue.
+
+      Returns the number of bytes queued, less than asked if the
+      transmit ring is full.
+
+      ...
+      pi.bsc_service_write(b'\x02\x03\x04')
+      ...
+      """
+      # I p1 0
+      # I p2 0
+      # I p3 len
+      ## extension ##
+      # s len data bytes
+
+      return _u2i(_pigpio_command_ext(
+         self.sl, _PI_CMD_BSCSW, 0, 0, len(data), [data]))
+
+   def bsc_service_read(self, max_trans=0, max_bytes=0):
+      """
+      Removes completed transactions from the BSC slave service
+      queue, oldest first.
+
+      max_trans:= the most transactions to return, 0 for as many
+                  as the reply will hold.
+      max_bytes:= the most received bytes to return, 0 for as
+                  many as the reply will hold.
+
+      The returned value is a list with a tuple for each
+      transaction of its start tick, end tick, flags (1 received
+      bytes lost, 2 master read with no data queued), the number
+      of bytes sent, and a bytearray of the bytes received.
+
+      ...
+      for (tick, end, flags, sent, data) in pi.bsc_service_read():
+         print(tick, end, flags, sent, data)
+      ...
+      """
+      bytes = PI_CMD_INTERRUPTED
+      with self.sl.l:
+         bytes = u2i(_pigpio_command_nolock(
+            self.sl, _PI_CMD_BSCSR, max_trans, max_bytes))
+         if bytes > 0:
+            rx = self._rxbuf(bytes)
+            count = struct.unpack("I", rx[0:4])[0]
+            pos = 4 + (count * 16)
+            trans = []
+            for i in range(count):
+               tick, end, rxCnt, txCnt, flags = struct.unpack(
+                  "IIHHI", rx[4+(i*16):20+(i*16)])
+               trans.append((tick, end, flags, txCnt, rx[pos:pos+rxCnt]))
+               pos += rxCnt
+            return trans
+      return bytes
+
+   def bsc_service_stats(self):
+      """
+      Returns the counts of the BSC slave service since it was
+      opened.
+
+      The returned value is a tuple of the transactions completed,
+      the bytes received, the bytes sent, the received bytes
+      dropped, the receive FIFO overruns, the master reads with
+      no data queued, and the transactions dropped.
+
+      ...
+      (trans, rx, tx, dropped, overruns, underruns, lost) = (
+         pi.bsc_service_stats())
+      ...
+      """
+      bytes = PI_CMD_INTERRUPTED
+      with self.sl.l:
+         bytes = u2i(_pigpio_command_nolock(
+            self.sl, _PI_CMD_BSCSS, 0, 0))
+         if bytes > 0:
+            return struct.unpack("IIIIIII", self._rxbuf(bytes))
+      return bytes
+
    def spi_open(self, spi_channel, baud, spi_flags=0):
       """
       Returns a handle for the SPI device on the channel.  Data
@@ -4080,6 +4426,66 @@ class pi():
             rdata = self._rxbuf(bytes)
       return bytes, rdata
 
+   def spi_segments(self, segs):
+      """
+      Performs a list of SPI transfers as one transaction in a
+      single round trip.  No other SPI transfer comes between
+      the segments.
+
+      segs:= a list of (handle, data, flags, delay) tuples.  flags
+             and delay (microseconds after the transfer) may be
+             omitted and default to 0.
+
+      If flags is SPI_SEG_CS_HOLD the chip select stays asserted
+      after the segment so the next segment on the same handle
+      continues the same transaction.  The delay is made with
+      chip select held.  Chip select is always released after
+      the last segment.
+
+      The returned value is a tuple of the total number of bytes
+      transferred and a list holding a bytearray of the bytes read
+      in each segment.  If there was an error the number of bytes
+      will be less than zero (and will contain the error code).
+
+      ...
+      (count, rx) = pi.spi_segments([
+         (h, [0x80, 0x00], pigpio.SPI_SEG_CS_HOLD, 10),
+         (h, [0]*6)])
+
+      data = rx[1] # the six bytes read after the command
+      ...
+      """
+      # I p1 number of segments
+      # I p2 0
+      # I p3 len
+      ## extension ##
+      # per segment: B handle, B flags, H len, H delay, s len data
+
+      ext = []
+      lens = []
+      total = 0
+      for seg in segs:
+         handle, data = seg[0], seg[1]
+         flags = seg[2] if len(seg) > 2 else 0
+         delay = seg[3] if len(seg) > 3 else 0
+         ext.append(struct.pack("<BBHH", handle, flags, len(data), delay))
+         ext.append(data)
+         lens.append(len(data))
+         total += 6 + len(data)
+
+      bytes = PI_CMD_INTERRUPTED
+      rdata = []
+      with self.sl.l:
+         bytes = u2i(_pigpio_command_ext_nolock(
+            self.sl, _PI_CMD_SPISEG, len(segs), 0, total, ext))
+         if bytes > 0:
+            buf = self._rxbuf(bytes)
+            pos = 0
+            for n in lens:
+               rdata.append(buf[pos:pos+n])
+               pos += n
+      return bytes, rdata
+
    def serial_open(self, tty, baud, ser_flags=0):
       """
       Returns a handle for the serial tty device opened
@@ -4227,6 +4633,38 @@ class pi():
       """
       return _u2i(_pigpio_command(self.sl, _PI_CMD_SERDA, handle, 0))
 
+   def serial_rx_event(self, handle, event):
+      """
+      Sets an event to be triggered whenever data arrives on the
+      device associated with handle.
+
+      handle:= >=0 (as returned by a prior call to [*serial_open*]).
+       event:= 0-31, or SER_NO_EVENT to stop triggering.
+
+      Use [*event_callback*] or [*wait_for_event*] to learn when
+      data is ready rather than polling [*serial_data_available*].
+
+      ...
+      pi.serial_rx_event(h1, 4)
+      cb = pi.event_callback(4, gps_data)
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_SERRE, handle, event))
+
+   def serial_rx_overruns(self, handle):
+      """
+      Returns the number of received bytes which were discarded,
+      unread, because the receive buffer of the device associated
+      with handle was full.
+
+      handle:= >=0 (as returned by a prior call to [*serial_open*]).
+
+      ...
+      lost = pi.serial_rx_overruns(h1)
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_SEROV, handle, 0))
+
    def gpio_trigger(self, user_gpio, pulse_len=10, level=1):
       """
       Send a trigger pulse to a GPIO.  The GPIO is set to
@@ -4562,6 +5000,44 @@ class pi():
       """
       return _u2i(_pigpio_command(self.sl, _PI_CMD_SLRI, user_gpio, invert))
 
+   def bb_serial_parity(self, user_gpio, parity):
+      """
+      Set the parity for bit bang serial reads.
+
+      user_gpio:= 0-31 (opened in a prior call to [*bb_serial_read_open*])
+         parity:= 0-2 (0 none, 1 odd, 2 even)
+
+      Characters with bad parity are still returned by
+      [*bb_serial_read*] and are counted by [*bb_serial_stats*].
+
+      ...
+      status = pi.bb_serial_parity(17, pigpio.BB_SER_PARITY_EVEN)
+      ...
+      """
+      return _u2i(_pigpio_command(self.sl, _PI_CMD_SLRP, user_gpio, parity))
+
+   def bb_serial_stats(self, user_gpio):
+      """
+      Returns the frame and error counts for bit bang serial reads.
+
+      user_gpio:= 0-31 (opened in a prior call to [*bb_serial_read_open*])
+
+      The returned value is a tuple of the characters received,
+      those with a low stop bit, those with bad parity, and those
+      lost because the buffer was full.
+
+      ...
+      (frames, framing, parity, overruns) = pi.bb_serial_stats(17)
+      ...
+      """
+      bytes = PI_CMD_INTERRUPTED
+      with self.sl.l:
+         bytes = u2i(_pigpio_command_nolock(
+            self.sl, _PI_CMD_SLRST, user_gpio, 0))
+         if bytes > 0:
+            return struct.unpack("IIII", self._rxbuf(bytes))
+      return bytes
+
 
    def custom_1(self, arg1=0, arg2=0, argx=[]):
       """
@@ -5501,6 +5977,24 @@ def xref():
    PI_CMD_INTERRUPTED = -144
    PI_NOT_ON_BCM2711   = -145
    PI_ONLY_ON_BCM2711  = -146
+   PI_BAD_SCRIPT_THREADS = -147
+   PI_SCRIPT_NOT_PROFILED = -148
+   PI_BAD_WAVE_PULSES = -149
+   PI_WAVE_TX_BUSY = -150
+   PI_BAD_STREAM_SEGS = -151
+   PI_STREAM_NOT_OPEN = -152
+   PI_STREAM_FULL = -153
+   PI_NO_WAVE_TICKET = -154
+   PI_WAVE_PENDING = -155
+   PI_BAD_WAVE_TICKET = -156
+   PI_DMA_START_FAILED = -157
+   PI_BAD_SPI_SEG = -158
+   PI_NO_I2C_TICKET = -159
+   PI_I2C_PENDING = -160
+   PI_BAD_I2C_TICKET = -161
+   PI_BAD_SER_PARITY = -162
+   PI_BSC_SERVICE_OPEN = -163
+   PI_BSC_NO_SERVICE = -164
    . .
 
    event:0-31
@@ -60,6 +60,10 @@ static unsigned DMAprimaryChannel = PI_DEFAULT_DMA_NOT_SET;
 static unsigned DMAsecondaryChannel = PI_DEFAULT_DMA_NOT_SET;
 static unsigned socketPort = PI_DEFAULT_SOCKET_PORT;
 static unsigned memAllocMode = PI_DEFAULT_MEM_ALLOC_MODE;
+static unsigned scriptThreads = PI_DEFAULT_SCRIPT_THREADS;
+static unsigned spiDmaBytes = PI_DEFAULT_SPI_DMA_BYTES;
+static unsigned bbDmaBytes = PI_DEFAULT_BB_DMA_BYTES;
+static char* scriptDir = NULL;
 static uint64_t updateMask = -1;
 
 static uint32_t cfgInternals = PI_DEFAULT_CFG_INTERNALS;
@@ -101,14 +105,19 @@ usage() {
           "   -e value,   secondary DMA channel, 0-14,       default 6\n"
           "   -f,         disable fifo interface,            default enabled\n"
           "   -g,         run in foreground (do not fork),   default disabled\n"
+          "   -i value,   bit bang DMA threshold, 0=off,     default 0\n"
+          "   -j value,   SPI DMA threshold bytes, 0=off,    default 1024\n"
           "   -k,         disable socket interface,          default enabled\n"
           "   -l,         localhost socket only              default local+remote\n"
           "   -m,         disable alerts                     default enabled\n"
           "   -n IP addr, allow address, name or dotted,     default allow all\n"
+          "   -o,         defer DMA until first needed,      default disabled\n"
           "   -p value,   socket port, 1024-32000,           default 8888\n"
+          "   -r dir,     persisted script directory,        default none\n"
           "   -s value,   sample rate, 1, 2, 4, 5, 8, or 10, default 5\n"
           "   -t value,   clock peripheral, 0=PWM 1=PCM,     default PCM\n"
           "   -v, -V,     display pigpio version and exit\n"
+          "   -w value,   script worker threads, 1-16,       default 2\n"
           "   -x mask,    GPIO which may be updated,         default board GPIO\n"
           "EXAMPLE\n"
           "sudo pigpiod -s 2 -b 200 -f\n"
@@ -170,7 +179,7 @@ initOpts(int argc, char* argv[]) {
   uint32_t addr;
   int64_t mask;
 
-  while((opt = getopt(argc, argv, "a:b:c:d:e:fgkln:mp:s:t:x:vV")) != -1) {
+  while((opt = getopt(argc, argv, "a:b:c:d:e:fgi:j:kln:mop:r:s:t:w:x:vV")) != -1) {
     switch(opt) {
       case 'a':
         i = getNum(optarg, &err);
@@ -216,12 +225,30 @@ initOpts(int argc, char* argv[]) {
 
       case 'g': foreground = 1; break;
 
+      case 'i':
+        i = getNum(optarg, &err);
+        if((i >= 0) && (i <= PI_MAX_BB_DMA_BYTES))
+          bbDmaBytes = i;
+        else
+          fatal("invalid -i option (%d)", i);
+        break;
+
+      case 'j':
+        i = getNum(optarg, &err);
+        if((i >= 0) && (i <= PI_MAX_SPI_DMA_BYTES))
+          spiDmaBytes = i;
+        else
+          fatal("invalid -j option (%d)", i);
+        break;
+
       case 'k': ifFlags |= PI_DISABLE_SOCK_IF; break;
 
       case 'l': ifFlags |= PI_LOCALHOST_SOCK_IF; break;
 
       case 'm': ifFlags |= PI_DISABLE_ALERT; break;
 
+      case 'o': ifFlags |= PI_LAZY_DMA; break;
+
       case 'n':
         addr = checkAddr(optarg);
         if(addr && (numSockNetAddr < MAX_CONNECT_ADDRESSES))
@@ -238,6 +265,13 @@ initOpts(int argc, char* argv[]) {
           fatal("invalid -p option (%d)", i);
         break;
 
+      case 'r':
+        if(optarg[0])
+          scriptDir = optarg;
+        else
+          fatal("invalid -r option (%s)", optarg);
+        break;
+
       case 's':
         i = getNum(optarg, &err);
 
@@ -267,6 +301,14 @@ initOpts(int argc, char* argv[]) {
         exit(EXIT_SUCCESS);
         break;
 
+      case 'w':
+        i = getNum(optarg, &err);
+        if((i >= PI_MIN_SCRIPT_THREADS) && (i <= PI_MAX_SCRIPT_THREADS))
+          scriptThreads = i;
+        else
+          fatal("invalid -w option (%d)", i);
+        break;
+
       case 'x':
         mask = getNum(optarg, &err);
         if(!err) {
@@ -360,6 +402,15 @@ main(int argc, char** argv) {
 
   gpioCfgMemAlloc(memAllocMode);
 
+  gpioCfgScriptThreads(scriptThreads);
+
+  gpioCfgSPIdma(spiDmaBytes);
+
+  gpioCfgBitBangDMA(bbDmaBytes);
+
+  if(scriptDir && (gpioCfgScriptDir(scriptDir) < 0))
+    fatal("invalid -r option (%s)", scriptDir);
+
   if(updateMaskSet)
     gpioCfgPermissions(updateMask);
 
@@ -762,6 +762,27 @@ set_PWM_dutycycle(int pi, unsigned user_gpio, unsigned dutycycle) {
   return pigpio_command(pi, PI_CMD_PWM, user_gpio, dutycycle, 1);
 }
 
+int
+set_PWM_dutycycles(int pi, unsigned numPairs, gpioPair_t* pairs) {
+  gpioExtent_t ext[1];
+
+  /*
+  p1=0
+  p2=0
+  p3=pairs*sizeof(gpioPair_t)
+  ## extension ##
+  gpioPair_t[] pairs
+  */
+
+  if(!numPairs)
+    return 0;
+
+  ext[0].size = numPairs * sizeof(gpioPair_t);
+  ext[0].ptr = pairs;
+
+  return pigpio_command_ext(pi, PI_CMD_PWMB, 0, 0, ext[0].size, 1, ext, 1);
+}
+
 int
 get_PWM_dutycycle(int pi, unsigned user_gpio) {
   return pigpio_command(pi, PI_CMD_GDC, user_gpio, 0, 1);
@@ -797,6 +818,27 @@ set_servo_pulsewidth(int pi, unsigned user_gpio, unsigned pulsewidth) {
   return pigpio_command(pi, PI_CMD_SERVO, user_gpio, pulsewidth, 1);
 }
 
+int
+set_servo_pulsewidths(int pi, unsigned numPairs, gpioPair_t* pairs) {
+  gpioExtent_t ext[1];
+
+  /*
+  p1=0
+  p2=0
+  p3=pairs*sizeof(gpioPair_t)
+  ## extension ##
+  gpioPair_t[] pairs
+  */
+
+  if(!numPairs)
+    return 0;
+
+  ext[0].size = numPairs * sizeof(gpioPair_t);
+  ext[0].ptr = pairs;
+
+  return pigpio_command_ext(pi, PI_CMD_SERVB, 0, 0, ext[0].size, 1, ext, 1);
+}
+
 int
 get_servo_pulsewidth(int pi, unsigned user_gpio) {
   return pigpio_command(pi, PI_CMD_GPW, user_gpio, 0, 1);
@@ -895,6 +937,11 @@ get_pigpio_version(int pi) {
   return pigpio_command(pi, PI_CMD_PIGPV, 0, 0, 1);
 }
 
+int
+get_subsystems(int pi) {
+  return pigpio_command(pi, PI_CMD_SUBS, 0, 0, 1);
+}
+
 int
 wave_clear(int pi) {
   return pigpio_command(pi, PI_CMD_WVCLR, 0, 0, 1);
@@ -1251,6 +1298,31 @@ bb_serial_invert(int pi, unsigned user_gpio, unsigned invert) {
   return pigpio_command(pi, PI_CMD_SLRI, user_gpio, invert, 1);
 }
 
+int
+bb_serial_parity(int pi, unsigned user_gpio, unsigned parity) {
+  return pigpio_command(pi, PI_CMD_SLRP, user_gpio, parity, 1);
+}
+
+int
+bb_serial_stats(int pi, unsigned user_gpio, gpioSerialStats_t* stats) {
+  int bytes;
+
+  bytes = pigpio_command(pi, PI_CMD_SLRST, user_gpio, 0, 0);
+
+  if(bytes > 0) {
+    bytes = recvMax(pi, stats, sizeof(gpioSerialStats_t), bytes);
+
+    if(bytes == sizeof(gpioSerialStats_t))
+      bytes = 0;
+    else
+      bytes = pigif_bad_recv;
+  }
+
+  _pmu(pi);
+
+  return bytes;
+}
+
 int
 i2c_open(int pi, unsigned i2c_bus, unsigned i2c_addr, uint32_t i2c_flags) {
   gpioExtent_t ext[1];
@@ -1518,6 +1590,42 @@ i2c_zip(int pi, unsigned handle, char* inBuf, unsigned inLen, char* outBuf, unsi
   return bytes;
 }
 
+int
+i2c_zip_async(int pi, unsigned handle, char* inBuf, unsigned inLen, unsigned outLen, unsigned event) {
+  gpioExtent_t ext[2];
+
+  /*
+  p1=handle
+  p2=outLen
+  p3=4+inLen
+  ## extension ##
+  uint32_t event
+  char inBuf[inLen]
+  */
+
+  ext[0].size = sizeof(uint32_t);
+  ext[0].ptr = &event;
+  ext[1].size = inLen;
+  ext[1].ptr = inBuf;
+
+  return pigpio_command_ext(pi, PI_CMD_I2CZA, handle, outLen, 4 + inLen, 2, ext, 1);
+}
+
+int
+i2c_async_result(int pi, unsigned ticket, char* outBuf, unsigned outLen, unsigned wait) {
+  int bytes;
+
+  bytes = pigpio_command(pi, PI_CMD_I2CAR, ticket, wait, 0);
+
+  if(bytes > 0) {
+    bytes = recvMax(pi, outBuf, outLen, bytes);
+  }
+
+  _pmu(pi);
+
+  return bytes;
+}
+
 int
 bb_i2c_open(int pi, unsigned SDA, unsigned SCL, unsigned baud) {
   gpioExtent_t ext[1];
@@ -1712,6 +1820,81 @@ spi_xfer(int pi, unsigned handle, char* txBuf, char* rxBuf, unsigned count) {
   return bytes;
 }
 
+int
+spi_segments(int pi, pi_spi_seg_t* segs, unsigned numSegs) {
+  int i, bytes, len, got;
+  unsigned total, zlen;
+  uint8_t hdr[PI_SPI_MAX_SEGS][6];
+  char* zeros;
+  gpioExtent_t ext[PI_SPI_MAX_SEGS * 2];
+
+  /*
+  p1=numSegs
+  p2=0
+  p3=total header and data bytes
+  ## extension ##
+  per segment: handle, flags, len (2), delay (2), txBuf[len]
+  */
+
+  if(!numSegs || (numSegs > PI_SPI_MAX_SEGS))
+    return PI_BAD_SPI_SEG;
+
+  /* segments without tx data send zeros */
+
+  zlen = 0;
+
+  for(i = 0; i < numSegs; i++) {
+    if(!segs[i].txBuf && (segs[i].len > zlen))
+      zlen = segs[i].len;
+  }
+
+  zeros = NULL;
+
+  if(zlen && !(zeros = calloc(zlen, 1)))
+    return pigif_bad_malloc;
+
+  total = 0;
+
+  for(i = 0; i < numSegs; i++) {
+    hdr[i][0] = segs[i].handle;
+    hdr[i][1] = segs[i].flags;
+    hdr[i][2] = segs[i].len & 0xFF;
+    hdr[i][3] = segs[i].len >> 8;
+    hdr[i][4] = segs[i].delay & 0xFF;
+    hdr[i][5] = segs[i].delay >> 8;
+
+    ext[i * 2].size = 6;
+    ext[i * 2].ptr = hdr[i];
+    ext[(i * 2) + 1].size = segs[i].len;
+    ext[(i * 2) + 1].ptr = segs[i].txBuf ? segs[i].txBuf : zeros;
+
+    total += 6 + segs[i].len;
+  }
+
+  bytes = pigpio_command_ext(pi, PI_CMD_SPISEG, numSegs, 0, total, numSegs * 2, ext, 0);
+
+  free(zeros);
+
+  got = 0;
+
+  for(i = 0; (i < numSegs) && (got < bytes); i++) {
+    len = segs[i].len;
+    if(len > (bytes - got))
+      len = bytes - got;
+
+    recvMax(pi, segs[i].rxBuf, segs[i].rxBuf ? len : 0, len);
+
+    got += len;
+  }
+
+  if((bytes > 0) && (got < bytes))
+    recvMax(pi, NULL, 0, bytes - got);
+
+  _pmu(pi);
+
+  return bytes;
+}
+
 int
 serial_open(int pi, char* dev, unsigned baud, unsigned flags) {
   int len;
@@ -1786,6 +1969,16 @@ serial_data_available(int pi, unsigned handle) {
   return pigpio_command(pi, PI_CMD_SERDA, handle, 0, 1);
 }
 
+int
+serial_rx_event(int pi, unsigned handle, unsigned event) {
+  return pigpio_command(pi, PI_CMD_SERRE, handle, event, 1);
+}
+
+int
+serial_rx_overruns(int pi, unsigned handle) {
+  return pigpio_command(pi, PI_CMD_SEROV, handle, 0, 1);
+}
+
 int
 custom_1(int pi, unsigned arg1, unsigned arg2, char* argx, unsigned count) {
   gpioExtent_t ext[1];
@@ -2073,6 +2266,94 @@ bsc_xfer(int pi, bsc_xfer_t* bscxfer) {
   return status;
 }
 
+int
+bsc_service_open(int pi, uint32_t control) {
+  return pigpio_command(pi, PI_CMD_BSCSO, control, 0, 1);
+}
+
+int
+bsc_service_close(int pi) {
+  return pigpio_command(pi, PI_CMD_BSCSC, 0, 0, 1);
+}
+
+int
+bsc_service_write(int pi, char* buf, unsigned count) {
+  gpioExtent_t ext[1];
+
+  /*
+  p1=0
+  p2=0
+  p3=count
+  ## extension ##
+  char buf[count]
+  */
+
+  ext[0].size = count;
+  ext[0].ptr = buf;
+
+  return pigpio_command_ext(pi, PI_CMD_BSCSW, 0, 0, count, 1, ext, 1);
+}
+
+int
+bsc_service_read(int pi, bscTrans_t* trans, unsigned maxTrans, char* rxBuf, unsigned rxLen) {
+  int bytes, count, i, len;
+
+  /* the daemon reads as much as fits for zero, the caller's buffers can't hold that */
+
+  if(!maxTrans || !rxLen)
+    return 0;
+
+  if(maxTrans > PI_BSC_SERVICE_TRANS)
+    maxTrans = PI_BSC_SERVICE_TRANS;
+
+  count = pigpio_command(pi, PI_CMD_BSCSR, maxTrans, rxLen, 0);
+
+  if(count > 0) {
+    /* count, the transactions, then their received bytes */
+
+    bytes = count;
+
+    if((recvMax(pi, &count, 4, 4) == 4) && (count >= 0) && (count <= maxTrans)) {
+      bytes -= 4;
+      recvMax(pi, trans, count * sizeof(bscTrans_t), count * sizeof(bscTrans_t));
+      bytes -= count * sizeof(bscTrans_t);
+
+      len = 0;
+      for(i = 0; i < count; i++) len += trans[i].rxCnt;
+
+      if((bytes != len) || (recvMax(pi, rxBuf, rxLen, bytes) != len))
+        count = pigif_bad_recv;
+    } else {
+      recvMax(pi, NULL, 0, bytes - 4);
+      count = pigif_bad_recv;
+    }
+  }
+
+  _pmu(pi);
+
+  return count;
+}
+
+int
+bsc_service_stats(int pi, bscServiceStats_t* stats) {
+  int bytes;
+
+  bytes = pigpio_command(pi, PI_CMD_BSCSS, 0, 0, 0);
+
+  if(bytes > 0) {
+    bytes = recvMax(pi, stats, sizeof(bscServiceStats_t), bytes);
+
+    if(bytes == sizeof(bscServiceStats_t))
+      bytes = 0;
+    else
+      bytes = pigif_bad_recv;
+  }
+
+  _pmu(pi);
+
+  return bytes;
+}
+
 int
 bsc_i2c(int pi, int i2c_addr, bsc_xfer_t* bscxfer) {
   int control = 0;
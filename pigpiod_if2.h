@@ -117,6 +117,7 @@ gpio_write                 Write a GPIO
 PWM_(overrides_servo_commands_on_same_GPIO)
 
 set_PWM_dutycycle          Start/stop PWM pulses on a GPIO
+set_PWM_dutycycles         Set the PWM dutycycle of several GPIO at once
 set_PWM_frequency          Configure PWM frequency for a GPIO
 set_PWM_range              Configure PWM range for a GPIO
 
@@ -129,6 +130,7 @@ get_PWM_real_range         Get underlying PWM range for a GPIO
 Servo_(overrides_PWM_commands_on_same_GPIO)
 
 set_servo_pulsewidth       Start/stop servo pulses on a GPIO
+set_servo_pulsewidths      Set the servo pulsewidth of several GPIO at once
 
 get_servo_pulsewidth       Get the servo pulsewidth in use on a GPIO
 
@@ -230,6 +232,8 @@ i2c_process_call           smbus process call
 i2c_block_process_call     smbus block process call
 
 i2c_zip                    Performs multiple I2C transactions
+i2c_zip_async              Queues multiple I2C transactions
+i2c_async_result           Gets a queued I2C transactions result
 
 I2C_BIT_BANG
 
@@ -243,6 +247,12 @@ I2C/SPI_SLAVE
 bsc_xfer                   I2C/SPI as slave transfer
 bsc_i2c                    I2C as slave transfer
 
+bsc_service_open           Opens the buffered BSC slave service
+bsc_service_close          Closes the buffered BSC slave service
+bsc_service_write          Queues bytes for the master to read
+bsc_service_read           Reads completed BSC transactions
+bsc_service_stats          Gets the BSC service counts
+
 SERIAL
 
 serial_open                Opens a serial device
@@ -256,12 +266,18 @@ serial_write               Writes bytes to a serial device
 
 serial_data_available      Returns number of bytes ready to be read
 
+serial_rx_event            Sets an event to trigger when data arrives
+serial_rx_overruns         Returns bytes lost to a full receive buffer
+
 SERIAL_BIT_BANG_(read_only)
 
 bb_serial_read_open        Opens a GPIO for bit bang serial reads
 bb_serial_read_close       Closes a GPIO for bit bang serial reads
 
 bb_serial_invert           Invert serial logic (1 invert, 0 normal)
+bb_serial_parity           Set serial parity (0 none, 1 odd, 2 even)
+
+bb_serial_stats            Gets the frame and error counts
 
 bb_serial_read             Reads bit bang serial data from a GPIO
 
@@ -273,6 +289,7 @@ spi_close                  Closes a SPI device
 spi_read                   Reads bytes from a SPI device
 spi_write                  Writes bytes to a SPI device
 spi_xfer                   Transfers bytes with a SPI device
+spi_segments               Performs multiple SPI transfers
 
 SPI_BIT_BANG
 
@@ -335,6 +352,7 @@ get_current_tick           Get current tick (microseconds)
 
 get_hardware_revision      Get hardware revision
 get_pigpio_version         Get the pigpio version
+get_subsystems             Get the live daemon subsystems
 pigpiod_if_version         Get the pigpiod_if2 version
 
 pigpio_error               Get a text description of an error code.
@@ -554,6 +572,24 @@ The [*set_PWM_range*] function may be used to change the
 default range of 255.
 D*/
 
+/*F*/
+int set_PWM_dutycycles(int pi, unsigned numPairs, gpioPair_t* pairs);
+/*D
+Set the PWM dutycycle of several GPIO at once.
+
+. .
+      pi: >=0 (as returned by [*pigpio_start*]).
+numPairs: the number of pairs.
+   pairs: an array of (GPIO 0-31, dutycycle 0-range) pairs.
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_BAD_DUTYCYCLE,
+or PI_NOT_PERMITTED.
+
+Every pair is checked before any GPIO is changed.  All the GPIO
+switch to their new dutycycles in the same PWM cycle.
+D*/
+
 /*F*/
 int get_PWM_dutycycle(int pi, unsigned user_gpio);
 /*D
@@ -769,6 +805,24 @@ Thereafter use the [*set_PWM_dutycycle*] function to move the servo,
 e.g. set_PWM_dutycycle(25, 1500) will set a 1500 us pulse.
 D*/
 
+/*F*/
+int set_servo_pulsewidths(int pi, unsigned numPairs, gpioPair_t* pairs);
+/*D
+Set the servo pulsewidth of several GPIO at once.
+
+. .
+      pi: >=0 (as returned by [*pigpio_start*]).
+numPairs: the number of pairs.
+   pairs: an array of (GPIO 0-31, pulsewidth 0 or 500-2500) pairs.
+. .
+
+Returns 0 if OK, otherwise PI_BAD_USER_GPIO, PI_BAD_PULSEWIDTH or
+PI_NOT_PERMITTED.
+
+Every pair is checked before any GPIO is changed.  All the servos
+are updated in the same cycle.
+D*/
+
 /*F*/
 int get_servo_pulsewidth(int pi, unsigned user_gpio);
 /*D
@@ -1213,6 +1267,26 @@ pi: >=0 (as returned by [*pigpio_start*]).
 . .
 D*/
 
+/*F*/
+int get_subsystems(int pi);
+/*D
+Returns a bit mask of the daemon subsystems which are running.
+
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
+
+. .
+PI_SUBSYS_DMA   1 DMA memory, sample clock, PWM, servos and waves
+PI_SUBSYS_ALERT 2 alert thread (callbacks, notifications, watchdogs)
+PI_SUBSYS_FIFO  4 pipe interface
+PI_SUBSYS_SOCK  8 socket interface
+. .
+
+If the daemon was started with -o the DMA and alert subsystems only
+start with the first command which needs them.
+D*/
+
 /*F*/
 int wave_clear(int pi);
 /*D
@@ -1533,6 +1607,11 @@ Loop Forever @ 255 3      @ loop forever
 
 If present Loop Forever must be the last entry in the chain.
 
+The whole chain is checked before any current output is stopped.
+Loops run 0 times are removed and loops run once are inlined.  Small
+loops are unrolled, and nested or adjacent loops which can share a
+loop counter do so.  Adjacent delays are merged.
+
 The code is currently dimensioned to support a chain with roughly
 600 entries and 20 loop counters.
 
@@ -1929,6 +2008,41 @@ user_gpio: 0-31, previously opened with [*bb_serial_read_open*].
 Returns 0 if OK, otherwise PI_NOT_SERIAL_GPIO or PI_BAD_SER_INVERT.
 D*/
 
+/*F*/
+int bb_serial_parity(int pi, unsigned user_gpio, unsigned parity);
+/*D
+This function sets the parity for bit bang serial reads.
+
+. .
+       pi: >=0 (as returned by [*pigpio_start*]).
+user_gpio: 0-31, previously opened with [*bb_serial_read_open*].
+   parity: 0-2, 0 none, 1 odd, 2 even.
+. .
+
+Returns 0 if OK, otherwise PI_NOT_SERIAL_GPIO or PI_BAD_SER_PARITY.
+
+Characters with bad parity are still returned by [*bb_serial_read*]
+and are counted by [*bb_serial_stats*].
+D*/
+
+/*F*/
+int bb_serial_stats(int pi, unsigned user_gpio, gpioSerialStats_t* stats);
+/*D
+This function returns the frame and error counts for bit bang
+serial reads.
+
+. .
+       pi: >=0 (as returned by [*pigpio_start*]).
+user_gpio: 0-31, previously opened with [*bb_serial_read_open*].
+    stats: the counts.
+. .
+
+Returns 0 if OK, otherwise PI_NOT_SERIAL_GPIO.
+
+The counts are the characters received, those with a low stop bit,
+those with bad parity, and those lost because the buffer was full.
+D*/
+
 /*F*/
 int i2c_open(int pi, unsigned i2c_bus, unsigned i2c_addr, unsigned i2c_flags);
 /*D
@@ -2376,6 +2490,54 @@ End
 
 D*/
 
+/*F*/
+int i2c_zip_async(int pi, unsigned handle, char* inBuf, unsigned inLen, unsigned outLen, unsigned event);
+/*D
+This function queues the [*i2c_zip*] sequence in inBuf and returns
+at once with a ticket.
+
+. .
+    pi: >=0 (as returned by [*pigpio_start*]).
+handle: >=0, as returned by a call to [*i2c_open*]
+ inBuf: pointer to the concatenated I2C commands
+ inLen: size of command buffer
+outLen: maximum number of read bytes to keep
+ event: 0-31, or PI_I2C_NO_EVENT
+. .
+
+Returns a ticket (0-31) if OK, otherwise PI_BAD_HANDLE,
+PI_BAD_POINTER, PI_BAD_EVENT_ID, or PI_NO_I2C_TICKET.
+
+Sequences for different buses run in parallel, those for the same
+bus run in the order queued.  If event is 0-31 that event is
+triggered when the sequence has finished.
+
+Collect the result with [*i2c_async_result*].
+D*/
+
+/*F*/
+int i2c_async_result(int pi, unsigned ticket, char* outBuf, unsigned outLen, unsigned wait);
+/*D
+This function returns the result of the queued I2C sequence with
+the given ticket.
+
+. .
+    pi: >=0 (as returned by [*pigpio_start*]).
+ticket: as returned by [*i2c_zip_async*]
+outBuf: pointer to buffer to hold returned data
+outLen: size of output buffer
+  wait: 1 to wait for the sequence to finish, otherwise 0
+. .
+
+Returns >= 0 if OK (the number of bytes read), otherwise
+PI_BAD_I2C_TICKET, PI_I2C_PENDING, or any error returned by
+[*i2c_zip*].
+
+If wait is 0 and the sequence has not finished PI_I2C_PENDING is
+returned and the ticket may be polled again.  Otherwise the ticket
+is released.
+D*/
+
 /*F*/
 int bb_i2c_open(int pi, unsigned SDA, unsigned SCL, unsigned baud);
 /*D
@@ -2795,6 +2957,30 @@ Returns the number of bytes transferred if OK, otherwise
 PI_BAD_HANDLE, PI_BAD_SPI_COUNT, or PI_SPI_XFER_FAILED.
 D*/
 
+/*F*/
+int spi_segments(int pi, pi_spi_seg_t* segs, unsigned numSegs);
+/*D
+This function performs a list of SPI transfers as one transaction
+in a single round trip to the daemon.  No other SPI transfer comes
+between the segments.
+
+. .
+     pi: >=0 (as returned by [*pigpio_start*]).
+   segs: an array of SPI segments.
+numSegs: 1-32, the number of segments.
+. .
+
+Returns the total number of bytes transferred if OK, otherwise
+PI_BAD_SPI_SEG, PI_TOO_MANY_SEGS, PI_BAD_HANDLE, or pigif_bad_malloc.
+
+The bytes read in each segment are placed in its rxBuf (if not
+NULL).
+
+If PI_SPI_SEG_CS_HOLD is set the chip select stays asserted after
+the segment so a following segment on the same handle continues
+the same transaction.  The delay is made with chip select held.
+D*/
+
 /*F*/
 int serial_open(int pi, char* ser_tty, unsigned baud, unsigned ser_flags);
 /*D
@@ -2914,6 +3100,40 @@ Returns the number of bytes of data available (>=0) if OK,
 otherwise PI_BAD_HANDLE.
 D*/
 
+/*F*/
+int serial_rx_event(int pi, unsigned handle, unsigned event);
+/*D
+This function sets an event to be triggered whenever data arrives
+on the serial device associated with handle.
+
+. .
+    pi: >=0 (as returned by [*pigpio_start*]).
+handle: >=0, as returned by a call to [*serial_open*].
+ event: 0-31, or PI_SER_NO_EVENT to stop triggering.
+. .
+
+Returns 0 if OK, otherwise PI_BAD_HANDLE or PI_BAD_EVENT_ID.
+
+Use [*event_callback*] or [*wait_for_event*] to learn when data
+is ready rather than polling [*serial_data_available*].
+D*/
+
+/*F*/
+int serial_rx_overruns(int pi, unsigned handle);
+/*D
+This function returns the number of received bytes which were
+discarded, unread, because the receive buffer of the serial device
+associated with handle was full.
+
+. .
+    pi: >=0 (as returned by [*pigpio_start*]).
+handle: >=0, as returned by a call to [*serial_open*].
+. .
+
+Returns the number of bytes discarded since the device was opened
+(>=0) if OK, otherwise PI_BAD_HANDLE.
+D*/
+
 /*F*/
 int custom_1(int pi, unsigned arg1, unsigned arg2, char* argx, unsigned argc);
 /*D
@@ -3636,6 +3856,96 @@ Note that an i2c_address of 0 may be used to close
 the BSC device and reassign the used GPIO as inputs.
 D*/
 
+/*F*/
+int bsc_service_open(int pi, uint32_t control);
+/*D
+This function starts a buffered BSC slave service in the daemon.
+The daemon drains the BSC receive FIFO and refills the transmit
+FIFO every millisecond, so no transfers are missed between calls.
+
+. .
+     pi: >=0 (as returned by [*pigpio_start*]).
+control: the BSC control word, see [*bsc_xfer*].
+. .
+
+Returns 0 if OK, otherwise PI_BAD_PARAM or PI_BSC_SERVICE_OPEN if
+the service is already open.
+
+Activity separated by a millisecond with nothing moved ends a
+transaction.  Completed transactions are queued to be fetched
+with [*bsc_service_read*] and event PI_EVENT_BSC is triggered as
+each one completes.
+
+While the service is open [*bsc_xfer*] fails with
+PI_BSC_SERVICE_OPEN.
+D*/
+
+/*F*/
+int bsc_service_close(int pi);
+/*D
+This function stops the BSC slave service.  Queued transactions
+may still be read.
+
+. .
+pi: >=0 (as returned by [*pigpio_start*]).
+. .
+
+Returns 0 if OK, otherwise PI_BSC_NO_SERVICE.
+D*/
+
+/*F*/
+int bsc_service_write(int pi, char* buf, unsigned count);
+/*D
+This function queues bytes for the master to read from the
+BSC slave.
+
+. .
+   pi: >=0 (as returned by [*pigpio_start*]).
+  buf: the bytes to queue.
+count: the number of bytes.
+. .
+
+Returns the number of bytes queued if OK (less than count if the
+transmit ring is full), otherwise PI_BSC_NO_SERVICE.
+D*/
+
+/*F*/
+int bsc_service_read(int pi, bscTrans_t* trans, unsigned maxTrans, char* rxBuf, unsigned rxLen);
+/*D
+This function removes completed transactions from the BSC slave
+service queue, oldest first.
+
+. .
+      pi: >=0 (as returned by [*pigpio_start*]).
+   trans: an array of at least maxTrans [*bscTrans_t*].
+maxTrans: the most transactions to return.
+   rxBuf: a buffer for the bytes received.
+   rxLen: the size of rxBuf.
+. .
+
+Returns the number of transactions if OK, otherwise pigif_bad_recv.
+
+The bytes received in each transaction are stored one after
+another in rxBuf.  Nothing is read if maxTrans or rxLen is zero.
+
+See [*bscServiceRead*] in the pigpio library documentation for
+the transaction flags.
+D*/
+
+/*F*/
+int bsc_service_stats(int pi, bscServiceStats_t* stats);
+/*D
+This function returns the counts of the BSC slave service since
+it was opened.
+
+. .
+   pi: >=0 (as returned by [*pigpio_start*]).
+stats: the service counts, see [*bscServiceStats_t*].
+. .
+
+Returns 0 if OK, otherwise pigif_bad_recv.
+D*/
+
 /*F*/
 int event_callback(int pi, unsigned event, evtCBFunc_t f);
 /*D
@@ -3785,6 +4095,34 @@ typedef struct
 } bsc_xfer_t;
 . .
 
+bscServiceStats_t::
+
+. .
+typedef struct
+{
+   uint32_t transactions; // transactions completed
+   uint32_t rxBytes;      // bytes received from the master
+   uint32_t txBytes;      // bytes sent to the master
+   uint32_t rxDropped;    // bytes dropped, receive ring full
+   uint32_t fifoOverruns; // receive FIFO overruns
+   uint32_t txUnderruns;  // master reads with no data queued
+   uint32_t transDropped; // transactions dropped, queue full
+} bscServiceStats_t;
+. .
+
+bscTrans_t::
+
+. .
+typedef struct
+{
+   uint32_t tick;    // first activity of the transaction
+   uint32_t endTick; // last activity of the transaction
+   uint16_t rxCnt;   // bytes received from the master
+   uint16_t txCnt;   // bytes sent to the master
+   uint32_t flags;   // PI_BSC_TRANS_x
+} bscTrans_t;
+. .
+
 *bscxfer::
 A pointer to a [*bsc_xfer_t*] object used to control a BSC transfer.
 
@@ -3827,6 +4165,9 @@ A single character, an 8 bit quantity able to store 0-255.
 clkfreq::4689-250M (13184-375M for the BCM2711)
 The hardware clock frequency.
 
+control::
+The BSC control word used by [*bsc_service_open*], see [*bsc_xfer*].
+
 count::
 The number of bytes to be transferred in a file, I2C, SPI, or serial
 command.
@@ -3929,6 +4270,15 @@ Type 2    -  X  X  -  -  -  X  X  X  X  -  X  X  X  X  X
 Type 3    X  X  X  X  X  X  X  X  X  X  X  X  -  -  -  -
 . .
 
+gpioPair_t::
+. .
+typedef struct
+{
+   uint32_t gpio;
+   uint32_t value;
+} gpioPair_t;
+. .
+
 gpioPulse_t::
 . .
 typedef struct
@@ -4001,6 +4351,9 @@ reported as PI_TIMEOUT.  See [*set_watchdog*].
 PI_TIMEOUT 2
 . .
 
+maxTrans::
+The most BSC slave transactions to return.
+
 MISO::
 The GPIO used for the MISO signal when bit banging SPI.
 
@@ -4051,12 +4404,18 @@ The number of bytes used to store characters in a string.  Depending
 on the number of bits per character there may be 1, 2, or 4 bytes
 per character.
 
+numPairs::
+The number of (GPIO, value) pairs in a batch update.
+
 numPar:: 0-10
 The number of parameters passed to a script.
 
 numPulses::
 The number of pulses to be added to a waveform.
 
+numSegs::
+The number of segments in a combined SPI transaction.
+
 offset::
 The associated data starts this number of microseconds from the start of
 the waveform.
@@ -4079,6 +4438,9 @@ padStrength:: 1-16
 The mA which may be drawn from each GPIO whilst still guaranteeing the
 high and low levels.
 
+*pairs::
+An array of (GPIO, value) pairs.
+
 *param::
 An array of script parameters.
 
@@ -4099,6 +4461,19 @@ variable.
 A thread identifier, returned by [*start_thread*].
 
 
+pi_spi_seg_t::
+. .
+typedef struct
+{
+   uint16_t handle; // as returned by spi_open
+   uint16_t flags;  // PI_SPI_SEG_CS_HOLD
+   uint16_t len;    // bytes to transfer
+   uint16_t delay;  // microseconds after transfer
+   char *txBuf;     // data to send, NULL to send zeros
+   char *rxBuf;     // received data, NULL to discard
+} pi_spi_seg_t;
+. .
+
 pthread_t::
 A thread identifier.
 
@@ -4158,6 +4533,9 @@ The maximum number of bytes a user customised function should return.
 *rxBuf::
 A pointer to a buffer to receive data.
 
+rxLen::
+The size in bytes of the receive buffer.
+
 SCL::
 The user GPIO to use for the clock when bit banging I2C.
 
@@ -4195,6 +4573,9 @@ seekOffset::
 The number of bytes to move forward (positive) or backwards (negative)
 from the seek position (start, current, or end of file).
 
+*segs::
+An array of segments which make up a combined SPI transaction.
+
 ser_flags::
 Flags which modify a serial open command.  None are currently defined.
 
@@ -4225,6 +4606,9 @@ to a waveform.
 #define PI_MAX_WAVE_HALFSTOPBITS 8
 . .
 
+*stats::
+A pointer to a [*bscServiceStats_t*] object to receive the counts.
+
 *str::
  An array of characters.
 
@@ -4232,6 +4616,12 @@ thread_func::
 A function of type gpioThreadFunc_t used as the main function of a
 thread.
 
+*trans::
+An array of [*bscTrans_t*] to receive completed BSC transactions.
+
+ticket::0-31
+A ticket returned by [*i2c_zip_async*].
+
 timeout::
 A GPIO watchdog timeout in milliseconds.
 
@@ -4284,6 +4674,9 @@ free(userdata);
 void::
 Denoting no parameter is required
 
+wait::0-1
+Whether to wait for a queued operation to finish.
+
 wave_add_*::
 One of
 
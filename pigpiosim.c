@@ -0,0 +1,505 @@
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/
+
+/*
+This file builds the pigpio library against simulated DMA memory.
+The control blocks made by the wave functions are executed by an
+interpreter instead of the DMA engine.
+*/
+
+#include "pigpio.c"
+
+#include "pigpiosim.h"
+
+/*
+the dma pages appear to the simulated engine at this bus address,
+shuffled by the stride as pages from the pagemap allocator would be
+*/
+
+#define SIM_BUS_BASE 0x10000000
+#define SIM_BUS_STRIDE 97
+
+#define SIM_DMA_CHANNELS 16
+
+#define SIM_GPSET0 (((GPIO_BASE + (GPSET0 * 4)) & 0x00ffffff) | PI_PERI_BUS)
+#define SIM_GPCLR0 (((GPIO_BASE + (GPCLR0 * 4)) & 0x00ffffff) | PI_PERI_BUS)
+#define SIM_GPLEV0 (((GPIO_BASE + (GPLEV0 * 4)) & 0x00ffffff) | PI_PERI_BUS)
+#define SIM_SYSTCLO (((SYST_BASE + (SYST_CLO * 4)) & 0x00ffffff) | PI_PERI_BUS)
+
+static char* simPages = NULL;
+static uint32_t* simRegs = NULL;
+
+static simStats_t simStats;
+
+static uint16_t simSeqno = 0;
+
+static simReportFunc_t simReport = NULL;
+static void* simUserdata = NULL;
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t*
+simBusPtr(uint32_t addr) {
+  int page;
+  uint32_t offset;
+
+  page = dmaOPageFind(addr, &offset);
+
+  if(page < 0)
+    return NULL;
+
+  return (uint32_t*)((char*)dmaOVirt[page] + offset);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+simLevels(uint32_t levels) {
+  gpioReport_t report;
+
+  if(levels == simStats.levels)
+    return;
+
+  simStats.levels = levels;
+  simStats.changes++;
+
+  gpioReg[GPLEV0] = levels;
+
+  if(simReport) {
+    report.seqno = simSeqno++;
+    report.flags = 0;
+    report.tick = simStats.micros;
+    report.level = levels;
+
+    (simReport)(&report, simUserdata);
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t
+simRead(uint32_t addr) {
+  uint32_t* p;
+
+  if(addr == SIM_GPLEV0)
+    return simStats.levels;
+
+  if(addr == SIM_SYSTCLO)
+    return simStats.micros;
+
+  p = simBusPtr(addr);
+
+  if(p)
+    return *p;
+
+  simStats.ignored++;
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+simWrite(uint32_t addr, uint32_t value) {
+  uint32_t* p;
+
+  if(addr == SIM_GPSET0)
+    simLevels(simStats.levels | value);
+  else if(addr == SIM_GPCLR0)
+    simLevels(simStats.levels & ~value);
+  else if((addr == PCM_TIMER) || (addr == PWM_TIMER)) {
+    /* paced writes, the time is accounted for by the caller */
+  } else {
+    p = simBusPtr(addr);
+
+    if(p)
+      *p = value;
+    else
+      simStats.ignored++;
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t
+simNextCB(uint32_t cbAddr) {
+  rawCbs_t* p;
+
+  p = (rawCbs_t*)simBusPtr(cbAddr);
+
+  return p ? p->next : 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t
+simExecCB(uint32_t cbAddr) {
+  rawCbs_t cb, *p;
+  uint32_t src, dst, x, y, xlen, ylen;
+  int s_stride, d_stride;
+
+  p = (rawCbs_t*)simBusPtr(cbAddr);
+
+  if(!p)
+    return 0;
+
+  /* copy first, the cb may be the target of its own transfer */
+
+  cb = *p;
+
+  if(cb.info & DMA_TDMODE) {
+    xlen = cb.length & 0xffff;
+    ylen = cb.length >> 16;
+    s_stride = (int16_t)(cb.stride & 0xffff);
+    d_stride = (int16_t)(cb.stride >> 16);
+  } else {
+    xlen = cb.length;
+    ylen = 1;
+    s_stride = 0;
+    d_stride = 0;
+  }
+
+  src = cb.src;
+  dst = cb.dst;
+
+  for(y = 0; y < ylen; y++) {
+    for(x = 0; x < xlen; x += 4) {
+      if(!(cb.info & DMA_DEST_IGNORE))
+        simWrite(dst, simRead(src));
+
+      if(cb.info & DMA_SRC_INC)
+        src += 4;
+      if(cb.info & DMA_DEST_INC)
+        dst += 4;
+    }
+
+    src += s_stride;
+    dst += d_stride;
+  }
+
+  /* a paced transfer moves one word per tick of the secondary clock */
+
+  if(cb.info & DMA_DEST_DREQ)
+    simStats.micros += (xlen * ylen / BPD) * PI_WF_MICROS;
+
+  simStats.cbs++;
+
+  return cb.next;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+simInitialise(void) {
+  int i;
+
+  DBG(DBG_STARTUP, "");
+
+  if(libInitialised)
+    return PIGPIO_VERSION;
+
+  initClearGlobals();
+
+  /* there is no board, any gpio may be driven */
+
+  if(!gpioMaskSet) {
+    gpioMask = 0xFFFFFFFF;
+    gpioMaskSet = 1;
+  }
+
+  if(gpioCfg.DMAprimaryChannel == PI_DEFAULT_DMA_NOT_SET)
+    gpioCfg.DMAprimaryChannel = PI_DEFAULT_DMA_PRIMARY_CHANNEL;
+
+  if(gpioCfg.DMAsecondaryChannel == PI_DEFAULT_DMA_NOT_SET)
+    gpioCfg.DMAsecondaryChannel = PI_DEFAULT_DMA_SECONDARY_CHANNEL;
+
+  /* one zeroed page for each peripheral, the dma channels share one */
+
+  simRegs = calloc(SIM_DMA_CHANNELS * 0x40 + 6 * (PAGE_SIZE / 4), sizeof(uint32_t));
+  simPages = calloc(DMAO_PAGES, PAGE_SIZE);
+
+  dmaOVirt = calloc(DMAO_PAGES, sizeof(dmaOPage_t*));
+  dmaOBus = calloc(DMAO_PAGES, sizeof(dmaOPage_t*));
+
+  if(!simRegs || !simPages || !dmaOVirt || !dmaOBus) {
+    simTerminate();
+    SOFT_ERROR(PI_INIT_FAILED, "no memory for the simulated dma");
+  }
+
+  for(i = 0; i < DMAO_PAGES; i++) {
+    dmaOVirt[i] = (dmaOPage_t*)(simPages + (i * PAGE_SIZE));
+    dmaOBus[i] = (dmaOPage_t*)(uintptr_t)(SIM_BUS_BASE + (((i * SIM_BUS_STRIDE) % DMAO_PAGES) * PAGE_SIZE));
+  }
+
+  if(dmaPageMapInit() < 0) {
+    simTerminate();
+    return PI_INIT_FAILED;
+  }
+
+  dmaReg = simRegs;
+  gpioReg = simRegs + (SIM_DMA_CHANNELS * 0x40);
+  systReg = gpioReg + (PAGE_SIZE / 4);
+  clkReg = systReg + (PAGE_SIZE / 4);
+  pcmReg = clkReg + (PAGE_SIZE / 4);
+  pwmReg = pcmReg + (PAGE_SIZE / 4);
+  auxReg = pwmReg + (PAGE_SIZE / 4);
+
+  dmaIn = dmaReg + (gpioCfg.DMAprimaryChannel * 0x40);
+  dmaOut = dmaReg + (gpioCfg.DMAsecondaryChannel * 0x40);
+
+  /* the secondary clock needs no setting up */
+
+  waveClockInited = 1;
+
+  memset(&simStats, 0, sizeof(simStats));
+  simSeqno = 0;
+
+  dmaLive = 1;
+
+  libInitialised = 1;
+  runState = PI_RUNNING;
+
+  return PIGPIO_VERSION;
+}
+
+/* ----------------------------------------------------------------------- */
+
+void
+simTerminate(void) {
+  DBG(DBG_STARTUP, "");
+
+  if(waveCompilerRunning) {
+    pthread_cancel(pthWaveCompiler);
+    pthread_join(pthWaveCompiler, NULL);
+    waveCompilerRunning = 0;
+  }
+
+  dmaPageMapFree();
+
+  free(dmaOVirt);
+  free(dmaOBus);
+  free(simPages);
+  free(simRegs);
+
+  dmaOVirt = MAP_FAILED;
+  dmaOBus = MAP_FAILED;
+  simPages = NULL;
+  simRegs = NULL;
+
+  dmaReg = MAP_FAILED;
+  gpioReg = MAP_FAILED;
+  systReg = MAP_FAILED;
+  clkReg = MAP_FAILED;
+  pcmReg = MAP_FAILED;
+  pwmReg = MAP_FAILED;
+  auxReg = MAP_FAILED;
+
+  dmaLive = 0;
+
+  libInitialised = 0;
+  runState = PI_ENDING;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+simRun(uint32_t micros, uint32_t maxCbs, simReportFunc_t f, void* userdata) {
+  uint32_t start, next, cbs;
+
+  DBG(DBG_USER, "micros=%u maxCbs=%u", micros, maxCbs);
+
+  CHECK_INITED;
+
+  simReport = f;
+  simUserdata = userdata;
+
+  start = simStats.micros;
+  cbs = 0;
+
+  while(dmaOut[DMA_CONBLK_AD]) {
+    if(micros && ((simStats.micros - start) >= micros))
+      break;
+
+    if(maxCbs && (cbs >= maxCbs))
+      break;
+
+    pthread_mutex_lock(&waveMutex);
+
+    /* initDMAgo writes the debug register, a fresh start loads the cb */
+
+    if(dmaOut[DMA_DEBUG]) {
+      dmaOut[DMA_DEBUG] = 0;
+      dmaOut[DMA_NEXTCONBK] = simNextCB(dmaOut[DMA_CONBLK_AD]);
+    }
+
+    simExecCB(dmaOut[DMA_CONBLK_AD]);
+
+    /* the next address was latched when the cb was loaded */
+
+    next = dmaOut[DMA_NEXTCONBK];
+
+    dmaOut[DMA_CONBLK_AD] = next;
+    dmaOut[DMA_NEXTCONBK] = simNextCB(next);
+
+    pthread_mutex_unlock(&waveMutex);
+
+    cbs++;
+  }
+
+  if(micros && ((simStats.micros - start) < micros))
+    simStats.micros = start + micros;
+
+  systReg[SYST_CLO] = simStats.micros;
+
+  simReport = NULL;
+  simUserdata = NULL;
+
+  return cbs;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+simDoCommand(uintptr_t* p, unsigned bufSize, char* buf) {
+  CHECK_INITED;
+
+  return myDoCommand(p, bufSize, buf);
+}
+
+/* ----------------------------------------------------------------------- */
+
+void
+simGetStats(simStats_t* stats) {
+  *stats = simStats;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+simSpanCompare(const void* a, const void* b) {
+  return ((waveSpan_t*)a)->start - ((waveSpan_t*)b)->start;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+simSpanCheck(char* what, waveSpan_t* free, int spans, int first, int last, int cbs, uint32_t* largest) {
+  waveSpan_t range[(2 * PI_MAX_WAVES) + 1];
+  int i, n, pos;
+
+  *largest = 0;
+
+  for(i = 0; i < spans; i++) {
+    if(free[i].len <= 0) {
+      DBG(DBG_ALWAYS, "%s free range %d is empty", what, i);
+      return -1;
+    }
+
+    if(i && ((free[i - 1].start + free[i - 1].len) >= free[i].start)) {
+      DBG(DBG_ALWAYS, "%s free ranges %d and %d out of order or not merged", what, i - 1, i);
+      return -1;
+    }
+
+    if(free[i].len > *largest)
+      *largest = free[i].len;
+  }
+
+  /* the live waves and the free ranges must tile the area */
+
+  n = 0;
+
+  for(i = 0; i < waveOutCount; i++) {
+    if(waveInfo[i].deleted)
+      continue;
+
+    if(cbs) {
+      range[n].start = waveInfo[i].botCB;
+      range[n].len = waveInfo[i].numCB;
+    } else {
+      range[n].start = waveInfo[i].botOOL;
+      range[n].len = waveInfo[i].numBOOL + waveInfo[i].numTOOL;
+    }
+
+    if(range[n].len)
+      n++;
+  }
+
+  memcpy(range + n, free, spans * sizeof(waveSpan_t));
+  n += spans;
+
+  qsort(range, n, sizeof(waveSpan_t), simSpanCompare);
+
+  pos = first;
+
+  for(i = 0; i < n; i++) {
+    if(range[i].start != pos) {
+      DBG(DBG_ALWAYS, "%s %d-%d %s", what, pos, range[i].start - 1, (range[i].start > pos) ? "lost" : "used twice");
+      return -1;
+    }
+
+    pos += range[i].len;
+  }
+
+  if(pos != last) {
+    DBG(DBG_ALWAYS, "%s ends at %d not %d", what, pos, last);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+simWaveCheck(simWaveSpace_t* space) {
+  simWaveSpace_t s;
+  int i, status;
+
+  CHECK_INITED;
+
+  pthread_mutex_lock(&waveMutex);
+
+  memset(&s, 0, sizeof(s));
+
+  for(i = 0; i < waveFreeCBs; i++) s.freeCBs += waveFreeCB[i].len;
+  for(i = 0; i < waveFreeOOLs; i++) s.freeOOL += waveFreeOOL[i].len;
+
+  s.spansCB = waveFreeCBs;
+  s.spansOOL = waveFreeOOLs;
+
+  status = simSpanCheck("cb", waveFreeCB, waveFreeCBs, WAVE_FIRST_CB, NUM_WAVE_CBS, 1, &s.largestCBs);
+
+  if(!status)
+    status = simSpanCheck("ool", waveFreeOOL, waveFreeOOLs, WAVE_FIRST_OOL, NUM_WAVE_OOL, 0, &s.largestOOL);
+
+  pthread_mutex_unlock(&waveMutex);
+
+  if(space)
+    *space = s;
+
+  return status;
+}
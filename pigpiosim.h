@@ -0,0 +1,144 @@
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/
+
+#ifndef PIGPIOSIM_H
+#define PIGPIOSIM_H
+
+#include <stdint.h>
+
+#include "pigpio.h"
+
+/*TEXT
+
+pigpiosim is a build of the pigpio library which runs without a
+Raspberry Pi.  The DMA pages are ordinary memory and the DMA engine
+is replaced by an interpreter which executes the control blocks
+built by the wave functions against a virtual microsecond clock.
+
+Only the waveform functions (gpioWave*) are modelled.  GPIO set and
+clear writes, GPIO level and system tick reads, memory to memory
+transfers (used by the chain loop counters) and paced delays are
+executed.  Accesses to other peripherals are counted and ignored.
+
+Level changes are delivered as [*gpioReport_t*] records, the format
+used by the notification pipes, so they may be fed to pig2vcd.
+
+TEXT*/
+
+typedef struct {
+  uint32_t cbs;     /* control blocks executed */
+  uint32_t micros;  /* virtual clock */
+  uint32_t changes; /* level changes reported */
+  uint32_t levels;  /* current GPIO 0-31 levels */
+  uint32_t ignored; /* accesses to peripherals not modelled */
+} simStats_t;
+
+typedef struct {
+  uint32_t freeCBs;    /* wave control blocks free */
+  uint32_t largestCBs; /* largest free control block range */
+  uint32_t spansCB;    /* free control block ranges */
+  uint32_t freeOOL;    /* wave OOL words free */
+  uint32_t largestOOL; /* largest free OOL range */
+  uint32_t spansOOL;   /* free OOL ranges */
+} simWaveSpace_t;
+
+typedef void (*simReportFunc_t)(const gpioReport_t* report, void* userdata);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*F*/
+int simInitialise(void);
+/*D
+Initialises the simulated library.  Call this instead of
+[*gpioInitialise*].  The wave functions may then be used as normal.
+
+Returns the pigpio version number if OK, otherwise PI_INIT_FAILED.
+D*/
+
+/*F*/
+void simTerminate(void);
+/*D
+Releases the simulated DMA memory.
+D*/
+
+/*F*/
+int simRun(uint32_t micros, uint32_t maxCbs, simReportFunc_t f, void* userdata);
+/*D
+Executes the transmitting wave or chain.
+
+. .
+  micros: how far to advance the virtual clock, 0 to run until the
+          DMA stops
+  maxCbs: the most control blocks to execute, 0 for no limit
+       f: called for each level change, may be NULL
+userdata: passed to f
+. .
+
+If the DMA stops before micros have passed the clock is still
+advanced by micros.  A control block which starts before the limit
+completes, so the clock may overshoot.
+
+Returns the number of control blocks executed.
+D*/
+
+/*F*/
+int simDoCommand(uintptr_t* p, unsigned bufSize, char* buf);
+/*D
+Executes a command parsed by cmdParse, as the socket and pipe
+interfaces do.  Only the wave commands are meaningful.
+D*/
+
+/*F*/
+void simGetStats(simStats_t* stats);
+/*D
+Returns the simulator statistics.
+D*/
+
+/*F*/
+int simWaveCheck(simWaveSpace_t* space);
+/*D
+Checks the wave storage allocator and returns the free space.
+
+. .
+space: the free control block and OOL space, may be NULL
+. .
+
+The free ranges must be in order, not empty, and not touch (a
+freed range is merged with its neighbours).  Together with the
+ranges of the live waves they must cover the wave control blocks
+and OOL exactly once.
+
+Returns 0 if OK, otherwise -1.  The first fault found is logged.
+D*/
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -54,6 +54,8 @@ char response_buf[CMD_MAX_EXTENSION];
 
 int printFlags = 0;
 
+char* profSource = NULL; /* script file used to annotate PROCT */
+
 int status = PIGS_OK;
 
 #define SOCKET_OPEN_FAILED -1
@@ -86,13 +88,22 @@ initOpts(int argc, char* argv[]) {
 
   args = 1;
 
-  while((opt = getopt(argc, argv, "ax")) != -1) {
+  while((opt = getopt(argc, argv, "axp:")) != -1) {
     switch(opt) {
       case 'a':
         printFlags |= PRINT_ASCII;
         args++;
         break;
 
+      case 'p':
+        profSource = optarg;
+        /* -p file takes two arguments, -pfile only one */
+        if(optarg == argv[optind - 1])
+          args += 2;
+        else
+          args++;
+        break;
+
       case 'x':
         printFlags |= PRINT_HEX;
         args++;
@@ -104,6 +115,106 @@ initOpts(int argc, char* argv[]) {
   return args;
 }
 
+static void
+printSource(char* text, int len, char* prefix) {
+  /* print text on one line, whitespace collapsed */
+
+  while(len && isspace(text[len - 1])) len--;
+
+  while(len && isspace(*text)) {
+    text++;
+    len--;
+  }
+
+  if(!len)
+    return;
+
+  printf("%s", prefix);
+
+  while(len--) {
+    if(isspace(*text)) {
+      while(len && isspace(text[1])) {
+        text++;
+        len--;
+      }
+      putchar(' ');
+    } else
+      putchar(*text);
+
+    text++;
+  }
+
+  printf("\n");
+}
+
+static void
+annotateProfile(char* script, int len, gpioScriptProf_t* prof, int steps, int* start, int* end) {
+  int i, pos, srcSteps;
+
+  srcSteps = cmdScriptSteps(script, start, end, CMD_MAX_EXTENSION);
+
+  if(srcSteps != steps)
+    report(PIGS_SCRIPT_ERR, "WARNING: %s has %d steps, profile has %d", profSource, srcSteps, steps);
+
+  if(srcSteps > steps)
+    srcSteps = steps;
+
+  printf("%10s %10s %10s %5s\n", "count", "micros", "blocked", "step");
+
+  pos = 0;
+
+  for(i = 0; i < srcSteps; i++) {
+    /* tags are printed on their own line */
+    printSource(script + pos, start[i] - pos, "                                        ");
+
+    printf("%10u %10u %10u %5d ", prof[i].count, prof[i].micros, prof[i].blocked, i);
+
+    printSource(script + start[i], end[i] - start[i], "");
+
+    pos = end[i];
+  }
+
+  printSource(script + pos, len - pos, "                                        ");
+}
+
+static void
+printProfile(gpioScriptProf_t* prof, int steps) {
+  FILE* f;
+  char* script;
+  int *start, *end;
+  int i, len;
+
+  if(!profSource) {
+    for(i = 0; i < steps; i++) printf("%d %u %u %u\n", i, prof[i].count, prof[i].micros, prof[i].blocked);
+    return;
+  }
+
+  f = fopen(profSource, "r");
+
+  if(!f) {
+    report(PIGS_OPTION_ERR, "ERROR: can't open %s", profSource);
+    return;
+  }
+
+  script = malloc(CMD_MAX_EXTENSION);
+  start = malloc(sizeof(int) * CMD_MAX_EXTENSION);
+  end = malloc(sizeof(int) * CMD_MAX_EXTENSION);
+
+  if(script && start && end) {
+    len = fread(script, 1, CMD_MAX_EXTENSION - 1, f);
+    script[len] = 0;
+
+    annotateProfile(script, len, prof, steps, start, end);
+  } else
+    report(PIGS_SCRIPT_ERR, "ERROR: no memory");
+
+  fclose(f);
+
+  free(script);
+  free(start);
+  free(end);
+}
+
 static int
 openSocket(void) {
   int sock, err;
@@ -151,8 +262,9 @@ openSocket(void) {
 
 void
 print_result(int sock, int rv, cmdCmd_t cmd) {
-  int i, r, ch;
+  int i, j, n, r, ch, pos;
   uint32_t* p;
+  bscTrans_t trans;
 
   r = cmd.res;
 
@@ -178,8 +290,8 @@ print_result(int sock, int rv, cmdCmd_t cmd) {
     case 5: printf("%s", cmdUsage); break;
 
     case 6: /*
-               BI2CZ  CF2  FL  FR  I2CPK  I2CRD  I2CRI  I2CRK
-               I2CZ  SERR  SLR  SPIX  SPIR
+               BI2CZ  CF2  FL  FR  I2CAR  I2CPK  I2CRD  I2CRI  I2CRK
+               I2CZ  SERR  SLR  SPISEG  SPIX  SPIR
             */
       printf("%d", r);
       if(r < 0)
@@ -251,6 +363,85 @@ print_result(int sock, int rv, cmdCmd_t cmd) {
       }
       printf("\n");
       break;
+
+    case 9: /* PROCT */
+      if(r < 0) {
+        printf("%d\n", r);
+        report(PIGS_SCRIPT_ERR, "ERROR: %s", cmdErrStr(r));
+        break;
+      }
+
+      printProfile((gpioScriptProf_t*)response_buf, r / sizeof(gpioScriptProf_t));
+      break;
+
+    case 10: /* WVSST */
+      if(r < 0) {
+        printf("%d\n", r);
+        report(PIGS_SCRIPT_ERR, "ERROR: %s", cmdErrStr(r));
+        break;
+      }
+
+      p = (uint32_t*)response_buf;
+      printf("%u %u %u %u %u\n", p[0], p[1], p[2], p[3], p[4]);
+      break;
+
+    case 11: /* SPIST */
+      if(r < 0) {
+        printf("%d\n", r);
+        report(PIGS_SCRIPT_ERR, "ERROR: %s", cmdErrStr(r));
+        break;
+      }
+
+      p = (uint32_t*)response_buf;
+      printf("%u %u %u\n", p[0], p[1], p[2]);
+      break;
+
+    case 12: /* SLRST */
+      if(r < 0) {
+        printf("%d\n", r);
+        report(PIGS_SCRIPT_ERR, "ERROR: %s", cmdErrStr(r));
+        break;
+      }
+
+      p = (uint32_t*)response_buf;
+      printf("%u %u %u %u\n", p[0], p[1], p[2], p[3]);
+      break;
+
+    case 13: /* BSCSR */
+      if(r < 0) {
+        printf("%d\n", r);
+        report(PIGS_SCRIPT_ERR, "ERROR: %s", cmdErrStr(r));
+        break;
+      }
+
+      /* one line per transaction, tick endTick flags txCnt rxCnt bytes */
+
+      memcpy(&n, response_buf, 4);
+      printf("%d\n", n);
+
+      pos = 4 + (n * sizeof(bscTrans_t));
+
+      for(i = 0; i < n; i++) {
+        memcpy(&trans, response_buf + 4 + (i * sizeof(bscTrans_t)), sizeof(bscTrans_t));
+
+        printf("%u %u %u %hu %hu", trans.tick, trans.endTick, trans.flags, trans.txCnt, trans.rxCnt);
+
+        for(j = 0; j < trans.rxCnt; j++) printf(" %hhu", response_buf[pos++]);
+
+        printf("\n");
+      }
+      break;
+
+    case 14: /* BSCSS */
+      if(r < 0) {
+        printf("%d\n", r);
+        report(PIGS_SCRIPT_ERR, "ERROR: %s", cmdErrStr(r));
+        break;
+      }
+
+      p = (uint32_t*)response_buf;
+      printf("%u %u %u %u %u %u %u\n", p[0], p[1], p[2], p[3], p[4], p[5], p[6]);
+      break;
   }
 }
 
@@ -259,20 +450,28 @@ get_extensions(int sock, int command, int res) {
   switch(command) {
     case PI_CMD_BI2CZ:
     case PI_CMD_BSCX:
+    case PI_CMD_BSCSR:
+    case PI_CMD_BSCSS:
     case PI_CMD_BSPIX:
     case PI_CMD_CF2:
     case PI_CMD_FL:
     case PI_CMD_FR:
+    case PI_CMD_I2CAR:
     case PI_CMD_I2CPK:
     case PI_CMD_I2CRD:
     case PI_CMD_I2CRI:
     case PI_CMD_I2CRK:
     case PI_CMD_I2CZ:
     case PI_CMD_PROCP:
+    case PI_CMD_PROCT:
     case PI_CMD_SERR:
     case PI_CMD_SLR:
+    case PI_CMD_SLRST:
     case PI_CMD_SPIX:
     case PI_CMD_SPIR:
+    case PI_CMD_SPISEG:
+    case PI_CMD_WVSST:
+    case PI_CMD_SPIST:
 
       if(res > 0) {
         recv(sock, response_buf, res, MSG_WAITALL);
@@ -0,0 +1,320 @@
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "pigpio.h"
+#include "command.h"
+#include "pigpiosim.h"
+
+/*
+This program runs pigs wave commands against the pigpio DMA
+simulator and writes the GPIO levels the waves produce as a VCD
+understood by GTKWave, or as notification reports for pig2vcd.
+
+pigsim [-r] [-s] [-t micros] [command ...]
+
+The commands are taken from the command line, or from stdin a line
+at a time.  Only the WV commands are simulated.  MICS and MILS let
+the transmitting wave run for the given time.  At the end of the
+input the wave is run until it finishes, or for at most -t micros
+(default 1000000).
+
+-r  write gpioReport_t records instead of a VCD
+-s  report the time taken by each command and the engine statistics
+*/
+
+#define SIM_RUN_CBS 1000
+
+static int rawReports = 0;
+static int showStats = 0;
+
+static uint32_t runLimit = 1000000;
+
+static uint32_t lastLevel = 0;
+
+static char command_buf[CMD_MAX_EXTENSION];
+
+static char rawBuf[sizeof(gpioReport_t) * 256];
+
+/* ----------------------------------------------------------------------- */
+
+static char*
+timeStamp() {
+  static char buf[32];
+
+  struct timeval now;
+  struct tm tmp;
+
+  gettimeofday(&now, NULL);
+
+  localtime_r(&now.tv_sec, &tmp);
+  strftime(buf, sizeof(buf), "%F %T", &tmp);
+
+  return buf;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+symbol(int bit) {
+  if(bit < 26)
+    return ('A' + bit);
+  else
+    return ('a' + bit - 26);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+writeReport(const gpioReport_t* report, void* userdata) {
+  int b;
+  uint32_t changed;
+
+  if(rawReports) {
+    fwrite(report, sizeof(gpioReport_t), 1, stdout);
+    return;
+  }
+
+  /* same layout as pig2vcd */
+
+  printf("#%u\n", report->tick);
+
+  changed = report->level ^ lastLevel;
+  lastLevel = report->level;
+
+  for(b = 0; b < 32; b++) {
+    if(changed & (1 << b))
+      printf("%c%c\n", (report->level & (1 << b)) ? '1' : '0', symbol(b));
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+writeHeader(void) {
+  int b;
+  gpioReport_t report;
+
+  if(rawReports) {
+    /* pig2vcd takes the first report as time zero */
+
+    memset(&report, 0, sizeof(report));
+    writeReport(&report, NULL);
+    return;
+  }
+
+  printf("$date %s $end\n", timeStamp());
+  printf("$version pigsim V1 $end\n");
+  printf("$timescale 1 us $end\n");
+  printf("$scope module top $end\n");
+
+  for(b = 0; b < 32; b++) printf("$var wire 1 %c %d $end\n", symbol(b), b);
+
+  printf("$upscope $end\n");
+  printf("$enddefinitions $end\n");
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t
+simRunMicros(void) {
+  simStats_t stats;
+
+  simGetStats(&stats);
+
+  return stats.micros;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static double
+elapsed(struct timespec* start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return ((now.tv_sec - start->tv_sec) * 1e6) + ((now.tv_nsec - start->tv_nsec) / 1e3);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+printResult(int idx, int res, char* v) {
+  gpioStreamStatus_t* stream;
+
+  if(cmdInfo[idx].rv == 10 && res >= 0) {
+    stream = (gpioStreamStatus_t*)v;
+    fprintf(stderr, "%u %u %u %u %u\n", stream->queued, stream->free, stream->sent, stream->underruns, stream->running);
+  } else if(res < 0)
+    fprintf(stderr, "%d ERROR: %s\n", res, cmdErrStr(res));
+  else if(cmdInfo[idx].rv == 2 || cmdInfo[idx].rv == 4)
+    fprintf(stderr, "%d\n", res);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+doCommands(char* buf) {
+  int idx, res, len;
+  uintptr_t p[CMD_P_ARR];
+  cmdCtlParse_t ctl;
+  char v[CMD_MAX_EXTENSION];
+  struct timespec start;
+  double micros;
+
+  ctl.eaten = 0;
+
+  len = strlen(buf);
+  idx = 0;
+
+  while((idx >= 0) && (ctl.eaten < len)) {
+    if((idx = cmdParse(buf, p, CMD_MAX_EXTENSION, v, &ctl)) >= 0) {
+      if(p[0] == PI_CMD_MICS)
+        simRun(p[1], 0, writeReport, NULL);
+      else if(p[0] == PI_CMD_MILS)
+        simRun(p[1] * 1000, 0, writeReport, NULL);
+      else if(strncmp(cmdInfo[idx].name, "WV", 2))
+        fprintf(stderr, "%s not simulated\n", cmdInfo[idx].name);
+      else {
+        v[p[3]] = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        res = simDoCommand(p, sizeof(v) - 1, v);
+
+        micros = elapsed(&start);
+
+        printResult(idx, res, v);
+
+        if(showStats)
+          fprintf(stderr, "%s took %.1f us\n", cmdInfo[idx].name, micros);
+      }
+    } else
+      fprintf(stderr, "bad command at offset %d\n", ctl.eaten);
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+main(int argc, char* argv[]) {
+  int opt, i, l, pp;
+  uint32_t start;
+  simStats_t stats;
+
+  while((opt = getopt(argc, argv, "rst:")) != -1) {
+    switch(opt) {
+      case 'r': rawReports = 1; break;
+
+      case 's': showStats = 1; break;
+
+      case 't': runLimit = strtoul(optarg, NULL, 0); break;
+
+      default: fprintf(stderr, "usage: pigsim [-r] [-s] [-t micros] [command ...]\n"); exit(1);
+    }
+  }
+
+  /* whole reports per pipe write so pig2vcd never sees a short read */
+
+  if(rawReports)
+    setvbuf(stdout, rawBuf, _IOFBF, sizeof(rawBuf));
+
+  gpioCfgSetInternals(gpioCfgGetInternals() | PI_CFG_NOSIGHANDLER);
+
+  if(simInitialise() < 0) {
+    fprintf(stderr, "simulator initialisation failed\n");
+    exit(1);
+  }
+
+  writeHeader();
+
+  if(optind < argc) {
+    l = 0;
+    pp = 0;
+
+    for(i = optind; i < argc; i++) {
+      l += (strlen(argv[i]) + 1);
+      if(l < sizeof(command_buf)) {
+        sprintf(command_buf + pp, "%s ", argv[i]);
+        pp = l;
+      }
+    }
+
+    if(pp)
+      command_buf[--pp] = 0;
+
+    doCommands(command_buf);
+  } else {
+    while(fgets(command_buf, sizeof(command_buf), stdin)) {
+      l = strlen(command_buf);
+
+      if(l && command_buf[l - 1] == '\n')
+        command_buf[--l] = 0;
+
+      doCommands(command_buf);
+    }
+  }
+
+  /* let the wave run out */
+
+  simGetStats(&stats);
+
+  start = stats.micros;
+
+  while(gpioWaveTxBusy() == 1) {
+    simGetStats(&stats);
+
+    if((stats.micros - start) >= runLimit)
+      break;
+
+    simRun(0, SIM_RUN_CBS, writeReport, NULL);
+
+    if(stats.micros == simRunMicros()) {
+      fprintf(stderr, "DMA looping without delays, stopped\n");
+      break;
+    }
+  }
+
+  fflush(stdout);
+
+  if(showStats) {
+    simGetStats(&stats);
+
+    fprintf(stderr, "cbs=%u micros=%u changes=%u ignored=%u\n", stats.cbs, stats.micros, stats.changes, stats.ignored);
+  }
+
+  simTerminate();
+
+  return 0;
+}
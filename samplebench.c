@@ -0,0 +1,247 @@
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/
+
+/*
+This program benchmarks the extraction of samples from the DMA input
+ring by the alert thread.  It includes the library source and points
+dmaIVirt at pages of ordinary memory filled with made up levels and
+cycle ticks, so it runs on any Linux machine.
+
+samplebench [scale]
+
+scale multiplies the number of passes over the ring, the default is 1.
+
+Each sample is extracted twice, one at a time with a page and slot
+division per sample as the alert thread used to, and in bulk.  The
+results are compared and the time per sample of each is printed.
+*/
+
+#include "pigpio.c"
+
+#define BENCH_BLOCKS 10
+
+static int scale = 1;
+
+static char* benchPages = NULL;
+
+static gpioSample_t refSample[MAX_SAMPLE];
+static uint32_t newTick[MAX_SAMPLE];
+static uint32_t newLevel[MAX_SAMPLE];
+static uint32_t cycleTick[(MAX_SAMPLE / PULSE_PER_CYCLE) + 1];
+
+/* ----------------------------------------------------------------------- */
+
+static double
+now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (ts.tv_sec * 1e9) + ts.tv_nsec;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+fill(void) {
+  int i, page, slot, cycle;
+  uint32_t tick;
+
+  bufferBlocks = BENCH_BLOCKS;
+  bufferCycles = BENCH_BLOCKS * CYCLES_PER_BLOCK;
+  gpioCfg.clockMicros = 5;
+
+  benchPages = calloc(DMAI_PAGES, PAGE_SIZE);
+  dmaIVirt = calloc(DMAI_PAGES, sizeof(dmaIPage_t*));
+
+  for(i = 0; i < DMAI_PAGES; i++) dmaIVirt[i] = (dmaIPage_t*)(benchPages + (i * PAGE_SIZE));
+
+  srandom(1);
+
+  for(i = 0; i < (bufferCycles * PULSE_PER_CYCLE); i++) {
+    myLvsPageSlot(i, &page, &slot);
+    dmaIVirt[page]->level[slot] = random();
+  }
+
+  /* most cycles are on time, some are late or early */
+
+  tick = 1000;
+
+  for(cycle = 0; cycle < bufferCycles; cycle++) {
+    myTckPageSlot(cycle, &page, &slot);
+    dmaIVirt[page]->tick[slot] = tick;
+
+    tick += PULSE_PER_CYCLE * gpioCfg.clockMicros;
+
+    if(!(random() % 8))
+      tick += (random() % 41) - 20;
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+extractRef(uint32_t* oldSlot, int* cycle, uint32_t* sTick) {
+  int numSamples, pulse, page, slot, i, diff, ticks;
+  uint32_t expected, ft;
+
+  /* the per sample extraction, for comparison */
+
+  numSamples = 0;
+  pulse = 0;
+
+  while(numSamples < MAX_SAMPLE) {
+    myLvsPageSlot((*oldSlot)++, &page, &slot);
+
+    refSample[numSamples].tick = *sTick;
+    refSample[numSamples].level = dmaIVirt[page]->level[slot];
+
+    numSamples++;
+
+    *sTick += gpioCfg.clockMicros;
+
+    if(++pulse >= PULSE_PER_CYCLE) {
+      pulse = 0;
+
+      if(++(*cycle) >= bufferCycles) {
+        *cycle = 0;
+        *oldSlot = 0;
+      }
+
+      expected = *sTick;
+
+      *sTick = myGetTick(*cycle);
+
+      diff = *sTick - expected;
+
+      if(abs(diff) > (gpioCfg.clockMicros / 2)) {
+        ft = refSample[numSamples - PULSE_PER_CYCLE].tick;
+
+        ticks = *sTick - ft;
+
+        for(i = 1; i < PULSE_PER_CYCLE; i++) refSample[numSamples - PULSE_PER_CYCLE + i].tick = ((i * ticks) / PULSE_PER_CYCLE) + ft;
+      }
+    }
+  }
+
+  return numSamples;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+extractBulk(uint32_t* oldSlot, int* cycle, uint32_t* sTick) {
+  int numSamples, cycles, run, i;
+
+  /* as pthAlertThread */
+
+  numSamples = 0;
+  cycles = 0;
+  cycleTick[0] = *sTick;
+
+  while(numSamples < MAX_SAMPLE) {
+    run = (bufferCycles * PULSE_PER_CYCLE) - *oldSlot;
+
+    if(run > (MAX_SAMPLE - numSamples))
+      run = MAX_SAMPLE - numSamples;
+
+    myGetLevels(*oldSlot, run, newLevel + numSamples);
+
+    numSamples += run;
+    *oldSlot += run;
+
+    for(i = run / PULSE_PER_CYCLE; i > 0; i--) {
+      if(++(*cycle) >= bufferCycles) {
+        *cycle = 0;
+        *oldSlot = 0;
+      }
+
+      cycleTick[++cycles] = myGetTick(*cycle);
+    }
+  }
+
+  *sTick = cycleTick[cycles];
+
+  alertTicks(cycleTick, cycles, newTick);
+
+  return numSamples;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+main(int argc, char* argv[]) {
+  int i, n, passes, bad, numSamples;
+  uint32_t refSlot, newSlot, refTick, newTick0;
+  int refCycle, newCycle;
+  double start, refNs, newNs;
+
+  if(argc > 1)
+    scale = atoi(argv[1]);
+
+  if(scale < 1)
+    scale = 1;
+
+  fill();
+
+  printf("%d cycles of %d samples in %d pages\n", bufferCycles, PULSE_PER_CYCLE, DMAI_PAGES);
+
+  passes = 2000 * scale;
+
+  refSlot = newSlot = 0;
+  refCycle = newCycle = 0;
+  refTick = newTick0 = myGetTick(0);
+
+  refNs = newNs = 0.0;
+  bad = 0;
+  numSamples = 0;
+
+  for(n = 0; n < passes; n++) {
+    start = now();
+    numSamples += extractRef(&refSlot, &refCycle, &refTick);
+    refNs += now() - start;
+
+    start = now();
+    extractBulk(&newSlot, &newCycle, &newTick0);
+    newNs += now() - start;
+
+    for(i = 0; i < MAX_SAMPLE; i++) {
+      if((refSample[i].tick != newTick[i]) || (refSample[i].level != newLevel[i]))
+        bad++;
+    }
+  }
+
+  printf("%-22s %9s\n", "", "ns/sample");
+  printf("%-22s %9.2f\n", "per sample", refNs / numSamples);
+  printf("%-22s %9.2f\n", "bulk", newNs / numSamples);
+  printf("%d samples, %d differ\n", numSamples, bad);
+
+  free(dmaIVirt);
+  free(benchPages);
+
+  return bad ? 1 : 0;
+}
@@ -0,0 +1,348 @@
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/
+
+/*
+This program checks and benchmarks the bit bang serial decoder.  It
+includes the library source and feeds the alert thread's serial batch
+decoder with made up sample streams, so it runs on any Linux machine.
+
+serialbench [scale]
+
+scale multiplies the number of characters sent, the default is 1.
+
+Each run sends random characters on a number of GPIO at once, with
+random idle gaps and some parity and framing errors.  The levels are
+sampled at the clock rate, compacted into changes as the alert thread
+does, and handed to the decoder in 1 ms batches.  The characters read
+back and the error counts are compared with those sent, and the decode
+time per sample and per character is printed.
+*/
+
+#include "pigpio.c"
+
+#define BATCH_MICROS 1000
+
+typedef struct {
+  int channels;
+  unsigned baud;
+  unsigned dataBits;
+  unsigned parity;
+  unsigned clockMicros;
+} run_t;
+
+static run_t runs[] = {
+    {1, 9600, 8, PI_BB_SER_PARITY_NONE, 5},
+    {8, 19200, 8, PI_BB_SER_PARITY_EVEN, 5},
+    {16, 38400, 7, PI_BB_SER_PARITY_ODD, 5},
+    {32, 57600, 8, PI_BB_SER_PARITY_NONE, 5},
+    {32, 115200, 8, PI_BB_SER_PARITY_EVEN, 2},
+    {16, 250000, 8, PI_BB_SER_PARITY_NONE, 1},
+    {4, 9600, 12, PI_BB_SER_PARITY_ODD, 5},
+};
+
+static int scale = 1;
+
+typedef struct {
+  uint32_t* edge; /* tick of each level change */
+  int edges;
+  int pos;
+  uint32_t* sent;
+  int chars;
+  int read;
+  int framing;
+  int parity;
+  int bad;
+} chan_t;
+
+static chan_t chan[PI_MAX_USER_GPIO + 1];
+
+/* ----------------------------------------------------------------------- */
+
+static double
+now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (ts.tv_sec * 1e9) + ts.tv_nsec;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint32_t
+build(chan_t* c, run_t* r, int chars) {
+  int i, b, level, bits, ones;
+  uint32_t data, mask, tick;
+  int frame[40];
+  double t, bitMicros;
+
+  /* the line idles high, a change is recorded at each level change */
+
+  bitMicros = 1000000.0 / r->baud;
+  mask = (r->dataBits < 32) ? ((1U << r->dataBits) - 1) : 0xFFFFFFFF;
+
+  c->edge = malloc(chars * 40 * sizeof(uint32_t));
+  c->sent = malloc(chars * sizeof(uint32_t));
+  c->edges = 0;
+  c->pos = 0;
+  c->chars = chars;
+  c->read = 0;
+  c->framing = 0;
+  c->parity = 0;
+  c->bad = 0;
+
+  t = 100.0 + (random() % 1000);
+  level = 1;
+
+  for(i = 0; i < chars; i++) {
+    data = random() & mask;
+    c->sent[i] = data;
+
+    bits = 0;
+    frame[bits++] = 0;
+
+    for(b = 0; b < r->dataBits; b++) frame[bits++] = (data >> b) & 1;
+
+    if(r->parity) {
+      ones = __builtin_popcount(data);
+
+      if(r->parity == PI_BB_SER_PARITY_ODD)
+        frame[bits] = !(ones & 1);
+      else
+        frame[bits] = ones & 1;
+
+      if(!(random() % 50)) {
+        frame[bits] = !frame[bits];
+        c->parity++;
+      }
+
+      bits++;
+    }
+
+    frame[bits++] = 1;
+
+    if(!(random() % 50)) {
+      frame[bits - 1] = 0;
+      c->framing++;
+    }
+
+    for(b = 0; b < bits; b++) {
+      if(frame[b] != level) {
+        level = frame[b];
+        c->edge[c->edges++] = t;
+      }
+
+      t += bitMicros;
+    }
+
+    /* back to back, or an idle gap, always one after a framing error */
+
+    if(level == 0) {
+      level = 1;
+      c->edge[c->edges++] = t;
+      t += bitMicros;
+    }
+
+    t += (random() % 4) * bitMicros;
+  }
+
+  tick = t + bitMicros;
+
+  return tick;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+sample(run_t* r, uint32_t from, uint32_t to, uint32_t* level, gpioSample_t* out) {
+  int g, n;
+  uint32_t tick, newLevel;
+  chan_t* c;
+
+  /* levels at each clock tick, kept only when they change */
+
+  n = 0;
+
+  for(tick = from; tick < to; tick += r->clockMicros) {
+    newLevel = *level;
+
+    for(g = 0; g < r->channels; g++) {
+      c = &chan[g];
+
+      while((c->pos < c->edges) && (c->edge[c->pos] <= tick)) {
+        newLevel ^= (1 << g);
+        c->pos++;
+      }
+    }
+
+    if(newLevel != *level) {
+      out[n].tick = tick;
+      out[n].level = newLevel;
+      *level = newLevel;
+      n++;
+    }
+  }
+
+  return n;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+drain(run_t* r, uint32_t* buf) {
+  int g, i, n, bytes;
+  chan_t* c;
+
+  bytes = wfRx[0].s.bytes;
+
+  for(g = 0; g < r->channels; g++) {
+    c = &chan[g];
+
+    while((n = gpioSerialRead(g, buf, SRX_BUF_SIZE)) > 0) {
+      for(i = 0; i < (n / bytes); i++) {
+        if(c->read >= c->chars)
+          c->bad++;
+        else if((bytes == 1) && (((uint8_t*)buf)[i] != c->sent[c->read]))
+          c->bad++;
+        else if((bytes == 2) && (((uint16_t*)buf)[i] != c->sent[c->read]))
+          c->bad++;
+        else if((bytes == 4) && (buf[i] != c->sent[c->read]))
+          c->bad++;
+
+        c->read++;
+      }
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+run(run_t* r) {
+  int g, n, chars, samples, bad;
+  uint32_t tick, end, t, level;
+  gpioSample_t* out;
+  uint32_t* buf;
+  gpioSerialStats_t stats;
+  double start, ns, signal;
+
+  chars = 2000 * scale;
+
+  end = 0;
+
+  for(g = 0; g < r->channels; g++) {
+    t = build(&chan[g], r, chars);
+
+    if(t > end)
+      end = t;
+
+    gpioSerialReadOpen(g, r->baud, r->dataBits);
+    gpioSerialReadParity(g, r->parity);
+  }
+
+  out = malloc(((BATCH_MICROS / r->clockMicros) + 1) * sizeof(gpioSample_t));
+  buf = malloc(SRX_BUF_SIZE);
+
+  level = 0xFFFFFFFF;
+  wfRxSerialLevel = level;
+  samples = 0;
+  ns = 0.0;
+
+  for(tick = 0; tick < end; tick += BATCH_MICROS) {
+    n = sample(r, tick, tick + BATCH_MICROS, &level, out);
+
+    samples += n;
+
+    start = now();
+    waveRxSerialBatch(out, n, tick + BATCH_MICROS);
+    ns += now() - start;
+
+    drain(r, buf);
+  }
+
+  bad = 0;
+
+  for(g = 0; g < r->channels; g++) {
+    gpioSerialReadStats(g, &stats);
+
+    if((chan[g].read != chars) || chan[g].bad || (stats.frames != chars) || (stats.framingErrors != chan[g].framing) || (stats.parityErrors != chan[g].parity) ||
+       stats.overruns) {
+      printf("GPIO %d: read %d of %d (%d wrong), framing %u/%d, parity %u/%d, overruns %u\n", g, chan[g].read, chars, chan[g].bad, stats.framingErrors,
+             chan[g].framing, stats.parityErrors, chan[g].parity, stats.overruns);
+      bad++;
+    }
+
+    gpioSerialReadClose(g);
+
+    free(chan[g].edge);
+    free(chan[g].sent);
+  }
+
+  signal = end * 1000.0;
+
+  printf("%3d %7u %3u %7s %3u %9.2f %9.2f %9.4f%%  %s\n", r->channels, r->baud, r->dataBits,
+         (r->parity == PI_BB_SER_PARITY_NONE)  ? "none"
+         : (r->parity == PI_BB_SER_PARITY_ODD) ? "odd"
+                                               : "even",
+         r->clockMicros, samples ? ns / samples : 0.0, ns / (chars * r->channels), (100.0 * ns) / signal, bad ? "FAIL" : "ok");
+
+  free(out);
+  free(buf);
+
+  return bad;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+main(int argc, char* argv[]) {
+  int i, bad;
+
+  if(argc > 1)
+    scale = atoi(argv[1]);
+
+  if(scale < 1)
+    scale = 1;
+
+  /* nothing touches the hardware, the decoder only sees samples */
+
+  libInitialised = 1;
+  dmaLive = 1;
+  reportedLevel = 0xFFFFFFFF;
+
+  for(i = 0; i <= PI_MAX_USER_GPIO; i++) wfRx[i].mode = PI_WFRX_NONE;
+
+  srandom(1);
+
+  printf("%3s %7s %3s %7s %3s %9s %9s %10s\n", "gpio", "baud", "db", "parity", "clk", "ns/sample", "ns/char", "cpu");
+
+  bad = 0;
+
+  for(i = 0; i < (sizeof(runs) / sizeof(run_t)); i++) bad += run(&runs[i]);
+
+  return bad ? 1 : 0;
+}
@@ -0,0 +1,677 @@
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/
+
+/*
+This program benchmarks the wave functions.  It is built against the
+simulated library (libpigpiosim) so it runs on any Linux machine.
+
+wavebench [scale]
+
+scale multiplies the number of iterations, the default is 1.
+
+The columns are
+
+pulses  pulses in the wave
+ns/p    build time per pulse, adding, merging and creating
+cbs     DMA control blocks in the wave
+cbs/us  control blocks per microsecond of output
+
+The track sections build one wave from several tracks added
+separately, the tracks are merged in one pass at create time.
+
+The first section also checks that a level set again after a delay
+is kept and one repeated at the same instant is dropped.  The churn
+section checks the wave storage free lists after each step.  The
+stream section checks that a segment appended after the engine has
+loaded the end of the stream is restarted rather than lost.  wavebench
+exits with status 1 if any check fails.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "pigpio.h"
+#include "pigpiosim.h"
+
+#define TRACK_PULSES 256
+
+static int scale = 1;
+
+static int quietFd = -1, savedFd = -1;
+
+static int faults = 0;
+
+/* ----------------------------------------------------------------------- */
+
+static double
+now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (ts.tv_sec * 1e9) + ts.tv_nsec;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+quiet(int on) {
+  /* expected failures would otherwise log to stderr */
+
+  fflush(stderr);
+
+  if(on) {
+    savedFd = dup(STDERR_FILENO);
+    quietFd = open("/dev/null", O_WRONLY);
+    dup2(quietFd, STDERR_FILENO);
+  } else {
+    dup2(savedFd, STDERR_FILENO);
+    close(savedFd);
+    close(quietFd);
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+check(char* fault) {
+  printf("FAIL: %s\n", fault);
+
+  faults++;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+heading(char* title) {
+  printf("\n%-22s %7s %9s %7s %9s\n", title, "pulses", "ns/p", "cbs", "cbs/us");
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+row(char* name, int pulses, double ns, int cbs, int micros) {
+  printf("%-22s %7d %9.1f %7d %9.3f\n", name, pulses, pulses ? ns / pulses : 0.0, cbs, micros ? (double)cbs / micros : 0.0);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+t1(void) {
+  static int trackCounts[] = {1, 2, 4, 8, 16, 24};
+  rawWave_t pulses[TRACK_PULSES];
+  char name[32];
+  int i, t, p, n, tracks, wid, cbs, micros, total;
+  double start, ns;
+
+  heading("rawWaveAddGeneric");
+
+  for(i = 0; i < (int)(sizeof(trackCounts) / sizeof(int)); i++) {
+    tracks = trackCounts[i];
+
+    ns = 0;
+    cbs = micros = total = 0;
+
+    for(n = 0; n < scale; n++) {
+      gpioWaveClear();
+
+      start = now();
+
+      /* track t toggles gpio t with a period of 2t+4 micros */
+
+      for(t = 0; t < tracks; t++) {
+        for(p = 0; p < TRACK_PULSES; p++) {
+          pulses[p].gpioOn = (p & 1) ? 0 : (1 << t);
+          pulses[p].gpioOff = (p & 1) ? (1 << t) : 0;
+          pulses[p].usDelay = t + 2;
+          pulses[p].flags = 0;
+        }
+
+        rawWaveAddGeneric(TRACK_PULSES, pulses);
+      }
+
+      total = gpioWaveGetPulses();
+      cbs = gpioWaveGetCbs();
+      micros = gpioWaveGetMicros();
+
+      wid = gpioWaveCreate();
+
+      ns += now() - start;
+
+      if(wid < 0)
+        printf("create failed (%d)\n", wid);
+    }
+
+    sprintf(name, "%d tracks x %d", tracks, TRACK_PULSES);
+    row(name, total, ns / scale, cbs, micros);
+  }
+
+  /* a level set again after a delay must be kept */
+
+  gpioWaveClear();
+
+  for(p = 0; p < 3; p++) {
+    pulses[p].gpioOn = (p < 2) ? (1 << 4) : 0;
+    pulses[p].gpioOff = (p < 2) ? 0 : (1 << 4);
+    pulses[p].usDelay = 10;
+    pulses[p].flags = 0;
+  }
+
+  rawWaveAddGeneric(3, pulses);
+
+  if(gpioWaveGetCbs() != gpioWaveGetRawCbs())
+    check("level set again after a delay was dropped");
+
+  /* the same level set twice at one instant is only needed once */
+
+  gpioWaveClear();
+
+  pulses[0].usDelay = 0;
+
+  rawWaveAddGeneric(2, pulses);
+
+  if(gpioWaveGetCbs() >= gpioWaveGetRawCbs())
+    check("level set twice at one instant was kept");
+
+  gpioWaveClear();
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+t2(void) {
+  static int trackCounts[] = {1, 2, 4, 8, 16, 24};
+  char data[32], name[32];
+  int i, t, n, tracks, wid, pulses, cbs, micros;
+  double start, ns;
+
+  /*
+  each track is a separate 8N1 serial channel on its own gpio, the
+  tracks are merged once when the wave is created so the time per
+  pulse should stay flat as tracks are added
+  */
+
+  heading("serial tracks");
+
+  for(i = 0; i < (int)sizeof(data); i++) data[i] = rand();
+
+  for(i = 0; i < (int)(sizeof(trackCounts) / sizeof(int)); i++) {
+    tracks = trackCounts[i];
+
+    ns = 0;
+    pulses = cbs = micros = 0;
+
+    for(n = 0; n < scale; n++) {
+      gpioWaveClear();
+
+      start = now();
+
+      for(t = 0; t < tracks; t++) gpioWaveAddSerial(t, 9600 + (t * 1200), 8, 2, t * 13, sizeof(data), data);
+
+      pulses = gpioWaveGetPulses();
+      cbs = gpioWaveGetCbs();
+      micros = gpioWaveGetMicros();
+
+      wid = gpioWaveCreate();
+
+      ns += now() - start;
+
+      if(wid < 0)
+        printf("create failed (%d)\n", wid);
+    }
+
+    sprintf(name, "%d tracks x %d", tracks, (int)sizeof(data));
+    row(name, pulses, ns / scale, cbs, micros);
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+t3(void) {
+  static unsigned bauds[] = {50, 110, 300, 1200, 9600, 19200, 38400, 57600, 115200, 250000, 500000, 1000000};
+  char data[64], name[32];
+  int i, n, wid, pulses, cbs, micros;
+  double start, ns;
+
+  heading("gpioWaveAddSerial 8N1");
+
+  for(i = 0; i < (int)sizeof(data); i++) data[i] = rand();
+
+  for(i = 0; i < (int)(sizeof(bauds) / sizeof(unsigned)); i++) {
+    ns = 0;
+    pulses = cbs = micros = 0;
+
+    for(n = 0; n < scale; n++) {
+      gpioWaveClear();
+
+      start = now();
+
+      gpioWaveAddSerial(4, bauds[i], 8, 2, 0, sizeof(data), data);
+
+      pulses = gpioWaveGetPulses();
+      cbs = gpioWaveGetCbs();
+      micros = gpioWaveGetMicros();
+
+      wid = gpioWaveCreate();
+
+      ns += now() - start;
+
+      if(wid < 0)
+        printf("create failed (%d)\n", wid);
+    }
+
+    sprintf(name, "%u baud x %d", bauds[i], (int)sizeof(data));
+    row(name, pulses, ns / scale, cbs, micros);
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+t4(void) {
+  int live[PI_MAX_WAVES];
+  gpioPulse_t pulses[400];
+  int i, p, n, wid, numLive, ops, cbs;
+  int creates, deletes, failures, recovered, compacted;
+  simWaveSpace_t space;
+  double start, ns;
+
+  printf("\ngpioWaveCreate/gpioWaveDelete churn\n");
+
+  gpioWaveClear();
+
+  numLive = 0;
+  creates = deletes = failures = recovered = compacted = 0;
+  ops = 20000 * scale;
+
+  srand(1);
+
+  quiet(1);
+
+  start = now();
+
+  for(i = 0; i < ops; i++) {
+    if(numLive && ((numLive >= (PI_MAX_WAVES / 2)) || (rand() & 1))) {
+      /* delete a random live wave */
+
+      n = rand() % numLive;
+
+      gpioWaveDelete(live[n]);
+
+      live[n] = live[--numLive];
+      deletes++;
+    } else {
+      n = 1 + (rand() % 400);
+
+      for(p = 0; p < n; p++) {
+        pulses[p].gpioOn = (p & 1) ? 0 : (1 << 4);
+        pulses[p].gpioOff = (p & 1) ? (1 << 4) : 0;
+        pulses[p].usDelay = 1 + (rand() % 50);
+      }
+
+      gpioWaveAddGeneric(n, pulses);
+
+      cbs = gpioWaveGetCbs();
+
+      wid = gpioWaveCreate();
+
+      if(wid < 0) {
+        failures++;
+
+        /* free space may just be fragmented */
+
+        if(gpioWaveCompact() >= 0)
+          compacted++;
+
+        /* compacting leaves at most one free range of each at the top */
+
+        if(simWaveCheck(&space) || (space.spansCB > 1) || (space.spansOOL > 1))
+          check("free ranges not packed after compacting");
+
+        /* the pulses are kept when a create fails */
+
+        wid = gpioWaveCreate();
+
+        if(wid >= 0)
+          recovered++;
+        else {
+          if((wid == PI_TOO_MANY_CBS) && (cbs <= space.freeCBs))
+            check("create failed with enough packed cbs");
+
+          gpioWaveClear();
+        }
+      }
+
+      if(wid >= 0) {
+        live[numLive++] = wid;
+        creates++;
+      } else
+        numLive = 0;
+    }
+
+    if(simWaveCheck(NULL)) {
+      check("wave storage inconsistent");
+      break;
+    }
+  }
+
+  ns = now() - start;
+
+  quiet(0);
+
+  /* everything deleted, the free lists must have merged back */
+
+  while(numLive) gpioWaveDelete(live[--numLive]);
+
+  if(simWaveCheck(&space) || (space.spansCB != 1) || (space.spansOOL != 1))
+    check("free ranges not merged after deleting every wave");
+
+  printf("%d ops %.1f ns/op (checked), %d creates %d deletes\n", ops, ns / ops, creates, deletes);
+  printf("%d creates failed, %d compactions, %d recovered by compacting\n", failures, compacted, recovered);
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+t5(void) {
+  gpioPulse_t pulses[2];
+  char chain[64];
+  int i, n, len, wid[4], cbs;
+  double start, ns;
+  simStats_t before, after;
+
+  printf("\ngpioWaveChain, three nested loops\n");
+
+  gpioWaveClear();
+
+  for(i = 0; i < 4; i++) {
+    pulses[0].gpioOn = 1 << i;
+    pulses[0].gpioOff = 0;
+    pulses[0].usDelay = 5 + i;
+    pulses[1].gpioOn = 0;
+    pulses[1].gpioOff = 1 << i;
+    pulses[1].usDelay = 5 + i;
+
+    gpioWaveAddGeneric(2, pulses);
+    wid[i] = gpioWaveCreate();
+  }
+
+  /* loop 20 { w0 loop 30 { w1 loop 40 { w2 } w3 } } */
+
+  len = 0;
+  chain[len++] = 255;
+  chain[len++] = 0;
+  chain[len++] = wid[0];
+  chain[len++] = 255;
+  chain[len++] = 0;
+  chain[len++] = wid[1];
+  chain[len++] = 255;
+  chain[len++] = 0;
+  chain[len++] = wid[2];
+  chain[len++] = 255;
+  chain[len++] = 1;
+  chain[len++] = 40;
+  chain[len++] = 0;
+  chain[len++] = wid[3];
+  chain[len++] = 255;
+  chain[len++] = 1;
+  chain[len++] = 30;
+  chain[len++] = 0;
+  chain[len++] = 255;
+  chain[len++] = 1;
+  chain[len++] = 20;
+  chain[len++] = 0;
+
+  n = 10000 * scale;
+
+  start = now();
+
+  for(i = 0; i < n; i++) gpioWaveChain(chain, len);
+
+  ns = now() - start;
+
+  printf("%d bytes %.1f ns/chain\n", len, ns / n);
+
+  /* run the last one to see what it costs the DMA engine */
+
+  simGetStats(&before);
+
+  while(gpioWaveTxBusy() == 1) simRun(0, 100000, NULL, NULL);
+
+  simGetStats(&after);
+
+  cbs = after.cbs - before.cbs;
+
+  printf("%u micros of output from %d cbs, %.3f cbs/us\n", after.micros - before.micros, cbs, (double)cbs / (after.micros - before.micros));
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+t6(void) {
+  static gpioPulse_t pulses[4000];
+  int i, j, n, wid, at, positions, bad, cbs;
+  double start, ns;
+
+  printf("\ngpioWaveTxAt, control block lookup\n");
+
+  gpioWaveClear();
+
+  for(i = 0; i < 4000; i += 2) {
+    pulses[i].gpioOn = 1 << (i % 8);
+    pulses[i].gpioOff = 0;
+    pulses[i].usDelay = 3;
+    pulses[i + 1].gpioOn = 0;
+    pulses[i + 1].gpioOff = 1 << (i % 8);
+    pulses[i + 1].usDelay = 3;
+  }
+
+  gpioWaveAddGeneric(4000, pulses);
+
+  cbs = gpioWaveGetCbs();
+
+  wid = gpioWaveCreate();
+
+  if(wid < 0) {
+    printf("wave create failed (%d)\n", wid);
+    return;
+  }
+
+  gpioWaveTxSend(wid, PI_WAVE_MODE_REPEAT);
+
+  /* sample the lookup at positions spread over the wave's pages */
+
+  positions = 0;
+  bad = 0;
+  ns = 0.0;
+  n = 1000 * scale;
+
+  for(i = 0; i < 64; i++) {
+    simRun(0, 97, NULL, NULL);
+
+    at = -1;
+
+    start = now();
+
+    for(j = 0; j < n; j++) at = gpioWaveTxAt();
+
+    ns += now() - start;
+
+    if(at != wid)
+      bad++;
+
+    positions++;
+  }
+
+  printf("%d cbs %d positions %.1f ns/lookup %d wrong\n", cbs, positions, ns / (positions * n), bad);
+
+  gpioWaveTxStop();
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+segment(int gpio) {
+  gpioPulse_t pulses[2];
+
+  pulses[0].gpioOn = 1 << gpio;
+  pulses[0].gpioOff = 0;
+  pulses[0].usDelay = 10;
+  pulses[1].gpioOn = 0;
+  pulses[1].gpioOff = 1 << gpio;
+  pulses[1].usDelay = 10;
+
+  gpioWaveAddGeneric(2, pulses);
+
+  return gpioWaveStreamAppend();
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+t7(void) {
+  gpioStreamStatus_t status;
+  simStats_t before, after;
+  uint32_t cbs;
+  int i;
+
+  printf("\ngpioWaveStream, segment links\n");
+
+  gpioWaveClear();
+
+  /* one segment alone gives the control blocks it runs */
+
+  gpioWaveStreamOpen(4);
+
+  simGetStats(&before);
+
+  segment(0);
+
+  while(simRun(0, 100000, NULL, NULL)) {
+  }
+
+  simGetStats(&after);
+
+  cbs = after.cbs - before.cbs;
+
+  /* segments appended while the first runs are linked in time */
+
+  gpioWaveStreamOpen(4);
+
+  simGetStats(&before);
+
+  for(i = 0; i < 3; i++) segment(i);
+
+  while(simRun(0, 100000, NULL, NULL)) {
+  }
+
+  simGetStats(&after);
+
+  gpioWaveStreamStatus(&status);
+
+  printf("linked in time, %u sent %u underruns %u changes\n", status.sent, status.underruns, after.changes - before.changes);
+
+  if((status.sent != 3) || (status.underruns != 1) || ((after.changes - before.changes) != 6))
+    check("linked segments not all sent");
+
+  /* stop on the end block so the engine has latched a null next */
+
+  gpioWaveStreamOpen(4);
+
+  simGetStats(&before);
+
+  segment(0);
+
+  simRun(0, cbs - 1, NULL, NULL);
+
+  segment(1);
+
+  while(simRun(0, 100000, NULL, NULL)) {
+  }
+
+  gpioWaveStreamStatus(&status);
+
+  if((status.sent != 1) || (status.queued != 1))
+    check("segment after a missed link counted as sent");
+
+  while(simRun(0, 100000, NULL, NULL)) {
+  }
+
+  simGetStats(&after);
+
+  gpioWaveStreamStatus(&status);
+
+  printf("link missed, %u sent %u underruns %u changes\n", status.sent, status.underruns, after.changes - before.changes);
+
+  if((status.sent != 2) || (status.underruns != 2) || ((after.changes - before.changes) != 4))
+    check("segment after a missed link not restarted");
+
+  gpioWaveStreamClose();
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+main(int argc, char* argv[]) {
+  struct rusage usage;
+
+  if(argc > 1)
+    scale = atoi(argv[1]);
+
+  if(scale < 1)
+    scale = 1;
+
+  if(simInitialise() < 0) {
+    fprintf(stderr, "simulator initialisation failed\n");
+    return 1;
+  }
+
+  printf("pigpio version %d, simulated DMA\n", gpioVersion());
+
+  t1();
+  t2();
+  t3();
+  t4();
+  t5();
+  t6();
+  t7();
+
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("\nmax resident %ld kB\n", usage.ru_maxrss);
+
+  simTerminate();
+
+  return faults ? 1 : 0;
+}
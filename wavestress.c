@@ -0,0 +1,441 @@
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or
+distribute this software, either in source code form or as a compiled
+binary, for any purpose, commercial or non-commercial, and by any
+means.
+
+In jurisdictions that recognize copyright laws, the author or authors
+of this software dedicate any and all copyright interest in the
+software to the public domain. We make this dedication for the benefit
+of the public at large and to the detriment of our heirs and
+successors. We intend this dedication to be an overt act of
+relinquishment in perpetuity of all present and future rights to this
+software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <http://unlicense.org/>
+*/
+
+/*
+This program stress tests the wave storage allocator.  It includes
+the library source and gives the wave functions pages of ordinary
+memory at bus addresses with holes between them, so it runs on any
+Linux machine.
+Nothing is transmitted.
+
+wavestress [steps [seed]]
+
+Waves of random sizes are created and deleted in random order, the
+default is 20000 steps.  After each step the free control block and
+OOL ranges must be ordered and merged, and together with the live
+waves must cover each area exactly once.
+
+A create which fails for want of space compacts the store and is
+retried.  Compaction must leave one free range of each kind, every
+wave must keep its control block graph, and the retry may only fail
+if the packed space is really too small.
+
+wavestress exits with status 1 if any check fails.
+*/
+
+#include "pigpio.c"
+
+#define STRESS_BUS_BASE 0x10000000
+#define STRESS_IBUS_BASE 0x08000000
+
+/* pages are a hole apart on the bus, the source stride of a two beat
+   cb is 16 bits so must span the hole */
+
+#define STRESS_BUS_STRIDE 3
+
+#define STRESS_MAX_PULSES 200
+
+#define STRESS_CB 1
+#define STRESS_OOL 2
+
+typedef struct {
+  uint32_t info;
+  uint32_t length;
+  uint64_t src;
+  uint64_t dst;
+  uint64_t next;
+  uint64_t src2; /* second row source of a 2D transfer */
+} stressCB_t;
+
+static char* stressPages = NULL;
+static uint32_t stressRegs[0x40];
+
+static stressCB_t* graph[PI_MAX_WAVES];
+static int graphCBs[PI_MAX_WAVES];
+
+static int faults = 0;
+
+/* ----------------------------------------------------------------------- */
+
+static void
+check(char* fault, int step) {
+  printf("FAIL: %s at step %d\n", fault, step);
+
+  faults++;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+stressInit(void) {
+  int i;
+
+  stressPages = calloc(DMAO_PAGES, PAGE_SIZE);
+
+  dmaOVirt = calloc(DMAO_PAGES, sizeof(dmaOPage_t*));
+  dmaOBus = calloc(DMAO_PAGES, sizeof(dmaOPage_t*));
+  dmaIBus = calloc(DMAI_PAGES, sizeof(dmaIPage_t*));
+
+  if(!stressPages || !dmaOVirt || !dmaOBus || !dmaIBus)
+    return -1;
+
+  /* the input pages are only hashed, never touched */
+
+  for(i = 0; i < DMAI_PAGES; i++)
+    dmaIBus[i] = (dmaIPage_t*)(uintptr_t)(STRESS_IBUS_BASE + (i * PAGE_SIZE));
+
+  for(i = 0; i < DMAO_PAGES; i++) {
+    dmaOVirt[i] = (dmaOPage_t*)(stressPages + (i * PAGE_SIZE));
+    dmaOBus[i] = (dmaOPage_t*)(uintptr_t)(STRESS_BUS_BASE + (i * STRESS_BUS_STRIDE * PAGE_SIZE));
+  }
+
+  if(dmaPageMapInit() < 0)
+    return -1;
+
+  /* an idle secondary channel, compaction checks it */
+
+  dmaOut = stressRegs;
+
+  dmaLive = 1;
+
+  libInitialised = 1;
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static uint64_t
+stressWhere(uint32_t addr, rawWaveInfo_t* w) {
+  int page, pos;
+  uint32_t offset;
+
+  /* a bus address in the wave's own storage, relative to the wave */
+
+  if((addr < STRESS_BUS_BASE) || (addr >= (STRESS_BUS_BASE + (DMAO_PAGES * STRESS_BUS_STRIDE * PAGE_SIZE))))
+    return addr;
+
+  page = (addr - STRESS_BUS_BASE) / PAGE_SIZE;
+
+  if(page % STRESS_BUS_STRIDE)
+    return addr;
+
+  page /= STRESS_BUS_STRIDE;
+  offset = (addr - STRESS_BUS_BASE) % PAGE_SIZE;
+
+  if(offset < offsetof(dmaOPage_t, OOL)) {
+    pos = (page * CBS_PER_OPAGE) + (offset / sizeof(rawCbs_t));
+
+    if((pos >= w->botCB) && (pos <= w->topCB))
+      return ((uint64_t)STRESS_CB << 32) | (pos - w->botCB);
+  } else if(offset < offsetof(dmaOPage_t, periphData)) {
+    pos = (page * OOL_PER_OPAGE) + ((offset - offsetof(dmaOPage_t, OOL)) / sizeof(uint32_t));
+
+    if((pos >= w->botOOL) && (pos < w->topOOL))
+      return ((uint64_t)STRESS_OOL << 32) | (pos - w->botOOL);
+  } else {
+    /* the paced delays write a fixed word */
+
+    return addr;
+  }
+
+  /* storage of another wave */
+
+  return ~(uint64_t)0;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+stressGraph(int wid, stressCB_t* g) {
+  rawWaveInfo_t* w;
+  rawCbs_t* p;
+  int i, n;
+
+  /* the cbs reachable from the first, padding is never written */
+
+  w = &waveInfo[wid];
+
+  i = 0;
+
+  for(n = 0; n < w->numCB; n++) {
+    p = rawWaveCBAdr(w->botCB + i);
+
+    g[n].info = p->info;
+    g[n].length = p->length;
+    g[n].src = stressWhere(p->src, w);
+    g[n].dst = stressWhere(p->dst, w);
+    g[n].next = stressWhere(p->next, w);
+
+    if(p->info & DMA_TDMODE)
+      g[n].src2 = stressWhere(p->src + (int16_t)(p->stride & 0xffff), w);
+    else
+      g[n].src2 = 0;
+
+    if((g[n].next >> 32) != STRESS_CB)
+      return n + 1;
+
+    i = g[n].next & 0xffffffff;
+  }
+
+  return n;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+stressSpans(waveSpan_t* free, int spans, int first, int last, int cbs) {
+  static waveSpan_t range[(2 * PI_MAX_WAVES) + 1];
+  waveSpan_t t;
+  int i, j, n, pos;
+
+  for(i = 0; i < spans; i++) {
+    if(free[i].len <= 0)
+      return -1;
+
+    if(i && ((free[i - 1].start + free[i - 1].len) >= free[i].start))
+      return -1;
+  }
+
+  /* the free ranges and the live waves must tile the area */
+
+  n = 0;
+
+  for(i = 0; i < spans; i++) range[n++] = free[i];
+
+  for(i = 0; i < waveOutCount; i++) {
+    if(waveInfo[i].deleted)
+      continue;
+
+    if(cbs) {
+      range[n].start = waveInfo[i].botCB;
+      range[n].len = waveInfo[i].numCB;
+    } else {
+      range[n].start = waveInfo[i].botOOL;
+      range[n].len = waveInfo[i].numBOOL + waveInfo[i].numTOOL;
+    }
+
+    if(range[n].len)
+      n++;
+  }
+
+  for(i = 1; i < n; i++) {
+    t = range[i];
+
+    for(j = i; (j > 0) && (range[j - 1].start > t.start); j--) range[j] = range[j - 1];
+
+    range[j] = t;
+  }
+
+  pos = first;
+
+  for(i = 0; i < n; i++) {
+    if(range[i].start != pos)
+      return -1;
+
+    pos += range[i].len;
+  }
+
+  return (pos == last) ? 0 : -1;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+stressFree(waveSpan_t* free, int spans) {
+  int i, total;
+
+  total = 0;
+
+  for(i = 0; i < spans; i++) total += free[i].len;
+
+  return total;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+stressPulses(gpioPulse_t* pulses) {
+  int i, n, kind;
+
+  n = 1 + (random() % STRESS_MAX_PULSES);
+
+  /* sets, clears, both (a two beat cb with an ool pair) or neither */
+
+  for(i = 0; i < n; i++) {
+    kind = random() % 4;
+
+    pulses[i].gpioOn = (kind & 1) ? (1 << (i % 28)) : 0;
+    pulses[i].gpioOff = (kind & 2) ? (1 << ((i + 1) % 28)) : 0;
+    pulses[i].usDelay = 1 + (random() % 100);
+  }
+
+  return n;
+}
+
+/* ----------------------------------------------------------------------- */
+
+static int
+stressCreate(gpioPulse_t* pulses, int n, int* pad) {
+  gpioWaveAddNew();
+  gpioWaveAddGeneric(n, pulses);
+
+  if(pad[0])
+    return gpioWaveCreatePad(pad[0], pad[1], pad[2]);
+
+  return gpioWaveCreate();
+}
+
+/* ----------------------------------------------------------------------- */
+
+static void
+stressCompact(int step, int* moved) {
+  stressCB_t* g;
+  int wid, n;
+
+  n = gpioWaveCompact();
+
+  if(n < 0) {
+    check("compaction refused", step);
+    return;
+  }
+
+  *moved += n;
+
+  if((waveFreeCBs > 1) || (waveFreeOOLs > 1))
+    check("compaction left several free ranges", step);
+
+  for(wid = 0; wid < waveOutCount; wid++) {
+    if(waveInfo[wid].deleted)
+      continue;
+
+    g = malloc(waveInfo[wid].numCB * sizeof(stressCB_t));
+
+    if((stressGraph(wid, g) != graphCBs[wid]) || memcmp(g, graph[wid], graphCBs[wid] * sizeof(stressCB_t)))
+      check("moved wave changed its control block graph", step);
+
+    free(g);
+  }
+}
+
+/* ----------------------------------------------------------------------- */
+
+int
+main(int argc, char* argv[]) {
+  gpioPulse_t pulses[STRESS_MAX_PULSES];
+  int steps, step, wid, n, pad[3], live, creates, deletes, failed, compactions, moved;
+
+  steps = (argc > 1) ? atoi(argv[1]) : 20000;
+
+  srandom((argc > 2) ? atoi(argv[2]) : 1);
+
+  if(stressInit() < 0) {
+    fprintf(stderr, "no memory for the wave pages\n");
+    return 1;
+  }
+
+  live = 0;
+  creates = 0;
+  deletes = 0;
+  failed = 0;
+  compactions = 0;
+  moved = 0;
+
+  for(step = 0; step < steps; step++) {
+    if((live < PI_MAX_WAVES) && (!live || (random() % 2))) {
+      n = stressPulses(pulses);
+
+      /* one create in eight is padded, percentages of each area */
+
+      pad[0] = (random() % 8) ? 0 : 1 + (random() % 3);
+      pad[1] = 1 + (random() % 3);
+      pad[2] = random() % 2;
+
+      wid = stressCreate(pulses, n, pad);
+
+      if((wid == PI_TOO_MANY_CBS) || (wid == PI_TOO_MANY_OOL)) {
+        stressCompact(step, &moved);
+
+        compactions++;
+
+        /* the same wave again, now against packed storage, it needs
+           one cb more than counted for the delay at the start */
+
+        wid = stressCreate(pulses, n, pad);
+
+        if((wid == PI_TOO_MANY_CBS) && !pad[0] && (gpioWaveGetCbs() < stressFree(waveFreeCB, waveFreeCBs)))
+          check("create failed with enough packed cbs", step);
+      }
+
+      if(wid >= 0) {
+        graph[wid] = malloc(waveInfo[wid].numCB * sizeof(stressCB_t));
+
+        graphCBs[wid] = stressGraph(wid, graph[wid]);
+
+        live++;
+        creates++;
+      } else
+        failed++;
+    } else {
+      do {
+        wid = random() % waveOutCount;
+      } while(waveInfo[wid].deleted);
+
+      gpioWaveDelete(wid);
+
+      free(graph[wid]);
+      graph[wid] = NULL;
+
+      live--;
+      deletes++;
+    }
+
+    if(stressSpans(waveFreeCB, waveFreeCBs, WAVE_FIRST_CB, NUM_WAVE_CBS, 1))
+      check("cb free ranges do not tile the area", step);
+
+    if(stressSpans(waveFreeOOL, waveFreeOOLs, WAVE_FIRST_OOL, NUM_WAVE_OOL, 0))
+      check("OOL free ranges do not tile the area", step);
+
+    if(faults > 10)
+      break;
+  }
+
+  for(wid = 0; wid < waveOutCount; wid++) {
+    if(!waveInfo[wid].deleted) {
+      gpioWaveDelete(wid);
+      free(graph[wid]);
+    }
+  }
+
+  if((waveFreeCBs != 1) || (waveFreeCB[0].len != (NUM_WAVE_CBS - WAVE_FIRST_CB)) || (waveFreeOOLs != 1) || (waveFreeOOL[0].len != (NUM_WAVE_OOL - WAVE_FIRST_OOL)))
+    check("free ranges not merged back into one", step);
+
+  printf("%d steps, %d creates %d deletes %d failed\n", step, creates, deletes, failed);
+  printf("%d compactions, %d waves moved\n", compactions, moved);
+
+  return faults ? 1 : 0;
+}
@@ -24,6 +24,7 @@ sudo ./x_pigpio
 #include <ctype.h>
 
 #include "pigpio.h"
+#include "command.h"
 
 #define USERDATA 18249013
 
@@ -620,6 +621,47 @@ t9cbf(int gpio, int level, uint32_t tick) {
     t9_count++;
 }
 
+int
+t9_image(char* script) {
+  cmdScript_t s, r;
+  char* image;
+  int i, j, size, same;
+
+  /* compiled form written by gpioCfgScriptDir, returns 1 if it loads back the same */
+
+  if(cmdParseScript(script, &s, 0))
+    return 0;
+
+  size = cmdScriptImageSize(&s);
+  image = malloc(size);
+  cmdScriptToImage(&s, image, size);
+
+  same = 0;
+
+  if(!cmdScriptFromImage(image, size, &r)) {
+    same = (r.instrs == s.instrs);
+
+    for(i = 0; same && (i < s.instrs); i++) {
+      for(j = 0; j < 4; j++)
+        if(r.instr[i].p[j] != s.instr[i].p[j])
+          same = 0;
+
+      if(memcmp(r.instr[i].opt, s.instr[i].opt, sizeof(s.instr[i].opt)))
+        same = 0;
+
+      if(s.instr[i].p[3] && strcmp((char*)r.instr[i].p[4], (char*)s.instr[i].p[4]))
+        same = 0;
+    }
+
+    free(r.par);
+  }
+
+  free(image);
+  free(s.par);
+
+  return same;
+}
+
 void
 t9() {
   int s, oc, c, e;
@@ -700,6 +742,14 @@ t9() {
 
   e = gpioDeleteScript(s);
   CHECK(9, 4, e, 0, 0, "delete script");
+
+  c = t9_image(script);
+  CHECK(9, 5, c, 1, 0, "script image round trip");
+
+  /* jz 2 jumps to the tag after the last instruction */
+
+  c = t9_image("ld v0 10 tag 1 dcr v0 jz 2 jmp 1 tag 2");
+  CHECK(9, 6, c, 1, 0, "script image round trip, trailing tag");
 }
 
 void